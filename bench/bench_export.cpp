@@ -0,0 +1,48 @@
+// Export encoding cost per point: remote write and OTLP into a reused
+// buffer, then Snappy over the encoded batch, for a 20k-series host.
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "bench_util.hpp"
+#include "sysapm/exporter.hpp"
+
+using namespace sysapm;
+using namespace sysapm::bench;
+
+int main() {
+  constexpr int kSeries = 20000;
+  SeriesRegistry reg;
+  std::vector<Sample> batch;
+  for (int i = 0; i < kSeries; ++i) {
+    const std::string pid = std::to_string(1000 + i / 10), field = "f" + std::to_string(i % 10);
+    const uint32_t id = reg.intern("process_stat", {{"pid", pid}, {"field", field}, {"host", "web-17"}});
+    batch.push_back(i % 3 ? Sample::make_counter(1700000000000000000 + i, id, static_cast<uint64_t>(i) * 977)
+                          : Sample::make_gauge(1700000000000000000 + i, id, i * 0.5));
+  }
+
+  char line[256];
+  std::vector<uint8_t> buf, z;
+  SnappyCompressor snappy;
+  for (ExportFormat f : {ExportFormat::kRemoteWrite, ExportFormat::kOtlp}) {
+    const char* name = f == ExportFormat::kOtlp ? "otlp" : "remote_write";
+    ExportEncoder enc(f, &reg);
+    std::size_t at = 0;
+    double ns = time_per_call(
+        [&] {
+          enc.begin(&buf);
+          for (const Sample& s : batch) enc.add(s);
+          at = enc.finish();
+          do_not_optimize(buf.data());
+        },
+        300000000);
+    std::snprintf(line, sizeof line, "export encode %s %.1f ns/point (%.1f B/point)", name, ns / kSeries,
+                  static_cast<double>(buf.size() - at) / kSeries);
+    report(line);
+    ns = time_per_call([&] { snappy.compress(buf.data() + at, buf.size() - at, &z); }, 300000000);
+    std::snprintf(line, sizeof line, "export snappy %s %.1f ns/point (%.1f B/point, %.1fx)", name, ns / kSeries,
+                  static_cast<double>(z.size()) / kSeries, static_cast<double>(buf.size() - at) / z.size());
+    report(line);
+  }
+  return 0;
+}
@@ -0,0 +1,272 @@
+// Whole-agent cost per tick on recorded hosts: every collector main()
+// runs, replayed against bench/fixtures/<host> (8, 64 and 256 cores).
+// For each host it reports tick latency, heap allocations per tick, what
+// a sample costs in the store after a run of ticks, and remote-write
+// encode throughput over the tick's samples.
+//
+// A fixture is a /proc and /sys/fs/cgroup tree plus a manifest giving the
+// number of processes and cgroups the host had; the replay copies the
+// tree to a scratch directory and clones the recorded pid and cgroup
+// directories up to those counts. capture.sh records a live host.
+//
+// Results are `fixture <metric> <value> <tags>` lines, one metric each,
+// so a regression gate can diff them against a baseline run.
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bench_util.hpp"
+#include "sysapm/cgroup_collector.hpp"
+#include "sysapm/chunk_store.hpp"
+#include "sysapm/exporter.hpp"
+#include "sysapm/host_collectors.hpp"
+
+using namespace sysapm;
+using namespace sysapm::bench;
+namespace fs = std::filesystem;
+
+namespace {
+
+std::atomic<uint64_t> g_allocs{0};
+std::atomic<uint64_t> g_alloc_bytes{0};
+
+}  // namespace
+
+// Every allocation the collectors make goes through here.
+void* operator new(std::size_t n) {
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  g_alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+  if (void* p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+constexpr int64_t kSec = 1000000000;
+constexpr int kStoreTicks = 720;  // 12 minutes at 1s
+
+struct Manifest {
+  unsigned cpus = 0;
+  std::size_t processes = 0;
+  std::size_t cgroups = 0;
+};
+
+Manifest read_manifest(const fs::path& dir) {
+  Manifest m;
+  std::ifstream in(dir / "manifest");
+  std::string key;
+  std::size_t v;
+  while (in >> key) {
+    if (key[0] == '#') {
+      std::getline(in, key);
+      continue;
+    }
+    if (!(in >> v)) break;
+    if (key == "cpus") m.cpus = static_cast<unsigned>(v);
+    if (key == "processes") m.processes = v;
+    if (key == "cgroups") m.cgroups = v;
+  }
+  return m;
+}
+
+std::string slurp(const fs::path& p) {
+  std::ifstream in(p, std::ios::binary);
+  std::ostringstream s;
+  s << in.rdbuf();
+  return s.str();
+}
+
+void spill(const fs::path& p, const std::string& s) {
+  std::ofstream out(p, std::ios::binary);
+  out << s;
+}
+
+bool is_pid(const std::string& name) {
+  return !name.empty() && std::all_of(name.begin(), name.end(), [](char c) { return c >= '0' && c <= '9'; });
+}
+
+// Copies `src` to a scratch directory and fills it out to the manifest's
+// process and cgroup counts. Returns the scratch root.
+std::string replay_root(const fs::path& src, const Manifest& m) {
+  const char* base = ::access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+  std::string tmpl = std::string(base) + "/sysapm-fixture-XXXXXX";
+  if (!::mkdtemp(tmpl.data())) return {};
+  const fs::path root = tmpl;
+  fs::copy(src, root, fs::copy_options::recursive);
+
+  std::vector<fs::path> pids;
+  for (const auto& e : fs::directory_iterator(root / "proc"))
+    if (e.is_directory() && is_pid(e.path().filename())) pids.push_back(e.path());
+  for (std::size_t i = pids.size(), next = 100000; i < m.processes && !pids.empty(); ++i, ++next) {
+    const fs::path& from = pids[i % pids.size()];
+    const fs::path to = root / "proc" / std::to_string(next);
+    fs::create_directory(to);
+    std::string stat = slurp(from / "stat");
+    stat.replace(0, stat.find(' '), std::to_string(next));
+    spill(to / "stat", stat);
+    if (fs::exists(from / "status")) fs::copy_file(from / "status", to / "status");
+  }
+
+  const fs::path cg = root / "sys/fs/cgroup";
+  std::vector<fs::path> groups;
+  if (fs::exists(cg))
+    for (const auto& e : fs::recursive_directory_iterator(cg))
+      if (e.is_directory() && fs::exists(e.path() / "cpu.stat")) groups.push_back(e.path());
+  // The root cgroup counts too.
+  for (std::size_t i = groups.size() + 1, n = 0; i < m.cgroups && !groups.empty(); ++i, ++n) {
+    const fs::path to = cg / "bench.slice" / ("replay-" + std::to_string(n / 64)) / ("cg-" + std::to_string(n));
+    fs::create_directories(to);
+    for (const auto& f : fs::directory_iterator(groups[n % groups.size()]))
+      if (f.is_regular_file()) fs::copy_file(f.path(), to / f.path().filename());
+  }
+  return root;
+}
+
+struct Host {
+  SeriesRegistry registry;
+  std::vector<std::unique_ptr<Collector>> collectors;
+
+  template <typename C, typename Opts>
+  void add(const Opts& opts) {
+    auto c = std::make_unique<C>();
+    if (int rc = c->open(opts); rc < 0) {
+      std::fprintf(stderr, "bench_fixture: %s collector: %s\n", c->name(), std::strerror(-rc));
+      return;
+    }
+    c->bind_registry(&registry);
+    collectors.push_back(std::move(c));
+  }
+
+  void tick(std::vector<Sample>& out) {
+    out.clear();
+    for (auto& c : collectors) c->collect(out);
+  }
+};
+
+// Deterministic drift with per-tick noise, so the store sees values that
+// change the way live ones do: counters at a per-series rate give or take
+// a quarter, and a third of the gauges moving on any tick.
+void advance(std::vector<Sample>& s, int tick) {
+  for (Sample& x : s) {
+    x.ts_ns += kSec;
+    const uint32_t h = x.series * 2654435761u;
+    const uint32_t noise = (h ^ static_cast<uint32_t>(tick) * 40503u) * 2246822519u >> 16;
+    if (x.kind == SampleKind::kCounter) {
+      const uint64_t rate = h % 97 == 0 ? 0 : (h >> 8) % 5000;
+      x.counter += rate - rate / 4 + (rate ? noise % (rate / 2 + 1) : 0);
+    } else if (noise % 3 == 0) {
+      x.gauge += static_cast<double>(noise % 64) - 32;
+    }
+  }
+}
+
+void report_metric(const char* metric, double value, const std::string& tags) {
+  char line[256];
+  std::snprintf(line, sizeof line, "fixture %s %.3f %s", metric, value, tags.c_str());
+  report(line);
+}
+
+void run_host(const fs::path& dir) {
+  const Manifest m = read_manifest(dir);
+  const std::string root = replay_root(dir, m);
+  if (root.empty()) {
+    std::fprintf(stderr, "bench_fixture: cannot stage %s\n", dir.c_str());
+    return;
+  }
+
+  Host host;
+  SamplerOptions so;
+  so.proc_root = root + "/proc";
+  host.add<CpuCollector>(so);
+  host.add<MemoryCollector>(so);
+  host.add<NetCollector>(so);
+  host.add<DiskCollector>(so);
+  ProcessCollectorOptions po;
+  po.proc_root = so.proc_root;
+  po.use_connector = false;
+  po.backend = ProcessBackend::kProcfs;
+  host.add<ProcessSummaryCollector>(po);
+  CgroupOptions co;
+  co.root = root + "/sys/fs/cgroup";
+  host.add<CgroupCollector>(co);
+
+  std::vector<Sample> samples;
+  samples.reserve(1 << 16);
+  for (int i = 0; i < 3; ++i) host.tick(samples);  // first ticks intern and size everything
+
+  std::vector<uint64_t> lat;
+  lat.reserve(1000);
+  const uint64_t a0 = g_allocs.load(), b0 = g_alloc_bytes.load();
+  const uint64_t start = now_ns();
+  do {
+    const uint64_t t0 = now_ns();
+    host.tick(samples);
+    lat.push_back(now_ns() - t0);
+  } while (lat.size() < 20 || (now_ns() - start < 1000000000 && lat.size() < 1000));
+  const double ticks = static_cast<double>(lat.size());
+  const double allocs = static_cast<double>(g_allocs.load() - a0) / ticks;
+  const double alloc_bytes = static_cast<double>(g_alloc_bytes.load() - b0) / ticks;
+  std::sort(lat.begin(), lat.end());
+  auto pct = [&lat](double q) { return static_cast<double>(lat[static_cast<std::size_t>(q * (lat.size() - 1))]) / 1000; };
+
+  char tags[160];
+  std::snprintf(tags, sizeof tags, "host=%s cpus=%u processes=%zu cgroups=%zu", dir.filename().c_str(), m.cpus,
+                m.processes, m.cgroups);
+  report_metric("samples_per_tick", static_cast<double>(samples.size()), tags);
+  report_metric("tick_p50_us", pct(0.5), tags);
+  report_metric("tick_p99_us", pct(0.99), tags);
+  report_metric("allocs_per_tick", allocs, tags);
+  report_metric("alloc_bytes_per_tick", alloc_bytes, tags);
+
+  ChunkStore store;
+  std::vector<Sample> series = samples;
+  for (Sample& s : series) s.ts_ns = 1700000000 * kSec;
+  for (int t = 0; t < kStoreTicks; ++t) {
+    store.append(series.data(), series.size());
+    advance(series, t);
+  }
+  store.seal_all();
+  report_metric("store_bytes_per_sample", store.stats().bytes_per_sample(), tags);
+
+  ExportEncoder enc(ExportFormat::kRemoteWrite, &host.registry);
+  std::vector<uint8_t> buf;
+  std::size_t at = 0;
+  const double ns = time_per_call(
+      [&] {
+        enc.begin(&buf);
+        for (const Sample& s : samples) enc.add(s);
+        at = enc.finish();
+        do_not_optimize(buf.data());
+      },
+      300000000);
+  report_metric("encode_ns_per_point", ns / static_cast<double>(samples.size()), tags);
+  report_metric("encode_mb_per_s", static_cast<double>(buf.size() - at) / ns * 1000, tags);
+
+  host.collectors.clear();
+  fs::remove_all(root);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  // Default: every fixture in the tree; or the directories named.
+  std::vector<fs::path> dirs;
+  for (int i = 1; i < argc; ++i) dirs.emplace_back(argv[i]);
+  if (dirs.empty())
+    for (const char* h : {"host8", "host64", "host256"}) dirs.push_back(fs::path(SYSAPM_BENCH_FIXTURES) / h);
+  for (const fs::path& d : dirs) run_host(d);
+  return 0;
+}
@@ -0,0 +1,61 @@
+// Histogram recording cost: one thread, then every hardware thread hitting
+// the same histogram through its shards, against a single shared shard.
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "bench_util.hpp"
+#include "sysapm/histogram.hpp"
+
+using namespace sysapm;
+using namespace sysapm::bench;
+
+namespace {
+
+double contended_ns(Histogram& h, unsigned threads) {
+  constexpr uint64_t kPerThread = 2000000;
+  std::atomic<bool> go{false};
+  std::vector<std::thread> ts;
+  for (unsigned t = 0; t < threads; ++t) {
+    ts.emplace_back([&, t] {
+      while (!go.load()) {
+      }
+      for (uint64_t i = 0; i < kPerThread; ++i) h.record((i * 7919 + t) & 0xfffff);
+    });
+  }
+  const uint64_t start = now_ns();
+  go = true;
+  for (auto& t : ts) t.join();
+  return static_cast<double>(now_ns() - start) / static_cast<double>(kPerThread);
+}
+
+}  // namespace
+
+int main() {
+  char line[256];
+  Histogram one(HistogramLayout{}, 1);
+  uint64_t v = 1;
+  double ns = time_per_call([&] {
+    v = v * 6364136223846793005ull + 1442695040888963407ull;
+    one.record(v >> 40);
+  });
+  std::snprintf(line, sizeof line, "histogram record single_thread %.2f ns/op (%zu B)", ns, one.memory_bytes());
+  report(line);
+
+  const unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+  Histogram sharded(HistogramLayout{}, 0);
+  Histogram shared(HistogramLayout{}, 1);
+  std::snprintf(line, sizeof line, "histogram record threads=%u sharded=%zu %.2f ns/op-per-thread", threads,
+                sharded.shards(), contended_ns(sharded, threads));
+  report(line);
+  std::snprintf(line, sizeof line, "histogram record threads=%u shared %.2f ns/op-per-thread", threads,
+                contended_ns(shared, threads));
+  report(line);
+
+  HistogramSnapshot s;
+  ns = time_per_call([&] { sharded.snapshot(&s); }, 50000000);
+  std::snprintf(line, sizeof line, "histogram snapshot shards=%zu %.0f ns", sharded.shards(), ns);
+  report(line);
+  return 0;
+}
@@ -0,0 +1,141 @@
+// Compares the /proc numeric-table scanners on synthetic large-host tables:
+// the FieldReader tokenizer baseline against each scan_u64_row backend.
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+
+#include "bench_util.hpp"
+#include "sysapm/num_scan.hpp"
+#include "sysapm/text.hpp"
+
+using namespace sysapm;
+using namespace sysapm::bench;
+
+namespace {
+
+std::string make_stat(int cpus, std::mt19937_64& rng) {
+  std::string s;
+  char line[256];
+  for (int c = -1; c < cpus; ++c) {
+    int n = c < 0 ? std::snprintf(line, sizeof line, "cpu ")
+                  : std::snprintf(line, sizeof line, "cpu%d", c);
+    s.append(line, static_cast<std::size_t>(n));
+    for (int f = 0; f < 10; ++f) s += ' ' + std::to_string(rng() % (f == 3 ? 9000000000ull : 40000000));
+    s += '\n';
+  }
+  return s;
+}
+
+std::string make_diskstats(int disks, std::mt19937_64& rng) {
+  std::string s;
+  char line[64];
+  for (int d = 0; d < disks; ++d) {
+    int n = std::snprintf(line, sizeof line, " 259 %7d nvme%dn1", d, d);
+    s.append(line, static_cast<std::size_t>(n));
+    for (int f = 0; f < 17; ++f) s += ' ' + std::to_string(rng() % 100000000000ull);
+    s += '\n';
+  }
+  return s;
+}
+
+std::string make_net_dev(int ifaces, std::mt19937_64& rng) {
+  std::string s = "Inter-| Receive | Transmit\n face |bytes packets|bytes packets\n";
+  char line[64];
+  for (int i = 0; i < ifaces; ++i) {
+    int n = std::snprintf(line, sizeof line, "  veth%04d:", i);
+    s.append(line, static_cast<std::size_t>(n));
+    for (int f = 0; f < 16; ++f) s += ' ' + std::to_string(rng() % 1000000000000ull);
+    s += '\n';
+  }
+  return s;
+}
+
+// Label position per table: leading token, "major minor name", "name:".
+enum class Layout { kStat, kDisk, kNet };
+
+uint64_t parse_with_scanner(ScanFn scan, const std::string& buf, Layout layout) {
+  uint64_t row[32], sum = 0;
+  const char* p = buf.data();
+  const char* end = p + buf.size();
+  const char* stop;
+  while (p < end) {
+    if (layout == Layout::kStat) {
+      next_token(p, end);
+    } else if (layout == Layout::kDisk) {
+      scan(p, end, row, 2, &p);
+      next_token(p, end);
+    } else {
+      const char* eol = next_line(p, end);
+      const char* colon = static_cast<const char*>(std::memchr(p, ':', static_cast<std::size_t>(eol - p)));
+      if (!colon) {
+        p = eol;
+        continue;
+      }
+      p = colon + 1;
+    }
+    std::size_t n = scan(p, end, row, 32, &stop);
+    for (std::size_t i = 0; i < n; ++i) sum += row[i];
+    p = next_line(stop, end);
+  }
+  return sum;
+}
+
+uint64_t parse_with_field_reader(const std::string& buf, Layout layout) {
+  uint64_t row[32], sum = 0;
+  LineReader lines(buf);
+  std::string_view line, tok;
+  while (lines.next(line)) {
+    if (layout == Layout::kNet) {
+      std::size_t colon = line.find(':');
+      if (colon == std::string_view::npos) continue;
+      line.remove_prefix(colon + 1);
+    }
+    FieldReader f(line);
+    if (layout == Layout::kStat) f.next(tok);
+    if (layout == Layout::kDisk) {
+      f.next(tok);
+      f.next(tok);
+      f.next(tok);
+    }
+    std::size_t n = f.read_u64s(row, 32);
+    for (std::size_t i = 0; i < n; ++i) sum += row[i];
+  }
+  return sum;
+}
+
+void run(const char* table, const std::string& buf, Layout layout) {
+  char out[256];
+  uint64_t expect = parse_with_field_reader(buf, layout);
+  double base = time_per_call([&] { do_not_optimize(parse_with_field_reader(buf, layout)); });
+  std::snprintf(out, sizeof out, "num_scan table=%s bytes=%zu impl=field_reader ns=%.0f MBps=%.1f",
+                table, buf.size(), base, static_cast<double>(buf.size()) * 1e3 / base);
+  report(out);
+
+  for (ScanImpl impl : {ScanImpl::kScalar, ScanImpl::kSse42, ScanImpl::kAvx2}) {
+    ScanFn fn = scan_fn(impl);
+    if (impl != ScanImpl::kScalar && fn == scan_fn(ScanImpl::kScalar)) continue;
+    if (parse_with_scanner(fn, buf, layout) != expect) {
+      std::fprintf(stderr, "num_scan: %s mismatch on %s\n", scan_impl_name(impl), table);
+      continue;
+    }
+    double ns = time_per_call([&] { do_not_optimize(parse_with_scanner(fn, buf, layout)); });
+    std::snprintf(out, sizeof out,
+                  "num_scan table=%s bytes=%zu impl=%s ns=%.0f MBps=%.1f speedup=%.2f", table,
+                  buf.size(), scan_impl_name(impl), ns, static_cast<double>(buf.size()) * 1e3 / ns,
+                  base / ns);
+    report(out);
+  }
+}
+
+}  // namespace
+
+
+
+int main() {
+  std::mt19937_64 rng(42);
+  run("stat_256cpu", make_stat(256, rng), Layout::kStat);
+  run("diskstats_512dev", make_diskstats(512, rng), Layout::kDisk);
+  run("net_dev_256if", make_net_dev(256, rng), Layout::kNet);
+  return 0;
+}
@@ -0,0 +1,39 @@
+// Per-tick cost of rereading live /proc: the host sampler's five files and
+// every process's stat/status, with pread and with batched io_uring reads.
+#include <cstdio>
+
+#include "bench_util.hpp"
+#include "sysapm/proc_sampler.hpp"
+#include "sysapm/process_collector.hpp"
+
+using namespace sysapm;
+using namespace sysapm::bench;
+
+int main() {
+  char line[256];
+  for (IoBackend io : {IoBackend::kRead, IoBackend::kUring}) {
+    const char* name = io == IoBackend::kUring ? "io_uring" : "pread";
+    SamplerOptions so;
+    so.io = io;
+    ProcSampler s;
+    if (int rc = s.open(so); rc < 0) {
+      std::fprintf(stderr, "bench_proc_io: %s unavailable (%d)\n", name, rc);
+      continue;
+    }
+    double ns = time_per_call([&] { do_not_optimize(s.sample()); });
+    std::snprintf(line, sizeof line, "proc_io sampler %s %.1f us/tick", name, ns / 1000);
+    report(line);
+
+    ProcessCollectorOptions po;
+    po.use_connector = false;
+    po.backend = ProcessBackend::kProcfs;
+    po.io = io;
+    ProcessCollector c;
+    if (c.open(po) < 0) continue;
+    ns = time_per_call([&] { do_not_optimize(c.collect()); });
+    std::snprintf(line, sizeof line, "proc_io processes %s %.1f us/tick (%zu processes, %llu syscalls)", name,
+                  ns / 1000, c.table().size(), static_cast<unsigned long long>(c.stats().syscalls_last_tick));
+    report(line);
+  }
+  return 0;
+}
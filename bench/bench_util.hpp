@@ -0,0 +1,47 @@
+// bench_util.hpp — timing and reporting helpers shared by the benchmarks.
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+
+namespace sysapm::bench {
+
+inline uint64_t now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+/// Keeps the optimizer from discarding a computed value.
+template <typename T>
+inline void do_not_optimize(const T& v) {
+  asm volatile("" : : "r,m"(v) : "memory");
+}
+
+/// Runs `fn` repeatedly for about `budget_ns` and returns mean ns per call.
+template <typename Fn>
+double time_per_call(Fn&& fn, uint64_t budget_ns = 200000000) {
+  for (int i = 0; i < 16; ++i) fn();  // warm caches and branch predictors
+  uint64_t iters = 0;
+  uint64_t start = now_ns(), elapsed = 0;
+  do {
+    for (int i = 0; i < 64; ++i) fn();
+    iters += 64;
+    elapsed = now_ns() - start;
+  } while (elapsed < budget_ns);
+  return static_cast<double>(elapsed) / static_cast<double>(iters);
+}
+
+/// Appends one result line to bench_output.txt and echoes it to stdout.
+inline void report(const char* line) {
+  std::fputs(line, stdout);
+  std::fputc('\n', stdout);
+  if (FILE* f = std::fopen(SYSAPM_BENCH_OUTPUT, "a")) {
+    std::fputs(line, f);
+    std::fputc('\n', f);
+    std::fclose(f);
+  }
+}
+
+}  // namespace sysapm::bench
@@ -0,0 +1,42 @@
+#!/bin/sh
+# capture.sh DIR — records this host's /proc and cgroup v2 tree into DIR in
+# the layout bench_fixture replays. Run as root so every pid's files are
+# readable; nothing outside DIR is written.
+#
+# host8, host64 and host256 here are synthesized in the shape of such
+# captures (per-CPU rows, a full intr line, veth and nvme/dm device lists,
+# a kubepods-style cgroup tree) with a few template pid and cgroup
+# directories; the manifest counts make the replay clone those up to the
+# host's scale. A capture holds every pid and cgroup, so nothing is cloned.
+set -eu
+out=${1:?usage: capture.sh DIR}
+mkdir -p "$out/proc/net" "$out/sys/fs/cgroup"
+for f in stat meminfo loadavg diskstats net/dev; do
+  cat "/proc/$f" > "$out/proc/$f"
+done
+procs=0
+for d in /proc/[0-9]*; do
+  pid=${d#/proc/}
+  mkdir -p "$out/proc/$pid"
+  if cat "$d/stat" > "$out/proc/$pid/stat" 2>/dev/null && cat "$d/status" > "$out/proc/$pid/status" 2>/dev/null; then
+    procs=$((procs + 1))
+  else
+    rm -rf "$out/proc/$pid"  # exited while we read it
+  fi
+done
+cgroups=0
+cd /sys/fs/cgroup
+for d in $(find . -type d); do
+  [ -r "$d/cpu.stat" ] || continue
+  mkdir -p "$out/sys/fs/cgroup/$d"
+  for f in cpu.stat memory.stat io.stat cpu.pressure memory.pressure; do
+    [ -r "$d/$f" ] && cat "$d/$f" > "$out/sys/fs/cgroup/$d/$f" 2>/dev/null || true
+  done
+  cgroups=$((cgroups + 1))
+done
+cat > "$out/manifest" <<MANIFEST
+# Copies the replay makes of the pid and cgroup directories here.
+cpus $(grep -c '^cpu[0-9]' /proc/stat)
+processes $procs
+cgroups $cgroups
+MANIFEST
@@ -0,0 +1,83 @@
+// adaptive.hpp — per-series sampling back-off for series that do not move.
+//
+// Most series on a host are flat for hours: idle disks, down interfaces,
+// memory limits. AdaptiveFilter sits in front of the store, rollups and
+// exporter and thins those out per series. A series within epsilon of its
+// last change only forwards every stride-th sample, as a heartbeat, and
+// after stable_ticks heartbeats in a row its stride doubles, up to
+// max_stride; a stable series' interval thus grows 1, 2, 4, ... ticks. The
+// first sample that moves is forwarded at once and the stride drops back
+// to one, so changes are never delayed.
+//
+// A series that stops arriving altogether (its cgroup, process or device
+// went away) gets one explicit staleness marker (Sample::make_stale) once
+// it has been silent for stale_after_ns, instead of downstream guessing
+// from a gap that may just be a back-off.
+//
+// Collectors still read every tick; what backs off is everything after
+// them. Counters only count as stable when exactly unchanged. Single-
+// threaded: the aggregator thread owns the filter.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "sysapm/sample.hpp"
+
+namespace sysapm {
+
+struct AdaptiveOptions {
+  uint32_t stable_ticks = 5;    // K: stable heartbeats before each doubling
+  uint32_t max_stride = 60;     // ceiling, in samples of the series
+  double abs_epsilon = 0;       // gauges: |v - last| <= max(abs, rel * |last|)
+  double rel_epsilon = 1e-6;
+  int64_t stale_after_ns = 5000000000;  // 0: no staleness markers
+};
+
+struct AdaptiveStats {
+  uint64_t in = 0;
+  uint64_t forwarded = 0;
+  uint64_t heartbeats = 0;  // forwarded unchanged at the end of a stride
+  uint64_t snapbacks = 0;   // backed-off series that moved
+  uint64_t stale = 0;       // staleness markers emitted
+  uint64_t backed_off = 0;  // series currently at a stride above one
+};
+
+class AdaptiveFilter {
+ public:
+  explicit AdaptiveFilter(const AdaptiveOptions& opts = {}) : opts_(opts) {}
+
+  /// Copies the samples that should go on from `in` to `out` (which may
+  /// be `in`) and returns how many.
+  std::size_t filter(const Sample* in, std::size_t n, Sample* out);
+
+  /// Appends staleness markers for series silent since before
+  /// now_ns - stale_after_ns. Cheap to call every tick: it only scans the
+  /// series table a few times per stale_after_ns.
+  void sweep(int64_t now_ns, std::vector<Sample>* out);
+
+  /// Current stride of `series`; 0 when the series is not being tracked.
+  uint32_t stride(uint32_t series) const { return series < state_.size() ? state_[series].stride : 0; }
+
+  const AdaptiveOptions& options() const { return opts_; }
+  const AdaptiveStats& stats() const { return stats_; }
+
+ private:
+  struct State {
+    Sample last;           // anchor: the last sample that counted as a change
+    int64_t seen_ns = 0;   // newest sample, forwarded or not
+    uint32_t stride = 0;   // 0: untracked or gone
+    uint32_t stable = 0;   // heartbeats since the last doubling
+    uint32_t skipped = 0;  // dropped since the last forward
+  };
+
+  bool unchanged(const Sample& prev, const Sample& s) const;
+
+  AdaptiveOptions opts_;
+  std::vector<State> state_;  // by series id: ids are dense
+  int64_t next_sweep_ = 0;
+  AdaptiveStats stats_;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,169 @@
+// aggregator.hpp — the fleet-side role: merging agents' rollups.
+//
+// Agents exporting with ExportFormat::kAgent POST their rollup windows to
+// an IntakeServer. The aggregator merges the windows of series that are
+// the same across agents into one point per (series, window, start) and
+// hands those to a sink, normally one Exporter per shard that forwards
+// them to the backend. Merging is exact: counts and sums add up, min and
+// max are the extremes, `last` adds up across agents (each agent sends a
+// window once, so a counter's merged last is the fleet's total) and
+// histograms merge bucket-wise. Resource attributes named in by_resource
+// become labels (dots turned into underscores), so series can be kept
+// apart per host or cluster; all others are dropped, which makes the
+// merge fleet-wide.
+//
+// Series are sharded by a hash of their label set, and each shard owns
+// its registry, its cells and its sink calls, so there are no locks
+// between shards. ingest() decodes the request bodies in parallel on the
+// pool, each into per-shard buckets, then merges shard by shard, also in
+// parallel. advance() emits the windows that ended grace_ns ago; a point
+// for an already emitted window is counted late and dropped. Raw samples,
+// staleness markers and windows of widths not in windows_ns are not
+// merged and only counted.
+//
+// Not thread-safe itself: one thread calls ingest() and advance(); the
+// sink runs on pool threads, at most once at a time per shard.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "sysapm/rollup.hpp"
+#include "sysapm/series_registry.hpp"
+#include "sysapm/thread_pool.hpp"
+
+namespace sysapm {
+
+struct AggregatorOptions {
+  unsigned shards = 0;  // 0: one per pool worker, at least 1
+  std::vector<int64_t> windows_ns = RollupOptions{}.windows_ns;  // widths merged
+  /// How long after a window's end advance() waits for slow agents.
+  int64_t grace_ns = 15000000000;
+  std::vector<std::string> by_resource;  // resource attributes kept as labels
+};
+
+struct AggregatorStats {
+  uint64_t batches = 0;
+  uint64_t malformed = 0;  // batches or points that did not decode
+  uint64_t points = 0;     // merged into a cell
+  uint64_t unmerged = 0;   // raw samples, stale markers, unknown widths
+  uint64_t late = 0;
+  uint64_t conflicts = 0;  // kind or histogram layout differs from the cell's
+  uint64_t emitted = 0;
+  uint64_t cells = 0;      // open right now
+  uint64_t series = 0;
+};
+
+class Aggregator {
+ public:
+  /// Receives a shard's merged points; resolve their ids with registry(shard).
+  using Sink = std::function<void(unsigned shard, const RollupPoint*, std::size_t)>;
+
+  /// `pool` may be null or not started; everything then runs inline.
+  Aggregator(const AggregatorOptions& opts, ThreadPool* pool, Sink sink);
+  ~Aggregator();
+  Aggregator(const Aggregator&) = delete;
+  Aggregator& operator=(const Aggregator&) = delete;
+
+  /// Merges uncompressed agent batches. Returns how many were malformed.
+  std::size_t ingest(const std::vector<std::string_view>& bodies);
+  /// Emits every window that ended at least grace_ns before `now_ns`.
+  void advance(int64_t now_ns);
+  /// Emits every open window, e.g. at shutdown.
+  void flush();
+
+  unsigned shards() const { return static_cast<unsigned>(shards_.size()); }
+  const SeriesRegistry& registry(unsigned shard) const;
+  const AggregatorOptions& options() const { return opts_; }
+  AggregatorStats stats() const;
+
+ private:
+  struct Point;
+  struct Decoded;
+  struct Shard;
+
+  void decode(std::string_view body, Decoded& d) const;
+  void merge(Shard& s, const Decoded& d, std::size_t shard) const;
+  void emit(Shard& s, unsigned shard, int64_t now_ns);
+  void run(std::size_t n, const std::function<void(std::size_t)>& fn);
+
+  AggregatorOptions opts_;
+  ThreadPool* pool_;
+  Sink sink_;
+  std::vector<std::pair<std::string, std::string>> keep_;  // attribute, label name
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::vector<std::unique_ptr<Decoded>> decoded_;  // reused across ingest() calls
+  uint64_t batches_ = 0;
+  uint64_t bad_batches_ = 0;
+};
+
+struct IntakeOptions {
+  std::string host = "0.0.0.0";
+  uint16_t port = 9091;
+  std::string path = "/v1/agent";
+  std::size_t max_body = 64u << 20;  // uncompressed
+  std::size_t max_connections = 4096;
+};
+
+/// Parses "HOST:PORT[/PATH]" like parse_export_target(). Returns 0 or -EINVAL.
+int parse_intake_address(std::string_view target, IntakeOptions* out);
+
+struct IntakeStats {
+  uint64_t connections = 0;
+  uint64_t requests = 0;
+  uint64_t rejected = 0;  // answered 4xx
+  uint64_t bytes = 0;     // bodies as received
+};
+
+/// Minimal HTTP/1.1 server for agent batches: keep-alive, pipelined POSTs
+/// with a Content-Length and an optional snappy Content-Encoding, answered
+/// 204 once the body has been read. Decoding happens later, in
+/// Aggregator::ingest(), so a batch that does not decode is acknowledged
+/// anyway: resending it would not help.
+class IntakeServer {
+ public:
+  IntakeServer() = default;
+  ~IntakeServer();
+  IntakeServer(const IntakeServer&) = delete;
+  IntakeServer& operator=(const IntakeServer&) = delete;
+
+  /// Binds and listens. Returns 0 or -errno.
+  int open(const IntakeOptions& opts);
+  void close();
+  /// The bound port, for port 0.
+  uint16_t port() const { return port_; }
+
+  /// Waits up to `timeout_ms` for activity, then accepts, reads and
+  /// answers without blocking. Appends each complete body, uncompressed,
+  /// to `bodies`. Returns 0 or -errno of the listening socket.
+  int poll(int timeout_ms, std::vector<std::vector<uint8_t>>* bodies);
+
+  const IntakeStats& stats() const { return stats_; }
+
+ private:
+  struct Conn {
+    int fd;
+    std::string in;
+    std::string out;
+    bool closing = false;  // close once `out` is written
+  };
+
+  void accept_all();
+  bool read_some(Conn& c, std::vector<std::vector<uint8_t>>* bodies);
+  void parse(Conn& c, std::vector<std::vector<uint8_t>>* bodies);
+  void reply(Conn& c, int status, bool close);
+
+  IntakeOptions opts_;
+  int fd_ = -1;
+  uint16_t port_ = 0;
+  std::vector<std::unique_ptr<Conn>> conns_;
+  std::vector<uint8_t> scratch_;
+  IntakeStats stats_;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,88 @@
+// arena.hpp — per-tick bump allocator.
+//
+// Everything a tick allocates for its own use (directory listings, request
+// lists, parsed rows, encoder fragments) dies together when the tick ends,
+// so it is bump-allocated from a TickArena that is reset rather than freed.
+// A tick that outgrows the arena chains one more block; the next reset()
+// folds the chain into a single block of the combined size, so after the
+// first busy tick the steady state performs no heap allocation at all.
+//
+// An arena given a NUMA node takes its blocks from numa_alloc(), so what
+// a node's workers allocate stays on that node (numa.hpp).
+//
+// ArenaResource adapts an arena to std::pmr::memory_resource for the
+// standard containers. Deallocation is a no-op; memory comes back only
+// with reset(), which must not happen while containers still use it.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+
+namespace sysapm {
+
+class TickArena {
+ public:
+  /// `node` < 0: blocks come from the heap.
+  explicit TickArena(std::size_t block_bytes = 64u << 10, int node = -1);
+  ~TickArena();
+  TickArena(const TickArena&) = delete;
+  TickArena& operator=(const TickArena&) = delete;
+
+  /// Returns `bytes` of storage aligned to `align` (a power of two).
+  /// Throws std::bad_alloc only if the upstream allocation fails.
+  void* allocate(std::size_t bytes, std::size_t align = alignof(std::max_align_t));
+
+  /// Uninitialized storage for `n` objects of trivially destructible T.
+  template <typename T>
+  T* allocate_array(std::size_t n) {
+    return static_cast<T*>(allocate(n * sizeof(T), alignof(T)));
+  }
+
+  /// Releases everything allocated since the last reset.
+  void reset();
+
+  int node() const { return node_; }
+  std::size_t used() const { return used_; }
+  std::size_t capacity() const { return capacity_; }
+  /// Largest used() seen at any reset().
+  std::size_t high_water() const { return high_water_; }
+  /// Blocks obtained from the heap over the arena's lifetime.
+  uint64_t upstream_allocs() const { return upstream_allocs_; }
+
+ private:
+  struct Block {
+    Block* next;
+    std::size_t size;  // usable bytes after the header
+  };
+
+  void add_block(std::size_t min_bytes);
+  void release_blocks();
+
+  Block* first_ = nullptr;
+  Block* cur_block_ = nullptr;
+  char* cur_ = nullptr;
+  char* end_ = nullptr;
+  std::size_t block_bytes_;
+  int node_;
+  std::size_t used_ = 0;
+  std::size_t capacity_ = 0;
+  std::size_t high_water_ = 0;
+  uint64_t upstream_allocs_ = 0;
+};
+
+class ArenaResource final : public std::pmr::memory_resource {
+ public:
+  explicit ArenaResource(TickArena& arena) : arena_(arena) {}
+  TickArena& arena() const { return arena_; }
+
+ private:
+  void* do_allocate(std::size_t bytes, std::size_t align) override { return arena_.allocate(bytes, align); }
+  void do_deallocate(void*, std::size_t, std::size_t) override {}
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+  TickArena& arena_;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,106 @@
+// bitstream.hpp — MSB-first bit packing over 64-bit words.
+//
+// The writer targets an array of std::atomic<uint64_t> so a head chunk can
+// be decoded while it is still being appended to: the writer only ever
+// stores whole words, and readers never look past the bit position the
+// writer has published. Relaxed word accesses compile to plain moves.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace sysapm {
+
+class BitWriter {
+ public:
+  BitWriter() = default;
+  BitWriter(std::atomic<uint64_t>* words, std::size_t cap_words) : w_(words), cap_(cap_words) {}
+
+  /// Appends the low `n` bits of `v` (0 <= n <= 64). The caller checks
+  /// capacity with remaining_bits() first.
+  void write(uint64_t v, unsigned n) {
+    if (n == 0) return;
+    if (n < 64) v &= (uint64_t{1} << n) - 1;
+    unsigned used = static_cast<unsigned>(pos_ & 63);
+    unsigned free = 64 - used;
+    std::size_t idx = static_cast<std::size_t>(pos_ >> 6);
+    if (n <= free) {
+      cur_ |= free == n ? v : v << (free - n);
+      w_[idx].store(cur_, std::memory_order_relaxed);
+      if (n == free) cur_ = 0;
+    } else {
+      unsigned spill = n - free;
+      cur_ |= v >> spill;
+      w_[idx].store(cur_, std::memory_order_relaxed);
+      cur_ = v << (64 - spill);
+      w_[idx + 1].store(cur_, std::memory_order_relaxed);
+    }
+    pos_ += n;
+  }
+
+  void write_bit(bool b) { write(b ? 1 : 0, 1); }
+
+  /// Continues the same stream in a larger array the caller has already
+  /// copied the written words into.
+  void rebind(std::atomic<uint64_t>* words, std::size_t cap_words) {
+    w_ = words;
+    cap_ = cap_words;
+  }
+
+  uint64_t bit_pos() const { return pos_; }
+  uint64_t remaining_bits() const { return static_cast<uint64_t>(cap_) * 64 - pos_; }
+
+ private:
+  std::atomic<uint64_t>* w_ = nullptr;
+  std::size_t cap_ = 0;
+  uint64_t pos_ = 0;
+  uint64_t cur_ = 0;  // copy of the word being filled
+};
+
+/// Word sources for BitReader: immutable memory or a live atomic array.
+struct PlainWords {
+  const uint64_t* w;
+  uint64_t operator[](std::size_t i) const { return w[i]; }
+};
+
+struct AtomicWords {
+  const std::atomic<uint64_t>* w;
+  uint64_t operator[](std::size_t i) const { return w[i].load(std::memory_order_relaxed); }
+};
+
+template <typename Words>
+class BitReader {
+ public:
+  BitReader() = default;
+  explicit BitReader(Words words) : w_(words) {}
+
+  uint64_t read(unsigned n) {
+    if (n == 0) return 0;
+    std::size_t idx = static_cast<std::size_t>(pos_ >> 6);
+    unsigned used = static_cast<unsigned>(pos_ & 63);
+    unsigned avail = 64 - used;
+    uint64_t v;
+    if (n <= avail) {
+      v = w_[idx] << used;
+      v >>= 64 - n;
+    } else {
+      // Spans two words; used > 0 here, so avail < 64 and the mask is safe.
+      unsigned spill = n - avail;
+      uint64_t hi = w_[idx] & ((uint64_t{1} << avail) - 1);
+      v = (hi << spill) | (w_[idx + 1] >> (64 - spill));
+    }
+    pos_ += n;
+    return v;
+  }
+
+  bool read_bit() { return read(1) != 0; }
+
+  uint64_t bit_pos() const { return pos_; }
+
+ private:
+  Words w_{};
+  uint64_t pos_ = 0;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,151 @@
+// bpf.hpp — minimal eBPF loader: maps, an instruction assembler, and
+// tracepoint attachment through perf events.
+//
+// There is no libbpf or clang in the build, so programs are assembled at
+// run time from the kernel's own instruction encoding. That also lets a
+// program take tracepoint field offsets from tracefs when it is built
+// instead of from headers of a kernel it may not run on. Everything talks
+// to the kernel with the raw bpf() and perf_event_open() syscalls and
+// reports -errno.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <linux/bpf.h>
+
+namespace sysapm {
+
+struct BpfMapSpec {
+  bpf_map_type type = BPF_MAP_TYPE_HASH;
+  uint32_t key_size = 0;
+  uint32_t value_size = 0;
+  uint32_t max_entries = 0;
+  uint32_t flags = 0;
+};
+
+class BpfMap {
+ public:
+  BpfMap() = default;
+  ~BpfMap() { close(); }
+  BpfMap(const BpfMap&) = delete;
+  BpfMap& operator=(const BpfMap&) = delete;
+
+  /// Creates the map. Returns 0 or -errno (-EPERM without CAP_BPF).
+  int create(const BpfMapSpec& spec, const char* name);
+  void close();
+  int fd() const { return fd_; }
+  const BpfMapSpec& spec() const { return spec_; }
+
+  int lookup(const void* key, void* value) const;
+  int update(const void* key, const void* value, uint64_t flags = BPF_ANY);
+
+  /// Copies up to `max` entries into `keys`/`values` with
+  /// BPF_MAP_LOOKUP_BATCH, resuming until the map is exhausted; one
+  /// syscall when `max` covers the whole map. Returns the entry count or
+  /// -errno (-EINVAL on kernels before 5.6).
+  int lookup_all(void* keys, void* values, std::size_t max) const;
+
+ private:
+  int fd_ = -1;
+  BpfMapSpec spec_;
+};
+
+/// Builds a program one instruction at a time. Jumps name a Label that may
+/// be bound later; finish() patches their offsets.
+class BpfAsm {
+ public:
+  struct Label {
+    int id;
+  };
+
+  Label label();
+  void bind(Label l);
+
+  void mov(int dst, int src) { alu(BPF_MOV, dst, src); }
+  void mov_imm(int dst, int32_t imm) { alu_imm(BPF_MOV, dst, imm); }
+  void alu(int op, int dst, int src) { emit(BPF_ALU64 | op | BPF_X, dst, src, 0, 0); }
+  void alu_imm(int op, int dst, int32_t imm) { emit(BPF_ALU64 | op | BPF_K, dst, 0, 0, imm); }
+  /// dst = *(size *)(src + off); `size` is BPF_W, BPF_DW, ...
+  void ldx(int size, int dst, int src, int16_t off) { emit(BPF_LDX | size | BPF_MEM, dst, src, off, 0); }
+  /// *(size *)(dst + off) = src
+  void stx(int size, int dst, int16_t off, int src) { emit(BPF_STX | size | BPF_MEM, dst, src, off, 0); }
+  void st_imm(int size, int dst, int16_t off, int32_t imm) { emit(BPF_ST | size | BPF_MEM, dst, 0, off, imm); }
+  /// __sync_fetch_and_add((u64 *)(dst + off), src)
+  void atomic_add(int dst, int16_t off, int src) { emit(BPF_STX | BPF_DW | BPF_ATOMIC, dst, src, off, BPF_ADD); }
+  /// dst = the map referenced by `map_fd` (a two-slot ld_imm64).
+  void ld_map(int dst, int map_fd);
+  void call(int helper) { emit(BPF_JMP | BPF_CALL, 0, 0, 0, helper); }
+  void jmp_imm(int op, int dst, int32_t imm, Label to);
+  void jmp(int op, int dst, int src, Label to);
+  void ja(Label to);
+  void exit() { emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0); }
+
+  /// Resolves jumps. Returns 0, or -EINVAL for an unbound label or a jump
+  /// out of range.
+  int finish();
+  const std::vector<bpf_insn>& insns() const { return insns_; }
+
+ private:
+  void emit(int code, int dst, int src, int16_t off, int32_t imm);
+  void emit_jump(int code, int dst, int src, int32_t imm, Label to);
+
+  std::vector<bpf_insn> insns_;
+  std::vector<int> labels_;                      // instruction index, -1 until bound
+  std::vector<std::pair<std::size_t, int>> fixups_;  // jump instruction, label
+};
+
+class BpfProgram {
+ public:
+  BpfProgram() = default;
+  ~BpfProgram() { close(); }
+  BpfProgram(const BpfProgram&) = delete;
+  BpfProgram& operator=(const BpfProgram&) = delete;
+
+  /// Loads the program. On a verifier rejection `log` (if given) receives
+  /// the verifier's output. Returns 0 or -errno.
+  int load(bpf_prog_type type, const BpfAsm& code, const char* name, std::string* log = nullptr);
+  void close();
+  int fd() const { return fd_; }
+
+ private:
+  int fd_ = -1;
+};
+
+/// Tracefs mount point ("/sys/kernel/tracing", or debugfs' tracing
+/// directory), found through /proc/self/mounts; empty when unmounted.
+std::string find_tracefs();
+
+struct TracepointField {
+  uint32_t offset = 0;
+  uint32_t size = 0;
+};
+
+/// Reads `field` of `category`/`event` from the tracepoint's format file.
+/// Returns 0, -ENOENT for an unknown event or field, or another -errno.
+int tracepoint_field(const std::string& tracefs, const char* category, const char* event, const char* field,
+                     TracepointField* out);
+
+/// The expression after "print fmt: " in the tracepoint's format file.
+/// Returns 0, -ENOENT for an unknown event, -EINVAL without one, or -errno.
+int tracepoint_print_fmt(const std::string& tracefs, const char* category, const char* event, std::string* out);
+
+/// A program attached to one tracepoint on every CPU. Detaches on close.
+class TracepointLink {
+ public:
+  TracepointLink() = default;
+  ~TracepointLink() { close(); }
+  TracepointLink(const TracepointLink&) = delete;
+  TracepointLink& operator=(const TracepointLink&) = delete;
+
+  int attach(const std::string& tracefs, const char* category, const char* event, const BpfProgram& prog);
+  void close();
+  std::size_t cpus() const { return fds_.size(); }
+
+ private:
+  std::vector<int> fds_;
+};
+
+}  // namespace sysapm
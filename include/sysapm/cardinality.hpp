@@ -0,0 +1,103 @@
+// cardinality.hpp — top-K series selection for metrics over their cap.
+//
+// The SeriesRegistry bounds how many series a metric can intern (see
+// CardinalityLimits); this stage decides which of a limited metric's series
+// are worth keeping. It sits in front of the store, rollups and exporter
+// and, per limited metric, feeds every sample's weight into a SpaceSaving
+// summary: a counter weighs its increase since the last tick, a gauge its
+// magnitude. Every epoch_ticks ticks the top_k heaviest series are chosen
+// again and old weight decays, so a series that goes quiet loses its place
+// and a new hot one earns it within a few epochs. Until the first choice a
+// newly limited metric passes everything.
+//
+// Chosen series pass untouched. The rest are folded into the metric's
+// overflow series, metric{series="other"}: gauges as their sum, counters as
+// the running sum of their increases, so the overflow counter only goes up
+// as series move in and out of it. A series that gets folded after having
+// passed gets a staleness marker. Samples that already carry the overflow
+// id (label sets the registry refused) have no identity to take increases
+// from; their counter sum is taken per tick and only its rises are added.
+//
+// Unlimited metrics cost one byte per series id and a load per sample.
+// Single-threaded: the aggregator thread owns the limiter.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "sysapm/sample.hpp"
+#include "sysapm/series_registry.hpp"
+#include "sysapm/sketch.hpp"
+
+namespace sysapm {
+
+struct CardinalityOptions {
+  uint32_t top_k = 0;         // series kept per limited metric; 0: the metric's cap
+  uint32_t counters_per_key = 2;  // SpaceSaving counters per kept series
+  uint32_t epoch_ticks = 10;  // ticks between choices
+  double decay = 0.5;         // weight kept from one epoch to the next
+};
+
+struct CardinalityStats {
+  uint64_t in = 0;
+  uint64_t passed = 0;
+  uint64_t folded = 0;      // samples summed into an overflow series
+  uint64_t demoted = 0;     // series folded after passing, each with a stale marker
+  uint64_t limited = 0;     // limited metrics seen so far
+};
+
+class CardinalityLimiter {
+ public:
+  explicit CardinalityLimiter(SeriesRegistry& registry, const CardinalityOptions& opts = {});
+  ~CardinalityLimiter();
+
+  /// Appends the samples of `in` that go on, folded and marked as above,
+  /// to `out`. A tick may arrive over several calls, so overflow samples
+  /// are held back: a metric's goes out when its next tick starts here or
+  /// at finish_tick(), whichever comes first.
+  void filter(const Sample* in, std::size_t n, std::vector<Sample>* out);
+
+  /// Appends the held overflow sample of every metric folded into since
+  /// its last one. Call once the tick's samples have all been filtered.
+  void finish_tick(std::vector<Sample>* out);
+
+  /// Appends, once per tick, each limited metric's
+  /// system_apm_self_series_{estimate,refused_total,folded_total}{metric}.
+  void self_metrics(int64_t now_ns, std::vector<Sample>* out);
+
+  /// Whether `series` currently passes; false for unlimited or unknown ids.
+  bool kept(uint32_t series) const;
+
+  const CardinalityOptions& options() const { return opts_; }
+  const CardinalityStats& stats() const { return stats_; }
+
+ private:
+  enum : uint8_t { kUnknown, kFree, kLimited };
+  struct Metric;
+  struct Track {
+    Metric* metric;
+    uint64_t last = 0;
+    bool has_last = false;
+    bool passing = true;
+  };
+
+  Metric* metric_for(uint32_t series);
+  void start_tick(Metric& m, int64_t ts);
+  void fold(Metric& m, const Sample& s, uint64_t delta);
+  void emit_overflow(Metric& m, std::vector<Sample>* out);
+
+  SeriesRegistry& registry_;
+  CardinalityOptions opts_;
+  std::vector<uint8_t> state_;  // by series id
+  uint64_t epoch_ = 0;
+  std::unordered_map<uint32_t, std::unique_ptr<Metric>> metrics_;  // by overflow id
+  std::unordered_map<uint32_t, Track> tracks_;  // limited series only
+  std::vector<Metric*> dirty_;
+  int64_t self_ts_ = 0;
+  CardinalityStats stats_;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,297 @@
+// chunk.hpp — compressed, single-series sample chunks.
+//
+// A chunk holds one series' samples for (part of) one block. Timestamps
+// are kept at millisecond precision and delta-of-delta encoded, so a
+// steady 1 s cadence costs one bit per sample. Gauges use Gorilla XOR
+// encoding against the previous value; counters store the change in their
+// delta as a zigzag varint, or a single bit when the delta repeats.
+//
+// A HeadChunk is appended to by one writer while readers decode it: the
+// writer publishes the sample count with release after the bits are in
+// place, and readers never decode past the count they loaded. Sealing
+// copies the stream into an immutable SealedChunk whose words and meta
+// are plain memory, so sealed chunks can be shared without coordination.
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include "sysapm/bitstream.hpp"
+#include "sysapm/sample.hpp"
+
+namespace sysapm {
+
+inline constexpr int64_t kNsPerMs = 1000000;
+
+/// Fixed header of a chunk, laid out so it can be written to disk as is.
+struct ChunkMeta {
+  uint32_t series = 0;
+  SampleKind kind = SampleKind::kGauge;
+  uint8_t reserved[3] = {};
+  uint32_t count = 0;      // samples in the stream
+  uint32_t words = 0;      // 64-bit words holding the stream
+  int64_t min_t_ms = 0;    // first sample
+  int64_t max_t_ms = 0;    // last sample
+};
+
+static_assert(sizeof(ChunkMeta) == 32);
+
+/// Worst-case encoding of one sample: a 64-bit timestamp escape plus a
+/// full varint or XOR window, rounded up to whole words.
+inline constexpr uint64_t kMaxSampleBits = 192;
+
+namespace detail {
+
+inline int64_t sign_extend(uint64_t v, unsigned n) {
+  return static_cast<int64_t>(v << (64 - n)) >> (64 - n);
+}
+
+inline uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+inline int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+
+}  // namespace detail
+
+/// Writer-side state of one stream; see chunk.cpp for the bit layout.
+struct ChunkEncoder {
+  BitWriter out;
+  uint32_t count = 0;
+  int64_t prev_t = 0;
+  int64_t prev_dt = 0;
+  uint64_t prev_v = 0;  // raw value bits
+  int64_t prev_dv = 0;  // counters: last delta
+  unsigned lead = 0;    // gauges: last XOR window
+  unsigned trail = 0;
+  bool window = false;
+
+  void append(SampleKind kind, int64_t t_ms, uint64_t v);
+};
+
+/// Decodes a stream from any word source; see PlainWords/AtomicWords.
+template <typename Words>
+class ChunkDecoder {
+ public:
+  ChunkDecoder(Words words, SampleKind kind, uint32_t count) : in_(words), kind_(kind), left_(count) {}
+
+  /// Decodes the next sample into (`t_ms`, raw value bits).
+  bool next(int64_t& t_ms, uint64_t& v) {
+    if (left_ == 0) return false;
+    --left_;
+    if (first_) {
+      first_ = false;
+      t_ = static_cast<int64_t>(in_.read(64));
+      v_ = in_.read(64);
+    } else {
+      dt_ += read_dod();
+      t_ += dt_;
+      if (kind_ == SampleKind::kCounter)
+        read_counter();
+      else
+        read_gauge();
+    }
+    t_ms = t_;
+    v = v_;
+    return true;
+  }
+
+ private:
+  int64_t read_dod() {
+    if (!in_.read_bit()) return 0;
+    if (!in_.read_bit()) return detail::sign_extend(in_.read(7), 7);
+    if (!in_.read_bit()) return detail::sign_extend(in_.read(9), 9);
+    if (!in_.read_bit()) return detail::sign_extend(in_.read(12), 12);
+    return static_cast<int64_t>(in_.read(64));
+  }
+
+  void read_counter() {
+    if (in_.read_bit()) {
+      uint64_t z = 0;
+      for (unsigned shift = 0;; shift += 7) {
+        uint64_t group = in_.read(8);
+        z |= (group & 0x7f) << shift;
+        if (!(group & 0x80)) break;
+      }
+      dv_ += detail::unzigzag(z);
+    }
+    v_ += static_cast<uint64_t>(dv_);
+  }
+
+  void read_gauge() {
+    if (!in_.read_bit()) return;
+    if (in_.read_bit()) {
+      lead_ = static_cast<unsigned>(in_.read(5));
+      unsigned len = static_cast<unsigned>(in_.read(6));
+      if (len == 0) len = 64;
+      trail_ = 64 - lead_ - len;
+    }
+    v_ ^= in_.read(64 - lead_ - trail_) << trail_;
+  }
+
+  BitReader<Words> in_;
+  SampleKind kind_;
+  uint32_t left_;
+  bool first_ = true;
+  int64_t t_ = 0;
+  int64_t dt_ = 0;
+  uint64_t v_ = 0;
+  int64_t dv_ = 0;
+  unsigned lead_ = 0;
+  unsigned trail_ = 0;
+};
+
+/// Samples decoded per block by the scan_blocks() family.
+inline constexpr std::size_t kDecodeBlock = 256;
+
+/// A run of decoded samples of one series, oldest first. Values are raw
+/// bits as in Sample: counters as is, gauges as the bits of a double.
+/// Valid only during the callback it is passed to.
+struct SampleBlock {
+  uint32_t series;
+  SampleKind kind;
+  std::size_t n;
+  const int64_t* t_ms;
+  const uint64_t* v;
+};
+
+/// Rebuilds the Sample a decoded (`t_ms`, bits) pair came from.
+inline Sample decoded_sample(const ChunkMeta& m, int64_t t_ms, uint64_t v) {
+  Sample s{t_ms * kNsPerMs, m.series, m.kind, 0, 0, {}};
+  s.counter = v;
+  return s;
+}
+
+/// Immutable chunk; words and meta never change after construction. The
+/// words live either on the heap or in memory kept alive by `backing`,
+/// such as a mapped segment file.
+class SealedChunk {
+ public:
+  SealedChunk(const ChunkMeta& meta, std::unique_ptr<uint64_t[]> words)
+      : meta_(meta), owned_(std::move(words)), words_(owned_.get()) {}
+  SealedChunk(const ChunkMeta& meta, const uint64_t* words, std::shared_ptr<const void> backing)
+      : meta_(meta), backing_(std::move(backing)), words_(words) {}
+
+  const ChunkMeta& meta() const { return meta_; }
+  const uint64_t* words() const { return words_; }
+  std::size_t bytes() const { return meta_.words * sizeof(uint64_t); }
+  /// True when the words are not heap memory owned by this chunk.
+  bool mapped() const { return backing_ != nullptr; }
+
+  /// Calls fn(const Sample&) for samples in [from_ms, to_ms]; returns how many.
+  template <typename Fn>
+  std::size_t scan(int64_t from_ms, int64_t to_ms, Fn&& fn) const {
+    if (meta_.max_t_ms < from_ms || meta_.min_t_ms > to_ms) return 0;
+    ChunkDecoder<PlainWords> d(PlainWords{words_}, meta_.kind, meta_.count);
+    return drain(d, meta_, from_ms, to_ms, fn);
+  }
+
+  /// Like scan(), but calls fn(const SampleBlock&) with up to kDecodeBlock
+  /// samples at a time.
+  template <typename Fn>
+  std::size_t scan_blocks(int64_t from_ms, int64_t to_ms, Fn&& fn) const {
+    if (meta_.max_t_ms < from_ms || meta_.min_t_ms > to_ms) return 0;
+    ChunkDecoder<PlainWords> d(PlainWords{words_}, meta_.kind, meta_.count);
+    return drain_blocks(d, meta_, from_ms, to_ms, fn);
+  }
+
+  template <typename Decoder, typename Fn>
+  static std::size_t drain(Decoder& d, const ChunkMeta& m, int64_t from_ms, int64_t to_ms, Fn& fn) {
+    std::size_t n = 0;
+    int64_t t;
+    uint64_t v;
+    while (d.next(t, v) && t <= to_ms) {
+      if (t < from_ms) continue;
+      fn(decoded_sample(m, t, v));
+      ++n;
+    }
+    return n;
+  }
+
+  template <typename Decoder, typename Fn>
+  static std::size_t drain_blocks(Decoder& d, const ChunkMeta& m, int64_t from_ms, int64_t to_ms, Fn& fn) {
+    int64_t t[kDecodeBlock];
+    uint64_t v[kDecodeBlock];
+    std::size_t n = 0, total = 0;
+    while (d.next(t[n], v[n]) && t[n] <= to_ms) {
+      if (t[n] < from_ms) continue;
+      if (++n == kDecodeBlock) {
+        fn(SampleBlock{m.series, m.kind, n, t, v});
+        total += n;
+        n = 0;
+      }
+    }
+    if (n) fn(SampleBlock{m.series, m.kind, n, t, v});
+    return total + n;
+  }
+
+ private:
+  ChunkMeta meta_;
+  std::unique_ptr<uint64_t[]> owned_;
+  std::shared_ptr<const void> backing_;
+  const uint64_t* words_;
+};
+
+/// Chunk still being appended to. Writer methods must all be called from
+/// one thread; the const methods may run concurrently on any thread.
+class HeadChunk {
+ public:
+  HeadChunk(uint32_t series, SampleKind kind, std::size_t cap_words);
+
+  // --- writer ---
+
+  /// True if one more sample is guaranteed to fit.
+  bool has_room() const { return enc_.out.remaining_bits() >= kMaxSampleBits; }
+  /// Appends a sample; the caller keeps timestamps non-decreasing and
+  /// checks has_room() first.
+  void append(int64_t t_ms, uint64_t v);
+  /// Copy of this chunk with `cap_words` of room; appends continue there.
+  std::shared_ptr<HeadChunk> grow(std::size_t cap_words) const;
+  /// Trimmed immutable copy of everything appended so far.
+  std::shared_ptr<const SealedChunk> seal() const;
+  int64_t last_t_ms() const { return enc_.prev_t; }
+  uint64_t bits() const { return enc_.out.bit_pos(); }
+  std::size_t cap_words() const { return cap_; }
+
+  // --- readers ---
+
+  uint32_t series() const { return series_; }
+  SampleKind kind() const { return kind_; }
+  uint32_t count() const { return count_.load(std::memory_order_acquire); }
+  int64_t min_t_ms() const { return min_t_; }
+
+  template <typename Fn>
+  std::size_t scan(int64_t from_ms, int64_t to_ms, Fn&& fn) const {
+    uint32_t n = count();
+    if (n == 0 || min_t_ > to_ms || max_t_.load(std::memory_order_relaxed) < from_ms) return 0;
+    ChunkMeta m;
+    m.series = series_;
+    m.kind = kind_;
+    ChunkDecoder<AtomicWords> d(AtomicWords{words_.get()}, kind_, n);
+    return SealedChunk::drain(d, m, from_ms, to_ms, fn);
+  }
+
+  template <typename Fn>
+  std::size_t scan_blocks(int64_t from_ms, int64_t to_ms, Fn&& fn) const {
+    uint32_t n = count();
+    if (n == 0 || min_t_ > to_ms || max_t_.load(std::memory_order_relaxed) < from_ms) return 0;
+    ChunkMeta m;
+    m.series = series_;
+    m.kind = kind_;
+    ChunkDecoder<AtomicWords> d(AtomicWords{words_.get()}, kind_, n);
+    return SealedChunk::drain_blocks(d, m, from_ms, to_ms, fn);
+  }
+
+ private:
+  uint32_t series_;
+  SampleKind kind_;
+  std::size_t cap_;
+  std::unique_ptr<std::atomic<uint64_t>[]> words_;
+  std::atomic<uint32_t> count_{0};
+  int64_t min_t_ = 0;  // written before the first count is published
+  std::atomic<int64_t> max_t_{0};
+  ChunkEncoder enc_;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,183 @@
+// chunk_store.hpp — in-memory columnar store for recent samples.
+//
+// Each series keeps one compressed chunk per block (2 h by default): a list
+// of sealed, immutable chunks plus the head chunk being appended to. The
+// list and head are published together as one SeriesView behind an atomic
+// shared_ptr, swapped only when a head grows, seals or expires, so a reader
+// sees every sample exactly once and never waits for the writer.
+//
+// Series ids are resolved through a three-level radix of atomic pointers,
+// so the append path takes no locks: one writer thread (the aggregator)
+// appends, seals and expires; any number of threads may scan.
+//
+// Scans find their time range among a series' sealed chunks by binary
+// search on the chunk metas (the footer index entries, for chunks in
+// segment files), so only chunks overlapping it are decoded.
+//
+// With a SegmentStore attached, every sealed chunk is written to the active
+// segment file and replaced by a view into its mapping, so retained history
+// lives in page cache instead of the heap and survives restarts.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "sysapm/chunk.hpp"
+#include "sysapm/sample.hpp"
+#include "sysapm/segment.hpp"
+
+namespace sysapm {
+
+struct StoreOptions {
+  int64_t block_ns = 2 * 3600 * 1000000000ll;
+  int64_t retention_ns = 24 * 3600 * 1000000000ll;
+  std::size_t initial_chunk_words = 32;  // first head of a new series
+  std::size_t max_chunk_words = 4096;    // a full head seals early
+};
+
+struct StoreStats {
+  uint64_t series = 0;
+  uint64_t samples = 0;         // currently retained
+  uint64_t rejected = 0;        // out of order, or kind changed
+  uint64_t sealed_chunks = 0;   // currently retained
+  uint64_t expired_chunks = 0;
+  uint64_t bytes = 0;           // compressed stream bytes, heads included
+  uint64_t mapped_bytes = 0;    // part of `bytes` read from segment files
+  uint64_t untrusted_chunks = 0;  // left in segment files: ids the registry does not share
+
+  double bytes_per_sample() const { return samples ? static_cast<double>(bytes) / samples : 0.0; }
+};
+
+/// What a scan touched, summed over the scans it is passed to.
+struct ScanStats {
+  uint64_t chunks = 0;   // decoded, head chunks included
+  uint64_t skipped = 0;  // sealed chunks outside the range, never decoded
+};
+
+class ChunkStore {
+ public:
+  explicit ChunkStore(const StoreOptions& opts = {});
+  ~ChunkStore();
+  ChunkStore(const ChunkStore&) = delete;
+  ChunkStore& operator=(const ChunkStore&) = delete;
+
+  // --- writer thread ---
+
+  /// Writes future sealed chunks through `segments` and adopts the chunks
+  /// it already holds. Call before the first append. With `ids`, a chunk
+  /// is adopted only if that registry trusts its series id for the
+  /// chunk's segment (SeriesRegistry::trusted_ids()); the others stay in
+  /// their files until expired. Returns the number of chunks adopted.
+  std::size_t attach(SegmentStore* segments, const SeriesRegistry* ids = nullptr);
+
+  /// Appends one sample. Returns false if it was rejected; staleness
+  /// markers are accepted and not stored.
+  bool append(const Sample& s);
+  /// Appends a run of samples; returns how many were stored.
+  std::size_t append(const Sample* s, std::size_t n);
+  /// Seals every non-empty head, e.g. before shutdown.
+  void seal_all();
+  /// Drops sealed chunks that ended before `now_ns - retention`. Returns
+  /// the number dropped.
+  std::size_t expire(int64_t now_ns);
+
+  // --- any thread ---
+
+  /// Calls fn(const Sample&) for each sample of `series` in
+  /// [from_ns, to_ns], oldest first. Returns how many were delivered.
+  template <typename Fn>
+  std::size_t scan(uint32_t series, int64_t from_ns, int64_t to_ns, Fn&& fn, ScanStats* stats = nullptr) const {
+    std::size_t n = 0;
+    for_chunks(series, from_ns, to_ns, stats, [&](const auto& c, int64_t from, int64_t to) { n += c.scan(from, to, fn); });
+    return n;
+  }
+
+  /// Like scan(), but calls fn(const SampleBlock&) with up to kDecodeBlock
+  /// samples at a time; never mixes chunks in one block.
+  template <typename Fn>
+  std::size_t scan_blocks(uint32_t series, int64_t from_ns, int64_t to_ns, Fn&& fn,
+                          ScanStats* stats = nullptr) const {
+    std::size_t n = 0;
+    for_chunks(series, from_ns, to_ns, stats,
+               [&](const auto& c, int64_t from, int64_t to) { n += c.scan_blocks(from, to, fn); });
+    return n;
+  }
+
+  StoreStats stats() const;
+  const StoreOptions& options() const { return opts_; }
+
+ private:
+  struct SeriesView {
+    std::vector<std::shared_ptr<const SealedChunk>> sealed;
+    std::shared_ptr<const HeadChunk> head;
+  };
+
+  struct Series {
+    std::atomic<std::shared_ptr<const SeriesView>> view;
+    // Writer-only below.
+    std::shared_ptr<HeadChunk> head;
+    std::vector<std::shared_ptr<const SealedChunk>> sealed;
+    SampleKind kind = SampleKind::kGauge;  // fixed by the first sample
+    int64_t last_t_ms = 0;
+    int64_t block_end_ms = 0;
+    std::size_t next_words = 0;  // capacity for the next head
+  };
+
+  static constexpr unsigned kTopBits = 8, kMidBits = 12, kLeafBits = 12;
+  struct Leaf {
+    std::atomic<Series*> slot[1u << kLeafBits] = {};
+  };
+  struct Mid {
+    std::atomic<Leaf*> slot[1u << kMidBits] = {};
+  };
+
+  static int64_t floor_ms(int64_t ns) { return ns >= 0 ? ns / kNsPerMs : -((-ns + kNsPerMs - 1) / kNsPerMs); }
+
+  // Sealed chunks are in time order and never overlap.
+  template <typename Fn>
+  void for_chunks(uint32_t series, int64_t from_ns, int64_t to_ns, ScanStats* stats, Fn&& fn) const {
+    const Series* s = find(series);
+    if (!s) return;
+    std::shared_ptr<const SeriesView> v = s->view.load(std::memory_order_acquire);
+    const int64_t from = floor_ms(from_ns), to = floor_ms(to_ns);
+    const auto& sealed = v->sealed;
+    auto it = std::partition_point(sealed.begin(), sealed.end(),
+                                   [&](const auto& c) { return c->meta().max_t_ms < from; });
+    auto end = it;
+    while (end != sealed.end() && (*end)->meta().min_t_ms <= to) ++end;
+    for (auto c = it; c != end; ++c) fn(**c, from, to);
+    if (v->head) fn(*v->head, from, to);
+    if (stats) {
+      stats->chunks += static_cast<uint64_t>(end - it) + (v->head ? 1 : 0);
+      stats->skipped += static_cast<uint64_t>(sealed.size()) - static_cast<uint64_t>(end - it);
+    }
+  }
+
+  const Series* find(uint32_t id) const;
+  Series* find_or_create(uint32_t id);
+  void publish(Series& s);
+  void seal(Series& s);
+  void account_sealed(const SealedChunk& c, int64_t sign);
+
+  StoreOptions opts_;
+  std::atomic<Mid*> top_[1u << kTopBits] = {};
+  std::vector<std::unique_ptr<Series>> all_;  // writer-only, for seal/expire
+  SegmentStore* segments_ = nullptr;
+
+  // Published with relaxed stores by the writer for stats().
+  std::atomic<uint64_t> series_{0};
+  std::atomic<uint64_t> samples_{0};
+  std::atomic<uint64_t> rejected_{0};
+  std::atomic<uint64_t> sealed_chunks_{0};
+  std::atomic<uint64_t> expired_chunks_{0};
+  std::atomic<uint64_t> sealed_bytes_{0};
+  std::atomic<uint64_t> mapped_bytes_{0};
+  std::atomic<uint64_t> head_bits_{0};
+  uint64_t untrusted_ = 0;  // attach() only, before any reader
+};
+
+}  // namespace sysapm
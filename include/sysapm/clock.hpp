@@ -0,0 +1,23 @@
+// clock.hpp — the clocks the agent reads, in nanoseconds.
+//
+// Timestamps that leave the process (samples, segment headers) are
+// CLOCK_REALTIME. Deadlines, timeouts and durations are CLOCK_MONOTONIC,
+// which an NTP step does not move.
+#pragma once
+
+#include <time.h>
+
+#include <cstdint>
+
+namespace sysapm {
+
+inline int64_t clock_ns(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+inline int64_t realtime_ns() { return clock_ns(CLOCK_REALTIME); }
+inline int64_t mono_ns() { return clock_ns(CLOCK_MONOTONIC); }
+
+}  // namespace sysapm
@@ -0,0 +1,38 @@
+// collector.hpp — interface implemented by every metric collector.
+//
+// A collector is driven once per tick by its own thread and appends that
+// tick's samples to a caller-owned batch. The batch keeps its capacity
+// between ticks, so steady-state collection does not allocate. Series ids
+// come from the SeriesRegistry the driver binds; collectors intern a row's
+// series the first time it appears and reuse the cached ids afterwards.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "sysapm/sample.hpp"
+#include "sysapm/series_registry.hpp"
+
+namespace sysapm {
+
+class Collector {
+ public:
+  virtual ~Collector() = default;
+
+  virtual const char* name() const = 0;
+
+  /// Appends this tick's samples to `out`. Returns 0 or -errno; samples
+  /// appended before an error are still published.
+  virtual int collect(std::vector<Sample>& out) = 0;
+
+  /// Selects the registry series are interned into; only valid before the
+  /// first collect().
+  void bind_registry(SeriesRegistry* registry) { registry_ = registry; }
+  SeriesRegistry& registry() const { return registry_ ? *registry_ : default_registry(); }
+
+ private:
+  SeriesRegistry* registry_ = nullptr;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,231 @@
+// exporter.hpp — batched, compressed, pipelined metric export.
+//
+// ExportEncoder writes Prometheus remote-write or OTLP/protobuf messages
+// straight from samples and rollup points into one reused buffer through
+// ProtoWriter: series names are resolved from the registry as they are
+// written, nothing is built per point, and a warm encoder allocates
+// nothing. Samples can come from ChunkStore::scan() as well as the rollup
+// stage, so replaying history and live export share one path.
+//
+//   remote write  one TimeSeries per point; labels are __name__ then the
+//                 registry's (sorted) labels; the value is the last one in
+//                 the window and histograms become <metric>_count/_sum
+//   OTLP          one ResourceMetrics/ScopeMetrics; consecutive points of
+//                 the same metric share a Metric. Gauges are Gauge, counters
+//                 cumulative monotonic Sum, histograms delta Histogram with
+//                 the snapshot's buckets as explicit bounds
+//   agent         system-apm's own batch, for an aggregator (aggregator.hpp):
+//                 every rollup field and the encoded histogram, so windows
+//                 from many agents merge exactly. Resource attributes go
+//                 once per batch
+//
+// Exporter batches points, Snappy-compresses each batch with a reused
+// compressor and POSTs it over a single persistent HTTP/1.1 connection,
+// with up to max_in_flight requests pipelined on it, so a flush costs no
+// connection setup and no round trip per batch. Requests that fail with
+// 5xx/429, or are in flight when the connection drops, are resent after a
+// reconnect with backoff; other 4xx are dropped, as remote write expects.
+// A bounded queue absorbs short outages. Past it, batches go to the
+// on-disk Spool when one is configured, or else the oldest is dropped.
+// While the spool holds anything every new batch goes through it too, so
+// batches still reach the backend in order; pump() refills the queue from
+// the spool at replay_bytes_per_sec once the queue has room.
+//
+// Single-threaded and non-blocking: the aggregator thread feeds add() and
+// drives I/O with pump().
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "sysapm/proto.hpp"
+#include "sysapm/rollup.hpp"
+#include "sysapm/sample.hpp"
+#include "sysapm/series_registry.hpp"
+#include "sysapm/snappy.hpp"
+#include "sysapm/spool.hpp"
+
+namespace sysapm {
+
+enum class ExportFormat : uint8_t { kRemoteWrite, kOtlp, kAgent };
+
+/// Field numbers of an agent batch, shared with the aggregator:
+///   Batch { resource = 1 (Label { name = 1, value = 2 }), points = 2 }
+///   Point { metric = 1, labels = 2 (Label), kind = 3, width_ns = 4,
+///           start_ns = 5, ts_ns = 6, count = 7, min = 8, max = 9, sum = 10,
+///           gauge = 11, counter = 12, stale = 13, histogram = 14 }
+/// width_ns is 0 for a raw sample; the histogram is HistogramSnapshot::encode().
+namespace agent_wire {
+enum : uint32_t { kResource = 1, kPoints = 2 };
+enum : uint32_t { kMetric = 1, kLabels, kKind, kWidth, kStart, kTs, kCount, kMin, kMax, kSum, kGauge, kCounter, kStale,
+                  kHistogram };
+enum : uint64_t { kGaugeKind = 0, kCounterKind = 1, kHistogramKind = 2 };
+}  // namespace agent_wire
+
+class ExportEncoder {
+ public:
+  ExportEncoder(ExportFormat format, const SeriesRegistry* registry);
+
+  /// Resource attributes for OTLP and agent batches (e.g. host.name);
+  /// ignored for remote write. The strings are copied.
+  void set_resource(const std::vector<Label>& attrs);
+  /// Agent batches: widths of the rollup windows RollupPoint::window
+  /// indexes. Points of other windows are sent as raw samples.
+  void set_windows(const std::vector<int64_t>& widths_ns) { windows_ = widths_ns; }
+
+  /// Starts a message in `out`, replacing its contents.
+  void begin(std::vector<uint8_t>* out);
+  /// Points of unknown series are skipped.
+  void add(const Sample& s);
+  void add(const RollupPoint& p);
+  /// Completes the message and returns the offset in `out` where it starts
+  /// (OTLP writes its envelope in front of the body, into reserved space).
+  std::size_t finish();
+
+  ExportFormat format() const { return format_; }
+  /// Points added since begin().
+  std::size_t points() const { return points_; }
+
+ private:
+  void series_rw(uint32_t id, std::string_view suffix, double value, int64_t ts_ns);
+  void metric_otlp(uint32_t id, int kind);
+  void attributes_otlp(uint32_t id, uint32_t field);
+  void close_metric();
+  void histogram_otlp(const RollupPoint& p);
+  void point_agent(const Sample& s, int64_t width_ns, const RollupPoint* p);
+
+  ExportFormat format_;
+  const SeriesRegistry* registry_;
+  std::vector<uint8_t> envelope_;  // OTLP: encoded resource, then scope
+  std::size_t resource_len_ = 0;
+  std::vector<uint8_t>* out_ = nullptr;
+  ProtoWriter w_{nullptr};
+  std::size_t points_ = 0;
+  std::string name_;  // scratch for suffixed metric names
+  std::vector<int64_t> windows_;
+  std::vector<uint8_t> hist_;  // scratch for encoded histograms
+  // OTLP: the currently open Metric and its data container, and what they hold.
+  std::size_t metric_mark_ = 0, data_mark_ = 0;
+  bool metric_open_ = false;
+  std::string_view metric_name_;
+  int metric_kind_ = -1;
+};
+
+struct ExporterOptions {
+  std::string host = "127.0.0.1";
+  uint16_t port = 9090;
+  std::string path = "/api/v1/write";
+  ExportFormat format = ExportFormat::kRemoteWrite;
+  bool compress = true;
+  std::size_t batch_points = 5000;
+  std::size_t max_in_flight = 4;  // pipelined requests awaiting responses
+  std::size_t max_queued = 64;    // encoded batches held while the gateway lags
+  int64_t min_backoff_ns = 250000000;
+  int64_t max_backoff_ns = 30000000000;
+  std::vector<Label> resource;  // OTLP and agent resource attributes, encoded by open()
+  std::vector<int64_t> windows_ns = RollupOptions{}.windows_ns;  // agent batches: see set_windows()
+  std::string spool_dir;        // empty: no spool, a full queue drops
+  std::size_t spool_bytes = 256u << 20;
+  double replay_bytes_per_sec = 4u << 20;  // body bytes replayed from the spool
+};
+
+/// Parses "HOST:PORT[/PATH]". Returns 0 or -EINVAL.
+int parse_export_target(std::string_view target, ExporterOptions* out);
+
+struct ExporterStats {
+  uint64_t points = 0;
+  uint64_t batches = 0;
+  uint64_t requests = 0;  // sent, including retries
+  uint64_t accepted = 0;  // 2xx responses
+  uint64_t rejected = 0;  // batches dropped on a non-retryable status
+  uint64_t retries = 0;
+  uint64_t dropped = 0;  // batches dropped from a full queue, or evicted from the spool
+  uint64_t spooled = 0;  // batches written to the spool
+  uint64_t replayed = 0;  // batches read back from it
+  uint64_t connects = 0;
+  uint64_t raw_bytes = 0;
+  uint64_t sent_bytes = 0;
+};
+
+class Exporter {
+ public:
+  Exporter() = default;
+  ~Exporter();
+  Exporter(const Exporter&) = delete;
+  Exporter& operator=(const Exporter&) = delete;
+
+  /// Resolves the target; the connection is made by pump(). Returns 0 or
+  /// -EINVAL / -EHOSTUNREACH.
+  int open(const ExporterOptions& opts, const SeriesRegistry* registry);
+  void close();
+
+  void add(const Sample* s, std::size_t n);
+  void add(const RollupPoint* p, std::size_t n);
+  /// Seals the partial batch so the next pump() sends it.
+  void flush();
+
+  /// Connects, writes and reads without blocking for longer than
+  /// `timeout_ms`. Returns 0 or -errno of a connection error (which is
+  /// retried on later calls).
+  int pump(int timeout_ms = 0);
+  /// True when every batch has been answered.
+  bool idle() const { return queue_.empty() && !encoding_ && (!spool_ || spool_->empty()); }
+
+  const ExporterStats& stats() const { return stats_; }
+  /// Zeroes when there is no spool.
+  SpoolStats spool_stats() const { return spool_ ? spool_->stats() : SpoolStats{}; }
+
+ private:
+  struct Request {
+    std::vector<uint8_t> raw;   // encoded message
+    std::vector<uint8_t> wire;  // compressed, when enabled
+    std::string head;
+    std::size_t offset = 0;  // where the message starts in `raw`
+    std::size_t points = 0;
+  };
+
+  void start_batch();
+  void seal_batch();
+  void write_head(Request& r, std::size_t body_len);
+  bool spill(Request& r);
+  void replay(int64_t now);
+  void recycle(std::unique_ptr<Request> r);
+  void back_off(int64_t now);
+  int connect_now(int64_t now);
+  void disconnect(int64_t now, bool failed);
+  bool want_write(int64_t now) const;
+  int write_some(int64_t now);
+  int read_some(int64_t now);
+  int parse_responses(int64_t now);
+
+  ExporterOptions opts_;
+  std::unique_ptr<ExportEncoder> enc_;
+  SnappyCompressor snappy_;
+  std::vector<unsigned char> addr_;  // resolved sockaddr
+  int family_ = 0;
+  std::deque<std::unique_ptr<Request>> queue_;  // oldest first; the first in_flight_ are written
+  std::vector<std::unique_ptr<Request>> free_;
+  std::unique_ptr<Request> batch_;  // being encoded
+  bool encoding_ = false;
+  int fd_ = -1;
+  bool connecting_ = false;
+  std::size_t in_flight_ = 0;
+  bool partial_ = false;     // queue_[in_flight_ - 1] is still being written
+  std::size_t write_off_ = 0;  // bytes of its head and body written
+  std::string rbuf_;
+  int64_t retry_at_ = 0;  // no connecting or (re)sending before this
+  int64_t backoff_ns_ = 0;
+  std::unique_ptr<Spool> spool_;
+  std::vector<uint8_t> replay_buf_;
+  double replay_tokens_ = 0;  // body bytes replay may still send
+  int64_t replay_refill_ns_ = 0;
+  uint64_t spool_dropped_ = 0;  // spool evictions already counted in stats_.dropped
+  ExporterStats stats_;
+};
+
+}  // namespace sysapm
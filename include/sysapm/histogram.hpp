@@ -0,0 +1,144 @@
+// histogram.hpp — fixed-memory log-linear histograms.
+//
+// Values are bucketed HDR-style: exact below 2^sub_bits, then 2^sub_bits
+// linear sub-buckets per power of two, so every bucket is within
+// 2^-sub_bits of its values (6.25% at the default 4 bits) and the whole
+// range up to 2^max_bits costs (max_bits - sub_bits + 1) << sub_bits
+// counters. Larger values land in the last bucket.
+//
+// Histogram is the recording side: one cache-line-aligned array of
+// counters per shard, and a thread always records into the same shard,
+// with a single relaxed fetch_add. snapshot() sums the shards without
+// stopping writers; a snapshot taken while recording is in flight may miss
+// the latest increments but never sees a count go backwards.
+//
+// HistogramSnapshot is plain counts. Snapshots with the same layout merge
+// exactly (bucket-wise sums), including after encode()/decode() on
+// another host, so the collector tier's quantiles are those of the union.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sysapm {
+
+struct HistogramLayout {
+  uint8_t sub_bits = 4;
+  uint8_t max_bits = 40;  // ns: about 18 minutes
+
+  bool valid() const { return sub_bits >= 1 && sub_bits <= 8 && max_bits > sub_bits && max_bits <= 64; }
+  bool operator==(const HistogramLayout& o) const { return sub_bits == o.sub_bits && max_bits == o.max_bits; }
+
+  std::size_t buckets() const { return std::size_t{max_bits - sub_bits + 1u} << sub_bits; }
+
+  std::size_t index(uint64_t v) const {
+    if (v < (uint64_t{1} << sub_bits)) return static_cast<std::size_t>(v);
+    const unsigned e = 63u - static_cast<unsigned>(__builtin_clzll(v));
+    if (e >= max_bits) return buckets() - 1;
+    const unsigned shift = e - sub_bits;
+    return (std::size_t{shift + 1u} << sub_bits) + static_cast<std::size_t>((v >> shift) - (uint64_t{1} << sub_bits));
+  }
+
+  /// Smallest value in bucket `i`.
+  uint64_t lower(std::size_t i) const {
+    if (i < (std::size_t{1} << sub_bits)) return i;
+    const std::size_t group = i >> sub_bits;
+    const uint64_t mantissa = (i & ((std::size_t{1} << sub_bits) - 1)) + (uint64_t{1} << sub_bits);
+    return mantissa << (group - 1);
+  }
+
+  /// Largest value in bucket `i` (the last bucket is open-ended nominally
+  /// but reports its regular width).
+  uint64_t upper(std::size_t i) const { return lower(i + 1) - 1; }
+};
+
+class HistogramSnapshot {
+ public:
+  HistogramSnapshot() = default;
+  explicit HistogramSnapshot(HistogramLayout layout) : layout_(layout), counts_(layout.buckets()) {}
+
+  const HistogramLayout& layout() const { return layout_; }
+  const std::vector<uint64_t>& counts() const { return counts_; }
+  uint64_t count() const { return total_; }
+
+  void add(uint64_t v, uint64_t n = 1) {
+    counts_[layout_.index(v)] += n;
+    total_ += n;
+  }
+
+  /// Adds `other` bucket-wise. Returns 0, or -EINVAL if the layouts differ.
+  int merge(const HistogramSnapshot& other);
+  /// Removes an earlier snapshot of the same histogram, leaving what was
+  /// recorded in between. Returns 0, or -EINVAL if the layouts differ.
+  int subtract(const HistogramSnapshot& earlier);
+
+  /// Value at quantile `q` in [0, 1]: the upper bound of the bucket holding
+  /// that rank, so it is never below the true value. 0 when empty.
+  uint64_t quantile(double q) const;
+  /// Approximate mean from bucket midpoints.
+  double mean() const;
+
+  /// Compact wire form: layout, then (index delta, count) varint pairs for
+  /// the non-empty buckets. Appends to `out`.
+  void encode(std::vector<uint8_t>* out) const;
+  /// Replaces this snapshot with a decoded one. Returns bytes consumed or
+  /// -EINVAL on malformed input.
+  int decode(const uint8_t* data, std::size_t len);
+
+ private:
+  friend class Histogram;
+
+  HistogramLayout layout_;
+  std::vector<uint64_t> counts_;
+  uint64_t total_ = 0;
+};
+
+namespace detail {
+
+/// Small per-thread number handed out round-robin; picks a thread's shard.
+inline unsigned thread_slot() {
+  static std::atomic<unsigned> next{0};
+  thread_local const unsigned slot = next.fetch_add(1, std::memory_order_relaxed);
+  return slot;
+}
+
+}  // namespace detail
+
+class Histogram {
+ public:
+  /// `shards` is rounded up to a power of two; 0 picks one per hardware
+  /// thread, up to 64. Single-writer histograms want 1.
+  explicit Histogram(HistogramLayout layout = {}, std::size_t shards = 0);
+  ~Histogram();
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  void record(uint64_t v) {
+    counts_[shard_base() + layout_.index(v)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// Sums every shard into `out`, reusing its storage.
+  void snapshot(HistogramSnapshot* out) const;
+  HistogramSnapshot snapshot() const {
+    HistogramSnapshot s;
+    snapshot(&s);
+    return s;
+  }
+
+  const HistogramLayout& layout() const { return layout_; }
+  std::size_t shards() const { return shards_; }
+  std::size_t memory_bytes() const { return shards_ * stride_ * sizeof(counts_[0]); }
+
+ private:
+  std::size_t shard_base() const { return (detail::thread_slot() & shard_mask_) * stride_; }
+
+  HistogramLayout layout_;
+  std::size_t shards_;
+  std::size_t shard_mask_;
+  std::size_t stride_;  // counters per shard, padded to a cache line
+  std::atomic<uint64_t>* counts_;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,110 @@
+// host_collectors.hpp — collectors for host-wide /proc tables.
+//
+// Each collector owns a ProcSampler opened for just its own files, so the
+// CPU, memory, network and disk collectors can run on separate threads
+// without sharing buffers.
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+#include "sysapm/collector.hpp"
+#include "sysapm/proc_sampler.hpp"
+#include "sysapm/process_collector.hpp"
+
+namespace sysapm {
+
+/// Stable small-integer slots for device names, so a device keeps its
+/// series ids when others appear or disappear around it.
+class NameSlots {
+ public:
+  explicit NameSlots(std::size_t capacity) : names_(capacity) {}
+
+  /// Slot for `name`, assigning a free one on first sight; -1 when full.
+  /// `hint` is checked first: devices usually keep their row position.
+  int find_or_add(std::string_view name, std::size_t hint);
+
+  const char* name(std::size_t slot) const {
+    return slot < used_ ? names_[slot].s : nullptr;
+  }
+
+ private:
+  struct Name {
+    char s[32];
+  };
+  std::vector<Name> names_;
+  std::size_t used_ = 0;
+};
+
+class CpuCollector final : public Collector {
+ public:
+  int open(const SamplerOptions& opts);
+  const char* name() const override { return "cpu"; }
+  int collect(std::vector<Sample>& out) override;
+
+ private:
+  void intern_rows(std::size_t rows);
+
+  ProcSampler sampler_;
+  std::vector<uint32_t> row_ids_;  // kCpuFieldCount per row, all-CPU row first
+  uint32_t host_ids_[kStatSchema.size()] = {};
+};
+
+class MemoryCollector final : public Collector {
+ public:
+  int open(const SamplerOptions& opts);
+  const char* name() const override { return "memory"; }
+  int collect(std::vector<Sample>& out) override;
+
+  static constexpr std::size_t kSeries = 27;
+
+ private:
+  ProcSampler sampler_;
+  uint32_t ids_[kSeries] = {};
+};
+
+class NetCollector final : public Collector {
+ public:
+  int open(const SamplerOptions& opts);
+  const char* name() const override { return "net"; }
+  int collect(std::vector<Sample>& out) override;
+
+ private:
+  static constexpr std::size_t kSlots = 256;
+
+  ProcSampler sampler_;
+  NameSlots slots_{kSlots};
+  std::vector<uint32_t> ids_ = std::vector<uint32_t>(kSlots * kNetFieldCount);  // 0 until interned
+};
+
+class DiskCollector final : public Collector {
+ public:
+  int open(const SamplerOptions& opts);
+  const char* name() const override { return "disk"; }
+  int collect(std::vector<Sample>& out) override;
+
+ private:
+  static constexpr std::size_t kSlots = 1024;
+
+  ProcSampler sampler_;
+  NameSlots slots_{kSlots};
+  std::vector<uint32_t> ids_ = std::vector<uint32_t>(kSlots * kDiskFieldCount);  // 0 until interned
+};
+
+/// Host-level rollup of the per-process table: counts by state, threads,
+/// and total CPU and RSS across live processes.
+class ProcessSummaryCollector final : public Collector {
+ public:
+  int open(const ProcessCollectorOptions& opts);
+  const char* name() const override { return "process"; }
+  int collect(std::vector<Sample>& out) override;
+
+  const ProcessCollector& processes() const { return procs_; }
+
+ private:
+  ProcessCollector procs_;
+  uint32_t ids_[8] = {};
+};
+
+}  // namespace sysapm
@@ -0,0 +1,98 @@
+// io_ring.hpp — minimal io_uring wrapper for batched /proc reads.
+//
+// Samplers queue one read per persistent fd and submit them all with a
+// single io_uring_enter, instead of one pread each; on a host with a few
+// thousand processes that turns thousands of syscalls per tick into a
+// handful. Reads target registered buffers (READ_FIXED), and fds that live
+// as long as the ring can be registered too.
+//
+// Talks to the kernel through the raw syscalls (no liburing). open() fails
+// with -ENOSYS on kernels without io_uring and -EPERM where it is disabled
+// (kernel.io_uring_disabled, seccomp); callers then keep their pread path.
+// A ring is used by one thread.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+namespace sysapm {
+
+/// How a sampler reads its files.
+enum class IoBackend {
+  kRead,   // one pread per file
+  kUring,  // batched through an IoRing; open() fails without it
+  kAuto,   // kUring when available, kRead otherwise
+};
+
+class IoRing {
+ public:
+  IoRing() = default;
+  ~IoRing();
+  IoRing(const IoRing&) = delete;
+  IoRing& operator=(const IoRing&) = delete;
+
+  /// Sets up a ring with at least `entries` submission slots. Returns 0 or
+  /// -errno.
+  int open(unsigned entries);
+  void close();
+  bool is_open() const { return fd_ >= 0; }
+  /// Submission slots; at most this many reads can be queued per submit().
+  unsigned capacity() const { return sq_entries_; }
+
+  /// Registers fds for IOSQE_FIXED_FILE use (index = position) or buffers
+  /// for READ_FIXED (index = position). Registering again replaces the
+  /// previous set. Return 0 or -errno.
+  int register_files(const int* fds, unsigned n);
+  int register_buffers(const iovec* bufs, unsigned n);
+
+  /// Queues a read of `len` bytes at `offset` into `buf`, which must lie
+  /// in registered buffer `buf_index`. `file` is a registered file index
+  /// when `fixed_file`, else an fd. Returns false when the queue is full.
+  bool read_fixed(int file, bool fixed_file, void* buf, uint32_t len, uint64_t offset, uint16_t buf_index,
+                  uint64_t user_data);
+
+  /// Submits everything queued and waits until `wait` completions are
+  /// available. Returns the number submitted or -errno.
+  int submit(unsigned wait);
+
+  /// Calls fn(user_data, res) for every available completion, where res is
+  /// bytes read or -errno. Returns how many were consumed.
+  template <typename Fn>
+  unsigned reap(Fn&& fn) {
+    unsigned head = *cq_head_;
+    const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned n = 0;
+    for (; head != tail; ++head, ++n) {
+      const io_uring_cqe& c = cqes_[head & cq_mask_];
+      fn(c.user_data, c.res);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return n;
+  }
+
+  /// io_uring_enter calls made so far, for syscall accounting.
+  uint64_t enters() const { return enters_; }
+
+ private:
+  int fd_ = -1;
+  void* sq_ring_ = nullptr;
+  void* cq_ring_ = nullptr;  // == sq_ring_ with IORING_FEAT_SINGLE_MMAP
+  std::size_t sq_ring_bytes_ = 0, cq_ring_bytes_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  std::size_t sqes_bytes_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned sq_mask_ = 0, sq_entries_ = 0;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+  unsigned cq_mask_ = 0;
+  unsigned queued_ = 0;  // SQEs written since the last submit()
+  bool files_ = false, buffers_ = false;
+  uint64_t enters_ = 0;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,49 @@
+// num_scan.hpp — vectorized scanner for whitespace-separated decimal rows.
+//
+// /proc/stat, /proc/diskstats and /proc/net/dev are tables of unsigned
+// decimals. scan_u64_row() converts the numeric fields of one row into a
+// fixed-width uint64_t array in a single pass. On x86-64 the row is
+// classified 32 bytes at a time with SSE4.2 or AVX2 and each digit run is
+// converted with a multiply-add reduction; the implementation is picked once
+// at startup from CPUID, with a portable scalar fallback.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sysapm {
+
+enum class ScanImpl { kScalar, kSse42, kAvx2 };
+
+/// Scans fields starting at `p`, never reading at or past `end`.
+///
+/// Stops at the first of: `max` fields stored, a newline, a token that is
+/// not purely decimal (e.g. "sda" or "eth0:"), or `end`. `*stop` receives
+/// the position it stopped at — the newline, the start of the offending
+/// token, or just past the last stored field. Returns the field count.
+using ScanFn = std::size_t (*)(const char* p, const char* end, uint64_t* out,
+                               std::size_t max, const char** stop);
+
+/// Best implementation supported by this CPU.
+ScanImpl detect_scan_impl();
+
+/// Entry point for a given implementation; unsupported ones map to scalar.
+ScanFn scan_fn(ScanImpl impl);
+
+const char* scan_impl_name(ScanImpl impl);
+
+/// Overrides the dispatched implementation (tests and benchmarks).
+void set_scan_impl(ScanImpl impl);
+ScanImpl active_scan_impl();
+
+namespace detail {
+extern ScanFn g_scan;
+}
+
+/// Dispatching entry point used by the collectors.
+inline std::size_t scan_u64_row(const char* p, const char* end, uint64_t* out,
+                                std::size_t max, const char** stop) {
+  return detail::g_scan(p, end, out, max, stop);
+}
+
+}  // namespace sysapm
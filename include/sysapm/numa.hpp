@@ -0,0 +1,43 @@
+// numa.hpp — NUMA topology and node-local memory.
+//
+// On a multi-socket host every access to a cache line another socket owns
+// crosses the interconnect. The agent keeps its per-CPU work on the node
+// it describes: the ThreadPool can spread its workers over the nodes and
+// pin each to its node's CPUs, node-bound tasks are queued to that node's
+// workers, and state read there (the perf groups, say) is allocated from
+// node-local memory. Results meet only where they are merged into a
+// collector's batch.
+//
+// The topology comes from /sys/devices/system/node; nodes without CPUs
+// (memory-only or CXL expanders) are left out. Memory is bound with
+// mbind(MPOL_PREFERRED), so a node that runs out falls back to another
+// instead of failing, and a kernel without NUMA support just gets the
+// default policy.
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace sysapm {
+
+struct NumaNode {
+  int id;
+  std::vector<int> cpus;  // ascending
+};
+
+/// Reads the nodes that have CPUs from <sys_root>/devices/system/node,
+/// sorted by id. Returns 0, or -ENOENT when the kernel lists no nodes.
+int read_numa_topology(std::vector<NumaNode>* out, const std::string& sys_root = "/sys");
+
+/// The id of the node `cpu` belongs to, or -1.
+int numa_node_of(const std::vector<NumaNode>& nodes, int cpu);
+
+/// `bytes` of zeroed, page-aligned anonymous memory preferring `node`
+/// (any node when negative). Returns nullptr when the mapping fails; a
+/// refused binding is not a failure.
+void* numa_alloc(std::size_t bytes, int node);
+/// Releases numa_alloc() memory; `bytes` as allocated.
+void numa_free(void* p, std::size_t bytes);
+
+}  // namespace sysapm
@@ -0,0 +1,193 @@
+// perf_collector.hpp — hardware counters per CPU and per cgroup.
+//
+// Each scope (a CPU, or a cgroup on one CPU) gets one perf_event group:
+// cycles leads it, then instructions, LLC misses and branch misses. Groups
+// are read with PERF_FORMAT_GROUP | TOTAL_TIME_ENABLED | TOTAL_TIME_RUNNING,
+// so one read() returns every counter of the group and the time it was
+// actually on the PMU. When more groups than the PMU has counters compete
+// the kernel multiplexes them; the collector scales each tick's delta by
+// enabled/running time over that tick and adds it to its own running
+// total, so the published counters stay monotonic even as the ratio moves.
+//
+//   perf_<event>_total{cpu}     perf_<event>_total{cgroup}
+//   perf_ipc{cpu|cgroup}        instructions per cycle over the last tick
+//   perf_running_ratio{cpu|cgroup}   fraction of the tick the group counted
+//
+// A cgroup's series sum its groups across CPUs. Events a PMU does not
+// offer are left out of every group; without the leader nothing opens.
+//
+// Group reads are independent, so with a ThreadPool they are sharded into
+// tasks of shard_groups reads each. Given the NUMA nodes, the groups of
+// each node live in that node's memory and its reads go to its own pool
+// workers, so a tick's reads stay off the interconnect and only the
+// per-scope sums cross it. The collecting thread also counts its
+// own cycles and instructions in a self-monitoring group read with rdpmc
+// from the group's mmap page where the CPU allows it (no syscall), and
+// publishes them as system_apm_self_perf_*, so the collector's own cost
+// stays visible. Needs CAP_PERFMON (or perf_event_paranoid <= 0) for
+// per-CPU events.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "sysapm/arena.hpp"
+#include "sysapm/collector.hpp"
+#include "sysapm/numa.hpp"
+#include "sysapm/thread_pool.hpp"
+
+struct perf_event_mmap_page;
+
+namespace sysapm {
+
+struct PerfEventSpec {
+  uint32_t type;    // PERF_TYPE_*
+  uint64_t config;
+  const char* name;  // series infix: perf_<name>_total
+};
+
+/// Events one group can hold, leader included.
+inline constexpr std::size_t kMaxPerfEvents = 8;
+
+/// cycles, instructions, llc_misses, branch_misses.
+const std::vector<PerfEventSpec>& default_perf_events();
+
+/// `delta` scaled for a group that counted `running` of `enabled` ns.
+inline uint64_t perf_scale(uint64_t delta, uint64_t enabled, uint64_t running) {
+  if (running == 0) return 0;
+  if (running >= enabled) return delta;
+  return static_cast<uint64_t>(static_cast<unsigned __int128>(delta) * enabled / running);
+}
+
+/// One perf_event group: a leader and up to kMaxPerfEvents - 1 members.
+class PerfGroup {
+ public:
+  PerfGroup() = default;
+  ~PerfGroup();
+  PerfGroup(const PerfGroup&) = delete;
+  PerfGroup& operator=(const PerfGroup&) = delete;
+
+  /// Opens `events` as a group on (pid, cpu), as perf_event_open() takes
+  /// them, and enables it. Members the PMU refuses are skipped and report
+  /// 0; a refused leader fails the group. A task group the kernel refuses
+  /// is retried counting user space only. Returns 0 or -errno. With
+  /// `mmap_pages`, maps each event's page so read() can try rdpmc.
+  int open(const std::vector<PerfEventSpec>& events, int pid, int cpu, unsigned long flags = 0,
+           bool mmap_pages = false);
+  void close();
+  bool is_open() const { return fds_[0] >= 0; }
+
+  /// Reads the group and folds the scaled deltas into totals(). Returns 0
+  /// or -errno.
+  int read();
+
+  /// Scaled running totals, indexed like the `events` passed to open().
+  const uint64_t* totals() const { return totals_; }
+  /// Scaled delta of each event over the last read().
+  const uint64_t* deltas() const { return deltas_; }
+  /// Enabled and running ns over the last read().
+  uint64_t last_enabled_ns() const { return d_enabled_; }
+  uint64_t last_running_ns() const { return d_running_; }
+  /// Whether the last read() used rdpmc.
+  bool last_read_rdpmc() const { return last_rdpmc_; }
+  /// Events of open()'s list that are counting; bit i for event i.
+  uint32_t present() const { return present_; }
+
+ private:
+  bool read_rdpmc(uint64_t* raw, uint64_t* enabled, uint64_t* running) const;
+  void fold(const uint64_t* raw, uint64_t enabled, uint64_t running);
+
+  std::size_t n_ = 0;                     // events passed to open()
+  int fds_[kMaxPerfEvents] = {-1, -1, -1, -1, -1, -1, -1, -1};
+  int slot_[kMaxPerfEvents] = {};          // position in the group read, -1 if absent
+  std::size_t opened_ = 0;                // events in the kernel group
+  perf_event_mmap_page* pages_[kMaxPerfEvents] = {};
+  uint32_t present_ = 0;
+  uint64_t last_raw_[kMaxPerfEvents] = {};
+  uint64_t last_enabled_ = 0, last_running_ = 0;
+  uint64_t totals_[kMaxPerfEvents] = {};
+  uint64_t deltas_[kMaxPerfEvents] = {};
+  uint64_t d_enabled_ = 0, d_running_ = 0;
+  bool last_rdpmc_ = false;
+};
+
+struct PerfOptions {
+  std::vector<PerfEventSpec> events;  // empty: default_perf_events(); the first leads
+  bool per_cpu = true;
+  std::vector<std::string> cgroups;   // paths under cgroup_root, counted on every CPU
+  std::string cgroup_root;            // empty: found through /proc/self/mounts
+  ThreadPool* pool = nullptr;         // shard group reads here; must outlive the collector
+  std::size_t shard_groups = 32;      // reads per task
+  std::vector<NumaNode> nodes;        // shard reads and place groups per node; empty: no placement
+  bool self = true;                   // the collecting thread's own counters
+};
+
+/// Parses "cgroups=/a:/b,per_cpu=0,shard=64,self=0"; cgroup paths are
+/// separated by ':'. Returns 0 or -EINVAL.
+int parse_perf_options(std::string_view args, PerfOptions* out);
+
+struct PerfStats {
+  uint64_t groups = 0;       // open
+  uint64_t reads = 0;        // group reads, summed over ticks
+  uint64_t read_errors = 0;
+  uint64_t self_rdpmc = 0;   // self reads served by rdpmc
+  uint64_t self_syscall = 0; // and by read()
+  uint64_t shards = 0;       // read tasks handed to the pool
+};
+
+class PerfCollector final : public Collector {
+ public:
+  PerfCollector() = default;
+  ~PerfCollector() override;
+
+  /// Opens every group. Returns 0, or -errno when no group could be
+  /// opened (no PMU, no permission).
+  int open(const PerfOptions& opts);
+  const char* name() const override { return "perf"; }
+  int collect(std::vector<Sample>& out) override;
+
+  const PerfStats& stats() const { return stats_; }
+  /// Events every group counts; a subset of the requested ones.
+  const std::vector<PerfEventSpec>& events() const { return events_; }
+
+ private:
+  struct Scope {
+    const char* label_key;  // "cpu" or "cgroup"
+    std::string label;
+    std::vector<std::size_t> groups;  // indexes into groups_
+    std::vector<uint32_t> ids;        // per event, then ipc and running ratio
+  };
+
+  struct DestroyGroup {
+    void operator()(PerfGroup* g) const { g->~PerfGroup(); }  // storage is the arena's
+  };
+
+  int add_scope(const char* key, const std::string& label, int pid, const std::vector<int>& cpus,
+                unsigned long flags);
+  void read_groups();
+  void self_counters(const PerfGroup& g, std::vector<Sample>& out, int64_t ts);
+
+  PerfOptions opts_;
+  std::vector<PerfEventSpec> events_;
+  std::vector<std::string> metrics_;    // perf_<name>_total, like events_
+  int cycles_ = -1, instructions_ = -1;  // positions in events_
+  std::vector<std::unique_ptr<TickArena>> arenas_;  // group storage per node, never reset
+  std::vector<std::unique_ptr<PerfGroup, DestroyGroup>> groups_;
+  std::vector<int> group_node_;                // like groups_
+  std::vector<std::size_t> read_order_;        // groups_ indexes, node by node
+  std::vector<ThreadPool::NodeRange> ranges_;  // over read_order_
+  std::vector<Scope> scopes_;
+  std::vector<int> cgroup_fds_;
+  // Self-monitoring groups, one per thread collect() has run on.
+  std::unordered_map<int, std::unique_ptr<PerfGroup>> self_;
+  uint64_t self_totals_[2] = {};
+  uint32_t self_ids_[2] = {};
+  PerfStats stats_;
+};
+
+}  // namespace sysapm
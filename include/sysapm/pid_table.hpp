@@ -0,0 +1,161 @@
+// pid_table.hpp — open-addressing hash table keyed by PID.
+//
+// Linear probing over a power-of-two slot array with backward-shift
+// deletion, so there are no tombstones and lookups stay short even after
+// heavy fork/exit churn. Values live inline in the slot array; the table
+// only allocates when it grows past its load factor.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace sysapm {
+
+template <typename V>
+class PidTable {
+ public:
+  static constexpr int32_t kEmpty = 0;  // PID 0 is never a userspace task
+
+  explicit PidTable(std::size_t initial_capacity = 1024) { rehash(round_up(initial_capacity)); }
+
+  std::size_t size() const { return size_; }
+  std::size_t capacity() const { return slots_.size(); }
+
+  V* find(int32_t pid) {
+    std::size_t i = home(pid);
+    for (;;) {
+      Slot& s = slots_[i];
+      if (s.pid == pid) return &s.value;
+      if (s.pid == kEmpty) return nullptr;
+      i = (i + 1) & mask_;
+    }
+  }
+
+  const V* find(int32_t pid) const { return const_cast<PidTable*>(this)->find(pid); }
+
+  /// Returns the value for `pid`, default-constructing it if absent.
+  /// `inserted` reports whether a new entry was created.
+  V& insert(int32_t pid, bool* inserted = nullptr) {
+    if ((size_ + 1) * 10 > slots_.size() * 7) rehash(slots_.size() * 2);
+    std::size_t i = home(pid);
+    for (;;) {
+      Slot& s = slots_[i];
+      if (s.pid == pid) {
+        if (inserted) *inserted = false;
+        return s.value;
+      }
+      if (s.pid == kEmpty) {
+        s.pid = pid;
+        s.value = V{};
+        ++size_;
+        if (inserted) *inserted = true;
+        return s.value;
+      }
+      i = (i + 1) & mask_;
+    }
+  }
+
+  bool erase(int32_t pid) {
+    std::size_t i = home(pid);
+    for (;;) {
+      if (slots_[i].pid == kEmpty) return false;
+      if (slots_[i].pid == pid) break;
+      i = (i + 1) & mask_;
+    }
+    erase_slot(i);
+    return true;
+  }
+
+  /// Calls fn(pid, value) for every entry; fn returns false to erase it.
+  /// Erasing shifts later entries back, so the slot is re-examined.
+  template <typename Fn>
+  void retain(Fn&& fn) {
+    // Start right after an empty slot so a backward shift never moves an
+    // unvisited entry into an already-visited position.
+    std::size_t start = 0;
+    while (slots_[start].pid != kEmpty) start = (start + 1) & mask_;
+    std::size_t i = (start + 1) & mask_;
+    for (std::size_t n = 0; n < slots_.size();) {
+      Slot& s = slots_[i];
+      if (s.pid != kEmpty && !fn(s.pid, s.value)) {
+        erase_slot(i);
+        continue;
+      }
+      i = (i + 1) & mask_;
+      ++n;
+    }
+  }
+
+  template <typename Fn>
+  void for_each(Fn&& fn) {
+    for (Slot& s : slots_)
+      if (s.pid != kEmpty) fn(s.pid, s.value);
+  }
+
+  template <typename Fn>
+  void for_each(Fn&& fn) const {
+    for (const Slot& s : slots_)
+      if (s.pid != kEmpty) fn(s.pid, s.value);
+  }
+
+ private:
+  struct Slot {
+    int32_t pid = kEmpty;
+    V value{};
+  };
+
+  static std::size_t round_up(std::size_t n) {
+    std::size_t c = 16;
+    while (c < n) c *= 2;
+    return c;
+  }
+
+  std::size_t home(int32_t pid) const {
+    // Fibonacci hashing spreads sequential PIDs across the table.
+    return static_cast<std::size_t>((static_cast<uint32_t>(pid) * 0x9E3779B97F4A7C15ull) >> shift_);
+  }
+
+  void erase_slot(std::size_t i) {
+    // Backward-shift: pull later members of the probe run into the hole.
+    std::size_t hole = i;
+    std::size_t j = (i + 1) & mask_;
+    while (slots_[j].pid != kEmpty) {
+      std::size_t h = home(slots_[j].pid);
+      // Move j into the hole unless its home lies cyclically in (hole, j].
+      bool in_range = hole <= j ? (hole < h && h <= j) : (hole < h || h <= j);
+      if (!in_range) {
+        slots_[hole] = std::move(slots_[j]);
+        hole = j;
+      }
+      j = (j + 1) & mask_;
+    }
+    slots_[hole].pid = kEmpty;
+    slots_[hole].value = V{};
+    --size_;
+  }
+
+  void rehash(std::size_t cap) {
+    std::vector<Slot> old = std::move(slots_);
+    slots_.assign(cap, Slot{});
+    mask_ = cap - 1;
+    shift_ = 64 - static_cast<unsigned>(__builtin_ctzll(cap));
+    size_ = 0;
+    for (Slot& s : old) {
+      if (s.pid == kEmpty) continue;
+      std::size_t i = home(s.pid);
+      while (slots_[i].pid != kEmpty) i = (i + 1) & mask_;
+      slots_[i] = std::move(s);
+      ++size_;
+    }
+  }
+
+  std::vector<Slot> slots_;
+  std::size_t mask_ = 0;
+  unsigned shift_ = 64;
+  std::size_t size_ = 0;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,171 @@
+// pipeline.hpp — collector threads feeding one aggregation thread.
+//
+// Every collector runs on its own thread and publishes each tick's batch
+// into a private SpscRing, so collectors never contend with each other.
+// The aggregator drains all rings and hands samples to a consumer, and
+// once per interval appends the rings' own health (occupancy high-water
+// mark, drops) as system_apm_self_* samples. The pipeline owns the
+// SeriesRegistry its collectors intern into.
+//
+// Collector lanes tick from a TickScheduler, so every lane wakes on the
+// same wall-clock boundaries; wake-up skew and skipped ticks are part of
+// the self metrics. All pipeline threads take PipelineOptions::threads.
+//
+// With PipelineOptions::pool set, collectors get no threads: one ticker
+// thread waits for each deadline and submits every lane's collect() to the
+// pool as a task. A lane whose previous tick is still running skips the
+// deadline, so a lane's ring keeps a single producer. The pool's queue
+// depth, steals and CPU are then part of the self metrics too.
+//
+// While stage_profiler() is enabled the self metrics also carry each
+// profiled stage's calls, time and window quantiles, labelled stage="...".
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "sysapm/collector.hpp"
+#include "sysapm/histogram.hpp"
+#include "sysapm/self_profile.hpp"
+#include "sysapm/spsc_ring.hpp"
+#include "sysapm/thread_pool.hpp"
+#include "sysapm/tick_scheduler.hpp"
+
+namespace sysapm {
+
+struct PipelineOptions {
+  int64_t interval_ns = 1000000000;
+  std::size_t ring_capacity = 16384;  // samples per collector ring
+  ThreadPolicy threads;  // housekeeping CPUs and SCHED_IDLE for every thread
+  ThreadPool* pool = nullptr;  // run collectors as tasks here; must outlive stop()
+};
+
+/// Self-metric series published per collector lane.
+enum SelfLaneMetric : uint32_t {
+  kSelfRingHighWater,
+  kSelfRingDropped,
+  kSelfRingPushed,
+  kSelfCollectErrors,
+  kSelfCollectNs,
+  kSelfCollectP50Ns,  // over the last self-metric interval
+  kSelfCollectP99Ns,
+  kSelfWakeSkewNs,  // worst wake-up lateness over the last self-metric interval
+  kSelfTicksSkipped,
+  kSelfLaneMetricCount
+};
+
+/// Self-metric series of PipelineOptions::pool, when there is one.
+enum SelfPoolMetric : uint32_t {
+  kSelfPoolQueued,
+  kSelfPoolTasks,
+  kSelfPoolSteals,
+  kSelfPoolCpuNs,
+  kSelfPoolThrottledNs,
+  kSelfPoolRemote,
+  kSelfPoolMetricCount
+};
+
+/// Self-metric series per profiled Stage.
+enum SelfStageMetric : uint32_t {
+  kSelfStageCalls,
+  kSelfStageNs,
+  kSelfStageP50Ns,  // over the last self-metric interval
+  kSelfStageP99Ns,
+  kSelfStageMetricCount
+};
+
+class Pipeline {
+ public:
+  /// Called on the aggregator thread with each drained run of samples.
+  using Consumer = std::function<void(const Sample*, std::size_t)>;
+  /// Called on the aggregator thread once every ring has been drained, so
+  /// a consumer that holds samples back across runs can let a tick go.
+  using Drained = std::function<void()>;
+
+  Pipeline() = default;
+  ~Pipeline();
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
+  /// Adds a collector and binds it to registry(); only valid before start().
+  void add(std::unique_ptr<Collector> c);
+
+  /// Starts the collector threads and the aggregator, which calls
+  /// `drained` after each drain when set. Returns 0 or -errno.
+  int start(const PipelineOptions& opts, Consumer consumer, Drained drained = nullptr);
+
+  /// Stops all threads after a final drain. Idempotent.
+  void stop();
+
+  /// Runs every collector once on the calling thread and delivers the
+  /// samples to `consumer` directly (one-shot mode, no threads).
+  int collect_once(const Consumer& consumer);
+
+  /// Collectors added so far; lane i carries collector i.
+  std::size_t lanes() const { return collectors_.size(); }
+  /// Valid after start().
+  RingStats ring_stats(std::size_t lane) const { return lanes_[lane]->ring.stats(); }
+  /// First -errno from applying PipelineOptions::threads on any thread,
+  /// or 0; valid once the threads have started.
+  int thread_policy_status() const { return policy_rc_.load(); }
+
+  /// Name of any series this pipeline carries, including its self metrics.
+  bool describe(uint32_t series, char* buf, std::size_t len) const {
+    return registry_.format(series, buf, len);
+  }
+
+  SeriesRegistry& registry() { return registry_; }
+  const SeriesRegistry& registry() const { return registry_; }
+
+ private:
+  struct Lane {
+    Lane(Collector* c, std::size_t cap) : collector(c), ring(cap) {}
+    Collector* collector;
+    SpscRing<Sample> ring;
+    std::vector<Sample> batch;
+    std::thread thread;
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> last_collect_ns{0};
+    std::atomic<int64_t> skew_max_ns{0};  // reset by each self-metric pass
+    std::atomic<uint64_t> skipped{0};
+    std::atomic<bool> busy{false};  // pool mode: a collect task is queued or running
+    TickScheduler ticks;
+    Histogram collect_ns{HistogramLayout{}, 1};  // written by one collect() at a time
+    HistogramSnapshot collect_seen, collect_window;  // aggregator side
+    uint32_t self_ids[kSelfLaneMetricCount] = {};
+  };
+
+  void run_collector(Lane& lane);
+  void run_ticker();
+  void note_tick(Lane& lane, const Tick& tick);
+  void collect(Lane& lane);
+  void run_aggregator();
+  void drain();
+  void emit_self_metrics(int64_t ts);
+  void ring_doorbell();
+  void apply_policy();
+
+  SeriesRegistry registry_;
+  PipelineOptions opts_;
+  Consumer consumer_;
+  Drained drained_;
+  std::vector<std::unique_ptr<Collector>> collectors_;
+  std::vector<std::unique_ptr<Lane>> lanes_;
+  std::vector<Sample> scratch_;
+  std::thread aggregator_;
+  std::thread ticker_;  // pool mode
+  TickScheduler ticks_;
+  uint32_t pool_ids_[kSelfPoolMetricCount] = {};
+  uint32_t stage_ids_[kStageCount][kSelfStageMetricCount] = {};
+  HistogramSnapshot stage_seen_[kStageCount], stage_window_[kStageCount];  // aggregator side
+  std::atomic<bool> running_{false};
+  std::atomic<int> policy_rc_{0};
+  int doorbell_ = -1;  // eventfd: collectors signal a published batch
+};
+
+}  // namespace sysapm
@@ -0,0 +1,136 @@
+// plugin.hpp — collectors shipped as shared objects.
+//
+// Plugins come in two kinds. Most use the C ABI of plugin_abi.h: they
+// share nothing with the agent but plain C structs, fill a columnar batch
+// per tick instead of returning samples one by one, and may be built out
+// of tree by any compiler. PluginCollector hosts one of them as a
+// Collector, and swaps in a new build of the library while the agent runs.
+//
+// In-tree plugins may instead export a PluginInfo named
+// `sysapm_plugin_info` (use SYSAPM_PLUGIN) and hand the agent a Collector
+// of their own through load_plugin(). They link their own copy of the
+// sysapm library and share the Collector vtable and the SeriesRegistry the
+// pipeline binds, so both sides must come from the same compiler and
+// source tree; kPluginAbiVersion is bumped whenever those types change
+// layout. Those libraries stay loaded for the life of the process.
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "sysapm/collector.hpp"
+#include "sysapm/plugin_abi.h"
+
+namespace sysapm {
+
+constexpr uint32_t kPluginAbiVersion = 1;
+
+struct PluginInfo {
+  uint32_t abi_version;
+  const char* name;
+  /// Creates the collector from the user's argument string ("k=v,k=v").
+  /// Returns 0 with `*out` set, or -errno.
+  int (*create)(const char* args, Collector** out);
+};
+
+/// Loads `path` and creates its collector. Returns 0, -ENOENT when the
+/// library cannot be loaded, -ENOEXEC when it is not a sysapm plugin,
+/// -EPROTO on an ABI mismatch, or the factory's error. `error` (if given)
+/// receives a human-readable reason.
+int load_plugin(const char* path, const char* args, std::unique_ptr<Collector>* out, std::string* error = nullptr);
+
+struct PluginOptions {
+  std::string path;
+  std::string args;  // passed to the plugin's open()
+  uint32_t check_ticks = 5;  // ticks between checks for a new build; 0: never
+  uint32_t max_rows = 1u << 20;  // largest batch a plugin may reserve()
+  uint32_t max_series = 1u << 20;  // handles one build may intern()
+};
+
+struct PluginStats {
+  uint64_t loads = 0;         // builds opened, the first included
+  uint64_t unloads = 0;
+  uint64_t load_errors = 0;   // builds that would not load or open
+  uint64_t dropped_rows = 0;  // batch rows with unknown handles
+  uint64_t series = 0;        // handles the loaded build holds
+};
+
+/// Hosts a C ABI plugin. Every check_ticks ticks, and on request_reload(),
+/// the library file is compared with the build that is loaded: a new file
+/// at the path is loaded in place of the old one, a removed file unloads
+/// the plugin, and a file that comes back is loaded again. Series the new
+/// build no longer publishes, or all of them on unload, get staleness
+/// markers. A new file that fails to load is not retried until it changes
+/// again.
+class PluginCollector final : public Collector {
+ public:
+  PluginCollector() = default;
+  ~PluginCollector() override;
+  PluginCollector(const PluginCollector&) = delete;
+  PluginCollector& operator=(const PluginCollector&) = delete;
+
+  /// Loads and opens the plugin at opts.path. Returns 0 or an error as for
+  /// load_plugin(); -ENOEXEC also means the library may be an in-tree
+  /// plugin for load_plugin().
+  int open(const PluginOptions& opts, std::string* error = nullptr);
+  const char* name() const override { return name_.c_str(); }
+  int collect(std::vector<Sample>& out) override;
+
+  /// Reloads the library on the next tick even if the file looks unchanged.
+  /// Safe from any thread.
+  void request_reload() { reload_.store(true, std::memory_order_relaxed); }
+
+  bool loaded() const { return plugin_ != nullptr; }
+  const PluginStats& stats() const { return stats_; }
+
+ private:
+  struct Handle {
+    uint32_t id;
+    SampleKind kind;
+  };
+  struct FileId {
+    dev_t dev = 0;
+    ino_t ino = 0;
+    int64_t mtime_ns = 0;
+    off_t size = 0;
+    bool operator==(const FileId&) const = default;
+  };
+
+  int load(std::string* error);
+  void unload();
+  void reload(int64_t ts, std::vector<Sample>& out);
+  void retire(int64_t ts, std::vector<Sample>& out);
+  FileId file_id() const;
+
+  static uint32_t host_intern(void* ctx, const char* metric, const sysapm_label* labels, uint32_t n, int kind);
+  static int host_reserve(void* ctx, sysapm_batch* batch, uint32_t rows);
+  static void host_log(void* ctx, const char* message);
+
+  PluginOptions opts_;
+  std::string name_;
+  void* lib_ = nullptr;
+  const sysapm_plugin* plugin_ = nullptr;
+  void* state_ = nullptr;
+  sysapm_host host_{};
+  std::vector<Handle> handles_;  // handle h is handles_[h - 1]
+  std::unordered_map<uint32_t, uint32_t> handle_of_;  // series id -> handle
+  std::vector<uint32_t> series_col_;
+  std::vector<sysapm_value> value_col_;
+  std::vector<Handle> retired_;  // the previous build's, until the next one has collected once
+  FileId loaded_, failed_;
+  uint32_t ticks_ = 0;
+  std::atomic<bool> reload_{false};
+  PluginStats stats_;
+};
+
+}  // namespace sysapm
+
+#define SYSAPM_PLUGIN(plugin_name, factory)                                                   \
+  extern "C" __attribute__((visibility("default"))) const ::sysapm::PluginInfo sysapm_plugin_info = { \
+      ::sysapm::kPluginAbiVersion, plugin_name, factory}
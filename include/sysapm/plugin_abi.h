@@ -0,0 +1,98 @@
+/* plugin_abi.h — the stable C ABI for collector plugins.
+ *
+ * A plugin is a shared object exporting one sysapm_plugin named
+ * `sysapm_plugin_entry` (use SYSAPM_DEFINE_PLUGIN). Nothing crosses the
+ * boundary but the plain C types below, so a plugin may be written in C or
+ * any language with a C FFI, built with any compiler, and needs neither
+ * the agent's headers beyond this one nor its library.
+ *
+ * Once per tick the agent calls collect() with a columnar batch it owns:
+ * the plugin writes one row per sample, a series handle and a value, and
+ * sets `count`. There is no call per sample in either direction. Series
+ * are declared once with host->intern(), which returns the handle the
+ * plugin keeps and writes into `series`; the kind given there applies to
+ * every row of that handle. A plugin that needs more rows than
+ * `capacity` asks host->reserve() for them first, which may move the
+ * columns.
+ *
+ * The agent may unload a plugin and load a new build of it while running:
+ * close() is called, the library is dlclose()d and the new one dlopen()ed
+ * and opened from scratch. Handles do not survive that; series do, when the
+ * new build interns the same metric and labels. Nothing the plugin hands
+ * the agent (names, label strings) needs to outlive the call it is passed
+ * to.
+ *
+ * SYSAPM_PLUGIN_ABI changes only when a struct here changes layout or a
+ * call changes meaning; fields are only ever appended.
+ */
+#ifndef SYSAPM_PLUGIN_ABI_H
+#define SYSAPM_PLUGIN_ABI_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SYSAPM_PLUGIN_ABI 2
+
+/* Sample kinds, as passed to intern(). */
+#define SYSAPM_GAUGE 0   /* point-in-time value; rows use value.gauge */
+#define SYSAPM_COUNTER 1 /* monotonically increasing total; rows use value.counter */
+
+typedef struct sysapm_label {
+  const char* name;
+  const char* value;
+} sysapm_label;
+
+typedef union sysapm_value {
+  uint64_t counter;
+  double gauge;
+} sysapm_value;
+
+typedef struct sysapm_batch {
+  uint32_t* series;     /* handles from intern(); rows with unknown handles are dropped */
+  sysapm_value* values;
+  uint32_t count;       /* rows written; 0 on entry */
+  uint32_t capacity;    /* rows the columns hold */
+  int64_t ts_ns;        /* CLOCK_REALTIME of the tick; the plugin may overwrite it */
+} sysapm_batch;
+
+typedef struct sysapm_host {
+  void* ctx; /* passed back to every call below */
+  /* Declares a series; returns its handle (never 0), or 0 when the name or
+   * labels are invalid or the agent is out of series. At most 8 labels.
+   * Declaring a series again returns the same handle, or 0 if the kind
+   * differs. */
+  uint32_t (*intern)(void* ctx, const char* metric, const sysapm_label* labels, uint32_t n_labels, int kind);
+  /* Grows `batch` to hold at least `rows` rows, keeping those written.
+   * Returns 0 or -ENOMEM; the columns may move either way. */
+  int (*reserve)(void* ctx, sysapm_batch* batch, uint32_t rows);
+  /* One line for the agent's log. */
+  void (*log)(void* ctx, const char* message);
+} sysapm_host;
+
+typedef struct sysapm_plugin {
+  uint32_t abi; /* SYSAPM_PLUGIN_ABI */
+  const char* name;
+  /* Starts the plugin from the user's argument string ("k=v,k=v"). `host`
+   * stays valid until close(). Returns 0 with *state set, or -errno. */
+  int (*open)(const char* args, const sysapm_host* host, void** state);
+  /* Fills `batch` with this tick's samples. Returns 0 or -errno; rows
+   * written before an error are still published. */
+  int (*collect)(void* state, sysapm_batch* batch);
+  void (*close)(void* state);
+} sysapm_plugin;
+
+#ifdef __cplusplus
+}
+#define SYSAPM_PLUGIN_EXTERN_ extern "C"
+#else
+#define SYSAPM_PLUGIN_EXTERN_
+#endif
+
+#define SYSAPM_DEFINE_PLUGIN(plugin_name, open_fn, collect_fn, close_fn)                       \
+  SYSAPM_PLUGIN_EXTERN_ __attribute__((visibility("default"))) const sysapm_plugin sysapm_plugin_entry = { \
+      SYSAPM_PLUGIN_ABI, plugin_name, open_fn, collect_fn, close_fn}
+
+#endif /* SYSAPM_PLUGIN_ABI_H */
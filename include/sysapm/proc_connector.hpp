@@ -0,0 +1,51 @@
+// proc_connector.hpp — netlink process-event listener.
+//
+// Subscribes to the kernel proc connector (NETLINK_CONNECTOR / CN_IDX_PROC)
+// so process collectors learn about fork, exec and exit as they happen
+// instead of rescanning /proc. Requires CAP_NET_ADMIN; callers fall back to
+// directory scans when open() fails.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sysapm {
+
+struct ProcEvent {
+  enum Kind : uint8_t { kFork, kExec, kExit };
+  Kind kind;
+  int32_t pid;   // the task the event is about (child for fork)
+  int32_t tgid;  // its thread group
+};
+
+class ProcConnector {
+ public:
+  ProcConnector() = default;
+  ~ProcConnector();
+  ProcConnector(const ProcConnector&) = delete;
+  ProcConnector& operator=(const ProcConnector&) = delete;
+
+  /// Opens a non-blocking socket and subscribes. Returns 0 or -errno.
+  int open(std::size_t rcvbuf_bytes = 4 << 20);
+  void close();
+  bool is_open() const { return fd_ >= 0; }
+  int fd() const { return fd_; }
+
+  /// Reads queued events without blocking. Returns how many were stored
+  /// (fewer than `max` means the socket is drained), or -ENOBUFS if the
+  /// kernel dropped events since the last call — the caller must resync —
+  /// or another -errno.
+  int read_events(ProcEvent* out, std::size_t max);
+
+ private:
+  int subscribe(bool on);
+
+  int fd_ = -1;
+  // Datagrams are parsed out of this buffer; a partly consumed one is kept
+  // here until the caller asks for more events.
+  alignas(8) unsigned char buf_[8192];
+  std::size_t len_ = 0;
+  std::size_t off_ = 0;
+};
+
+}  // namespace sysapm
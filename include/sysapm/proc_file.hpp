@@ -0,0 +1,86 @@
+// proc_file.hpp — persistent handle on a /proc or /sys pseudo-file.
+//
+// The file is opened once and re-read with pread() at offset 0 on every tick
+// into a buffer allocated at open time. The buffer only grows when the file
+// outgrows it (CPU hotplug, new block devices), so the steady state performs
+// no heap allocation.
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace sysapm {
+
+class IoRing;
+
+class ProcFile {
+ public:
+  ProcFile() = default;
+  ~ProcFile();
+
+  ProcFile(ProcFile&& other) noexcept;
+  ProcFile& operator=(ProcFile&& other) noexcept;
+  ProcFile(const ProcFile&) = delete;
+  ProcFile& operator=(const ProcFile&) = delete;
+
+  /// Opens `path` read-only and allocates a `capacity`-byte buffer.
+  /// Returns 0 or -errno.
+  int open(const char* path, std::size_t capacity = 4096);
+
+  /// Re-reads the whole file from offset 0. Returns bytes read or -errno.
+  long read();
+
+  void close();
+
+  bool is_open() const { return fd_ >= 0; }
+  int fd() const { return fd_; }
+
+  /// Contents from the last successful read().
+  std::string_view data() const { return {buf_, len_}; }
+
+  std::size_t capacity() const { return cap_; }
+
+  /// Number of times the buffer had to grow since open().
+  unsigned grow_count() const { return grows_; }
+
+ private:
+  friend class ProcFileBatch;
+
+  int grow();
+
+  int fd_ = -1;
+  char* buf_ = nullptr;
+  std::size_t cap_ = 0;
+  std::size_t len_ = 0;
+  unsigned grows_ = 0;
+};
+
+/// Rereads a fixed set of ProcFiles through an IoRing: one read per file
+/// at offset 0, then a read at the end of each to confirm EOF (seq_file
+/// may return less than the buffer holds), so a tick is normally two
+/// io_uring_enter calls whatever the number of files. Files and buffers
+/// are registered with the ring; a file that fills its buffer is re-read
+/// with ProcFile::read(), which grows it, and the buffers re-registered.
+class ProcFileBatch {
+ public:
+  /// Registers `files` (index i = files[i]) with `ring`, which must have
+  /// at least n slots. Returns 0 or -errno.
+  int attach(IoRing* ring, ProcFile* const* files, std::size_t n);
+  bool attached() const { return ring_ != nullptr; }
+  const std::vector<ProcFile*>& files() const { return files_; }
+
+  /// Like read() on every file; results[i] gets bytes read or -errno.
+  /// Returns 0, or -errno when the ring itself failed.
+  int read_all(long* results);
+
+ private:
+  int register_buffers();
+
+  IoRing* ring_ = nullptr;
+  std::vector<ProcFile*> files_;
+  std::vector<unsigned> grows_;   // each file's grow_count() when registered
+  std::vector<std::size_t> off_;  // bytes read so far this pass
+};
+
+}  // namespace sysapm
@@ -0,0 +1,130 @@
+// proc_sampler.hpp — host-wide /proc sampling engine.
+//
+// ProcSampler keeps /proc/stat, /proc/meminfo, /proc/loadavg, /proc/net/dev
+// and /proc/diskstats open for its whole lifetime. Each sample() rereads them
+// into preallocated buffers and parses into a ProcSnapshot whose containers
+// were sized at open(), so a tick touches no heap.
+//
+// With IoBackend::kUring the files are reread through an IoRing as one
+// ProcFileBatch, two io_uring_enter calls per tick instead of one pread
+// per file.
+//
+// Field layouts come from proc_schema.hpp: snapshot arrays are indexed by
+// schema position, e.g. mem.v[kMeminfoSchema.index("MemAvailable")].
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sysapm/io_ring.hpp"
+#include "sysapm/proc_file.hpp"
+#include "sysapm/proc_schema.hpp"
+
+namespace sysapm {
+
+inline constexpr std::size_t kCpuFieldCount = kStatCpuSchema.size();
+
+struct CpuTimes {
+  uint64_t v[kCpuFieldCount] = {};  // USER_HZ ticks, indexed like kStatCpuSchema
+};
+
+struct CpuStats {
+  CpuTimes total;
+  std::vector<CpuTimes> cpus;  // indexed by CPU number; gaps stay zero
+  uint64_t v[kStatSchema.size()] = {};  // indexed like kStatSchema
+};
+
+struct MemInfo {
+  uint64_t v[kMeminfoSchema.size()] = {};  // as reported, indexed like kMeminfoSchema
+};
+
+struct LoadAvg {
+  double load1 = 0, load5 = 0, load15 = 0;
+  uint64_t running = 0;
+  uint64_t total = 0;
+  uint64_t last_pid = 0;
+};
+
+inline constexpr std::size_t kNetFieldCount = kNetDevSchema.size();
+
+struct NetDevStats {
+  char name[16] = {};  // IFNAMSIZ
+  uint64_t v[kNetFieldCount] = {};
+};
+
+inline constexpr std::size_t kDiskFieldCount = kDiskstatsSchema.size();
+
+struct DiskStats {
+  uint32_t major = 0;
+  uint32_t minor = 0;
+  char name[32] = {};
+  uint64_t v[kDiskFieldCount] = {};
+};
+
+struct ProcSnapshot {
+  uint64_t timestamp_ns = 0;  // CLOCK_REALTIME at the start of the tick
+  CpuStats cpu;
+  MemInfo mem;
+  LoadAvg load;
+  std::vector<NetDevStats> net;
+  std::vector<DiskStats> disks;
+  uint32_t truncated_rows = 0;  // rows dropped because a table was full
+};
+
+/// Which of the sampler's files are available on this host.
+enum SamplerSource : unsigned {
+  kSourceStat = 1u << 0,
+  kSourceMeminfo = 1u << 1,
+  kSourceLoadavg = 1u << 2,
+  kSourceNetDev = 1u << 3,
+  kSourceDiskstats = 1u << 4,
+  kSourceAll = (1u << 5) - 1,
+};
+
+struct SamplerOptions {
+  std::string proc_root = "/proc";
+  unsigned sources = kSourceAll;  // SamplerSource bits to open
+  std::size_t max_cpus = 0;  // 0: size from the first read
+  std::size_t max_net_devices = 256;
+  std::size_t max_disks = 1024;
+  IoBackend io = IoBackend::kRead;
+};
+
+class ProcSampler {
+ public:
+  /// Opens the requested source files and sizes the snapshot. Missing
+  /// files (e.g. diskstats inside some containers) are skipped; fails if a
+  /// requested /proc/stat cannot be opened or nothing could be. Returns 0 or
+  /// -errno.
+  int open(const SamplerOptions& opts = {});
+
+  /// Rereads and parses all open sources. Returns 0 or the first -errno.
+  int sample();
+
+  const ProcSnapshot& snapshot() const { return snap_; }
+  unsigned sources() const { return sources_; }
+  bool uring_active() const { return batch_.attached(); }
+
+ private:
+  int open_ring();
+  long fetch(ProcFile& f);
+
+  int sample_stat();
+  int sample_meminfo();
+  int sample_loadavg();
+  int sample_net_dev();
+  int sample_diskstats();
+
+  ProcFile stat_, meminfo_, loadavg_, net_dev_, diskstats_;
+  IoRing ring_;
+  ProcFileBatch batch_;
+  long results_[5] = {};    // by position in batch_.files()
+  bool prefetched_ = false;  // results_ hold this tick's reads
+  ProcSnapshot snap_;
+  SamplerOptions opts_;
+  unsigned sources_ = 0;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,232 @@
+// proc_schema.hpp — the fixed layouts of the host /proc tables, described once.
+//
+// Each schema lists a table's fields in the kernel's order: the columns of
+// a /proc/stat cpu line, /proc/net/dev and /proc/diskstats, and the keys of
+// /proc/meminfo and the rest of /proc/stat. A field also names the series
+// it is published as, its sample kind and the factor to its unit. The
+// snapshot structs are arrays sized from these tables, and everything
+// downstream is generated from them at compile time:
+//
+//   S.index("MemAvailable")   a field's array index, or a compile error
+//   KeyIndex<S>::find(key)    a keyed line's field, through a collision-free
+//                             hash table laid out by the compiler
+//   intern_schema<S>()        series ids for every published field
+//   emit_schema<S>()          one sample per published field, unrolled,
+//                             kind and scale folded into each push
+//
+// Columnar rows are still converted by scan_u64_row(), which is faster than
+// a per-field unrolled loop; the schema gives it the row width.
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "sysapm/sample.hpp"
+#include "sysapm/series_registry.hpp"
+
+namespace sysapm {
+
+struct SchemaField {
+  std::string_view key;         // meminfo or /proc/stat key, or column name
+  const char* metric = nullptr; // nullptr: parsed, not published
+  SampleKind kind = SampleKind::kCounter;
+  uint32_t scale = 1;           // published value = parsed * scale
+};
+
+template <std::size_t N>
+struct Schema {
+  const char* key_label;  // label carrying each field's key, or nullptr
+  std::array<SchemaField, N> fields;
+
+  static constexpr std::size_t size() { return N; }
+
+  /// Index of the field named `key`; an unknown key does not compile.
+  consteval std::size_t index(std::string_view key) const {
+    for (std::size_t i = 0; i < N; ++i)
+      if (fields[i].key == key) return i;
+    throw "no such field in this schema";
+  }
+};
+
+template <std::size_t N>
+consteval Schema<N> make_schema(const char* key_label, const SchemaField (&fields)[N]) {
+  Schema<N> s{key_label, {}};
+  for (std::size_t i = 0; i < N; ++i) s.fields[i] = fields[i];
+  return s;
+}
+
+// clang-format off
+inline constexpr auto kStatCpuSchema = make_schema("mode", {
+    {"user", "cpu_ticks_total"}, {"nice", "cpu_ticks_total"}, {"system", "cpu_ticks_total"},
+    {"idle", "cpu_ticks_total"}, {"iowait", "cpu_ticks_total"}, {"irq", "cpu_ticks_total"},
+    {"softirq", "cpu_ticks_total"}, {"steal", "cpu_ticks_total"}, {"guest", "cpu_ticks_total"},
+    {"guest_nice", "cpu_ticks_total"},
+});
+
+// The /proc/stat lines that are not cpu rows; values after the first are ignored.
+inline constexpr auto kStatSchema = make_schema(nullptr, {
+    {"ctxt", "context_switches_total"},
+    {"intr", "interrupts_total"},
+    {"processes", "forks_total"},
+    {"procs_running", "procs_running", SampleKind::kGauge},
+    {"procs_blocked", "procs_blocked", SampleKind::kGauge},
+    {"btime"},
+    {"softirq"},
+});
+
+// kB unless noted; a subset, in the kernel's order.
+inline constexpr auto kMeminfoSchema = make_schema(nullptr, {
+    {"MemTotal", "mem_total_bytes", SampleKind::kGauge, 1024},
+    {"MemFree", "mem_free_bytes", SampleKind::kGauge, 1024},
+    {"MemAvailable", "mem_available_bytes", SampleKind::kGauge, 1024},
+    {"Buffers", "mem_buffers_bytes", SampleKind::kGauge, 1024},
+    {"Cached", "mem_cached_bytes", SampleKind::kGauge, 1024},
+    {"SwapCached", "mem_swap_cached_bytes", SampleKind::kGauge, 1024},
+    {"Active", "mem_active_bytes", SampleKind::kGauge, 1024},
+    {"Inactive", "mem_inactive_bytes", SampleKind::kGauge, 1024},
+    {"SwapTotal", "mem_swap_total_bytes", SampleKind::kGauge, 1024},
+    {"SwapFree", "mem_swap_free_bytes", SampleKind::kGauge, 1024},
+    {"Dirty", "mem_dirty_bytes", SampleKind::kGauge, 1024},
+    {"Writeback", "mem_writeback_bytes", SampleKind::kGauge, 1024},
+    {"AnonPages", "mem_anon_bytes", SampleKind::kGauge, 1024},
+    {"Mapped", "mem_mapped_bytes", SampleKind::kGauge, 1024},
+    {"Shmem", "mem_shmem_bytes", SampleKind::kGauge, 1024},
+    {"Slab", "mem_slab_bytes", SampleKind::kGauge, 1024},
+    {"SReclaimable", "mem_slab_reclaimable_bytes", SampleKind::kGauge, 1024},
+    {"SUnreclaim", "mem_slab_unreclaimable_bytes", SampleKind::kGauge, 1024},
+    {"PageTables", "mem_page_tables_bytes", SampleKind::kGauge, 1024},
+    {"Committed_AS", "mem_committed_bytes", SampleKind::kGauge, 1024},
+    {"HugePages_Total", "hugepages_total", SampleKind::kGauge},  // pages
+    {"HugePages_Free", "hugepages_free", SampleKind::kGauge},
+});
+
+inline constexpr auto kNetDevSchema = make_schema(nullptr, {
+    {"rx_bytes", "net_rx_bytes_total"}, {"rx_packets", "net_rx_packets_total"},
+    {"rx_errs", "net_rx_errors_total"}, {"rx_drop", "net_rx_dropped_total"},
+    {"rx_fifo", "net_rx_fifo_total"}, {"rx_frame", "net_rx_frame_total"},
+    {"rx_compressed", "net_rx_compressed_total"}, {"rx_multicast", "net_rx_multicast_total"},
+    {"tx_bytes", "net_tx_bytes_total"}, {"tx_packets", "net_tx_packets_total"},
+    {"tx_errs", "net_tx_errors_total"}, {"tx_drop", "net_tx_dropped_total"},
+    {"tx_fifo", "net_tx_fifo_total"}, {"tx_colls", "net_tx_collisions_total"},
+    {"tx_carrier", "net_tx_carrier_total"}, {"tx_compressed", "net_tx_compressed_total"},
+});
+
+// After the device name. Kernels before 4.18 report 11 columns, before 5.5
+// report 15; missing ones read as zero.
+inline constexpr auto kDiskstatsSchema = make_schema(nullptr, {
+    {"reads", "disk_reads_total"}, {"reads_merged", "disk_reads_merged_total"},
+    {"sectors_read", "disk_sectors_read_total"}, {"read_ms", "disk_read_ms_total"},
+    {"writes", "disk_writes_total"}, {"writes_merged", "disk_writes_merged_total"},
+    {"sectors_written", "disk_sectors_written_total"}, {"write_ms", "disk_write_ms_total"},
+    {"io_in_progress", "disk_io_in_progress", SampleKind::kGauge}, {"io_ms", "disk_io_ms_total"},
+    {"weighted_io_ms", "disk_weighted_io_ms_total"}, {"discards", "disk_discards_total"},
+    {"discards_merged", "disk_discards_merged_total"}, {"sectors_discarded", "disk_sectors_discarded_total"},
+    {"discard_ms", "disk_discard_ms_total"}, {"flushes", "disk_flushes_total"},
+    {"flush_ms", "disk_flush_ms_total"},
+});
+// clang-format on
+
+namespace detail {
+
+constexpr uint32_t schema_hash(std::string_view key, uint32_t seed) {
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (char c : key) {
+    h ^= static_cast<uint8_t>(c);
+    h *= 16777619u;
+  }
+  return h ^ (h >> 15);
+}
+
+template <const auto& S>
+inline constexpr std::size_t kKeySlots = std::bit_ceil(S.size() * 4);
+
+// Builds the table for `seed`; false if two keys land in one slot.
+template <const auto& S>
+constexpr bool build_key_table(uint32_t seed, std::array<uint8_t, kKeySlots<S>>* table) {
+  *table = {};
+  for (std::size_t i = 0; i < S.size(); ++i) {
+    uint8_t& e = (*table)[schema_hash(S.fields[i].key, seed) & (kKeySlots<S> - 1)];
+    if (e) return false;
+    e = static_cast<uint8_t>(i + 1);
+  }
+  return true;
+}
+
+template <const auto& S>
+consteval uint32_t key_seed() {
+  std::array<uint8_t, kKeySlots<S>> t{};
+  for (uint32_t seed = 0; seed < 100000; ++seed)
+    if (build_key_table<S>(seed, &t)) return seed;
+  throw "no collision-free seed; are two keys the same?";
+}
+
+template <const auto& S>
+consteval std::array<uint8_t, kKeySlots<S>> key_table() {
+  std::array<uint8_t, kKeySlots<S>> t{};
+  build_key_table<S>(key_seed<S>(), &t);
+  return t;
+}
+
+}  // namespace detail
+
+/// Perfect-hash lookup of a schema's keys: one hash, one load and one
+/// compare per key, whether or not the key is in the schema.
+template <const auto& S>
+struct KeyIndex {
+  static_assert(S.size() < 255);
+  static constexpr uint32_t kSeed = detail::key_seed<S>();
+  static constexpr std::array<uint8_t, detail::kKeySlots<S>> kTable = detail::key_table<S>();
+
+  /// Index of `key` in S, or -1.
+  static constexpr int find(std::string_view key) {
+    const uint8_t e = kTable[detail::schema_hash(key, kSeed) & (detail::kKeySlots<S> - 1)];
+    return e && S.fields[e - 1u].key == key ? e - 1 : -1;
+  }
+};
+
+/// Interns every published field of S into ids[0, S.size()), with `labels`
+/// and, when S has one, its key label; unpublished fields get 0.
+template <const auto& S>
+void intern_schema(SeriesRegistry& r, std::initializer_list<Label> labels, uint32_t* ids) {
+  std::array<Label, 4> l{};
+  std::size_t n = 0;
+  for (const Label& x : labels) l[n++] = x;
+  if constexpr (S.key_label != nullptr) ++n;
+  for (std::size_t i = 0; i < S.size(); ++i) {
+    if constexpr (S.key_label != nullptr) l[n - 1] = {S.key_label, S.fields[i].key};
+    ids[i] = S.fields[i].metric ? r.intern(S.fields[i].metric, l.data(), n) : 0;
+  }
+}
+
+namespace detail {
+
+template <const auto& S, std::size_t I>
+inline void emit_field(int64_t ts, const uint32_t* ids, const uint64_t* v, std::vector<Sample>& out) {
+  constexpr SchemaField f = S.fields[I];
+  if constexpr (f.metric == nullptr) {
+    return;
+  } else if constexpr (f.kind == SampleKind::kCounter) {
+    out.push_back(Sample::make_counter(ts, ids[I], v[I] * f.scale));
+  } else {
+    out.push_back(Sample::make_gauge(ts, ids[I], static_cast<double>(v[I]) * f.scale));
+  }
+}
+
+}  // namespace detail
+
+/// Appends a sample for each published field of S, in schema order; `ids`
+/// and `v` are indexed like S.fields.
+template <const auto& S>
+inline void emit_schema(int64_t ts, const uint32_t* ids, const uint64_t* v, std::vector<Sample>& out) {
+  [&]<std::size_t... I>(std::index_sequence<I...>) {
+    (detail::emit_field<S, I>(ts, ids, v, out), ...);
+  }(std::make_index_sequence<S.size()>{});
+}
+
+}  // namespace sysapm
@@ -0,0 +1,192 @@
+// proto.hpp — minimal protobuf wire-format writer and reader.
+//
+// The exporter encodes OTLP and remote-write messages field by field
+// straight into one reused byte buffer; there are no generated classes and
+// no message objects. A nested message is opened with begin(), which
+// leaves one byte for its length, and closed with end(), which writes the
+// length and shifts the body when it needs more than one byte. Nested
+// messages here are small (a label, a data point), so the shift is cheap
+// and the outermost messages are never length-prefixed.
+//
+// ProtoReader walks a buffer field by field; tests and the aggregator use
+// it to check and consume what the writer produced.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+namespace sysapm {
+
+enum class WireType : uint8_t { kVarint = 0, kFixed64 = 1, kLen = 2, kFixed32 = 5 };
+
+class ProtoWriter {
+ public:
+  /// Appends to `out`, which the caller owns and reuses across messages.
+  /// The vector is grown ahead of the cursor, so call done() to trim it to
+  /// what was written.
+  explicit ProtoWriter(std::vector<uint8_t>* out) : out_(out), pos_(out ? out->size() : 0) {}
+
+  std::size_t size() const { return pos_; }
+  void done() { out_->resize(pos_); }
+
+  void varint(uint64_t v) {
+    uint8_t* p = room(10);
+    while (v >= 0x80) {
+      *p++ = static_cast<uint8_t>(v | 0x80);
+      v >>= 7;
+    }
+    *p++ = static_cast<uint8_t>(v);
+    pos_ = static_cast<std::size_t>(p - out_->data());
+  }
+  void tag(uint32_t field, WireType t) { varint(uint64_t{field} << 3 | static_cast<uint8_t>(t)); }
+
+  void uint64_field(uint32_t field, uint64_t v) {
+    tag(field, WireType::kVarint);
+    varint(v);
+  }
+  void int64_field(uint32_t field, int64_t v) { uint64_field(field, static_cast<uint64_t>(v)); }
+  void bool_field(uint32_t field, bool v) { uint64_field(field, v ? 1 : 0); }
+  /// Untagged 8-byte values, for the bodies of packed repeated fields.
+  void fixed64(uint64_t v) {
+    std::memcpy(room(8), &v, 8);  // little-endian hosts only, like the segment files
+    pos_ += 8;
+  }
+  void fixed64(double v) {
+    uint64_t bits;
+    std::memcpy(&bits, &v, 8);
+    fixed64(bits);
+  }
+  void fixed64_field(uint32_t field, uint64_t v) {
+    tag(field, WireType::kFixed64);
+    fixed64(v);
+  }
+  void double_field(uint32_t field, double v) {
+    tag(field, WireType::kFixed64);
+    fixed64(v);
+  }
+  void bytes_field(uint32_t field, const void* data, std::size_t len) {
+    tag(field, WireType::kLen);
+    varint(len);
+    if (len) std::memcpy(room(len), data, len);
+    pos_ += len;
+  }
+  void string_field(uint32_t field, std::string_view s) { bytes_field(field, s.data(), s.size()); }
+
+  /// Opens a length-delimited field; returns the mark to pass to end().
+  std::size_t begin(uint32_t field) {
+    tag(field, WireType::kLen);
+    *room(1) = 0;
+    return ++pos_;
+  }
+  void end(std::size_t mark) {
+    const std::size_t len = pos_ - mark;
+    if (len < 0x80) {
+      (*out_)[mark - 1] = static_cast<uint8_t>(len);
+      return;
+    }
+    uint8_t tmp[10];
+    std::size_t n = 0;
+    for (uint64_t v = len; v >= 0x80; v >>= 7) tmp[n++] = static_cast<uint8_t>(v | 0x80);
+    tmp[n] = static_cast<uint8_t>(len >> (7 * n));
+    ++n;
+    uint8_t* base = room(n - 1) - pos_;
+    std::memmove(base + mark + n - 1, base + mark, len);
+    std::memcpy(base + mark - 1, tmp, n);
+    pos_ += n - 1;
+  }
+
+ private:
+  /// Pointer to at least `n` writable bytes at the cursor.
+  uint8_t* room(std::size_t n) {
+    if (out_->size() - pos_ < n) out_->resize(std::max<std::size_t>({256, out_->size() * 2, pos_ + n}));
+    return out_->data() + pos_;
+  }
+
+  std::vector<uint8_t>* out_;
+  std::size_t pos_;
+};
+
+class ProtoReader {
+ public:
+  ProtoReader(const uint8_t* data, std::size_t len) : p_(data), end_(data + len) {}
+  ProtoReader(std::string_view s) : ProtoReader(reinterpret_cast<const uint8_t*>(s.data()), s.size()) {}
+
+  /// Advances to the next field. Returns false at the end or on malformed
+  /// input; error() tells them apart.
+  bool next() {
+    if (p_ >= end_) return false;
+    uint64_t key;
+    if (!read_varint(&key) || (key >> 3) == 0 || (key >> 3) > UINT32_MAX) return fail();
+    field_ = static_cast<uint32_t>(key >> 3);
+    type_ = static_cast<WireType>(key & 7);
+    switch (type_) {
+      case WireType::kVarint:
+        return read_varint(&value_) || fail();
+      case WireType::kFixed64:
+        return fixed(8);
+      case WireType::kFixed32:
+        return fixed(4);
+      case WireType::kLen: {
+        uint64_t len;
+        if (!read_varint(&len) || len > static_cast<uint64_t>(end_ - p_)) return fail();
+        bytes_ = {reinterpret_cast<const char*>(p_), static_cast<std::size_t>(len)};
+        p_ += len;
+        return true;
+      }
+    }
+    return fail();
+  }
+
+  uint32_t field() const { return field_; }
+  WireType type() const { return type_; }
+  /// Varint and fixed fields.
+  uint64_t value() const { return value_; }
+  double as_double() const {
+    double d;
+    std::memcpy(&d, &value_, 8);
+    return d;
+  }
+  /// Length-delimited fields: the payload, for strings or nested readers.
+  std::string_view bytes() const { return bytes_; }
+  bool error() const { return error_; }
+
+ private:
+  bool read_varint(uint64_t* out) {
+    uint64_t v = 0;
+    for (unsigned shift = 0; shift < 64 && p_ < end_; shift += 7) {
+      const uint8_t b = *p_++;
+      v |= uint64_t{b & 0x7fu} << shift;
+      if (!(b & 0x80)) {
+        *out = v;
+        return true;
+      }
+    }
+    return false;
+  }
+  bool fixed(std::size_t n) {
+    if (static_cast<std::size_t>(end_ - p_) < n) return fail();
+    value_ = 0;
+    std::memcpy(&value_, p_, n);
+    p_ += n;
+    return true;
+  }
+  bool fail() {
+    error_ = true;
+    p_ = end_;
+    return false;
+  }
+
+  const uint8_t* p_;
+  const uint8_t* end_;
+  uint32_t field_ = 0;
+  WireType type_ = WireType::kVarint;
+  uint64_t value_ = 0;
+  std::string_view bytes_;
+  bool error_ = false;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,140 @@
+// query.hpp — local queries over the chunk store.
+//
+// Answers questions like "p99 of CPU pressure per cgroup over the last 30
+// minutes" from the host's own data, so incident response does not depend
+// on a central backend that is likely to be struggling at the same time:
+//
+//   p99(cgroup_cpu_pressure_some_avg10{cgroup=~"/kubepods.*"}[30m]) by (cgroup)
+//
+// The selector is resolved against a metric -> series index kept next to
+// the registry and caught up on each query, so label predicates are
+// checked on that metric's series only and never touch chunk data. The
+// time range is pushed into the store, which skips chunks by their metas
+// (the segment footer index for mapped chunks). Matching series are
+// scanned in parallel on a ThreadPool; each decodes kDecodeBlock samples
+// at a time and reduces a block in fixed-width lanes the compiler turns
+// into SIMD.
+//
+// Counters are turned into per-second rates between consecutive samples
+// (a decrease counts as a reset) and every aggregation but `rate` works on
+// those; `rate` is the series' increase over the time it covers, summed
+// over a group. For gauges `rate` is the change per second. Quantiles are
+// exact (nearest rank) over the group's points. NaN gauge samples are left
+// out.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "sysapm/chunk_store.hpp"
+#include "sysapm/series_registry.hpp"
+#include "sysapm/thread_pool.hpp"
+
+namespace sysapm {
+
+enum class MatchOp : uint8_t {
+  kEqual,     // name="v"
+  kNotEqual,  // name!="v"
+  kPrefix,    // name=~"v.*": only literal prefixes are supported
+};
+
+struct LabelMatcher {
+  std::string name;
+  MatchOp op = MatchOp::kEqual;
+  std::string value;  // a missing label matches as ""
+};
+
+enum class QueryAgg : uint8_t { kAvg, kMin, kMax, kSum, kCount, kLast, kRate, kQuantile };
+
+struct Query {
+  QueryAgg agg = QueryAgg::kAvg;
+  double quantile = 0.99;  // kQuantile only
+  std::string metric;
+  std::vector<LabelMatcher> matchers;
+  int64_t from_ns = 0;
+  int64_t to_ns = 0;
+  bool grouped = false;         // false: one row per series
+  std::vector<std::string> by;  // grouping labels; none: one row overall
+};
+
+struct QueryRow {
+  std::string group;  // the series, or {label="value",...} of its group
+  double value = 0;
+  uint64_t samples = 0;  // raw samples read
+  uint32_t series = 0;   // series folded into the row
+};
+
+struct QueryStats {
+  uint64_t series = 0;  // matching the selector
+  uint64_t samples = 0;
+  uint64_t blocks = 0;
+  ScanStats chunks;
+};
+
+/// Parses the text form shown in the file comment. The range ends at
+/// `now_ns`; aggregations are avg, min, max, sum, count, last, rate and
+/// pNN (p50, p99, p999, ...). Returns 0 or -EINVAL.
+int parse_query(std::string_view text, int64_t now_ns, Query* out);
+
+class QueryEngine {
+ public:
+  /// `pool` may be null to scan on the calling thread only.
+  QueryEngine(const ChunkStore& store, const SeriesRegistry& registry, ThreadPool* pool = nullptr)
+      : store_(store), registry_(registry), pool_(pool) {}
+
+  /// Runs `q`; rows come out sorted by value, largest first. Returns 0 or
+  /// -EINVAL for an empty metric or range. Safe to call from several
+  /// threads.
+  int run(const Query& q, std::vector<QueryRow>* rows, QueryStats* stats = nullptr);
+
+ private:
+  std::vector<uint32_t> select(const Query& q);
+
+  const ChunkStore& store_;
+  const SeriesRegistry& registry_;
+  ThreadPool* pool_;
+  std::mutex mu_;  // guards the index
+  // Keys point into the registry's storage, which never moves.
+  std::unordered_map<std::string_view, std::vector<uint32_t>> by_metric_;
+  std::size_t indexed_ = 0;  // ids 1..indexed_ are in by_metric_
+};
+
+/// One "group value" line per row, as the query socket sends them.
+std::string format_rows(const std::vector<QueryRow>& rows);
+
+/// Serves queries on a Unix stream socket: a client writes one query line
+/// and reads format_rows() output, or a line starting with "error:", until
+/// the server closes the connection. It has a second to send the line and
+/// another to read the reply; a slower client is cut off.
+class QueryServer {
+ public:
+  QueryServer() = default;
+  ~QueryServer();
+  QueryServer(const QueryServer&) = delete;
+  QueryServer& operator=(const QueryServer&) = delete;
+
+  /// Binds and listens on `path`, replacing a stale socket file. Returns 0
+  /// or -errno.
+  int open(const std::string& path);
+  void close();
+  /// Non-blocking listening socket, for poll().
+  int fd() const { return fd_; }
+
+  /// Answers every pending connection. Returns how many were served.
+  std::size_t serve(QueryEngine& engine, int64_t now_ns);
+
+ private:
+  int fd_ = -1;
+  std::string path_;
+};
+
+/// Client side: sends `text` to the server at `path` and stores the reply.
+/// Returns 0 or -errno.
+int query_socket(const std::string& path, std::string_view text, std::string* reply);
+
+}  // namespace sysapm
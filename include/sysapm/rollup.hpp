@@ -0,0 +1,133 @@
+// rollup.hpp — streaming pre-aggregation into fixed time windows.
+//
+// Sits between the pipeline and the exporter: every sample updates one
+// running cell per (series, window) — min, max, sum, count and last — so a
+// rollup is never recomputed from raw data. A cell is emitted when a later
+// sample of its series lands in the next window, or when advance() finds
+// the window closed for longer than the grace period (quiet series).
+// Windows are aligned to multiples of their width in wall-clock time, like
+// the chunk store's blocks.
+//
+// For counters, min/max/last are raw values and `sum` is the increase over
+// the window, counted from the previous window's last value and treating a
+// decrease as a reset; consecutive sums therefore add up to the series'
+// total increase and sum / width is its rate.
+//
+// A staleness marker (Sample::stale()) closes the series' open windows at
+// once and is passed on as a count-0 point whose `last` is the marker.
+//
+// Histogram series are fed interval snapshots (HistogramSnapshot::
+// subtract() turns cumulative ones into those) with append_histogram();
+// each window emits the exact bucket-wise merge of what it received.
+//
+// Single-threaded: the aggregator thread owns a RollupStage.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "sysapm/histogram.hpp"
+#include "sysapm/sample.hpp"
+
+namespace sysapm {
+
+struct RollupOptions {
+  std::vector<int64_t> windows_ns = {10000000000ll, 60000000000ll, 300000000000ll};
+  /// How long after a window's end advance() waits for stragglers.
+  int64_t grace_ns = 2000000000;
+};
+
+struct RollupPoint {
+  Sample last;           // most recent sample in the window (series, kind, ts);
+                         // histograms: a counter of the merged observations
+  uint8_t window;        // index into RollupOptions::windows_ns
+  int64_t start_ns;      // window start; it spans [start_ns, start_ns + width)
+  uint64_t count;
+  double min, max, sum;  // see the file comment for counters; histograms:
+                         // bucket bounds of the extremes and the midpoint sum
+  const HistogramSnapshot* histogram;  // histogram series only; valid during the sink call
+};
+
+struct RollupStats {
+  uint64_t samples = 0;
+  uint64_t late = 0;  // for an already emitted finest window, dropped there
+  uint64_t points = 0;
+  uint64_t histograms = 0;
+};
+
+class RollupStage {
+ public:
+  /// Receives emitted points in batches, on the caller's thread.
+  using Sink = std::function<void(const RollupPoint*, std::size_t)>;
+
+  RollupStage(const RollupOptions& opts, Sink sink);
+  ~RollupStage();
+  RollupStage(const RollupStage&) = delete;
+  RollupStage& operator=(const RollupStage&) = delete;
+
+  void append(const Sample* s, std::size_t n);
+  void append(const Sample& s) { append(&s, 1); }
+  void append_histogram(uint32_t series, int64_t ts_ns, const HistogramSnapshot& h);
+
+  /// Emits every window that ended at least grace_ns before `now_ns`.
+  void advance(int64_t now_ns);
+  /// Emits every open window regardless of time, e.g. at shutdown.
+  void flush();
+  /// The number of windows (per series and width) holding samples not
+  /// emitted yet.
+  std::size_t open_windows() const;
+
+  /// Appends the open windows and each counter's last value to `out`, so a
+  /// restarted agent carries on where this one stopped (snapshot.hpp).
+  void save(std::vector<uint8_t>* out) const;
+  /// Restores save() output into a stage with no state yet. Windows are
+  /// matched by width; saved ones with no match are skipped. Returns bytes
+  /// consumed or -EINVAL.
+  int load(const uint8_t* data, std::size_t len);
+
+  const RollupOptions& options() const { return opts_; }
+  const RollupStats& stats() const { return stats_; }
+
+ private:
+  struct Cell {
+    int64_t bucket = -1;  // window index (ts / width) being accumulated
+    bool open = false;
+    uint64_t count = 0;
+    double min = 0, max = 0, sum = 0;
+    Sample last{};
+    bool have_prev = false;  // counters: `prev` is the last value before this window
+    uint64_t prev = 0;
+  };
+  struct HistCell {
+    int64_t bucket = -1;
+    bool open = false;
+    uint64_t count = 0;
+    Sample last{};
+    HistogramSnapshot merged;
+  };
+  struct Window {
+    int64_t width;
+    std::vector<Cell> cells;  // by series id: ids are dense
+    std::unordered_map<uint32_t, HistCell> hists;
+    int64_t next_close = 0;  // earliest end among open cells, for advance()
+  };
+
+  void add(Window& w, uint8_t wi, const Sample& s);
+  void emit(Window& w, uint8_t wi, Cell& c);
+  void emit(Window& w, uint8_t wi, HistCell& c);
+  void deliver();
+
+  RollupOptions opts_;
+  Sink sink_;
+  std::vector<Window> windows_;
+  std::vector<RollupPoint> pending_;
+  std::vector<std::unique_ptr<HistogramSnapshot>> pending_hists_;  // backing for pending histogram points
+  std::size_t pending_hist_used_ = 0;
+  RollupStats stats_;
+};
+
+}  // namespace sysapm
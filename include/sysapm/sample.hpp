@@ -0,0 +1,54 @@
+// sample.hpp — the fixed-size record every collector publishes.
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+
+namespace sysapm {
+
+enum class SampleKind : uint8_t {
+  kGauge,    // point-in-time value, stored as double
+  kCounter,  // monotonically increasing total, stored as uint64
+};
+
+enum SampleFlag : uint8_t {
+  kSampleStale = 1u << 0,  // the series ended; the value is kStaleNaN
+};
+
+/// Prometheus' staleness marker: a NaN no arithmetic produces.
+constexpr uint64_t kStaleNaN = 0x7ff0000000000002ull;
+
+struct Sample {
+  int64_t ts_ns;    // CLOCK_REALTIME
+  uint32_t series;  // SeriesRegistry id
+  SampleKind kind;
+  uint8_t flags;    // SampleFlag bits
+  uint16_t reserved;
+  union {
+    double gauge;
+    uint64_t counter;
+  };
+
+  static Sample make_gauge(int64_t ts, uint32_t series, double v) {
+    Sample s{ts, series, SampleKind::kGauge, 0, 0, {}};
+    s.gauge = v;
+    return s;
+  }
+  static Sample make_counter(int64_t ts, uint32_t series, uint64_t v) {
+    Sample s{ts, series, SampleKind::kCounter, 0, 0, {}};
+    s.counter = v;
+    return s;
+  }
+  /// Marks `series` as gone at `ts`; keeps the series' kind.
+  static Sample make_stale(int64_t ts, uint32_t series, SampleKind kind) {
+    Sample s{ts, series, kind, kSampleStale, 0, {}};
+    s.counter = kStaleNaN;
+    return s;
+  }
+  bool stale() const { return flags & kSampleStale; }
+};
+
+static_assert(sizeof(Sample) == 24);
+static_assert(std::is_trivially_copyable_v<Sample>);
+
+}  // namespace sysapm
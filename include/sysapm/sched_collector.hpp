@@ -0,0 +1,153 @@
+// sched_collector.hpp — run-queue latency and off-CPU time from eBPF.
+//
+// Programs on sched_wakeup, sched_wakeup_new and sched_switch keep a small
+// per-task record (when it blocked, when it became runnable, its cgroup and
+// the kernel stack it blocked in) and fold every context switch into two
+// kernel maps:
+//
+//   hist    cgroup id -> log2 run-queue latency buckets (µs) and their sum
+//   offcpu  (cgroup id, stack id) -> nanoseconds spent blocked
+//
+// Nothing crosses into userspace per event. Every drain interval the
+// collector copies each map with one BPF_MAP_LOOKUP_BATCH call into buffers
+// sized at open() and publishes the cumulative values as counters:
+//
+//   sched_runqueue_latency_us_bucket{cgroup,le}   (le = 2^b µs, then +Inf)
+//   sched_runqueue_latency_us_count{cgroup}, ..._us_sum{cgroup}
+//   sched_offcpu_ns_total{cgroup,stack}
+//
+// Cgroup ids are cgroup v2 inode numbers resolved to paths under the
+// unified hierarchy; stacks are symbolized from /proc/kallsyms and labelled
+// by their innermost frames outside the scheduler. Needs CAP_BPF and
+// CAP_PERFMON (or root), tracefs, and Linux 5.6 for batched lookups.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "sysapm/bpf.hpp"
+#include "sysapm/collector.hpp"
+
+namespace sysapm {
+
+struct SchedOptions {
+  int64_t drain_interval_ns = 10000000000;
+  std::string tracefs;      // empty: found through /proc/self/mounts
+  std::string cgroup_root;  // cgroup v2 mount; empty: found likewise
+  uint32_t max_tasks = 65536;
+  uint32_t max_cgroups = 4096;
+  uint32_t max_stacks = 8192;  // distinct (cgroup, stack) pairs
+  uint32_t stack_frames = 5;   // frames kept in the stack label
+};
+
+/// Parses "drain_s=10,tracefs=/sys/kernel/tracing,max_stacks=4096,...".
+/// Returns 0 or -EINVAL for an unknown key or malformed value.
+int parse_sched_options(std::string_view args, SchedOptions* out);
+
+/// The prev_state flag sched_switch reports for a preempted task
+/// (TASK_REPORT_MAX: 0x100 since Linux 4.14, 2048 before), evaluated from
+/// the `prev_state & (...) ? "+"` term of the event's print fmt. Returns 0
+/// or -EINVAL when there is no such term or it is not a single bit.
+int sched_preempt_flag(std::string_view print_fmt, uint64_t* out);
+
+/// Kernel text symbols from /proc/kallsyms, for stack labels.
+class KernelSymbols {
+ public:
+  /// Returns 0, -EPERM when addresses are hidden (kptr_restrict), or -errno.
+  int load(const char* path = "/proc/kallsyms");
+  bool empty() const { return addrs_.empty(); }
+  /// Function containing `addr`, or nullptr.
+  const char* resolve(uint64_t addr) const;
+
+ private:
+  std::vector<uint64_t> addrs_;
+  std::vector<uint32_t> names_;  // offsets into blob_
+  std::string blob_;
+};
+
+/// cgroup v2 id (directory inode) to path, rescanning on a miss.
+class CgroupPaths {
+ public:
+  int open(const std::string& root);
+  /// Path relative to the mount ("/" for the root), or nullptr when the
+  /// cgroup is gone. Rescans at most once per `generation`.
+  const char* path(uint64_t id, uint64_t generation);
+
+ private:
+  void rescan();
+
+  std::string root_;
+  std::unordered_map<uint64_t, std::string> paths_;
+  uint64_t scanned_ = ~uint64_t{0};
+};
+
+class SchedCollector final : public Collector {
+ public:
+  static constexpr uint32_t kBuckets = 32;  // bucket b: latency < 2^b µs; the last is open
+
+  SchedCollector() = default;
+  ~SchedCollector() override;
+
+  /// Builds, loads and attaches the programs. Returns 0, -EPERM without
+  /// privileges, -ENOENT without tracefs, or another -errno. `log` gets the
+  /// verifier output when a program is rejected.
+  int open(const SchedOptions& opts, std::string* log = nullptr);
+  void close();
+
+  const char* name() const override { return "sched"; }
+  int collect(std::vector<Sample>& out) override;
+
+  /// Drains the maps now, whatever the interval; collect() calls it.
+  int drain(std::vector<Sample>& out);
+  uint64_t drains() const { return drains_; }
+
+ private:
+  struct OffcpuKey {
+    uint64_t cgroup;
+    int64_t stack;
+    bool operator==(const OffcpuKey& o) const { return cgroup == o.cgroup && stack == o.stack; }
+  };
+  struct OffcpuKeyHash {
+    std::size_t operator()(const OffcpuKey& k) const {
+      return k.cgroup * 0x9e3779b97f4a7c15ull ^ static_cast<uint64_t>(k.stack);
+    }
+  };
+  struct HistIds {
+    uint32_t bucket[kBuckets];  // le=2^b for b < kBuckets-1, +Inf last
+    uint32_t count;
+    uint32_t sum;
+  };
+
+  int build_wakeup(bool new_task, BpfProgram* prog, std::string* log);
+  int build_switch(BpfProgram* prog, std::string* log);
+  const HistIds* hist_ids(uint64_t cgroup);
+  uint32_t offcpu_id(const OffcpuKey& k);
+  std::string stack_label(int64_t stack);
+
+  SchedOptions opts_;
+  std::string tracefs_;
+  TracepointField wakeup_pid_, wakeup_new_pid_, prev_pid_, prev_state_, next_pid_;
+  uint64_t preempt_flag_ = 0;
+  BpfMap tasks_, hist_, offcpu_, stacks_;
+  BpfProgram wakeup_prog_, wakeup_new_prog_, switch_prog_;
+  TracepointLink wakeup_link_, wakeup_new_link_, switch_link_;
+  KernelSymbols ksyms_;
+  CgroupPaths cgroups_;
+
+  // Drain buffers, sized to the maps at open().
+  std::vector<uint64_t> hist_keys_, hist_values_;
+  std::vector<OffcpuKey> offcpu_keys_;
+  std::vector<uint64_t> offcpu_values_;
+  std::vector<uint64_t> stack_ips_;
+
+  std::unordered_map<uint64_t, HistIds> hist_ids_;
+  std::unordered_map<OffcpuKey, uint32_t, OffcpuKeyHash> offcpu_ids_;
+  int64_t next_drain_ns_ = 0;
+  uint64_t drains_ = 0;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,136 @@
+// segment.hpp — append-only, memory-mapped segment files of sealed chunks.
+//
+// A segment starts with one header page, then holds sealed chunks as
+// 8-byte aligned records:
+//
+//   record   RecordHeader  ChunkMeta  words[meta.words]
+//
+// Once it reaches its size limit the segment is finished: a footer index
+// (one FooterEntry per chunk: meta plus record offset) is appended, the
+// file is padded to a whole number of pages, and a SegmentTrailer fills
+// its last bytes. Reopening a finished segment reads only the trailer and
+// footer; the chunk words are used in place through a read-only shared
+// mapping, so sealed data costs page cache rather than heap and restarts
+// deserialize nothing. A segment left without a trailer by a crash is
+// recovered by walking its records until the first one that fails its
+// checksum, then finished as usual.
+//
+// The active segment is mapped at its full size limit up front, so each
+// chunk written with pwrite() is immediately readable through the map.
+//
+// Chunks carry series ids, which only the registry that interned them can
+// resolve. The header records that registry's SeriesIdOrigin, and
+// for_each_chunk() passes it on, so a reader can drop ids its registry
+// does not share with the writer.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "sysapm/chunk.hpp"
+#include "sysapm/series_registry.hpp"
+
+namespace sysapm {
+
+inline constexpr std::size_t kSegmentPage = 4096;
+
+struct SegmentHeader {
+  char magic[8];  // "SYSAPMSG"
+  uint32_t version;
+  uint32_t page;
+  uint64_t seq;
+  int64_t created_ns;
+  uint64_t generation;  // SeriesIdOrigin of the writer; zeros: unknown
+  uint64_t parent;
+  uint32_t inherited;
+  uint32_t reserved;
+};
+
+struct RecordHeader {
+  uint32_t magic;     // kRecordMagic
+  uint32_t checksum;  // of the ChunkMeta and words that follow
+};
+
+struct FooterEntry {
+  ChunkMeta meta;
+  uint64_t offset;  // of the RecordHeader
+};
+
+struct SegmentTrailer {
+  uint64_t footer_offset;
+  uint64_t entries;
+  uint64_t checksum;  // of the footer entries
+  char magic[8];      // "SYSAPMFT"
+};
+
+static_assert(sizeof(FooterEntry) == 40);
+static_assert(sizeof(SegmentTrailer) == 32);
+
+struct SegmentOptions {
+  std::string dir;                        // created if missing
+  std::size_t segment_bytes = 64u << 20;  // a segment is finished once its records fill this
+  bool sync = true;                       // fdatasync() when finishing a segment
+  SeriesIdOrigin origin;                  // recorded in the segments this store starts
+};
+
+struct SegmentStats {
+  uint64_t segments = 0;          // open, including the active one
+  uint64_t chunks = 0;            // indexed across open segments
+  uint64_t bytes = 0;             // file bytes across open segments
+  uint64_t written = 0;           // chunks written since open()
+  uint64_t write_errors = 0;
+  uint64_t recovered_chunks = 0;  // found by scanning unfinished segments
+  uint64_t removed = 0;           // segments deleted by expire()
+};
+
+class SegmentStore {
+ public:
+  SegmentStore() = default;
+  ~SegmentStore();
+  SegmentStore(const SegmentStore&) = delete;
+  SegmentStore& operator=(const SegmentStore&) = delete;
+
+  /// Opens (creating if needed) the segment directory and maps every
+  /// segment found in it, recovering unfinished ones. Returns 0 or -errno.
+  int open(const SegmentOptions& opts);
+
+  /// Calls fn for every chunk in the open segments, oldest segment first
+  /// and in write order within a segment. Used to rebuild the index of an
+  /// in-memory store after a restart; `origin` is the one recorded in the
+  /// chunk's segment.
+  void for_each_chunk(
+      const std::function<void(const SeriesIdOrigin& origin, std::shared_ptr<const SealedChunk>)>& fn) const;
+
+  /// Appends `chunk` to the active segment and stores a zero-copy view of
+  /// the written record in `*view`. Returns 0 or -errno; on error the
+  /// caller should keep its own copy.
+  int write(const SealedChunk& chunk, std::shared_ptr<const SealedChunk>* view);
+
+  /// Finishes the active segment, if any; the next write starts a new one.
+  int finish();
+
+  /// Deletes finished segments whose newest sample is older than
+  /// `cutoff_ms`. Views into them stay valid until released.
+  std::size_t expire(int64_t cutoff_ms);
+
+  SegmentStats stats() const;
+
+ private:
+  struct Segment;
+
+  int start_segment();
+  int finish(Segment& seg);
+  int map_segment(Segment& seg, std::size_t len);
+  std::shared_ptr<const SealedChunk> view(const std::shared_ptr<Segment>& seg, const FooterEntry& e) const;
+
+  SegmentOptions opts_;
+  std::vector<std::shared_ptr<Segment>> segments_;  // oldest first; back() may be active
+  uint64_t next_seq_ = 1;
+  SegmentStats stats_;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,164 @@
+// self_profile.hpp — stage timers for the agent's own hot paths.
+//
+// A StageTimer on the stack times one pass through a stage (a collector
+// tick, a /proc parse, exporter encoding, compression, a socket write)
+// into that stage's Histogram. Histograms shard by thread, so a timer
+// costs two clock reads, a relaxed add into the thread's own shard and
+// one into the stage total; with profiling switched off it is one
+// relaxed load. The pipeline publishes every stage
+// as system_apm_self_stage_*{stage="..."} next to its other self metrics,
+// so a fleet-wide regression can be pinned on a stage from the metrics
+// alone.
+//
+// The clock is CLOCK_MONOTONIC_RAW by default. ProfileClock::kTsc reads
+// the time-stamp counter instead, scaled to ns with a factor calibrated
+// against CLOCK_MONOTONIC_RAW; it is only taken on x86-64 when the CPU
+// reports an invariant TSC (constant_tsc and nonstop_tsc), and configure()
+// falls back to the raw clock otherwise.
+//
+// Built with SYSAPM_USDT, each finished timer also hits a USDT probe,
+// sysapm:stage(stage, ns), written as a .note.stapsdt entry that perf,
+// bpftrace and systemtap understand. The probe is a nop plus a semaphore
+// the tracer raises while it is attached; timers run whenever it is
+// raised, even with profiling switched off.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+#include "sysapm/histogram.hpp"
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#if defined(SYSAPM_USDT) && (defined(__x86_64__) || defined(__aarch64__))
+#define SYSAPM_HAVE_USDT 1
+extern "C" volatile unsigned short sysapm_stage_semaphore;
+#else
+#define SYSAPM_HAVE_USDT 0
+#endif
+
+namespace sysapm {
+
+enum class Stage : uint8_t {
+  kCollect,   // one collector tick
+  kParse,     // turning /proc text into numbers
+  kEncode,    // exporter: samples into protobuf
+  kCompress,  // exporter: snappy
+  kSend,      // exporter: socket writes
+  kCount
+};
+
+inline constexpr std::size_t kStageCount = static_cast<std::size_t>(Stage::kCount);
+
+/// Label value of `s`, e.g. "parse".
+const char* stage_name(Stage s);
+
+enum class ProfileClock : uint8_t { kMonotonicRaw, kTsc };
+
+struct SelfProfileOptions {
+  bool enabled = true;
+  ProfileClock clock = ProfileClock::kMonotonicRaw;
+};
+
+struct StageStats {
+  uint64_t calls = 0;
+  uint64_t total_ns = 0;
+};
+
+class StageProfiler {
+ public:
+  StageProfiler();
+
+  /// Applies `opts`; returns the clock actually in use. Call it before
+  /// other threads start timing; a timer that spans a clock change is
+  /// discarded, not misread.
+  ProfileClock configure(const SelfProfileOptions& opts);
+  ProfileClock clock() const { return tsc_ ? ProfileClock::kTsc : ProfileClock::kMonotonicRaw; }
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+  /// Enabled, or a tracer is attached to the probe.
+  bool active() const {
+#if SYSAPM_HAVE_USDT
+    if (sysapm_stage_semaphore) return true;
+#endif
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  /// Timestamp in the current clock's units; never 0.
+  uint64_t now() const {
+#if defined(__x86_64__)
+    if (tsc_) return (__rdtsc() << 1) | 1;
+#endif
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ((static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec)) << 1);
+  }
+
+  /// Records the stage that started at `start` (a now() value).
+  void finish(Stage s, uint64_t start) {
+    const uint64_t end = now();
+    // The low bit tags the clock, so a timer spanning configure() is dropped.
+    if (((start ^ end) & 1) || end < start) return;
+    uint64_t ns = (end - start) >> 1;
+    if (end & 1) ns = static_cast<uint64_t>((static_cast<unsigned __int128>(ns) * tsc_mult_) >> 32);
+    Slot& slot = slots_[static_cast<std::size_t>(s)];
+    slot.hist.record(ns);
+    slot.total_ns.fetch_add(ns, std::memory_order_relaxed);
+#if SYSAPM_HAVE_USDT
+    if (sysapm_stage_semaphore) probe(static_cast<uint64_t>(s), ns);
+#endif
+  }
+
+  const Histogram& histogram(Stage s) const { return slots_[static_cast<std::size_t>(s)].hist; }
+  uint64_t total_ns(Stage s) const {
+    return slots_[static_cast<std::size_t>(s)].total_ns.load(std::memory_order_relaxed);
+  }
+  /// Sums the histogram shards for the call count.
+  StageStats stats(Stage s) const;
+
+ private:
+  struct Slot {
+    Histogram hist;
+    alignas(64) std::atomic<uint64_t> total_ns{0};
+  };
+
+#if SYSAPM_HAVE_USDT
+  static void probe(uint64_t stage, uint64_t ns);
+#endif
+
+  Slot slots_[kStageCount];
+  std::atomic<bool> enabled_{true};
+  bool tsc_ = false;
+  uint64_t tsc_mult_ = 0;  // ns per cycle, 32.32 fixed point
+};
+
+namespace detail {
+extern StageProfiler g_stage_profiler;
+}  // namespace detail
+
+/// The process-wide profiler every StageTimer records into.
+inline StageProfiler& stage_profiler() { return detail::g_stage_profiler; }
+
+/// Times its own lifetime as one pass through `stage`.
+class StageTimer {
+ public:
+  explicit StageTimer(Stage stage) : stage_(stage) {
+    StageProfiler& p = stage_profiler();
+    start_ = p.active() ? p.now() : 0;
+  }
+  ~StageTimer() {
+    if (start_) stage_profiler().finish(stage_, start_);
+  }
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+ private:
+  Stage stage_;
+  uint64_t start_;
+};
+
+}  // namespace sysapm
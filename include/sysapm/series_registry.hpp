@@ -0,0 +1,266 @@
+// series_registry.hpp — interned series identities with dense 32-bit ids.
+//
+// A series is a metric name plus a set of labels. Every distinct string
+// (metric names, label names, label values) is stored once as a symbol,
+// and a series is stored as its symbol sequence: metric, then label
+// name/value pairs sorted by name. Interning hands out dense ids starting
+// at 1, and everything downstream (rings, the chunk store, export) carries
+// only those ids; collectors intern when a row first appears and cache the
+// id, so the per-tick path never hashes or compares a string.
+//
+// Both lookup tables are open-addressing arrays of (hash, id) pairs probed
+// with string_view or symbol-sequence keys directly, so a miss allocates
+// nothing. Interning takes a mutex; resolving an id back to its name is
+// lock-free, because entries and their bytes live in append-only storage
+// that never moves.
+//
+// Because nothing is ever freed, a label with unbounded values (container
+// ids, client ports) would grow the registry without bound. With limits
+// set, a metric that reaches its cap is limited: from then on a
+// HyperLogLog estimates how many distinct label sets it is really asked
+// for, and once it holds cap * headroom series, new label sets are handed
+// the metric's overflow series, metric{series="other"}, without storing
+// any of their strings. CardinalityLimiter decides downstream which of a
+// limited metric's series keep their own identity.
+//
+// Ids mean something only to the registry that handed them out, yet they
+// outlive it in segment files. Every registry therefore has a random
+// generation, and a saved one carries its lineage: the generations it
+// descends from and how many series each had when it was saved. Whoever
+// persists ids records origin(); trusted_ids() tells which of them a
+// registry can vouch for, so a run that crashed before saving its
+// registry leaves behind only the ids it had inherited.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "sysapm/sketch.hpp"
+
+namespace sysapm {
+
+struct Label {
+  std::string_view name;
+  std::string_view value;
+};
+
+/// A valid Prometheus metric or label name: [A-Za-z_:][A-Za-z0-9_:]*. The
+/// registry itself takes any string; sources the agent does not control
+/// check their names with this first.
+inline bool valid_series_name(std::string_view s) {
+  if (s.empty()) return false;
+  for (std::size_t i = 0; i < s.size(); ++i) {
+    const char c = s[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == ':' || (i && c >= '0' && c <= '9')))
+      return false;
+  }
+  return true;
+}
+
+struct RegistryStats {
+  uint64_t series = 0;
+  uint64_t symbols = 0;
+  uint64_t bytes = 0;  // strings, symbol sequences and table slots
+};
+
+struct CardinalityLimits {
+  uint32_t per_metric = 0;  // series a metric interns before it is limited; 0: none
+  uint32_t headroom = 2;    // a limited metric interns up to per_metric * headroom
+  std::vector<std::pair<std::string, uint32_t>> overrides;  // metric, cap (0: unlimited)
+};
+
+/// Where a run's series ids come from; see trusted_ids().
+struct SeriesIdOrigin {
+  uint64_t generation = 0;  // of the registry that interned them; 0: unknown
+  uint64_t parent = 0;      // of the saved registry it was loaded from; 0: none
+  uint32_t inherited = 0;   // series it took over from the parent
+};
+
+struct MetricCardinality {
+  std::string_view metric;
+  uint32_t cap = 0;
+  uint32_t interned = 0;  // the metric's series in the registry
+  uint32_t overflow = 0;  // its overflow series; 0 until first needed
+  uint64_t refused = 0;   // interns answered with the overflow series
+  double estimate = 0;    // distinct label sets asked for, interned or not
+};
+
+namespace detail {
+
+/// Append-only array with stable element addresses: a fixed directory of
+/// lazily allocated chunks. Appends are serialized by the owner; reads of
+/// indices below a published size are safe from any thread.
+template <typename T, unsigned kChunkBits = 12, unsigned kDirBits = 12>
+class StableArray {
+ public:
+  static constexpr std::size_t kCapacity = std::size_t{1} << (kChunkBits + kDirBits);
+
+  ~StableArray() {
+    for (auto& c : dir_) delete[] c.load(std::memory_order_relaxed);
+  }
+
+  /// Writes `v` at index `i`, allocating its chunk if needed.
+  void set(std::size_t i, const T& v) {
+    auto& c = dir_[i >> kChunkBits];
+    T* chunk = c.load(std::memory_order_relaxed);
+    if (!chunk) {
+      chunk = new T[std::size_t{1} << kChunkBits]();
+      c.store(chunk, std::memory_order_release);
+    }
+    chunk[i & ((std::size_t{1} << kChunkBits) - 1)] = v;
+  }
+
+  const T& operator[](std::size_t i) const {
+    return dir_[i >> kChunkBits].load(std::memory_order_acquire)[i & ((std::size_t{1} << kChunkBits) - 1)];
+  }
+
+ private:
+  std::atomic<T*> dir_[std::size_t{1} << kDirBits] = {};
+};
+
+}  // namespace detail
+
+class SeriesRegistry {
+ public:
+  static constexpr std::size_t kMaxLabels = 32;
+
+  SeriesRegistry();
+  ~SeriesRegistry();
+  SeriesRegistry(const SeriesRegistry&) = delete;
+  SeriesRegistry& operator=(const SeriesRegistry&) = delete;
+
+  /// Id of `metric{labels...}`, interning it on first sight. Label order
+  /// does not matter. Returns 0 for an empty metric name, repeated label
+  /// names, more than kMaxLabels labels, or when the id space is full.
+  uint32_t intern(std::string_view metric, const Label* labels, std::size_t n);
+  uint32_t intern(std::string_view metric, std::initializer_list<Label> labels = {}) {
+    return intern(metric, labels.begin(), labels.size());
+  }
+
+  /// Like intern() but never adds; 0 when the series is unknown.
+  uint32_t find(std::string_view metric, const Label* labels, std::size_t n) const;
+  uint32_t find(std::string_view metric, std::initializer_list<Label> labels = {}) const {
+    return find(metric, labels.begin(), labels.size());
+  }
+
+  // --- lock-free reads of an interned id ---
+
+  std::size_t size() const { return series_count_.load(std::memory_order_acquire); }
+  bool contains(uint32_t id) const { return id != 0 && id <= size(); }
+  std::string_view metric(uint32_t id) const;
+  std::size_t label_count(uint32_t id) const;
+  Label label(uint32_t id, std::size_t i) const;
+  /// Writes `metric{name="value",...}` with Prometheus escaping. Returns
+  /// false for unknown ids or when `buf` is too small.
+  bool format(uint32_t id, char* buf, std::size_t len) const;
+
+  RegistryStats stats() const;
+
+  /// This registry's generation, and what it was loaded from.
+  SeriesIdOrigin origin() const;
+  /// The highest id of those recorded under `o` that this registry maps
+  /// to the same series: all of its own; all a saved ancestor had; what a
+  /// writer that was never saved inherited from a saved ancestor. 0 when
+  /// none can be trusted.
+  uint32_t trusted_ids(const SeriesIdOrigin& o) const;
+
+  /// Appends the symbol and series tables to `out`, ids in order, for a
+  /// later load() (snapshot.hpp).
+  void save(std::vector<uint8_t>* out) const;
+  /// Rebuilds an empty registry from save() output, so every series keeps
+  /// its id, and takes over its lineage; the generation stays this
+  /// registry's own. Metric caps set before are applied to what is loaded.
+  /// Returns bytes consumed, -EBUSY when the registry is not empty, or
+  /// -EINVAL.
+  int load(const uint8_t* data, std::size_t len);
+
+  /// Caps the series each metric may intern; set before interning.
+  void set_limits(const CardinalityLimits& limits);
+  /// Whether the metric of `id` has reached its cap.
+  bool limited(uint32_t id) const;
+  /// Bumped each time another metric becomes limited, so callers caching
+  /// limited() per series know when to look again.
+  uint64_t limit_epoch() const { return limit_epoch_.load(std::memory_order_acquire); }
+  /// The metric of `id`, when limited; `overflow` is interned on demand.
+  bool cardinality(uint32_t id, MetricCardinality* out);
+  std::vector<MetricCardinality> limited_metrics() const;
+
+ private:
+  struct Symbol {
+    const char* data;
+    uint32_t len;
+    uint32_t hash;
+  };
+  struct Series {
+    const uint32_t* syms;  // metric, then name/value pairs
+    uint32_t n;            // entries in syms
+    uint32_t hash;
+  };
+  struct Slot {
+    uint32_t hash;
+    uint32_t id;  // 0 = empty
+  };
+  struct MetricLimit {
+    uint32_t cap = 0;
+    uint32_t interned = 0;
+    uint32_t overflow = 0;
+    uint64_t refused = 0;
+    std::unique_ptr<HyperLogLog> distinct;  // label sets seen since the cap was reached
+  };
+
+  std::string_view symbol(uint32_t sym) const {
+    const Symbol& s = symbols_[sym];
+    return {s.data, s.len};
+  }
+  /// Resolves the symbol sequence of a series; missing symbols are added
+  /// through `adder` when it is non-null.
+  bool canonical(std::string_view metric, const Label* labels, std::size_t n, uint32_t* syms,
+                 SeriesRegistry* adder) const;
+  uint32_t find_symbol(std::string_view s, uint32_t hash) const;
+  uint32_t add_symbol(std::string_view s, uint32_t hash);
+  uint32_t find_series(const uint32_t* syms, uint32_t n, uint32_t hash) const;
+  uint32_t add_series(std::string_view metric, const Label* labels, std::size_t n);
+  uint32_t intern_limited(std::string_view metric, const Label* labels, std::size_t n);
+  uint32_t overflow_series(MetricLimit& ml, std::string_view metric);
+  MetricLimit& limit_for(uint32_t metric_sym);
+  void count_limits();
+  const MetricLimit* limit_of(uint32_t id) const;  // limited metrics only
+  MetricLimit* limit_of(uint32_t id);
+  MetricCardinality describe_limit(uint32_t metric_sym, const MetricLimit& ml) const;
+  void* store(std::size_t bytes, std::size_t align);
+  static void grow(std::vector<Slot>& table, std::size_t used);
+
+  mutable std::mutex mu_;  // guards everything below except the published arrays
+  std::vector<Slot> sym_table_;
+  std::vector<Slot> series_table_;
+  std::vector<std::unique_ptr<char[]>> pages_;
+  char* page_cur_ = nullptr;
+  char* page_end_ = nullptr;
+  uint64_t bytes_ = 0;
+  std::size_t symbol_count_ = 0;
+  detail::StableArray<Symbol> symbols_;
+  detail::StableArray<Series> series_;
+  std::atomic<std::size_t> series_count_{0};
+  uint64_t generation_;
+  SeriesIdOrigin loaded_;  // generation and parent unset until load()
+  std::vector<std::pair<uint64_t, uint32_t>> lineage_;  // saved ancestors, oldest first
+  CardinalityLimits limits_;
+  bool limiting_ = false;
+  std::unordered_map<uint32_t, MetricLimit> metric_limits_;  // by metric symbol
+  std::atomic<uint64_t> limit_epoch_{0};
+};
+
+/// Process-wide registry for users that are not handed one, such as
+/// collectors driven outside a Pipeline.
+SeriesRegistry& default_registry();
+
+}  // namespace sysapm
@@ -0,0 +1,304 @@
+// shm_client.hpp — header-only client for pushing metrics to the agent.
+//
+// An application creates one memfd region of fixed-size slots and hands
+// its descriptor to the agent once, over the agent's ingest socket. Each
+// counter, gauge or histogram it asks for is a slot in that region, and
+// the handle it gets back points straight at the slot's values: updating
+// a metric is a relaxed atomic add or store into shared memory, with no
+// syscall, no packet and no formatting. The agent maps the same pages and
+// reads every slot once per tick.
+//
+//   sysapm::shm::Client apm;
+//   apm.connect("checkout");
+//   auto orders = apm.counter("orders_total", {{"region", "eu"}});
+//   auto latency = apm.histogram("request_latency_us");
+//   orders.add();
+//   latency.record(elapsed_us);
+//
+// Any thread may take handles and update them; take a handle once and
+// keep it, since taking one looks up the slot under a lock. Asking again
+// for the same metric and labels returns the same slot. The region works
+// whether or not an agent has it: if the agent is not up yet, call
+// reattach() later. A client without a region, or whose region is full,
+// hands out handles that do nothing, so instrumentation never fails the
+// application.
+//
+// The region is sealed against resizing before the agent sees it, so the
+// agent can map it without trusting the application. Series carry the
+// client's app name and pid as labels "app" and "pid". Histograms use
+// power-of-two buckets up to 2^37, published like the agent's own
+// histograms: <metric>_bucket{le}, _count and _sum.
+//
+// Only the standard library and Linux headers are used; nothing here
+// links against the agent.
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <mutex>
+#include <string_view>
+
+namespace sysapm::shm {
+
+inline constexpr const char* kIngestSocket = "/run/system-apm-ingest.sock";
+inline constexpr uint32_t kRegionMagic = 0x31484d53;  // "SMH1"
+inline constexpr uint32_t kRegionVersion = 1;
+inline constexpr std::size_t kSlotBytes = 512;
+inline constexpr std::size_t kKeyBytes = 184;  // metric, then label names and values
+inline constexpr std::size_t kSlotValues = 40;
+inline constexpr std::size_t kHistBuckets = kSlotValues - 1;  // le = 2^0 .. 2^37, +Inf
+inline constexpr std::size_t kAppBytes = 64;
+
+enum class SlotKind : uint8_t { kCounter = 1, kGauge = 2, kHistogram = 3 };
+
+struct RegionHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_bytes;
+  uint32_t slot_count;
+  std::atomic<uint32_t> used;  // slots handed out; each is published by its `ready`
+  uint32_t reserved[11];
+};
+
+// The key is "metric\0name\0value\0...": NUL-separated, key_len bytes, the
+// last one a NUL. Values sit on their own cache lines, apart from the key.
+struct Slot {
+  std::atomic<uint32_t> ready;  // 1 once kind and key are written
+  SlotKind kind;
+  uint8_t reserved;
+  uint16_t key_len;
+  char key[kKeyBytes];
+  // counter: v[0]; gauge: v[0] holds the double's bits;
+  // histogram: v[0] the sum, v[1 + b] bucket b.
+  alignas(64) std::atomic<uint64_t> v[kSlotValues];
+};
+
+/// What the client sends with its descriptor.
+struct Hello {
+  uint32_t magic;
+  uint32_t version;
+  char app[kAppBytes];  // NUL-terminated
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "slots are shared across processes");
+static_assert(sizeof(RegionHeader) == 64);
+static_assert(sizeof(Slot) == kSlotBytes);
+
+/// Bucket of `v`: 0 holds v <= 1, b holds 2^(b-1) < v <= 2^b, the last
+/// everything above.
+inline std::size_t hist_bucket(uint64_t v) {
+  const std::size_t b = v <= 1 ? 0 : static_cast<std::size_t>(std::bit_width(v - 1));
+  return b < kHistBuckets ? b : kHistBuckets - 1;
+}
+
+struct Label {
+  std::string_view name;
+  std::string_view value;
+};
+
+class Counter {
+ public:
+  Counter() = default;
+  void add(uint64_t n = 1) const {
+    if (v_) v_->fetch_add(n, std::memory_order_relaxed);
+  }
+  explicit operator bool() const { return v_ != nullptr; }
+
+ private:
+  friend class Client;
+  explicit Counter(std::atomic<uint64_t>* v) : v_(v) {}
+  std::atomic<uint64_t>* v_ = nullptr;
+};
+
+class Gauge {
+ public:
+  Gauge() = default;
+  void set(double x) const {
+    if (v_) v_->store(std::bit_cast<uint64_t>(x), std::memory_order_relaxed);
+  }
+  explicit operator bool() const { return v_ != nullptr; }
+
+ private:
+  friend class Client;
+  explicit Gauge(std::atomic<uint64_t>* v) : v_(v) {}
+  std::atomic<uint64_t>* v_ = nullptr;
+};
+
+class Histogram {
+ public:
+  Histogram() = default;
+  void record(uint64_t x) const {
+    if (!v_) return;
+    v_[1 + hist_bucket(x)].fetch_add(1, std::memory_order_relaxed);
+    v_[0].fetch_add(x, std::memory_order_relaxed);
+  }
+  explicit operator bool() const { return v_ != nullptr; }
+
+ private:
+  friend class Client;
+  explicit Histogram(std::atomic<uint64_t>* v) : v_(v) {}
+  std::atomic<uint64_t>* v_ = nullptr;
+};
+
+class Client {
+ public:
+  Client() = default;
+  ~Client() { close(); }
+  Client(const Client&) = delete;
+  Client& operator=(const Client&) = delete;
+
+  /// Creates a region of `slots` slots and hands it to the agent listening
+  /// on `socket_path`. Returns 0 or -errno; when only the hand-over
+  /// failed, the region is kept and handles work.
+  int connect(std::string_view app, const char* socket_path = kIngestSocket, uint32_t slots = 1024) {
+    close();
+    if (slots == 0 || app.empty() || app.size() >= kAppBytes) return -EINVAL;
+    const std::size_t bytes = kSlotBytes * (std::size_t{slots} + 1);  // the header gets a slot of its own
+    int fd = ::memfd_create("sysapm-metrics", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) return -errno;
+    void* p = MAP_FAILED;
+    if (::ftruncate(fd, static_cast<off_t>(bytes)) < 0 ||
+        ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+        (p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+      const int err = errno;
+      ::close(fd);
+      return -err;
+    }
+    auto* h = static_cast<RegionHeader*>(p);
+    h->magic = kRegionMagic;
+    h->version = kRegionVersion;
+    h->slot_bytes = kSlotBytes;
+    h->slot_count = slots;
+    fd_ = fd;
+    base_ = static_cast<unsigned char*>(p);
+    bytes_ = bytes;
+    std::memset(app_, 0, sizeof app_);
+    std::memcpy(app_, app.data(), app.size());
+    const std::size_t path_len = std::strlen(socket_path);
+    if (path_len >= sizeof socket_path_) {
+      close();
+      return -ENAMETOOLONG;
+    }
+    std::memcpy(socket_path_, socket_path, path_len + 1);
+    return reattach();
+  }
+
+  /// Hands the region to the agent again, e.g. after the agent restarted.
+  /// Values carry on from where they were. Returns 0 or -errno.
+  int reattach() {
+    if (fd_ < 0) return -EBADF;
+    if (sock_ >= 0) ::close(sock_);
+    sock_ = -1;
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, socket_path_, sizeof addr.sun_path);
+    int s = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (s < 0) return -errno;
+    Hello hello{kRegionMagic, kRegionVersion, {}};
+    std::memcpy(hello.app, app_, sizeof hello.app);
+    iovec iov{&hello, sizeof hello};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(c), &fd_, sizeof(int));
+    if (::connect(s, reinterpret_cast<const sockaddr*>(&addr), sizeof addr) < 0 ||
+        ::sendmsg(s, &msg, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof hello)) {
+      const int err = errno;
+      ::close(s);
+      return -err;
+    }
+    // Held open: the agent drops the region when it sees this close.
+    sock_ = s;
+    return 0;
+  }
+
+  /// Unmaps the region; handles taken from it must not be used afterwards.
+  void close() {
+    if (sock_ >= 0) ::close(sock_);
+    if (base_) ::munmap(base_, bytes_);
+    if (fd_ >= 0) ::close(fd_);
+    sock_ = fd_ = -1;
+    base_ = nullptr;
+    bytes_ = 0;
+  }
+
+  /// The last reattach() reached an agent.
+  bool attached() const { return sock_ >= 0; }
+
+  Counter counter(std::string_view metric, std::initializer_list<Label> labels = {}) {
+    Slot* s = slot(SlotKind::kCounter, metric, labels);
+    return Counter(s ? &s->v[0] : nullptr);
+  }
+  Gauge gauge(std::string_view metric, std::initializer_list<Label> labels = {}) {
+    Slot* s = slot(SlotKind::kGauge, metric, labels);
+    return Gauge(s ? &s->v[0] : nullptr);
+  }
+  Histogram histogram(std::string_view metric, std::initializer_list<Label> labels = {}) {
+    Slot* s = slot(SlotKind::kHistogram, metric, labels);
+    return Histogram(s ? s->v : nullptr);
+  }
+
+ private:
+  RegionHeader* header() const { return reinterpret_cast<RegionHeader*>(base_); }
+  Slot* slot_at(uint32_t i) const { return reinterpret_cast<Slot*>(base_ + kSlotBytes * (std::size_t{i} + 1)); }
+
+  Slot* slot(SlotKind kind, std::string_view metric, std::initializer_list<Label> labels) {
+    if (!base_ || metric.empty()) return nullptr;
+    char key[kKeyBytes];
+    std::size_t len = 0;
+    auto put = [&](std::string_view s) {
+      if (s.find('\0') != std::string_view::npos || len + s.size() + 1 > sizeof key) return false;
+      std::memcpy(key + len, s.data(), s.size());
+      len += s.size();
+      key[len++] = '\0';
+      return true;
+    };
+    if (!put(metric)) return nullptr;
+    for (const Label& l : labels)
+      if (!put(l.name) || !put(l.value)) return nullptr;
+    std::lock_guard<std::mutex> lk(mu_);
+    RegionHeader* h = header();
+    const uint32_t used = h->used.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < used; ++i) {
+      Slot* s = slot_at(i);
+      if (s->key_len == len && std::memcmp(s->key, key, len) == 0) return s->kind == kind ? s : nullptr;
+    }
+    if (used == h->slot_count) return nullptr;
+    Slot* s = slot_at(used);
+    s->kind = kind;
+    s->key_len = static_cast<uint16_t>(len);
+    std::memcpy(s->key, key, len);
+    s->ready.store(1, std::memory_order_release);
+    h->used.store(used + 1, std::memory_order_release);
+    return s;
+  }
+
+  int fd_ = -1;
+  int sock_ = -1;
+  unsigned char* base_ = nullptr;
+  std::size_t bytes_ = 0;
+  char app_[kAppBytes] = {};
+  char socket_path_[sizeof(sockaddr_un::sun_path)] = {};
+  std::mutex mu_;  // slot allocation
+};
+
+}  // namespace sysapm::shm
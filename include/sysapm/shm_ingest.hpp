@@ -0,0 +1,109 @@
+// shm_ingest.hpp — the agent's side of the shared-memory metrics API.
+//
+// Applications push their own metrics through shm_client.hpp: each hands
+// the agent a sealed memfd of slots over a Unix seqpacket socket and then
+// only writes to shared memory. This collector accepts those regions,
+// maps them read-only and, every tick, turns each published slot into
+// samples:
+//
+//   counter     <metric>{app,pid,...}
+//   gauge       <metric>{app,pid,...}
+//   histogram   <metric>_bucket{app,pid,...,le}, _count, _sum
+//
+// A slot's key is parsed and interned once, when the slot first appears;
+// after that a tick reads its values only. The agent keeps its own copy of
+// everything it validated (slot count, keys), so a client rewriting its
+// header or keys after the fact cannot make the agent read outside the
+// region or change a series' name. A region that is not a memfd sealed
+// against shrinking is refused: the client could otherwise truncate it
+// and fault the agent.
+//
+// A client is gone when its socket closes: its region is read one last
+// time and its series get staleness markers. A client that reattaches the
+// region it already gave keeps its series.
+// The socket is world-writable, as the statsd port it replaces was.
+#pragma once
+
+#include <poll.h>
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sysapm/collector.hpp"
+#include "sysapm/shm_client.hpp"
+
+namespace sysapm {
+
+struct ShmIngestOptions {
+  std::string socket_path = shm::kIngestSocket;
+  uint32_t max_clients = 256;
+  uint32_t max_slots = 16384;  // per region; larger regions are refused
+};
+
+struct ShmIngestStats {
+  uint64_t clients = 0;         // attached right now
+  uint64_t slots = 0;           // published slots, all clients
+  uint64_t accepted = 0;        // regions taken, since open()
+  uint64_t refused = 0;         // regions or hellos turned away
+  uint64_t refused_slots = 0;   // slots with malformed keys, or kinds reused
+  uint64_t detached = 0;        // clients whose socket closed
+};
+
+class ShmIngestCollector final : public Collector {
+ public:
+  ShmIngestCollector() = default;
+  ~ShmIngestCollector() override;
+  ShmIngestCollector(const ShmIngestCollector&) = delete;
+  ShmIngestCollector& operator=(const ShmIngestCollector&) = delete;
+
+  /// Binds the ingest socket, replacing a stale socket file. Returns 0 or
+  /// -errno.
+  int open(const ShmIngestOptions& opts);
+  void close();
+  const char* name() const override { return "shm"; }
+  int collect(std::vector<Sample>& out) override;
+
+  const ShmIngestStats& stats() const { return stats_; }
+
+ private:
+  struct SlotState {
+    shm::SlotKind kind;  // 0: refused
+    uint32_t first;      // into Client::ids
+  };
+  struct Client {
+    int sock = -1;
+    const unsigned char* base = nullptr;
+    std::size_t bytes = 0;
+    uint32_t slot_count = 0;  // as validated at attach
+    dev_t dev = 0;
+    ino_t ino = 0;
+    std::string app;
+    std::string pid;
+    std::vector<SlotState> slots;  // discovered so far
+    std::vector<uint32_t> ids;
+  };
+  struct Pending {
+    int sock;
+    uint32_t ticks;
+  };
+
+  void accept_clients();
+  // 1 attached, 0 not yet readable, -1 refused.
+  int attach(int sock);
+  void discover(Client& c);
+  void harvest(const Client& c, int64_t ts, std::vector<Sample>& out) const;
+  void detach(Client& c, int64_t ts, std::vector<Sample>& out);
+
+  ShmIngestOptions opts_;
+  int fd_ = -1;
+  std::string path_;
+  std::vector<Pending> pending_;
+  std::vector<Client> clients_;
+  std::vector<pollfd> polls_;
+  ShmIngestStats stats_;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,80 @@
+// sketch.hpp — fixed-memory summaries of unbounded streams.
+//
+// HyperLogLog estimates how many distinct keys a stream held (within about
+// 1.04/sqrt(2^precision), 3% at the default 2^10 one-byte registers) from
+// their 64-bit hashes, without keeping the keys. SpaceSaving keeps the
+// heaviest keys of a weighted stream in a fixed number of counters: any key
+// whose weight exceeds total/capacity is guaranteed to be held, and each
+// count overestimates the key's true weight by at most its error(). Both
+// are single-threaded.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace sysapm {
+
+class HyperLogLog {
+ public:
+  /// 2^precision registers, precision in [4, 16].
+  explicit HyperLogLog(unsigned precision = 10);
+
+  /// Adds a key by its hash; the hash must be well mixed in all 64 bits.
+  void add(uint64_t hash) {
+    const uint64_t idx = hash >> (64 - precision_);
+    const uint64_t rest = hash << precision_;
+    const auto rank = static_cast<uint8_t>(rest ? __builtin_clzll(rest) + 1 : 64 - precision_ + 1);
+    if (rank > registers_[idx]) registers_[idx] = rank;
+  }
+
+  /// Distinct keys added so far, estimated.
+  double estimate() const;
+  void clear();
+  std::size_t bytes() const { return registers_.size(); }
+
+ private:
+  unsigned precision_;
+  std::vector<uint8_t> registers_;
+};
+
+class SpaceSaving {
+ public:
+  explicit SpaceSaving(std::size_t capacity) : capacity_(capacity ? capacity : 1) { heap_.reserve(capacity_); }
+
+  /// Adds `weight` to `key`. A key not held takes over the lightest counter
+  /// when all are in use, inheriting its count as error.
+  void offer(uint32_t key, double weight);
+
+  /// Multiplies every count by `factor` in (0, 1], so old weight fades.
+  void decay(double factor);
+
+  /// The `k` heaviest keys held, heaviest first.
+  void top(std::size_t k, std::vector<uint32_t>* out) const;
+
+  bool contains(uint32_t key) const { return pos_.count(key) != 0; }
+  /// Estimated weight of `key`; 0 when not held.
+  double count(uint32_t key) const;
+  /// How much of count(key) may belong to keys it displaced.
+  double error(uint32_t key) const;
+  std::size_t size() const { return heap_.size(); }
+  std::size_t capacity() const { return capacity_; }
+
+ private:
+  struct Counter {
+    uint32_t key;
+    double count;
+    double error;
+  };
+
+  void sift_down(std::size_t i);
+  void sift_up(std::size_t i);
+  void swap_at(std::size_t a, std::size_t b);
+
+  std::size_t capacity_;
+  std::vector<Counter> heap_;  // min-heap on count
+  std::unordered_map<uint32_t, std::size_t> pos_;  // key -> heap index
+};
+
+}  // namespace sysapm
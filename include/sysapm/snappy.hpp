@@ -0,0 +1,35 @@
+// snappy.hpp — Snappy block-format compression.
+//
+// Prometheus remote write requires the raw Snappy block format (no framing)
+// and most OTLP receivers accept it too, so the exporter carries its own
+// encoder instead of a library dependency. The compressor is the usual
+// greedy LZ77 over 64 KiB fragments with a 14-bit hash table of positions;
+// SnappyCompressor keeps that table between calls so compressing a batch
+// allocates nothing once the output buffer has grown.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sysapm {
+
+class SnappyCompressor {
+ public:
+  /// Worst-case compressed size for `n` input bytes.
+  static std::size_t max_compressed_length(std::size_t n) { return 32 + n + n / 6; }
+
+  /// Replaces `out` with the compressed form of [data, data + len).
+  void compress(const uint8_t* data, std::size_t len, std::vector<uint8_t>* out);
+
+ private:
+  static constexpr unsigned kHashBits = 14;
+  uint16_t table_[1u << kHashBits];
+};
+
+/// Replaces `out` with the decompressed bytes. Returns 0, or -EINVAL for a
+/// malformed block or one that would exceed `max_len`.
+int snappy_uncompress(const uint8_t* data, std::size_t len, std::vector<uint8_t>* out,
+                      std::size_t max_len = std::size_t{1} << 30);
+
+}  // namespace sysapm
@@ -0,0 +1,63 @@
+// snapshot.hpp — the agent's in-memory state, carried across a restart.
+//
+// At shutdown the agent writes one snapshot file: the registry's symbol
+// and series tables, so every series keeps its id (which also keeps the
+// ids in the segment files meaningful), and the rollup stage's open
+// windows and counter baselines, so the first window after the restart
+// has its increase instead of a gap. On start the file is mapped and
+// restored into the empty registry before any collector interns, and into
+// the rollup stage before the first sample.
+//
+// The open windows are saved instead of flushed: emitted half full, each
+// would reach the backend twice under one start time. They are emitted by
+// the next run that restores the file, which means never if the agent is
+// not started again with it; the agent logs how many it deferred. With no
+// snapshot, or when writing it fails, they are flushed at shutdown.
+//
+// Layout: a header (magic, version, body length, FNV-1a of the body), then
+// sections of {tag, length} and an 8-byte padded body. A file that does
+// not check out is ignored as a whole; the agent then starts fresh.
+// Writing goes to a temporary file that is fsynced and renamed over the
+// old one.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "sysapm/rollup.hpp"
+#include "sysapm/series_registry.hpp"
+
+namespace sysapm {
+
+/// Saves `registry` and, when given, `rollup`. Returns 0 or -errno.
+int write_snapshot(const std::string& path, const SeriesRegistry& registry, const RollupStage* rollup);
+
+class SnapshotReader {
+ public:
+  SnapshotReader() = default;
+  ~SnapshotReader();
+  SnapshotReader(const SnapshotReader&) = delete;
+  SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+  /// Maps and checks `path`. Returns 0, -ENOENT, or -EINVAL for a file
+  /// that is truncated, corrupt or of another version.
+  int open(const std::string& path);
+  void close();
+
+  /// Returns 0, -ENODATA when the snapshot has no such section, or the
+  /// error of SeriesRegistry::load() / RollupStage::load().
+  int restore(SeriesRegistry* registry) const;
+  int restore(RollupStage* rollup) const;
+
+  std::size_t bytes() const { return len_; }
+
+ private:
+  std::string_view section(uint32_t tag) const;
+
+  const uint8_t* map_ = nullptr;
+  std::size_t len_ = 0;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,129 @@
+// spool.hpp — size-capped, segmented on-disk FIFO of export batches.
+//
+// When the backend is unreachable the exporter appends its encoded,
+// compressed request bodies here instead of holding them in memory, and
+// pops them back out in order once the link recovers. A record is
+//
+//   SpoolRecordHeader  payload  zero padding to 8 bytes
+//
+// appended to the newest segment file. Appends fill an aligned buffer
+// that is written out in whole kSpoolBlock blocks at block-aligned
+// offsets, so the writes are sequential and valid for O_DIRECT; the
+// partial last block is kept in the buffer and written again, padded,
+// on the next flush. fdatasync() is batched: at most once per
+// sync_interval_ns, plus when a segment is finished. The read cursor is
+// saved with each sync, so a restart resumes where replay stopped.
+//
+// Once the segments add up to more than max_bytes the oldest one is
+// deleted, records and all, so disk use stays bounded during an outage
+// of any length. Reopening a directory scans each segment up to its first
+// torn record and starts a fresh segment for new appends.
+//
+// Single-threaded: the exporter owns its spool.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace sysapm {
+
+inline constexpr std::size_t kSpoolBlock = 4096;
+
+struct SpoolRecordHeader {
+  uint32_t magic;     // kSpoolMagic
+  uint32_t len;       // payload bytes
+  uint32_t points;    // carried through for stats
+  uint32_t checksum;  // of the payload
+};
+
+static_assert(sizeof(SpoolRecordHeader) == 16);
+
+struct SpoolOptions {
+  std::string dir;                         // created if missing
+  std::size_t max_bytes = 256u << 20;      // all segments together
+  std::size_t segment_bytes = 16u << 20;
+  std::size_t buffer_bytes = 1u << 20;     // largest record, and the write size
+  int64_t sync_interval_ns = 1000000000;
+  bool direct = true;                      // O_DIRECT where the filesystem allows it
+};
+
+struct SpoolStats {
+  uint64_t appended = 0;
+  uint64_t popped = 0;
+  uint64_t dropped = 0;        // records deleted with an evicted segment
+  uint64_t pending = 0;        // records not yet popped
+  uint64_t bytes = 0;          // on disk, across segments
+  uint64_t segments = 0;
+  uint64_t syncs = 0;
+  uint64_t write_errors = 0;
+  uint64_t recovered = 0;      // records found by open()
+  bool direct = false;         // the active segment uses O_DIRECT
+};
+
+class Spool {
+ public:
+  Spool() = default;
+  ~Spool();
+  Spool(const Spool&) = delete;
+  Spool& operator=(const Spool&) = delete;
+
+  /// Opens `opts.dir`, recovering what earlier runs left. Returns 0 or
+  /// -errno.
+  int open(const SpoolOptions& opts);
+  /// Flushes and syncs everything, then closes.
+  void close();
+
+  /// Appends one record. Returns 0, -EFBIG for a record larger than the
+  /// buffer, or -errno of a failed write.
+  int append(const void* data, std::size_t len, uint32_t points);
+  /// Moves the oldest record into `out`. Returns 1, 0 when empty, or
+  /// -errno.
+  int pop(std::vector<uint8_t>* out, uint32_t* points);
+  bool empty() const { return pending_ == 0; }
+
+  /// Writes and syncs pending appends once sync_interval_ns has passed
+  /// since the last sync, or at once with `force`. Returns 0 or -errno.
+  int sync(int64_t now_ns, bool force = false);
+
+  SpoolStats stats() const;
+
+ private:
+  struct Segment {
+    uint64_t seq;
+    std::size_t size;     // bytes of records
+    std::size_t records;
+  };
+
+  int start_segment();
+  int flush();
+  int finish_active();
+  void evict();
+  void scan(Segment& seg);
+  std::string path(uint64_t seq) const;
+  void save_cursor();
+  void advance_segment();
+
+  SpoolOptions opts_;
+  bool open_ = false;
+  std::vector<Segment> segments_;  // oldest first; back() is the active one
+  int fd_ = -1;                    // active segment, write side
+  int rfd_ = -1;                   // segment being read
+  uint64_t rseq_ = 0;              // and its sequence number
+  std::size_t roff_ = 0;           // read cursor within segments_.front()
+  std::size_t rskip_ = 0;          // records of segments_.front() already popped
+  int cursor_fd_ = -1;
+  std::unique_ptr<uint8_t, void (*)(void*)> buf_{nullptr, nullptr};
+  std::size_t buf_base_ = 0;       // file offset of buf_[0], block-aligned
+  std::size_t buf_len_ = 0;
+  bool dirty_ = false;             // appended since the last sync
+  int64_t last_sync_ns_ = 0;
+  uint64_t next_seq_ = 1;
+  std::size_t pending_ = 0;
+  std::size_t bytes_ = 0;
+  SpoolStats stats_;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,144 @@
+// spsc_ring.hpp — bounded single-producer/single-consumer ring.
+//
+// Carries fixed-size records from one collector thread to the aggregator
+// without locks. Producer and consumer indices sit on separate cache lines,
+// each side caches the other's index, and both sides move records in
+// batches so the shared lines are touched once per batch.
+//
+// Overflow policy is drop-oldest: a producer that finds the ring full
+// advances the consumer index itself and counts the records it discarded,
+// so a stalled consumer can never block sampling. Because the producer may
+// overwrite slots the consumer is copying, pop() validates its copy with a
+// CAS on the consumer index and retries if the producer got there first;
+// T must therefore be trivially copyable.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+namespace sysapm {
+
+inline constexpr std::size_t kCacheLine = 64;
+
+struct RingStats {
+  uint64_t pushed = 0;
+  uint64_t popped = 0;
+  uint64_t dropped = 0;     // discarded by drop-oldest
+  uint64_t high_water = 0;  // largest occupancy observed by the producer
+  uint64_t capacity = 0;
+};
+
+template <typename T>
+class SpscRing {
+  static_assert(std::is_trivially_copyable_v<T>, "torn copies are discarded, not prevented");
+
+ public:
+  /// `capacity` is rounded up to a power of two.
+  explicit SpscRing(std::size_t capacity) {
+    std::size_t cap = 2;
+    while (cap < capacity) cap *= 2;
+    cap_ = cap;
+    mask_ = cap - 1;
+    slots_ = std::make_unique<T[]>(cap);
+  }
+
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  std::size_t capacity() const { return cap_; }
+
+  /// Producer side. Always accepts all `n` records, dropping the oldest
+  /// queued (or, if n exceeds the capacity, the oldest of `items`).
+  /// Returns how many records were dropped.
+  std::size_t push(const T* items, std::size_t n) {
+    std::size_t dropped = 0;
+    if (n > cap_) {
+      dropped = n - cap_;
+      items += dropped;
+      n = cap_;
+    }
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head + n - cached_tail_ > cap_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      while (head + n - cached_tail_ > cap_) {
+        uint64_t want = head + n - cap_;
+        if (tail_.compare_exchange_weak(cached_tail_, want, std::memory_order_acq_rel,
+                                        std::memory_order_acquire)) {
+          dropped += want - cached_tail_;
+          cached_tail_ = want;
+        }
+      }
+    }
+    for (std::size_t i = 0; i < n; ++i) slots_[(head + i) & mask_] = items[i];
+    head_.store(head + n, std::memory_order_release);
+
+    uint64_t used = head + n - cached_tail_;
+    if (used > high_water_.load(std::memory_order_relaxed))
+      high_water_.store(used, std::memory_order_relaxed);
+    pushed_.store(pushed_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    if (dropped)
+      dropped_.store(dropped_.load(std::memory_order_relaxed) + dropped, std::memory_order_relaxed);
+    return dropped;
+  }
+
+  bool push(const T& item) { return push(&item, 1) == 0; }
+
+  /// Consumer side. Copies up to `max` records and returns the count.
+  std::size_t pop(T* out, std::size_t max) {
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    for (;;) {
+      // Refresh the cached head only when it cannot satisfy the request. A
+      // drop can move tail past our cached head, never past the published one.
+      if (tail >= cached_head_ || cached_head_ - tail < max)
+        cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail >= cached_head_) return 0;
+      uint64_t avail = cached_head_ - tail;
+      std::size_t n = avail < max ? static_cast<std::size_t>(avail) : max;
+      for (std::size_t i = 0; i < n; ++i) out[i] = slots_[(tail + i) & mask_];
+      // Order the copies before the claim; a failed CAS means the producer
+      // dropped some of these slots and may have reused them.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (tail_.compare_exchange_strong(tail, tail + n, std::memory_order_acq_rel,
+                                        std::memory_order_acquire)) {
+        popped_.store(popped_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        return n;
+      }
+      // `tail` now holds the producer's advanced index; retry from there.
+    }
+  }
+
+  /// Records currently queued (approximate when called concurrently).
+  std::size_t size() const {
+    return static_cast<std::size_t>(head_.load(std::memory_order_acquire) -
+                                    tail_.load(std::memory_order_acquire));
+  }
+
+  /// Safe to call from any thread.
+  RingStats stats() const {
+    return {pushed_.load(std::memory_order_relaxed), popped_.load(std::memory_order_relaxed),
+            dropped_.load(std::memory_order_relaxed), high_water_.load(std::memory_order_relaxed),
+            cap_};
+  }
+
+ private:
+  // Producer-owned line.
+  alignas(kCacheLine) std::atomic<uint64_t> head_{0};
+  uint64_t cached_tail_ = 0;
+  std::atomic<uint64_t> pushed_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> high_water_{0};
+
+  // Consumer-owned line. The producer only writes tail_ when dropping.
+  alignas(kCacheLine) std::atomic<uint64_t> tail_{0};
+  uint64_t cached_head_ = 0;
+  std::atomic<uint64_t> popped_{0};
+
+  alignas(kCacheLine) std::unique_ptr<T[]> slots_;
+  std::size_t cap_ = 0;
+  std::size_t mask_ = 0;
+};
+
+}  // namespace sysapm
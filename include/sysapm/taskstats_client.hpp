@@ -0,0 +1,67 @@
+// taskstats_client.hpp — batched TASKSTATS_CMD_GET over generic netlink.
+//
+// One request per thread group returns CPU time, scheduler/IO/swap delay
+// accounting and context switches in a single fixed-layout record, instead
+// of several procfs reads per PID. Requests are packed many to a datagram
+// on one long-lived socket, and replies are collected with recvmmsg() into
+// a receive area allocated once at open().
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sysapm {
+
+struct TaskstatsRecord {
+  int32_t tgid = 0;
+  uint64_t cpu_ns = 0;            // cpu_run_real_total: utime + stime
+  uint64_t cpu_count = 0;         // times scheduled in
+  uint64_t cpu_delay_ns = 0;      // waiting on a run queue
+  uint64_t blkio_delay_ns = 0;    // waiting on synchronous block IO
+  uint64_t swapin_delay_ns = 0;
+  uint64_t freepages_delay_ns = 0;
+  uint64_t thrashing_delay_ns = 0;
+  uint64_t voluntary_ctxt = 0;
+  uint64_t nonvoluntary_ctxt = 0;
+};
+
+class TaskstatsClient {
+ public:
+  static constexpr std::size_t kDefaultBatch = 128;
+
+  TaskstatsClient() = default;
+  ~TaskstatsClient();
+  TaskstatsClient(const TaskstatsClient&) = delete;
+  TaskstatsClient& operator=(const TaskstatsClient&) = delete;
+
+  /// Opens the socket, resolves the TASKSTATS family and probes a query for
+  /// our own thread group. Returns 0, -EPERM without CAP_NET_ADMIN,
+  /// -ENOENT if the kernel lacks taskstats, or another -errno.
+  int open(std::size_t batch = kDefaultBatch);
+  void close();
+  bool is_open() const { return fd_ >= 0; }
+
+  /// Queries `n` thread groups. Writes one record per group that still
+  /// exists into `out` (which must hold `n`) and returns how many were
+  /// written, or -errno if the socket failed.
+  int query(const int32_t* tgids, std::size_t n, TaskstatsRecord* out);
+
+  /// Syscalls issued since open(); lets collectors report per-tick cost.
+  uint64_t syscalls() const { return syscalls_; }
+
+ private:
+  int resolve_family();
+  int send_batch(const int32_t* tgids, std::size_t n);
+  int receive(std::size_t expected, const int32_t* tgids, TaskstatsRecord* out, std::size_t* got);
+
+  int fd_ = -1;
+  uint16_t family_ = 0;
+  uint32_t seq_base_ = 0;
+  std::size_t batch_ = kDefaultBatch;
+  uint64_t syscalls_ = 0;
+  std::vector<unsigned char> tx_;
+  std::vector<unsigned char> rx_;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,142 @@
+// text.hpp — fixed-buffer tokenizer for /proc text formats, and the two
+// HTTP header helpers the exporter and the intake server share.
+//
+// Everything here operates on string_views into a caller-owned buffer and
+// never allocates. Numbers are parsed by hand: /proc output is plain ASCII
+// decimal, and strtoull/strtod would drag in locale handling.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace sysapm {
+
+inline bool is_space(char c) { return c == ' ' || c == '\t'; }
+inline bool is_digit(char c) { return static_cast<unsigned char>(c - '0') < 10; }
+
+/// Parses an unsigned decimal; the whole view must be digits.
+inline bool parse_u64(std::string_view s, uint64_t& out) {
+  if (s.empty()) return false;
+  uint64_t v = 0;
+  for (char c : s) {
+    if (!is_digit(c)) return false;
+    v = v * 10 + static_cast<uint64_t>(c - '0');
+  }
+  out = v;
+  return true;
+}
+
+/// Parses a non-negative fixed-point decimal such as "0.52" or "17".
+inline bool parse_fixed(std::string_view s, double& out) {
+  uint64_t ip = 0, fp = 0, scale = 1;
+  std::size_t i = 0;
+  if (s.empty()) return false;
+  while (i < s.size() && is_digit(s[i])) ip = ip * 10 + static_cast<uint64_t>(s[i++] - '0');
+  if (i < s.size() && s[i] == '.') {
+    for (++i; i < s.size() && is_digit(s[i]); ++i) {
+      fp = fp * 10 + static_cast<uint64_t>(s[i] - '0');
+      scale *= 10;
+    }
+  }
+  if (i != s.size()) return false;
+  out = static_cast<double>(ip) + static_cast<double>(fp) / static_cast<double>(scale);
+  return true;
+}
+
+/// ASCII case-insensitive equality, for HTTP header names and tokens.
+inline bool iequals(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) return false;
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    char x = a[i], y = b[i];
+    if (x >= 'A' && x <= 'Z') x = static_cast<char>(x - 'A' + 'a');
+    if (y >= 'A' && y <= 'Z') y = static_cast<char>(y - 'A' + 'a');
+    if (x != y) return false;
+  }
+  return true;
+}
+
+/// Strips blanks around an HTTP header value, and a trailing CR.
+inline std::string_view trim(std::string_view s) {
+  while (!s.empty() && is_space(s.front())) s.remove_prefix(1);
+  while (!s.empty() && (is_space(s.back()) || s.back() == '\r')) s.remove_suffix(1);
+  return s;
+}
+
+/// Copies `s` into a fixed char array, truncating and NUL-terminating.
+template <std::size_t N>
+inline void copy_name(char (&dst)[N], std::string_view s) {
+  std::size_t n = s.size() < N - 1 ? s.size() : N - 1;
+  std::memcpy(dst, s.data(), n);
+  dst[n] = '\0';
+}
+
+/// Position just past the next newline at or after `p`, or `end`.
+inline const char* next_line(const char* p, const char* end) {
+  const void* nl = std::memchr(p, '\n', static_cast<std::size_t>(end - p));
+  return nl ? static_cast<const char*>(nl) + 1 : end;
+}
+
+/// Skips blanks, then returns the token up to the next blank or newline.
+inline std::string_view next_token(const char*& p, const char* end) {
+  while (p < end && is_space(*p)) ++p;
+  const char* start = p;
+  while (p < end && !is_space(*p) && *p != '\n') ++p;
+  return {start, static_cast<std::size_t>(p - start)};
+}
+
+/// Splits a buffer into lines without copying.
+class LineReader {
+ public:
+  explicit LineReader(std::string_view buf) : buf_(buf) {}
+
+  bool next(std::string_view& line) {
+    if (pos_ >= buf_.size()) return false;
+    std::size_t nl = buf_.find('\n', pos_);
+    if (nl == std::string_view::npos) nl = buf_.size();
+    line = buf_.substr(pos_, nl - pos_);
+    pos_ = nl + 1;
+    return true;
+  }
+
+ private:
+  std::string_view buf_;
+  std::size_t pos_ = 0;
+};
+
+/// Walks whitespace-separated fields of a single line.
+class FieldReader {
+ public:
+  explicit FieldReader(std::string_view line) : p_(line.data()), end_(line.data() + line.size()) {}
+
+  bool next(std::string_view& field) {
+    while (p_ < end_ && is_space(*p_)) ++p_;
+    if (p_ == end_) return false;
+    const char* start = p_;
+    while (p_ < end_ && !is_space(*p_)) ++p_;
+    field = {start, static_cast<std::size_t>(p_ - start)};
+    return true;
+  }
+
+  bool next_u64(uint64_t& v) {
+    std::string_view f;
+    return next(f) && parse_u64(f, v);
+  }
+
+  /// Reads up to `max` numeric fields; stops at the first non-number.
+  std::size_t read_u64s(uint64_t* out, std::size_t max) {
+    std::size_t n = 0;
+    while (n < max && next_u64(out[n])) ++n;
+    return n;
+  }
+
+  /// Remaining unread part of the line.
+  std::string_view rest() const { return {p_, static_cast<std::size_t>(end_ - p_)}; }
+
+ private:
+  const char* p_;
+  const char* end_;
+};
+
+}  // namespace sysapm
@@ -0,0 +1,162 @@
+// thread_pool.hpp — the agent's bounded work-stealing worker pool.
+//
+// Collector ticks and query scans run here instead of on threads of their
+// own. Each worker owns a WorkDeque: tasks submitted from a worker go to
+// its own deque, tasks from any other thread to a shared injection queue.
+// An idle worker takes from its deque first, then the injection queue,
+// then steals from the other workers, and parks once all are empty.
+//
+// The pool as a whole stays within PoolOptions::cpu_budget cores: every
+// task's thread CPU time is charged to a token bucket that refills at the
+// budget rate and holds at most one budget_window_ns worth, and a worker
+// that finds the bucket empty sleeps until it is positive again before it
+// starts its next task. A task is never interrupted, so the budget bounds
+// the average over a window, not any single task. Work a caller runs
+// inline in parallel_for() is on the caller's thread and is not charged.
+//
+// With PoolOptions::nodes the workers are spread over the NUMA nodes,
+// each pinned to its node's CPUs (within the policy's housekeeping CPUs,
+// if any). A task submitted for a node goes to that node's queue; an idle
+// worker looks at its own node's queue and steals from its own node's
+// workers before anything else, and takes another node's work only when
+// its whole node has none. Such remote runs are counted.
+//
+// Queue depth, steals and throttled time are in stats() (and the
+// pipeline's system_apm_self_pool_* series), so a starved agent shows up
+// as a growing depth and throttle time.
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "sysapm/numa.hpp"
+#include "sysapm/tick_scheduler.hpp"
+#include "sysapm/work_deque.hpp"
+
+namespace sysapm {
+
+struct PoolOptions {
+  unsigned workers = 0;                 // 0: one per CPU, at most 8
+  double cpu_budget = 0;                // cores; 0: unlimited
+  int64_t budget_window_ns = 1000000000;  // burst the bucket can save up
+  std::size_t deque_capacity = 1024;    // per worker; overflow goes to the injection queue
+  ThreadPolicy policy;                  // applied by every worker
+  std::vector<NumaNode> nodes;          // spread and pin workers over these; empty: no placement
+};
+
+struct ThreadPoolStats {
+  uint64_t tasks = 0;         // run by workers
+  uint64_t inlined = 0;       // run by the submitting thread: no workers
+  uint64_t injected = 0;      // submitted from outside the pool
+  uint64_t steals = 0;        // taken from another worker's deque
+  uint64_t remote = 0;        // node-bound tasks run on another node
+  uint64_t queued = 0;        // waiting right now, all queues
+  uint64_t cpu_ns = 0;        // thread CPU time of the tasks run by workers
+  uint64_t throttled_ns = 0;  // workers asleep on an empty budget
+};
+
+class ThreadPool {
+ public:
+  ThreadPool() = default;
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /// Starts the workers. Returns 0 or -errno. A pool that was never
+  /// started runs everything inline.
+  int start(const PoolOptions& opts = {});
+  /// Runs what is queued, then joins the workers.
+  void stop();
+  unsigned workers() const { return static_cast<unsigned>(workers_.size()); }
+
+  /// Queues `fn`; runs it inline when there are no workers.
+  void submit(std::function<void()> fn);
+  /// Queues `fn` for a worker of NUMA node `node`; like submit() when no
+  /// worker is on that node.
+  void submit(std::function<void()> fn, int node);
+  /// The NUMA node of the calling worker, or -1.
+  int current_node() const;
+
+  /// Calls fn(begin, end) over subranges of [0, n) no longer than `grain`
+  /// and returns once all of them are done. The calling thread works on
+  /// the range too, so this may be called from a task.
+  void parallel_for(std::size_t n, std::size_t grain, const std::function<void(std::size_t, std::size_t)>& fn);
+
+  /// A range of indices whose work belongs on NUMA node `node`.
+  struct NodeRange {
+    std::size_t begin, end;
+    int node;
+  };
+  /// parallel_for() over several ranges at once, each range's subranges
+  /// handed to its node's workers first. Helpers that run out of their
+  /// own node's work move on to the rest.
+  void parallel_for(const std::vector<NodeRange>& ranges, std::size_t grain,
+                    const std::function<void(std::size_t, std::size_t)>& fn);
+
+  ThreadPoolStats stats() const;
+
+ private:
+  struct Task {
+    std::function<void()> fn;
+    int node = -1;  // index into nodes_ when node-bound
+  };
+  struct Worker {
+    explicit Worker(std::size_t cap) : deque(cap) {}
+    WorkDeque<Task> deque;
+    std::thread thread;
+    uint64_t seed = 0;  // victim selection
+    int node = -1;      // index into nodes_
+  };
+  struct Node {
+    int id;
+    ThreadPolicy policy;  // the pool's, pinned to the node's CPUs
+    std::vector<unsigned> workers;
+    std::mutex mu;
+    std::deque<Task*> inject;
+    std::condition_variable park;  // under park_mu_, like sleepers
+    unsigned sleepers = 0;
+  };
+
+  void run(unsigned self);
+  Task* take(unsigned self);
+  Task* steal(unsigned self, bool same_node);
+  Task* took(Task* t, const Worker& w);
+  void enqueue(Task* t);
+  void wake(int node);
+  int node_index(int id) const;
+  void throttle();
+  void charge(int64_t cpu_ns);
+
+  PoolOptions opts_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::unique_ptr<Node>> nodes_;
+  std::mutex inject_mu_;
+  std::deque<Task*> inject_;
+  std::mutex park_mu_;
+  std::condition_variable park_cv_;
+  std::atomic<int64_t> queued_{0};
+  std::atomic<unsigned> sleepers_{0};
+  std::atomic<bool> stopping_{false};
+
+  std::mutex budget_mu_;
+  double tokens_ = 0;    // ns of CPU the workers may still use
+  int64_t refill_ns_ = 0;
+
+  std::atomic<uint64_t> tasks_{0};
+  std::atomic<uint64_t> inlined_{0};
+  std::atomic<uint64_t> injected_{0};
+  std::atomic<uint64_t> steals_{0};
+  std::atomic<uint64_t> remote_{0};
+  std::atomic<uint64_t> cpu_ns_{0};
+  std::atomic<uint64_t> throttled_ns_{0};
+};
+
+}  // namespace sysapm
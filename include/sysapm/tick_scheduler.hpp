@@ -0,0 +1,81 @@
+// tick_scheduler.hpp — timerfd-driven sampling ticks on wall-clock boundaries.
+//
+// A TickScheduler arms a CLOCK_MONOTONIC timerfd with absolute deadlines
+// chosen so each tick lands on a multiple of the interval in CLOCK_REALTIME
+// (every whole second for a 1s interval), which keeps samples from different
+// hosts and collectors comparable without interpolation. The realtime
+// offset is re-read before every arm, so an NTP step moves the next deadline
+// rather than leaving the grid for good.
+//
+// Each wait() reports how late the wake-up was against its deadline. A tick
+// that overran one or more deadlines does not fire them back to back: the
+// missed ticks are counted and the schedule resumes at the next boundary.
+//
+// apply_thread_policy() is the companion for the threads that run ticks:
+// pin them to housekeeping CPUs and drop them to SCHED_IDLE (or nice 19),
+// so the agent only runs on cycles nobody else wants.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace sysapm {
+
+struct Tick {
+  int64_t deadline_ns = 0;  // CLOCK_REALTIME slot this tick belongs to
+  int64_t skew_ns = 0;      // wake-up minus deadline, on CLOCK_MONOTONIC
+  uint64_t skipped = 0;     // deadlines missed since the previous tick
+};
+
+class TickScheduler {
+ public:
+  TickScheduler() = default;
+  ~TickScheduler();
+  TickScheduler(const TickScheduler&) = delete;
+  TickScheduler& operator=(const TickScheduler&) = delete;
+
+  /// Creates the timerfd; the first tick is the next boundary of
+  /// `interval_ns` after now. Returns 0 or -errno.
+  int open(int64_t interval_ns);
+  void close();
+  bool is_open() const { return fd_ >= 0; }
+
+  /// Blocks until the next deadline or wake(). Returns 1 with `*tick`
+  /// filled on a tick, 0 when woken early (no tick consumed), or -errno.
+  int wait(Tick* tick);
+
+  /// Makes a concurrent or later wait() return 0 promptly. Thread-safe.
+  void wake();
+
+  int64_t interval_ns() const { return interval_ns_; }
+  /// Total deadlines skipped by the catch-up policy.
+  uint64_t skipped_total() const { return skipped_total_; }
+
+ private:
+  int arm();
+
+  int fd_ = -1;
+  int64_t interval_ns_ = 0;
+  int64_t next_real_ = 0;  // CLOCK_REALTIME of the next deadline
+  int64_t armed_mono_ = 0;  // the same deadline on CLOCK_MONOTONIC
+  uint64_t pending_skipped_ = 0;  // reported by the next tick
+  uint64_t skipped_total_ = 0;
+  std::atomic<bool> woken_{false};
+};
+
+struct ThreadPolicy {
+  std::vector<int> cpus;  // housekeeping CPUs; empty leaves affinity alone
+  bool idle = false;      // SCHED_IDLE, falling back to nice 19
+};
+
+/// Applies `p` to the calling thread. Returns 0 or the first -errno; a
+/// failed SCHED_IDLE that fell back to nice 19 still counts as success.
+int apply_thread_policy(const ThreadPolicy& p);
+
+/// Parses a kernel-style CPU list ("0-3,8,10-11") into ascending CPU
+/// numbers. Returns 0 or -EINVAL.
+int parse_cpu_list(std::string_view s, std::vector<int>* out);
+
+}  // namespace sysapm
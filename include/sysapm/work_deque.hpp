@@ -0,0 +1,93 @@
+// work_deque.hpp — bounded Chase-Lev work-stealing deque of pointers.
+//
+// The owning worker pushes and pops at the bottom, LIFO, so the task it
+// just spawned runs next while its data is still in cache; other workers
+// steal the oldest task from the top. Only the last remaining element is
+// contended, and owner and thieves settle it with one CAS on `top`. This
+// is the fence-based formulation of Lê, Pop, Cohen and Zappa Nardelli
+// ("Correct and efficient work-stealing for weak memory models"), with a
+// fixed capacity instead of a growable array: push() reports a full deque
+// and the caller queues the task elsewhere.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "sysapm/spsc_ring.hpp"
+
+namespace sysapm {
+
+template <typename T>
+class WorkDeque {
+ public:
+  /// `capacity` is rounded up to a power of two.
+  explicit WorkDeque(std::size_t capacity = 1024) {
+    std::size_t cap = 2;
+    while (cap < capacity) cap *= 2;
+    mask_ = static_cast<int64_t>(cap - 1);
+    slots_ = std::make_unique<std::atomic<T*>[]>(cap);
+  }
+
+  WorkDeque(const WorkDeque&) = delete;
+  WorkDeque& operator=(const WorkDeque&) = delete;
+
+  /// Owner only. False when the deque is full.
+  bool push(T* item) {
+    const int64_t b = bottom_.load(std::memory_order_relaxed);
+    const int64_t t = top_.load(std::memory_order_acquire);
+    if (b - t > mask_) return false;
+    slots_[b & mask_].store(item, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /// Owner only. Newest item, or nullptr when empty.
+  T* pop() {
+    const int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    T* item = slots_[b & mask_].load(std::memory_order_relaxed);
+    if (t == b) {
+      // Last one: race the thieves for it.
+      if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        item = nullptr;
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return item;
+  }
+
+  /// Any thread. Oldest item, or nullptr when empty or when another thread
+  /// won the race for it.
+  T* steal() {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) return nullptr;
+    T* item = slots_[t & mask_].load(std::memory_order_relaxed);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+      return nullptr;
+    return item;
+  }
+
+  /// Approximate when read by a thread other than the owner.
+  std::size_t size() const {
+    const int64_t n = bottom_.load(std::memory_order_relaxed) - top_.load(std::memory_order_relaxed);
+    return n > 0 ? static_cast<std::size_t>(n) : 0;
+  }
+
+ private:
+  alignas(kCacheLine) std::atomic<int64_t> top_{0};
+  alignas(kCacheLine) std::atomic<int64_t> bottom_{0};
+  int64_t mask_;
+  std::unique_ptr<std::atomic<T*>[]> slots_;
+};
+
+}  // namespace sysapm
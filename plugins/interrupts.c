@@ -0,0 +1,205 @@
+/* interrupts.c — per-CPU interrupt counts, as a C ABI plugin.
+ *
+ *   system-apm --plugin=sysapm-interrupts.so[:proc_root=/proc]
+ *
+ * Publishes interrupts_per_cpu_total{irq,cpu} for every row and CPU column
+ * of /proc/interrupts: hundreds of IRQs times the CPU count on a large
+ * host, all written straight into the agent's batch. Rows keep their
+ * handles between ticks, found by name with the previous tick's position
+ * as the first guess. Offline CPUs have no column; a row's handles are kept
+ * by CPU number, so when CPUs go and come back the columns move but each
+ * series keeps its handle.
+ *
+ * Written against plugin_abi.h alone, in C, to keep the ABI honest.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sysapm/plugin_abi.h"
+
+#define IRQ_MAX_CPU 65535 /* highest CPU number taken from the header */
+
+struct irq_row {
+  char irq[32];
+  uint32_t* handles; /* by CPU number, 0 until interned */
+  unsigned nhandles;
+};
+
+struct irq_state {
+  const sysapm_host* host;
+  int fd;
+  char* buf;
+  size_t cap;
+  unsigned* cpus; /* CPU number of each column */
+  uint32_t ncols;
+  struct irq_row* rows;
+  size_t nrows, cap_rows;
+};
+
+static void irq_close(void* state) {
+  struct irq_state* s = state;
+  if (!s) return;
+  for (size_t i = 0; i < s->nrows; ++i) free(s->rows[i].handles);
+  free(s->rows);
+  free(s->cpus);
+  free(s->buf);
+  if (s->fd >= 0) close(s->fd);
+  free(s);
+}
+
+static int irq_open(const char* args, const sysapm_host* host, void** state) {
+  char root[256] = "/proc";
+  /* The only option: proc_root=PATH. */
+  if (args && *args) {
+    if (strncmp(args, "proc_root=", 10) != 0 || strchr(args, ',') || strlen(args + 10) >= sizeof root)
+      return -EINVAL;
+    strcpy(root, args + 10);
+  }
+  char path[300];
+  snprintf(path, sizeof path, "%s/interrupts", root);
+  struct irq_state* s = calloc(1, sizeof *s);
+  if (!s) return -ENOMEM;
+  s->host = host;
+  s->fd = open(path, O_RDONLY | O_CLOEXEC);
+  s->cap = 16384;
+  s->buf = malloc(s->cap);
+  if (s->fd < 0 || !s->buf) {
+    int err = s->fd < 0 ? -errno : -ENOMEM;
+    irq_close(s);
+    return err;
+  }
+  *state = s;
+  return 0;
+}
+
+/* Rereads the whole file, growing the buffer until it fits. */
+static long read_all(struct irq_state* s) {
+  for (;;) {
+    size_t len = 0;
+    ssize_t n;
+    while ((n = pread(s->fd, s->buf + len, s->cap - 1 - len, (off_t)len)) > 0) len += (size_t)n;
+    if (n < 0) return -errno;
+    if (len < s->cap - 1) {
+      s->buf[len] = '\0';
+      return (long)len;
+    }
+    char* grown = realloc(s->buf, s->cap * 2);
+    if (!grown) return -ENOMEM;
+    s->buf = grown;
+    s->cap *= 2;
+  }
+}
+
+/* Parses the "CPU0 CPU1 ..." header into the CPU number of each column. */
+static int read_header(struct irq_state* s, const char* p, const char* eol) {
+  uint32_t n = 0;
+  for (const char* q = p; (q = strstr(q, "CPU")) && q < eol; q += 3) ++n;
+  unsigned* cpus = malloc((n ? n : 1) * sizeof *cpus);
+  if (!cpus) return -ENOMEM;
+  uint32_t i = 0;
+  for (const char* q = p; i < n && (q = strstr(q, "CPU")) && q < eol; q += 3) {
+    unsigned long cpu = strtoul(q + 3, NULL, 10);
+    if (cpu > IRQ_MAX_CPU) {
+      free(cpus);
+      return -EINVAL;
+    }
+    cpus[i++] = (unsigned)cpu;
+  }
+  if (n == s->ncols && s->cpus && memcmp(cpus, s->cpus, n * sizeof *cpus) == 0) {
+    free(cpus);
+    return 0;
+  }
+  free(s->cpus);
+  s->cpus = cpus;
+  s->ncols = n;
+  return 0;
+}
+
+static struct irq_row* find_row(struct irq_state* s, const char* irq, size_t len, size_t hint) {
+  if (len >= sizeof s->rows[0].irq) len = sizeof s->rows[0].irq - 1;
+  if (hint < s->nrows && strncmp(s->rows[hint].irq, irq, len) == 0 && s->rows[hint].irq[len] == '\0')
+    return &s->rows[hint];
+  for (size_t i = 0; i < s->nrows; ++i)
+    if (strncmp(s->rows[i].irq, irq, len) == 0 && s->rows[i].irq[len] == '\0') return &s->rows[i];
+  if (s->nrows == s->cap_rows) {
+    size_t cap = s->cap_rows ? s->cap_rows * 2 : 64;
+    struct irq_row* rows = realloc(s->rows, cap * sizeof *rows);
+    if (!rows) return NULL;
+    s->rows = rows;
+    s->cap_rows = cap;
+  }
+  struct irq_row* r = &s->rows[s->nrows++];
+  memcpy(r->irq, irq, len);
+  r->irq[len] = '\0';
+  r->handles = NULL;
+  r->nhandles = 0;
+  return r;
+}
+
+/* The handle slot of `cpu` in `r`, growing the row to reach it. */
+static uint32_t* handle_of(struct irq_row* r, unsigned cpu) {
+  if (cpu >= r->nhandles) {
+    unsigned n = r->nhandles ? r->nhandles : 8;
+    while (n <= cpu) n *= 2;
+    uint32_t* grown = realloc(r->handles, n * sizeof *grown);
+    if (!grown) return NULL;
+    memset(grown + r->nhandles, 0, (n - r->nhandles) * sizeof *grown);
+    r->handles = grown;
+    r->nhandles = n;
+  }
+  return &r->handles[cpu];
+}
+
+static int irq_collect(void* state, sysapm_batch* batch) {
+  struct irq_state* s = state;
+  long len = read_all(s);
+  if (len < 0) return (int)len;
+  const char* p = s->buf;
+  const char* end = s->buf + len;
+  const char* eol = memchr(p, '\n', (size_t)(end - p));
+  if (!eol) return -EINVAL;
+  int rc = read_header(s, p, eol);
+  if (rc < 0) return rc;
+  size_t row = 0;
+  for (p = eol + 1; p < end; p = eol + 1, ++row) {
+    eol = memchr(p, '\n', (size_t)(end - p));
+    if (!eol) eol = end;
+    while (p < eol && *p == ' ') ++p;
+    const char* colon = memchr(p, ':', (size_t)(eol - p));
+    if (!colon) continue;
+    struct irq_row* r = find_row(s, p, (size_t)(colon - p), row);
+    if (!r) return -ENOMEM;
+    if (batch->count + s->ncols > batch->capacity &&
+        (rc = s->host->reserve(s->host->ctx, batch, batch->count + s->ncols)) < 0)
+      return rc;
+    /* Counts up to the first non-numeric field; ERR and MIS have one. */
+    const char* q = colon + 1;
+    for (uint32_t col = 0; col < s->ncols; ++col) {
+      while (q < eol && *q == ' ') ++q;
+      if (q == eol || *q < '0' || *q > '9') break;
+      char* next;
+      uint64_t v = strtoull(q, &next, 10);
+      q = next;
+      uint32_t* h = handle_of(r, s->cpus[col]);
+      if (!h) return -ENOMEM;
+      if (!*h) {
+        char cpu[16];
+        snprintf(cpu, sizeof cpu, "%u", s->cpus[col]);
+        sysapm_label labels[2] = {{"irq", r->irq}, {"cpu", cpu}};
+        *h = s->host->intern(s->host->ctx, "interrupts_per_cpu_total", labels, 2, SYSAPM_COUNTER);
+        if (!*h) continue;
+      }
+      batch->series[batch->count] = *h;
+      batch->values[batch->count].counter = v;
+      ++batch->count;
+    }
+  }
+  return 0;
+}
+
+SYSAPM_DEFINE_PLUGIN("interrupts", irq_open, irq_collect, irq_close);
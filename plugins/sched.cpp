@@ -0,0 +1,32 @@
+// sched.cpp — SchedCollector packaged as sysapm-sched.so.
+//
+//   system-apm --plugin=sysapm-sched.so:drain_s=10,max_stacks=4096
+//
+// Arguments are those of parse_sched_options().
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "sysapm/plugin.hpp"
+#include "sysapm/sched_collector.hpp"
+
+namespace {
+
+int create(const char* args, sysapm::Collector** out) {
+  sysapm::SchedOptions opts;
+  int rc = sysapm::parse_sched_options(args, &opts);
+  if (rc < 0) return rc;
+  auto c = std::make_unique<sysapm::SchedCollector>();
+  std::string log;
+  rc = c->open(opts, &log);
+  if (rc < 0) {
+    if (!log.empty()) std::fprintf(stderr, "sysapm-sched: program rejected:\n%s\n", log.c_str());
+    return rc;
+  }
+  *out = c.release();
+  return 0;
+}
+
+}  // namespace
+
+SYSAPM_PLUGIN("sched", create);
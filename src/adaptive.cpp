@@ -0,0 +1,74 @@
+#include "sysapm/adaptive.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace sysapm {
+
+bool AdaptiveFilter::unchanged(const Sample& prev, const Sample& s) const {
+  if (prev.kind != s.kind) return false;
+  if (s.kind == SampleKind::kCounter) return prev.counter == s.counter;
+  if (std::isnan(prev.gauge) || std::isnan(s.gauge)) return std::isnan(prev.gauge) && std::isnan(s.gauge);
+  const double tol = std::max(opts_.abs_epsilon, opts_.rel_epsilon * std::fabs(prev.gauge));
+  return std::fabs(s.gauge - prev.gauge) <= tol;
+}
+
+std::size_t AdaptiveFilter::filter(const Sample* in, std::size_t n, Sample* out) {
+  std::size_t kept = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    const Sample s = in[i];
+    ++stats_.in;
+    if (s.stale()) {  // ended upstream already; pass it on and forget the series
+      if (s.series < state_.size()) {
+        if (state_[s.series].stride > 1) --stats_.backed_off;
+        state_[s.series].stride = 0;
+      }
+      out[kept++] = s;
+      continue;
+    }
+    if (s.series >= state_.size()) state_.resize(std::max<std::size_t>(s.series + 1, state_.size() * 2));
+    State& st = state_[s.series];
+    st.seen_ns = s.ts_ns;
+    if (st.stride != 0 && unchanged(st.last, s)) {
+      if (++st.skipped < st.stride) continue;
+      // Heartbeat. `last` stays the anchor, so drift within epsilon per
+      // sample still adds up to a change.
+      if (st.stride > 1) ++stats_.heartbeats;
+      st.skipped = 0;
+      if (++st.stable >= opts_.stable_ticks && st.stride < opts_.max_stride) {
+        if (st.stride == 1) ++stats_.backed_off;
+        st.stride = std::min(st.stride * 2, opts_.max_stride);
+        st.stable = 0;
+      }
+      out[kept++] = s;
+      continue;
+    }
+    if (st.stride > 1) {
+      ++stats_.snapbacks;
+      --stats_.backed_off;
+    }
+    st.stride = 1;
+    st.stable = 0;
+    st.skipped = 0;
+    st.last = s;
+    out[kept++] = s;
+  }
+  stats_.forwarded += kept;
+  return kept;
+}
+
+void AdaptiveFilter::sweep(int64_t now_ns, std::vector<Sample>* out) {
+  if (opts_.stale_after_ns <= 0 || now_ns < next_sweep_) return;
+  next_sweep_ = now_ns + opts_.stale_after_ns / 4;
+  const int64_t cutoff = now_ns - opts_.stale_after_ns;
+  for (uint32_t id = 0; id < state_.size(); ++id) {
+    State& st = state_[id];
+    if (st.stride == 0 || st.seen_ns >= cutoff) continue;
+    if (st.stride > 1) --stats_.backed_off;
+    st.stride = 0;
+    out->push_back(Sample::make_stale(now_ns, id, st.last.kind));
+    ++stats_.stale;
+  }
+}
+
+}  // namespace sysapm
@@ -0,0 +1,555 @@
+#include "sysapm/aggregator.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "sysapm/exporter.hpp"
+#include "sysapm/proto.hpp"
+#include "sysapm/snappy.hpp"
+#include "sysapm/text.hpp"
+
+namespace sysapm {
+namespace {
+
+uint64_t fnv(std::string_view s) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (char c : s) h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3ull;
+  return h;
+}
+
+uint64_t mix(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+// Independent of label order: resource labels are appended after the
+// point's sorted ones.
+uint64_t shard_hash(std::string_view metric, const Label* labels, std::size_t n) {
+  uint64_t sum = 0;
+  for (std::size_t i = 0; i < n; ++i) sum += mix(fnv(labels[i].name) * 31 ^ fnv(labels[i].value));
+  return mix(sum ^ fnv(metric));
+}
+
+bool read_label(std::string_view msg, Label* out) {
+  ProtoReader r(msg);
+  *out = {};
+  while (r.next()) {
+    if (r.field() == 1) out->name = r.bytes();
+    else if (r.field() == 2) out->value = r.bytes();
+  }
+  return !r.error() && !out->name.empty();
+}
+
+struct CellKey {
+  uint32_t series;
+  uint8_t window;
+  int64_t start;
+  bool operator==(const CellKey& o) const { return series == o.series && window == o.window && start == o.start; }
+};
+
+struct CellHash {
+  std::size_t operator()(const CellKey& k) const {
+    return mix(uint64_t{k.series} << 8 ^ k.window ^ static_cast<uint64_t>(k.start) * 0x9e3779b97f4a7c15ull);
+  }
+};
+
+struct Cell {
+  uint64_t kind = 0;  // agent_wire kind
+  uint64_t count = 0;
+  double min = 0, max = 0, sum = 0;
+  int64_t ts = 0;
+  double gauge = 0;
+  uint64_t counter = 0;
+  std::unique_ptr<HistogramSnapshot> hist;
+};
+
+}  // namespace
+
+struct Aggregator::Point {
+  std::string_view metric;
+  uint32_t label_at = 0;
+  uint8_t label_n = 0;
+  uint8_t window = 0;
+  uint64_t kind = 0;
+  int64_t start = 0, ts = 0;
+  uint64_t count = 0;
+  double min = 0, max = 0, sum = 0, gauge = 0;
+  uint64_t counter = 0;
+  std::string_view histogram;
+};
+
+struct Aggregator::Decoded {
+  struct Bucket {
+    std::vector<Point> points;
+    std::vector<Label> labels;
+  };
+  std::vector<Bucket> buckets;  // by shard
+  std::vector<Label> resource;
+  uint64_t malformed = 0, unmerged = 0;
+  bool bad = false;
+
+  void reset(std::size_t shards) {
+    buckets.resize(shards);
+    for (Bucket& b : buckets) {
+      b.points.clear();
+      b.labels.clear();
+    }
+    resource.clear();
+    malformed = unmerged = 0;
+    bad = false;
+  }
+};
+
+struct Aggregator::Shard {
+  SeriesRegistry registry;
+  std::unordered_map<CellKey, Cell, CellHash> cells;
+  std::unordered_map<uint64_t, int64_t> closed;  // (series, window) -> last emitted start
+  int64_t next_close = INT64_MAX;                // earliest end among open cells
+  std::vector<RollupPoint> out;
+  std::vector<std::unique_ptr<HistogramSnapshot>> hists;  // backing for `out`
+  HistogramSnapshot scratch;
+  AggregatorStats stats;
+};
+
+Aggregator::Aggregator(const AggregatorOptions& opts, ThreadPool* pool, Sink sink)
+    : opts_(opts), pool_(pool), sink_(std::move(sink)) {
+  for (const std::string& attr : opts_.by_resource) {
+    std::string label = attr;
+    std::replace(label.begin(), label.end(), '.', '_');
+    keep_.emplace_back(attr, std::move(label));
+  }
+  unsigned n = opts_.shards ? opts_.shards : pool_ ? pool_->workers() : 1;
+  n = std::max(n, 1u);
+  for (unsigned i = 0; i < n; ++i) shards_.push_back(std::make_unique<Shard>());
+}
+
+Aggregator::~Aggregator() = default;
+
+const SeriesRegistry& Aggregator::registry(unsigned shard) const { return shards_[shard]->registry; }
+
+void Aggregator::run(std::size_t n, const std::function<void(std::size_t)>& fn) {
+  if (!pool_) {
+    for (std::size_t i = 0; i < n; ++i) fn(i);
+    return;
+  }
+  pool_->parallel_for(n, 1, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) fn(i);
+  });
+}
+
+void Aggregator::decode(std::string_view body, Decoded& d) const {
+  namespace aw = agent_wire;
+  d.reset(shards_.size());
+  // The resource applies to every point, wherever it sits in the batch.
+  ProtoReader r(body);
+  while (r.next()) {
+    if (r.field() != aw::kResource || r.type() != WireType::kLen) continue;
+    Label l;
+    if (!read_label(r.bytes(), &l)) continue;
+    for (const auto& [attr, label] : keep_)
+      if (l.name == attr) d.resource.push_back({label, l.value});
+  }
+  if (r.error()) {
+    d.bad = true;
+    return;
+  }
+  Label labels[SeriesRegistry::kMaxLabels];
+  ProtoReader batch(body);
+  while (batch.next()) {
+    if (batch.field() != aw::kPoints || batch.type() != WireType::kLen) continue;
+    Point p;
+    std::size_t n = 0;
+    int64_t width = 0;
+    bool stale = false, ok = true;
+    ProtoReader f(batch.bytes());
+    while (f.next()) {
+      switch (f.field()) {
+        case aw::kMetric: p.metric = f.bytes(); break;
+        case aw::kLabels:
+          if (n == SeriesRegistry::kMaxLabels || !read_label(f.bytes(), &labels[n])) ok = false;
+          else ++n;
+          break;
+        case aw::kKind: p.kind = f.value(); break;
+        case aw::kWidth: width = static_cast<int64_t>(f.value()); break;
+        case aw::kStart: p.start = static_cast<int64_t>(f.value()); break;
+        case aw::kTs: p.ts = static_cast<int64_t>(f.value()); break;
+        case aw::kCount: p.count = f.value(); break;
+        case aw::kMin: p.min = f.as_double(); break;
+        case aw::kMax: p.max = f.as_double(); break;
+        case aw::kSum: p.sum = f.as_double(); break;
+        case aw::kGauge: p.gauge = f.as_double(); break;
+        case aw::kCounter: p.counter = f.value(); break;
+        case aw::kStale: stale = f.value() != 0; break;
+        case aw::kHistogram: p.histogram = f.bytes(); break;
+        default: break;
+      }
+    }
+    if (f.error() || !ok || p.metric.empty() || p.kind > aw::kHistogramKind ||
+        (p.kind == aw::kHistogramKind && p.histogram.empty()) ||
+        n + d.resource.size() > SeriesRegistry::kMaxLabels) {
+      ++d.malformed;
+      continue;
+    }
+    const auto w = std::find(opts_.windows_ns.begin(), opts_.windows_ns.end(), width);
+    if (stale || width <= 0 || w == opts_.windows_ns.end()) {
+      ++d.unmerged;
+      continue;
+    }
+    p.window = static_cast<uint8_t>(w - opts_.windows_ns.begin());
+    for (const Label& l : d.resource) labels[n++] = l;
+    Decoded::Bucket& b = d.buckets[shard_hash(p.metric, labels, n) % shards_.size()];
+    p.label_at = static_cast<uint32_t>(b.labels.size());
+    p.label_n = static_cast<uint8_t>(n);
+    b.labels.insert(b.labels.end(), labels, labels + n);
+    b.points.push_back(p);
+  }
+  // Points before a corrupt tail still merge.
+  d.bad = batch.error();
+}
+
+void Aggregator::merge(Shard& s, const Decoded& d, std::size_t shard) const {
+  namespace aw = agent_wire;
+  const Decoded::Bucket& b = d.buckets[shard];
+  for (const Point& p : b.points) {
+    const uint32_t id = s.registry.intern(p.metric, b.labels.data() + p.label_at, p.label_n);
+    if (!id) {
+      ++s.stats.malformed;
+      continue;
+    }
+    if (auto it = s.closed.find(uint64_t{id} << 8 | p.window); it != s.closed.end() && p.start <= it->second) {
+      ++s.stats.late;
+      continue;
+    }
+    auto [it, fresh] = s.cells.try_emplace(CellKey{id, p.window, p.start});
+    Cell& c = it->second;
+    if (fresh) {
+      if (p.kind == aw::kHistogramKind) {
+        c.hist = std::make_unique<HistogramSnapshot>();
+        if (c.hist->decode(reinterpret_cast<const uint8_t*>(p.histogram.data()), p.histogram.size()) < 0) {
+          s.cells.erase(it);
+          ++s.stats.malformed;
+          continue;
+        }
+      }
+      c.kind = p.kind;
+      c.count = p.count;
+      c.min = p.min;
+      c.max = p.max;
+      c.sum = p.sum;
+      c.ts = p.ts;
+      c.gauge = p.gauge;
+      c.counter = p.counter;
+      s.next_close = std::min(s.next_close, p.start + opts_.windows_ns[p.window]);
+      ++s.stats.points;
+      continue;
+    }
+    if (c.kind != p.kind) {
+      ++s.stats.conflicts;
+      continue;
+    }
+    if (c.hist) {
+      if (s.scratch.decode(reinterpret_cast<const uint8_t*>(p.histogram.data()), p.histogram.size()) < 0) {
+        ++s.stats.malformed;
+        continue;
+      }
+      if (c.hist->merge(s.scratch) < 0) {
+        ++s.stats.conflicts;
+        continue;
+      }
+    }
+    c.count += p.count;
+    c.min = std::min(c.min, p.min);
+    c.max = std::max(c.max, p.max);
+    c.sum += p.sum;
+    c.ts = std::max(c.ts, p.ts);
+    c.gauge += p.gauge;
+    c.counter += p.counter;
+    ++s.stats.points;
+  }
+}
+
+std::size_t Aggregator::ingest(const std::vector<std::string_view>& bodies) {
+  while (decoded_.size() < bodies.size()) decoded_.push_back(std::make_unique<Decoded>());
+  run(bodies.size(), [&](std::size_t i) { decode(bodies[i], *decoded_[i]); });
+  // Each shard visits every body's bucket for it: no shard touches another's state.
+  run(shards_.size(), [&](std::size_t si) {
+    for (std::size_t i = 0; i < bodies.size(); ++i) merge(*shards_[si], *decoded_[i], si);
+  });
+  std::size_t bad = 0;
+  for (std::size_t i = 0; i < bodies.size(); ++i) {
+    const Decoded& d = *decoded_[i];
+    bad += d.bad;
+    shards_[0]->stats.malformed += d.malformed + d.bad;
+    shards_[0]->stats.unmerged += d.unmerged;
+  }
+  batches_ += bodies.size();
+  bad_batches_ += bad;
+  return bad;
+}
+
+void Aggregator::emit(Shard& s, unsigned shard, int64_t now_ns) {
+  const int64_t horizon = now_ns - opts_.grace_ns;
+  if (s.next_close > horizon) return;
+  int64_t next = INT64_MAX;
+  for (auto it = s.cells.begin(); it != s.cells.end();) {
+    const CellKey& k = it->first;
+    const int64_t end = k.start + opts_.windows_ns[k.window];
+    if (end > horizon) {
+      next = std::min(next, end);
+      ++it;
+      continue;
+    }
+    Cell& c = it->second;
+    RollupPoint p{};
+    p.last = c.kind == agent_wire::kGaugeKind ? Sample::make_gauge(c.ts, k.series, c.gauge)
+                                              : Sample::make_counter(c.ts, k.series, c.counter);
+    p.window = k.window;
+    p.start_ns = k.start;
+    p.count = c.count;
+    p.min = c.min;
+    p.max = c.max;
+    p.sum = c.sum;
+    if (c.hist) {
+      p.histogram = c.hist.get();
+      s.hists.push_back(std::move(c.hist));
+    }
+    s.out.push_back(p);
+    int64_t& closed = s.closed.try_emplace(uint64_t{k.series} << 8 | k.window, k.start).first->second;
+    closed = std::max(closed, k.start);
+    it = s.cells.erase(it);
+  }
+  s.next_close = next;
+  if (!s.out.empty() && sink_) sink_(shard, s.out.data(), s.out.size());
+  s.stats.emitted += s.out.size();
+  s.out.clear();
+  s.hists.clear();
+}
+
+void Aggregator::advance(int64_t now_ns) {
+  run(shards_.size(), [&](std::size_t i) { emit(*shards_[i], static_cast<unsigned>(i), now_ns); });
+}
+
+void Aggregator::flush() { advance(INT64_MAX); }
+
+AggregatorStats Aggregator::stats() const {
+  AggregatorStats st;
+  st.batches = batches_;
+  for (const auto& s : shards_) {
+    st.malformed += s->stats.malformed;
+    st.points += s->stats.points;
+    st.unmerged += s->stats.unmerged;
+    st.late += s->stats.late;
+    st.conflicts += s->stats.conflicts;
+    st.emitted += s->stats.emitted;
+    st.cells += s->cells.size();
+    st.series += s->registry.size();
+  }
+  return st;
+}
+
+// --- intake ---
+
+int parse_intake_address(std::string_view target, IntakeOptions* out) {
+  ExporterOptions x;
+  x.path = out->path;
+  if (int rc = parse_export_target(target, &x); rc < 0) return rc;
+  out->host = x.host;
+  out->port = x.port;
+  out->path = x.path;
+  return 0;
+}
+
+IntakeServer::~IntakeServer() { close(); }
+
+int IntakeServer::open(const IntakeOptions& opts) {
+  close();
+  addrinfo hints{};
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+  char port[8];
+  std::snprintf(port, sizeof port, "%u", static_cast<unsigned>(opts.port));
+  addrinfo* res = nullptr;
+  if (::getaddrinfo(opts.host.c_str(), port, &hints, &res) != 0 || !res) return -EADDRNOTAVAIL;
+  int fd = ::socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    ::freeaddrinfo(res);
+    return -errno;
+  }
+  const int one = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if (::bind(fd, res->ai_addr, res->ai_addrlen) < 0 || ::listen(fd, 128) < 0) {
+    const int err = errno;
+    ::freeaddrinfo(res);
+    ::close(fd);
+    return -err;
+  }
+  ::freeaddrinfo(res);
+  sockaddr_storage a{};
+  socklen_t len = sizeof a;
+  ::getsockname(fd, reinterpret_cast<sockaddr*>(&a), &len);
+  port_ = a.ss_family == AF_INET6 ? ntohs(reinterpret_cast<sockaddr_in6*>(&a)->sin6_port)
+                                  : ntohs(reinterpret_cast<sockaddr_in*>(&a)->sin_port);
+  fd_ = fd;
+  opts_ = opts;
+  return 0;
+}
+
+void IntakeServer::close() {
+  for (auto& c : conns_) ::close(c->fd);
+  conns_.clear();
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+}
+
+void IntakeServer::accept_all() {
+  for (;;) {
+    const int c = ::accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (c < 0) return;
+    if (conns_.size() >= opts_.max_connections) {
+      ::close(c);
+      continue;
+    }
+    ++stats_.connections;
+    conns_.push_back(std::make_unique<Conn>(Conn{c, {}, {}}));
+  }
+}
+
+void IntakeServer::reply(Conn& c, int status, bool close) {
+  const char* text = status == 204 ? "No Content" : status == 404 ? "Not Found" : status == 411 ? "Length Required"
+                     : status == 413 ? "Payload Too Large" : "Bad Request";
+  char line[128];
+  std::snprintf(line, sizeof line, "HTTP/1.1 %d %s\r\n%s%s\r\n", status, text,
+                status == 204 ? "" : "Content-Length: 0\r\n", close ? "Connection: close\r\n" : "");
+  c.out.append(line);
+  if (status / 100 != 2) ++stats_.rejected;
+  if (close) c.closing = true;
+}
+
+void IntakeServer::parse(Conn& c, std::vector<std::vector<uint8_t>>* bodies) {
+  // Every complete request in the buffer, in order: agents pipeline them.
+  while (!c.closing) {
+    const std::size_t he = c.in.find("\r\n\r\n");
+    if (he == std::string::npos) {
+      if (c.in.size() > 65536) reply(c, 400, true);
+      return;
+    }
+    const std::string_view head(c.in.data(), he);
+    const std::size_t eol = head.find("\r\n");
+    const std::string_view request = head.substr(0, eol);
+    const std::size_t sp1 = request.find(' '), sp2 = request.rfind(' ');
+    if (sp1 == std::string_view::npos || sp2 <= sp1) {
+      reply(c, 400, true);
+      return;
+    }
+    const bool ok_target = request.substr(0, sp1) == "POST" && request.substr(sp1 + 1, sp2 - sp1 - 1) == opts_.path;
+    std::size_t length = 0;
+    bool snappy = false, chunked = false, close = false, bad = false;
+    for (std::size_t pos = eol; pos != std::string_view::npos;) {
+      pos += 2;
+      const std::size_t next = head.find("\r\n", pos);
+      const std::string_view line = head.substr(pos, next == std::string_view::npos ? next : next - pos);
+      pos = next;
+      const std::size_t colon = line.find(':');
+      if (colon == std::string_view::npos) continue;
+      const std::string_view name = trim(line.substr(0, colon)), value = trim(line.substr(colon + 1));
+      if (iequals(name, "content-length")) {
+        uint64_t v = 0;
+        if (!parse_u64(value, v)) bad = true;
+        length = static_cast<std::size_t>(std::min<uint64_t>(v, SIZE_MAX / 2));
+      } else if (iequals(name, "content-encoding")) {
+        snappy = iequals(value, "snappy");
+        if (!snappy && !iequals(value, "identity")) bad = true;
+      } else if (iequals(name, "transfer-encoding")) {
+        chunked = true;
+      } else if (iequals(name, "connection")) {
+        close = iequals(value, "close");
+      }
+    }
+    if (chunked) return reply(c, 411, true);
+    if (bad) return reply(c, 400, true);
+    if (length > opts_.max_body) return reply(c, 413, true);
+    if (c.in.size() - (he + 4) < length) return;  // wait for the rest
+    const auto* body = reinterpret_cast<const uint8_t*>(c.in.data()) + he + 4;
+    int status = 204;
+    if (!ok_target) {
+      status = 404;
+    } else if (snappy) {
+      if (snappy_uncompress(body, length, &scratch_, opts_.max_body) < 0)
+        status = 400;
+      else
+        bodies->push_back(scratch_);
+    } else {
+      bodies->emplace_back(body, body + length);
+    }
+    ++stats_.requests;
+    stats_.bytes += length;
+    reply(c, status, close);
+    c.in.erase(0, he + 4 + length);
+  }
+}
+
+bool IntakeServer::read_some(Conn& c, std::vector<std::vector<uint8_t>>* bodies) {
+  char buf[65536];
+  for (;;) {
+    const ssize_t n = ::recv(c.fd, buf, sizeof buf, 0);
+    if (n > 0) {
+      c.in.append(buf, static_cast<std::size_t>(n));
+      // Bound the buffer; the request is rejected once its head is in.
+      if (c.in.size() >= opts_.max_body + 65536) break;
+      continue;
+    }
+    if (n == 0) {
+      parse(c, bodies);
+      return false;
+    }
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+    return false;
+  }
+  parse(c, bodies);
+  return true;
+}
+
+int IntakeServer::poll(int timeout_ms, std::vector<std::vector<uint8_t>>* bodies) {
+  if (fd_ < 0) return -EBADF;
+  std::vector<pollfd> fds;
+  fds.reserve(conns_.size() + 1);
+  fds.push_back({fd_, POLLIN, 0});
+  for (const auto& c : conns_) fds.push_back({c->fd, static_cast<short>(POLLIN | (c->out.empty() ? 0 : POLLOUT)), 0});
+  const int ready = ::poll(fds.data(), fds.size(), timeout_ms);
+  if (ready < 0) return errno == EINTR ? 0 : -errno;
+  if (ready == 0) return 0;
+  for (std::size_t i = 1; i < fds.size(); ++i) {
+    Conn& c = *conns_[i - 1];
+    bool alive = true;
+    if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) alive = read_some(c, bodies);
+    while (alive && !c.out.empty()) {
+      const ssize_t w = ::send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+      if (w < 0) {
+        alive = errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        break;
+      }
+      c.out.erase(0, static_cast<std::size_t>(w));
+    }
+    if (!alive || (c.closing && c.out.empty())) {
+      ::close(c.fd);
+      c.fd = -1;
+    }
+  }
+  conns_.erase(std::remove_if(conns_.begin(), conns_.end(), [](const auto& c) { return c->fd < 0; }),
+               conns_.end());
+  if (fds[0].revents & POLLIN) accept_all();
+  return 0;
+}
+
+}  // namespace sysapm
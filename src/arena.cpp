@@ -0,0 +1,92 @@
+#include "sysapm/arena.hpp"
+
+#include <cstdlib>
+
+#include "sysapm/numa.hpp"
+
+namespace sysapm {
+namespace {
+
+constexpr std::size_t kHeader = 64;  // keeps block data cache-line aligned
+
+std::size_t block_alloc_bytes(std::size_t size, int node) {
+  const std::size_t unit = node < 0 ? kHeader : 4096;
+  return (kHeader + size + unit - 1) / unit * unit;
+}
+
+}  // namespace
+
+TickArena::TickArena(std::size_t block_bytes, int node)
+    : block_bytes_(block_bytes ? block_bytes : 4096), node_(node) {}
+
+TickArena::~TickArena() { release_blocks(); }
+
+void TickArena::release_blocks() {
+  for (Block* b = first_; b;) {
+    Block* next = b->next;
+    if (node_ < 0)
+      std::free(b);
+    else
+      numa_free(b, block_alloc_bytes(b->size, node_));
+    b = next;
+  }
+  first_ = cur_block_ = nullptr;
+  cur_ = end_ = nullptr;
+  capacity_ = 0;
+}
+
+void TickArena::add_block(std::size_t min_bytes) {
+  // Grow geometrically so a burst needs few blocks before the next reset
+  // folds them together.
+  std::size_t size = block_bytes_;
+  if (size < capacity_) size = capacity_;
+  if (size < min_bytes) size = min_bytes;
+  void* mem = node_ < 0 ? std::aligned_alloc(kHeader, block_alloc_bytes(size, node_))
+                        : numa_alloc(block_alloc_bytes(size, node_), node_);
+  if (!mem) throw std::bad_alloc();
+  ++upstream_allocs_;
+  auto* b = static_cast<Block*>(mem);
+  b->next = nullptr;
+  b->size = size;
+  if (cur_block_)
+    cur_block_->next = b;
+  else
+    first_ = b;
+  cur_block_ = b;
+  cur_ = static_cast<char*>(mem) + kHeader;
+  end_ = cur_ + size;
+  capacity_ += size;
+}
+
+void* TickArena::allocate(std::size_t bytes, std::size_t align) {
+  auto aligned = [align](char* p) {
+    auto v = reinterpret_cast<uintptr_t>(p);
+    return reinterpret_cast<char*>((v + align - 1) & ~(uintptr_t{align} - 1));
+  };
+  char* p = cur_ ? aligned(cur_) : nullptr;
+  if (!p || p + bytes > end_) {
+    add_block(bytes + align);
+    p = aligned(cur_);
+  }
+  used_ += static_cast<std::size_t>(p + bytes - cur_);
+  cur_ = p + bytes;
+  return p;
+}
+
+void TickArena::reset() {
+  if (used_ > high_water_) high_water_ = used_;
+  used_ = 0;
+  if (first_ && first_->next) {
+    std::size_t total = capacity_;
+    release_blocks();
+    add_block(total);
+    return;
+  }
+  cur_block_ = first_;
+  if (first_) {
+    cur_ = reinterpret_cast<char*>(first_) + kHeader;
+    end_ = cur_ + first_->size;
+  }
+}
+
+}  // namespace sysapm
@@ -0,0 +1,293 @@
+#include "sysapm/bpf.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace sysapm {
+namespace {
+
+int sys_bpf(int cmd, bpf_attr* attr) {
+  return static_cast<int>(::syscall(SYS_bpf, cmd, attr, sizeof *attr));
+}
+
+uint64_t ptr(const void* p) { return reinterpret_cast<uintptr_t>(p); }
+
+void copy_name(char (&dst)[BPF_OBJ_NAME_LEN], const char* name) {
+  std::strncpy(dst, name ? name : "", BPF_OBJ_NAME_LEN - 1);
+}
+
+// Reads a small tracefs/procfs file whole. Returns its length or -errno.
+int read_file(const std::string& path, std::string* out) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -errno;
+  out->clear();
+  char buf[4096];
+  for (;;) {
+    ssize_t n = ::read(fd, buf, sizeof buf);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      int err = n < 0 ? -errno : 0;
+      ::close(fd);
+      return err ? err : static_cast<int>(out->size());
+    }
+    out->append(buf, static_cast<std::size_t>(n));
+  }
+}
+
+}  // namespace
+
+int BpfMap::create(const BpfMapSpec& spec, const char* name) {
+  close();
+  bpf_attr attr;
+  std::memset(&attr, 0, sizeof attr);
+  attr.map_type = spec.type;
+  attr.key_size = spec.key_size;
+  attr.value_size = spec.value_size;
+  attr.max_entries = spec.max_entries;
+  attr.map_flags = spec.flags;
+  copy_name(attr.map_name, name);
+  int fd = sys_bpf(BPF_MAP_CREATE, &attr);
+  if (fd < 0) return -errno;
+  fd_ = fd;
+  spec_ = spec;
+  return 0;
+}
+
+void BpfMap::close() {
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+}
+
+int BpfMap::lookup(const void* key, void* value) const {
+  bpf_attr attr;
+  std::memset(&attr, 0, sizeof attr);
+  attr.map_fd = static_cast<uint32_t>(fd_);
+  attr.key = ptr(key);
+  attr.value = ptr(value);
+  return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0 ? -errno : 0;
+}
+
+int BpfMap::update(const void* key, const void* value, uint64_t flags) {
+  bpf_attr attr;
+  std::memset(&attr, 0, sizeof attr);
+  attr.map_fd = static_cast<uint32_t>(fd_);
+  attr.key = ptr(key);
+  attr.value = ptr(value);
+  attr.flags = flags;
+  return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0 ? -errno : 0;
+}
+
+int BpfMap::lookup_all(void* keys, void* values, std::size_t max) const {
+  // The resume token is opaque (a bucket index for hash maps) but never
+  // larger than a key.
+  alignas(8) unsigned char token[2][64];
+  if (spec_.key_size > sizeof token[0]) return -EINVAL;
+  std::size_t got = 0;
+  bool first = true;
+  int cur = 0;
+  while (got < max) {
+    bpf_attr attr;
+    std::memset(&attr, 0, sizeof attr);
+    attr.batch.in_batch = first ? 0 : ptr(token[cur]);
+    attr.batch.out_batch = ptr(token[cur ^ 1]);
+    attr.batch.keys = ptr(static_cast<unsigned char*>(keys) + got * spec_.key_size);
+    attr.batch.values = ptr(static_cast<unsigned char*>(values) + got * spec_.value_size);
+    attr.batch.count = static_cast<uint32_t>(max - got);
+    attr.batch.map_fd = static_cast<uint32_t>(fd_);
+    int rc = sys_bpf(BPF_MAP_LOOKUP_BATCH, &attr);
+    int err = rc < 0 ? errno : 0;
+    got += attr.batch.count;  // valid on ENOENT too
+    if (err == ENOENT) break;  // walked the whole map
+    if (err) return -err;
+    first = false;
+    cur ^= 1;
+  }
+  return static_cast<int>(got);
+}
+
+BpfAsm::Label BpfAsm::label() {
+  labels_.push_back(-1);
+  return {static_cast<int>(labels_.size() - 1)};
+}
+
+void BpfAsm::bind(Label l) { labels_[static_cast<std::size_t>(l.id)] = static_cast<int>(insns_.size()); }
+
+void BpfAsm::emit(int code, int dst, int src, int16_t off, int32_t imm) {
+  bpf_insn in;
+  std::memset(&in, 0, sizeof in);
+  in.code = static_cast<uint8_t>(code);
+  in.dst_reg = static_cast<uint8_t>(dst) & 0xf;
+  in.src_reg = static_cast<uint8_t>(src) & 0xf;
+  in.off = off;
+  in.imm = imm;
+  insns_.push_back(in);
+}
+
+void BpfAsm::emit_jump(int code, int dst, int src, int32_t imm, Label to) {
+  fixups_.emplace_back(insns_.size(), to.id);
+  emit(code, dst, src, 0, imm);
+}
+
+void BpfAsm::ld_map(int dst, int map_fd) {
+  emit(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, map_fd);
+  emit(0, 0, 0, 0, 0);
+}
+
+void BpfAsm::jmp_imm(int op, int dst, int32_t imm, Label to) { emit_jump(BPF_JMP | op | BPF_K, dst, 0, imm, to); }
+
+void BpfAsm::jmp(int op, int dst, int src, Label to) { emit_jump(BPF_JMP | op | BPF_X, dst, src, 0, to); }
+
+void BpfAsm::ja(Label to) { emit_jump(BPF_JMP | BPF_JA, 0, 0, 0, to); }
+
+int BpfAsm::finish() {
+  for (auto [at, id] : fixups_) {
+    int target = labels_[static_cast<std::size_t>(id)];
+    if (target < 0) return -EINVAL;
+    long off = static_cast<long>(target) - static_cast<long>(at) - 1;
+    if (off < INT16_MIN || off > INT16_MAX) return -EINVAL;
+    insns_[at].off = static_cast<int16_t>(off);
+  }
+  fixups_.clear();
+  return 0;
+}
+
+int BpfProgram::load(bpf_prog_type type, const BpfAsm& code, const char* name, std::string* log) {
+  close();
+  const auto& insns = code.insns();
+  bpf_attr attr;
+  std::memset(&attr, 0, sizeof attr);
+  attr.prog_type = type;
+  attr.insns = ptr(insns.data());
+  attr.insn_cnt = static_cast<uint32_t>(insns.size());
+  attr.license = ptr("GPL");  // bpf_get_stackid and friends are GPL-only
+  copy_name(attr.prog_name, name);
+  int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+  if (fd < 0 && log) {
+    // Retry with the verifier log only on failure; it is large and slow.
+    int err = errno;
+    std::vector<char> buf(1 << 20);
+    attr.log_buf = ptr(buf.data());
+    attr.log_size = static_cast<uint32_t>(buf.size());
+    attr.log_level = 1;
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0) {
+      *log = buf.data();
+      errno = err;
+    }
+  }
+  if (fd < 0) return -errno;
+  fd_ = fd;
+  return 0;
+}
+
+void BpfProgram::close() {
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+}
+
+std::string find_tracefs() {
+  std::string mounts;
+  if (read_file("/proc/self/mounts", &mounts) < 0) return {};
+  std::string debugfs;
+  std::size_t pos = 0;
+  while (pos < mounts.size()) {
+    std::size_t eol = mounts.find('\n', pos);
+    if (eol == std::string::npos) eol = mounts.size();
+    char dir[512], type[64];
+    std::string line = mounts.substr(pos, eol - pos);
+    if (std::sscanf(line.c_str(), "%*s %511s %63s", dir, type) == 2) {
+      if (std::strcmp(type, "tracefs") == 0) return dir;
+      if (std::strcmp(type, "debugfs") == 0) debugfs = std::string(dir) + "/tracing";
+    }
+    pos = eol + 1;
+  }
+  if (!debugfs.empty() && ::access((debugfs + "/events").c_str(), F_OK) == 0) return debugfs;
+  return {};
+}
+
+int tracepoint_field(const std::string& tracefs, const char* category, const char* event, const char* field,
+                     TracepointField* out) {
+  std::string format;
+  int rc = read_file(tracefs + "/events/" + category + "/" + event + "/format", &format);
+  if (rc < 0) return rc;
+  // Lines look like: "\tfield:pid_t next_pid;\toffset:56;\tsize:4;\tsigned:1;"
+  const std::size_t flen = std::strlen(field);
+  for (std::size_t pos = format.find("field:"); pos != std::string::npos; pos = format.find("field:", pos + 1)) {
+    std::size_t semi = format.find(';', pos);
+    if (semi == std::string::npos) break;
+    std::size_t name_end = semi;
+    while (name_end > pos && format[name_end - 1] == ']') {  // arrays: "char comm[16]"
+      name_end = format.rfind('[', name_end - 1);
+    }
+    if (name_end < flen || format.compare(name_end - flen, flen, field) != 0) continue;
+    const char c = format[name_end - flen - 1];
+    if (c != ' ' && c != '*') continue;
+    unsigned off = 0, size = 0;
+    if (std::sscanf(format.c_str() + semi, ";%*[ \t]offset:%u;%*[ \t]size:%u;", &off, &size) != 2) return -EINVAL;
+    out->offset = off;
+    out->size = size;
+    return 0;
+  }
+  return -ENOENT;
+}
+
+int tracepoint_print_fmt(const std::string& tracefs, const char* category, const char* event, std::string* out) {
+  std::string format;
+  int rc = read_file(tracefs + "/events/" + category + "/" + event + "/format", &format);
+  if (rc < 0) return rc;
+  static constexpr char kKey[] = "print fmt: ";
+  std::size_t pos = format.find(kKey);
+  if (pos == std::string::npos) return -EINVAL;
+  pos += sizeof kKey - 1;
+  std::size_t end = format.find('\n', pos);
+  out->assign(format, pos, end == std::string::npos ? std::string::npos : end - pos);
+  return 0;
+}
+
+int TracepointLink::attach(const std::string& tracefs, const char* category, const char* event,
+                           const BpfProgram& prog) {
+  close();
+  std::string id;
+  int rc = read_file(tracefs + "/events/" + category + "/" + event + "/id", &id);
+  if (rc < 0) return rc;
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof attr);
+  attr.type = PERF_TYPE_TRACEPOINT;
+  attr.size = sizeof attr;
+  attr.config = std::strtoull(id.c_str(), nullptr, 10);
+  attr.sample_period = 1;
+  attr.sample_type = PERF_SAMPLE_RAW;
+  attr.wakeup_events = 1;
+  const long cpus = ::sysconf(_SC_NPROCESSORS_CONF);
+  for (long cpu = 0; cpu < cpus; ++cpu) {
+    int fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, -1, static_cast<int>(cpu), -1,
+                                        PERF_FLAG_FD_CLOEXEC));
+    if (fd < 0) {
+      if (errno == ENODEV) continue;  // offline CPU
+      rc = -errno;
+      close();
+      return rc;
+    }
+    fds_.push_back(fd);
+    if (::ioctl(fd, PERF_EVENT_IOC_SET_BPF, prog.fd()) < 0 || ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+      rc = -errno;
+      close();
+      return rc;
+    }
+  }
+  return fds_.empty() ? -ENODEV : 0;
+}
+
+void TracepointLink::close() {
+  for (int fd : fds_) ::close(fd);
+  fds_.clear();
+}
+
+}  // namespace sysapm
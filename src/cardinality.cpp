@@ -0,0 +1,200 @@
+#include "sysapm/cardinality.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+namespace sysapm {
+
+struct CardinalityLimiter::Metric {
+  Metric(const MetricCardinality& c, std::size_t k, std::size_t counters)
+      : name(c.metric), overflow(c.overflow), top_k(k), top(counters) {}
+
+  std::string name;  // owned: self metrics label with it
+  uint32_t overflow;
+  std::size_t top_k;
+  SpaceSaving top;
+  std::vector<uint32_t> keep;  // sorted
+  bool chosen = false;         // keep is valid; until then everything passes
+  uint32_t ticks = 0;
+  int64_t ts = 0;              // current tick
+  SampleKind kind = SampleKind::kCounter;
+  bool kind_set = false;
+  uint64_t other_counter = 0;  // increases folded so far
+  double other_gauge = 0;      // this tick's folded gauges
+  uint64_t refused_now = 0;    // this tick's sum of overflow-id counters
+  uint64_t refused_last = 0;   // the previous tick's
+  bool refused_seen = false;
+  bool dirty = false;
+  uint64_t folded = 0;
+  uint32_t self_ids[3] = {};
+};
+
+CardinalityLimiter::CardinalityLimiter(SeriesRegistry& registry, const CardinalityOptions& opts)
+    : registry_(registry), opts_(opts) {}
+
+CardinalityLimiter::~CardinalityLimiter() = default;
+
+CardinalityLimiter::Metric* CardinalityLimiter::metric_for(uint32_t series) {
+  MetricCardinality c;
+  if (!registry_.cardinality(series, &c) || !c.overflow) return nullptr;
+  auto& m = metrics_[c.overflow];
+  if (!m) {
+    const std::size_t k = opts_.top_k ? opts_.top_k : c.cap;
+    m = std::make_unique<Metric>(c, k, k * std::max(opts_.counters_per_key, 1u));
+    ++stats_.limited;
+  }
+  return m.get();
+}
+
+void CardinalityLimiter::start_tick(Metric& m, int64_t ts) {
+  m.ts = ts;
+  m.other_gauge = 0;
+  if (m.refused_seen) {
+    // Only rises count: a refused source that went away must not look
+    // like a counter reset.
+    if (m.refused_now > m.refused_last) m.other_counter += m.refused_now - m.refused_last;
+    m.refused_last = m.refused_now;
+  }
+  m.refused_now = 0;
+  m.refused_seen = false;
+  if (++m.ticks % std::max(opts_.epoch_ticks, 1u) == 0) {
+    m.top.top(m.top_k, &m.keep);
+    std::sort(m.keep.begin(), m.keep.end());
+    m.top.decay(opts_.decay);
+    m.chosen = true;
+  }
+}
+
+void CardinalityLimiter::fold(Metric& m, const Sample& s, uint64_t delta) {
+  if (!m.kind_set) {
+    m.kind = s.kind;
+    m.kind_set = true;
+  }
+  ++stats_.folded;
+  ++m.folded;
+  if (s.kind != m.kind) return;
+  if (s.kind == SampleKind::kCounter)
+    m.other_counter += delta;
+  else
+    m.other_gauge += s.gauge;
+  if (!m.dirty) {
+    m.dirty = true;
+    dirty_.push_back(&m);
+  }
+}
+
+void CardinalityLimiter::filter(const Sample* in, std::size_t n, std::vector<Sample>* out) {
+  stats_.in += n;
+  if (const uint64_t epoch = registry_.limit_epoch(); epoch != epoch_) {
+    // Another metric became limited; its series must be looked at again.
+    epoch_ = epoch;
+    std::fill(state_.begin(), state_.end(), kUnknown);
+  }
+  for (std::size_t i = 0; i < n; ++i) {
+    const Sample& s = in[i];
+    if (s.series >= state_.size()) state_.resize(std::max<std::size_t>(s.series + 1, registry_.size() + 1), kUnknown);
+    uint8_t& st = state_[s.series];
+    if (st == kUnknown) st = registry_.limited(s.series) ? kLimited : kFree;
+    if (st != kLimited) {
+      ++stats_.passed;
+      out->push_back(s);
+      continue;
+    }
+    auto it = tracks_.find(s.series);
+    if (it == tracks_.end()) {
+      Metric* m = metric_for(s.series);
+      if (!m) {
+        ++stats_.passed;
+        out->push_back(s);
+        continue;
+      }
+      it = tracks_.emplace(s.series, Track{m}).first;
+    }
+    Track& t = it->second;
+    Metric& m = *t.metric;
+    if (s.ts_ns > m.ts) {
+      if (m.dirty) emit_overflow(m, out);
+      start_tick(m, s.ts_ns);
+    }
+    if (s.series == m.overflow) {
+      // A refused label set: nothing to weigh, fold as is.
+      if (s.stale()) continue;
+      if (s.kind == SampleKind::kCounter) {
+        m.refused_now += s.counter;
+        m.refused_seen = true;
+      }
+      fold(m, s, 0);
+      continue;
+    }
+    if (s.stale()) {
+      if (t.passing) out->push_back(s);
+      tracks_.erase(it);  // gone: it gets a fresh track if it comes back
+      continue;
+    }
+    uint64_t delta = 0;
+    double weight;
+    if (s.kind == SampleKind::kCounter) {
+      if (t.has_last) delta = s.counter >= t.last ? s.counter - t.last : s.counter;
+      t.last = s.counter;
+      t.has_last = true;
+      weight = static_cast<double>(delta);
+    } else {
+      weight = std::fabs(s.gauge);
+    }
+    m.top.offer(s.series, weight);
+    if (!m.chosen || std::binary_search(m.keep.begin(), m.keep.end(), s.series)) {
+      t.passing = true;
+      ++stats_.passed;
+      out->push_back(s);
+      continue;
+    }
+    if (t.passing) {
+      t.passing = false;
+      ++stats_.demoted;
+      out->push_back(Sample::make_stale(s.ts_ns, s.series, s.kind));
+    }
+    fold(m, s, delta);
+  }
+}
+
+void CardinalityLimiter::emit_overflow(Metric& m, std::vector<Sample>* out) {
+  m.dirty = false;
+  const uint64_t pending = m.refused_now > m.refused_last ? m.refused_now - m.refused_last : 0;
+  out->push_back(m.kind == SampleKind::kCounter ? Sample::make_counter(m.ts, m.overflow, m.other_counter + pending)
+                                                : Sample::make_gauge(m.ts, m.overflow, m.other_gauge));
+}
+
+void CardinalityLimiter::finish_tick(std::vector<Sample>* out) {
+  // A metric whose tick advanced inside filter() has already gone out and
+  // may be listed again if it was folded into since.
+  for (Metric* m : dirty_)
+    if (m->dirty) emit_overflow(*m, out);
+  dirty_.clear();
+}
+
+void CardinalityLimiter::self_metrics(int64_t now_ns, std::vector<Sample>* out) {
+  if (metrics_.empty() || now_ns <= self_ts_) return;
+  self_ts_ = now_ns;
+  for (const MetricCardinality& c : registry_.limited_metrics()) {
+    auto it = metrics_.find(c.overflow);
+    if (it == metrics_.end()) continue;
+    Metric& m = *it->second;
+    if (!m.self_ids[0]) {
+      const Label l{"metric", m.name};
+      m.self_ids[0] = registry_.intern("system_apm_self_series_estimate", &l, 1);
+      m.self_ids[1] = registry_.intern("system_apm_self_series_refused_total", &l, 1);
+      m.self_ids[2] = registry_.intern("system_apm_self_series_folded_total", &l, 1);
+    }
+    out->push_back(Sample::make_gauge(now_ns, m.self_ids[0], c.estimate));
+    out->push_back(Sample::make_counter(now_ns, m.self_ids[1], c.refused));
+    out->push_back(Sample::make_counter(now_ns, m.self_ids[2], m.folded));
+  }
+}
+
+bool CardinalityLimiter::kept(uint32_t series) const {
+  auto it = tracks_.find(series);
+  return it != tracks_.end() && it->second.passing && series != it->second.metric->overflow;
+}
+
+}  // namespace sysapm
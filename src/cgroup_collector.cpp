@@ -0,0 +1,374 @@
+#include "sysapm/cgroup_collector.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <string_view>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "sysapm/clock.hpp"
+#include "sysapm/self_profile.hpp"
+#include "sysapm/text.hpp"
+
+namespace sysapm {
+namespace {
+
+constexpr const char* kFileNames[kCgroupFileCount] = {"cpu.stat", "memory.stat", "io.stat", "cpu.pressure",
+                                                      "memory.pressure"};
+// Generous first sizes: memory.stat runs to ~60 lines on recent kernels.
+constexpr std::size_t kFileCaps[kCgroupFileCount] = {512, 4096, 1024, 256, 256};
+
+constexpr uint32_t kWatchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+enum class Kind : uint8_t { kCounter, kGauge, kPercent };
+
+struct CgroupSeries {
+  CgroupFile file;
+  std::string_view key;  // "prefix_key" for pressure lines, plain key otherwise
+  const char* name;
+  Kind kind;
+};
+
+// Grouped by file, in the order the kernel prints the keys.
+constexpr CgroupSeries kSeries[] = {
+    {kCgroupCpuStat, "usage_usec", "cgroup_cpu_usage_usec_total", Kind::kCounter},
+    {kCgroupCpuStat, "user_usec", "cgroup_cpu_user_usec_total", Kind::kCounter},
+    {kCgroupCpuStat, "system_usec", "cgroup_cpu_system_usec_total", Kind::kCounter},
+    {kCgroupCpuStat, "nr_periods", "cgroup_cpu_periods_total", Kind::kCounter},
+    {kCgroupCpuStat, "nr_throttled", "cgroup_cpu_throttled_periods_total", Kind::kCounter},
+    {kCgroupCpuStat, "throttled_usec", "cgroup_cpu_throttled_usec_total", Kind::kCounter},
+    {kCgroupMemoryStat, "anon", "cgroup_memory_anon_bytes", Kind::kGauge},
+    {kCgroupMemoryStat, "file", "cgroup_memory_file_bytes", Kind::kGauge},
+    {kCgroupMemoryStat, "kernel", "cgroup_memory_kernel_bytes", Kind::kGauge},
+    {kCgroupMemoryStat, "kernel_stack", "cgroup_memory_kernel_stack_bytes", Kind::kGauge},
+    {kCgroupMemoryStat, "sock", "cgroup_memory_sock_bytes", Kind::kGauge},
+    {kCgroupMemoryStat, "shmem", "cgroup_memory_shmem_bytes", Kind::kGauge},
+    {kCgroupMemoryStat, "file_mapped", "cgroup_memory_file_mapped_bytes", Kind::kGauge},
+    {kCgroupMemoryStat, "file_dirty", "cgroup_memory_file_dirty_bytes", Kind::kGauge},
+    {kCgroupMemoryStat, "file_writeback", "cgroup_memory_file_writeback_bytes", Kind::kGauge},
+    {kCgroupMemoryStat, "slab", "cgroup_memory_slab_bytes", Kind::kGauge},
+    {kCgroupMemoryStat, "pgfault", "cgroup_memory_page_faults_total", Kind::kCounter},
+    {kCgroupMemoryStat, "pgmajfault", "cgroup_memory_major_page_faults_total", Kind::kCounter},
+    {kCgroupIoStat, "rbytes", "cgroup_io_read_bytes_total", Kind::kCounter},
+    {kCgroupIoStat, "wbytes", "cgroup_io_written_bytes_total", Kind::kCounter},
+    {kCgroupIoStat, "rios", "cgroup_io_reads_total", Kind::kCounter},
+    {kCgroupIoStat, "wios", "cgroup_io_writes_total", Kind::kCounter},
+    {kCgroupIoStat, "dbytes", "cgroup_io_discarded_bytes_total", Kind::kCounter},
+    {kCgroupIoStat, "dios", "cgroup_io_discards_total", Kind::kCounter},
+    {kCgroupCpuPressure, "some_avg10", "cgroup_cpu_pressure_some_avg10", Kind::kPercent},
+    {kCgroupCpuPressure, "some_total", "cgroup_cpu_pressure_some_usec_total", Kind::kCounter},
+    {kCgroupCpuPressure, "full_avg10", "cgroup_cpu_pressure_full_avg10", Kind::kPercent},
+    {kCgroupCpuPressure, "full_total", "cgroup_cpu_pressure_full_usec_total", Kind::kCounter},
+    {kCgroupMemoryPressure, "some_avg10", "cgroup_memory_pressure_some_avg10", Kind::kPercent},
+    {kCgroupMemoryPressure, "some_total", "cgroup_memory_pressure_some_usec_total", Kind::kCounter},
+    {kCgroupMemoryPressure, "full_avg10", "cgroup_memory_pressure_full_avg10", Kind::kPercent},
+    {kCgroupMemoryPressure, "full_total", "cgroup_memory_pressure_full_usec_total", Kind::kCounter},
+};
+static_assert(sizeof kSeries / sizeof kSeries[0] == kCgroupSeriesCount);
+
+struct FileRange {
+  uint32_t begin, end;  // into kSeries
+};
+
+constexpr FileRange file_range(CgroupFile f) {
+  uint32_t b = 0;
+  while (b < kCgroupSeriesCount && kSeries[b].file != f) ++b;
+  uint32_t e = b;
+  while (e < kCgroupSeriesCount && kSeries[e].file == f) ++e;
+  return {b, e};
+}
+
+std::string child_path(const std::string& parent, std::string_view name) {
+  std::string rel = parent == "/" ? std::string() : parent;
+  rel += '/';
+  rel += name;
+  return rel;
+}
+
+// Per-tick values of one cgroup, indexed like kSeries.
+struct Values {
+  uint64_t u[kCgroupSeriesCount];
+  double d[kCgroupSeriesCount];
+  bool seen[kCgroupSeriesCount] = {};
+};
+
+// Finds `key` among the file's series, starting after the last match:
+// the kernel prints keys in a fixed order.
+int match(FileRange r, std::string_view key, uint32_t& hint) {
+  const uint32_t n = r.end - r.begin;
+  for (uint32_t i = 0; i < n; ++i) {
+    const uint32_t j = r.begin + (hint + i) % n;
+    if (kSeries[j].key == key) {
+      hint = (hint + i + 1) % n;
+      return static_cast<int>(j);
+    }
+  }
+  return -1;
+}
+
+void store(Values& v, int j, std::string_view value, bool sum) {
+  if (j < 0) return;
+  if (kSeries[j].kind == Kind::kPercent) {
+    if (parse_fixed(value, v.d[j])) v.seen[j] = true;
+    return;
+  }
+  uint64_t x;
+  if (!parse_u64(value, x)) return;
+  v.u[j] = sum && v.seen[j] ? v.u[j] + x : x;
+  v.seen[j] = true;
+}
+
+// "key value" lines: cpu.stat, memory.stat.
+void parse_flat(std::string_view buf, FileRange r, Values& v) {
+  LineReader lines(buf);
+  std::string_view line, key, value;
+  uint32_t hint = 0;
+  while (lines.next(line)) {
+    FieldReader f(line);
+    if (f.next(key) && f.next(value)) store(v, match(r, key, hint), value, false);
+  }
+}
+
+// "head k=v k=v ..." lines. io.stat heads are devices and get summed;
+// pressure heads ("some", "full") prefix the key.
+void parse_pairs(std::string_view buf, FileRange r, bool prefixed, Values& v) {
+  LineReader lines(buf);
+  std::string_view line, head, pair;
+  uint32_t hint = 0;
+  char key[32];
+  while (lines.next(line)) {
+    FieldReader f(line);
+    if (!f.next(head)) continue;
+    while (f.next(pair)) {
+      const std::size_t eq = pair.find('=');
+      if (eq == std::string_view::npos) continue;
+      std::string_view k = pair.substr(0, eq);
+      if (prefixed) {
+        const int n = std::snprintf(key, sizeof key, "%.*s_%.*s", static_cast<int>(head.size()), head.data(),
+                                    static_cast<int>(k.size()), k.data());
+        if (n <= 0 || static_cast<std::size_t>(n) >= sizeof key) continue;
+        k = {key, static_cast<std::size_t>(n)};
+      }
+      store(v, match(r, k, hint), pair.substr(eq + 1), !prefixed);
+    }
+  }
+}
+
+}  // namespace
+
+std::string find_cgroup2() {
+  std::FILE* f = std::fopen("/proc/self/mounts", "re");
+  if (!f) return {};
+  char dir[512], type[64];
+  std::string found;
+  while (std::fscanf(f, "%*s %511s %63s %*[^\n]", dir, type) == 2) {
+    if (std::strcmp(type, "cgroup2") == 0) {
+      found = dir;
+      break;
+    }
+  }
+  std::fclose(f);
+  return found;
+}
+
+CgroupCollector::~CgroupCollector() { close(); }
+
+int CgroupCollector::open(const CgroupOptions& opts) {
+  close();
+  opts_ = opts;
+  if (opts_.root.empty()) opts_.root = find_cgroup2();
+  if (opts_.root.empty()) return -ENOENT;
+  while (opts_.root.size() > 1 && opts_.root.back() == '/') opts_.root.pop_back();
+  if (::access(opts_.root.c_str(), R_OK | X_OK) < 0) return -errno;
+  inotify_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_ < 0) return -errno;
+  stats_ = {};
+  add_tree("/");
+  if (entries_.empty()) {
+    close();
+    return -ENOENT;
+  }
+  return 0;
+}
+
+void CgroupCollector::close() {
+  if (inotify_ >= 0) ::close(inotify_);  // drops every watch with it
+  inotify_ = -1;
+  entries_.clear();
+  free_.clear();
+  by_wd_.clear();
+  by_path_.clear();
+  rescan_ = false;
+  ticks_ = 0;
+}
+
+std::string CgroupCollector::full_path(const std::string& rel) const {
+  return rel == "/" ? opts_.root : opts_.root + rel;
+}
+
+const CgroupEntry* CgroupCollector::find(const std::string& path) const {
+  auto it = by_path_.find(path);
+  return it == by_path_.end() ? nullptr : &entries_[it->second];
+}
+
+// Watch first, then list: a child created in between shows up either in
+// the listing or as an event, and add() ignores the duplicate.
+void CgroupCollector::add_tree(const std::string& rel) {
+  std::vector<std::string> todo{rel};
+  while (!todo.empty()) {
+    std::string cur = std::move(todo.back());
+    todo.pop_back();
+    if (add(cur) < 0) continue;
+    DIR* d = ::opendir(full_path(cur).c_str());
+    if (!d) continue;
+    while (dirent* e = ::readdir(d)) {
+      if (e->d_type != DT_DIR || e->d_name[0] == '.') continue;
+      todo.push_back(child_path(cur, e->d_name));
+    }
+    ::closedir(d);
+  }
+}
+
+int CgroupCollector::add(const std::string& rel) {
+  if (by_path_.count(rel)) return 0;
+  if (stats_.tracked >= opts_.max_cgroups) {
+    ++stats_.overflow;
+    return -ENOSPC;
+  }
+  const int wd = ::inotify_add_watch(inotify_, full_path(rel).c_str(), kWatchMask);
+  if (wd < 0) return -errno;  // already gone
+  if (by_wd_.count(wd)) return 0;  // the same directory under a path we have not caught up with
+  uint32_t slot;
+  if (!free_.empty()) {
+    slot = free_.back();
+    free_.pop_back();
+  } else {
+    slot = static_cast<uint32_t>(entries_.size());
+    entries_.emplace_back();
+  }
+  CgroupEntry& e = entries_[slot];
+  e.path = rel;
+  e.wd = wd;
+  std::memset(e.ids, 0, sizeof e.ids);
+  open_files(e);
+  by_wd_[wd] = slot;
+  by_path_[rel] = slot;
+  ++stats_.tracked;
+  ++stats_.added;
+  return 0;
+}
+
+void CgroupCollector::open_files(CgroupEntry& e) {
+  const std::string dir = full_path(e.path);
+  for (unsigned f = 0; f < kCgroupFileCount; ++f) {
+    if (e.files[f].is_open()) continue;
+    const std::string path = dir + "/" + kFileNames[f];
+    e.files[f].open(path.c_str(), kFileCaps[f]);  // absent when the controller is off
+  }
+}
+
+void CgroupCollector::remove(uint32_t slot) {
+  CgroupEntry& e = entries_[slot];
+  if (e.wd < 0) return;
+  by_wd_.erase(e.wd);
+  by_path_.erase(e.path);
+  for (ProcFile& f : e.files) f.close();
+  e.wd = -1;
+  e.path.clear();
+  free_.push_back(slot);
+  --stats_.tracked;
+  ++stats_.removed;
+}
+
+void CgroupCollector::drain_events() {
+  alignas(inotify_event) char buf[16384];
+  for (;;) {
+    const ssize_t n = ::read(inotify_, buf, sizeof buf);
+    if (n <= 0) break;  // EAGAIN: caught up
+    for (const char* p = buf; p < buf + n;) {
+      const auto* ev = reinterpret_cast<const inotify_event*>(p);
+      p += sizeof(inotify_event) + ev->len;
+      ++stats_.events;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        rescan_ = true;
+        continue;
+      }
+      auto it = by_wd_.find(ev->wd);
+      if (it == by_wd_.end()) continue;  // a watch we already dropped
+      if (ev->mask & IN_IGNORED) {
+        remove(it->second);
+        continue;
+      }
+      if (!(ev->mask & IN_ISDIR) || ev->len == 0) continue;
+      const std::string rel = child_path(entries_[it->second].path, ev->name);
+      if (ev->mask & IN_CREATE) {
+        add_tree(rel);
+      } else if (ev->mask & IN_DELETE) {
+        auto child = by_path_.find(rel);
+        if (child != by_path_.end()) remove(child->second);
+      } else if (ev->mask & (IN_MOVED_FROM | IN_MOVED_TO)) {
+        rescan_ = true;  // every path below the moved directory changed
+      }
+    }
+  }
+}
+
+// Reconciles against a fresh walk: drops what is gone or was renamed and
+// adds what is new. Only runs after a rename or a lost event.
+void CgroupCollector::rescan() {
+  rescan_ = false;
+  ++stats_.rescans;
+  for (uint32_t slot = 0; slot < entries_.size(); ++slot) {
+    CgroupEntry& e = entries_[slot];
+    if (e.wd < 0) continue;
+    if (::access(full_path(e.path).c_str(), F_OK) == 0) continue;
+    ::inotify_rm_watch(inotify_, e.wd);
+    remove(slot);
+  }
+  add_tree("/");
+}
+
+int CgroupCollector::collect(std::vector<Sample>& out) {
+  if (inotify_ < 0) return -EBADF;
+  drain_events();
+  if (rescan_) rescan();
+  const bool reprobe = opts_.reprobe_ticks && ++ticks_ % opts_.reprobe_ticks == 0;
+  const int64_t ts = realtime_ns();
+  for (CgroupEntry& e : entries_) {
+    if (e.wd < 0) continue;
+    if (reprobe) open_files(e);
+    sample(e, ts, out);
+  }
+  return 0;
+}
+
+void CgroupCollector::sample(CgroupEntry& e, int64_t ts, std::vector<Sample>& out) {
+  Values v;
+  for (unsigned f = 0; f < kCgroupFileCount; ++f) {
+    ProcFile& pf = e.files[f];
+    if (!pf.is_open()) continue;
+    if (long rc = pf.read(); rc < 0) {
+      if (rc == -ENODEV || rc == -ENOENT) pf.close();  // rmdir raced us; the event follows
+      continue;
+    }
+    const FileRange r = file_range(static_cast<CgroupFile>(f));
+    StageTimer timer(Stage::kParse);
+    if (f == kCgroupCpuStat || f == kCgroupMemoryStat)
+      parse_flat(pf.data(), r, v);
+    else
+      parse_pairs(pf.data(), r, f != kCgroupIoStat, v);
+  }
+  for (uint32_t j = 0; j < kCgroupSeriesCount; ++j) {
+    if (!v.seen[j]) continue;
+    if (!e.ids[j]) e.ids[j] = registry().intern(kSeries[j].name, {{"cgroup", e.path}});
+    switch (kSeries[j].kind) {
+      case Kind::kCounter: out.push_back(Sample::make_counter(ts, e.ids[j], v.u[j])); break;
+      case Kind::kGauge: out.push_back(Sample::make_gauge(ts, e.ids[j], static_cast<double>(v.u[j]))); break;
+      case Kind::kPercent: out.push_back(Sample::make_gauge(ts, e.ids[j], v.d[j])); break;
+    }
+  }
+}
+
+}  // namespace sysapm
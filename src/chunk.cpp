@@ -0,0 +1,137 @@
+#include "sysapm/chunk.hpp"
+
+namespace sysapm {
+namespace {
+
+bool fits_signed(int64_t v, unsigned n) {
+  const int64_t lim = int64_t{1} << (n - 1);
+  return v >= -lim && v < lim;
+}
+
+}  // namespace
+
+// Stream layout, most significant bit first:
+//
+//   first sample   t:64 v:64
+//   timestamp      '0'               delta-of-delta is zero
+//                  '10'   dod:7      two's complement
+//                  '110'  dod:9
+//                  '1110' dod:12
+//                  '1111' dod:64
+//   gauge          '0'               same value as before
+//                  '10'   xor        meaningful bits fit the previous window
+//                  '11'   lead:5 len:6 xor   new window; len 64 is written as 0
+//   counter        '0'               same delta as before
+//                  '1'    zigzag(delta - previous delta) as 8-bit groups,
+//                         high bit = more
+void ChunkEncoder::append(SampleKind kind, int64_t t_ms, uint64_t v) {
+  if (count++ == 0) {
+    out.write(static_cast<uint64_t>(t_ms), 64);
+    out.write(v, 64);
+    prev_t = t_ms;
+    prev_v = v;
+    return;
+  }
+
+  const int64_t dt = t_ms - prev_t;
+  const int64_t dod = dt - prev_dt;
+  if (dod == 0) {
+    out.write_bit(false);
+  } else if (fits_signed(dod, 7)) {
+    out.write(0b10, 2);
+    out.write(static_cast<uint64_t>(dod), 7);
+  } else if (fits_signed(dod, 9)) {
+    out.write(0b110, 3);
+    out.write(static_cast<uint64_t>(dod), 9);
+  } else if (fits_signed(dod, 12)) {
+    out.write(0b1110, 4);
+    out.write(static_cast<uint64_t>(dod), 12);
+  } else {
+    out.write(0b1111, 4);
+    out.write(static_cast<uint64_t>(dod), 64);
+  }
+  prev_t = t_ms;
+  prev_dt = dt;
+
+  if (kind == SampleKind::kCounter) {
+    // Rates drift slowly, so the change in delta is what gets stored; a
+    // reset is just a large negative change.
+    const int64_t dv = static_cast<int64_t>(v - prev_v);
+    if (dv == prev_dv) {
+      out.write_bit(false);
+    } else {
+      out.write_bit(true);
+      uint64_t z = detail::zigzag(dv - prev_dv);
+      do {
+        uint64_t group = z & 0x7f;
+        z >>= 7;
+        out.write(group | (z ? 0x80 : 0), 8);
+      } while (z);
+      prev_dv = dv;
+    }
+  } else {
+    const uint64_t x = v ^ prev_v;
+    if (x == 0) {
+      out.write_bit(false);
+    } else {
+      unsigned lz = static_cast<unsigned>(std::countl_zero(x));
+      unsigned tz = static_cast<unsigned>(std::countr_zero(x));
+      if (lz > 31) lz = 31;  // 5-bit field
+      if (window && lz >= lead && tz >= trail) {
+        out.write(0b10, 2);
+        out.write(x >> trail, 64 - lead - trail);
+      } else {
+        const unsigned len = 64 - lz - tz;
+        out.write(0b11, 2);
+        out.write(lz, 5);
+        out.write(len & 63, 6);
+        out.write(x >> tz, len);
+        lead = lz;
+        trail = tz;
+        window = true;
+      }
+    }
+  }
+  prev_v = v;
+}
+
+HeadChunk::HeadChunk(uint32_t series, SampleKind kind, std::size_t cap_words)
+    : series_(series), kind_(kind), cap_(cap_words), words_(new std::atomic<uint64_t>[cap_words]) {
+  for (std::size_t i = 0; i < cap_; ++i) words_[i].store(0, std::memory_order_relaxed);
+  enc_.out = BitWriter(words_.get(), cap_);
+}
+
+void HeadChunk::append(int64_t t_ms, uint64_t v) {
+  if (enc_.count == 0) min_t_ = t_ms;
+  enc_.append(kind_, t_ms, v);
+  max_t_.store(t_ms, std::memory_order_relaxed);
+  count_.store(enc_.count, std::memory_order_release);
+}
+
+std::shared_ptr<HeadChunk> HeadChunk::grow(std::size_t cap_words) const {
+  auto h = std::make_shared<HeadChunk>(series_, kind_, cap_words);
+  const std::size_t used = static_cast<std::size_t>((enc_.out.bit_pos() + 63) / 64);
+  for (std::size_t i = 0; i < used && i < cap_words; ++i)
+    h->words_[i].store(words_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+  h->enc_ = enc_;
+  h->enc_.out.rebind(h->words_.get(), cap_words);
+  h->min_t_ = min_t_;
+  h->max_t_.store(max_t_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  h->count_.store(enc_.count, std::memory_order_release);
+  return h;
+}
+
+std::shared_ptr<const SealedChunk> HeadChunk::seal() const {
+  ChunkMeta m;
+  m.series = series_;
+  m.kind = kind_;
+  m.count = enc_.count;
+  m.words = static_cast<uint32_t>((enc_.out.bit_pos() + 63) / 64);
+  m.min_t_ms = min_t_;
+  m.max_t_ms = enc_.prev_t;
+  std::unique_ptr<uint64_t[]> w(new uint64_t[m.words]);
+  for (uint32_t i = 0; i < m.words; ++i) w[i] = words_[i].load(std::memory_order_relaxed);
+  return std::make_shared<const SealedChunk>(m, std::move(w));
+}
+
+}  // namespace sysapm
@@ -0,0 +1,220 @@
+#include "sysapm/chunk_store.hpp"
+
+#include <algorithm>
+
+namespace sysapm {
+namespace {
+
+int64_t floor_div(int64_t a, int64_t b) { return a / b - (a % b != 0 && (a < 0) != (b < 0)); }
+
+// The writer owns every counter, so a plain load/store pair is enough.
+void bump(std::atomic<uint64_t>& a, int64_t delta) {
+  a.store(a.load(std::memory_order_relaxed) + static_cast<uint64_t>(delta), std::memory_order_relaxed);
+}
+
+}  // namespace
+
+ChunkStore::ChunkStore(const StoreOptions& opts) : opts_(opts) {
+  if (opts_.block_ns < kNsPerMs) opts_.block_ns = kNsPerMs;
+  // A head must hold at least one worst-case sample.
+  const std::size_t min_words = kMaxSampleBits / 64;
+  opts_.max_chunk_words = std::max(opts_.max_chunk_words, min_words);
+  opts_.initial_chunk_words = std::clamp(opts_.initial_chunk_words, min_words, opts_.max_chunk_words);
+}
+
+ChunkStore::~ChunkStore() {
+  for (auto& t : top_) {
+    Mid* mid = t.load(std::memory_order_relaxed);
+    if (!mid) continue;
+    for (auto& m : mid->slot) delete m.load(std::memory_order_relaxed);
+    delete mid;
+  }
+}
+
+const ChunkStore::Series* ChunkStore::find(uint32_t id) const {
+  const Mid* mid = top_[id >> (kMidBits + kLeafBits)].load(std::memory_order_acquire);
+  if (!mid) return nullptr;
+  const Leaf* leaf = mid->slot[(id >> kLeafBits) & ((1u << kMidBits) - 1)].load(std::memory_order_acquire);
+  if (!leaf) return nullptr;
+  return leaf->slot[id & ((1u << kLeafBits) - 1)].load(std::memory_order_acquire);
+}
+
+ChunkStore::Series* ChunkStore::find_or_create(uint32_t id) {
+  auto& top = top_[id >> (kMidBits + kLeafBits)];
+  Mid* mid = top.load(std::memory_order_relaxed);
+  if (!mid) {
+    mid = new Mid;
+    top.store(mid, std::memory_order_release);
+  }
+  auto& mslot = mid->slot[(id >> kLeafBits) & ((1u << kMidBits) - 1)];
+  Leaf* leaf = mslot.load(std::memory_order_relaxed);
+  if (!leaf) {
+    leaf = new Leaf;
+    mslot.store(leaf, std::memory_order_release);
+  }
+  auto& lslot = leaf->slot[id & ((1u << kLeafBits) - 1)];
+  Series* s = lslot.load(std::memory_order_relaxed);
+  if (!s) {
+    all_.push_back(std::make_unique<Series>());
+    s = all_.back().get();
+    s->next_words = opts_.initial_chunk_words;
+    s->view.store(std::make_shared<const SeriesView>(), std::memory_order_relaxed);
+    lslot.store(s, std::memory_order_release);
+    series_.store(all_.size(), std::memory_order_relaxed);
+  }
+  return s;
+}
+
+void ChunkStore::publish(Series& s) {
+  s.view.store(std::make_shared<const SeriesView>(SeriesView{s.sealed, s.head}), std::memory_order_release);
+}
+
+void ChunkStore::account_sealed(const SealedChunk& c, int64_t sign) {
+  bump(sealed_chunks_, sign);
+  bump(sealed_bytes_, sign * static_cast<int64_t>(c.bytes()));
+  if (c.mapped()) bump(mapped_bytes_, sign * static_cast<int64_t>(c.bytes()));
+}
+
+std::size_t ChunkStore::attach(SegmentStore* segments, const SeriesRegistry* ids) {
+  segments_ = segments;
+  std::size_t adopted = 0;
+  std::vector<Series*> touched;
+  // Segments of one writer come in a row; ask once per run of them.
+  SeriesIdOrigin last{};
+  uint32_t trusted = 0;
+  bool asked = false;
+  segments->for_each_chunk([&](const SeriesIdOrigin& origin, std::shared_ptr<const SealedChunk> c) {
+    const ChunkMeta& m = c->meta();
+    if (ids) {
+      if (!asked || origin.generation != last.generation || origin.parent != last.parent ||
+          origin.inherited != last.inherited) {
+        trusted = ids->trusted_ids(origin);
+        last = origin;
+        asked = true;
+      }
+      if (m.series > trusted) {
+        ++untrusted_;
+        return;
+      }
+    }
+    Series* s = find_or_create(m.series);
+    const bool fresh = s->sealed.empty();
+    if (!fresh && (m.kind != s->kind || m.min_t_ms < s->last_t_ms)) return;
+    if (fresh) {
+      s->kind = m.kind;
+      touched.push_back(s);
+    }
+    s->last_t_ms = m.max_t_ms;
+    bump(samples_, m.count);
+    account_sealed(*c, 1);
+    s->sealed.push_back(std::move(c));
+    ++adopted;
+  });
+  for (Series* s : touched) publish(*s);
+  return adopted;
+}
+
+void ChunkStore::seal(Series& s) {
+  if (!s.head) return;
+  if (s.head->count() > 0) {
+    auto c = s.head->seal();
+    // On a write error the heap copy is kept and simply not persisted.
+    std::shared_ptr<const SealedChunk> mapped;
+    if (segments_ && segments_->write(*c, &mapped) == 0) c = std::move(mapped);
+    s.sealed.push_back(c);
+    account_sealed(*c, 1);
+    // Size the next head from this one so a steady series reaches the end
+    // of its block without growing.
+    s.next_words = std::clamp<std::size_t>(c->meta().words + kMaxSampleBits / 64, opts_.initial_chunk_words,
+                                           opts_.max_chunk_words);
+  }
+  bump(head_bits_, -static_cast<int64_t>(s.head->bits()));
+  s.head.reset();
+  publish(s);
+}
+
+bool ChunkStore::append(const Sample& smp) {
+  if (smp.stale()) return true;  // the series ends with its last stored sample
+  Series* s = find_or_create(smp.series);
+  const int64_t t = floor_ms(smp.ts_ns);
+  const bool fresh = !s->head && s->sealed.empty();
+  if (fresh) {
+    s->kind = smp.kind;
+  } else if (smp.kind != s->kind || t < s->last_t_ms) {
+    bump(rejected_, 1);
+    return false;
+  }
+
+  if (s->head && t >= s->block_end_ms) seal(*s);
+  if (!s->head) {
+    const int64_t block_ms = opts_.block_ns / kNsPerMs;
+    s->block_end_ms = (floor_div(t, block_ms) + 1) * block_ms;
+    s->head = std::make_shared<HeadChunk>(smp.series, smp.kind, s->next_words);
+    publish(*s);
+  } else if (!s->head->has_room()) {
+    if (s->head->cap_words() < opts_.max_chunk_words) {
+      // The old head stays alive for readers that already hold it.
+      s->head = s->head->grow(std::min(s->head->cap_words() * 2, opts_.max_chunk_words));
+      publish(*s);
+    } else {
+      const int64_t block_end = s->block_end_ms;
+      seal(*s);
+      s->head = std::make_shared<HeadChunk>(smp.series, smp.kind, opts_.max_chunk_words);
+      s->block_end_ms = block_end;
+      publish(*s);
+    }
+  }
+
+  const uint64_t before = s->head->bits();
+  s->head->append(t, smp.counter);
+  bump(head_bits_, static_cast<int64_t>(s->head->bits() - before));
+  bump(samples_, 1);
+  s->last_t_ms = t;
+  return true;
+}
+
+std::size_t ChunkStore::append(const Sample* s, std::size_t n) {
+  std::size_t stored = 0;
+  for (std::size_t i = 0; i < n; ++i) stored += append(s[i]);
+  return stored;
+}
+
+void ChunkStore::seal_all() {
+  for (auto& s : all_) seal(*s);
+}
+
+std::size_t ChunkStore::expire(int64_t now_ns) {
+  const int64_t cutoff = floor_ms(now_ns - opts_.retention_ns);
+  std::size_t dropped = 0;
+  for (auto& s : all_) {
+    auto& sealed = s->sealed;
+    std::size_t k = 0;
+    while (k < sealed.size() && sealed[k]->meta().max_t_ms < cutoff) {
+      bump(samples_, -static_cast<int64_t>(sealed[k]->meta().count));
+      account_sealed(*sealed[k], -1);
+      ++k;
+    }
+    if (k == 0) continue;
+    sealed.erase(sealed.begin(), sealed.begin() + static_cast<std::ptrdiff_t>(k));
+    publish(*s);
+    dropped += k;
+  }
+  bump(expired_chunks_, static_cast<int64_t>(dropped));
+  if (segments_) segments_->expire(cutoff);
+  return dropped;
+}
+
+StoreStats ChunkStore::stats() const {
+  StoreStats st;
+  st.series = series_.load(std::memory_order_relaxed);
+  st.samples = samples_.load(std::memory_order_relaxed);
+  st.rejected = rejected_.load(std::memory_order_relaxed);
+  st.sealed_chunks = sealed_chunks_.load(std::memory_order_relaxed);
+  st.expired_chunks = expired_chunks_.load(std::memory_order_relaxed);
+  st.mapped_bytes = mapped_bytes_.load(std::memory_order_relaxed);
+  st.untrusted_chunks = untrusted_;
+  st.bytes = sealed_bytes_.load(std::memory_order_relaxed) + (head_bits_.load(std::memory_order_relaxed) + 7) / 8;
+  return st;
+}
+
+}  // namespace sysapm
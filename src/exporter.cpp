@@ -0,0 +1,786 @@
+#include "sysapm/exporter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "sysapm/clock.hpp"
+#include "sysapm/self_profile.hpp"
+#include "sysapm/text.hpp"
+
+namespace sysapm {
+namespace {
+
+// OTLP metric data kinds, by the Metric field that holds them.
+enum : int { kGauge = 5, kSum = 7, kHistogram = 9 };
+constexpr uint64_t kDelta = 1, kCumulative = 2;  // AggregationTemporality
+
+// Room in front of an OTLP body for the two field heads (tag and length)
+// that the envelope needs besides its fixed resource and scope bytes.
+constexpr std::size_t kEnvelopeSlack = 2 * (1 + 10);
+
+std::size_t put_field_head(uint8_t* p, uint32_t field, uint64_t len) {
+  std::size_t n = 0;
+  p[n++] = static_cast<uint8_t>(field << 3 | static_cast<uint8_t>(WireType::kLen));
+  while (len >= 0x80) {
+    p[n++] = static_cast<uint8_t>(len | 0x80);
+    len >>= 7;
+  }
+  p[n++] = static_cast<uint8_t>(len);
+  return n;
+}
+
+bool parse_hex(std::string_view s, std::size_t* out) {
+  std::size_t v = 0;
+  std::size_t i = 0;
+  for (; i < s.size(); ++i) {
+    const char c = s[i];
+    unsigned d;
+    if (c >= '0' && c <= '9') d = static_cast<unsigned>(c - '0');
+    else if (c >= 'a' && c <= 'f') d = static_cast<unsigned>(c - 'a' + 10);
+    else if (c >= 'A' && c <= 'F') d = static_cast<unsigned>(c - 'A' + 10);
+    else break;  // chunk extensions follow ';'
+    if (v >> 56) return false;
+    v = v << 4 | d;
+  }
+  *out = v;
+  return i > 0;
+}
+
+// Length of a complete chunked body at the start of `s`, or 0 if more bytes
+// are needed, or npos when it is malformed.
+std::size_t chunked_length(std::string_view s) {
+  std::size_t pos = 0;
+  for (;;) {
+    const std::size_t eol = s.find("\r\n", pos);
+    if (eol == std::string_view::npos) return 0;
+    std::size_t n;
+    if (!parse_hex(s.substr(pos, eol - pos), &n)) return std::string_view::npos;
+    pos = eol + 2;
+    if (n == 0) break;
+    if (s.size() < pos + n + 2) return 0;
+    pos += n + 2;
+  }
+  // Trailers, then an empty line.
+  for (;;) {
+    const std::size_t eol = s.find("\r\n", pos);
+    if (eol == std::string_view::npos) return 0;
+    const bool empty = eol == pos;
+    pos = eol + 2;
+    if (empty) return pos;
+  }
+}
+
+}  // namespace
+
+// --- encoder ---
+
+ExportEncoder::ExportEncoder(ExportFormat format, const SeriesRegistry* registry)
+    : format_(format), registry_(registry) {
+  set_resource({});
+}
+
+void ExportEncoder::set_resource(const std::vector<Label>& attrs) {
+  envelope_.clear();
+  if (format_ == ExportFormat::kAgent) {
+    // Batch.resource fields, copied to the front of every batch.
+    ProtoWriter w(&envelope_);
+    for (const Label& l : attrs) {
+      const std::size_t m = w.begin(agent_wire::kResource);
+      w.string_field(1, l.name);
+      w.string_field(2, l.value);
+      w.end(m);
+    }
+    w.done();
+    resource_len_ = envelope_.size();
+    return;
+  }
+  // The Resource and InstrumentationScope fields never change, so they are
+  // encoded once; finish() only adds the two lengths that enclose the body.
+  ProtoWriter w(&envelope_);
+  std::size_t m = w.begin(1);  // ResourceMetrics.resource
+  for (const Label& l : attrs) {
+    const std::size_t kv = w.begin(1);
+    w.string_field(1, l.name);
+    const std::size_t any = w.begin(2);
+    w.string_field(1, l.value);
+    w.end(any);
+    w.end(kv);
+  }
+  w.end(m);
+  resource_len_ = w.size();
+  m = w.begin(1);  // ScopeMetrics.scope
+  w.string_field(1, "system-apm");
+  w.end(m);
+  w.done();
+}
+
+void ExportEncoder::begin(std::vector<uint8_t>* out) {
+  out_ = out;
+  out->clear();
+  if (format_ == ExportFormat::kOtlp) out->resize(envelope_.size() + kEnvelopeSlack);
+  if (format_ == ExportFormat::kAgent) out->assign(envelope_.begin(), envelope_.end());
+  w_ = ProtoWriter(out);
+  points_ = 0;
+  metric_open_ = false;
+  metric_kind_ = -1;
+}
+
+void ExportEncoder::series_rw(uint32_t id, std::string_view suffix, double value, int64_t ts_ns) {
+  // TimeSeries { labels = 1 (Label { name = 1, value = 2 }), samples = 2 (Sample { value = 1, timestamp = 2 }) }
+  const std::size_t ts = w_.begin(1);
+  std::size_t m = w_.begin(1);
+  w_.string_field(1, "__name__");
+  if (suffix.empty()) {
+    w_.string_field(2, registry_->metric(id));
+  } else {
+    name_.assign(registry_->metric(id));
+    name_.append(suffix);
+    w_.string_field(2, name_);
+  }
+  w_.end(m);
+  const std::size_t labels = registry_->label_count(id);
+  for (std::size_t i = 0; i < labels; ++i) {
+    const Label l = registry_->label(id, i);
+    m = w_.begin(1);
+    w_.string_field(1, l.name);
+    w_.string_field(2, l.value);
+    w_.end(m);
+  }
+  m = w_.begin(2);
+  w_.double_field(1, value);
+  w_.int64_field(2, ts_ns / 1000000);
+  w_.end(m);
+  w_.end(ts);
+}
+
+void ExportEncoder::close_metric() {
+  if (!metric_open_) return;
+  if (metric_kind_ == kSum) {
+    w_.uint64_field(2, kCumulative);
+    w_.bool_field(3, true);
+  } else if (metric_kind_ == kHistogram) {
+    w_.uint64_field(2, kDelta);
+  }
+  w_.end(data_mark_);
+  w_.end(metric_mark_);
+  metric_open_ = false;
+}
+
+void ExportEncoder::metric_otlp(uint32_t id, int kind) {
+  // Series of one metric are usually adjacent (interned together, emitted
+  // together), so runs share a Metric without sorting the batch.
+  const std::string_view name = registry_->metric(id);
+  if (metric_open_ && metric_kind_ == kind && metric_name_ == name) return;
+  close_metric();
+  metric_mark_ = w_.begin(2);  // ScopeMetrics.metrics
+  w_.string_field(1, name);
+  data_mark_ = w_.begin(static_cast<uint32_t>(kind));
+  metric_open_ = true;
+  metric_kind_ = kind;
+  metric_name_ = name;
+}
+
+void ExportEncoder::attributes_otlp(uint32_t id, uint32_t field) {
+  const std::size_t labels = registry_->label_count(id);
+  for (std::size_t i = 0; i < labels; ++i) {
+    const Label l = registry_->label(id, i);
+    const std::size_t kv = w_.begin(field);
+    w_.string_field(1, l.name);
+    const std::size_t any = w_.begin(2);
+    w_.string_field(1, l.value);
+    w_.end(any);
+    w_.end(kv);
+  }
+}
+
+void ExportEncoder::point_agent(const Sample& s, int64_t width_ns, const RollupPoint* p) {
+  namespace aw = agent_wire;
+  const std::size_t pt = w_.begin(aw::kPoints);
+  w_.string_field(aw::kMetric, registry_->metric(s.series));
+  const std::size_t labels = registry_->label_count(s.series);
+  for (std::size_t i = 0; i < labels; ++i) {
+    const Label l = registry_->label(s.series, i);
+    const std::size_t m = w_.begin(aw::kLabels);
+    w_.string_field(1, l.name);
+    w_.string_field(2, l.value);
+    w_.end(m);
+  }
+  const bool counter = s.kind == SampleKind::kCounter;
+  w_.uint64_field(aw::kKind, p && p->histogram ? aw::kHistogramKind : counter ? aw::kCounterKind : aw::kGaugeKind);
+  w_.int64_field(aw::kTs, s.ts_ns);
+  if (s.stale()) w_.bool_field(aw::kStale, true);
+  else if (counter) w_.uint64_field(aw::kCounter, s.counter);
+  else w_.double_field(aw::kGauge, s.gauge);
+  if (p) {
+    w_.int64_field(aw::kWidth, width_ns);
+    w_.int64_field(aw::kStart, p->start_ns);
+    w_.uint64_field(aw::kCount, p->count);
+    w_.double_field(aw::kMin, p->min);
+    w_.double_field(aw::kMax, p->max);
+    w_.double_field(aw::kSum, p->sum);
+    if (p->histogram) {
+      hist_.clear();
+      p->histogram->encode(&hist_);
+      w_.bytes_field(aw::kHistogram, hist_.data(), hist_.size());
+    }
+  }
+  w_.end(pt);
+}
+
+void ExportEncoder::add(const Sample& s) {
+  if (!registry_->contains(s.series)) return;
+  ++points_;
+  if (format_ == ExportFormat::kAgent) {
+    point_agent(s, 0, nullptr);
+    return;
+  }
+  const bool counter = s.kind == SampleKind::kCounter;
+  if (format_ == ExportFormat::kRemoteWrite) {
+    // A staleness marker carries Prometheus' stale NaN in either kind.
+    series_rw(s.series, {}, counter && !s.stale() ? static_cast<double>(s.counter) : s.gauge, s.ts_ns);
+    return;
+  }
+  metric_otlp(s.series, counter ? kSum : kGauge);
+  // NumberDataPoint { attributes = 7, time_unix_nano = 3, as_double = 4,
+  // as_int = 6, flags = 8 }; flag 1 is FLAG_NO_RECORDED_VALUE.
+  const std::size_t dp = w_.begin(1);
+  attributes_otlp(s.series, 7);
+  w_.fixed64_field(3, static_cast<uint64_t>(s.ts_ns));
+  if (s.stale()) w_.uint64_field(8, 1);
+  else if (counter) w_.fixed64_field(6, s.counter);
+  else w_.double_field(4, s.gauge);
+  w_.end(dp);
+}
+
+void ExportEncoder::histogram_otlp(const RollupPoint& p) {
+  // HistogramDataPoint { start = 2, time = 3, count = 4, sum = 5,
+  // bucket_counts = 6, explicit_bounds = 7, attributes = 9 }. Only the
+  // occupied span of buckets is sent: bucket i holds (upper(i-1), upper(i)].
+  const HistogramSnapshot& h = *p.histogram;
+  const auto& counts = h.counts();
+  std::size_t lo = 0, hi = counts.size();
+  while (lo < hi && counts[lo] == 0) ++lo;
+  while (hi > lo && counts[hi - 1] == 0) --hi;
+  metric_otlp(p.last.series, kHistogram);
+  const std::size_t dp = w_.begin(1);
+  w_.fixed64_field(2, static_cast<uint64_t>(p.start_ns));
+  w_.fixed64_field(3, static_cast<uint64_t>(p.last.ts_ns));
+  w_.fixed64_field(4, h.count());
+  w_.double_field(5, p.sum);
+  if (lo < hi) {
+    std::size_t m = w_.begin(6);
+    for (std::size_t i = lo; i < hi; ++i) w_.fixed64(counts[i]);
+    w_.end(m);
+    if (hi - lo > 1) {
+      m = w_.begin(7);
+      for (std::size_t i = lo; i + 1 < hi; ++i) w_.fixed64(static_cast<double>(h.layout().upper(i)));
+      w_.end(m);
+    }
+  }
+  attributes_otlp(p.last.series, 9);
+  w_.end(dp);
+}
+
+void ExportEncoder::add(const RollupPoint& p) {
+  if (format_ == ExportFormat::kAgent) {
+    if (!registry_->contains(p.last.series)) return;
+    ++points_;
+    if (p.window < windows_.size())
+      point_agent(p.last, windows_[p.window], &p);
+    else
+      point_agent(p.last, 0, nullptr);
+    return;
+  }
+  if (!p.histogram) {
+    add(p.last);
+    return;
+  }
+  if (!registry_->contains(p.last.series)) return;
+  ++points_;
+  if (format_ == ExportFormat::kRemoteWrite) {
+    series_rw(p.last.series, "_count", static_cast<double>(p.histogram->count()), p.last.ts_ns);
+    series_rw(p.last.series, "_sum", p.sum, p.last.ts_ns);
+    return;
+  }
+  histogram_otlp(p);
+}
+
+std::size_t ExportEncoder::finish() {
+  close_metric();
+  w_.done();
+  if (format_ != ExportFormat::kOtlp) return 0;
+  // ExportMetricsServiceRequest { resource_metrics = 1 { resource = 1,
+  // scope_metrics = 2 { scope = 1, metrics = 2... } } }, written backwards
+  // into the space begin() reserved so the body never moves.
+  std::vector<uint8_t>& out = *out_;
+  const std::size_t body = envelope_.size() + kEnvelopeSlack;
+  const std::size_t scope_len = envelope_.size() - resource_len_;
+  const std::size_t sm_len = scope_len + (out.size() - body);
+  uint8_t sm_head[11], rm_head[11];
+  const std::size_t sm_n = put_field_head(sm_head, 2, sm_len);
+  const std::size_t rm_n = put_field_head(rm_head, 1, resource_len_ + sm_n + sm_len);
+  std::size_t at = body - scope_len;
+  std::memcpy(out.data() + at, envelope_.data() + resource_len_, scope_len);
+  at -= sm_n;
+  std::memcpy(out.data() + at, sm_head, sm_n);
+  at -= resource_len_;
+  std::memcpy(out.data() + at, envelope_.data(), resource_len_);
+  at -= rm_n;
+  std::memcpy(out.data() + at, rm_head, rm_n);
+  return at;
+}
+
+// --- transport ---
+
+int parse_export_target(std::string_view target, ExporterOptions* out) {
+  const std::size_t slash = target.find('/');
+  const std::string_view hostport = target.substr(0, slash);
+  std::string_view host, port;
+  if (!hostport.empty() && hostport.front() == '[') {  // [v6]:port
+    const std::size_t close = hostport.find(']');
+    if (close == std::string_view::npos || hostport.substr(close + 1, 1) != ":") return -EINVAL;
+    host = hostport.substr(1, close - 1);
+    port = hostport.substr(close + 2);
+  } else {
+    const std::size_t colon = hostport.rfind(':');
+    if (colon == std::string_view::npos) return -EINVAL;
+    host = hostport.substr(0, colon);
+    port = hostport.substr(colon + 1);
+  }
+  if (host.empty() || port.empty() || port.size() > 5) return -EINVAL;
+  unsigned p = 0;
+  for (char c : port) {
+    if (c < '0' || c > '9') return -EINVAL;
+    p = p * 10 + static_cast<unsigned>(c - '0');
+  }
+  if (p == 0 || p > 65535) return -EINVAL;
+  out->host.assign(host);
+  out->port = static_cast<uint16_t>(p);
+  if (slash != std::string_view::npos) out->path.assign(target.substr(slash));
+  return 0;
+}
+
+Exporter::~Exporter() { close(); }
+
+int Exporter::open(const ExporterOptions& opts, const SeriesRegistry* registry) {
+  close();
+  if (!registry || opts.host.empty() || opts.path.empty() || opts.path.front() != '/' || opts.batch_points == 0 ||
+      opts.max_in_flight == 0)
+    return -EINVAL;
+  addrinfo hints{};
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  char port[8];
+  std::snprintf(port, sizeof port, "%u", static_cast<unsigned>(opts.port));
+  addrinfo* res = nullptr;
+  if (::getaddrinfo(opts.host.c_str(), port, &hints, &res) != 0 || !res) return -EHOSTUNREACH;
+  const auto* a = reinterpret_cast<const unsigned char*>(res->ai_addr);
+  addr_.assign(a, a + res->ai_addrlen);
+  family_ = res->ai_family;
+  ::freeaddrinfo(res);
+
+  opts_ = opts;
+  opts_.max_queued = std::max(opts.max_queued, opts.max_in_flight + 1);
+  enc_ = std::make_unique<ExportEncoder>(opts.format, registry);
+  enc_->set_resource(opts.resource);
+  enc_->set_windows(opts.windows_ns);
+  opts_.resource.clear();  // the caller's strings need not outlive open()
+  backoff_ns_ = 0;
+  retry_at_ = 0;
+  if (!opts_.spool_dir.empty()) {
+    spool_ = std::make_unique<Spool>();
+    SpoolOptions so;
+    so.dir = opts_.spool_dir;
+    so.max_bytes = opts_.spool_bytes;
+    if (int rc = spool_->open(so); rc < 0) {
+      spool_.reset();
+      enc_.reset();
+      return rc;
+    }
+    replay_tokens_ = opts_.replay_bytes_per_sec;
+    replay_refill_ns_ = mono_ns();
+  }
+  return 0;
+}
+
+void Exporter::close() {
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+  connecting_ = false;
+  queue_.clear();
+  batch_.reset();
+  encoding_ = false;
+  in_flight_ = 0;
+  partial_ = false;
+  rbuf_.clear();
+  enc_.reset();
+  spool_.reset();  // syncs what it holds; a later open() replays it
+}
+
+void Exporter::add(const Sample* s, std::size_t n) {
+  if (!enc_) return;
+  StageTimer timer(Stage::kEncode);
+  for (std::size_t i = 0; i < n; ++i) {
+    if (!encoding_) start_batch();
+    enc_->add(s[i]);
+    if (enc_->points() >= opts_.batch_points) seal_batch();
+  }
+}
+
+void Exporter::add(const RollupPoint* p, std::size_t n) {
+  if (!enc_) return;
+  StageTimer timer(Stage::kEncode);
+  for (std::size_t i = 0; i < n; ++i) {
+    if (!encoding_) start_batch();
+    enc_->add(p[i]);
+    if (enc_->points() >= opts_.batch_points) seal_batch();
+  }
+}
+
+void Exporter::flush() { seal_batch(); }
+
+void Exporter::start_batch() {
+  if (!free_.empty()) {
+    batch_ = std::move(free_.back());
+    free_.pop_back();
+  } else {
+    batch_ = std::make_unique<Request>();
+  }
+  enc_->begin(&batch_->raw);
+  encoding_ = true;
+}
+
+void Exporter::recycle(std::unique_ptr<Request> r) {
+  // Enough warm buffers to refill the pipeline; more would only pin memory.
+  if (free_.size() <= opts_.max_in_flight) free_.push_back(std::move(r));
+}
+
+void Exporter::seal_batch() {
+  if (!encoding_) return;
+  encoding_ = false;
+  Request& r = *batch_;
+  r.points = enc_->points();
+  if (r.points == 0) {
+    recycle(std::move(batch_));
+    return;
+  }
+  r.offset = enc_->finish();
+  std::size_t len = r.raw.size() - r.offset;
+  stats_.points += r.points;
+  stats_.raw_bytes += len;
+  ++stats_.batches;
+  if (opts_.compress) {
+    StageTimer timer(Stage::kCompress);
+    snappy_.compress(r.raw.data() + r.offset, len, &r.wire);
+    len = r.wire.size();
+  }
+  // Once anything is spooled, newer batches queue behind it on disk.
+  if (spool_ && (!spool_->empty() || queue_.size() >= opts_.max_queued) && spill(r)) {
+    recycle(std::move(batch_));
+    return;
+  }
+  write_head(r, len);
+  queue_.push_back(std::move(batch_));
+  if (queue_.size() > opts_.max_queued) {
+    // max_queued > max_in_flight, so there is always an unwritten batch.
+    auto oldest = queue_.begin() + static_cast<std::ptrdiff_t>(in_flight_);
+    recycle(std::move(*oldest));
+    queue_.erase(oldest);
+    ++stats_.dropped;
+  }
+}
+
+void Exporter::write_head(Request& r, std::size_t body_len) {
+  r.head.clear();
+  r.head.append("POST ").append(opts_.path).append(" HTTP/1.1\r\nHost: ").append(opts_.host);
+  char line[64];
+  std::snprintf(line, sizeof line, ":%u\r\n", static_cast<unsigned>(opts_.port));
+  r.head.append(line);
+  r.head.append("User-Agent: system-apm\r\nContent-Type: application/x-protobuf\r\n");
+  if (opts_.compress) r.head.append("Content-Encoding: snappy\r\n");
+  if (opts_.format == ExportFormat::kRemoteWrite) r.head.append("X-Prometheus-Remote-Write-Version: 0.1.0\r\n");
+  std::snprintf(line, sizeof line, "Content-Length: %zu\r\n\r\n", body_len);
+  r.head.append(line);
+}
+
+bool Exporter::spill(Request& r) {
+  const uint8_t* body = opts_.compress ? r.wire.data() : r.raw.data() + r.offset;
+  const std::size_t len = opts_.compress ? r.wire.size() : r.raw.size() - r.offset;
+  if (spool_->append(body, len, static_cast<uint32_t>(r.points)) < 0) return false;
+  ++stats_.spooled;
+  const uint64_t evicted = spool_->stats().dropped;
+  stats_.dropped += evicted - spool_dropped_;
+  spool_dropped_ = evicted;
+  return true;
+}
+
+void Exporter::replay(int64_t now) {
+  spool_->sync(now);
+  replay_tokens_ = std::min(opts_.replay_bytes_per_sec,
+                            replay_tokens_ + static_cast<double>(now - replay_refill_ns_) * 1e-9 *
+                                                 opts_.replay_bytes_per_sec);
+  replay_refill_ns_ = now;
+  // Refill only what the pipeline can take next, so replayed batches
+  // never pile up in memory again.
+  while (replay_tokens_ > 0 && queue_.size() < opts_.max_in_flight + 1 && !spool_->empty()) {
+    uint32_t points = 0;
+    if (spool_->pop(&replay_buf_, &points) <= 0) break;
+    std::unique_ptr<Request> r;
+    if (!free_.empty()) {
+      r = std::move(free_.back());
+      free_.pop_back();
+    } else {
+      r = std::make_unique<Request>();
+    }
+    (opts_.compress ? r->wire : r->raw).swap(replay_buf_);
+    r->offset = 0;
+    r->points = points;
+    const std::size_t len = opts_.compress ? r->wire.size() : r->raw.size();
+    write_head(*r, len);
+    replay_tokens_ -= static_cast<double>(len);
+    queue_.push_back(std::move(r));
+    ++stats_.replayed;
+  }
+}
+
+void Exporter::back_off(int64_t now) {
+  backoff_ns_ = backoff_ns_ ? std::min(backoff_ns_ * 2, opts_.max_backoff_ns) : opts_.min_backoff_ns;
+  retry_at_ = now + backoff_ns_;
+}
+
+int Exporter::connect_now(int64_t now) {
+  int fd = ::socket(family_, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -errno;
+  int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  if (::connect(fd, reinterpret_cast<const sockaddr*>(addr_.data()), static_cast<socklen_t>(addr_.size())) < 0 &&
+      errno != EINPROGRESS) {
+    int err = -errno;
+    ::close(fd);
+    back_off(now);
+    return err;
+  }
+  fd_ = fd;
+  connecting_ = true;  // confirmed by the first POLLOUT either way
+  return 0;
+}
+
+void Exporter::disconnect(int64_t now, bool failed) {
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+  connecting_ = false;
+  // Unanswered requests go out again on the next connection.
+  stats_.retries += in_flight_;
+  in_flight_ = 0;
+  partial_ = false;
+  write_off_ = 0;
+  rbuf_.clear();
+  if (failed) back_off(now);
+}
+
+bool Exporter::want_write(int64_t now) const {
+  return partial_ || (in_flight_ < queue_.size() && in_flight_ < opts_.max_in_flight && now >= retry_at_);
+}
+
+int Exporter::write_some(int64_t now) {
+  StageTimer timer(Stage::kSend);
+  while (want_write(now)) {
+    if (!partial_) {
+      ++in_flight_;
+      partial_ = true;
+      write_off_ = 0;
+      ++stats_.requests;
+    }
+    const Request& r = *queue_[in_flight_ - 1];
+    const uint8_t* body = opts_.compress ? r.wire.data() : r.raw.data() + r.offset;
+    const std::size_t body_len = opts_.compress ? r.wire.size() : r.raw.size() - r.offset;
+    const std::size_t head_len = r.head.size();
+    // Head and body go out in one segment where the window allows.
+    iovec iov[2];
+    int n = 0;
+    if (write_off_ < head_len) {
+      iov[n++] = {const_cast<char*>(r.head.data()) + write_off_, head_len - write_off_};
+      iov[n++] = {const_cast<uint8_t*>(body), body_len};
+    } else {
+      iov[n++] = {const_cast<uint8_t*>(body) + (write_off_ - head_len), body_len - (write_off_ - head_len)};
+    }
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = static_cast<std::size_t>(n);
+    ssize_t w = ::sendmsg(fd_, &msg, MSG_NOSIGNAL);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      return -errno;
+    }
+    write_off_ += static_cast<std::size_t>(w);
+    stats_.sent_bytes += static_cast<uint64_t>(w);
+    if (write_off_ == head_len + body_len) partial_ = false;
+  }
+  return 0;
+}
+
+int Exporter::read_some(int64_t now) {
+  char buf[4096];
+  bool eof = false;
+  for (;;) {
+    ssize_t n = ::recv(fd_, buf, sizeof buf, 0);
+    if (n > 0) {
+      rbuf_.append(buf, static_cast<std::size_t>(n));
+      if (rbuf_.size() > (1u << 20)) return -EPROTO;  // no sane response is this large
+      continue;
+    }
+    if (n == 0) {
+      eof = true;
+      break;
+    }
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+    return -errno;
+  }
+  int rc = parse_responses(now);
+  if (rc < 0) return rc;
+  // Servers close idle keep-alive connections; that is only a failure while
+  // responses are outstanding. The next batch reconnects.
+  if (eof || rc > 0) disconnect(now, in_flight_ > 0);
+  return 0;
+}
+
+// Consumes complete responses, oldest request first. Returns 0, 1 when the
+// server asked to close the connection, or -EPROTO.
+int Exporter::parse_responses(int64_t now) {
+  for (;;) {
+    const std::size_t head_end = rbuf_.find("\r\n\r\n");
+    if (head_end == std::string::npos) return 0;
+    const std::string_view head(rbuf_.data(), head_end);
+    if (head.size() < 12 || head.substr(0, 5) != "HTTP/" || head[8] != ' ') return -EPROTO;
+    int status = 0;
+    for (std::size_t i = 9; i < 12; ++i) {
+      if (head[i] < '0' || head[i] > '9') return -EPROTO;
+      status = status * 10 + (head[i] - '0');
+    }
+    bool chunked = false, close = false, have_length = false;
+    std::size_t length = 0;
+    for (std::size_t pos = head.find("\r\n"); pos != std::string_view::npos;) {
+      pos += 2;
+      std::size_t eol = head.find("\r\n", pos);
+      const std::string_view line = head.substr(pos, eol == std::string_view::npos ? eol : eol - pos);
+      pos = eol;
+      const std::size_t colon = line.find(':');
+      if (colon == std::string_view::npos) continue;
+      const std::string_view name = trim(line.substr(0, colon)), value = trim(line.substr(colon + 1));
+      if (iequals(name, "content-length")) {
+        have_length = true;
+        length = 0;
+        for (char c : value) {
+          if (c < '0' || c > '9' || length > (1u << 30)) return -EPROTO;
+          length = length * 10 + static_cast<std::size_t>(c - '0');
+        }
+      } else if (iequals(name, "transfer-encoding")) {
+        chunked = iequals(value, "chunked");
+      } else if (iequals(name, "connection")) {
+        close = iequals(value, "close");
+      }
+    }
+    const std::size_t body_at = head_end + 4;
+    std::size_t total;
+    if (status / 100 == 1 || status == 204 || status == 304) {
+      total = body_at;
+    } else if (chunked) {
+      const std::size_t n = chunked_length(std::string_view(rbuf_).substr(body_at));
+      if (n == std::string_view::npos) return -EPROTO;
+      if (n == 0) return 0;
+      total = body_at + n;
+    } else if (have_length) {
+      if (rbuf_.size() < body_at + length) return 0;
+      total = body_at + length;
+    } else {
+      total = body_at;  // the body runs to EOF; nothing else can follow it
+      close = true;
+    }
+    rbuf_.erase(0, total);
+    if (status / 100 == 1) continue;
+    if (in_flight_ == 0) return -EPROTO;
+
+    std::unique_ptr<Request> r = std::move(queue_.front());
+    queue_.pop_front();
+    --in_flight_;
+    if (in_flight_ == 0 && partial_) {
+      // Answered before it was fully written (e.g. 413): the stream is
+      // out of step, so start over on a fresh connection.
+      partial_ = false;
+      close = true;
+    }
+    if (status / 100 == 2) {
+      ++stats_.accepted;
+      backoff_ns_ = 0;
+      recycle(std::move(r));
+    } else if (status == 429 || status / 100 == 5) {
+      ++stats_.retries;
+      queue_.insert(queue_.begin() + static_cast<std::ptrdiff_t>(in_flight_), std::move(r));
+      back_off(now);
+    } else {
+      ++stats_.rejected;
+      recycle(std::move(r));
+    }
+    if (close) return 1;
+  }
+}
+
+int Exporter::pump(int timeout_ms) {
+  if (!enc_) return -EBADF;
+  int64_t now = mono_ns();
+  if (spool_) replay(now);
+  if (fd_ < 0) {
+    if (queue_.empty()) return 0;  // connect only when there is something to send
+    if (now < retry_at_) {
+      if (timeout_ms > 0) {
+        const int64_t wait_ms = (retry_at_ - now) / 1000000 + 1;
+        ::poll(nullptr, 0, static_cast<int>(std::min<int64_t>(timeout_ms, wait_ms)));
+      }
+      return 0;
+    }
+    if (int rc = connect_now(now); rc < 0) return rc;
+  }
+  if (!connecting_) {
+    if (int rc = write_some(now); rc < 0) {
+      disconnect(now, true);
+      return rc;
+    }
+  }
+  pollfd p{fd_, POLLIN, 0};
+  if (connecting_ || want_write(now)) p.events |= POLLOUT;
+  int n = ::poll(&p, 1, timeout_ms);
+  if (n < 0) return errno == EINTR ? 0 : -errno;
+  if (n == 0) return 0;
+  now = mono_ns();
+  int rc = 0;
+  if (connecting_) {
+    int err = 0;
+    socklen_t len = sizeof err;
+    ::getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+      disconnect(now, true);
+      return -err;
+    }
+    connecting_ = false;
+    ++stats_.connects;
+    rc = write_some(now);
+  } else {
+    if (p.revents & (POLLIN | POLLHUP | POLLERR)) rc = read_some(now);
+    if (rc == 0 && fd_ >= 0 && (p.revents & POLLOUT)) rc = write_some(now);
+  }
+  if (rc < 0) disconnect(now, true);
+  return rc;
+}
+
+}  // namespace sysapm
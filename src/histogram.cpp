@@ -0,0 +1,148 @@
+#include "sysapm/histogram.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+namespace sysapm {
+namespace {
+
+constexpr std::size_t kLine = 64;
+
+void put_varint(std::vector<uint8_t>* out, uint64_t v) {
+  while (v >= 0x80) {
+    out->push_back(static_cast<uint8_t>(v | 0x80));
+    v >>= 7;
+  }
+  out->push_back(static_cast<uint8_t>(v));
+}
+
+bool get_varint(const uint8_t*& p, const uint8_t* end, uint64_t* v) {
+  uint64_t r = 0;
+  for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+    const uint8_t b = *p++;
+    r |= uint64_t{b & 0x7fu} << shift;
+    if (!(b & 0x80)) {
+      *v = r;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+int HistogramSnapshot::merge(const HistogramSnapshot& other) {
+  if (counts_.empty() && total_ == 0) *this = HistogramSnapshot(other.layout_);
+  if (!(layout_ == other.layout_)) return -EINVAL;
+  for (std::size_t i = 0; i < counts_.size(); ++i) counts_[i] += other.counts_[i];
+  total_ += other.total_;
+  return 0;
+}
+
+int HistogramSnapshot::subtract(const HistogramSnapshot& earlier) {
+  if (earlier.counts_.empty()) return 0;
+  if (!(layout_ == earlier.layout_)) return -EINVAL;
+  total_ = 0;
+  for (std::size_t i = 0; i < counts_.size(); ++i) {
+    counts_[i] = counts_[i] >= earlier.counts_[i] ? counts_[i] - earlier.counts_[i] : 0;
+    total_ += counts_[i];
+  }
+  return 0;
+}
+
+uint64_t HistogramSnapshot::quantile(double q) const {
+  if (total_ == 0) return 0;
+  q = std::clamp(q, 0.0, 1.0);
+  // Rank of the sample at q, 1-based: the smallest rank covering q.
+  const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * static_cast<double>(total_))));
+  uint64_t seen = 0;
+  for (std::size_t i = 0; i < counts_.size(); ++i) {
+    seen += counts_[i];
+    if (seen >= rank) return layout_.upper(i);
+  }
+  return layout_.upper(counts_.size() - 1);
+}
+
+double HistogramSnapshot::mean() const {
+  if (total_ == 0) return 0;
+  double sum = 0;
+  for (std::size_t i = 0; i < counts_.size(); ++i) {
+    if (!counts_[i]) continue;
+    const double mid = (static_cast<double>(layout_.lower(i)) + static_cast<double>(layout_.upper(i))) / 2;
+    sum += mid * static_cast<double>(counts_[i]);
+  }
+  return sum / static_cast<double>(total_);
+}
+
+void HistogramSnapshot::encode(std::vector<uint8_t>* out) const {
+  out->push_back(layout_.sub_bits);
+  out->push_back(layout_.max_bits);
+  std::size_t nonzero = 0;
+  for (uint64_t c : counts_) nonzero += c != 0;
+  put_varint(out, nonzero);
+  std::size_t prev = 0;
+  for (std::size_t i = 0; i < counts_.size(); ++i) {
+    if (!counts_[i]) continue;
+    put_varint(out, i - prev);
+    put_varint(out, counts_[i]);
+    prev = i;
+  }
+}
+
+int HistogramSnapshot::decode(const uint8_t* data, std::size_t len) {
+  const uint8_t* p = data;
+  const uint8_t* end = data + len;
+  if (len < 2) return -EINVAL;
+  HistogramLayout layout{p[0], p[1]};
+  p += 2;
+  if (!layout.valid()) return -EINVAL;
+  HistogramSnapshot s(layout);
+  uint64_t nonzero = 0;
+  if (!get_varint(p, end, &nonzero) || nonzero > s.counts_.size()) return -EINVAL;
+  uint64_t at = 0;
+  for (uint64_t k = 0; k < nonzero; ++k) {
+    uint64_t delta = 0, count = 0;
+    if (!get_varint(p, end, &delta) || !get_varint(p, end, &count)) return -EINVAL;
+    if ((k > 0 && delta == 0) || delta >= s.counts_.size() - at) return -EINVAL;
+    at += delta;
+    s.counts_[at] = count;
+    s.total_ += count;
+  }
+  *this = std::move(s);
+  return static_cast<int>(p - data);
+}
+
+Histogram::Histogram(HistogramLayout layout, std::size_t shards) : layout_(layout) {
+  if (!layout_.valid()) layout_ = HistogramLayout{};
+  if (shards == 0) shards = std::max(1u, std::min(64u, std::thread::hardware_concurrency()));
+  shards_ = std::bit_ceil(shards);
+  shard_mask_ = shards_ - 1;
+  const std::size_t per_line = kLine / sizeof(std::atomic<uint64_t>);
+  stride_ = (layout_.buckets() + per_line - 1) / per_line * per_line;
+  const std::size_t bytes = shards_ * stride_ * sizeof(std::atomic<uint64_t>);
+  void* mem = std::aligned_alloc(kLine, bytes);
+  if (!mem) throw std::bad_alloc();
+  counts_ = static_cast<std::atomic<uint64_t>*>(mem);
+  for (std::size_t i = 0; i < shards_ * stride_; ++i) new (&counts_[i]) std::atomic<uint64_t>(0);
+}
+
+Histogram::~Histogram() { std::free(counts_); }
+
+void Histogram::snapshot(HistogramSnapshot* out) const {
+  out->layout_ = layout_;
+  out->counts_.assign(layout_.buckets(), 0);
+  out->total_ = 0;
+  for (std::size_t s = 0; s < shards_; ++s) {
+    const std::atomic<uint64_t>* shard = counts_ + s * stride_;
+    for (std::size_t i = 0; i < out->counts_.size(); ++i)
+      out->counts_[i] += shard[i].load(std::memory_order_relaxed);
+  }
+  for (uint64_t c : out->counts_) out->total_ += c;
+}
+
+}  // namespace sysapm
@@ -0,0 +1,177 @@
+#include "sysapm/host_collectors.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#include "sysapm/clock.hpp"
+
+namespace sysapm {
+namespace {
+
+// Load average follows the meminfo fields.
+enum MemExtra : uint32_t {
+  kLoad1 = kMeminfoSchema.size(), kLoad5, kLoad15, kTasksRunnable, kTasksTotal, kMemLocalCount
+};
+static_assert(kMemLocalCount == MemoryCollector::kSeries);
+constexpr const char* kMemExtraNames[] = {"load1", "load5", "load15", "tasks_runnable", "tasks_total"};
+
+enum ProcSummary : uint32_t {
+  kProcCount, kProcThreads, kProcRunning, kProcSleeping, kProcBlocked, kProcZombie,
+  kProcCpuTicks, kProcRssBytes, kProcSummaryCount
+};
+constexpr const char* kProcNames[kProcSummaryCount] = {
+    "processes", "threads", "processes_running", "processes_sleeping",
+    "processes_blocked", "processes_zombie", "process_cpu_ticks", "process_rss_bytes"};
+
+int sampler_for(ProcSampler& s, const SamplerOptions& base, unsigned sources) {
+  SamplerOptions o = base;
+  o.sources = sources;
+  return s.open(o);
+}
+
+}  // namespace
+
+int NameSlots::find_or_add(std::string_view name, std::size_t hint) {
+  name = name.substr(0, sizeof(Name::s) - 1);  // stored names are truncated too
+  auto same = [&](std::size_t i) { return std::string_view(names_[i].s) == name; };
+  if (hint < used_ && same(hint)) return static_cast<int>(hint);
+  for (std::size_t i = 0; i < used_; ++i)
+    if (same(i)) return static_cast<int>(i);
+  if (used_ == names_.size()) return -1;
+  std::memcpy(names_[used_].s, name.data(), name.size());
+  names_[used_].s[name.size()] = '\0';
+  return static_cast<int>(used_++);
+}
+
+int CpuCollector::open(const SamplerOptions& opts) { return sampler_for(sampler_, opts, kSourceStat); }
+
+int CpuCollector::collect(std::vector<Sample>& out) {
+  int rc = sampler_.sample();
+  if (rc < 0) return rc;
+  const ProcSnapshot& s = sampler_.snapshot();
+  const auto ts = static_cast<int64_t>(s.timestamp_ns);
+  // Row 0 is the all-CPU line, CPU n is row n+1; rows are interned once,
+  // when their CPU first shows up.
+  const std::size_t rows = s.cpu.cpus.size() + 1;
+  if (row_ids_.size() < rows * kCpuFieldCount) intern_rows(rows);
+  emit_schema<kStatCpuSchema>(ts, &row_ids_[0], s.cpu.total.v, out);
+  for (std::size_t c = 0; c < s.cpu.cpus.size(); ++c)
+    emit_schema<kStatCpuSchema>(ts, &row_ids_[(c + 1) * kCpuFieldCount], s.cpu.cpus[c].v, out);
+  emit_schema<kStatSchema>(ts, host_ids_, s.cpu.v, out);
+  return 0;
+}
+
+void CpuCollector::intern_rows(std::size_t rows) {
+  SeriesRegistry& r = registry();
+  if (row_ids_.empty()) intern_schema<kStatSchema>(r, {}, host_ids_);
+  const std::size_t first = row_ids_.size() / kCpuFieldCount;
+  row_ids_.resize(rows * kCpuFieldCount);
+  for (std::size_t row = first; row < rows; ++row) {
+    char cpu[16];
+    std::snprintf(cpu, sizeof cpu, "%zu", row - 1);
+    uint32_t* ids = &row_ids_[row * kCpuFieldCount];
+    if (row == 0)
+      intern_schema<kStatCpuSchema>(r, {}, ids);
+    else
+      intern_schema<kStatCpuSchema>(r, {{"cpu", cpu}}, ids);
+  }
+}
+
+int MemoryCollector::open(const SamplerOptions& opts) {
+  return sampler_for(sampler_, opts, kSourceMeminfo | kSourceLoadavg);
+}
+
+int MemoryCollector::collect(std::vector<Sample>& out) {
+  int rc = sampler_.sample();
+  const ProcSnapshot& s = sampler_.snapshot();
+  const auto ts = static_cast<int64_t>(s.timestamp_ns);
+  if (!ids_[0]) {
+    SeriesRegistry& r = registry();
+    intern_schema<kMeminfoSchema>(r, {}, ids_);
+    for (uint32_t i = kLoad1; i < kMemLocalCount; ++i) ids_[i] = r.intern(kMemExtraNames[i - kLoad1]);
+  }
+  auto gauge = [&](uint32_t local, double v) { out.push_back(Sample::make_gauge(ts, ids_[local], v)); };
+  if (sampler_.sources() & kSourceMeminfo) emit_schema<kMeminfoSchema>(ts, ids_, s.mem.v, out);
+  if (sampler_.sources() & kSourceLoadavg) {
+    gauge(kLoad1, s.load.load1);
+    gauge(kLoad5, s.load.load5);
+    gauge(kLoad15, s.load.load15);
+    gauge(kTasksRunnable, static_cast<double>(s.load.running));
+    gauge(kTasksTotal, static_cast<double>(s.load.total));
+  }
+  return rc;
+}
+
+int NetCollector::open(const SamplerOptions& opts) { return sampler_for(sampler_, opts, kSourceNetDev); }
+
+int NetCollector::collect(std::vector<Sample>& out) {
+  int rc = sampler_.sample();
+  if (rc < 0) return rc;
+  const ProcSnapshot& s = sampler_.snapshot();
+  const auto ts = static_cast<int64_t>(s.timestamp_ns);
+  for (std::size_t row = 0; row < s.net.size(); ++row) {
+    const NetDevStats& d = s.net[row];
+    int slot = slots_.find_or_add(d.name, row);
+    if (slot < 0) continue;
+    uint32_t* ids = &ids_[static_cast<std::size_t>(slot) * kNetFieldCount];
+    if (!ids[0]) {
+      const char* device = slots_.name(static_cast<std::size_t>(slot));
+      intern_schema<kNetDevSchema>(registry(), {{"device", device}}, ids);
+    }
+    emit_schema<kNetDevSchema>(ts, ids, d.v, out);
+  }
+  return 0;
+}
+
+int DiskCollector::open(const SamplerOptions& opts) {
+  return sampler_for(sampler_, opts, kSourceDiskstats);
+}
+
+int DiskCollector::collect(std::vector<Sample>& out) {
+  int rc = sampler_.sample();
+  if (rc < 0) return rc;
+  const ProcSnapshot& s = sampler_.snapshot();
+  const auto ts = static_cast<int64_t>(s.timestamp_ns);
+  for (std::size_t row = 0; row < s.disks.size(); ++row) {
+    const DiskStats& d = s.disks[row];
+    int slot = slots_.find_or_add(d.name, row);
+    if (slot < 0) continue;
+    uint32_t* ids = &ids_[static_cast<std::size_t>(slot) * kDiskFieldCount];
+    if (!ids[0]) {
+      const char* device = slots_.name(static_cast<std::size_t>(slot));
+      intern_schema<kDiskstatsSchema>(registry(), {{"device", device}}, ids);
+    }
+    emit_schema<kDiskstatsSchema>(ts, ids, d.v, out);
+  }
+  return 0;
+}
+
+int ProcessSummaryCollector::open(const ProcessCollectorOptions& opts) { return procs_.open(opts); }
+
+int ProcessSummaryCollector::collect(std::vector<Sample>& out) {
+  int rc = procs_.collect();
+  if (rc < 0) return rc;
+  const int64_t ts = realtime_ns();
+  uint64_t v[kProcSummaryCount] = {};
+  procs_.table().for_each([&v](int32_t, const ProcessEntry& e) {
+    ++v[kProcCount];
+    v[kProcThreads] += e.stats.num_threads;
+    v[kProcCpuTicks] += e.stats.utime + e.stats.stime;
+    v[kProcRssBytes] += e.stats.rss;
+    switch (e.stats.state) {
+      case 'R': ++v[kProcRunning]; break;
+      case 'D': ++v[kProcBlocked]; break;
+      case 'Z': ++v[kProcZombie]; break;
+      default: ++v[kProcSleeping]; break;
+    }
+  });
+  v[kProcRssBytes] *= static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+  if (!ids_[0])
+    for (uint32_t i = 0; i < kProcSummaryCount; ++i) ids_[i] = registry().intern(kProcNames[i]);
+  for (uint32_t i = 0; i < kProcSummaryCount; ++i)
+    out.push_back(Sample::make_gauge(ts, ids_[i], static_cast<double>(v[i])));
+  return 0;
+}
+
+}  // namespace sysapm
@@ -0,0 +1,155 @@
+#include "sysapm/io_ring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace sysapm {
+namespace {
+
+int sys_setup(unsigned entries, io_uring_params* p) {
+  return static_cast<int>(::syscall(SYS_io_uring_setup, entries, p));
+}
+
+int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return static_cast<int>(::syscall(SYS_io_uring_enter, fd, submit, wait, flags, nullptr, 0));
+}
+
+int sys_register(int fd, unsigned op, const void* arg, unsigned n) {
+  return static_cast<int>(::syscall(SYS_io_uring_register, fd, op, arg, n));
+}
+
+template <typename T>
+T* at(void* base, uint32_t off) {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + off);
+}
+
+}  // namespace
+
+IoRing::~IoRing() { close(); }
+
+int IoRing::open(unsigned entries) {
+  close();
+  io_uring_params p;
+  std::memset(&p, 0, sizeof p);
+  int fd = sys_setup(entries, &p);
+  if (fd < 0) return -errno;
+  fd_ = fd;
+
+  sq_ring_bytes_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_bytes_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) sq_ring_bytes_ = cq_ring_bytes_ = std::max(sq_ring_bytes_, cq_ring_bytes_);
+  sq_ring_ = ::mmap(nullptr, sq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    int err = -errno;
+    close();
+    return err;
+  }
+  if (single) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = ::mmap(nullptr, cq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      int err = -errno;
+      close();
+      return err;
+    }
+  }
+  sqes_bytes_ = p.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = ::mmap(nullptr, sqes_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    int err = -errno;
+    close();
+    return err;
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  sq_head_ = at<unsigned>(sq_ring_, p.sq_off.head);
+  sq_tail_ = at<unsigned>(sq_ring_, p.sq_off.tail);
+  sq_array_ = at<unsigned>(sq_ring_, p.sq_off.array);
+  sq_mask_ = *at<unsigned>(sq_ring_, p.sq_off.ring_mask);
+  sq_entries_ = p.sq_entries;
+  cq_head_ = at<unsigned>(cq_ring_, p.cq_off.head);
+  cq_tail_ = at<unsigned>(cq_ring_, p.cq_off.tail);
+  cq_mask_ = *at<unsigned>(cq_ring_, p.cq_off.ring_mask);
+  cqes_ = at<io_uring_cqe>(cq_ring_, p.cq_off.cqes);
+  // Slot i of the SQ array always names SQE i: entries are filled in order.
+  for (unsigned i = 0; i < sq_entries_; ++i) sq_array_[i] = i;
+  return 0;
+}
+
+void IoRing::close() {
+  if (sqes_) ::munmap(sqes_, sqes_bytes_);
+  if (cq_ring_ && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_ring_bytes_);
+  if (sq_ring_) ::munmap(sq_ring_, sq_ring_bytes_);
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+  sq_ring_ = cq_ring_ = nullptr;
+  sqes_ = nullptr;
+  queued_ = 0;
+  files_ = buffers_ = false;
+}
+
+int IoRing::register_files(const int* fds, unsigned n) {
+  if (fd_ < 0) return -EBADF;
+  if (files_ && sys_register(fd_, IORING_UNREGISTER_FILES, nullptr, 0) < 0) return -errno;
+  files_ = false;
+  if (n == 0) return 0;
+  if (sys_register(fd_, IORING_REGISTER_FILES, fds, n) < 0) return -errno;
+  files_ = true;
+  return 0;
+}
+
+int IoRing::register_buffers(const iovec* bufs, unsigned n) {
+  if (fd_ < 0) return -EBADF;
+  if (buffers_ && sys_register(fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0) < 0) return -errno;
+  buffers_ = false;
+  if (n == 0) return 0;
+  if (sys_register(fd_, IORING_REGISTER_BUFFERS, bufs, n) < 0) return -errno;
+  buffers_ = true;
+  return 0;
+}
+
+bool IoRing::read_fixed(int file, bool fixed_file, void* buf, uint32_t len, uint64_t offset, uint16_t buf_index,
+                        uint64_t user_data) {
+  const unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  const unsigned tail = *sq_tail_ + queued_;
+  if (tail - head >= sq_entries_) return false;
+  io_uring_sqe& s = sqes_[tail & sq_mask_];
+  std::memset(&s, 0, sizeof s);
+  s.opcode = IORING_OP_READ_FIXED;
+  s.flags = fixed_file ? IOSQE_FIXED_FILE : 0;
+  s.fd = file;
+  s.off = offset;
+  s.addr = reinterpret_cast<uintptr_t>(buf);
+  s.len = len;
+  s.buf_index = buf_index;
+  s.user_data = user_data;
+  ++queued_;
+  return true;
+}
+
+int IoRing::submit(unsigned wait) {
+  if (fd_ < 0) return -EBADF;
+  const unsigned n = queued_;
+  __atomic_store_n(sq_tail_, *sq_tail_ + n, __ATOMIC_RELEASE);
+  queued_ = 0;
+  unsigned to_submit = n;
+  for (;;) {
+    ++enters_;
+    int rc = sys_enter(fd_, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (rc >= 0) return static_cast<int>(n);
+    if (errno != EINTR) return -errno;
+    to_submit = 0;  // interrupted while waiting; the entries were consumed
+  }
+}
+
+}  // namespace sysapm
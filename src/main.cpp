@@ -0,0 +1,619 @@
+// system-apm agent entry point.
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <poll.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "sysapm/adaptive.hpp"
+#include "sysapm/aggregator.hpp"
+#include "sysapm/cardinality.hpp"
+#include "sysapm/cgroup_collector.hpp"
+#include "sysapm/chunk_store.hpp"
+#include "sysapm/clock.hpp"
+#include "sysapm/exporter.hpp"
+#include "sysapm/host_collectors.hpp"
+#include "sysapm/numa.hpp"
+#include "sysapm/perf_collector.hpp"
+#include "sysapm/pipeline.hpp"
+#include "sysapm/plugin.hpp"
+#include "sysapm/query.hpp"
+#include "sysapm/rollup.hpp"
+#include "sysapm/self_profile.hpp"
+#include "sysapm/shm_ingest.hpp"
+#include "sysapm/snapshot.hpp"
+
+namespace {
+
+volatile std::sig_atomic_t g_stop = 0;
+volatile std::sig_atomic_t g_reload = 0;
+
+void on_signal(int) { g_stop = 1; }
+void on_hup(int) { g_reload = 1; }
+
+void usage() {
+  std::fprintf(stderr,
+               "usage: system-apm [--interval-ms=N] [--proc-root=PATH] [--data-dir=PATH] [--no-processes]\n"
+               "                  [--cgroup-root=PATH] [--no-cgroups] [--perf[=ARGS]]\n"
+               "                  [--io-uring] [--plugin=PATH[:ARGS]]... [--export=HOST:PORT[/PATH]]\n"
+               "                  [--export-format=remote-write|otlp|agent] [--spool-dir=PATH] [--housekeeping-cpus=LIST]\n"
+               "                  [--idle-priority] [--workers=N] [--cpu-budget=CORES] [--numa] [--adaptive]\n"
+               "                  [--cardinality-limit=N] [--snapshot=PATH]\n"
+               "                  [--self-profile=off|raw|tsc] [--query-socket=PATH] [--ingest-socket=PATH]\n"
+               "                  [--once]\n"
+               "       system-apm --aggregate=HOST:PORT[/PATH] [--aggregate-by=ATTR]... [--export=...]\n"
+               "                  [--export-format=...] [--workers=N] [--cpu-budget=CORES] [--numa]\n"
+               "       system-apm --query=QUERY [--query-socket=PATH]\n");
+}
+
+void print_sample(const sysapm::Pipeline& p, const sysapm::Sample& s) {
+  char name[256];
+  if (!p.describe(s.series, name, sizeof name)) std::snprintf(name, sizeof name, "series_%08x", s.series);
+  if (s.kind == sysapm::SampleKind::kCounter)
+    std::printf("%s %llu %lld\n", name, static_cast<unsigned long long>(s.counter),
+                static_cast<long long>(s.ts_ns));
+  else
+    std::printf("%s %.6g %lld\n", name, s.gauge, static_cast<long long>(s.ts_ns));
+}
+
+// The aggregator role: agents' batches in, merged windows out. Each shard
+// forwards through an exporter of its own, so shards share nothing.
+int run_aggregator(const sysapm::IntakeOptions& intake, const sysapm::AggregatorOptions& aopts,
+                   const sysapm::ExporterOptions* xopts, sysapm::PoolOptions pool_opts, long interval_ms) {
+  sysapm::ThreadPool pool;
+  if (int rc = pool.start(pool_opts); rc < 0) {
+    std::fprintf(stderr, "system-apm: worker pool: %s\n", std::strerror(-rc));
+    return 1;
+  }
+  sysapm::IntakeServer server;
+  if (int rc = server.open(intake); rc < 0) {
+    std::fprintf(stderr, "system-apm: listen on %s:%u: %s\n", intake.host.c_str(),
+                 static_cast<unsigned>(intake.port), std::strerror(-rc));
+    return 1;
+  }
+  std::vector<std::unique_ptr<sysapm::Exporter>> exporters;
+  sysapm::Aggregator agg(aopts, &pool, [&](unsigned shard, const sysapm::RollupPoint* p, std::size_t n) {
+    if (!exporters.empty()) exporters[shard]->add(p, n);
+  });
+  if (xopts) {
+    for (unsigned i = 0; i < agg.shards(); ++i) {
+      exporters.push_back(std::make_unique<sysapm::Exporter>());
+      sysapm::ExporterOptions o = *xopts;
+      if (!o.spool_dir.empty()) o.spool_dir += "/" + std::to_string(i);
+      if (int rc = exporters.back()->open(o, &agg.registry(i)); rc < 0) {
+        std::fprintf(stderr, "system-apm: export to %s: %s\n", o.host.c_str(), std::strerror(-rc));
+        return 1;
+      }
+    }
+  }
+  std::signal(SIGINT, on_signal);
+  std::signal(SIGTERM, on_signal);
+  std::vector<std::vector<uint8_t>> bodies;
+  std::vector<std::string_view> views;
+  uint64_t emitted = 0;
+  int64_t next_report = sysapm::mono_ns() + interval_ms * 1000000ll;
+  while (!g_stop) {
+    if (int rc = server.poll(50, &bodies); rc < 0) {
+      std::fprintf(stderr, "system-apm: intake: %s\n", std::strerror(-rc));
+      return 1;
+    }
+    if (!bodies.empty()) {
+      views.clear();
+      for (const auto& b : bodies) views.emplace_back(reinterpret_cast<const char*>(b.data()), b.size());
+      agg.ingest(views);
+      bodies.clear();
+    }
+    agg.advance(sysapm::realtime_ns());
+    const sysapm::AggregatorStats st = agg.stats();
+    for (auto& ex : exporters) {
+      if (st.emitted != emitted) ex->flush();  // a round's windows go out together
+      ex->pump(0);
+    }
+    emitted = st.emitted;
+    if (sysapm::mono_ns() >= next_report) {
+      std::printf("batches=%llu points=%llu series=%llu open=%llu emitted=%llu late=%llu\n",
+                  static_cast<unsigned long long>(st.batches), static_cast<unsigned long long>(st.points),
+                  static_cast<unsigned long long>(st.series), static_cast<unsigned long long>(st.cells),
+                  static_cast<unsigned long long>(st.emitted), static_cast<unsigned long long>(st.late));
+      std::fflush(stdout);
+      next_report = sysapm::mono_ns() + interval_ms * 1000000ll;
+    }
+  }
+  agg.flush();
+  const int64_t give_up = sysapm::mono_ns() + 2000000000;
+  for (auto& ex : exporters) {
+    ex->flush();
+    while (!ex->idle() && sysapm::mono_ns() < give_up) ex->pump(50);
+  }
+  const sysapm::AggregatorStats st = agg.stats();
+  std::fprintf(stderr, "system-apm: merged %llu points into %llu, %llu malformed, %llu unmerged, %llu conflicts\n",
+               static_cast<unsigned long long>(st.points), static_cast<unsigned long long>(st.emitted),
+               static_cast<unsigned long long>(st.malformed), static_cast<unsigned long long>(st.unmerged),
+               static_cast<unsigned long long>(st.conflicts));
+  pool.stop();
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  sysapm::SamplerOptions opts;
+  long interval_ms = 1000;
+  bool once = false;
+  bool processes = true;
+  bool cgroups = true;
+  sysapm::CgroupOptions copts;
+  bool perf = false;
+  sysapm::PerfOptions perf_opts;
+  const char* data_dir = nullptr;
+  std::vector<std::string> plugins;
+  sysapm::ExporterOptions xopts;
+  bool exporting = false;
+  const char* spool_dir = nullptr;  // default: <data-dir>/spool
+  const char* snapshot_path = nullptr;  // default: <data-dir>/state.snap
+  sysapm::ThreadPolicy threads;
+  sysapm::PoolOptions pool_opts;
+  bool adaptive = false;
+  bool numa = false;
+  sysapm::CardinalityLimits limits;
+  limits.per_metric = 10000;
+  sysapm::SelfProfileOptions profile;
+  std::string query_path = "/run/system-apm.sock";  // empty: no query socket
+  std::string ingest_path = sysapm::shm::kIngestSocket;  // empty: no shared-memory ingestion
+  const char* query = nullptr;
+  bool aggregating = false;
+  sysapm::IntakeOptions intake;
+  sysapm::AggregatorOptions agg_opts;
+  for (int i = 1; i < argc; ++i) {
+    const char* a = argv[i];
+    if (std::strncmp(a, "--interval-ms=", 14) == 0) {
+      interval_ms = std::strtol(a + 14, nullptr, 10);
+    } else if (std::strncmp(a, "--proc-root=", 12) == 0) {
+      opts.proc_root = a + 12;
+    } else if (std::strncmp(a, "--data-dir=", 11) == 0) {
+      data_dir = a + 11;
+    } else if (std::strncmp(a, "--plugin=", 9) == 0) {
+      plugins.emplace_back(a + 9);
+    } else if (std::strncmp(a, "--export=", 9) == 0) {
+      if (sysapm::parse_export_target(a + 9, &xopts) < 0) {
+        usage();
+        return 2;
+      }
+      exporting = true;
+    } else if (std::strcmp(a, "--export-format=otlp") == 0) {
+      xopts.format = sysapm::ExportFormat::kOtlp;
+      if (xopts.path == sysapm::ExporterOptions{}.path) xopts.path = "/v1/metrics";
+    } else if (std::strcmp(a, "--export-format=agent") == 0) {
+      xopts.format = sysapm::ExportFormat::kAgent;
+      if (xopts.path == sysapm::ExporterOptions{}.path) xopts.path = sysapm::IntakeOptions{}.path;
+    } else if (std::strncmp(a, "--aggregate=", 12) == 0) {
+      if (sysapm::parse_intake_address(a + 12, &intake) < 0) {
+        usage();
+        return 2;
+      }
+      aggregating = true;
+    } else if (std::strncmp(a, "--aggregate-by=", 15) == 0) {
+      agg_opts.by_resource.emplace_back(a + 15);
+    } else if (std::strcmp(a, "--export-format=remote-write") == 0) {
+      xopts.format = sysapm::ExportFormat::kRemoteWrite;
+    } else if (std::strcmp(a, "--io-uring") == 0) {
+      opts.io = sysapm::IoBackend::kAuto;
+    } else if (std::strncmp(a, "--housekeeping-cpus=", 20) == 0) {
+      if (sysapm::parse_cpu_list(a + 20, &threads.cpus) < 0) {
+        usage();
+        return 2;
+      }
+    } else if (std::strncmp(a, "--workers=", 10) == 0) {
+      pool_opts.workers = static_cast<unsigned>(std::strtoul(a + 10, nullptr, 10));
+    } else if (std::strncmp(a, "--cpu-budget=", 13) == 0) {
+      pool_opts.cpu_budget = std::strtod(a + 13, nullptr);
+      if (pool_opts.cpu_budget < 0) {
+        usage();
+        return 2;
+      }
+    } else if (std::strcmp(a, "--numa") == 0) {
+      numa = true;
+    } else if (std::strcmp(a, "--idle-priority") == 0) {
+      threads.idle = true;
+    } else if (std::strncmp(a, "--cgroup-root=", 14) == 0) {
+      copts.root = a + 14;
+    } else if (std::strcmp(a, "--no-cgroups") == 0) {
+      cgroups = false;
+    } else if (std::strcmp(a, "--perf") == 0) {
+      perf = true;
+    } else if (std::strncmp(a, "--perf=", 7) == 0) {
+      if (sysapm::parse_perf_options(a + 7, &perf_opts) < 0) {
+        usage();
+        return 2;
+      }
+      perf = true;
+    } else if (std::strncmp(a, "--spool-dir=", 12) == 0) {
+      spool_dir = a + 12;
+    } else if (std::strncmp(a, "--snapshot=", 11) == 0) {
+      snapshot_path = a + 11;
+    } else if (std::strncmp(a, "--query-socket=", 15) == 0) {
+      query_path = a + 15;
+    } else if (std::strncmp(a, "--ingest-socket=", 16) == 0) {
+      ingest_path = a + 16;
+    } else if (std::strncmp(a, "--query=", 8) == 0) {
+      query = a + 8;
+    } else if (std::strcmp(a, "--self-profile=off") == 0) {
+      profile.enabled = false;
+    } else if (std::strcmp(a, "--self-profile=raw") == 0) {
+      profile.clock = sysapm::ProfileClock::kMonotonicRaw;
+    } else if (std::strcmp(a, "--self-profile=tsc") == 0) {
+      profile.clock = sysapm::ProfileClock::kTsc;
+    } else if (std::strcmp(a, "--adaptive") == 0) {
+      adaptive = true;
+    } else if (std::strncmp(a, "--cardinality-limit=", 20) == 0) {
+      limits.per_metric = static_cast<uint32_t>(std::strtoul(a + 20, nullptr, 10));
+    } else if (std::strcmp(a, "--no-processes") == 0) {
+      processes = false;
+    } else if (std::strcmp(a, "--once") == 0) {
+      once = true;
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  if (interval_ms <= 0) {
+    usage();
+    return 2;
+  }
+  // Client mode: ask the running agent, which has the data in memory.
+  if (query) {
+    std::string reply;
+    if (int rc = sysapm::query_socket(query_path, query, &reply); rc < 0) {
+      std::fprintf(stderr, "system-apm: %s: %s\n", query_path.c_str(), std::strerror(-rc));
+      return 1;
+    }
+    std::fputs(reply.c_str(), stdout);
+    return reply.starts_with("error:") ? 1 : 0;
+  }
+
+  // Pool workers per node, and the perf groups with them; one node is
+  // nothing to place.
+  if (numa) {
+    if (sysapm::read_numa_topology(&pool_opts.nodes) < 0 || pool_opts.nodes.size() < 2) {
+      std::fprintf(stderr, "system-apm: --numa: a single NUMA node, nothing to place\n");
+      pool_opts.nodes.clear();
+    }
+    perf_opts.nodes = pool_opts.nodes;
+  }
+
+  if (aggregating) {
+    if (spool_dir) xopts.spool_dir = spool_dir;
+    pool_opts.policy = threads;
+    return run_aggregator(intake, agg_opts, exporting ? &xopts : nullptr, pool_opts, interval_ms);
+  }
+
+  // Before any thread can start a stage timer.
+  if (sysapm::stage_profiler().configure(profile) != profile.clock)
+    std::fprintf(stderr, "system-apm: no invariant TSC, self-profiling with CLOCK_MONOTONIC_RAW\n");
+
+  // Started further down; until then parallel_for() runs inline.
+  sysapm::ThreadPool pool;
+  sysapm::Pipeline pipeline;
+  // Before any collector interns a series.
+  pipeline.registry().set_limits(limits);
+  // Restored into the still empty registry, so series keep last run's ids;
+  // an empty --snapshot= starts fresh every time.
+  std::string snapshot;
+  if (snapshot_path)
+    snapshot = snapshot_path;
+  else if (data_dir)
+    snapshot = std::string(data_dir) + "/state.snap";
+  sysapm::SnapshotReader restored;
+  bool have_snapshot = false;
+  if (!snapshot.empty() && !once) {
+    const int64_t t0 = sysapm::mono_ns();
+    int rc = restored.open(snapshot);
+    if (rc == 0) rc = restored.restore(&pipeline.registry());
+    if (rc == 0) {
+      have_snapshot = true;
+      std::fprintf(stderr, "system-apm: restored %zu series from %s in %.1f ms\n", pipeline.registry().size(),
+                   snapshot.c_str(), static_cast<double>(sysapm::mono_ns() - t0) / 1e6);
+    } else if (rc != -ENOENT) {
+      std::fprintf(stderr, "system-apm: snapshot %s ignored: %s\n", snapshot.c_str(), std::strerror(-rc));
+    }
+  }
+  auto add = [&](auto collector, int rc) {
+    if (rc < 0)
+      std::fprintf(stderr, "system-apm: %s collector disabled: %s\n", collector->name(),
+                   std::strerror(-rc));
+    else
+      pipeline.add(std::move(collector));
+  };
+  {
+    auto c = std::make_unique<sysapm::CpuCollector>();
+    int rc = c->open(opts);
+    add(std::move(c), rc);
+  }
+  {
+    auto c = std::make_unique<sysapm::MemoryCollector>();
+    int rc = c->open(opts);
+    add(std::move(c), rc);
+  }
+  {
+    auto c = std::make_unique<sysapm::NetCollector>();
+    int rc = c->open(opts);
+    add(std::move(c), rc);
+  }
+  {
+    auto c = std::make_unique<sysapm::DiskCollector>();
+    int rc = c->open(opts);
+    add(std::move(c), rc);
+  }
+  if (processes) {
+    sysapm::ProcessCollectorOptions popts;
+    popts.proc_root = opts.proc_root;
+    popts.io = opts.io;
+    auto c = std::make_unique<sysapm::ProcessSummaryCollector>();
+    int rc = c->open(popts);
+    add(std::move(c), rc);
+  }
+  if (cgroups) {
+    auto c = std::make_unique<sysapm::CgroupCollector>();
+    int rc = c->open(copts);
+    add(std::move(c), rc);
+  }
+  if (perf) {
+    if (perf_opts.cgroup_root.empty()) perf_opts.cgroup_root = copts.root;
+    perf_opts.pool = &pool;
+    auto c = std::make_unique<sysapm::PerfCollector>();
+    int rc = c->open(perf_opts);
+    add(std::move(c), rc);
+  }
+  // Applications' own metrics; nothing to harvest in a single pass.
+  if (!ingest_path.empty() && !once) {
+    sysapm::ShmIngestOptions iopts;
+    iopts.socket_path = ingest_path;
+    auto c = std::make_unique<sysapm::ShmIngestCollector>();
+    int rc = c->open(iopts);
+    add(std::move(c), rc);
+  }
+  // C ABI plugins first; an in-tree one has no C entry point.
+  std::vector<sysapm::PluginCollector*> reloadable;
+  for (const std::string& spec : plugins) {
+    const std::size_t colon = spec.find(':');
+    sysapm::PluginOptions plopts;
+    plopts.path = spec.substr(0, colon);
+    plopts.args = colon == std::string::npos ? "" : spec.substr(colon + 1);
+    std::string why;
+    auto pc = std::make_unique<sysapm::PluginCollector>();
+    int rc = pc->open(plopts, &why);
+    if (rc == 0) {
+      reloadable.push_back(pc.get());
+      pipeline.add(std::move(pc));
+      continue;
+    }
+    std::unique_ptr<sysapm::Collector> c;
+    if (rc == -ENOEXEC) rc = sysapm::load_plugin(plopts.path.c_str(), plopts.args.c_str(), &c, &why);
+    if (rc < 0)
+      std::fprintf(stderr, "system-apm: plugin %s disabled: %s\n", plopts.path.c_str(), why.c_str());
+    else
+      pipeline.add(std::move(c));
+  }
+  if (pipeline.lanes() == 0) {
+    std::fprintf(stderr, "system-apm: no collectors could be opened under %s\n", opts.proc_root.c_str());
+    return 1;
+  }
+
+  if (once) {
+    pipeline.collect_once([&](const sysapm::Sample* s, std::size_t n) {
+      for (std::size_t i = 0; i < n; ++i) print_sample(pipeline, s[i]);
+    });
+    return 0;
+  }
+
+  // The aggregator thread is the store's only writer.
+  sysapm::SegmentStore segments;
+  sysapm::ChunkStore store;
+  if (data_dir) {
+    sysapm::SegmentOptions sopts;
+    sopts.dir = data_dir;
+    sopts.origin = pipeline.registry().origin();
+    if (int rc = segments.open(sopts); rc < 0) {
+      std::fprintf(stderr, "system-apm: %s: %s\n", data_dir, std::strerror(-rc));
+      return 1;
+    }
+    // Chunks whose series ids this registry cannot vouch for (written
+    // after the snapshot it came from, or without one) are left out.
+    store.attach(&segments, &pipeline.registry());
+    if (const uint64_t n = store.stats().untrusted_chunks)
+      std::fprintf(stderr, "system-apm: %s: skipped %llu chunks with unknown series ids\n", data_dir,
+                   static_cast<unsigned long long>(n));
+  }
+  // The aggregator thread also owns the exporter.
+  sysapm::Exporter exporter;
+  if (exporting) {
+    char host[256] = "";
+    ::gethostname(host, sizeof host - 1);
+    xopts.resource = {{"host.name", host}, {"service.name", "system-apm"}};
+    // Batches the backend cannot take yet wait on disk; an empty
+    // --spool-dir= keeps the in-memory queue only.
+    if (spool_dir)
+      xopts.spool_dir = spool_dir;
+    else if (data_dir)
+      xopts.spool_dir = std::string(data_dir) + "/spool";
+    if (int rc = exporter.open(xopts, &pipeline.registry()); rc < 0) {
+      std::fprintf(stderr, "system-apm: export to %s: %s\n", xopts.host.c_str(), std::strerror(-rc));
+      return 1;
+    }
+  }
+  std::atomic<uint64_t> received{0};
+  // The store keeps raw samples locally; upstream gets the 10s rollups.
+  std::atomic<uint64_t> rolled{0};
+  sysapm::RollupStage rollup({}, [&](const sysapm::RollupPoint* p, std::size_t n) {
+    std::size_t upstream = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      if (p[i].window != 0) continue;
+      ++upstream;
+      if (exporting) exporter.add(&p[i], 1);
+    }
+    rolled.fetch_add(upstream, std::memory_order_relaxed);
+  });
+  // Open windows and counter baselines carry on where the last run stopped.
+  if (have_snapshot) {
+    if (int rc = restored.restore(&rollup); rc < 0 && rc != -ENODATA)
+      std::fprintf(stderr, "system-apm: snapshot %s: rollups not restored: %s\n", snapshot.c_str(),
+                   std::strerror(-rc));
+  }
+  restored.close();
+  int64_t next_expire = 0;
+  // Flat series back off downstream of the collectors; a series that has
+  // missed three ticks is marked stale.
+  sysapm::AdaptiveOptions aopts;
+  aopts.stale_after_ns = 3 * interval_ms * 1000000ll;
+  sysapm::AdaptiveFilter filter(aopts);
+  std::vector<sysapm::Sample> thinned;
+  // Metrics over their cap keep their heaviest series; the rest fold into
+  // metric{series="other"}.
+  sysapm::CardinalityLimiter limiter(pipeline.registry());
+  std::vector<sysapm::Sample> capped;
+  sysapm::PipelineOptions popts;
+  popts.interval_ns = interval_ms * 1000000;
+  popts.threads = threads;
+  // Collectors and query scans share one pool and its CPU budget; only the
+  // tick, aggregator and main threads are the agent's own.
+  pool_opts.policy = threads;
+  if (int rc = pool.start(pool_opts); rc < 0) {
+    std::fprintf(stderr, "system-apm: worker pool: %s\n", std::strerror(-rc));
+    return 1;
+  }
+  popts.pool = &pool;
+  // Everything downstream of the limiter.
+  auto deliver = [&](const sysapm::Sample* s, std::size_t n) {
+    const int64_t tick = n ? s[n - 1].ts_ns : 0;
+    if (adaptive) {
+      thinned.resize(n);
+      thinned.resize(filter.filter(s, n, thinned.data()));
+      if (n) filter.sweep(tick, &thinned);
+      s = thinned.data();
+      n = thinned.size();
+    }
+    store.append(s, n);
+    rollup.append(s, n);
+    if (tick) rollup.advance(tick);
+    if (exporting) {
+      exporter.flush();  // a tick's points go out together
+      exporter.pump(0);
+    }
+    if (tick && tick >= next_expire) {
+      store.expire(tick);
+      next_expire = tick + 60 * 1000000000ll;
+    }
+  };
+  auto consume = [&](const sysapm::Sample* s, std::size_t n) {
+    const int64_t tick = n ? s[n - 1].ts_ns : 0;
+    received.fetch_add(n, std::memory_order_relaxed);
+    if (limits.per_metric) {
+      capped.clear();
+      limiter.filter(s, n, &capped);
+      if (n) limiter.self_metrics(tick, &capped);
+      s = capped.data();
+      n = capped.size();
+    }
+    deliver(s, n);
+  };
+  // A tick can span several drained runs; its overflow points go out once
+  // the whole drain has been filtered.
+  auto drained = [&] {
+    if (!limits.per_metric) return;
+    capped.clear();
+    limiter.finish_tick(&capped);
+    if (!capped.empty()) deliver(capped.data(), capped.size());
+  };
+  if (int rc = pipeline.start(popts, consume, drained); rc < 0) {
+    std::fprintf(stderr, "system-apm: start: %s\n", std::strerror(-rc));
+    return 1;
+  }
+
+  // The threads apply the policy as they start; give them a moment.
+  timespec settle{0, 50000000};
+  nanosleep(&settle, nullptr);
+  if (int rc = pipeline.thread_policy_status(); rc < 0)
+    std::fprintf(stderr, "system-apm: thread policy: %s\n", std::strerror(-rc));
+
+  // Queries run on this thread; their scans fan out over the pool.
+  sysapm::QueryEngine queries(store, pipeline.registry(), &pool);
+  sysapm::QueryServer server;
+  if (!query_path.empty())
+    if (int rc = server.open(query_path); rc < 0)
+      std::fprintf(stderr, "system-apm: query socket %s: %s\n", query_path.c_str(), std::strerror(-rc));
+
+  std::signal(SIGINT, on_signal);
+  std::signal(SIGTERM, on_signal);
+  // SIGHUP: every C ABI plugin reloads its library on its next tick.
+  std::signal(SIGHUP, on_hup);
+  uint64_t last = 0;
+  while (!g_stop) {
+    for (const int64_t until = sysapm::mono_ns() + interval_ms * 1000000ll; !g_stop;) {
+      if (g_reload) {
+        g_reload = 0;
+        for (sysapm::PluginCollector* pc : reloadable) pc->request_reload();
+      }
+      const int64_t left = until - sysapm::mono_ns();
+      if (left <= 0) break;
+      pollfd pfd{server.fd(), POLLIN, 0};
+      if (::poll(&pfd, 1, static_cast<int>((left + 999999) / 1000000)) > 0)
+        server.serve(queries, sysapm::realtime_ns());
+    }
+    uint64_t now = received.load(std::memory_order_relaxed);
+    sysapm::StoreStats st = store.stats();
+    std::printf("samples=%llu (+%llu) series=%llu stored=%.2fB/sample rollups=%llu\n",
+                static_cast<unsigned long long>(now), static_cast<unsigned long long>(now - last),
+                static_cast<unsigned long long>(st.series), st.bytes_per_sample(),
+                static_cast<unsigned long long>(rolled.load(std::memory_order_relaxed)));
+    std::fflush(stdout);
+    last = now;
+  }
+  pipeline.stop();
+  // Open windows go into the snapshot instead of out half full; the next
+  // run closes them, so they are lost if none restores it (snapshot.hpp).
+  bool saved = false;
+  if (!snapshot.empty()) {
+    if (int rc = sysapm::write_snapshot(snapshot, pipeline.registry(), &rollup); rc < 0) {
+      std::fprintf(stderr, "system-apm: snapshot %s: %s\n", snapshot.c_str(), std::strerror(-rc));
+    } else {
+      saved = true;
+      if (const std::size_t n = rollup.open_windows())
+        std::fprintf(stderr, "system-apm: %zu open rollup windows deferred to the next start from %s\n", n,
+                     snapshot.c_str());
+    }
+  }
+  if (!saved) rollup.flush();
+  if (const sysapm::CardinalityStats& cs = limiter.stats(); cs.limited)
+    std::fprintf(stderr, "system-apm: %llu metrics over their series cap, %llu/%llu samples folded\n",
+                 static_cast<unsigned long long>(cs.limited), static_cast<unsigned long long>(cs.folded),
+                 static_cast<unsigned long long>(cs.in));
+  if (adaptive) {
+    const sysapm::AdaptiveStats& as = filter.stats();
+    std::fprintf(stderr, "system-apm: adaptive forwarded %llu/%llu samples (%llu stale markers)\n",
+                 static_cast<unsigned long long>(as.forwarded), static_cast<unsigned long long>(as.in),
+                 static_cast<unsigned long long>(as.stale));
+  }
+  if (exporting) {
+    exporter.flush();
+    const int64_t give_up = sysapm::mono_ns() + 2000000000;
+    while (!exporter.idle() && sysapm::mono_ns() < give_up) exporter.pump(50);
+    const sysapm::ExporterStats& xs = exporter.stats();
+    std::fprintf(stderr, "system-apm: exported %llu/%llu batches (%llu dropped, %llu retries)\n",
+                 static_cast<unsigned long long>(xs.accepted), static_cast<unsigned long long>(xs.batches),
+                 static_cast<unsigned long long>(xs.dropped + xs.rejected),
+                 static_cast<unsigned long long>(xs.retries));
+    if (!xopts.spool_dir.empty())
+      std::fprintf(stderr, "system-apm: spooled %llu batches, replayed %llu, %llu left in %s\n",
+                   static_cast<unsigned long long>(xs.spooled), static_cast<unsigned long long>(xs.replayed),
+                   static_cast<unsigned long long>(exporter.spool_stats().pending), xopts.spool_dir.c_str());
+  }
+  store.seal_all();
+  return 0;
+}
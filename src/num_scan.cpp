@@ -0,0 +1,227 @@
+#include "sysapm/num_scan.hpp"
+
+#include <array>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SYSAPM_SCAN_X86 1
+#endif
+
+namespace sysapm {
+namespace {
+
+inline bool digit(char c) { return static_cast<unsigned char>(c - '0') < 10; }
+inline bool blank(char c) { return c == ' ' || c == '\t'; }
+
+std::size_t scan_scalar(const char* p, const char* end, uint64_t* out, std::size_t max,
+                        const char** stop) {
+  std::size_t n = 0;
+  while (n < max) {
+    while (p < end && blank(*p)) ++p;
+    if (p == end || !digit(*p)) break;
+    const char* tok = p;
+    uint64_t v = 0;
+    do v = v * 10 + static_cast<uint64_t>(*p++ - '0');
+    while (p < end && digit(*p));
+    if (p < end && !blank(*p) && *p != '\n') {
+      p = tok;  // "12ab" is a label, not a number
+      break;
+    }
+    out[n++] = v;
+  }
+  *stop = p;
+  return n;
+}
+
+#ifdef SYSAPM_SCAN_X86
+
+struct Masks {
+  uint32_t digit;
+  uint32_t blank;
+};
+
+// pshufb controls that right-align an n-digit run inside 16 bytes, filling
+// the leading lanes with zero (0x80 selects zero).
+constexpr std::array<std::array<int8_t, 16>, 17> make_align_table() {
+  std::array<std::array<int8_t, 16>, 17> t{};
+  for (int len = 0; len <= 16; ++len)
+    for (int i = 0; i < 16; ++i) {
+      int src = i - (16 - len);
+      t[len][i] = src < 0 ? static_cast<int8_t>(0x80) : static_cast<int8_t>(src);
+    }
+  return t;
+}
+alignas(16) constexpr auto kAlign = make_align_table();
+
+__attribute__((target("sse4.2"))) inline uint64_t parse_run16(const char* s, unsigned len) {
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+  v = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+  v = _mm_shuffle_epi8(v, _mm_load_si128(reinterpret_cast<const __m128i*>(kAlign[len].data())));
+  // 16 digits -> 8 pairs -> 4 quads -> 2 octets.
+  v = _mm_maddubs_epi16(v, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1));
+  v = _mm_madd_epi16(v, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+  v = _mm_packus_epi32(v, v);
+  v = _mm_madd_epi16(v, _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+  uint64_t hi = static_cast<uint32_t>(_mm_cvtsi128_si32(v));
+  uint64_t lo = static_cast<uint32_t>(_mm_extract_epi32(v, 1));
+  return hi * 100000000ull + lo;
+}
+
+inline uint64_t parse_run_scalar(const char* s, unsigned len) {
+  uint64_t v = 0;
+  for (unsigned i = 0; i < len; ++i) v = v * 10 + static_cast<uint64_t>(s[i] - '0');
+  return v;
+}
+
+// Shared block loop. Classify(p) returns digit/blank masks for p[0..31].
+// Blocks are only processed while a 16-byte run load stays inside `end`.
+template <typename Classify>
+__attribute__((always_inline)) inline std::size_t scan_blocks(
+    Classify classify, const char* p, const char* end, uint64_t* out, std::size_t max,
+    const char** stop) {
+  std::size_t n = 0;
+  while (n < max && end - p >= 48) {
+    Masks m = classify(p);
+    uint32_t other = ~(m.digit | m.blank);
+    unsigned limit = other ? static_cast<unsigned>(__builtin_ctz(other)) : 32;
+    uint32_t starts = m.digit & ~(m.digit << 1);
+    uint32_t ends = m.digit & ~(m.digit >> 1);
+    const char* resume = p + 32;
+    while (starts) {
+      unsigned s = static_cast<unsigned>(__builtin_ctz(starts));
+      if (s >= limit) break;
+      unsigned e = s + static_cast<unsigned>(__builtin_ctz(ends >> s));
+      if (e == 31 && limit == 32) {
+        // The run may continue into the next block; restart there, or let
+        // the scalar path take an over-long run that fills a whole block.
+        if (s == 0) {
+          std::size_t k = scan_scalar(p, end, out + n, 1, stop);
+          if (k == 0) return n;
+          n += k;
+          resume = *stop;
+        } else {
+          resume = p + s;
+        }
+        break;
+      }
+      if (e + 1 == limit && p[limit] != '\n') {
+        *stop = p + s;  // digits glued to a label character
+        return n;
+      }
+      unsigned len = e - s + 1;
+      out[n++] = len <= 16 ? parse_run16(p + s, len) : parse_run_scalar(p + s, len);
+      if (n == max) {
+        *stop = p + e + 1;
+        return n;
+      }
+      starts &= starts - 1;
+    }
+    // A run can only straddle the block when nothing stopped it inside.
+    if (limit < 32) {
+      *stop = p + limit;
+      return n;
+    }
+    p = resume;
+  }
+  if (n == max) {
+    *stop = p;
+    return n;
+  }
+  return n + scan_scalar(p, end, out + n, max - n, stop);
+}
+
+template <int Mode>
+__attribute__((target("sse4.2"))) inline uint32_t cmp_mask16(__m128i set, int set_len, __m128i v) {
+  return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_cmpestrm(set, set_len, v, 16, Mode)));
+}
+
+struct ClassifySse42 {
+  __attribute__((target("sse4.2"))) Masks operator()(const char* q) const {
+    const __m128i range = _mm_setr_epi8('0', '9', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i blanks = _mm_setr_epi8(' ', '\t', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    constexpr int kRange = _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_BIT_MASK;
+    constexpr int kAny = _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK;
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(q));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(q + 16));
+    Masks m;
+    m.digit = cmp_mask16<kRange>(range, 2, lo) | cmp_mask16<kRange>(range, 2, hi) << 16;
+    m.blank = cmp_mask16<kAny>(blanks, 2, lo) | cmp_mask16<kAny>(blanks, 2, hi) << 16;
+    return m;
+  }
+};
+
+struct ClassifyAvx2 {
+  __attribute__((target("avx2"))) Masks operator()(const char* q) const {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q));
+    // Signed compares: bytes >= 0x80 are negative and never digits.
+    __m256i ge0 = _mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1));
+    __m256i le9 = _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v);
+    __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                 _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    Masks m;
+    m.digit = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_and_si256(ge0, le9)));
+    m.blank = static_cast<uint32_t>(_mm256_movemask_epi8(sp));
+    return m;
+  }
+};
+
+__attribute__((target("sse4.2"))) std::size_t scan_sse42(const char* p, const char* end,
+                                                          uint64_t* out, std::size_t max,
+                                                          const char** stop) {
+  return scan_blocks(ClassifySse42{}, p, end, out, max, stop);
+}
+
+__attribute__((target("avx2"))) std::size_t scan_avx2(const char* p, const char* end,
+                                                       uint64_t* out, std::size_t max,
+                                                       const char** stop) {
+  return scan_blocks(ClassifyAvx2{}, p, end, out, max, stop);
+}
+
+#endif  // SYSAPM_SCAN_X86
+
+}  // namespace
+
+ScanImpl detect_scan_impl() {
+#ifdef SYSAPM_SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return ScanImpl::kAvx2;
+  if (__builtin_cpu_supports("sse4.2")) return ScanImpl::kSse42;
+#endif
+  return ScanImpl::kScalar;
+}
+
+ScanFn scan_fn(ScanImpl impl) {
+#ifdef SYSAPM_SCAN_X86
+  __builtin_cpu_init();
+  if (impl == ScanImpl::kAvx2 && __builtin_cpu_supports("avx2")) return scan_avx2;
+  if (impl == ScanImpl::kSse42 && __builtin_cpu_supports("sse4.2")) return scan_sse42;
+#endif
+  (void)impl;
+  return scan_scalar;
+}
+
+const char* scan_impl_name(ScanImpl impl) {
+  switch (impl) {
+    case ScanImpl::kAvx2: return "avx2";
+    case ScanImpl::kSse42: return "sse4.2";
+    case ScanImpl::kScalar: break;
+  }
+  return "scalar";
+}
+
+namespace detail {
+ScanFn g_scan = scan_fn(detect_scan_impl());
+}
+
+namespace {
+ScanImpl g_impl = detect_scan_impl();
+}
+
+void set_scan_impl(ScanImpl impl) {
+  detail::g_scan = scan_fn(impl);
+  g_impl = detail::g_scan == scan_fn(ScanImpl::kScalar) ? ScanImpl::kScalar : impl;
+}
+
+ScanImpl active_scan_impl() { return g_impl; }
+
+}  // namespace sysapm
@@ -0,0 +1,78 @@
+#include "sysapm/numa.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "sysapm/tick_scheduler.hpp"
+
+namespace sysapm {
+namespace {
+
+constexpr int kMaxNodes = 1024;
+
+bool read_small(const std::string& path, std::string* out) {
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  char buf[4096];
+  const ssize_t n = ::read(fd, buf, sizeof buf);
+  ::close(fd);
+  if (n < 0) return false;
+  out->assign(buf, static_cast<std::size_t>(n));
+  return true;
+}
+
+}  // namespace
+
+int read_numa_topology(std::vector<NumaNode>* out, const std::string& sys_root) {
+  out->clear();
+  const std::string dir = sys_root + "/devices/system/node";
+  DIR* d = ::opendir(dir.c_str());
+  if (!d) return -ENOENT;
+  std::string text;
+  while (const dirent* e = ::readdir(d)) {
+    if (std::strncmp(e->d_name, "node", 4) != 0) continue;
+    char* end;
+    const long id = std::strtol(e->d_name + 4, &end, 10);
+    if (end == e->d_name + 4 || *end || id < 0 || id >= kMaxNodes) continue;
+    NumaNode node{static_cast<int>(id), {}};
+    // An empty cpulist (a memory-only node) does not parse.
+    if (!read_small(dir + "/" + e->d_name + "/cpulist", &text) || parse_cpu_list(text, &node.cpus) < 0) continue;
+    out->push_back(std::move(node));
+  }
+  ::closedir(d);
+  std::sort(out->begin(), out->end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+  return out->empty() ? -ENOENT : 0;
+}
+
+int numa_node_of(const std::vector<NumaNode>& nodes, int cpu) {
+  for (const NumaNode& n : nodes)
+    if (std::binary_search(n.cpus.begin(), n.cpus.end(), cpu)) return n.id;
+  return -1;
+}
+
+void* numa_alloc(std::size_t bytes, int node) {
+  void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return nullptr;
+  if (node >= 0 && node < kMaxNodes) {
+    // Before the first touch, so every page faults in on the node.
+    unsigned long mask[kMaxNodes / (8 * sizeof(unsigned long))] = {};
+    mask[static_cast<std::size_t>(node) / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+    ::syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, mask, kMaxNodes + 1, 0);
+  }
+  return p;
+}
+
+void numa_free(void* p, std::size_t bytes) {
+  if (p) ::munmap(p, bytes);
+}
+
+}  // namespace sysapm
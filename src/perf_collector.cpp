@@ -0,0 +1,442 @@
+#include "sysapm/perf_collector.hpp"
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include "sysapm/cgroup_collector.hpp"
+#include "sysapm/clock.hpp"
+#include "sysapm/tick_scheduler.hpp"
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+namespace sysapm {
+namespace {
+
+// Leader's time_enabled, time_running, then one value per group member.
+constexpr uint64_t kReadFormat = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+int perf_event_open(perf_event_attr* attr, int pid, int cpu, int group_fd, unsigned long flags) {
+  return static_cast<int>(::syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags | PERF_FLAG_FD_CLOEXEC));
+}
+
+template <typename T>
+bool parse_number(std::string_view v, T* out) {
+  auto [end, ec] = std::from_chars(v.data(), v.data() + v.size(), *out);
+  return ec == std::errc() && end == v.data() + v.size();
+}
+
+bool parse_bool(std::string_view v, bool* out) {
+  if (v == "1") *out = true;
+  else if (v == "0") *out = false;
+  else return false;
+  return true;
+}
+
+std::vector<int> online_cpus() {
+  std::vector<int> cpus;
+  char buf[256];
+  int fd = ::open("/sys/devices/system/cpu/online", O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    const ssize_t n = ::read(fd, buf, sizeof buf - 1);
+    ::close(fd);
+    if (n > 0 && parse_cpu_list(std::string_view(buf, static_cast<std::size_t>(n)), &cpus) == 0) return cpus;
+  }
+  cpus.clear();
+  for (long c = 0, n = ::sysconf(_SC_NPROCESSORS_ONLN); c < n; ++c) cpus.push_back(static_cast<int>(c));
+  return cpus;
+}
+
+int current_tid() { return static_cast<int>(::syscall(SYS_gettid)); }
+
+enum PerfSeries : uint32_t { kSeriesIpc, kSeriesRunningRatio, kScopeSeriesCount };
+
+}  // namespace
+
+const std::vector<PerfEventSpec>& default_perf_events() {
+  // Cache misses are the last-level cache on every PMU that offers them.
+  static const std::vector<PerfEventSpec> kEvents = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "llc_misses"},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses"},
+  };
+  return kEvents;
+}
+
+PerfGroup::~PerfGroup() { close(); }
+
+int PerfGroup::open(const std::vector<PerfEventSpec>& events, int pid, int cpu, unsigned long flags,
+                    bool mmap_pages) {
+  close();
+  if (events.empty() || events.size() > kMaxPerfEvents) return -EINVAL;
+  n_ = events.size();
+  // A task's own counters are allowed at perf_event_paranoid 2 if they
+  // leave out the kernel.
+  const bool task = pid >= 0 && !(flags & PERF_FLAG_PID_CGROUP);
+  bool user_only = false;
+  for (std::size_t i = 0; i < n_; ++i) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.read_format = kReadFormat;
+    attr.disabled = i == 0;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = user_only;
+    int fd = perf_event_open(&attr, pid, cpu, i == 0 ? -1 : fds_[0], flags);
+    if (fd < 0 && i == 0 && task && (errno == EACCES || errno == EPERM)) {
+      user_only = true;
+      attr.exclude_kernel = attr.exclude_hv = 1;
+      fd = perf_event_open(&attr, pid, cpu, -1, flags);
+    }
+    if (fd < 0) {
+      const int rc = -errno;
+      if (i == 0) {
+        close();
+        return rc;
+      }
+      slot_[i] = -1;  // not on this PMU, or it cannot be grouped with the leader
+      continue;
+    }
+    fds_[i] = fd;
+    slot_[i] = static_cast<int>(opened_++);
+    present_ |= 1u << i;
+    if (mmap_pages) {
+      void* p = ::mmap(nullptr, static_cast<std::size_t>(::sysconf(_SC_PAGESIZE)), PROT_READ, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED) pages_[i] = static_cast<perf_event_mmap_page*>(p);
+    }
+  }
+  if (::ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) < 0 ||
+      ::ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0) {
+    const int rc = -errno;
+    close();
+    return rc;
+  }
+  return 0;
+}
+
+void PerfGroup::close() {
+  const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+  // Members first: closing the leader alone would leave them as singletons.
+  for (std::size_t i = kMaxPerfEvents; i-- > 0;) {
+    if (pages_[i]) ::munmap(pages_[i], page);
+    if (fds_[i] >= 0) ::close(fds_[i]);
+    pages_[i] = nullptr;
+    fds_[i] = -1;
+    slot_[i] = 0;
+    last_raw_[i] = totals_[i] = deltas_[i] = 0;
+  }
+  n_ = opened_ = 0;
+  present_ = 0;
+  last_enabled_ = last_running_ = d_enabled_ = d_running_ = 0;
+  last_rdpmc_ = false;
+}
+
+// The user-space read of perf_event_mmap_page: each page is a seqlock
+// around offset + the live PMC, and the times the kernel last wrote plus
+// what the TSC says has passed since. Only usable while every member is on
+// the PMU of this very CPU, which holds for a self-monitoring group of the
+// calling thread; anything else falls back to read().
+bool PerfGroup::read_rdpmc(uint64_t* raw, uint64_t* enabled, uint64_t* running) const {
+#if defined(__x86_64__)
+  for (std::size_t i = 0; i < n_; ++i) {
+    if (slot_[i] < 0) continue;
+    const volatile perf_event_mmap_page* pc = pages_[i];
+    if (!pc) return false;
+    uint32_t seq;
+    uint64_t count, en, run;
+    do {
+      seq = pc->lock;
+      __atomic_signal_fence(__ATOMIC_ACQUIRE);
+      const uint32_t idx = pc->index;
+      if (!pc->cap_user_rdpmc || !pc->cap_user_time || idx == 0) return false;
+      en = pc->time_enabled;
+      run = pc->time_running;
+      const uint64_t cyc = __rdtsc();
+      const uint16_t shift = pc->time_shift;
+      const uint64_t quot = cyc >> shift, rem = cyc & ((uint64_t{1} << shift) - 1);
+      const uint64_t delta = pc->time_offset + quot * pc->time_mult + ((rem * pc->time_mult) >> shift);
+      en += delta;
+      run += delta;
+      uint32_t lo, hi;
+      asm volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1));
+      const unsigned width = pc->pmc_width;
+      int64_t pmc = static_cast<int64_t>((uint64_t{hi} << 32) | lo);
+      pmc = static_cast<int64_t>(static_cast<uint64_t>(pmc) << (64 - width)) >> (64 - width);
+      count = static_cast<uint64_t>(static_cast<int64_t>(pc->offset) + pmc);
+      __atomic_signal_fence(__ATOMIC_ACQUIRE);
+    } while (pc->lock != seq);
+    raw[slot_[i]] = count;
+    // The leader's times stand for the group, as in a read().
+    if (slot_[i] == 0) {
+      *enabled = en;
+      *running = run;
+    }
+  }
+  return true;
+#else
+  (void)raw;
+  (void)enabled;
+  (void)running;
+  return false;
+#endif
+}
+
+int PerfGroup::read() {
+  if (fds_[0] < 0) return -EBADF;
+  uint64_t raw[kMaxPerfEvents] = {};
+  uint64_t enabled = 0, running = 0;
+  last_rdpmc_ = pages_[0] && read_rdpmc(raw, &enabled, &running);
+  if (!last_rdpmc_) {
+    uint64_t buf[3 + kMaxPerfEvents];
+    const ssize_t n = ::read(fds_[0], buf, sizeof buf);
+    if (n < 0) return -errno;
+    if (n < static_cast<ssize_t>(3 * sizeof(uint64_t)) || buf[0] != opened_) return -EIO;
+    enabled = buf[1];
+    running = buf[2];
+    std::memcpy(raw, buf + 3, opened_ * sizeof(uint64_t));
+  }
+  fold(raw, enabled, running);
+  return 0;
+}
+
+// Scales this read's deltas by its own enabled/running ratio; scaling the
+// cumulative values instead would rewrite history every time the ratio
+// moved and could make a total go backwards.
+void PerfGroup::fold(const uint64_t* raw, uint64_t enabled, uint64_t running) {
+  d_enabled_ = enabled - last_enabled_;
+  d_running_ = running - last_running_;
+  last_enabled_ = enabled;
+  last_running_ = running;
+  for (std::size_t i = 0; i < n_; ++i) {
+    deltas_[i] = 0;
+    if (slot_[i] < 0) continue;
+    const uint64_t v = raw[slot_[i]];
+    deltas_[i] = perf_scale(v - last_raw_[i], d_enabled_, d_running_);
+    last_raw_[i] = v;
+    totals_[i] += deltas_[i];
+  }
+}
+
+int parse_perf_options(std::string_view args, PerfOptions* out) {
+  while (!args.empty()) {
+    std::size_t comma = args.find(',');
+    std::string_view item = args.substr(0, comma);
+    args = comma == std::string_view::npos ? std::string_view{} : args.substr(comma + 1);
+    if (item.empty()) continue;
+    std::size_t eq = item.find('=');
+    if (eq == std::string_view::npos) return -EINVAL;
+    std::string_view k = item.substr(0, eq), v = item.substr(eq + 1);
+    bool ok = true;
+    if (k == "cgroups") {
+      out->cgroups.clear();
+      while (!v.empty()) {
+        const std::size_t colon = v.find(':');
+        if (colon) out->cgroups.emplace_back(v.substr(0, colon));
+        v = colon == std::string_view::npos ? std::string_view{} : v.substr(colon + 1);
+      }
+    } else if (k == "cgroup_root") {
+      out->cgroup_root = v;
+    } else if (k == "per_cpu") {
+      ok = parse_bool(v, &out->per_cpu);
+    } else if (k == "shard") {
+      ok = parse_number(v, &out->shard_groups) && out->shard_groups > 0;
+    } else if (k == "self") {
+      ok = parse_bool(v, &out->self);
+    } else {
+      ok = false;
+    }
+    if (!ok) return -EINVAL;
+  }
+  return 0;
+}
+
+PerfCollector::~PerfCollector() {
+  groups_.clear();
+  self_.clear();
+  for (int fd : cgroup_fds_) ::close(fd);
+}
+
+int PerfCollector::open(const PerfOptions& opts) {
+  opts_ = opts;
+  const std::vector<PerfEventSpec>& want = opts.events.empty() ? default_perf_events() : opts.events;
+  if (want.size() > kMaxPerfEvents) return -EINVAL;
+  const std::vector<int> cpus = online_cpus();
+  if (cpus.empty()) return -ENODEV;
+
+  // One probe group finds the events this PMU counts, so every group has
+  // the same layout and scopes line up.
+  {
+    PerfGroup probe;
+    if (int rc = probe.open(want, -1, cpus[0]); rc < 0) return rc;
+    events_.clear();
+    for (std::size_t i = 0; i < want.size(); ++i)
+      if (probe.present() & (1u << i)) events_.push_back(want[i]);
+  }
+  metrics_.clear();
+  for (std::size_t i = 0; i < events_.size(); ++i) {
+    metrics_.push_back(std::string("perf_") + events_[i].name + "_total");
+    if (events_[i].type == PERF_TYPE_HARDWARE && events_[i].config == PERF_COUNT_HW_CPU_CYCLES)
+      cycles_ = static_cast<int>(i);
+    if (events_[i].type == PERF_TYPE_HARDWARE && events_[i].config == PERF_COUNT_HW_INSTRUCTIONS)
+      instructions_ = static_cast<int>(i);
+  }
+
+  if (opts.per_cpu)
+    for (int cpu : cpus)
+      if (int rc = add_scope("cpu", std::to_string(cpu), -1, {cpu}, 0); rc < 0) return rc;
+  if (!opts.cgroups.empty()) {
+    const std::string root = opts.cgroup_root.empty() ? find_cgroup2() : opts.cgroup_root;
+    if (root.empty()) return -ENOENT;
+    for (const std::string& path : opts.cgroups) {
+      const int fd = ::open((root + path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0) return -errno;
+      cgroup_fds_.push_back(fd);
+      if (int rc = add_scope("cgroup", path, fd, cpus, PERF_FLAG_PID_CGROUP); rc < 0) return rc;
+    }
+  }
+  if (groups_.empty()) return -ENODEV;
+  stats_.groups = groups_.size();
+  // Reads go node by node, each node's as one range for its workers.
+  read_order_.resize(groups_.size());
+  for (std::size_t i = 0; i < groups_.size(); ++i) read_order_[i] = i;
+  std::stable_sort(read_order_.begin(), read_order_.end(),
+                   [&](std::size_t a, std::size_t b) { return group_node_[a] < group_node_[b]; });
+  ranges_.clear();
+  for (std::size_t i = 0; i < read_order_.size(); ++i) {
+    const int node = group_node_[read_order_[i]];
+    if (ranges_.empty() || ranges_.back().node != node) ranges_.push_back({i, i, node});
+    ranges_.back().end = i + 1;
+  }
+  return 0;
+}
+
+int PerfCollector::add_scope(const char* key, const std::string& label, int pid, const std::vector<int>& cpus,
+                             unsigned long flags) {
+  Scope s;
+  s.label_key = key;
+  s.label = label;
+  for (int cpu : cpus) {
+    const int node = numa_node_of(opts_.nodes, cpu);
+    TickArena* arena = nullptr;
+    for (auto& a : arenas_)
+      if (a->node() == node) arena = a.get();
+    if (!arena) arena = arenas_.emplace_back(std::make_unique<TickArena>(16u << 10, node)).get();
+    std::unique_ptr<PerfGroup, DestroyGroup> g(new (arena->allocate(sizeof(PerfGroup), alignof(PerfGroup))) PerfGroup);
+    if (int rc = g->open(events_, pid, cpu, flags); rc < 0) {
+      if (rc == -ENODEV) continue;  // went offline since we listed it
+      return rc;
+    }
+    s.groups.push_back(groups_.size());
+    groups_.push_back(std::move(g));
+    group_node_.push_back(node);
+  }
+  if (s.groups.empty()) return 0;
+  s.ids.assign(events_.size() + kScopeSeriesCount, 0);
+  scopes_.push_back(std::move(s));
+  return 0;
+}
+
+void PerfCollector::read_groups() {
+  const std::size_t n = groups_.size();
+  stats_.reads += n;
+  // Spread over several nodes, even a few reads are worth keeping local.
+  if (!opts_.pool || (ranges_.size() < 2 && n <= opts_.shard_groups)) {
+    for (auto& g : groups_)
+      if (g->read() < 0) ++stats_.read_errors;
+    return;
+  }
+  std::atomic<uint64_t> errors{0};
+  opts_.pool->parallel_for(ranges_, opts_.shard_groups, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i)
+      if (groups_[read_order_[i]]->read() < 0) errors.fetch_add(1, std::memory_order_relaxed);
+  });
+  stats_.read_errors += errors.load(std::memory_order_relaxed);
+  for (const ThreadPool::NodeRange& r : ranges_)
+    stats_.shards += (r.end - r.begin + opts_.shard_groups - 1) / opts_.shard_groups;
+}
+
+int PerfCollector::collect(std::vector<Sample>& out) {
+  // The self group brackets the whole tick, read included.
+  PerfGroup* self = nullptr;
+  if (opts_.self && cycles_ >= 0) {
+    std::unique_ptr<PerfGroup>& g = self_[current_tid()];
+    if (!g) {
+      std::vector<PerfEventSpec> own = {events_[static_cast<std::size_t>(cycles_)]};
+      if (instructions_ >= 0) own.push_back(events_[static_cast<std::size_t>(instructions_)]);
+      g = std::make_unique<PerfGroup>();
+      if (g->open(own, 0, -1, 0, true) < 0) g.reset();
+    }
+    self = g.get();
+    if (self) self->read();  // whatever else this thread ran since is not ours
+  }
+
+  read_groups();
+  const int64_t ts = realtime_ns();
+  const std::size_t ne = events_.size();
+  uint64_t totals[kMaxPerfEvents], deltas[kMaxPerfEvents];
+  for (Scope& s : scopes_) {
+    std::memset(totals, 0, sizeof totals);
+    std::memset(deltas, 0, sizeof deltas);
+    uint64_t enabled = 0, running = 0;
+    for (std::size_t gi : s.groups) {
+      const PerfGroup& g = *groups_[gi];
+      for (std::size_t i = 0; i < ne; ++i) {
+        totals[i] += g.totals()[i];
+        deltas[i] += g.deltas()[i];
+      }
+      enabled += g.last_enabled_ns();
+      running += g.last_running_ns();
+    }
+    for (std::size_t i = 0; i < ne; ++i) {
+      if (!s.ids[i]) s.ids[i] = registry().intern(metrics_[i], {{s.label_key, s.label}});
+      out.push_back(Sample::make_counter(ts, s.ids[i], totals[i]));
+    }
+    if (cycles_ >= 0 && instructions_ >= 0 && deltas[static_cast<std::size_t>(cycles_)] > 0) {
+      uint32_t& id = s.ids[ne + kSeriesIpc];
+      if (!id) id = registry().intern("perf_ipc", {{s.label_key, s.label}});
+      out.push_back(Sample::make_gauge(ts, id, static_cast<double>(deltas[static_cast<std::size_t>(instructions_)]) /
+                                                   static_cast<double>(deltas[static_cast<std::size_t>(cycles_)])));
+    }
+    if (enabled > 0) {
+      uint32_t& id = s.ids[ne + kSeriesRunningRatio];
+      if (!id) id = registry().intern("perf_running_ratio", {{s.label_key, s.label}});
+      out.push_back(Sample::make_gauge(ts, id, static_cast<double>(running) / static_cast<double>(enabled)));
+    }
+  }
+
+  if (self && self->read() == 0) {
+    ++(self->last_read_rdpmc() ? stats_.self_rdpmc : stats_.self_syscall);
+    self_counters(*self, out, ts);
+  }
+  return 0;
+}
+
+void PerfCollector::self_counters(const PerfGroup& g, std::vector<Sample>& out, int64_t ts) {
+  static constexpr const char* kNames[2] = {"system_apm_self_perf_cycles_total",
+                                            "system_apm_self_perf_instructions_total"};
+  // After the self group's second read its deltas are this tick's cost.
+  const std::size_t n = instructions_ >= 0 ? 2 : 1;
+  for (std::size_t i = 0; i < n; ++i) {
+    self_totals_[i] += g.deltas()[i];
+    if (!self_ids_[i]) self_ids_[i] = registry().intern(kNames[i], {{"collector", "perf"}});
+    out.push_back(Sample::make_counter(ts, self_ids_[i], self_totals_[i]));
+  }
+}
+
+}  // namespace sysapm
@@ -0,0 +1,286 @@
+#include "sysapm/pipeline.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "sysapm/clock.hpp"
+#include "sysapm/self_profile.hpp"
+
+namespace sysapm {
+namespace {
+
+constexpr std::size_t kDrainChunk = 4096;
+
+constexpr const char* kSelfNames[kSelfLaneMetricCount] = {
+    "ring_high_water", "ring_dropped_total", "ring_pushed_total", "collect_errors_total",
+    "collect_duration_ns", "collect_duration_p50_ns", "collect_duration_p99_ns",
+    "wake_skew_ns", "ticks_skipped_total"};
+
+constexpr const char* kPoolNames[kSelfPoolMetricCount] = {
+    "pool_queued", "pool_tasks_total", "pool_steals_total", "pool_cpu_ns_total", "pool_throttled_ns_total",
+    "pool_remote_total"};
+
+constexpr const char* kStageMetricNames[kSelfStageMetricCount] = {
+    "stage_calls_total", "stage_ns_total", "stage_duration_p50_ns", "stage_duration_p99_ns"};
+
+}  // namespace
+
+Pipeline::~Pipeline() { stop(); }
+
+void Pipeline::add(std::unique_ptr<Collector> c) {
+  c->bind_registry(&registry_);
+  collectors_.push_back(std::move(c));
+}
+
+int Pipeline::start(const PipelineOptions& opts, Consumer consumer, Drained drained) {
+  if (running_.load()) return -EBUSY;
+  opts_ = opts;
+  consumer_ = std::move(consumer);
+  drained_ = std::move(drained);
+  doorbell_ = ::eventfd(0, EFD_CLOEXEC);
+  if (doorbell_ < 0) return -errno;
+  lanes_.clear();
+  char metric[64];
+  for (auto& c : collectors_) {
+    auto lane = std::make_unique<Lane>(c.get(), opts_.ring_capacity);
+    for (uint32_t m = 0; m < kSelfLaneMetricCount; ++m) {
+      std::snprintf(metric, sizeof metric, "system_apm_self_%s", kSelfNames[m]);
+      lane->self_ids[m] = registry_.intern(metric, {{"collector", c->name()}});
+    }
+    if (int rc = opts_.pool ? 0 : lane->ticks.open(opts_.interval_ns); rc < 0) {
+      lanes_.clear();
+      ::close(doorbell_);
+      doorbell_ = -1;
+      return rc;
+    }
+    lanes_.push_back(std::move(lane));
+  }
+  if (opts_.pool) {
+    for (uint32_t m = 0; m < kSelfPoolMetricCount; ++m) {
+      std::snprintf(metric, sizeof metric, "system_apm_self_%s", kPoolNames[m]);
+      pool_ids_[m] = registry_.intern(metric);
+    }
+    if (int rc = ticks_.open(opts_.interval_ns); rc < 0) {
+      lanes_.clear();
+      ::close(doorbell_);
+      doorbell_ = -1;
+      return rc;
+    }
+  }
+  for (std::size_t s = 0; s < kStageCount; ++s)
+    for (uint32_t m = 0; m < kSelfStageMetricCount; ++m) {
+      std::snprintf(metric, sizeof metric, "system_apm_self_%s", kStageMetricNames[m]);
+      stage_ids_[s][m] = registry_.intern(metric, {{"stage", stage_name(static_cast<Stage>(s))}});
+    }
+  scratch_.resize(kDrainChunk);
+  policy_rc_.store(0);
+  running_.store(true);
+  if (opts_.pool)
+    ticker_ = std::thread([this] { run_ticker(); });
+  else
+    for (auto& lane : lanes_) lane->thread = std::thread([this, l = lane.get()] { run_collector(*l); });
+  aggregator_ = std::thread([this] { run_aggregator(); });
+  return 0;
+}
+
+void Pipeline::stop() {
+  if (!running_.exchange(false)) return;
+  for (auto& lane : lanes_) lane->ticks.wake();
+  ticks_.wake();
+  for (auto& lane : lanes_)
+    if (lane->thread.joinable()) lane->thread.join();
+  if (ticker_.joinable()) ticker_.join();
+  // Tasks already handed to the pool still push into their rings.
+  for (auto& lane : lanes_)
+    while (lane->busy.load(std::memory_order_acquire)) {
+      timespec ts{0, 1000000};
+      nanosleep(&ts, nullptr);
+    }
+  ring_doorbell();  // wake the aggregator for its final drain
+  if (aggregator_.joinable()) aggregator_.join();
+  ::close(doorbell_);
+  doorbell_ = -1;
+}
+
+int Pipeline::collect_once(const Consumer& consumer) {
+  std::vector<Sample> batch;
+  int first = 0;
+  for (auto& c : collectors_) {
+    batch.clear();
+    int rc = c->collect(batch);
+    if (rc < 0 && first == 0) first = rc;
+    consumer(batch.data(), batch.size());
+  }
+  return first;
+}
+
+void Pipeline::ring_doorbell() {
+  uint64_t one = 1;
+  ssize_t n = ::write(doorbell_, &one, sizeof one);
+  (void)n;  // the counter saturating just means a wakeup is already pending
+}
+
+void Pipeline::apply_policy() {
+  if (int rc = apply_thread_policy(opts_.threads); rc < 0) {
+    int none = 0;
+    policy_rc_.compare_exchange_strong(none, rc);
+  }
+}
+
+void Pipeline::run_collector(Lane& lane) {
+  apply_policy();
+  // The scheduler skips deadlines a slow tick overran rather than bunching.
+  while (running_.load(std::memory_order_relaxed)) {
+    Tick tick;
+    int rc = lane.ticks.wait(&tick);
+    if (!running_.load(std::memory_order_relaxed)) break;
+    if (rc <= 0) continue;
+    note_tick(lane, tick);
+    collect(lane);
+  }
+}
+
+void Pipeline::run_ticker() {
+  apply_policy();
+  while (running_.load(std::memory_order_relaxed)) {
+    Tick tick;
+    int rc = ticks_.wait(&tick);
+    if (!running_.load(std::memory_order_relaxed)) break;
+    if (rc <= 0) continue;
+    for (auto& l : lanes_) {
+      Lane* lane = l.get();
+      note_tick(*lane, tick);
+      if (lane->busy.exchange(true, std::memory_order_acquire)) {
+        lane->skipped.fetch_add(1, std::memory_order_relaxed);  // still on the last deadline
+        continue;
+      }
+      opts_.pool->submit([this, lane] {
+        collect(*lane);
+        lane->busy.store(false, std::memory_order_release);
+      });
+    }
+  }
+}
+
+void Pipeline::note_tick(Lane& lane, const Tick& tick) {
+  if (tick.skew_ns > lane.skew_max_ns.load(std::memory_order_relaxed))
+    lane.skew_max_ns.store(tick.skew_ns, std::memory_order_relaxed);
+  if (tick.skipped) lane.skipped.fetch_add(tick.skipped, std::memory_order_relaxed);
+}
+
+void Pipeline::collect(Lane& lane) {
+  StageTimer timer(Stage::kCollect);
+  int64_t t0 = clock_ns(CLOCK_MONOTONIC);
+  lane.batch.clear();
+  if (lane.collector->collect(lane.batch) < 0) lane.errors.fetch_add(1, std::memory_order_relaxed);
+  const auto took = static_cast<uint64_t>(clock_ns(CLOCK_MONOTONIC) - t0);
+  lane.last_collect_ns.store(took, std::memory_order_relaxed);
+  lane.collect_ns.record(took);
+  if (!lane.batch.empty()) {
+    lane.ring.push(lane.batch.data(), lane.batch.size());
+    ring_doorbell();
+  }
+}
+
+void Pipeline::run_aggregator() {
+  apply_policy();
+  int64_t next_self = 0;
+  for (;;) {
+    uint64_t v;
+    ssize_t n = ::read(doorbell_, &v, sizeof v);
+    if (n < 0 && errno == EINTR) continue;
+    drain();
+    int64_t now = clock_ns(CLOCK_REALTIME);
+    if (now >= next_self) {
+      emit_self_metrics(now);
+      next_self = (now / opts_.interval_ns + 1) * opts_.interval_ns;
+    }
+    if (!running_.load()) break;
+  }
+  drain();
+}
+
+void Pipeline::drain() {
+  for (auto& lane : lanes_) {
+    for (;;) {
+      std::size_t n = lane->ring.pop(scratch_.data(), scratch_.size());
+      if (n == 0) break;
+      consumer_(scratch_.data(), n);
+      if (n < scratch_.size()) break;
+    }
+  }
+  if (drained_) drained_();
+}
+
+void Pipeline::emit_self_metrics(int64_t ts) {
+  std::size_t n = 0;
+  for (const auto& l : lanes_) {
+    Lane& lane = *l;
+    RingStats rs = lane.ring.stats();
+    auto series = [&lane](uint32_t m) { return lane.self_ids[m]; };
+    scratch_[n++] = Sample::make_gauge(ts, series(kSelfRingHighWater), static_cast<double>(rs.high_water));
+    scratch_[n++] = Sample::make_counter(ts, series(kSelfRingDropped), rs.dropped);
+    scratch_[n++] = Sample::make_counter(ts, series(kSelfRingPushed), rs.pushed);
+    scratch_[n++] = Sample::make_counter(ts, series(kSelfCollectErrors),
+                                         lane.errors.load(std::memory_order_relaxed));
+    scratch_[n++] = Sample::make_gauge(
+        ts, series(kSelfCollectNs),
+        static_cast<double>(lane.last_collect_ns.load(std::memory_order_relaxed)));
+    lane.collect_ns.snapshot(&lane.collect_window);
+    lane.collect_window.subtract(lane.collect_seen);
+    lane.collect_seen.merge(lane.collect_window);  // seen += window: the running total again
+    scratch_[n++] = Sample::make_gauge(ts, series(kSelfCollectP50Ns),
+                                       static_cast<double>(lane.collect_window.quantile(0.5)));
+    scratch_[n++] = Sample::make_gauge(ts, series(kSelfCollectP99Ns),
+                                       static_cast<double>(lane.collect_window.quantile(0.99)));
+    // Only the lane raises the maximum, so a lost race costs one reading.
+    scratch_[n++] = Sample::make_gauge(
+        ts, series(kSelfWakeSkewNs),
+        static_cast<double>(lane.skew_max_ns.exchange(0, std::memory_order_relaxed)));
+    scratch_[n++] = Sample::make_counter(ts, series(kSelfTicksSkipped),
+                                         lane.skipped.load(std::memory_order_relaxed));
+    if (n + kSelfLaneMetricCount > scratch_.size()) {
+      consumer_(scratch_.data(), n);
+      n = 0;
+    }
+  }
+  if (opts_.pool) {
+    if (n + kSelfPoolMetricCount > scratch_.size()) {
+      consumer_(scratch_.data(), n);
+      n = 0;
+    }
+    const ThreadPoolStats ps = opts_.pool->stats();
+    scratch_[n++] = Sample::make_gauge(ts, pool_ids_[kSelfPoolQueued], static_cast<double>(ps.queued));
+    scratch_[n++] = Sample::make_counter(ts, pool_ids_[kSelfPoolTasks], ps.tasks);
+    scratch_[n++] = Sample::make_counter(ts, pool_ids_[kSelfPoolSteals], ps.steals);
+    scratch_[n++] = Sample::make_counter(ts, pool_ids_[kSelfPoolCpuNs], ps.cpu_ns);
+    scratch_[n++] = Sample::make_counter(ts, pool_ids_[kSelfPoolThrottledNs], ps.throttled_ns);
+    scratch_[n++] = Sample::make_counter(ts, pool_ids_[kSelfPoolRemote], ps.remote);
+  }
+  StageProfiler& prof = stage_profiler();
+  if (prof.enabled()) {
+    if (n + kStageCount * kSelfStageMetricCount > scratch_.size()) {
+      consumer_(scratch_.data(), n);
+      n = 0;
+    }
+    for (std::size_t s = 0; s < kStageCount; ++s) {
+      const Stage stage = static_cast<Stage>(s);
+      const uint32_t* ids = stage_ids_[s];
+      prof.histogram(stage).snapshot(&stage_window_[s]);
+      stage_window_[s].subtract(stage_seen_[s]);
+      stage_seen_[s].merge(stage_window_[s]);
+      scratch_[n++] = Sample::make_counter(ts, ids[kSelfStageCalls], stage_seen_[s].count());
+      scratch_[n++] = Sample::make_counter(ts, ids[kSelfStageNs], prof.total_ns(stage));
+      scratch_[n++] = Sample::make_gauge(ts, ids[kSelfStageP50Ns],
+                                         static_cast<double>(stage_window_[s].quantile(0.5)));
+      scratch_[n++] = Sample::make_gauge(ts, ids[kSelfStageP99Ns],
+                                         static_cast<double>(stage_window_[s].quantile(0.99)));
+    }
+  }
+  if (n) consumer_(scratch_.data(), n);
+}
+
+}  // namespace sysapm
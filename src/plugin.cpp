@@ -0,0 +1,233 @@
+#include "sysapm/plugin.hpp"
+
+#include <dlfcn.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "sysapm/clock.hpp"
+
+namespace sysapm {
+namespace {
+
+constexpr uint32_t kPluginMaxLabels = 8;
+constexpr uint32_t kInitialRows = 1024;
+
+}  // namespace
+
+int load_plugin(const char* path, const char* args, std::unique_ptr<Collector>* out, std::string* error) {
+  auto fail = [error](int rc, const std::string& why) {
+    if (error) *error = why;
+    return rc;
+  };
+  // RTLD_LOCAL keeps the plugin's copy of sysapm from interposing on ours.
+  void* lib = ::dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!lib) return fail(-ENOENT, ::dlerror());
+  const auto* info = static_cast<const PluginInfo*>(::dlsym(lib, "sysapm_plugin_info"));
+  if (!info || !info->create) {
+    ::dlclose(lib);
+    return fail(-ENOEXEC, std::string(path) + ": no sysapm_plugin_info");
+  }
+  if (info->abi_version != kPluginAbiVersion) {
+    ::dlclose(lib);
+    return fail(-EPROTO, std::string(path) + ": plugin ABI " + std::to_string(info->abi_version) + ", agent " +
+                             std::to_string(kPluginAbiVersion));
+  }
+  Collector* c = nullptr;
+  int rc = info->create(args ? args : "", &c);
+  if (rc < 0 || !c) {
+    if (rc >= 0) rc = -EINVAL;
+    const std::string why = std::string(info->name) + ": " + std::strerror(-rc);  // before `info` is unmapped
+    ::dlclose(lib);
+    return fail(rc, why);
+  }
+  out->reset(c);  // the library stays loaded: `c`'s code lives in it
+  return 0;
+}
+
+PluginCollector::~PluginCollector() { unload(); }
+
+int PluginCollector::open(const PluginOptions& opts, std::string* error) {
+  unload();
+  opts_ = opts;
+  name_.clear();
+  retired_.clear();
+  stats_ = {};
+  host_ = {this, &PluginCollector::host_intern, &PluginCollector::host_reserve, &PluginCollector::host_log};
+  series_col_.assign(kInitialRows, 0);
+  value_col_.assign(kInitialRows, sysapm_value{});
+  return load(error);
+}
+
+PluginCollector::FileId PluginCollector::file_id() const {
+  struct stat st;
+  if (::stat(opts_.path.c_str(), &st) < 0) return {};
+  return {st.st_dev, st.st_ino, static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+          st.st_size};
+}
+
+int PluginCollector::load(std::string* error) {
+  auto fail = [&](int rc, const std::string& why) {
+    if (lib_) ::dlclose(lib_);
+    lib_ = nullptr;
+    plugin_ = nullptr;
+    handles_.clear();
+    handle_of_.clear();
+    ++stats_.load_errors;
+    if (error) *error = why;
+    return rc;
+  };
+  // Checked before dlopen(), so a file replaced in between is caught by
+  // the next check rather than taken for the one loaded.
+  const FileId id = file_id();
+  // RTLD_LOCAL: each build's symbols stay its own, so the next dlopen()
+  // of the path cannot resolve against this one.
+  lib_ = ::dlopen(opts_.path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!lib_) return fail(-ENOENT, ::dlerror());
+  const auto* p = static_cast<const sysapm_plugin*>(::dlsym(lib_, "sysapm_plugin_entry"));
+  if (!p || !p->open || !p->collect || !p->close)
+    return fail(-ENOEXEC, opts_.path + ": no sysapm_plugin_entry");
+  if (p->abi != SYSAPM_PLUGIN_ABI)
+    return fail(-EPROTO, opts_.path + ": plugin ABI " + std::to_string(p->abi) + ", agent " +
+                             std::to_string(SYSAPM_PLUGIN_ABI));
+  const std::string plugin_name = p->name ? p->name : "plugin";
+  if (name_.empty()) name_ = plugin_name;  // a lane keeps the name it started with
+  plugin_ = p;  // host_intern() may be called from open()
+  void* state = nullptr;
+  int rc = p->open(opts_.args.c_str(), &host_, &state);
+  if (rc < 0) return fail(rc, plugin_name + ": " + std::strerror(-rc));
+  state_ = state;
+  loaded_ = id;
+  ++stats_.loads;
+  return 0;
+}
+
+void PluginCollector::unload() {
+  if (!plugin_) return;
+  plugin_->close(state_);
+  ::dlclose(lib_);
+  lib_ = nullptr;
+  plugin_ = nullptr;
+  state_ = nullptr;
+  retired_.insert(retired_.end(), handles_.begin(), handles_.end());
+  handles_.clear();
+  handle_of_.clear();
+  stats_.series = 0;
+  loaded_ = {};
+  ++stats_.unloads;
+}
+
+void PluginCollector::reload(int64_t ts, std::vector<Sample>& out) {
+  unload();
+  const FileId now = file_id();
+  if (now == FileId{}) {
+    retire(ts, out);  // removed: nothing will take over the series
+    return;
+  }
+  std::string why;
+  if (load(&why) < 0) {
+    failed_ = now;
+    std::fprintf(stderr, "system-apm: plugin %s not reloaded: %s\n", opts_.path.c_str(), why.c_str());
+    retire(ts, out);
+  }
+}
+
+void PluginCollector::retire(int64_t ts, std::vector<Sample>& out) {
+  if (retired_.empty()) return;
+  std::vector<uint32_t> live;
+  live.reserve(handles_.size());
+  for (const Handle& h : handles_) live.push_back(h.id);
+  std::sort(live.begin(), live.end());
+  std::sort(retired_.begin(), retired_.end(), [](const Handle& a, const Handle& b) { return a.id < b.id; });
+  for (std::size_t i = 0; i < retired_.size(); ++i) {
+    const Handle& h = retired_[i];
+    if (i && retired_[i - 1].id == h.id) continue;
+    if (!std::binary_search(live.begin(), live.end(), h.id)) out.push_back(Sample::make_stale(ts, h.id, h.kind));
+  }
+  retired_.clear();
+}
+
+int PluginCollector::collect(std::vector<Sample>& out) {
+  const int64_t ts = realtime_ns();
+  ++ticks_;
+  bool check = reload_.exchange(false, std::memory_order_relaxed);
+  if (!check && opts_.check_ticks && ticks_ % opts_.check_ticks == 0) {
+    const FileId now = file_id();
+    // A file that failed to load waits for the next change to it; one
+    // that went away is always acted on.
+    check = now != loaded_ && (now == FileId{} || now != failed_);
+  }
+  if (check) reload(ts, out);
+  if (!plugin_) return 0;
+
+  sysapm_batch batch{series_col_.data(), value_col_.data(), 0, static_cast<uint32_t>(series_col_.size()), ts};
+  const int rc = plugin_->collect(state_, &batch);
+  const uint32_t rows = std::min(batch.count, batch.capacity);
+  out.reserve(out.size() + rows);
+  const auto known = static_cast<uint32_t>(handles_.size());
+  for (uint32_t i = 0; i < rows; ++i) {
+    const uint32_t h = batch.series[i] - 1;  // 0 wraps past `known`
+    if (h >= known) {
+      ++stats_.dropped_rows;
+      continue;
+    }
+    const Handle& x = handles_[h];
+    out.push_back(x.kind == SampleKind::kCounter ? Sample::make_counter(batch.ts_ns, x.id, batch.values[i].counter)
+                                                 : Sample::make_gauge(batch.ts_ns, x.id, batch.values[i].gauge));
+  }
+  // After a reload, once the new build has said what it publishes.
+  retire(ts, out);
+  return rc < 0 ? rc : 0;
+}
+
+uint32_t PluginCollector::host_intern(void* ctx, const char* metric, const sysapm_label* labels, uint32_t n,
+                                      int kind) {
+  auto* self = static_cast<PluginCollector*>(ctx);
+  if (!metric || !valid_series_name(metric) || n > kPluginMaxLabels || (n && !labels)) return 0;
+  if (kind != SYSAPM_GAUGE && kind != SYSAPM_COUNTER) return 0;
+  Label l[kPluginMaxLabels];
+  for (uint32_t i = 0; i < n; ++i) {
+    if (!labels[i].name || !labels[i].value || !valid_series_name(labels[i].name)) return 0;
+    l[i] = {labels[i].name, labels[i].value};
+  }
+  const SampleKind k = kind == SYSAPM_COUNTER ? SampleKind::kCounter : SampleKind::kGauge;
+  // A series declared again (say after CPU hotplug) keeps its handle, so
+  // handles stay bounded by the series published; once full, only those
+  // already held are found.
+  const bool full = self->handles_.size() >= self->opts_.max_series;
+  const uint32_t id = full ? self->registry().find(metric, l, n) : self->registry().intern(metric, l, n);
+  if (id == 0) return 0;
+  if (auto it = self->handle_of_.find(id); it != self->handle_of_.end())
+    return self->handles_[it->second - 1].kind == k ? it->second : 0;
+  if (full) return 0;
+  self->handles_.push_back({id, k});
+  const auto h = static_cast<uint32_t>(self->handles_.size());
+  self->handle_of_.emplace(id, h);
+  self->stats_.series = h;
+  return h;
+}
+
+int PluginCollector::host_reserve(void* ctx, sysapm_batch* batch, uint32_t rows) {
+  auto* self = static_cast<PluginCollector*>(ctx);
+  if (rows > self->opts_.max_rows) return -ENOMEM;
+  if (rows > self->series_col_.size()) {
+    const std::size_t want = std::min<std::size_t>(std::max<std::size_t>(rows, 2 * self->series_col_.size()),
+                                                   self->opts_.max_rows);
+    self->series_col_.resize(want);
+    self->value_col_.resize(want);
+  }
+  batch->series = self->series_col_.data();
+  batch->values = self->value_col_.data();
+  batch->capacity = static_cast<uint32_t>(self->series_col_.size());
+  return 0;
+}
+
+void PluginCollector::host_log(void* ctx, const char* message) {
+  const auto* self = static_cast<const PluginCollector*>(ctx);
+  std::fprintf(stderr, "system-apm: plugin %s: %s\n", self->name_.c_str(), message ? message : "");
+}
+
+}  // namespace sysapm
@@ -0,0 +1,108 @@
+#include "sysapm/proc_connector.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace sysapm {
+
+ProcConnector::~ProcConnector() { close(); }
+
+int ProcConnector::open(std::size_t rcvbuf_bytes) {
+  close();
+  int fd = ::socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+  if (fd < 0) return -errno;
+  // Fork storms burst thousands of events; a deep queue makes ENOBUFS rare.
+  int rcvbuf = static_cast<int>(rcvbuf_bytes);
+  if (::setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof rcvbuf) < 0)
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
+  sockaddr_nl addr{};
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+  if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0) {
+    int err = -errno;
+    ::close(fd);
+    return err;
+  }
+  fd_ = fd;
+  if (int rc = subscribe(true); rc < 0) {
+    close();
+    return rc;
+  }
+  return 0;
+}
+
+void ProcConnector::close() {
+  if (fd_ < 0) return;
+  subscribe(false);
+  ::close(fd_);
+  fd_ = -1;
+  len_ = off_ = 0;
+}
+
+int ProcConnector::subscribe(bool on) {
+  alignas(nlmsghdr) unsigned char msg[NLMSG_SPACE(sizeof(cn_msg) + sizeof(proc_cn_mcast_op))] = {};
+  auto* nl = reinterpret_cast<nlmsghdr*>(msg);
+  auto* cn = static_cast<cn_msg*>(NLMSG_DATA(nl));
+  nl->nlmsg_len = NLMSG_LENGTH(sizeof(cn_msg) + sizeof(proc_cn_mcast_op));
+  nl->nlmsg_type = NLMSG_DONE;
+  nl->nlmsg_pid = static_cast<uint32_t>(getpid());
+  cn->id.idx = CN_IDX_PROC;
+  cn->id.val = CN_VAL_PROC;
+  cn->len = sizeof(proc_cn_mcast_op);
+  proc_cn_mcast_op op = on ? PROC_CN_MCAST_LISTEN : PROC_CN_MCAST_IGNORE;
+  std::memcpy(cn->data, &op, sizeof op);
+  if (::send(fd_, msg, nl->nlmsg_len, 0) < 0) return -errno;
+  return 0;
+}
+
+int ProcConnector::read_events(ProcEvent* out, std::size_t max) {
+  if (fd_ < 0) return -EBADF;
+  std::size_t n = 0;
+  while (n < max) {
+    if (off_ >= len_) {
+      ssize_t r = ::recv(fd_, buf_, sizeof buf_, 0);
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return -errno;  // -ENOBUFS: events were lost
+      }
+      len_ = static_cast<std::size_t>(r);
+      off_ = 0;
+    }
+    auto* nl = reinterpret_cast<nlmsghdr*>(buf_ + off_);
+    std::size_t remaining = len_ - off_;
+    if (!NLMSG_OK(nl, remaining)) {
+      off_ = len_;
+      continue;
+    }
+    off_ += NLMSG_ALIGN(nl->nlmsg_len);
+    if (nl->nlmsg_type == NLMSG_ERROR || nl->nlmsg_type == NLMSG_NOOP) continue;
+    auto* cn = static_cast<cn_msg*>(NLMSG_DATA(nl));
+    if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC) continue;
+    auto* ev = reinterpret_cast<proc_event*>(cn->data);
+    switch (ev->what) {
+      case proc_event::PROC_EVENT_FORK:
+        out[n++] = {ProcEvent::kFork, ev->event_data.fork.child_pid, ev->event_data.fork.child_tgid};
+        break;
+      case proc_event::PROC_EVENT_EXEC:
+        out[n++] = {ProcEvent::kExec, ev->event_data.exec.process_pid,
+                    ev->event_data.exec.process_tgid};
+        break;
+      case proc_event::PROC_EVENT_EXIT:
+        out[n++] = {ProcEvent::kExit, ev->event_data.exit.process_pid,
+                    ev->event_data.exit.process_tgid};
+        break;
+      default:
+        break;
+    }
+  }
+  return static_cast<int>(n);
+}
+
+}  // namespace sysapm
@@ -0,0 +1,172 @@
+#include "sysapm/proc_file.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utility>
+
+#include "sysapm/io_ring.hpp"
+
+namespace sysapm {
+
+ProcFile::~ProcFile() { close(); }
+
+ProcFile::ProcFile(ProcFile&& other) noexcept
+    : fd_(std::exchange(other.fd_, -1)),
+      buf_(std::exchange(other.buf_, nullptr)),
+      cap_(std::exchange(other.cap_, 0)),
+      len_(std::exchange(other.len_, 0)),
+      grows_(std::exchange(other.grows_, 0)) {}
+
+ProcFile& ProcFile::operator=(ProcFile&& other) noexcept {
+  if (this != &other) {
+    close();
+    fd_ = std::exchange(other.fd_, -1);
+    buf_ = std::exchange(other.buf_, nullptr);
+    cap_ = std::exchange(other.cap_, 0);
+    len_ = std::exchange(other.len_, 0);
+    grows_ = std::exchange(other.grows_, 0);
+  }
+  return *this;
+}
+
+int ProcFile::open(const char* path, std::size_t capacity) {
+  close();
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -errno;
+  buf_ = static_cast<char*>(std::malloc(capacity));
+  if (!buf_) {
+    ::close(fd);
+    return -ENOMEM;
+  }
+  fd_ = fd;
+  cap_ = capacity;
+  return 0;
+}
+
+void ProcFile::close() {
+  if (fd_ >= 0) ::close(fd_);
+  std::free(buf_);
+  fd_ = -1;
+  buf_ = nullptr;
+  cap_ = len_ = 0;
+}
+
+int ProcFile::grow() {
+  std::size_t cap = cap_ * 2;
+  char* buf = static_cast<char*>(std::realloc(buf_, cap));
+  if (!buf) return -ENOMEM;
+  buf_ = buf;
+  cap_ = cap;
+  ++grows_;
+  return 0;
+}
+
+long ProcFile::read() {
+  if (fd_ < 0) return -EBADF;
+  // seq_file-backed files may return short reads, so keep reading until EOF.
+  // Filling the buffer completely means the file may be larger: grow and
+  // restart so the result is a consistent single pass.
+  for (;;) {
+    std::size_t off = 0;
+    for (;;) {
+      ssize_t n = ::pread(fd_, buf_ + off, cap_ - off, static_cast<off_t>(off));
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        len_ = 0;
+        return -errno;
+      }
+      if (n == 0) break;
+      off += static_cast<std::size_t>(n);
+      if (off == cap_) break;
+    }
+    if (off < cap_) {
+      len_ = off;
+      return static_cast<long>(off);
+    }
+    if (int rc = grow(); rc < 0) return rc;
+  }
+}
+
+int ProcFileBatch::attach(IoRing* ring, ProcFile* const* files, std::size_t n) {
+  ring_ = nullptr;
+  if (!ring->is_open() || n > ring->capacity()) return -EINVAL;
+  files_.assign(files, files + n);
+  off_.assign(n, 0);
+  std::vector<int> fds(n);
+  for (std::size_t i = 0; i < n; ++i) fds[i] = files[i]->fd_;
+  if (int rc = ring->register_files(fds.data(), static_cast<unsigned>(n)); rc < 0) return rc;
+  ring_ = ring;
+  if (int rc = register_buffers(); rc < 0) {
+    ring_ = nullptr;
+    return rc;
+  }
+  return 0;
+}
+
+int ProcFileBatch::register_buffers() {
+  std::vector<iovec> iov(files_.size());
+  grows_.resize(files_.size());
+  for (std::size_t i = 0; i < files_.size(); ++i) {
+    iov[i] = {files_[i]->buf_, files_[i]->cap_};
+    grows_[i] = files_[i]->grows_;
+  }
+  return ring_->register_buffers(iov.data(), static_cast<unsigned>(iov.size()));
+}
+
+int ProcFileBatch::read_all(long* results) {
+  if (!ring_) return -EBADF;
+  bool moved = false;
+  for (std::size_t i = 0; i < files_.size(); ++i) moved |= files_[i]->grows_ != grows_[i];
+  if (moved) {
+    if (int rc = register_buffers(); rc < 0) return rc;
+  }
+  for (std::size_t i = 0; i < files_.size(); ++i) {
+    off_[i] = 0;
+    results[i] = 1;  // > 0: still reading
+  }
+  for (;;) {
+    unsigned queued = 0;
+    for (std::size_t i = 0; i < files_.size(); ++i) {
+      if (results[i] <= 0) continue;
+      ProcFile& f = *files_[i];
+      ring_->read_fixed(static_cast<int>(i), true, f.buf_ + off_[i], static_cast<uint32_t>(f.cap_ - off_[i]),
+                        off_[i], static_cast<uint16_t>(i), i);
+      ++queued;
+    }
+    if (queued == 0) break;
+    if (int rc = ring_->submit(queued); rc < 0) return rc;
+    unsigned done = 0;
+    while (done < queued) {
+      const unsigned got = ring_->reap([&](uint64_t i, int32_t res) {
+        ProcFile& f = *files_[i];
+        if (res < 0) {
+          f.len_ = 0;
+          results[i] = res;
+        } else if (res == 0) {
+          f.len_ = off_[i];
+          results[i] = 0;  // EOF; the length is reported below
+        } else {
+          off_[i] += static_cast<std::size_t>(res);
+          if (off_[i] == f.cap_) results[i] = -ENOSPC;  // outgrew the buffer
+        }
+      });
+      done += got;
+      if (got == 0) {
+        if (int rc = ring_->submit(queued - done); rc < 0) return rc;
+      }
+    }
+  }
+  for (std::size_t i = 0; i < files_.size(); ++i) {
+    ProcFile& f = *files_[i];
+    if (results[i] == -ENOSPC) {
+      results[i] = f.read();  // grows, then re-reads in one consistent pass
+    } else if (results[i] == 0) {
+      results[i] = static_cast<long>(off_[i]);
+    }
+  }
+  return 0;
+}
+
+}  // namespace sysapm
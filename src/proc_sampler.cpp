@@ -0,0 +1,250 @@
+#include "sysapm/proc_sampler.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+
+#include "sysapm/clock.hpp"
+#include "sysapm/num_scan.hpp"
+#include "sysapm/self_profile.hpp"
+#include "sysapm/text.hpp"
+
+namespace sysapm {
+namespace {
+
+int open_source(ProcFile& f, const std::string& root, const char* rel, std::size_t cap) {
+  char path[512];
+  std::snprintf(path, sizeof path, "%s/%s", root.c_str(), rel);
+  return f.open(path, cap);
+}
+
+}  // namespace
+
+int ProcSampler::open(const SamplerOptions& opts) {
+  opts_ = opts;
+  sources_ = 0;
+  snap_ = {};
+  batch_ = {};
+  ring_.close();
+
+  // Buffer sizes are first guesses; ProcFile grows them once if needed.
+  const unsigned want = opts_.sources;
+  if (want & kSourceStat) {
+    if (int rc = open_source(stat_, opts_.proc_root, "stat", 16384); rc < 0) return rc;
+    sources_ |= kSourceStat;
+  }
+  auto optional = [&](unsigned bit, ProcFile& f, const char* rel, std::size_t cap) {
+    if ((want & bit) && open_source(f, opts_.proc_root, rel, cap) == 0) sources_ |= bit;
+  };
+  optional(kSourceMeminfo, meminfo_, "meminfo", 8192);
+  optional(kSourceLoadavg, loadavg_, "loadavg", 256);
+  optional(kSourceNetDev, net_dev_, "net/dev", 8192);
+  optional(kSourceDiskstats, diskstats_, "diskstats", 16384);
+  if (!sources_) return -ENOENT;
+
+  std::size_t cpus = opts_.max_cpus;
+  if (cpus == 0 && (sources_ & kSourceStat)) {
+    // Size from the file itself so fixtures and hosts agree.
+    if (long n = fetch(stat_); n < 0) return static_cast<int>(n);
+    LineReader lines(stat_.data());
+    std::string_view line;
+    while (lines.next(line)) {
+      uint64_t idx;
+      if (line.size() > 3 && line.starts_with("cpu") && line[3] != ' ' &&
+          parse_u64(line.substr(3, line.find(' ') - 3), idx) && idx + 1 > cpus)
+        cpus = idx + 1;
+    }
+  }
+  snap_.cpu.cpus.reserve(cpus);
+  snap_.net.reserve(opts_.max_net_devices);
+  snap_.disks.reserve(opts_.max_disks);
+  if (opts_.io != IoBackend::kRead) {
+    int rc = open_ring();
+    if (rc < 0 && opts_.io == IoBackend::kUring) return rc;
+  }
+  return 0;
+}
+
+int ProcSampler::open_ring() {
+  ProcFile* files[5];
+  std::size_t n = 0;
+  for (ProcFile* f : {&stat_, &meminfo_, &loadavg_, &net_dev_, &diskstats_})
+    if (f->is_open()) files[n++] = f;
+  int rc = ring_.open(8);
+  if (rc == 0) rc = batch_.attach(&ring_, files, n);
+  if (rc < 0) ring_.close();
+  return rc;
+}
+
+long ProcSampler::fetch(ProcFile& f) {
+  if (prefetched_) {
+    const auto& files = batch_.files();
+    for (std::size_t i = 0; i < files.size(); ++i)
+      if (files[i] == &f) return results_[i];
+  }
+  return f.read();
+}
+
+int ProcSampler::sample() {
+  snap_.timestamp_ns = static_cast<uint64_t>(realtime_ns());
+  snap_.truncated_rows = 0;
+  prefetched_ = batch_.attached() && batch_.read_all(results_) == 0;
+  int first = 0;
+  auto keep = [&first](int rc) {
+    if (rc < 0 && first == 0) first = rc;
+  };
+  if (sources_ & kSourceStat) keep(sample_stat());
+  if (sources_ & kSourceMeminfo) keep(sample_meminfo());
+  if (sources_ & kSourceLoadavg) keep(sample_loadavg());
+  if (sources_ & kSourceNetDev) keep(sample_net_dev());
+  if (sources_ & kSourceDiskstats) keep(sample_diskstats());
+  return first;
+}
+
+int ProcSampler::sample_stat() {
+  if (long n = fetch(stat_); n < 0) return static_cast<int>(n);
+  StageTimer timer(Stage::kParse);
+  CpuStats& cs = snap_.cpu;
+  for (CpuTimes& c : cs.cpus) c = {};
+
+  std::string_view buf = stat_.data();
+  const char* p = buf.data();
+  const char* end = p + buf.size();
+  const char* stop = p;
+  while (p < end) {
+    std::string_view key = next_token(p, end);
+    uint64_t* dst = nullptr;
+    std::size_t max = 1;
+    if (key.starts_with("cpu")) {
+      CpuTimes* row = &cs.total;
+      uint64_t idx;
+      if (key.size() > 3 && parse_u64(key.substr(3), idx)) {
+        // Only allocates when a CPU beyond the sized range comes online.
+        if (idx >= cs.cpus.size()) cs.cpus.resize(idx + 1);
+        row = &cs.cpus[idx];
+      }
+      dst = row->v;
+      max = kCpuFieldCount;
+    } else if (int f = KeyIndex<kStatSchema>::find(key); f >= 0) {
+      dst = &cs.v[f];
+    }
+    if (dst) {
+      scan_u64_row(p, end, dst, max, &stop);
+      p = stop;
+    }
+    p = next_line(p, end);
+  }
+  return 0;
+}
+
+int ProcSampler::sample_meminfo() {
+  if (long n = fetch(meminfo_); n < 0) return static_cast<int>(n);
+  StageTimer timer(Stage::kParse);
+  MemInfo& m = snap_.mem;
+  LineReader lines(meminfo_.data());
+  std::string_view line;
+  // One hash probe per line, whether or not the key is tracked.
+  while (lines.next(line)) {
+    std::size_t colon = line.find(':');
+    if (colon == std::string_view::npos) continue;
+    if (int f = KeyIndex<kMeminfoSchema>::find(line.substr(0, colon)); f >= 0) {
+      FieldReader fields(line.substr(colon + 1));
+      fields.next_u64(m.v[f]);
+    }
+  }
+  return 0;
+}
+
+int ProcSampler::sample_loadavg() {
+  if (long n = fetch(loadavg_); n < 0) return static_cast<int>(n);
+  StageTimer timer(Stage::kParse);
+  // "0.52 0.58 0.59 2/1093 123456"
+  LoadAvg& l = snap_.load;
+  FieldReader fields(loadavg_.data());
+  std::string_view f;
+  if (fields.next(f)) parse_fixed(f, l.load1);
+  if (fields.next(f)) parse_fixed(f, l.load5);
+  if (fields.next(f)) parse_fixed(f, l.load15);
+  if (fields.next(f)) {
+    std::size_t slash = f.find('/');
+    if (slash != std::string_view::npos) {
+      parse_u64(f.substr(0, slash), l.running);
+      parse_u64(f.substr(slash + 1), l.total);
+    }
+  }
+  if (fields.next(f)) {
+    if (!f.empty() && f.back() == '\n') f.remove_suffix(1);
+    parse_u64(f, l.last_pid);
+  }
+  return 0;
+}
+
+int ProcSampler::sample_net_dev() {
+  if (long n = fetch(net_dev_); n < 0) return static_cast<int>(n);
+  StageTimer timer(Stage::kParse);
+  auto& net = snap_.net;
+  net.clear();
+  std::string_view buf = net_dev_.data();
+  const char* p = buf.data();
+  const char* end = p + buf.size();
+  const char* stop;
+  while (p < end) {
+    const char* eol = next_line(p, end);
+    // Header lines have no ':'; old kernels glue the first counter to it.
+    const char* colon = static_cast<const char*>(std::memchr(p, ':', static_cast<std::size_t>(eol - p)));
+    if (!colon) {
+      p = eol;
+      continue;
+    }
+    if (net.size() == net.capacity()) {
+      ++snap_.truncated_rows;
+      p = eol;
+      continue;
+    }
+    NetDevStats& d = net.emplace_back();
+    while (p < colon && is_space(*p)) ++p;
+    copy_name(d.name, {p, static_cast<std::size_t>(colon - p)});
+    scan_u64_row(colon + 1, end, d.v, kNetFieldCount, &stop);
+    p = eol;
+  }
+  return 0;
+}
+
+int ProcSampler::sample_diskstats() {
+  if (long n = fetch(diskstats_); n < 0) return static_cast<int>(n);
+  StageTimer timer(Stage::kParse);
+  auto& disks = snap_.disks;
+  disks.clear();
+  std::string_view buf = diskstats_.data();
+  const char* p = buf.data();
+  const char* end = p + buf.size();
+  const char* stop;
+  while (p < end) {
+    uint64_t devno[2];
+    if (scan_u64_row(p, end, devno, 2, &stop) != 2) {
+      p = next_line(stop, end);
+      continue;
+    }
+    p = stop;
+    std::string_view name = next_token(p, end);
+    if (name.empty()) {
+      p = next_line(p, end);
+      continue;
+    }
+    if (disks.size() == disks.capacity()) {
+      ++snap_.truncated_rows;
+      p = next_line(p, end);
+      continue;
+    }
+    DiskStats& d = disks.emplace_back();
+    d.major = static_cast<uint32_t>(devno[0]);
+    d.minor = static_cast<uint32_t>(devno[1]);
+    copy_name(d.name, name);
+    scan_u64_row(p, end, d.v, kDiskFieldCount, &stop);
+    p = next_line(stop, end);
+  }
+  return 0;
+}
+
+}  // namespace sysapm
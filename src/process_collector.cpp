@@ -0,0 +1,442 @@
+#include "sysapm/process_collector.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "sysapm/self_profile.hpp"
+#include "sysapm/text.hpp"
+
+namespace sysapm {
+namespace {
+
+bool parse_i64(std::string_view s, int64_t& out) {
+  bool neg = !s.empty() && s[0] == '-';
+  uint64_t v;
+  if (!parse_u64(neg ? s.substr(1) : s, v)) return false;
+  out = neg ? -static_cast<int64_t>(v) : static_cast<int64_t>(v);
+  return true;
+}
+
+// Every cached process costs two descriptors; make the soft limit as large
+// as the hard limit allows before the first scan.
+void raise_nofile_limit() {
+  rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+}  // namespace
+
+bool parse_pid_stat(const char* p, const char* end, ProcessStats& out) {
+  StageTimer timer(Stage::kParse);
+  // "pid (comm) S ppid ..." — comm may contain spaces and parens, so the
+  // field list starts after the *last* ')'.
+  const char* open = static_cast<const char*>(std::memchr(p, '(', static_cast<std::size_t>(end - p)));
+  const char* close = static_cast<const char*>(memrchr(p, ')', static_cast<std::size_t>(end - p)));
+  if (!open || !close || close < open) return false;
+  copy_name(out.comm, {open + 1, static_cast<std::size_t>(close - open - 1)});
+
+  FieldReader fields({close + 1, static_cast<std::size_t>(end - close - 1)});
+  std::string_view f;
+  int64_t v = 0;
+  for (int idx = 3; idx <= 24 && fields.next(f); ++idx) {
+    if (idx == 3) {
+      out.state = f.empty() ? '?' : f[0];
+      continue;
+    }
+    if (!parse_i64(f, v)) return false;
+    auto u = static_cast<uint64_t>(v);
+    switch (idx) {
+      case 4: out.ppid = static_cast<int32_t>(v); break;
+      case 10: out.minflt = u; break;
+      case 12: out.majflt = u; break;
+      case 14: out.utime = u; break;
+      case 15: out.stime = u; break;
+      case 19: out.nice = static_cast<int32_t>(v); break;
+      case 20: out.num_threads = u; break;
+      case 22: out.starttime = u; break;
+      case 23: out.vsize = u; break;
+      case 24: out.rss = u; return true;
+      default: break;
+    }
+  }
+  return false;
+}
+
+void parse_pid_status(const char* p, const char* end, ProcessStats& out) {
+  StageTimer timer(Stage::kParse);
+  LineReader lines({p, static_cast<std::size_t>(end - p)});
+  std::string_view line;
+  while (lines.next(line)) {
+    std::size_t colon = line.find(':');
+    if (colon == std::string_view::npos) continue;
+    std::string_view key = line.substr(0, colon);
+    FieldReader fields(line.substr(colon + 1));
+    uint64_t v;
+    if (key == "Uid") {
+      if (fields.next_u64(v)) out.uid = static_cast<uint32_t>(v);
+    } else if (key == "VmSwap") {
+      if (fields.next_u64(v)) out.vm_swap_kb = v;
+    } else if (key == "voluntary_ctxt_switches") {
+      if (fields.next_u64(v)) out.voluntary_ctxt = v;
+    } else if (key == "nonvoluntary_ctxt_switches") {
+      if (fields.next_u64(v)) out.nonvoluntary_ctxt = v;
+      break;  // last field we track
+    }
+  }
+}
+
+ProcessCollector::~ProcessCollector() {
+  table_.for_each([this](int32_t, ProcessEntry& e) { close_entry(e); });
+}
+
+int ProcessCollector::open(const ProcessCollectorOptions& opts) {
+  opts_ = opts;
+  raise_nofile_limit();
+  table_ = PidTable<ProcessEntry>(opts_.initial_capacity);
+  events_.resize(256);
+  if (opts_.use_connector) conn_.open();  // failure leaves us in rescan mode
+  if (opts_.backend != ProcessBackend::kProcfs) {
+    int rc = taskstats_.open(opts_.taskstats_batch);
+    if (rc < 0 && opts_.backend == ProcessBackend::kTaskstats) return rc;
+  }
+  if (opts_.io != IoBackend::kRead) {
+    int rc = open_ring();
+    if (rc < 0 && opts_.io == IoBackend::kUring) return rc;
+  }
+  need_rescan_ = true;
+  if (int rc = rescan(); rc < 0) return rc;
+  need_rescan_ = false;
+  return 0;
+}
+
+int ProcessCollector::collect() {
+  scratch_.reset();
+  ++stats_.ticks;
+  stats_.syscalls_last_tick = 0;
+  if (conn_.is_open()) {
+    drain_events();
+  } else if (++ticks_since_scan_ >= opts_.fallback_rescan_ticks) {
+    need_rescan_ = true;
+  }
+  if (need_rescan_) {
+    if (int rc = rescan(); rc < 0) return rc;
+    need_rescan_ = false;
+  }
+  if (ring_.is_open()) {
+    refresh_batched();
+  } else {
+    table_.retain([this](int32_t pid, ProcessEntry& e) {
+      if ((e.pending && !open_entry(pid, e)) || !refresh(pid, e)) {
+        close_entry(e);
+        ++stats_.removed;
+        return false;
+      }
+      return true;
+    });
+  }
+  if (taskstats_.is_open()) collect_taskstats();
+  return 0;
+}
+
+int ProcessCollector::open_ring() {
+  if (int rc = ring_.open(opts_.uring_depth < 2 ? 2 : opts_.uring_depth); rc < 0) return rc;
+  const std::size_t slots = ring_.capacity();
+  ring_buf_.reset(new char[slots * sizeof buf_]);
+  const iovec iov{ring_buf_.get(), slots * sizeof buf_};
+  if (int rc = ring_.register_buffers(&iov, 1); rc < 0) {
+    ring_.close();
+    ring_buf_.reset();
+    return rc;
+  }
+  inflight_.reserve(slots);
+  results_.resize(slots);
+  return 0;
+}
+
+void ProcessCollector::refresh_batched() {
+  table_.retain([this](int32_t pid, ProcessEntry& e) {
+    if (e.pending && !open_entry(pid, e)) {
+      close_entry(e);
+      ++stats_.removed;
+      return false;
+    }
+    return true;
+  });
+  // The table is not modified until the final retain, so entry pointers
+  // stay valid while their reads are in flight.
+  table_.for_each([this](int32_t pid, ProcessEntry& e) {
+    e.failed = false;
+    if (e.stat_fd < 0) {  // uncached: open/read/close as before
+      e.failed = !refresh(pid, e);
+      return;
+    }
+    const bool status = wants_status(e) && e.status_fd >= 0;
+    if (slots_used_ + 2 > ring_.capacity()) submit_batch();
+    const unsigned slot = slots_used_;
+    char* buf = ring_buf_.get() + slot * sizeof buf_;
+    ring_.read_fixed(e.stat_fd, false, buf, sizeof buf_ - 1, 0, 0, slot);
+    if (status) ring_.read_fixed(e.status_fd, false, buf + sizeof buf_, sizeof buf_ - 1, 0, 0, slot + 1);
+    slots_used_ += status ? 2 : 1;
+    inflight_.push_back({pid, &e, slot, status});
+  });
+  submit_batch();
+  table_.retain([this](int32_t, ProcessEntry& e) {
+    if (!e.failed) return true;
+    close_entry(e);
+    ++stats_.removed;
+    return false;
+  });
+}
+
+void ProcessCollector::submit_batch() {
+  if (slots_used_ == 0) return;
+  const unsigned n = slots_used_;
+  slots_used_ = 0;
+  ++stats_.syscalls_last_tick;
+  if (ring_.submit(n) < 0) {
+    // Cannot happen with a healthy ring; read these the old way.
+    for (const Inflight& f : inflight_) f.entry->failed = !refresh(f.pid, *f.entry);
+    inflight_.clear();
+    return;
+  }
+  for (unsigned done = 0; done < n;) {
+    const unsigned got = ring_.reap([this](uint64_t slot, int32_t res) { results_[slot] = res; });
+    done += got;
+    if (got == 0 && ring_.submit(n - done) >= 0) ++stats_.syscalls_last_tick;
+  }
+  for (const Inflight& f : inflight_) {
+    ProcessEntry& e = *f.entry;
+    const char* buf = ring_buf_.get() + f.slot * sizeof buf_;
+    ProcessStats fresh;
+    if (!merge_stat(e, buf, results_[f.slot], fresh)) {
+      e.failed = true;
+      continue;
+    }
+    if (f.status) {
+      if (results_[f.slot + 1] > 0) parse_pid_status(buf + sizeof buf_, buf + sizeof buf_ + results_[f.slot + 1], fresh);
+      e.status_stale = false;
+    }
+    e.stats = fresh;
+  }
+  inflight_.clear();
+}
+
+void ProcessCollector::collect_taskstats() {
+  const std::size_t count = table_.size();
+  int32_t* tgids = scratch_.allocate_array<int32_t>(count);
+  TaskstatsRecord* records = scratch_.allocate_array<TaskstatsRecord>(count);
+  std::size_t k = 0;
+  table_.for_each([&](int32_t pid, ProcessEntry&) { tgids[k++] = pid; });
+  uint64_t before = taskstats_.syscalls();
+  int n = taskstats_.query(tgids, count, records);
+  stats_.syscalls_last_tick += taskstats_.syscalls() - before;
+  if (n < 0) {
+    // Lost the capability or the socket: procfs keeps the numbers flowing
+    // from the next tick on.
+    taskstats_.close();
+    table_.for_each([](int32_t, ProcessEntry& e) { e.status_stale = true; });
+    return;
+  }
+  for (int i = 0; i < n; ++i) {
+    const TaskstatsRecord& r = records[i];
+    ProcessEntry* e = table_.find(r.tgid);
+    if (!e) continue;
+    e->stats.cpu_ns = r.cpu_ns;
+    e->stats.cpu_delay_ns = r.cpu_delay_ns;
+    e->stats.blkio_delay_ns = r.blkio_delay_ns;
+    e->stats.swapin_delay_ns = r.swapin_delay_ns;
+    e->stats.voluntary_ctxt = r.voluntary_ctxt;
+    e->stats.nonvoluntary_ctxt = r.nonvoluntary_ctxt;
+  }
+}
+
+void ProcessCollector::drain_events() {
+  for (;;) {
+    int n = conn_.read_events(events_.data(), events_.size());
+    ++stats_.syscalls_last_tick;
+    if (n < 0) {
+      // Lost events (-ENOBUFS) or a broken socket: a rescan is the only way
+      // back to a consistent table.
+      ++stats_.event_overflows;
+      need_rescan_ = true;
+      if (n != -ENOBUFS) conn_.close();
+      return;
+    }
+    stats_.events += static_cast<uint64_t>(n);
+    for (int i = 0; i < n; ++i) {
+      const ProcEvent& ev = events_[static_cast<std::size_t>(i)];
+      switch (ev.kind) {
+        case ProcEvent::kFork:
+          if (ev.pid != ev.tgid) break;  // new thread, not a new process
+          // A fork for a PID we still hold means the old task is gone and
+          // the PID was recycled: start over with fresh descriptors.
+          if (ProcessEntry* e = table_.find(ev.pid); e && !e->pending) drop(ev.pid);
+          track(ev.pid);
+          break;
+        case ProcEvent::kExec:
+          track(ev.tgid);
+          if (ProcessEntry* e = table_.find(ev.tgid)) e->status_stale = true;
+          break;
+        case ProcEvent::kExit:
+          // Only a thread-group leader's exit can end the process; whether
+          // the group is really gone is settled by the next stat read.
+          break;
+      }
+    }
+    if (static_cast<std::size_t>(n) < events_.size()) return;
+  }
+}
+
+int ProcessCollector::rescan() {
+  // Raw getdents64 into tick scratch: opendir() would malloc a DIR on
+  // every fallback rescan.
+  int dir = ::open(opts_.proc_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir < 0) return -errno;
+  ++stats_.rescans;
+  ++scan_gen_;
+  ticks_since_scan_ = 0;
+  constexpr std::size_t kDentBuf = 32u << 10;
+  char* buf = static_cast<char*>(scratch_.allocate(kDentBuf, alignof(dirent64)));
+  for (;;) {
+    long n = ::syscall(SYS_getdents64, dir, buf, kDentBuf);
+    ++stats_.syscalls_last_tick;
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      // A partial listing is not authoritative; keep the table as it is.
+      int err = errno;
+      ::close(dir);
+      return -err;
+    }
+    if (n == 0) break;
+    for (long off = 0; off < n;) {
+      const auto* de = reinterpret_cast<const dirent64*>(buf + off);
+      off += de->d_reclen;
+      uint64_t pid;
+      if (!parse_u64(de->d_name, pid) || pid == 0 || pid > INT32_MAX) continue;
+      track(static_cast<int32_t>(pid));
+      table_.find(static_cast<int32_t>(pid))->seen_scan = scan_gen_;
+    }
+  }
+  ::close(dir);
+  // A listing taken after every drained event is authoritative: anything
+  // it did not show has exited.
+  table_.retain([this](int32_t, ProcessEntry& e) {
+    if (e.seen_scan == scan_gen_) return true;
+    close_entry(e);
+    ++stats_.removed;
+    return false;
+  });
+  return 0;
+}
+
+void ProcessCollector::track(int32_t pid) {
+  bool inserted = false;
+  ProcessEntry& e = table_.insert(pid, &inserted);
+  if (inserted) {
+    e.seen_scan = scan_gen_;
+    ++stats_.added;
+  }
+}
+
+void ProcessCollector::drop(int32_t pid) {
+  if (ProcessEntry* e = table_.find(pid)) {
+    close_entry(*e);
+    table_.erase(pid);
+    ++stats_.removed;
+  }
+}
+
+bool ProcessCollector::open_entry(int32_t pid, ProcessEntry& e) {
+  char path[256];
+  std::snprintf(path, sizeof path, "%s/%d/stat", opts_.proc_root.c_str(), pid);
+  e.stat_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  ++stats_.syscalls_last_tick;
+  // Out of descriptors: keep the entry but read it uncached (fd -1).
+  if (e.stat_fd < 0 && errno != EMFILE && errno != ENFILE) return false;
+  if (opts_.read_status && e.stat_fd >= 0) {
+    std::snprintf(path, sizeof path, "%s/%d/status", opts_.proc_root.c_str(), pid);
+    e.status_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    ++stats_.syscalls_last_tick;
+  }
+  e.pending = false;
+  return true;
+}
+
+bool ProcessCollector::refresh(int32_t pid, ProcessEntry& e) {
+  auto read_file = [&](int fd, const char* leaf) -> ssize_t {
+    if (fd >= 0) {
+      ++stats_.syscalls_last_tick;
+      return ::pread(fd, buf_, sizeof buf_ - 1, 0);
+    }
+    char path[256];
+    std::snprintf(path, sizeof path, "%s/%d/%s", opts_.proc_root.c_str(), pid, leaf);
+    int tmp = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (tmp < 0) return -1;
+    ssize_t n = ::pread(tmp, buf_, sizeof buf_ - 1, 0);
+    ::close(tmp);
+    stats_.syscalls_last_tick += 3;
+    return n;
+  };
+
+  ProcessStats fresh;
+  if (!merge_stat(e, buf_, read_file(e.stat_fd, "stat"), fresh)) return false;
+  if (wants_status(e)) {
+    ssize_t n = read_file(e.status_fd, "status");
+    if (n > 0) parse_pid_status(buf_, buf_ + n, fresh);
+    e.status_stale = false;
+  }
+  e.stats = fresh;
+  return true;
+}
+
+bool ProcessCollector::merge_stat(ProcessEntry& e, const char* buf, long n, ProcessStats& fresh) {
+  if (n <= 0) return false;  // ESRCH: the task behind the fd has exited
+  if (!parse_pid_stat(buf, buf + n, fresh)) return false;
+  if (fresh.state == 'X' || (fresh.state == 'Z' && fresh.num_threads <= 1)) return false;
+  // An uncached entry can silently switch to a recycled PID; a different
+  // starttime means a different process.
+  if (e.starttime != 0 && fresh.starttime != e.starttime) {
+    ++stats_.recycled;
+    e.stats = {};
+    e.status_stale = true;
+  }
+  e.starttime = fresh.starttime;
+
+  // Fields that only change with the process image carry over between
+  // status reads; taskstats overwrites its own fields after this pass.
+  fresh.uid = e.stats.uid;
+  fresh.vm_swap_kb = e.stats.vm_swap_kb;
+  fresh.voluntary_ctxt = e.stats.voluntary_ctxt;
+  fresh.nonvoluntary_ctxt = e.stats.nonvoluntary_ctxt;
+  fresh.cpu_ns = e.stats.cpu_ns;
+  fresh.cpu_delay_ns = e.stats.cpu_delay_ns;
+  fresh.blkio_delay_ns = e.stats.blkio_delay_ns;
+  fresh.swapin_delay_ns = e.stats.swapin_delay_ns;
+  return true;
+}
+
+// Batched reads decide this before the stat read is parsed, so a recycle
+// detected in the same tick picks up its status one tick later.
+bool ProcessCollector::wants_status(const ProcessEntry& e) const {
+  const bool want = !taskstats_.is_open() || e.status_stale;
+  return opts_.read_status && want && (e.status_fd >= 0 || e.stat_fd < 0);
+}
+
+void ProcessCollector::close_entry(ProcessEntry& e) {
+  if (e.stat_fd >= 0) ::close(e.stat_fd);
+  if (e.status_fd >= 0) ::close(e.status_fd);
+  if (e.stat_fd >= 0 || e.status_fd >= 0) ++stats_.syscalls_last_tick;
+  e.stat_fd = e.status_fd = -1;
+  e.pending = true;
+}
+
+}  // namespace sysapm
@@ -0,0 +1,577 @@
+#include "sysapm/query.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "sysapm/clock.hpp"
+
+namespace sysapm {
+
+namespace {
+
+constexpr std::size_t kLanes = 4;
+constexpr std::size_t kGrain = 16;  // series per parallel_for chunk
+constexpr std::size_t kMaxQuery = 4096;
+constexpr int64_t kClientNs = 1000000000;  // for a client to send its line, and again to take the reply
+
+// Waits for `events` on the non-blocking `fd` until `deadline_ns`.
+bool wait_until(int fd, short events, int64_t deadline_ns) {
+  for (;;) {
+    const int64_t left = deadline_ns - mono_ns();
+    if (left <= 0) return false;
+    pollfd pfd{fd, events, 0};
+    const int rc = ::poll(&pfd, 1, static_cast<int>((left + 999999) / 1000000));
+    if (rc > 0) return true;
+    if (rc < 0 && errno != EINTR) return false;
+  }
+}
+
+struct Lanes {
+  double sum = 0;
+  double lo = std::numeric_limits<double>::infinity();
+  double hi = -std::numeric_limits<double>::infinity();
+};
+
+// Independent accumulators per lane keep the loop free of a serial
+// dependency, so it vectorizes without -ffast-math reassociation.
+#if defined(__x86_64__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+void reduce(const double* x, std::size_t n, Lanes* out) {
+  double sum[kLanes] = {}, lo[kLanes], hi[kLanes];
+  for (std::size_t l = 0; l < kLanes; ++l) {
+    lo[l] = out->lo;
+    hi[l] = out->hi;
+  }
+  std::size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes)
+    for (std::size_t l = 0; l < kLanes; ++l) {
+      const double v = x[i + l];
+      sum[l] += v;
+      lo[l] = v < lo[l] ? v : lo[l];
+      hi[l] = v > hi[l] ? v : hi[l];
+    }
+  for (; i < n; ++i) {
+    sum[0] += x[i];
+    lo[0] = x[i] < lo[0] ? x[i] : lo[0];
+    hi[0] = x[i] > hi[0] ? x[i] : hi[0];
+  }
+  for (std::size_t l = 0; l < kLanes; ++l) {
+    out->sum += sum[l];
+    out->lo = std::min(out->lo, lo[l]);
+    out->hi = std::max(out->hi, hi[l]);
+  }
+}
+
+// One series' contribution, built by one scan task.
+struct Partial {
+  uint64_t samples = 0;
+  uint64_t points = 0;  // values reduced: samples, or rates for counters
+  Lanes acc;
+  double last = 0;      // newest point
+  int64_t first_t = 0;  // ms, of the first and last raw sample
+  int64_t last_t = 0;
+  double increase = 0;  // counters: summed deltas; gauges: last - first value
+  double first_v = 0;
+  uint64_t prev = 0;    // counters: previous raw value
+  std::vector<double> values;  // quantiles only
+  uint64_t blocks = 0;
+  ScanStats chunks;
+
+  double rate() const { return last_t > first_t ? increase * 1000.0 / static_cast<double>(last_t - first_t) : 0; }
+};
+
+void consume(const SampleBlock& b, bool keep_values, Partial* p) {
+  double x[kDecodeBlock];
+  std::size_t m = 0;
+  std::size_t i = 0;
+  if (p->samples == 0) {
+    p->first_t = b.t_ms[0];
+    if (b.kind == SampleKind::kCounter) {
+      p->prev = b.v[0];
+      i = 1;  // a rate needs a predecessor
+    } else {
+      p->first_v = std::bit_cast<double>(b.v[0]);
+    }
+  }
+  if (b.kind == SampleKind::kCounter) {
+    int64_t prev_t = i ? b.t_ms[0] : p->last_t;
+    uint64_t prev = p->prev;
+    for (; i < b.n; ++i) {
+      const uint64_t d = b.v[i] >= prev ? b.v[i] - prev : b.v[i];
+      const int64_t dt = b.t_ms[i] - prev_t;
+      p->increase += static_cast<double>(d);
+      if (dt > 0) x[m++] = static_cast<double>(d) * 1000.0 / static_cast<double>(dt);
+      prev = b.v[i];
+      prev_t = b.t_ms[i];
+    }
+    p->prev = prev;
+  } else {
+    for (; i < b.n; ++i) {
+      const double v = std::bit_cast<double>(b.v[i]);
+      if (!std::isnan(v)) x[m++] = v;
+    }
+    const double last = std::bit_cast<double>(b.v[b.n - 1]);
+    if (!std::isnan(last) && !std::isnan(p->first_v)) p->increase = last - p->first_v;
+  }
+  p->samples += b.n;
+  p->last_t = b.t_ms[b.n - 1];
+  ++p->blocks;
+  if (m == 0) return;
+  reduce(x, m, &p->acc);
+  p->points += m;
+  p->last = x[m - 1];
+  if (keep_values) p->values.insert(p->values.end(), x, x + m);
+}
+
+bool matches(const SeriesRegistry& reg, uint32_t id, const std::vector<LabelMatcher>& ms) {
+  const std::size_t n = reg.label_count(id);
+  for (const LabelMatcher& m : ms) {
+    std::string_view v;
+    for (std::size_t i = 0; i < n; ++i) {
+      const Label l = reg.label(id, i);
+      if (l.name == m.name) {
+        v = l.value;
+        break;
+      }
+    }
+    switch (m.op) {
+      case MatchOp::kEqual:
+        if (v != m.value) return false;
+        break;
+      case MatchOp::kNotEqual:
+        if (v == m.value) return false;
+        break;
+      case MatchOp::kPrefix:
+        if (!v.starts_with(m.value)) return false;
+        break;
+    }
+  }
+  return true;
+}
+
+void append_quoted(std::string* out, std::string_view v) {
+  out->push_back('"');
+  for (char c : v) {
+    if (c == '"' || c == '\\') out->push_back('\\');
+    if (c == '\n') {
+      out->append("\\n");
+      continue;
+    }
+    out->push_back(c);
+  }
+  out->push_back('"');
+}
+
+std::string group_key(const SeriesRegistry& reg, uint32_t id, const std::vector<std::string>& by) {
+  std::string key = "{";
+  const std::size_t n = reg.label_count(id);
+  for (const std::string& name : by) {
+    std::string_view v;
+    for (std::size_t i = 0; i < n; ++i)
+      if (reg.label(id, i).name == name) v = reg.label(id, i).value;
+    if (key.size() > 1) key.push_back(',');
+    key.append(name);
+    key.push_back('=');
+    append_quoted(&key, v);
+  }
+  key.push_back('}');
+  return key;
+}
+
+struct Group {
+  QueryRow row;
+  Lanes acc;
+  uint64_t points = 0;
+  double rate = 0;
+  double last = 0;
+  int64_t last_t = std::numeric_limits<int64_t>::min();
+  std::vector<double> values;
+};
+
+void fold(Group* g, Partial& p) {
+  g->row.samples += p.samples;
+  ++g->row.series;
+  if (p.points == 0) return;
+  g->acc.sum += p.acc.sum;
+  g->acc.lo = std::min(g->acc.lo, p.acc.lo);
+  g->acc.hi = std::max(g->acc.hi, p.acc.hi);
+  g->points += p.points;
+  g->rate += p.rate();
+  if (p.last_t >= g->last_t) {
+    g->last_t = p.last_t;
+    g->last = p.last;
+  }
+  if (g->values.empty())
+    g->values = std::move(p.values);
+  else
+    g->values.insert(g->values.end(), p.values.begin(), p.values.end());
+}
+
+bool finish(const Query& q, Group* g) {
+  if (g->points == 0) return false;
+  switch (q.agg) {
+    case QueryAgg::kAvg:
+      g->row.value = g->acc.sum / static_cast<double>(g->points);
+      break;
+    case QueryAgg::kMin:
+      g->row.value = g->acc.lo;
+      break;
+    case QueryAgg::kMax:
+      g->row.value = g->acc.hi;
+      break;
+    case QueryAgg::kSum:
+      g->row.value = g->acc.sum;
+      break;
+    case QueryAgg::kCount:
+      g->row.value = static_cast<double>(g->points);
+      break;
+    case QueryAgg::kLast:
+      g->row.value = g->last;
+      break;
+    case QueryAgg::kRate:
+      g->row.value = g->rate;
+      break;
+    case QueryAgg::kQuantile: {
+      const std::size_t n = g->values.size();
+      const double rank = std::ceil(q.quantile * static_cast<double>(n));
+      const std::size_t k = rank < 1 ? 0 : std::min(n - 1, static_cast<std::size_t>(rank) - 1);
+      std::nth_element(g->values.begin(), g->values.begin() + static_cast<std::ptrdiff_t>(k), g->values.end());
+      g->row.value = g->values[k];
+      break;
+    }
+  }
+  return true;
+}
+
+// --- parser ---
+
+struct Cursor {
+  std::string_view s;
+  std::size_t i = 0;
+
+  void skip() {
+    while (i < s.size() && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r')) ++i;
+  }
+  bool eat(char c) {
+    skip();
+    if (i < s.size() && s[i] == c) {
+      ++i;
+      return true;
+    }
+    return false;
+  }
+  bool eat(std::string_view w) {
+    skip();
+    if (s.substr(i).starts_with(w)) {
+      i += w.size();
+      return true;
+    }
+    return false;
+  }
+  std::string_view ident() {
+    skip();
+    const std::size_t b = i;
+    while (i < s.size() && (std::isalnum(static_cast<unsigned char>(s[i])) || s[i] == '_' || s[i] == ':')) ++i;
+    return s.substr(b, i - b);
+  }
+  bool quoted(std::string* out) {
+    if (!eat('"')) return false;
+    out->clear();
+    while (i < s.size() && s[i] != '"') {
+      if (s[i] == '\\' && i + 1 < s.size()) {
+        ++i;
+        out->push_back(s[i] == 'n' ? '\n' : s[i]);
+      } else {
+        out->push_back(s[i]);
+      }
+      ++i;
+    }
+    return eat('"');
+  }
+  bool done() {
+    skip();
+    return i == s.size();
+  }
+};
+
+bool parse_agg(std::string_view w, Query* q) {
+  static constexpr struct {
+    const char* name;
+    QueryAgg agg;
+  } kAggs[] = {{"avg", QueryAgg::kAvg},     {"min", QueryAgg::kMin},   {"max", QueryAgg::kMax},
+               {"sum", QueryAgg::kSum},     {"count", QueryAgg::kCount}, {"last", QueryAgg::kLast},
+               {"rate", QueryAgg::kRate}};
+  for (const auto& a : kAggs)
+    if (w == a.name) {
+      q->agg = a.agg;
+      return true;
+    }
+  // pNN: the digits are the fraction, except p100.
+  if (w.size() < 2 || w[0] != 'p') return false;
+  const std::string_view d = w.substr(1);
+  if (!std::all_of(d.begin(), d.end(), [](char c) { return c >= '0' && c <= '9'; })) return false;
+  q->agg = QueryAgg::kQuantile;
+  q->quantile = d == "100" ? 1.0 : std::strtod(("0." + std::string(d)).c_str(), nullptr);
+  return true;
+}
+
+bool parse_duration(Cursor& c, int64_t* ns) {
+  c.skip();
+  const std::size_t b = c.i;
+  while (c.i < c.s.size() && c.s[c.i] >= '0' && c.s[c.i] <= '9') ++c.i;
+  if (c.i == b || c.i == c.s.size()) return false;
+  const int64_t n = std::strtoll(std::string(c.s.substr(b, c.i - b)).c_str(), nullptr, 10);
+  int64_t unit;
+  switch (c.s[c.i++]) {
+    case 's':
+      unit = 1000000000ll;
+      break;
+    case 'm':
+      unit = 60 * 1000000000ll;
+      break;
+    case 'h':
+      unit = 3600 * 1000000000ll;
+      break;
+    case 'd':
+      unit = 86400 * 1000000000ll;
+      break;
+    default:
+      return false;
+  }
+  if (n <= 0 || n > std::numeric_limits<int64_t>::max() / unit) return false;
+  *ns = n * unit;
+  return true;
+}
+
+}  // namespace
+
+int parse_query(std::string_view text, int64_t now_ns, Query* out) {
+  Query q;
+  Cursor c{text};
+  if (!parse_agg(c.ident(), &q) || !c.eat('(')) return -EINVAL;
+  q.metric = std::string(c.ident());
+  if (q.metric.empty()) return -EINVAL;
+  if (c.eat('{') && !c.eat('}')) {
+    do {
+      LabelMatcher m;
+      m.name = std::string(c.ident());
+      if (m.name.empty()) return -EINVAL;
+      if (c.eat("!="))
+        m.op = MatchOp::kNotEqual;
+      else if (c.eat("=~"))
+        m.op = MatchOp::kPrefix;
+      else if (c.eat('='))
+        m.op = MatchOp::kEqual;
+      else
+        return -EINVAL;
+      if (!c.quoted(&m.value)) return -EINVAL;
+      if (m.op == MatchOp::kPrefix) {
+        if (!m.value.ends_with(".*")) return -EINVAL;
+        m.value.resize(m.value.size() - 2);
+        if (m.value.find_first_of(".*+?()[]{}|^$\\") != std::string::npos) return -EINVAL;
+      }
+      q.matchers.push_back(std::move(m));
+    } while (c.eat(','));
+    if (!c.eat('}')) return -EINVAL;
+  }
+  int64_t range;
+  if (!c.eat('[') || !parse_duration(c, &range) || !c.eat(']') || !c.eat(')')) return -EINVAL;
+  q.to_ns = now_ns;
+  q.from_ns = now_ns - range;
+  if (c.eat("by")) {
+    q.grouped = true;
+    if (!c.eat('(')) return -EINVAL;
+    if (!c.eat(')')) {
+      do {
+        std::string_view name = c.ident();
+        if (name.empty()) return -EINVAL;
+        q.by.emplace_back(name);
+      } while (c.eat(','));
+      if (!c.eat(')')) return -EINVAL;
+    }
+  }
+  if (!c.done()) return -EINVAL;
+  *out = std::move(q);
+  return 0;
+}
+
+std::vector<uint32_t> QueryEngine::select(const Query& q) {
+  std::vector<uint32_t> ids;
+  std::lock_guard<std::mutex> lk(mu_);
+  for (const std::size_t n = registry_.size(); indexed_ < n;) {
+    const uint32_t id = static_cast<uint32_t>(++indexed_);
+    by_metric_[registry_.metric(id)].push_back(id);
+  }
+  auto it = by_metric_.find(q.metric);
+  if (it == by_metric_.end()) return ids;
+  for (uint32_t id : it->second)
+    if (matches(registry_, id, q.matchers)) ids.push_back(id);
+  return ids;
+}
+
+int QueryEngine::run(const Query& q, std::vector<QueryRow>* rows, QueryStats* stats) {
+  if (q.metric.empty() || q.to_ns < q.from_ns) return -EINVAL;
+  rows->clear();
+  const std::vector<uint32_t> ids = select(q);
+  std::vector<Partial> parts(ids.size());
+  const bool keep = q.agg == QueryAgg::kQuantile;
+  auto scan = [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      Partial& p = parts[i];
+      store_.scan_blocks(ids[i], q.from_ns, q.to_ns, [&](const SampleBlock& blk) { consume(blk, keep, &p); },
+                         &p.chunks);
+    }
+  };
+  if (pool_)
+    pool_->parallel_for(ids.size(), kGrain, scan);
+  else
+    scan(0, ids.size());
+
+  std::vector<Group> groups;
+  std::unordered_map<std::string, std::size_t> by_key;
+  char name[512];
+  for (std::size_t i = 0; i < ids.size(); ++i) {
+    Partial& p = parts[i];
+    if (stats) {
+      stats->samples += p.samples;
+      stats->blocks += p.blocks;
+      stats->chunks.chunks += p.chunks.chunks;
+      stats->chunks.skipped += p.chunks.skipped;
+    }
+    if (p.samples == 0) continue;
+    std::string key;
+    if (q.grouped)
+      key = group_key(registry_, ids[i], q.by);
+    else
+      key = registry_.format(ids[i], name, sizeof name) ? name : "series_" + std::to_string(ids[i]);
+    auto [it, fresh] = by_key.emplace(std::move(key), groups.size());
+    if (fresh) {
+      groups.emplace_back();
+      groups.back().row.group = it->first;
+    }
+    fold(&groups[it->second], p);
+  }
+  if (stats) stats->series += ids.size();
+  for (Group& g : groups)
+    if (finish(q, &g)) rows->push_back(std::move(g.row));
+  std::sort(rows->begin(), rows->end(), [](const QueryRow& a, const QueryRow& b) {
+    return a.value != b.value ? a.value > b.value : a.group < b.group;
+  });
+  return 0;
+}
+
+std::string format_rows(const std::vector<QueryRow>& rows) {
+  std::string out;
+  char buf[64];
+  for (const QueryRow& r : rows) {
+    out.append(r.group);
+    std::snprintf(buf, sizeof buf, " %.6g\n", r.value);
+    out.append(buf);
+  }
+  return out;
+}
+
+QueryServer::~QueryServer() { close(); }
+
+int QueryServer::open(const std::string& path) {
+  close();
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path) return -ENAMETOOLONG;
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -errno;
+  ::unlink(path.c_str());
+  if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof addr) < 0 || ::listen(fd, 8) < 0) {
+    int err = errno;
+    ::close(fd);
+    return -err;
+  }
+  fd_ = fd;
+  path_ = path;
+  return 0;
+}
+
+void QueryServer::close() {
+  if (fd_ < 0) return;
+  ::close(fd_);
+  ::unlink(path_.c_str());
+  fd_ = -1;
+}
+
+std::size_t QueryServer::serve(QueryEngine& engine, int64_t now_ns) {
+  std::size_t served = 0;
+  for (;;) {
+    int c = ::accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (c < 0) break;
+    // The client has a second for its whole line, however it trickles in,
+    // and another for the reply; the agent never blocks on it longer.
+    int64_t deadline = mono_ns() + kClientNs;
+    std::string text;
+    char buf[512];
+    while (text.find('\n') == std::string::npos && text.size() < kMaxQuery) {
+      ssize_t n = ::recv(c, buf, sizeof buf, 0);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR) && wait_until(c, POLLIN, deadline)) continue;
+      if (n <= 0) break;
+      text.append(buf, static_cast<std::size_t>(n));
+    }
+    if (std::size_t nl = text.find('\n'); nl != std::string::npos) text.resize(nl);
+    std::string reply;
+    Query q;
+    std::vector<QueryRow> rows;
+    if (parse_query(text, now_ns, &q) < 0)
+      reply = "error: cannot parse query\n";
+    else if (engine.run(q, &rows) < 0)
+      reply = "error: invalid query\n";
+    else
+      reply = format_rows(rows);
+    deadline = mono_ns() + kClientNs;
+    for (std::size_t off = 0; off < reply.size();) {
+      ssize_t w = ::send(c, reply.data() + off, reply.size() - off, MSG_NOSIGNAL);
+      if (w < 0 && (errno == EAGAIN || errno == EINTR) && wait_until(c, POLLOUT, deadline)) continue;
+      if (w <= 0) break;
+      off += static_cast<std::size_t>(w);
+    }
+    ::close(c);
+    ++served;
+  }
+  return served;
+}
+
+int query_socket(const std::string& path, std::string_view text, std::string* reply) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path) return -ENAMETOOLONG;
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -errno;
+  int rc = 0;
+  std::string line(text);
+  line.push_back('\n');
+  if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof addr) < 0 ||
+      ::send(fd, line.data(), line.size(), MSG_NOSIGNAL) < 0) {
+    rc = -errno;
+  } else {
+    reply->clear();
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::recv(fd, buf, sizeof buf, 0)) > 0) reply->append(buf, static_cast<std::size_t>(n));
+    if (n < 0) rc = -errno;
+  }
+  ::close(fd);
+  return rc;
+}
+
+}  // namespace sysapm
@@ -0,0 +1,302 @@
+#include "sysapm/rollup.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+
+namespace sysapm {
+namespace {
+
+constexpr int64_t kNever = std::numeric_limits<int64_t>::max();
+
+int64_t bucket_of(int64_t ts, int64_t width) { return ts >= 0 ? ts / width : -((-ts + width - 1) / width); }
+
+double value_of(const Sample& s) {
+  return s.kind == SampleKind::kCounter ? static_cast<double>(s.counter) : s.gauge;
+}
+
+// Fixed-size cell records for save()/load(); little-endian hosts only.
+struct SavedCell {
+  uint32_t series;
+  uint8_t open;
+  uint8_t have_prev;
+  uint16_t reserved;
+  int64_t bucket;
+  uint64_t count;
+  double min, max, sum;
+  uint64_t prev;
+  Sample last;
+};
+struct SavedHist {
+  uint32_t series;
+  uint32_t encoded;  // bytes of the HistogramSnapshot that follow, padded to 8
+  int64_t bucket;
+  uint64_t count;
+  Sample last;
+};
+struct SavedWindow {
+  int64_t width;
+  uint32_t cells;
+  uint32_t hists;
+};
+
+template <typename T>
+void put(std::vector<uint8_t>* out, const T& v) {
+  const std::size_t at = out->size();
+  out->resize(at + sizeof v);
+  std::memcpy(out->data() + at, &v, sizeof v);
+}
+
+template <typename T>
+bool get(const uint8_t*& p, const uint8_t* end, T* v) {
+  if (static_cast<std::size_t>(end - p) < sizeof *v) return false;
+  std::memcpy(v, p, sizeof *v);
+  p += sizeof *v;
+  return true;
+}
+
+}  // namespace
+
+RollupStage::RollupStage(const RollupOptions& opts, Sink sink) : opts_(opts), sink_(std::move(sink)) {
+  for (int64_t w : opts_.windows_ns) {
+    if (w <= 0) continue;
+    windows_.push_back(Window{w, {}, {}, kNever});
+  }
+}
+
+RollupStage::~RollupStage() = default;
+
+void RollupStage::append(const Sample* s, std::size_t n) {
+  for (std::size_t i = 0; i < n; ++i) {
+    ++stats_.samples;
+    for (std::size_t wi = 0; wi < windows_.size(); ++wi) add(windows_[wi], static_cast<uint8_t>(wi), s[i]);
+  }
+  deliver();
+}
+
+void RollupStage::add(Window& w, uint8_t wi, const Sample& s) {
+  if (s.series >= w.cells.size()) w.cells.resize(std::max<std::size_t>(s.series + 1, w.cells.size() * 2));
+  Cell& c = w.cells[s.series];
+  if (s.stale()) {
+    // The series ended: close its window now and pass the marker on.
+    if (c.open) emit(w, wi, c);
+    c.have_prev = false;
+    c.bucket = -1;  // a new incarnation may reopen the same window
+    const double nan = s.gauge;  // the stale NaN bits, whatever the kind
+    pending_.push_back(RollupPoint{s, wi, bucket_of(s.ts_ns, w.width) * w.width, 0, nan, nan, nan, nullptr});
+    return;
+  }
+  const int64_t bucket = bucket_of(s.ts_ns, w.width);
+  if (bucket < c.bucket || (!c.open && bucket == c.bucket)) {
+    if (wi == 0) ++stats_.late;  // once per sample, not per window
+    return;
+  }
+  if (c.open && bucket > c.bucket) emit(w, wi, c);
+  const double v = value_of(s);
+  if (!c.open) {
+    c.bucket = bucket;
+    c.open = true;
+    c.count = 0;
+    c.min = c.max = v;
+    c.sum = 0;
+    w.next_close = std::min(w.next_close, (bucket + 1) * w.width);
+  }
+  if (s.kind == SampleKind::kCounter) {
+    if (c.have_prev) c.sum += static_cast<double>(s.counter >= c.prev ? s.counter - c.prev : s.counter);
+    c.prev = s.counter;
+    c.have_prev = true;
+  } else {
+    c.sum += v;
+  }
+  c.min = std::min(c.min, v);
+  c.max = std::max(c.max, v);
+  ++c.count;
+  c.last = s;
+}
+
+void RollupStage::append_histogram(uint32_t series, int64_t ts_ns, const HistogramSnapshot& h) {
+  ++stats_.histograms;
+  for (std::size_t i = 0; i < windows_.size(); ++i) {
+    Window& w = windows_[i];
+    const auto wi = static_cast<uint8_t>(i);
+    HistCell& c = w.hists[series];
+    const int64_t bucket = bucket_of(ts_ns, w.width);
+    if (bucket < c.bucket || (!c.open && bucket == c.bucket)) {
+      if (wi == 0) ++stats_.late;
+      continue;
+    }
+    if (c.open && bucket > c.bucket) emit(w, wi, c);
+    if (!c.open) {
+      c.bucket = bucket;
+      c.open = true;
+      c.count = 0;
+      c.merged = HistogramSnapshot(h.layout());
+      w.next_close = std::min(w.next_close, (bucket + 1) * w.width);
+    }
+    if (c.merged.merge(h) < 0) {
+      if (wi == 0) ++stats_.late;  // layout changed mid-window: not mergeable
+      continue;
+    }
+    ++c.count;
+    c.last = Sample::make_counter(ts_ns, series, c.merged.count());
+  }
+  deliver();
+}
+
+void RollupStage::emit(Window& w, uint8_t wi, Cell& c) {
+  pending_.push_back(RollupPoint{c.last, wi, c.bucket * w.width, c.count, c.min, c.max, c.sum, nullptr});
+  c.open = false;
+  ++stats_.points;
+}
+
+void RollupStage::emit(Window& w, uint8_t wi, HistCell& c) {
+  // The cell is reused by the next window before the sink runs, so the
+  // point gets its own copy.
+  if (pending_hist_used_ == pending_hists_.size()) pending_hists_.push_back(std::make_unique<HistogramSnapshot>());
+  HistogramSnapshot& h = *pending_hists_[pending_hist_used_++];
+  h = c.merged;
+  // min/max bracket the observations: the lowest bucket's lower bound and
+  // the highest one's upper bound.
+  const auto& counts = h.counts();
+  std::size_t lo = 0, hi = counts.size();
+  while (lo < counts.size() && counts[lo] == 0) ++lo;
+  while (hi > lo && counts[hi - 1] == 0) --hi;
+  const double mn = lo < hi ? static_cast<double>(h.layout().lower(lo)) : 0;
+  const double mx = lo < hi ? static_cast<double>(h.layout().upper(hi - 1)) : 0;
+  pending_.push_back(RollupPoint{c.last, wi, c.bucket * w.width, c.count, mn, mx,
+                                 h.mean() * static_cast<double>(h.count()), &h});
+  c.open = false;
+  ++stats_.points;
+}
+
+void RollupStage::advance(int64_t now_ns) {
+  const int64_t horizon = now_ns - opts_.grace_ns;
+  for (std::size_t i = 0; i < windows_.size(); ++i) {
+    Window& w = windows_[i];
+    if (horizon < w.next_close) continue;
+    const auto wi = static_cast<uint8_t>(i);
+    int64_t next = kNever;
+    for (Cell& c : w.cells) {
+      if (!c.open) continue;
+      const int64_t end = (c.bucket + 1) * w.width;
+      if (end <= horizon)
+        emit(w, wi, c);
+      else
+        next = std::min(next, end);
+    }
+    for (auto& [series, c] : w.hists) {
+      if (!c.open) continue;
+      const int64_t end = (c.bucket + 1) * w.width;
+      if (end <= horizon)
+        emit(w, wi, c);
+      else
+        next = std::min(next, end);
+    }
+    w.next_close = next;
+  }
+  deliver();
+}
+
+void RollupStage::flush() {
+  for (std::size_t i = 0; i < windows_.size(); ++i) {
+    Window& w = windows_[i];
+    const auto wi = static_cast<uint8_t>(i);
+    for (Cell& c : w.cells)
+      if (c.open) emit(w, wi, c);
+    for (auto& [series, c] : w.hists)
+      if (c.open) emit(w, wi, c);
+    w.next_close = kNever;
+  }
+  deliver();
+}
+
+std::size_t RollupStage::open_windows() const {
+  std::size_t n = 0;
+  for (const Window& w : windows_) {
+    for (const Cell& c : w.cells) n += c.open;
+    for (const auto& [series, c] : w.hists) n += c.open;
+  }
+  return n;
+}
+
+void RollupStage::save(std::vector<uint8_t>* out) const {
+  put(out, static_cast<uint64_t>(windows_.size()));
+  std::vector<uint8_t> enc;
+  for (const Window& w : windows_) {
+    // Closed cells matter too: a counter's last value is the base of the
+    // next window's increase.
+    SavedWindow sw{w.width, 0, 0};
+    for (const Cell& c : w.cells) sw.cells += c.open || c.have_prev;
+    for (const auto& [series, c] : w.hists) sw.hists += c.open;
+    put(out, sw);
+    for (std::size_t id = 0; id < w.cells.size(); ++id) {
+      const Cell& c = w.cells[id];
+      if (!c.open && !c.have_prev) continue;
+      put(out, SavedCell{static_cast<uint32_t>(id), c.open, c.have_prev, 0, c.bucket, c.count, c.min, c.max, c.sum,
+                         c.prev, c.last});
+    }
+    for (const auto& [series, c] : w.hists) {
+      if (!c.open) continue;
+      enc.clear();
+      c.merged.encode(&enc);
+      enc.resize((enc.size() + 7) & ~std::size_t{7});
+      put(out, SavedHist{series, static_cast<uint32_t>(enc.size()), c.bucket, c.count, c.last});
+      out->insert(out->end(), enc.begin(), enc.end());
+    }
+  }
+}
+
+int RollupStage::load(const uint8_t* data, std::size_t len) {
+  const uint8_t* p = data;
+  const uint8_t* end = data + len;
+  uint64_t n;
+  if (!get(p, end, &n)) return -EINVAL;
+  for (uint64_t i = 0; i < n; ++i) {
+    SavedWindow sw;
+    if (!get(p, end, &sw)) return -EINVAL;
+    Window* w = nullptr;
+    for (Window& cand : windows_)
+      if (cand.width == sw.width) w = &cand;
+    for (uint32_t k = 0; k < sw.cells; ++k) {
+      SavedCell sc;
+      if (!get(p, end, &sc) || sc.series >= (1u << 24)) return -EINVAL;
+      if (!w) continue;
+      if (sc.series >= w->cells.size()) w->cells.resize(std::max<std::size_t>(sc.series + 1, w->cells.size() * 2));
+      Cell& c = w->cells[sc.series];
+      c.bucket = sc.bucket;
+      c.open = sc.open;
+      c.count = sc.count;
+      c.min = sc.min;
+      c.max = sc.max;
+      c.sum = sc.sum;
+      c.last = sc.last;
+      c.have_prev = sc.have_prev;
+      c.prev = sc.prev;
+      if (c.open) w->next_close = std::min(w->next_close, (c.bucket + 1) * w->width);
+    }
+    for (uint32_t k = 0; k < sw.hists; ++k) {
+      SavedHist sh;
+      if (!get(p, end, &sh) || static_cast<std::size_t>(end - p) < sh.encoded) return -EINVAL;
+      const uint8_t* enc = p;
+      p += sh.encoded;
+      if (!w) continue;
+      HistCell& c = w->hists[sh.series];
+      if (c.merged.decode(enc, sh.encoded) < 0) return -EINVAL;
+      c.bucket = sh.bucket;
+      c.open = true;
+      c.count = sh.count;
+      c.last = sh.last;
+      w->next_close = std::min(w->next_close, (c.bucket + 1) * w->width);
+    }
+  }
+  return static_cast<int>(p - data);
+}
+
+void RollupStage::deliver() {
+  if (!pending_.empty() && sink_) sink_(pending_.data(), pending_.size());
+  pending_.clear();
+  pending_hist_used_ = 0;
+}
+
+}  // namespace sysapm
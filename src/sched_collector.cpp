@@ -0,0 +1,604 @@
+#include "sysapm/sched_collector.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sysapm/cgroup_collector.hpp"
+#include "sysapm/clock.hpp"
+
+namespace sysapm {
+namespace {
+
+constexpr uint32_t kStackDepth = 32;
+
+// Per-task record in the `tasks` map. Written whole by sched_switch when a
+// task goes off CPU and partially by the wakeup programs.
+struct TaskState {
+  uint64_t off_ns;   // blocked since; 0 when preempted or already counted
+  uint64_t wake_ns;  // runnable since; 0 when not waiting for a CPU
+  uint64_t cgroup;
+  int64_t stack;  // bpf_get_stackid() result, negative on failure
+};
+constexpr int16_t kOffNs = 0, kWakeNs = 8, kCgroup = 16, kStack = 24;
+
+// Stack frame layout shared by the programs (offsets from r10).
+constexpr int16_t kFpPid = -8;              // u32 key into `tasks`
+constexpr int16_t kFpTask = -40;            // TaskState being written
+constexpr int16_t kFpKey = -56;             // offcpu key {cgroup, stack}; hist key is its first word
+constexpr int16_t kFpZero = -64;            // u64 zero for new offcpu entries
+constexpr int16_t kFpHist = kFpZero - 8 * static_cast<int16_t>(SchedCollector::kBuckets + 1);  // zeroed hist value
+
+// Frames that every off-CPU stack shares, skipped before labelling.
+bool scheduler_frame(const char* f) {
+  static constexpr const char* kExact[] = {"schedule", "__schedule", "schedule_idle", "preempt_schedule",
+                                           "preempt_schedule_common", "trace_call_bpf"};
+  static constexpr const char* kPrefix[] = {"__traceiter_", "perf_trace_", "bpf_", "__bpf_", "perf_", "__perf_"};
+  for (const char* e : kExact)
+    if (std::strcmp(f, e) == 0) return true;
+  for (const char* p : kPrefix)
+    if (std::strncmp(f, p, std::strlen(p)) == 0) return true;
+  return false;
+}
+
+template <typename T>
+bool parse_number(std::string_view v, T* out) {
+  auto [end, ec] = std::from_chars(v.data(), v.data() + v.size(), *out);
+  return ec == std::errc() && end == v.data() + v.size();
+}
+
+// Integer constant expressions as the kernel prints them in a print fmt:
+// numbers, parentheses, +, -, << and |, with C precedence.
+class ConstExpr {
+ public:
+  explicit ConstExpr(std::string_view s) : s_(s) {}
+
+  bool eval(uint64_t* out) {
+    *out = or_expr();
+    skip();
+    return ok_ && pos_ == s_.size();
+  }
+
+ private:
+  void skip() {
+    while (pos_ < s_.size() && (s_[pos_] == ' ' || s_[pos_] == '\t')) ++pos_;
+  }
+  bool take(std::string_view op) {
+    skip();
+    if (s_.substr(pos_, op.size()) != op) return false;
+    pos_ += op.size();
+    return true;
+  }
+  uint64_t or_expr() {
+    uint64_t v = shift_expr();
+    while (ok_ && take("|")) v |= shift_expr();
+    return v;
+  }
+  uint64_t shift_expr() {
+    uint64_t v = add_expr();
+    while (ok_ && take("<<")) {
+      const uint64_t n = add_expr();
+      if (n >= 64) ok_ = false;
+      else v <<= n;
+    }
+    return v;
+  }
+  uint64_t add_expr() {
+    uint64_t v = primary();
+    for (;;) {
+      if (take("+")) v += primary();
+      else if (take("-")) v -= primary();
+      else return v;
+    }
+  }
+  uint64_t primary() {
+    if (take("(")) {
+      const uint64_t v = or_expr();
+      if (!take(")")) ok_ = false;
+      return v;
+    }
+    skip();
+    std::size_t at = pos_;
+    int base = 10;
+    if (s_.substr(at, 2) == "0x" || s_.substr(at, 2) == "0X") {
+      base = 16;
+      at += 2;
+    }
+    uint64_t v = 0;
+    auto [end, ec] = std::from_chars(s_.data() + at, s_.data() + s_.size(), v, base);
+    if (ec != std::errc()) ok_ = false;
+    pos_ = static_cast<std::size_t>(end - s_.data());
+    return v;
+  }
+
+  std::string_view s_;
+  std::size_t pos_ = 0;
+  bool ok_ = true;
+};
+
+}  // namespace
+
+int sched_preempt_flag(std::string_view print_fmt, uint64_t* out) {
+  static constexpr std::string_view kTerm = "REC->prev_state &", kPlus = "? \"+\"";
+  const std::size_t plus = print_fmt.find(kPlus);
+  if (plus == std::string_view::npos) return -EINVAL;
+  const std::size_t term = print_fmt.rfind(kTerm, plus);
+  if (term == std::string_view::npos) return -EINVAL;
+  const std::size_t from = term + kTerm.size();
+  uint64_t flag;
+  if (!ConstExpr(print_fmt.substr(from, plus - from)).eval(&flag) || flag == 0 || (flag & (flag - 1)) != 0 ||
+      flag > 0x40000000)
+    return -EINVAL;
+  *out = flag;
+  return 0;
+}
+
+int parse_sched_options(std::string_view args, SchedOptions* out) {
+  while (!args.empty()) {
+    std::size_t comma = args.find(',');
+    std::string_view item = args.substr(0, comma);
+    args = comma == std::string_view::npos ? std::string_view{} : args.substr(comma + 1);
+    if (item.empty()) continue;
+    std::size_t eq = item.find('=');
+    if (eq == std::string_view::npos) return -EINVAL;
+    std::string_view k = item.substr(0, eq), v = item.substr(eq + 1);
+    bool ok = true;
+    if (k == "drain_s") {
+      uint32_t s = 0;
+      ok = parse_number(v, &s) && s > 0;
+      out->drain_interval_ns = int64_t{s} * 1000000000;
+    } else if (k == "tracefs") {
+      out->tracefs = v;
+    } else if (k == "cgroup_root") {
+      out->cgroup_root = v;
+    } else if (k == "max_tasks") {
+      ok = parse_number(v, &out->max_tasks) && out->max_tasks > 0;
+    } else if (k == "max_cgroups") {
+      ok = parse_number(v, &out->max_cgroups) && out->max_cgroups > 0;
+    } else if (k == "max_stacks") {
+      ok = parse_number(v, &out->max_stacks) && out->max_stacks > 0;
+    } else if (k == "stack_frames") {
+      ok = parse_number(v, &out->stack_frames) && out->stack_frames > 0 && out->stack_frames <= kStackDepth;
+    } else {
+      ok = false;
+    }
+    if (!ok) return -EINVAL;
+  }
+  return 0;
+}
+
+int KernelSymbols::load(const char* path) {
+  std::FILE* f = std::fopen(path, "re");
+  if (!f) return -errno;
+  std::vector<std::pair<uint64_t, uint32_t>> syms;
+  blob_.clear();
+  char line[512];
+  bool hidden = false;
+  while (std::fgets(line, sizeof line, f)) {
+    unsigned long long addr;
+    char type;
+    char name[256];
+    if (std::sscanf(line, "%llx %c %255s", &addr, &type, name) != 3) continue;
+    if (type != 't' && type != 'T' && type != 'w' && type != 'W') continue;
+    if (addr == 0) {
+      hidden = true;
+      break;
+    }
+    syms.emplace_back(addr, static_cast<uint32_t>(blob_.size()));
+    blob_.append(name).push_back('\0');
+  }
+  std::fclose(f);
+  if (hidden || syms.empty()) {
+    blob_.clear();
+    return -EPERM;
+  }
+  std::sort(syms.begin(), syms.end());
+  addrs_.resize(syms.size());
+  names_.resize(syms.size());
+  for (std::size_t i = 0; i < syms.size(); ++i) {
+    addrs_[i] = syms[i].first;
+    names_[i] = syms[i].second;
+  }
+  return 0;
+}
+
+const char* KernelSymbols::resolve(uint64_t addr) const {
+  auto it = std::upper_bound(addrs_.begin(), addrs_.end(), addr);
+  if (it == addrs_.begin()) return nullptr;
+  return blob_.data() + names_[static_cast<std::size_t>(it - addrs_.begin() - 1)];
+}
+
+int CgroupPaths::open(const std::string& root) {
+  struct stat st;
+  if (::stat(root.c_str(), &st) < 0) return -errno;
+  root_ = root;
+  paths_.clear();
+  scanned_ = ~uint64_t{0};
+  return 0;
+}
+
+void CgroupPaths::rescan() {
+  paths_.clear();
+  if (root_.empty()) return;
+  // Depth-first over the hierarchy; `rel` is the path below the mount.
+  std::vector<std::string> todo{"/"};
+  while (!todo.empty()) {
+    std::string rel = std::move(todo.back());
+    todo.pop_back();
+    std::string full = root_ + rel;
+    struct stat st;
+    if (::stat(full.c_str(), &st) < 0) continue;
+    paths_[st.st_ino] = rel;
+    DIR* d = ::opendir(full.c_str());
+    if (!d) continue;
+    while (dirent* e = ::readdir(d)) {
+      if (e->d_type != DT_DIR || e->d_name[0] == '.') continue;
+      todo.push_back(rel == "/" ? "/" + std::string(e->d_name) : rel + "/" + e->d_name);
+    }
+    ::closedir(d);
+  }
+}
+
+const char* CgroupPaths::path(uint64_t id, uint64_t generation) {
+  auto it = paths_.find(id);
+  if (it == paths_.end() && scanned_ != generation) {
+    scanned_ = generation;
+    rescan();
+    it = paths_.find(id);
+  }
+  return it == paths_.end() ? nullptr : it->second.c_str();
+}
+
+SchedCollector::~SchedCollector() { close(); }
+
+int SchedCollector::build_wakeup(bool new_task, BpfProgram* prog, std::string* log) {
+  const TracepointField& pid = new_task ? wakeup_new_pid_ : wakeup_pid_;
+  BpfAsm a;
+  auto out = a.label(), missing = a.label();
+  a.mov(BPF_REG_6, BPF_REG_1);
+  a.ldx(BPF_W, BPF_REG_7, BPF_REG_6, static_cast<int16_t>(pid.offset));
+  a.jmp_imm(BPF_JEQ, BPF_REG_7, 0, out);
+  a.stx(BPF_W, BPF_REG_10, kFpPid, BPF_REG_7);
+  a.call(BPF_FUNC_ktime_get_ns);
+  a.mov(BPF_REG_8, BPF_REG_0);
+  a.ld_map(BPF_REG_1, tasks_.fd());
+  a.mov(BPF_REG_2, BPF_REG_10);
+  a.alu_imm(BPF_ADD, BPF_REG_2, kFpPid);
+  a.call(BPF_FUNC_map_lookup_elem);
+  a.jmp_imm(BPF_JEQ, BPF_REG_0, 0, missing);
+  a.stx(BPF_DW, BPF_REG_0, kWakeNs, BPF_REG_8);
+  a.ja(out);
+  a.bind(missing);
+  if (new_task) {
+    // A new task has never been switched out, so there is no record yet.
+    // The parent is current here and the child starts in its cgroup.
+    a.call(BPF_FUNC_get_current_cgroup_id);
+    a.st_imm(BPF_DW, BPF_REG_10, kFpTask + kOffNs, 0);
+    a.stx(BPF_DW, BPF_REG_10, kFpTask + kWakeNs, BPF_REG_8);
+    a.stx(BPF_DW, BPF_REG_10, kFpTask + kCgroup, BPF_REG_0);
+    a.st_imm(BPF_DW, BPF_REG_10, kFpTask + kStack, -1);
+    a.ld_map(BPF_REG_1, tasks_.fd());
+    a.mov(BPF_REG_2, BPF_REG_10);
+    a.alu_imm(BPF_ADD, BPF_REG_2, kFpPid);
+    a.mov(BPF_REG_3, BPF_REG_10);
+    a.alu_imm(BPF_ADD, BPF_REG_3, kFpTask);
+    a.mov_imm(BPF_REG_4, BPF_ANY);
+    a.call(BPF_FUNC_map_update_elem);
+  }
+  // Tasks that have not slept since we attached have no cgroup yet; their
+  // first wakeup is not measured.
+  a.bind(out);
+  a.mov_imm(BPF_REG_0, 0);
+  a.exit();
+  int rc = a.finish();
+  if (rc < 0) return rc;
+  return prog->load(BPF_PROG_TYPE_TRACEPOINT, a, new_task ? "sysapm_wakenew" : "sysapm_wakeup", log);
+}
+
+int SchedCollector::build_switch(BpfProgram* prog, std::string* log) {
+  BpfAsm a;
+  auto store = a.label(), next = a.label(), out = a.label(), runq = a.label(), add_off = a.label(),
+       add_hist = a.label(), have = a.label(), clear = a.label();
+  auto key_at = [&a](int reg, int16_t fp) {
+    a.mov(reg, BPF_REG_10);
+    a.alu_imm(BPF_ADD, reg, fp);
+  };
+  // Looks up `fp` in `map`, on a miss writing a zero value with `zero`
+  // and inserting it at `init`; leaves the value in r0, or jumps to `fail`.
+  auto lookup_or_init = [&](const BpfMap& map, int16_t fp, int16_t init, auto zero, BpfAsm::Label found,
+                            BpfAsm::Label fail) {
+    a.ld_map(BPF_REG_1, map.fd());
+    key_at(BPF_REG_2, fp);
+    a.call(BPF_FUNC_map_lookup_elem);
+    a.jmp_imm(BPF_JNE, BPF_REG_0, 0, found);
+    zero();
+    a.ld_map(BPF_REG_1, map.fd());
+    key_at(BPF_REG_2, fp);
+    key_at(BPF_REG_3, init);
+    a.mov_imm(BPF_REG_4, BPF_NOEXIST);
+    a.call(BPF_FUNC_map_update_elem);
+    a.ld_map(BPF_REG_1, map.fd());
+    key_at(BPF_REG_2, fp);
+    a.call(BPF_FUNC_map_lookup_elem);
+    a.jmp_imm(BPF_JEQ, BPF_REG_0, 0, fail);
+  };
+
+  a.mov(BPF_REG_6, BPF_REG_1);
+  a.call(BPF_FUNC_ktime_get_ns);
+  a.mov(BPF_REG_8, BPF_REG_0);
+
+  // prev leaves the CPU. current is still prev, so its cgroup and stack are
+  // what we want. A blocked task starts an off-CPU interval; a preempted
+  // one is straight back on the run queue. That is prev_state ==
+  // TASK_RUNNING, or TASK_REPORT_MAX alone when preempted in the kernel,
+  // so only the state bits below the flag mean blocked.
+  a.ldx(BPF_W, BPF_REG_7, BPF_REG_6, static_cast<int16_t>(prev_pid_.offset));
+  a.jmp_imm(BPF_JEQ, BPF_REG_7, 0, next);
+  a.stx(BPF_W, BPF_REG_10, kFpPid, BPF_REG_7);
+  a.call(BPF_FUNC_get_current_cgroup_id);
+  a.mov(BPF_REG_9, BPF_REG_0);
+  a.mov(BPF_REG_1, BPF_REG_6);
+  a.ld_map(BPF_REG_2, stacks_.fd());
+  a.mov_imm(BPF_REG_3, 0);
+  a.call(BPF_FUNC_get_stackid);
+  a.stx(BPF_DW, BPF_REG_10, kFpTask + kStack, BPF_REG_0);
+  a.stx(BPF_DW, BPF_REG_10, kFpTask + kCgroup, BPF_REG_9);
+  a.ldx(prev_state_.size == 8 ? BPF_DW : BPF_W, BPF_REG_1, BPF_REG_6, static_cast<int16_t>(prev_state_.offset));
+  a.alu_imm(BPF_AND, BPF_REG_1, static_cast<int32_t>(preempt_flag_ - 1));
+  a.stx(BPF_DW, BPF_REG_10, kFpTask + kOffNs, BPF_REG_8);
+  a.st_imm(BPF_DW, BPF_REG_10, kFpTask + kWakeNs, 0);
+  a.jmp_imm(BPF_JNE, BPF_REG_1, 0, store);
+  a.st_imm(BPF_DW, BPF_REG_10, kFpTask + kOffNs, 0);
+  a.stx(BPF_DW, BPF_REG_10, kFpTask + kWakeNs, BPF_REG_8);
+  a.bind(store);
+  a.ld_map(BPF_REG_1, tasks_.fd());
+  key_at(BPF_REG_2, kFpPid);
+  key_at(BPF_REG_3, kFpTask);
+  a.mov_imm(BPF_REG_4, BPF_ANY);
+  a.call(BPF_FUNC_map_update_elem);
+
+  // next gets the CPU: close its off-CPU and run-queue intervals.
+  a.bind(next);
+  a.ldx(BPF_W, BPF_REG_7, BPF_REG_6, static_cast<int16_t>(next_pid_.offset));
+  a.jmp_imm(BPF_JEQ, BPF_REG_7, 0, out);
+  a.stx(BPF_W, BPF_REG_10, kFpPid, BPF_REG_7);
+  a.ld_map(BPF_REG_1, tasks_.fd());
+  key_at(BPF_REG_2, kFpPid);
+  a.call(BPF_FUNC_map_lookup_elem);
+  a.jmp_imm(BPF_JEQ, BPF_REG_0, 0, out);
+  a.mov(BPF_REG_9, BPF_REG_0);
+
+  a.ldx(BPF_DW, BPF_REG_1, BPF_REG_9, kOffNs);
+  a.jmp_imm(BPF_JEQ, BPF_REG_1, 0, runq);
+  a.mov(BPF_REG_7, BPF_REG_8);
+  a.alu(BPF_SUB, BPF_REG_7, BPF_REG_1);
+  a.ldx(BPF_DW, BPF_REG_1, BPF_REG_9, kCgroup);
+  a.stx(BPF_DW, BPF_REG_10, kFpKey, BPF_REG_1);
+  a.ldx(BPF_DW, BPF_REG_1, BPF_REG_9, kStack);
+  a.stx(BPF_DW, BPF_REG_10, kFpKey + 8, BPF_REG_1);
+  lookup_or_init(
+      offcpu_, kFpKey, kFpZero, [&] { a.st_imm(BPF_DW, BPF_REG_10, kFpZero, 0); }, add_off, runq);
+  a.bind(add_off);
+  a.atomic_add(BPF_REG_0, 0, BPF_REG_7);
+
+  a.bind(runq);
+  a.ldx(BPF_DW, BPF_REG_1, BPF_REG_9, kWakeNs);
+  a.jmp_imm(BPF_JEQ, BPF_REG_1, 0, clear);
+  a.mov(BPF_REG_7, BPF_REG_8);
+  a.alu(BPF_SUB, BPF_REG_7, BPF_REG_1);
+  a.ldx(BPF_DW, BPF_REG_1, BPF_REG_9, kCgroup);
+  a.stx(BPF_DW, BPF_REG_10, kFpKey, BPF_REG_1);
+  auto zero_hist = [&] {
+    for (uint32_t i = 0; i <= kBuckets; ++i) a.st_imm(BPF_DW, BPF_REG_10, static_cast<int16_t>(kFpHist + 8 * i), 0);
+  };
+  lookup_or_init(hist_, kFpKey, kFpHist, zero_hist, add_hist, clear);
+  a.bind(add_hist);
+  a.atomic_add(BPF_REG_0, 8 * kBuckets, BPF_REG_7);  // sum, ns
+  // bucket = 0 for < 1 µs, else floor(log2(us)) + 1, by binary search.
+  a.mov(BPF_REG_1, BPF_REG_7);
+  a.alu_imm(BPF_DIV, BPF_REG_1, 1000);
+  a.mov_imm(BPF_REG_2, 0);
+  a.jmp_imm(BPF_JEQ, BPF_REG_1, 0, have);
+  a.mov_imm(BPF_REG_2, 1);
+  for (int shift : {32, 16, 8, 4, 2, 1}) {
+    auto skip = a.label();
+    a.mov(BPF_REG_3, BPF_REG_1);
+    a.alu_imm(BPF_RSH, BPF_REG_3, shift);
+    a.jmp_imm(BPF_JEQ, BPF_REG_3, 0, skip);
+    a.alu_imm(BPF_ADD, BPF_REG_2, shift);
+    a.mov(BPF_REG_1, BPF_REG_3);
+    a.bind(skip);
+  }
+  a.bind(have);
+  auto in_range = a.label();
+  a.jmp_imm(BPF_JLE, BPF_REG_2, kBuckets - 1, in_range);
+  a.mov_imm(BPF_REG_2, kBuckets - 1);
+  a.bind(in_range);
+  a.alu_imm(BPF_LSH, BPF_REG_2, 3);
+  a.alu(BPF_ADD, BPF_REG_0, BPF_REG_2);
+  a.mov_imm(BPF_REG_1, 1);
+  a.atomic_add(BPF_REG_0, 0, BPF_REG_1);
+
+  a.bind(clear);
+  a.st_imm(BPF_DW, BPF_REG_9, kOffNs, 0);
+  a.st_imm(BPF_DW, BPF_REG_9, kWakeNs, 0);
+  a.bind(out);
+  a.mov_imm(BPF_REG_0, 0);
+  a.exit();
+  int rc = a.finish();
+  if (rc < 0) return rc;
+  return prog->load(BPF_PROG_TYPE_TRACEPOINT, a, "sysapm_switch", log);
+}
+
+int SchedCollector::open(const SchedOptions& opts, std::string* log) {
+  close();
+  opts_ = opts;
+  tracefs_ = opts.tracefs.empty() ? find_tracefs() : opts.tracefs;
+  if (tracefs_.empty()) return -ENOENT;
+  int rc;
+  auto fail = [this](int err) {
+    close();
+    return err;
+  };
+  if ((rc = tracepoint_field(tracefs_, "sched", "sched_wakeup", "pid", &wakeup_pid_)) < 0 ||
+      (rc = tracepoint_field(tracefs_, "sched", "sched_wakeup_new", "pid", &wakeup_new_pid_)) < 0 ||
+      (rc = tracepoint_field(tracefs_, "sched", "sched_switch", "prev_pid", &prev_pid_)) < 0 ||
+      (rc = tracepoint_field(tracefs_, "sched", "sched_switch", "prev_state", &prev_state_)) < 0 ||
+      (rc = tracepoint_field(tracefs_, "sched", "sched_switch", "next_pid", &next_pid_)) < 0)
+    return fail(rc);
+  if (wakeup_pid_.size != 4 || wakeup_new_pid_.size != 4 || prev_pid_.size != 4 || next_pid_.size != 4 ||
+      (prev_state_.size != 4 && prev_state_.size != 8))
+    return fail(-EPROTO);
+  // Without a readable print fmt, assume the 4.14+ TASK_REPORT_MAX.
+  std::string fmt;
+  if (tracepoint_print_fmt(tracefs_, "sched", "sched_switch", &fmt) < 0 || sched_preempt_flag(fmt, &preempt_flag_) < 0)
+    preempt_flag_ = 0x100;
+
+  const uint32_t hist_value = 8 * (kBuckets + 1);
+  if ((rc = tasks_.create({BPF_MAP_TYPE_LRU_HASH, 4, sizeof(TaskState), opts_.max_tasks}, "sysapm_tasks")) < 0 ||
+      (rc = hist_.create({BPF_MAP_TYPE_HASH, 8, hist_value, opts_.max_cgroups}, "sysapm_runq")) < 0 ||
+      (rc = offcpu_.create({BPF_MAP_TYPE_HASH, sizeof(OffcpuKey), 8, opts_.max_stacks}, "sysapm_offcpu")) < 0 ||
+      (rc = stacks_.create({BPF_MAP_TYPE_STACK_TRACE, 4, 8 * kStackDepth, opts_.max_stacks}, "sysapm_stacks")) < 0)
+    return fail(rc);
+  if ((rc = build_wakeup(false, &wakeup_prog_, log)) < 0 || (rc = build_wakeup(true, &wakeup_new_prog_, log)) < 0 ||
+      (rc = build_switch(&switch_prog_, log)) < 0)
+    return fail(rc);
+  if ((rc = wakeup_link_.attach(tracefs_, "sched", "sched_wakeup", wakeup_prog_)) < 0 ||
+      (rc = wakeup_new_link_.attach(tracefs_, "sched", "sched_wakeup_new", wakeup_new_prog_)) < 0 ||
+      (rc = switch_link_.attach(tracefs_, "sched", "sched_switch", switch_prog_)) < 0)
+    return fail(rc);
+
+  // Without symbols or a cgroup v2 mount the labels fall back to numbers.
+  ksyms_.load();
+  cgroups_.open(opts_.cgroup_root.empty() ? find_cgroup2() : opts_.cgroup_root);
+
+  hist_keys_.resize(opts_.max_cgroups);
+  hist_values_.resize(std::size_t{opts_.max_cgroups} * (kBuckets + 1));
+  offcpu_keys_.resize(opts_.max_stacks);
+  offcpu_values_.resize(opts_.max_stacks);
+  stack_ips_.resize(kStackDepth);
+  next_drain_ns_ = 0;
+  return 0;
+}
+
+void SchedCollector::close() {
+  switch_link_.close();
+  wakeup_new_link_.close();
+  wakeup_link_.close();
+  switch_prog_.close();
+  wakeup_new_prog_.close();
+  wakeup_prog_.close();
+  stacks_.close();
+  offcpu_.close();
+  hist_.close();
+  tasks_.close();
+}
+
+int SchedCollector::collect(std::vector<Sample>& out) {
+  const int64_t now = realtime_ns();
+  if (now < next_drain_ns_) return 0;
+  next_drain_ns_ = (now / opts_.drain_interval_ns + 1) * opts_.drain_interval_ns;
+  return drain(out);
+}
+
+const SchedCollector::HistIds* SchedCollector::hist_ids(uint64_t cgroup) {
+  auto it = hist_ids_.find(cgroup);
+  if (it != hist_ids_.end()) return &it->second;
+  char fallback[32];
+  const char* path = cgroups_.path(cgroup, drains_);
+  if (!path) {
+    std::snprintf(fallback, sizeof fallback, "#%llu", static_cast<unsigned long long>(cgroup));
+    path = fallback;
+  }
+  SeriesRegistry& r = registry();
+  HistIds ids;
+  char le[24];
+  for (uint32_t b = 0; b < kBuckets; ++b) {
+    if (b + 1 < kBuckets)
+      std::snprintf(le, sizeof le, "%llu", 1ull << b);
+    else
+      std::snprintf(le, sizeof le, "+Inf");
+    ids.bucket[b] = r.intern("sched_runqueue_latency_us_bucket", {{"cgroup", path}, {"le", le}});
+  }
+  ids.count = r.intern("sched_runqueue_latency_us_count", {{"cgroup", path}});
+  ids.sum = r.intern("sched_runqueue_latency_us_sum", {{"cgroup", path}});
+  return &hist_ids_.emplace(cgroup, ids).first->second;
+}
+
+std::string SchedCollector::stack_label(int64_t stack) {
+  if (stack < 0) return "[unknown]";
+  const auto id = static_cast<uint32_t>(stack);
+  std::fill(stack_ips_.begin(), stack_ips_.end(), 0);
+  if (stacks_.lookup(&id, stack_ips_.data()) < 0) return "[unknown]";
+  // ips are innermost first; keep the innermost frames below the scheduler
+  // and print them outermost first, as folded stacks are.
+  std::vector<std::string> frames;
+  bool inside = true;
+  for (uint64_t ip : stack_ips_) {
+    if (!ip || frames.size() == opts_.stack_frames) break;
+    const char* sym = ksyms_.resolve(ip);
+    if (inside && sym && scheduler_frame(sym)) continue;
+    inside = false;
+    char hex[24];
+    if (!sym) {
+      std::snprintf(hex, sizeof hex, "0x%llx", static_cast<unsigned long long>(ip));
+      sym = hex;
+    }
+    frames.emplace_back(sym);
+  }
+  if (frames.empty()) return "[scheduler]";
+  std::string label;
+  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+    if (!label.empty()) label.push_back(';');
+    label += *it;
+  }
+  return label;
+}
+
+uint32_t SchedCollector::offcpu_id(const OffcpuKey& k) {
+  auto it = offcpu_ids_.find(k);
+  if (it != offcpu_ids_.end()) return it->second;
+  char fallback[32];
+  const char* path = cgroups_.path(k.cgroup, drains_);
+  if (!path) {
+    std::snprintf(fallback, sizeof fallback, "#%llu", static_cast<unsigned long long>(k.cgroup));
+    path = fallback;
+  }
+  const std::string stack = stack_label(k.stack);
+  const uint32_t id = registry().intern("sched_offcpu_ns_total", {{"cgroup", path}, {"stack", stack}});
+  offcpu_ids_.emplace(k, id);
+  return id;
+}
+
+int SchedCollector::drain(std::vector<Sample>& out) {
+  if (hist_.fd() < 0) return -EBADF;
+  ++drains_;
+  const int64_t ts = realtime_ns();
+  int n = hist_.lookup_all(hist_keys_.data(), hist_values_.data(), hist_keys_.size());
+  if (n < 0) return n;
+  for (int i = 0; i < n; ++i) {
+    const HistIds* ids = hist_ids(hist_keys_[static_cast<std::size_t>(i)]);
+    const uint64_t* v = &hist_values_[static_cast<std::size_t>(i) * (kBuckets + 1)];
+    uint64_t cumulative = 0;
+    for (uint32_t b = 0; b < kBuckets; ++b) {
+      cumulative += v[b];
+      out.push_back(Sample::make_counter(ts, ids->bucket[b], cumulative));
+    }
+    out.push_back(Sample::make_counter(ts, ids->count, cumulative));
+    out.push_back(Sample::make_counter(ts, ids->sum, v[kBuckets] / 1000));
+  }
+  n = offcpu_.lookup_all(offcpu_keys_.data(), offcpu_values_.data(), offcpu_keys_.size());
+  if (n < 0) return n;
+  for (int i = 0; i < n; ++i) {
+    const auto j = static_cast<std::size_t>(i);
+    out.push_back(Sample::make_counter(ts, offcpu_id(offcpu_keys_[j]), offcpu_values_[j]));
+  }
+  return 0;
+}
+
+}  // namespace sysapm
@@ -0,0 +1,318 @@
+#include "sysapm/segment.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "sysapm/clock.hpp"
+
+namespace sysapm {
+namespace {
+
+constexpr char kHeaderMagic[8] = {'S', 'Y', 'S', 'A', 'P', 'M', 'S', 'G'};
+constexpr char kTrailerMagic[8] = {'S', 'Y', 'S', 'A', 'P', 'M', 'F', 'T'};
+constexpr uint32_t kRecordMagic = 0x4b484353;  // "SCHK"
+constexpr uint32_t kVersion = 1;
+constexpr std::size_t kRecordOverhead = sizeof(RecordHeader) + sizeof(ChunkMeta);
+
+// FNV-1a; only guards against torn writes and stray bytes, not tampering.
+uint64_t fnv1a(const void* data, std::size_t len, uint64_t h = 0xcbf29ce484222325ull) {
+  const auto* p = static_cast<const unsigned char*>(data);
+  for (std::size_t i = 0; i < len; ++i) h = (h ^ p[i]) * 0x100000001b3ull;
+  return h;
+}
+
+uint32_t record_checksum(const ChunkMeta& m, const uint64_t* words) {
+  uint64_t h = fnv1a(&m, sizeof m);
+  h = fnv1a(words, m.words * sizeof(uint64_t), h);
+  return static_cast<uint32_t>(h ^ (h >> 32));
+}
+
+std::size_t round_up(std::size_t n, std::size_t to) { return (n + to - 1) / to * to; }
+
+int pwrite_all(int fd, const void* buf, std::size_t len, uint64_t off) {
+  const char* p = static_cast<const char*>(buf);
+  while (len) {
+    ssize_t n = ::pwrite(fd, p, len, static_cast<off_t>(off));
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -errno;
+    }
+    p += n;
+    len -= static_cast<std::size_t>(n);
+    off += static_cast<uint64_t>(n);
+  }
+  return 0;
+}
+
+bool parse_name(const char* name, uint64_t& seq) {
+  unsigned long long v;
+  int end = 0;
+  if (std::sscanf(name, "segment-%16llx.seg%n", &v, &end) != 1 || name[end] != '\0') return false;
+  seq = v;
+  return true;
+}
+
+}  // namespace
+
+struct SegmentStore::Segment {
+  uint64_t seq = 0;
+  std::string path;
+  int fd = -1;
+  const char* map = nullptr;
+  std::size_t map_len = 0;
+  uint64_t end = 0;  // next record offset while active
+  bool finished = false;
+  int64_t max_t_ms = INT64_MIN;
+  SeriesIdOrigin origin;
+  std::vector<FooterEntry> index;
+
+  ~Segment() {
+    if (map) ::munmap(const_cast<char*>(map), map_len);
+    if (fd >= 0) ::close(fd);
+  }
+};
+
+SegmentStore::~SegmentStore() { finish(); }
+
+int SegmentStore::map_segment(Segment& seg, std::size_t len) {
+  void* m = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, seg.fd, 0);
+  if (m == MAP_FAILED) return -errno;
+  seg.map = static_cast<const char*>(m);
+  seg.map_len = len;
+  return 0;
+}
+
+int SegmentStore::open(const SegmentOptions& opts) {
+  opts_ = opts;
+  segments_.clear();
+  stats_ = {};
+  if (opts_.segment_bytes < 2 * kSegmentPage) opts_.segment_bytes = 2 * kSegmentPage;
+  if (::mkdir(opts_.dir.c_str(), 0755) < 0 && errno != EEXIST) return -errno;
+
+  DIR* d = ::opendir(opts_.dir.c_str());
+  if (!d) return -errno;
+  std::vector<uint64_t> seqs;
+  while (dirent* e = ::readdir(d)) {
+    uint64_t seq;
+    if (parse_name(e->d_name, seq)) seqs.push_back(seq);
+  }
+  ::closedir(d);
+  std::sort(seqs.begin(), seqs.end());
+
+  for (uint64_t seq : seqs) {
+    next_seq_ = seq + 1;
+    auto seg = std::make_shared<Segment>();
+    seg->seq = seq;
+    char name[64];
+    std::snprintf(name, sizeof name, "/segment-%016llx.seg", static_cast<unsigned long long>(seq));
+    seg->path = opts_.dir + name;
+    seg->fd = ::open(seg->path.c_str(), O_RDWR | O_CLOEXEC);
+    if (seg->fd < 0) return -errno;
+    struct stat st;
+    if (::fstat(seg->fd, &st) < 0) return -errno;
+    const std::size_t size = static_cast<std::size_t>(st.st_size);
+    if (size < sizeof(SegmentHeader)) continue;  // died before the header landed
+    if (int rc = map_segment(*seg, size); rc < 0) return rc;
+    SegmentHeader hdr;
+    std::memcpy(&hdr, seg->map, sizeof hdr);
+    if (std::memcmp(hdr.magic, kHeaderMagic, 8) != 0 || hdr.version != kVersion) continue;
+    seg->origin = {hdr.generation, hdr.parent, hdr.inherited};
+
+    SegmentTrailer tr{};
+    if (size >= kSegmentPage + sizeof tr) std::memcpy(&tr, seg->map + size - sizeof tr, sizeof tr);
+    // Both fields come from the file: bound each on its own, so no sum of
+    // them can wrap past the checks.
+    bool has_footer = std::memcmp(tr.magic, kTrailerMagic, 8) == 0 && tr.footer_offset >= kSegmentPage &&
+                      tr.footer_offset <= size - sizeof tr &&
+                      tr.entries <= (size - sizeof tr - tr.footer_offset) / sizeof(FooterEntry) &&
+                      fnv1a(seg->map + tr.footer_offset, tr.entries * sizeof(FooterEntry)) == tr.checksum;
+    if (has_footer) {
+      seg->index.resize(tr.entries);
+      std::memcpy(seg->index.data(), seg->map + tr.footer_offset, tr.entries * sizeof(FooterEntry));
+      for (const FooterEntry& e : seg->index)
+        if (e.offset < kSegmentPage || e.offset > tr.footer_offset - kRecordOverhead ||
+            e.meta.words > (tr.footer_offset - kRecordOverhead - e.offset) / sizeof(uint64_t)) {
+          has_footer = false;
+          seg->index.clear();
+          break;
+        }
+    }
+    if (has_footer) {
+      seg->end = tr.footer_offset;
+      seg->finished = true;
+    } else {
+      // Walk the records; the first torn or foreign one ends the segment.
+      uint64_t off = kSegmentPage;
+      while (off + kRecordOverhead <= size) {
+        RecordHeader rh;
+        FooterEntry e;
+        std::memcpy(&rh, seg->map + off, sizeof rh);
+        std::memcpy(&e.meta, seg->map + off + sizeof rh, sizeof e.meta);
+        const uint64_t len = kRecordOverhead + uint64_t{e.meta.words} * sizeof(uint64_t);
+        if (rh.magic != kRecordMagic || off + len > size ||
+            record_checksum(e.meta, reinterpret_cast<const uint64_t*>(seg->map + off + kRecordOverhead)) !=
+                rh.checksum)
+          break;
+        e.offset = off;
+        seg->index.push_back(e);
+        off += len;
+      }
+      seg->end = off;
+      stats_.recovered_chunks += seg->index.size();
+      if (seg->index.empty()) {
+        ::unlink(seg->path.c_str());
+        continue;
+      }
+      if (::ftruncate(seg->fd, static_cast<off_t>(off)) < 0) return -errno;
+      if (int rc = finish(*seg); rc < 0) return rc;
+    }
+    for (const FooterEntry& e : seg->index) seg->max_t_ms = std::max(seg->max_t_ms, e.meta.max_t_ms);
+    segments_.push_back(std::move(seg));
+  }
+  return 0;
+}
+
+int SegmentStore::start_segment() {
+  auto seg = std::make_shared<Segment>();
+  seg->seq = next_seq_++;
+  char name[64];
+  std::snprintf(name, sizeof name, "/segment-%016llx.seg", static_cast<unsigned long long>(seg->seq));
+  seg->path = opts_.dir + name;
+  seg->fd = ::open(seg->path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (seg->fd < 0) return -errno;
+  alignas(8) char page[kSegmentPage] = {};
+  SegmentHeader hdr{};
+  std::memcpy(hdr.magic, kHeaderMagic, 8);
+  hdr.version = kVersion;
+  hdr.page = kSegmentPage;
+  hdr.seq = seg->seq;
+  hdr.created_ns = realtime_ns();
+  hdr.generation = opts_.origin.generation;
+  hdr.parent = opts_.origin.parent;
+  hdr.inherited = opts_.origin.inherited;
+  std::memcpy(page, &hdr, sizeof hdr);
+  int rc = pwrite_all(seg->fd, page, sizeof page, 0);
+  // Map the whole size limit now; pages past EOF are never touched.
+  if (rc == 0) rc = map_segment(*seg, opts_.segment_bytes);
+  if (rc < 0) {
+    ::unlink(seg->path.c_str());
+    return rc;
+  }
+  seg->end = kSegmentPage;
+  seg->origin = opts_.origin;
+  segments_.push_back(std::move(seg));
+  return 0;
+}
+
+int SegmentStore::finish(Segment& seg) {
+  if (seg.finished) return 0;
+  SegmentTrailer tr{};
+  tr.footer_offset = seg.end;
+  tr.entries = seg.index.size();
+  const std::size_t footer = seg.index.size() * sizeof(FooterEntry);
+  tr.checksum = fnv1a(seg.index.data(), footer);
+  std::memcpy(tr.magic, kTrailerMagic, 8);
+  const std::size_t total = round_up(seg.end + footer + sizeof tr, kSegmentPage);
+  // The gap between footer and trailer is left as a hole and reads as zeros.
+  int rc = pwrite_all(seg.fd, seg.index.data(), footer, seg.end);
+  if (rc == 0) rc = pwrite_all(seg.fd, &tr, sizeof tr, total - sizeof tr);
+  if (rc == 0 && opts_.sync && ::fdatasync(seg.fd) < 0) rc = -errno;
+  if (rc < 0) return rc;
+  seg.finished = true;
+  return 0;
+}
+
+int SegmentStore::finish() {
+  if (segments_.empty()) return 0;
+  return finish(*segments_.back());
+}
+
+std::shared_ptr<const SealedChunk> SegmentStore::view(const std::shared_ptr<Segment>& seg,
+                                                      const FooterEntry& e) const {
+  const auto* words = reinterpret_cast<const uint64_t*>(seg->map + e.offset + kRecordOverhead);
+  return std::make_shared<const SealedChunk>(e.meta, words, seg);
+}
+
+void SegmentStore::for_each_chunk(
+    const std::function<void(const SeriesIdOrigin& origin, std::shared_ptr<const SealedChunk>)>& fn) const {
+  for (const auto& seg : segments_)
+    for (const FooterEntry& e : seg->index) fn(seg->origin, view(seg, e));
+}
+
+int SegmentStore::write(const SealedChunk& chunk, std::shared_ptr<const SealedChunk>* out) {
+  const ChunkMeta& m = chunk.meta();
+  const std::size_t len = kRecordOverhead + m.words * sizeof(uint64_t);
+  if (kSegmentPage + len > opts_.segment_bytes) {
+    ++stats_.write_errors;
+    return -EFBIG;
+  }
+  if (segments_.empty() || segments_.back()->finished || segments_.back()->end + len > opts_.segment_bytes) {
+    int rc = finish();
+    if (rc == 0) rc = start_segment();
+    if (rc < 0) {
+      ++stats_.write_errors;
+      return rc;
+    }
+  }
+  Segment& seg = *segments_.back();
+  RecordHeader rh{kRecordMagic, record_checksum(m, chunk.words())};
+  iovec iov[3] = {{&rh, sizeof rh},
+                  {const_cast<ChunkMeta*>(&m), sizeof m},
+                  {const_cast<uint64_t*>(chunk.words()), m.words * sizeof(uint64_t)}};
+  ssize_t n;
+  do {
+    n = ::pwritev(seg.fd, iov, 3, static_cast<off_t>(seg.end));
+  } while (n < 0 && errno == EINTR);
+  if (n != static_cast<ssize_t>(len)) {
+    // A short record is overwritten by the next write, or cut off by
+    // recovery if we crash first.
+    ++stats_.write_errors;
+    return n < 0 ? -errno : -EIO;
+  }
+  FooterEntry e{m, seg.end};
+  seg.index.push_back(e);
+  seg.end += len;
+  seg.max_t_ms = std::max(seg.max_t_ms, m.max_t_ms);
+  ++stats_.written;
+  *out = view(segments_.back(), e);
+  return 0;
+}
+
+std::size_t SegmentStore::expire(int64_t cutoff_ms) {
+  std::size_t removed = 0;
+  auto it = segments_.begin();
+  while (it != segments_.end()) {
+    Segment& seg = **it;
+    if (!seg.finished || seg.max_t_ms >= cutoff_ms) {
+      ++it;
+      continue;
+    }
+    ::unlink(seg.path.c_str());
+    it = segments_.erase(it);
+    ++removed;
+  }
+  stats_.removed += removed;
+  return removed;
+}
+
+SegmentStats SegmentStore::stats() const {
+  SegmentStats st = stats_;
+  st.segments = segments_.size();
+  for (const auto& seg : segments_) {
+    st.chunks += seg->index.size();
+    st.bytes += seg->finished ? round_up(seg->end + seg->index.size() * sizeof(FooterEntry) + sizeof(SegmentTrailer),
+                                         kSegmentPage)
+                              : seg->end;
+  }
+  return st;
+}
+
+}  // namespace sysapm
@@ -0,0 +1,118 @@
+#include "sysapm/self_profile.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#if SYSAPM_HAVE_USDT
+// Raised by a tracer while it has sysapm:stage attached.
+extern "C" {
+__attribute__((section(".probes"), used)) volatile unsigned short sysapm_stage_semaphore = 0;
+}
+#endif
+
+namespace sysapm {
+namespace {
+
+constexpr const char* kStageNames[kStageCount] = {"collect", "parse", "encode", "compress", "send"};
+
+uint64_t raw_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+// Both flags: the TSC ticks at a fixed rate and keeps ticking in deep
+// C-states, so cycles convert to time with one factor.
+bool invariant_tsc() {
+#if defined(__x86_64__)
+  FILE* f = std::fopen("/proc/cpuinfo", "re");
+  if (!f) return false;
+  bool constant = false, nonstop = false;
+  char line[4096];
+  while (std::fgets(line, sizeof line, f)) {
+    if (std::strncmp(line, "flags", 5) != 0) continue;
+    constant = std::strstr(line, " constant_tsc") != nullptr;
+    nonstop = std::strstr(line, " nonstop_tsc") != nullptr;
+    break;
+  }
+  std::fclose(f);
+  return constant && nonstop;
+#else
+  return false;
+#endif
+}
+
+}  // namespace
+
+namespace detail {
+StageProfiler g_stage_profiler;
+}  // namespace detail
+
+const char* stage_name(Stage s) {
+  const auto i = static_cast<std::size_t>(s);
+  return i < kStageCount ? kStageNames[i] : "unknown";
+}
+
+StageProfiler::StageProfiler() = default;
+
+ProfileClock StageProfiler::configure(const SelfProfileOptions& opts) {
+  enabled_.store(opts.enabled, std::memory_order_relaxed);
+  tsc_ = false;
+#if defined(__x86_64__)
+  if (opts.clock == ProfileClock::kTsc && invariant_tsc()) {
+    // Calibrate over ~10ms against the raw clock the TSC replaces.
+    const uint64_t n0 = raw_ns(), c0 = __rdtsc();
+    uint64_t n1;
+    while ((n1 = raw_ns()) - n0 < 10000000) {
+    }
+    const uint64_t c1 = __rdtsc();
+    if (c1 > c0) {
+      tsc_mult_ = static_cast<uint64_t>((static_cast<unsigned __int128>(n1 - n0) << 32) / (c1 - c0));
+      tsc_ = true;
+    }
+  }
+#endif
+  return clock();
+}
+
+StageStats StageProfiler::stats(Stage s) const {
+  StageStats st;
+  st.calls = histogram(s).snapshot().count();
+  st.total_ns = total_ns(s);
+  return st;
+}
+
+#if SYSAPM_HAVE_USDT
+// What <sys/sdt.h> emits for STAP_PROBE2(sysapm, stage, stage, ns): a nop
+// at the probe site and a note naming it, its semaphore and where the
+// tracer finds each argument.
+void StageProfiler::probe(uint64_t stage, uint64_t ns) {
+  __asm__ __volatile__(
+      "990: nop\n"
+      ".pushsection .note.stapsdt,\"\",\"note\"\n"
+      ".balign 4\n"
+      ".4byte 992f-991f, 994f-993f, 3\n"
+      "991: .asciz \"stapsdt\"\n"
+      "992: .balign 4\n"
+      "993: .8byte 990b\n"
+      ".8byte _.stapsdt.base\n"
+      ".8byte sysapm_stage_semaphore\n"
+      ".asciz \"sysapm\"\n"
+      ".asciz \"stage\"\n"
+      ".asciz \"8@%0 8@%1\"\n"
+      "994: .balign 4\n"
+      ".popsection\n"
+      ".ifndef _.stapsdt.base\n"
+      ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"
+      ".weak _.stapsdt.base\n"
+      ".hidden _.stapsdt.base\n"
+      "_.stapsdt.base: .space 1\n"
+      ".size _.stapsdt.base, 1\n"
+      ".popsection\n"
+      ".endif\n"
+      :
+      : "r"(stage), "r"(ns));
+}
+#endif
+
+}  // namespace sysapm
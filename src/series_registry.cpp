@@ -0,0 +1,533 @@
+#include "sysapm/series_registry.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <utility>
+
+namespace sysapm {
+namespace {
+
+constexpr std::size_t kPageBytes = 64u << 10;
+constexpr std::size_t kInitialSlots = 1024;
+constexpr std::size_t kMaxLineage = 256;  // restarts remembered; older segments have expired
+
+uint64_t new_generation() {
+  std::random_device rd;
+  uint64_t g;
+  do g = (uint64_t{rd()} << 32) ^ rd();
+  while (g == 0);
+  return g;
+}
+
+inline uint64_t mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h;
+}
+
+// Eight bytes per step; strings here are short names and label values.
+uint32_t hash_string(std::string_view s) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ s.size();
+  const char* p = s.data();
+  std::size_t n = s.size();
+  for (; n >= 8; n -= 8, p += 8) {
+    uint64_t w;
+    std::memcpy(&w, p, 8);
+    h = mix(h ^ w) * 0x9e3779b97f4a7c15ull;
+  }
+  uint64_t tail = 0;
+  std::memcpy(&tail, p, n);
+  return static_cast<uint32_t>(mix(h ^ tail));
+}
+
+uint32_t hash_syms(const uint32_t* syms, std::size_t n) {
+  uint64_t h = 0x2545f4914f6cdd1dull ^ n;
+  for (std::size_t i = 0; i < n; ++i) h = mix(h ^ syms[i]) * 0x9e3779b97f4a7c15ull;
+  return static_cast<uint32_t>(mix(h));
+}
+
+// Identifies a label set independently of label order and of the symbol
+// table, for HyperLogLog: label names are unique within a set.
+uint64_t label_set_hash(std::string_view metric, const Label* labels, std::size_t n) {
+  uint64_t sum = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    const uint64_t pair = uint64_t{hash_string(labels[i].name)} << 32 | hash_string(labels[i].value);
+    sum += mix(pair * 0x9e3779b97f4a7c15ull);
+  }
+  return mix(mix(sum ^ hash_string(metric)) * 0xc2b2ae3d27d4eb4full);
+}
+
+// Appends `s` to the output with Prometheus label-value escaping.
+bool put(char*& out, char* end, std::string_view s, bool escape) {
+  for (char c : s) {
+    const char* rep = nullptr;
+    if (escape) rep = c == '\\' ? "\\\\" : c == '"' ? "\\\"" : c == '\n' ? "\\n" : nullptr;
+    std::size_t k = rep ? 2 : 1;
+    if (end - out <= static_cast<std::ptrdiff_t>(k)) return false;
+    if (rep) {
+      *out++ = rep[0];
+      *out++ = rep[1];
+    } else {
+      *out++ = c;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+SeriesRegistry& default_registry() {
+  static SeriesRegistry registry;
+  return registry;
+}
+
+SeriesRegistry::SeriesRegistry()
+    : sym_table_(kInitialSlots), series_table_(kInitialSlots), generation_(new_generation()) {
+  loaded_.generation = generation_;
+}
+
+SeriesRegistry::~SeriesRegistry() = default;
+
+void* SeriesRegistry::store(std::size_t bytes, std::size_t align) {
+  auto aligned = [align](char* p) {
+    auto v = reinterpret_cast<uintptr_t>(p);
+    return reinterpret_cast<char*>((v + align - 1) & ~(uintptr_t{align} - 1));
+  };
+  char* p = page_cur_ ? aligned(page_cur_) : nullptr;
+  if (!p || p + bytes > page_end_) {
+    const std::size_t size = std::max(kPageBytes, bytes + align);
+    pages_.emplace_back(new char[size]);
+    bytes_ += size;
+    page_cur_ = pages_.back().get();
+    page_end_ = page_cur_ + size;
+    p = aligned(page_cur_);
+  }
+  page_cur_ = p + bytes;
+  return p;
+}
+
+void SeriesRegistry::grow(std::vector<Slot>& table, std::size_t used) {
+  if ((used + 1) * 10 < table.size() * 7) return;
+  std::vector<Slot> next(table.size() * 2);
+  const std::size_t mask = next.size() - 1;
+  for (const Slot& s : table) {
+    if (!s.id) continue;
+    std::size_t i = s.hash & mask;
+    while (next[i].id) i = (i + 1) & mask;
+    next[i] = s;
+  }
+  table.swap(next);
+}
+
+uint32_t SeriesRegistry::find_symbol(std::string_view s, uint32_t hash) const {
+  const std::size_t mask = sym_table_.size() - 1;
+  for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+    const Slot& slot = sym_table_[i];
+    if (!slot.id) return 0;
+    if (slot.hash == hash && symbol(slot.id) == s) return slot.id;
+  }
+}
+
+uint32_t SeriesRegistry::add_symbol(std::string_view s, uint32_t hash) {
+  if (symbol_count_ + 1 >= decltype(symbols_)::kCapacity) return 0;
+  grow(sym_table_, symbol_count_);
+  const uint32_t sym = static_cast<uint32_t>(++symbol_count_);
+  char* p = static_cast<char*>(store(s.size() ? s.size() : 1, 1));
+  std::memcpy(p, s.data(), s.size());
+  symbols_.set(sym, Symbol{p, static_cast<uint32_t>(s.size()), hash});
+  const std::size_t mask = sym_table_.size() - 1;
+  std::size_t i = hash & mask;
+  while (sym_table_[i].id) i = (i + 1) & mask;
+  sym_table_[i] = {hash, sym};
+  return sym;
+}
+
+bool SeriesRegistry::canonical(std::string_view metric, const Label* labels, std::size_t n, uint32_t* syms,
+                               SeriesRegistry* adder) const {
+  if (metric.empty() || n > kMaxLabels) return false;
+  const Label* order[kMaxLabels];
+  for (std::size_t i = 0; i < n; ++i) order[i] = &labels[i];
+  std::sort(order, order + n, [](const Label* a, const Label* b) { return a->name < b->name; });
+  for (std::size_t i = 1; i < n; ++i)
+    if (order[i]->name == order[i - 1]->name) return false;
+  auto resolve = [&](std::string_view s, uint32_t& out) {
+    const uint32_t h = hash_string(s);
+    out = find_symbol(s, h);
+    if (!out && adder) out = adder->add_symbol(s, h);
+    return out != 0;
+  };
+  if (!resolve(metric, syms[0])) return false;
+  for (std::size_t i = 0; i < n; ++i)
+    if (!resolve(order[i]->name, syms[1 + 2 * i]) || !resolve(order[i]->value, syms[2 + 2 * i])) return false;
+  return true;
+}
+
+uint32_t SeriesRegistry::find_series(const uint32_t* syms, uint32_t n, uint32_t hash) const {
+  const std::size_t mask = series_table_.size() - 1;
+  for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+    const Slot& slot = series_table_[i];
+    if (!slot.id) return 0;
+    if (slot.hash != hash) continue;
+    const Series& s = series_[slot.id];
+    if (s.n == n && std::memcmp(s.syms, syms, n * sizeof(uint32_t)) == 0) return slot.id;
+  }
+}
+
+uint32_t SeriesRegistry::intern(std::string_view metric, const Label* labels, std::size_t n) {
+  std::lock_guard<std::mutex> lock(mu_);
+  return limiting_ ? intern_limited(metric, labels, n) : add_series(metric, labels, n);
+}
+
+// Interns with mu_ held.
+uint32_t SeriesRegistry::add_series(std::string_view metric, const Label* labels, std::size_t n) {
+  uint32_t syms[1 + 2 * kMaxLabels];
+  const auto count = static_cast<uint32_t>(1 + 2 * n);
+  if (!canonical(metric, labels, n, syms, this)) return 0;
+  const uint32_t hash = hash_syms(syms, count);
+  if (uint32_t id = find_series(syms, count, hash)) return id;
+
+  const std::size_t used = series_count_.load(std::memory_order_relaxed);
+  if (used + 1 >= decltype(series_)::kCapacity) return 0;
+  grow(series_table_, used);
+  auto* stored = static_cast<uint32_t*>(store(count * sizeof(uint32_t), alignof(uint32_t)));
+  std::memcpy(stored, syms, count * sizeof(uint32_t));
+  const auto id = static_cast<uint32_t>(used + 1);
+  series_.set(id, Series{stored, count, hash});
+  const std::size_t mask = series_table_.size() - 1;
+  std::size_t i = hash & mask;
+  while (series_table_[i].id) i = (i + 1) & mask;
+  series_table_[i] = {hash, id};
+  series_count_.store(id, std::memory_order_release);  // publishes the entry to lock-free readers
+  return id;
+}
+
+uint32_t SeriesRegistry::intern_limited(std::string_view metric, const Label* labels, std::size_t n) {
+  // Look up without adding: a refused label set must not leave its
+  // strings behind.
+  uint32_t syms[1 + 2 * kMaxLabels];
+  if (canonical(metric, labels, n, syms, nullptr)) {
+    const auto count = static_cast<uint32_t>(1 + 2 * n);
+    if (uint32_t id = find_series(syms, count, hash_syms(syms, count))) return id;
+  }
+  if (metric.empty() || n > kMaxLabels) return 0;
+  const uint32_t mhash = hash_string(metric);
+  uint32_t msym = find_symbol(metric, mhash);
+  if (!msym && !(msym = add_symbol(metric, mhash))) return 0;
+  MetricLimit& ml = limit_for(msym);
+  if (ml.cap == 0) return add_series(metric, labels, n);
+  if (ml.distinct) ml.distinct->add(label_set_hash(metric, labels, n));
+  if (ml.interned >= uint64_t{ml.cap} * std::max(limits_.headroom, 1u)) {
+    ++ml.refused;
+    return overflow_series(ml, metric);
+  }
+  const std::size_t before = series_count_.load(std::memory_order_relaxed);
+  const uint32_t id = add_series(metric, labels, n);
+  if (id && series_count_.load(std::memory_order_relaxed) > before && ++ml.interned == ml.cap) {
+    ml.distinct = std::make_unique<HyperLogLog>();
+    limit_epoch_.fetch_add(1, std::memory_order_release);
+  }
+  return id;
+}
+
+SeriesRegistry::MetricLimit& SeriesRegistry::limit_for(uint32_t metric_sym) {
+  auto [it, fresh] = metric_limits_.try_emplace(metric_sym);
+  MetricLimit& ml = it->second;
+  if (fresh) {
+    ml.cap = limits_.per_metric;
+    for (const auto& [name, cap] : limits_.overrides)
+      if (name == symbol(metric_sym)) ml.cap = cap;
+  }
+  return ml;
+}
+
+uint32_t SeriesRegistry::overflow_series(MetricLimit& ml, std::string_view metric) {
+  if (!ml.overflow) {
+    const Label other{"series", "other"};
+    ml.overflow = add_series(metric, &other, 1);
+  }
+  return ml.overflow;
+}
+
+uint32_t SeriesRegistry::find(std::string_view metric, const Label* labels, std::size_t n) const {
+  uint32_t syms[1 + 2 * kMaxLabels];
+  std::lock_guard<std::mutex> lock(mu_);
+  if (!canonical(metric, labels, n, syms, nullptr)) return 0;
+  const auto count = static_cast<uint32_t>(1 + 2 * n);
+  return find_series(syms, count, hash_syms(syms, count));
+}
+
+std::string_view SeriesRegistry::metric(uint32_t id) const {
+  return contains(id) ? symbol(series_[id].syms[0]) : std::string_view{};
+}
+
+std::size_t SeriesRegistry::label_count(uint32_t id) const { return contains(id) ? series_[id].n / 2 : 0; }
+
+Label SeriesRegistry::label(uint32_t id, std::size_t i) const {
+  if (i >= label_count(id)) return {};
+  const Series& s = series_[id];
+  return {symbol(s.syms[1 + 2 * i]), symbol(s.syms[2 + 2 * i])};
+}
+
+bool SeriesRegistry::format(uint32_t id, char* buf, std::size_t len) const {
+  if (!contains(id) || len == 0) return false;
+  char* out = buf;
+  char* end = buf + len;
+  const Series& s = series_[id];
+  bool ok = put(out, end, symbol(s.syms[0]), false);
+  for (uint32_t i = 1; ok && i < s.n; i += 2) {
+    ok = put(out, end, i == 1 ? "{" : ",", false) && put(out, end, symbol(s.syms[i]), false) &&
+         put(out, end, "=\"", false) && put(out, end, symbol(s.syms[i + 1]), true) && put(out, end, "\"", false);
+  }
+  if (ok && s.n > 1) ok = put(out, end, "}", false);
+  *(ok ? out : buf) = '\0';
+  return ok;
+}
+
+RegistryStats SeriesRegistry::stats() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  RegistryStats st;
+  st.series = series_count_.load(std::memory_order_relaxed);
+  st.symbols = symbol_count_;
+  st.bytes = bytes_ + (sym_table_.size() + series_table_.size()) * sizeof(Slot);
+  return st;
+}
+
+namespace {
+
+void put_u32(std::vector<uint8_t>* out, uint32_t v) {
+  const std::size_t at = out->size();
+  out->resize(at + 4);
+  std::memcpy(out->data() + at, &v, 4);  // little-endian hosts only, like the segment files
+}
+
+bool get_u32(const uint8_t*& p, const uint8_t* end, uint32_t* v) {
+  if (end - p < 4) return false;
+  std::memcpy(v, p, 4);
+  p += 4;
+  return true;
+}
+
+}  // namespace
+
+SeriesIdOrigin SeriesRegistry::origin() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return loaded_;
+}
+
+uint32_t SeriesRegistry::trusted_ids(const SeriesIdOrigin& o) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (o.generation == 0) return 0;
+  if (o.generation == generation_) return static_cast<uint32_t>(series_count_.load(std::memory_order_relaxed));
+  for (const auto& [g, n] : lineage_)
+    if (g == o.generation) return n;
+  // Never saved, so whatever it interned itself is lost with it.
+  for (const auto& [g, n] : lineage_)
+    if (g == o.parent) return std::min(n, o.inherited);
+  return 0;
+}
+
+// Layout: the lineage count and per entry its generation (two halves) and
+// series count, the last entry being the saved registry; then symbol
+// count, series count, each symbol's length, the symbol bytes back to back
+// (padded to 4), then per series its entry count and symbol ids. Hashes
+// are recomputed on load.
+void SeriesRegistry::save(std::vector<uint8_t>* out) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  const std::size_t series = series_count_.load(std::memory_order_relaxed);
+  // The lineage as it will be after a load(): ours, then this registry.
+  const std::size_t keep = std::min(lineage_.size(), kMaxLineage - 1);
+  put_u32(out, static_cast<uint32_t>(keep + 1));
+  for (std::size_t i = lineage_.size() - keep; i < lineage_.size(); ++i) {
+    put_u32(out, static_cast<uint32_t>(lineage_[i].first));
+    put_u32(out, static_cast<uint32_t>(lineage_[i].first >> 32));
+    put_u32(out, lineage_[i].second);
+  }
+  put_u32(out, static_cast<uint32_t>(generation_));
+  put_u32(out, static_cast<uint32_t>(generation_ >> 32));
+  put_u32(out, static_cast<uint32_t>(series));
+  put_u32(out, static_cast<uint32_t>(symbol_count_));
+  put_u32(out, static_cast<uint32_t>(series));
+  std::size_t text = 0;
+  for (std::size_t i = 1; i <= symbol_count_; ++i) {
+    put_u32(out, symbols_[i].len);
+    text += symbols_[i].len;
+  }
+  std::size_t at = out->size();
+  out->resize(at + ((text + 3) & ~std::size_t{3}));
+  for (std::size_t i = 1; i <= symbol_count_; ++i) {
+    std::memcpy(out->data() + at, symbols_[i].data, symbols_[i].len);
+    at += symbols_[i].len;
+  }
+  for (std::size_t id = 1; id <= series; ++id) {
+    const Series& s = series_[id];
+    put_u32(out, s.n);
+    at = out->size();
+    out->resize(at + s.n * sizeof(uint32_t));
+    std::memcpy(out->data() + at, s.syms, s.n * sizeof(uint32_t));
+  }
+}
+
+int SeriesRegistry::load(const uint8_t* data, std::size_t len) {
+  const uint8_t* p = data;
+  const uint8_t* end = data + len;
+  uint32_t nlineage;
+  if (!get_u32(p, end, &nlineage) || nlineage == 0 || nlineage > kMaxLineage) return -EINVAL;
+  std::vector<std::pair<uint64_t, uint32_t>> lineage(nlineage);
+  for (auto& [g, n] : lineage) {
+    uint32_t lo, hi;
+    if (!get_u32(p, end, &lo) || !get_u32(p, end, &hi) || !get_u32(p, end, &n)) return -EINVAL;
+    g = (uint64_t{hi} << 32) | lo;
+  }
+  uint32_t nsyms, nseries;
+  if (!get_u32(p, end, &nsyms) || !get_u32(p, end, &nseries) || lineage.back().second != nseries) return -EINVAL;
+  if (nsyms + 1 >= decltype(symbols_)::kCapacity || nseries + 1 >= decltype(series_)::kCapacity ||
+      static_cast<std::size_t>(end - p) / 4 < nsyms)
+    return -EINVAL;
+  const uint8_t* lens = p;
+  p += std::size_t{nsyms} * 4;
+  std::size_t text = 0;
+  for (uint32_t i = 0; i < nsyms; ++i) {
+    uint32_t l;
+    std::memcpy(&l, lens + 4 * i, 4);
+    text += l;
+  }
+  const std::size_t padded = (text + 3) & ~std::size_t{3};
+  if (static_cast<std::size_t>(end - p) < padded) return -EINVAL;
+  const uint8_t* bytes = p;
+  p += padded;
+
+  std::lock_guard<std::mutex> lock(mu_);
+  if (symbol_count_ || series_count_.load(std::memory_order_relaxed)) return -EBUSY;
+  // Tables sized once for what is coming, then filled without lookups: a
+  // saved registry holds no duplicates.
+  auto size_table = [](std::vector<Slot>& table, std::size_t n) {
+    std::size_t slots = table.size();
+    while ((n + 1) * 10 >= slots * 7) slots *= 2;
+    table.assign(slots, Slot{});
+  };
+  auto place = [](std::vector<Slot>& table, uint32_t hash, uint32_t id) {
+    const std::size_t mask = table.size() - 1;
+    std::size_t i = hash & mask;
+    while (table[i].id) i = (i + 1) & mask;
+    table[i] = {hash, id};
+  };
+  size_table(sym_table_, nsyms);
+  char* store_at = static_cast<char*>(store(text ? text : 1, 1));
+  for (uint32_t i = 0; i < nsyms; ++i) {
+    uint32_t l;
+    std::memcpy(&l, lens + 4 * i, 4);
+    std::memcpy(store_at, bytes, l);
+    const uint32_t hash = hash_string({store_at, l});
+    symbols_.set(i + 1, Symbol{store_at, l, hash});
+    place(sym_table_, hash, i + 1);
+    store_at += l;
+    bytes += l;
+  }
+  symbol_count_ = nsyms;
+  size_table(series_table_, nseries);
+  uint32_t id = 0;
+  bool ok = true;
+  while (ok && id < nseries) {
+    uint32_t n;
+    if (!get_u32(p, end, &n) || n % 2 == 0 || n > 1 + 2 * kMaxLabels || static_cast<std::size_t>(end - p) / 4 < n) {
+      ok = false;
+      break;
+    }
+    auto* stored = static_cast<uint32_t*>(store(n * sizeof(uint32_t), alignof(uint32_t)));
+    std::memcpy(stored, p, n * sizeof(uint32_t));
+    p += n * sizeof(uint32_t);
+    for (uint32_t k = 0; k < n; ++k) ok = ok && stored[k] >= 1 && stored[k] <= nsyms;
+    if (!ok) break;
+    const uint32_t hash = hash_syms(stored, n);
+    series_.set(++id, Series{stored, n, hash});
+    place(series_table_, hash, id);
+  }
+  if (!ok) {
+    // Back to empty; the strings already stored stay in the pages.
+    symbol_count_ = 0;
+    sym_table_.assign(kInitialSlots, Slot{});
+    series_table_.assign(kInitialSlots, Slot{});
+    return -EINVAL;
+  }
+  series_count_.store(id, std::memory_order_release);
+  loaded_.parent = lineage.back().first;
+  loaded_.inherited = nseries;
+  lineage_ = std::move(lineage);
+  if (limiting_) count_limits();
+  return static_cast<int>(p - data);
+}
+
+// After load(): each metric's count and, for those at their cap, the
+// sketch, as if the series had been interned one by one.
+void SeriesRegistry::count_limits() {
+  const std::size_t n = series_count_.load(std::memory_order_relaxed);
+  for (std::size_t id = 1; id <= n; ++id) {
+    const Series& s = series_[id];
+    MetricLimit& ml = limit_for(s.syms[0]);
+    if (s.n == 3 && symbol(s.syms[1]) == "series" && symbol(s.syms[2]) == "other")
+      ml.overflow = static_cast<uint32_t>(id);
+    else
+      ++ml.interned;
+  }
+  for (auto& [sym, ml] : metric_limits_) {
+    if (ml.cap == 0 || ml.interned < ml.cap) continue;
+    ml.distinct = std::make_unique<HyperLogLog>();
+    limit_epoch_.fetch_add(1, std::memory_order_release);
+  }
+}
+
+void SeriesRegistry::set_limits(const CardinalityLimits& limits) {
+  std::lock_guard<std::mutex> lock(mu_);
+  limits_ = limits;
+  limiting_ = limits.per_metric != 0 || !limits.overrides.empty();
+}
+
+const SeriesRegistry::MetricLimit* SeriesRegistry::limit_of(uint32_t id) const {
+  if (!limiting_ || !contains(id)) return nullptr;
+  auto it = metric_limits_.find(series_[id].syms[0]);
+  return it == metric_limits_.end() || !it->second.distinct ? nullptr : &it->second;
+}
+
+SeriesRegistry::MetricLimit* SeriesRegistry::limit_of(uint32_t id) {
+  return const_cast<MetricLimit*>(std::as_const(*this).limit_of(id));
+}
+
+MetricCardinality SeriesRegistry::describe_limit(uint32_t metric_sym, const MetricLimit& ml) const {
+  MetricCardinality c;
+  c.metric = symbol(metric_sym);
+  c.cap = ml.cap;
+  c.interned = ml.interned;
+  c.overflow = ml.overflow;
+  c.refused = ml.refused;
+  c.estimate = ml.cap + (ml.distinct ? ml.distinct->estimate() : 0);
+  return c;
+}
+
+bool SeriesRegistry::limited(uint32_t id) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return limit_of(id) != nullptr;
+}
+
+bool SeriesRegistry::cardinality(uint32_t id, MetricCardinality* out) {
+  std::lock_guard<std::mutex> lock(mu_);
+  MetricLimit* ml = limit_of(id);
+  if (!ml) return false;
+  const uint32_t msym = series_[id].syms[0];
+  overflow_series(*ml, symbol(msym));
+  *out = describe_limit(msym, *ml);
+  return true;
+}
+
+std::vector<MetricCardinality> SeriesRegistry::limited_metrics() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  std::vector<MetricCardinality> out;
+  for (const auto& [sym, ml] : metric_limits_)
+    if (ml.distinct) out.push_back(describe_limit(sym, ml));
+  return out;
+}
+
+}  // namespace sysapm
@@ -0,0 +1,312 @@
+#include "sysapm/shm_ingest.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+
+#include "sysapm/clock.hpp"
+
+namespace sysapm {
+namespace {
+
+constexpr uint32_t kPendingTicks = 3;  // ticks a connection has to send its hello
+
+bool printable(std::string_view s) {
+  if (s.empty()) return false;
+  for (char c : s)
+    if (c < 0x20 || c > 0x7e) return false;
+  return true;
+}
+
+// Splits a slot key into its NUL-terminated parts; false if it is not
+// "metric\0(name\0value\0)*" with valid names.
+bool split_key(const char* key, std::size_t len, std::vector<std::string_view>* parts) {
+  parts->clear();
+  if (len == 0 || len > shm::kKeyBytes || key[len - 1] != '\0') return false;
+  for (std::size_t at = 0; at < len;) {
+    const std::size_t n = std::strlen(key + at);
+    parts->emplace_back(key + at, n);
+    at += n + 1;
+  }
+  if (parts->size() % 2 == 0 || !valid_series_name((*parts)[0])) return false;
+  for (std::size_t i = 1; i < parts->size(); i += 2) {
+    const std::string_view l = (*parts)[i];
+    // The agent's own labels, and names reserved by Prometheus.
+    if (!valid_series_name(l) || l == "app" || l == "pid" || l == "le" || l.starts_with("__")) return false;
+  }
+  return true;
+}
+
+uint32_t ids_for(shm::SlotKind kind) {
+  // A histogram: its buckets, then _count and _sum.
+  return kind == shm::SlotKind::kHistogram ? static_cast<uint32_t>(shm::kHistBuckets + 2) : 1;
+}
+
+}  // namespace
+
+ShmIngestCollector::~ShmIngestCollector() { close(); }
+
+int ShmIngestCollector::open(const ShmIngestOptions& opts) {
+  close();
+  opts_ = opts;
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (opts.socket_path.size() >= sizeof addr.sun_path) return -ENAMETOOLONG;
+  std::memcpy(addr.sun_path, opts.socket_path.c_str(), opts.socket_path.size() + 1);
+  int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -errno;
+  ::unlink(opts.socket_path.c_str());
+  if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof addr) < 0 ||
+      ::chmod(opts.socket_path.c_str(), 0666) < 0 || ::listen(fd, 64) < 0) {
+    int err = errno;
+    ::close(fd);
+    return -err;
+  }
+  fd_ = fd;
+  path_ = opts.socket_path;
+  return 0;
+}
+
+void ShmIngestCollector::close() {
+  for (Client& c : clients_) {
+    ::close(c.sock);
+    ::munmap(const_cast<unsigned char*>(c.base), c.bytes);
+  }
+  clients_.clear();
+  for (const Pending& p : pending_) ::close(p.sock);
+  pending_.clear();
+  stats_.clients = stats_.slots = 0;
+  if (fd_ < 0) return;
+  ::close(fd_);
+  ::unlink(path_.c_str());
+  fd_ = -1;
+}
+
+void ShmIngestCollector::accept_clients() {
+  for (;;) {
+    int s = ::accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (s < 0) break;
+    pending_.push_back({s, 0});
+  }
+  std::size_t keep = 0;
+  for (Pending& p : pending_) {
+    const int rc = attach(p.sock);
+    if (rc == 0 && ++p.ticks < kPendingTicks) {
+      pending_[keep++] = p;
+      continue;
+    }
+    if (rc <= 0) {
+      ::close(p.sock);
+      ++stats_.refused;
+    }
+  }
+  pending_.resize(keep);
+}
+
+int ShmIngestCollector::attach(int sock) {
+  shm::Hello hello;
+  alignas(cmsghdr) char control[CMSG_SPACE(4 * sizeof(int))];
+  iovec iov{&hello, sizeof hello};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  const ssize_t n = ::recvmsg(sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+  int region = -1;
+  for (cmsghdr* c = CMSG_FIRSTHDR(&msg); n >= 0 && c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+    const std::size_t fds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (std::size_t i = 0; i < fds; ++i) {
+      int fd;
+      std::memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof fd);
+      if (region < 0)
+        region = fd;
+      else
+        ::close(fd);
+    }
+  }
+  auto refuse = [&] {
+    if (region >= 0) ::close(region);
+    return -1;
+  };
+  if (n != static_cast<ssize_t>(sizeof hello) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || region < 0)
+    return refuse();
+  if (hello.magic != shm::kRegionMagic || hello.version != shm::kRegionVersion ||
+      ::memchr(hello.app, '\0', sizeof hello.app) == nullptr || !printable(hello.app))
+    return refuse();
+  if (clients_.size() >= opts_.max_clients) return refuse();
+
+  // Sealed against shrinking, or a truncate would fault every read.
+  const int seals = ::fcntl(region, F_GET_SEALS);
+  struct stat st;
+  if (seals < 0 || !(seals & F_SEAL_SHRINK) || ::fstat(region, &st) < 0) return refuse();
+  const std::size_t bytes = static_cast<std::size_t>(st.st_size);
+  if (bytes < 2 * shm::kSlotBytes) return refuse();
+  void* p = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, region, 0);
+  ::close(region);
+  region = -1;
+  if (p == MAP_FAILED) return -1;
+  const auto* h = static_cast<const shm::RegionHeader*>(p);
+  const uint32_t slot_count = h->slot_count;
+  if (h->magic != shm::kRegionMagic || h->version != shm::kRegionVersion || h->slot_bytes != shm::kSlotBytes ||
+      slot_count == 0 || slot_count > opts_.max_slots || (std::size_t{slot_count} + 1) * shm::kSlotBytes > bytes) {
+    ::munmap(p, bytes);
+    return -1;
+  }
+
+  ucred cred{};
+  socklen_t len = sizeof cred;
+  ::getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+  // The same region again, from a client that reattached: keep its series.
+  for (Client& c : clients_) {
+    if (c.dev != st.st_dev || c.ino != st.st_ino) continue;
+    ::munmap(p, bytes);
+    ::close(c.sock);
+    c.sock = sock;
+    return 1;
+  }
+  Client c;
+  c.sock = sock;
+  c.base = static_cast<const unsigned char*>(p);
+  c.bytes = bytes;
+  c.slot_count = slot_count;
+  c.dev = st.st_dev;
+  c.ino = st.st_ino;
+  c.app = hello.app;
+  c.pid = std::to_string(cred.pid);
+  clients_.push_back(std::move(c));
+  ++stats_.accepted;
+  return 1;
+}
+
+void ShmIngestCollector::discover(Client& c) {
+  const auto* h = reinterpret_cast<const shm::RegionHeader*>(c.base);
+  const uint32_t used = std::min(h->used.load(std::memory_order_acquire), c.slot_count);
+  std::vector<std::string_view> parts;
+  std::vector<Label> labels;
+  char key[shm::kKeyBytes];
+  SeriesRegistry& r = registry();
+  while (c.slots.size() < used) {
+    const auto* s = reinterpret_cast<const shm::Slot*>(c.base + shm::kSlotBytes * (c.slots.size() + 1));
+    if (!s->ready.load(std::memory_order_acquire)) break;
+    SlotState st{s->kind, static_cast<uint32_t>(c.ids.size())};
+    // Copied first: the client can rewrite its key while we look at it.
+    const std::size_t len = s->key_len;
+    if (len <= sizeof key) std::memcpy(key, s->key, len);
+    if (st.kind != shm::SlotKind::kCounter && st.kind != shm::SlotKind::kGauge &&
+        st.kind != shm::SlotKind::kHistogram)
+      st.kind = shm::SlotKind{};
+    if (st.kind == shm::SlotKind{} || !split_key(key, len, &parts)) {
+      st.kind = shm::SlotKind{};
+      ++stats_.refused_slots;
+      c.slots.push_back(st);
+      continue;
+    }
+    labels.assign({{"app", c.app}, {"pid", c.pid}});
+    for (std::size_t i = 1; i < parts.size(); i += 2) labels.push_back({parts[i], parts[i + 1]});
+    const std::string metric(parts[0]);
+    if (st.kind != shm::SlotKind::kHistogram) {
+      c.ids.push_back(r.intern(metric, labels.data(), labels.size()));
+    } else {
+      char le[24];
+      labels.push_back({"le", le});
+      const std::string bucket = metric + "_bucket";
+      for (uint32_t b = 0; b < shm::kHistBuckets; ++b) {
+        if (b + 1 < shm::kHistBuckets)
+          std::snprintf(le, sizeof le, "%llu", 1ull << b);
+        else
+          std::snprintf(le, sizeof le, "+Inf");
+        labels.back().value = le;
+        c.ids.push_back(r.intern(bucket, labels.data(), labels.size()));
+      }
+      labels.pop_back();
+      c.ids.push_back(r.intern(metric + "_count", labels.data(), labels.size()));
+      c.ids.push_back(r.intern(metric + "_sum", labels.data(), labels.size()));
+    }
+    c.slots.push_back(st);
+    ++stats_.slots;
+  }
+}
+
+void ShmIngestCollector::harvest(const Client& c, int64_t ts, std::vector<Sample>& out) const {
+  for (std::size_t i = 0; i < c.slots.size(); ++i) {
+    const SlotState& st = c.slots[i];
+    if (st.kind == shm::SlotKind{}) continue;
+    const auto* s = reinterpret_cast<const shm::Slot*>(c.base + shm::kSlotBytes * (i + 1));
+    const uint32_t* id = c.ids.data() + st.first;
+    switch (st.kind) {
+      case shm::SlotKind::kCounter:
+        out.push_back(Sample::make_counter(ts, id[0], s->v[0].load(std::memory_order_relaxed)));
+        break;
+      case shm::SlotKind::kGauge:
+        out.push_back(Sample::make_gauge(ts, id[0], std::bit_cast<double>(s->v[0].load(std::memory_order_relaxed))));
+        break;
+      case shm::SlotKind::kHistogram: {
+        // Buckets are read one by one while the application records, so
+        // the cumulative counts can be a few records apart; never
+        // decreasing, which is what consumers rely on.
+        uint64_t cum = 0;
+        for (std::size_t b = 0; b < shm::kHistBuckets; ++b) {
+          cum += s->v[1 + b].load(std::memory_order_relaxed);
+          out.push_back(Sample::make_counter(ts, id[b], cum));
+        }
+        out.push_back(Sample::make_counter(ts, id[shm::kHistBuckets], cum));
+        out.push_back(Sample::make_counter(ts, id[shm::kHistBuckets + 1], s->v[0].load(std::memory_order_relaxed)));
+        break;
+      }
+    }
+  }
+}
+
+void ShmIngestCollector::detach(Client& c, int64_t ts, std::vector<Sample>& out) {
+  harvest(c, ts, out);
+  for (const SlotState& st : c.slots) {
+    if (st.kind == shm::SlotKind{}) continue;
+    const SampleKind kind = st.kind == shm::SlotKind::kGauge ? SampleKind::kGauge : SampleKind::kCounter;
+    for (uint32_t i = 0; i < ids_for(st.kind); ++i) out.push_back(Sample::make_stale(ts, c.ids[st.first + i], kind));
+    --stats_.slots;
+  }
+  ::close(c.sock);
+  ::munmap(const_cast<unsigned char*>(c.base), c.bytes);
+  ++stats_.detached;
+}
+
+int ShmIngestCollector::collect(std::vector<Sample>& out) {
+  if (fd_ < 0) return -EBADF;
+  accept_clients();
+  const int64_t ts = realtime_ns();
+  // One poll for every client tells which sockets have closed; a client
+  // never sends after its hello, so input counts as closing too.
+  polls_.resize(clients_.size());
+  for (std::size_t i = 0; i < clients_.size(); ++i) polls_[i] = {clients_[i].sock, POLLIN, 0};
+  if (!polls_.empty() && ::poll(polls_.data(), polls_.size(), 0) < 0) return -errno;
+  std::size_t keep = 0;
+  for (std::size_t i = 0; i < clients_.size(); ++i) {
+    Client& c = clients_[i];
+    discover(c);
+    if (polls_[i].revents & (POLLHUP | POLLERR | POLLIN)) {
+      detach(c, ts, out);
+      continue;
+    }
+    harvest(c, ts, out);
+    if (keep != i) clients_[keep] = std::move(c);
+    ++keep;
+  }
+  clients_.resize(keep);
+  stats_.clients = clients_.size();
+  return 0;
+}
+
+}  // namespace sysapm
@@ -0,0 +1,105 @@
+#include "sysapm/sketch.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace sysapm {
+
+HyperLogLog::HyperLogLog(unsigned precision)
+    : precision_(std::clamp(precision, 4u, 16u)), registers_(std::size_t{1} << precision_) {}
+
+double HyperLogLog::estimate() const {
+  const double m = static_cast<double>(registers_.size());
+  double sum = 0;
+  std::size_t zeros = 0;
+  for (uint8_t r : registers_) {
+    sum += std::ldexp(1.0, -r);
+    zeros += r == 0;
+  }
+  const double alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1 + 1.079 / m);
+  const double raw = alpha * m * m / sum;
+  // Small counts are estimated far better by how many registers are untouched.
+  if (raw <= 2.5 * m && zeros) return m * std::log(m / static_cast<double>(zeros));
+  return raw;
+}
+
+void HyperLogLog::clear() { std::fill(registers_.begin(), registers_.end(), 0); }
+
+void SpaceSaving::swap_at(std::size_t a, std::size_t b) {
+  std::swap(heap_[a], heap_[b]);
+  pos_[heap_[a].key] = a;
+  pos_[heap_[b].key] = b;
+}
+
+void SpaceSaving::sift_up(std::size_t i) {
+  while (i > 0) {
+    const std::size_t parent = (i - 1) / 2;
+    if (heap_[parent].count <= heap_[i].count) return;
+    swap_at(i, parent);
+    i = parent;
+  }
+}
+
+void SpaceSaving::sift_down(std::size_t i) {
+  for (;;) {
+    const std::size_t l = 2 * i + 1, r = l + 1;
+    std::size_t least = i;
+    if (l < heap_.size() && heap_[l].count < heap_[least].count) least = l;
+    if (r < heap_.size() && heap_[r].count < heap_[least].count) least = r;
+    if (least == i) return;
+    swap_at(i, least);
+    i = least;
+  }
+}
+
+void SpaceSaving::offer(uint32_t key, double weight) {
+  if (auto it = pos_.find(key); it != pos_.end()) {
+    heap_[it->second].count += weight;
+    sift_down(it->second);
+    return;
+  }
+  if (heap_.size() < capacity_) {
+    heap_.push_back({key, weight, 0});
+    pos_[key] = heap_.size() - 1;
+    sift_up(heap_.size() - 1);
+    return;
+  }
+  Counter& min = heap_[0];
+  pos_.erase(min.key);
+  min = {key, min.count + weight, min.count};
+  pos_[key] = 0;
+  sift_down(0);
+}
+
+void SpaceSaving::decay(double factor) {
+  // A uniform scale keeps the heap ordered.
+  for (Counter& c : heap_) {
+    c.count *= factor;
+    c.error *= factor;
+  }
+}
+
+void SpaceSaving::top(std::size_t k, std::vector<uint32_t>* out) const {
+  std::vector<const Counter*> order;
+  order.reserve(heap_.size());
+  for (const Counter& c : heap_) order.push_back(&c);
+  k = std::min(k, order.size());
+  std::partial_sort(order.begin(), order.begin() + static_cast<std::ptrdiff_t>(k), order.end(),
+                    [](const Counter* a, const Counter* b) {
+                      return a->count > b->count || (a->count == b->count && a->key < b->key);
+                    });
+  out->clear();
+  for (std::size_t i = 0; i < k; ++i) out->push_back(order[i]->key);
+}
+
+double SpaceSaving::count(uint32_t key) const {
+  auto it = pos_.find(key);
+  return it == pos_.end() ? 0 : heap_[it->second].count;
+}
+
+double SpaceSaving::error(uint32_t key) const {
+  auto it = pos_.find(key);
+  return it == pos_.end() ? 0 : heap_[it->second].error;
+}
+
+}  // namespace sysapm
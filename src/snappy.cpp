@@ -0,0 +1,161 @@
+#include "sysapm/snappy.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+namespace sysapm {
+namespace {
+
+constexpr std::size_t kFragment = 1 << 16;  // copy offsets stay below 64 KiB
+
+uint32_t load32(const uint8_t* p) {
+  uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+
+uint8_t* put_varint(uint8_t* op, uint64_t v) {
+  while (v >= 0x80) {
+    *op++ = static_cast<uint8_t>(v | 0x80);
+    v >>= 7;
+  }
+  *op++ = static_cast<uint8_t>(v);
+  return op;
+}
+
+uint8_t* put_literal(uint8_t* op, const uint8_t* lit, std::size_t len) {
+  const std::size_t n = len - 1;
+  if (n < 60) {
+    *op++ = static_cast<uint8_t>(n << 2);
+  } else {
+    unsigned bytes = n < (1u << 8) ? 1 : n < (1u << 16) ? 2 : n < (1u << 24) ? 3 : 4;
+    *op++ = static_cast<uint8_t>((59 + bytes) << 2);
+    for (unsigned i = 0; i < bytes; ++i) *op++ = static_cast<uint8_t>(n >> (8 * i));
+  }
+  std::memcpy(op, lit, len);
+  return op + len;
+}
+
+uint8_t* put_copy(uint8_t* op, std::size_t offset, std::size_t len) {
+  // Long copies go out as 64-byte pieces, leaving at least 4 for the last.
+  while (len >= 68) {
+    *op++ = static_cast<uint8_t>(2 | (63 << 2));
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+    len -= 64;
+  }
+  if (len > 64) {
+    *op++ = static_cast<uint8_t>(2 | (59 << 2));
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+    len -= 60;
+  }
+  if (len >= 4 && len < 12 && offset < 2048) {
+    *op++ = static_cast<uint8_t>(1 | ((len - 4) << 2) | ((offset >> 8) << 5));
+    *op++ = static_cast<uint8_t>(offset);
+  } else {
+    *op++ = static_cast<uint8_t>(2 | ((len - 1) << 2));
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+  }
+  return op;
+}
+
+}  // namespace
+
+void SnappyCompressor::compress(const uint8_t* data, std::size_t len, std::vector<uint8_t>* out) {
+  out->resize(max_compressed_length(len));
+  uint8_t* op = put_varint(out->data(), len);
+  for (std::size_t base = 0; base < len; base += kFragment) {
+    const uint8_t* frag = data + base;
+    const std::size_t flen = len - base < kFragment ? len - base : kFragment;
+    const uint8_t* lit = frag;
+    if (flen >= 15) {
+      std::memset(table_, 0, sizeof table_);
+      const uint8_t* const limit = frag + flen - 4;  // last position a 4-byte load may start
+      const uint8_t* ip = frag + 1;
+      uint32_t misses = 32;
+      while (ip <= limit) {
+        const uint32_t cur = load32(ip);
+        const uint32_t h = (cur * 0x1e35a7bdu) >> (32 - kHashBits);
+        const uint8_t* cand = frag + table_[h];
+        table_[h] = static_cast<uint16_t>(ip - frag);
+        if (cand >= ip || load32(cand) != cur) {
+          ip += misses++ >> 5;  // skip faster through incompressible input
+          continue;
+        }
+        misses = 32;
+        const uint8_t* m = ip + 4;
+        const uint8_t* c = cand + 4;
+        while (m < frag + flen && *m == *c) ++m, ++c;
+        if (ip > lit) op = put_literal(op, lit, static_cast<std::size_t>(ip - lit));
+        op = put_copy(op, static_cast<std::size_t>(ip - cand), static_cast<std::size_t>(m - ip));
+        ip = lit = m;
+        if (ip <= limit) table_[(load32(ip - 1) * 0x1e35a7bdu) >> (32 - kHashBits)] =
+            static_cast<uint16_t>(ip - 1 - frag);
+      }
+    }
+    if (lit < frag + flen) op = put_literal(op, lit, static_cast<std::size_t>(frag + flen - lit));
+  }
+  out->resize(static_cast<std::size_t>(op - out->data()));
+}
+
+int snappy_uncompress(const uint8_t* data, std::size_t len, std::vector<uint8_t>* out, std::size_t max_len) {
+  const uint8_t* ip = data;
+  const uint8_t* const end = data + len;
+  uint64_t want = 0;
+  for (unsigned shift = 0;; shift += 7) {
+    if (ip == end || shift > 35) return -EINVAL;
+    const uint8_t b = *ip++;
+    want |= uint64_t{b & 0x7fu} << shift;
+    if (!(b & 0x80)) break;
+  }
+  if (want > max_len) return -EINVAL;
+  out->resize(static_cast<std::size_t>(want));
+  uint8_t* const base = out->data();
+  std::size_t pos = 0;
+  while (ip < end) {
+    const uint8_t tag = *ip++;
+    std::size_t n, offset;
+    switch (tag & 3) {
+      case 0: {
+        n = tag >> 2;
+        if (n >= 60) {
+          const unsigned bytes = static_cast<unsigned>(n) - 59;
+          if (static_cast<std::size_t>(end - ip) < bytes) return -EINVAL;
+          n = 0;
+          for (unsigned i = 0; i < bytes; ++i) n |= std::size_t{ip[i]} << (8 * i);
+          ip += bytes;
+        }
+        ++n;
+        if (static_cast<std::size_t>(end - ip) < n || want - pos < n) return -EINVAL;
+        std::memcpy(base + pos, ip, n);
+        ip += n;
+        pos += n;
+        continue;
+      }
+      case 1:
+        if (ip == end) return -EINVAL;
+        n = 4 + ((tag >> 2) & 7);
+        offset = static_cast<std::size_t>(tag >> 5) << 8 | *ip++;
+        break;
+      case 2:
+        if (end - ip < 2) return -EINVAL;
+        n = 1 + (tag >> 2);
+        offset = std::size_t{ip[0]} | std::size_t{ip[1]} << 8;
+        ip += 2;
+        break;
+      default:
+        if (end - ip < 4) return -EINVAL;
+        n = 1 + (tag >> 2);
+        offset = load32(ip);
+        ip += 4;
+        break;
+    }
+    if (offset == 0 || offset > pos || want - pos < n) return -EINVAL;
+    for (std::size_t i = 0; i < n; ++i, ++pos) base[pos] = base[pos - offset];  // may overlap
+  }
+  return pos == want ? 0 : -EINVAL;
+}
+
+}  // namespace sysapm
@@ -0,0 +1,144 @@
+#include "sysapm/snapshot.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace sysapm {
+namespace {
+
+constexpr uint32_t kSnapshotMagic = 0x50414e53;  // "SNAP"
+constexpr uint32_t kSnapshotVersion = 2;
+enum : uint32_t { kRegistrySection = 1, kRollupSection = 2 };
+
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t body;  // bytes after the header
+  uint32_t checksum;
+  uint32_t reserved;
+};
+struct SectionHeader {
+  uint32_t tag;
+  uint32_t reserved;
+  uint64_t len;  // unpadded
+};
+
+uint32_t fnv1a(const uint8_t* p, std::size_t len) {
+  uint32_t h = 2166136261u;
+  for (std::size_t i = 0; i < len; ++i) h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+// Appends a section whose body `fill` writes.
+template <typename Fill>
+void section(std::vector<uint8_t>* out, uint32_t tag, Fill fill) {
+  const std::size_t at = out->size();
+  out->resize(at + sizeof(SectionHeader));
+  fill(out);
+  const SectionHeader sh{tag, 0, out->size() - at - sizeof(SectionHeader)};
+  std::memcpy(out->data() + at, &sh, sizeof sh);
+  out->resize((out->size() + 7) & ~std::size_t{7});
+}
+
+}  // namespace
+
+int write_snapshot(const std::string& path, const SeriesRegistry& registry, const RollupStage* rollup) {
+  std::vector<uint8_t> buf(sizeof(Header));
+  section(&buf, kRegistrySection, [&](std::vector<uint8_t>* out) { registry.save(out); });
+  if (rollup) section(&buf, kRollupSection, [&](std::vector<uint8_t>* out) { rollup->save(out); });
+  const Header h{kSnapshotMagic, kSnapshotVersion, buf.size() - sizeof(Header),
+                 fnv1a(buf.data() + sizeof(Header), buf.size() - sizeof(Header)), 0};
+  std::memcpy(buf.data(), &h, sizeof h);
+
+  const std::string tmp = path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return -errno;
+  for (std::size_t off = 0; off < buf.size();) {
+    const ssize_t n = ::write(fd, buf.data() + off, buf.size() - off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      const int err = errno;
+      ::close(fd);
+      ::unlink(tmp.c_str());
+      return -err;
+    }
+    off += static_cast<std::size_t>(n);
+  }
+  int rc = ::fdatasync(fd) < 0 ? -errno : 0;
+  if (::close(fd) < 0 && rc == 0) rc = -errno;
+  if (rc == 0 && ::rename(tmp.c_str(), path.c_str()) < 0) rc = -errno;
+  if (rc < 0) ::unlink(tmp.c_str());
+  return rc;
+}
+
+SnapshotReader::~SnapshotReader() { close(); }
+
+int SnapshotReader::open(const std::string& path) {
+  close();
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -errno;
+  struct stat st;
+  if (::fstat(fd, &st) < 0) {
+    const int err = errno;
+    ::close(fd);
+    return -err;
+  }
+  const auto len = static_cast<std::size_t>(st.st_size);
+  if (len < sizeof(Header) || len > INT_MAX) {
+    ::close(fd);
+    return -EINVAL;
+  }
+  void* m = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  ::close(fd);
+  if (m == MAP_FAILED) return -errno;
+  map_ = static_cast<const uint8_t*>(m);
+  len_ = len;
+  Header h;
+  std::memcpy(&h, map_, sizeof h);
+  if (h.magic != kSnapshotMagic || h.version != kSnapshotVersion || h.body != len - sizeof h ||
+      fnv1a(map_ + sizeof h, len - sizeof h) != h.checksum) {
+    close();
+    return -EINVAL;
+  }
+  return 0;
+}
+
+void SnapshotReader::close() {
+  if (map_) ::munmap(const_cast<uint8_t*>(map_), len_);
+  map_ = nullptr;
+  len_ = 0;
+}
+
+std::string_view SnapshotReader::section(uint32_t tag) const {
+  for (std::size_t at = sizeof(Header); at + sizeof(SectionHeader) <= len_;) {
+    SectionHeader sh;
+    std::memcpy(&sh, map_ + at, sizeof sh);
+    at += sizeof sh;
+    if (sh.len > len_ - at) break;
+    if (sh.tag == tag) return {reinterpret_cast<const char*>(map_ + at), static_cast<std::size_t>(sh.len)};
+    at += (sh.len + 7) & ~uint64_t{7};
+  }
+  return {};
+}
+
+int SnapshotReader::restore(SeriesRegistry* registry) const {
+  const std::string_view s = section(kRegistrySection);
+  if (!s.data()) return -ENODATA;
+  const int rc = registry->load(reinterpret_cast<const uint8_t*>(s.data()), s.size());
+  return rc < 0 ? rc : 0;
+}
+
+int SnapshotReader::restore(RollupStage* rollup) const {
+  const std::string_view s = section(kRollupSection);
+  if (!s.data()) return -ENODATA;
+  const int rc = rollup->load(reinterpret_cast<const uint8_t*>(s.data()), s.size());
+  return rc < 0 ? rc : 0;
+}
+
+}  // namespace sysapm
@@ -0,0 +1,329 @@
+#include "sysapm/spool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace sysapm {
+namespace {
+
+constexpr uint32_t kSpoolMagic = 0x4c4f5053;  // "SPOL"
+
+struct Cursor {
+  uint64_t seq;
+  uint64_t off;
+};
+
+uint32_t fnv1a(const void* data, std::size_t len) {
+  const auto* p = static_cast<const uint8_t*>(data);
+  uint32_t h = 2166136261u;
+  for (std::size_t i = 0; i < len; ++i) h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+std::size_t record_bytes(std::size_t len) { return sizeof(SpoolRecordHeader) + ((len + 7) & ~std::size_t{7}); }
+
+std::size_t round_up(std::size_t n, std::size_t to) { return (n + to - 1) / to * to; }
+
+bool parse_name(const char* name, uint64_t& seq) {
+  char tail[8];
+  unsigned long long v;
+  if (std::sscanf(name, "%16llx.%7s", &v, tail) != 2 || std::strcmp(tail, "spool") != 0) return false;
+  seq = v;
+  return true;
+}
+
+int pread_full(int fd, void* buf, std::size_t len, std::size_t off) {
+  auto* p = static_cast<uint8_t*>(buf);
+  while (len) {
+    ssize_t n = ::pread(fd, p, len, static_cast<off_t>(off));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -errno;
+    if (n == 0) return -ENODATA;
+    p += n;
+    off += static_cast<std::size_t>(n);
+    len -= static_cast<std::size_t>(n);
+  }
+  return 0;
+}
+
+}  // namespace
+
+Spool::~Spool() { close(); }
+
+std::string Spool::path(uint64_t seq) const {
+  char name[48];
+  std::snprintf(name, sizeof name, "/%016llx.spool", static_cast<unsigned long long>(seq));
+  return opts_.dir + name;
+}
+
+int Spool::open(const SpoolOptions& opts) {
+  close();
+  opts_ = opts;
+  opts_.buffer_bytes = std::max(round_up(opts_.buffer_bytes, kSpoolBlock), 2 * kSpoolBlock);
+  opts_.segment_bytes = std::max(opts_.segment_bytes, opts_.buffer_bytes);
+  opts_.max_bytes = std::max(opts_.max_bytes, opts_.segment_bytes);
+  segments_.clear();
+  stats_ = {};
+  pending_ = bytes_ = 0;
+  roff_ = rskip_ = 0;
+  if (::mkdir(opts_.dir.c_str(), 0755) < 0 && errno != EEXIST) return -errno;
+
+  DIR* d = ::opendir(opts_.dir.c_str());
+  if (!d) return -errno;
+  std::vector<uint64_t> seqs;
+  while (dirent* e = ::readdir(d)) {
+    uint64_t seq;
+    if (parse_name(e->d_name, seq)) seqs.push_back(seq);
+  }
+  ::closedir(d);
+  std::sort(seqs.begin(), seqs.end());
+  next_seq_ = seqs.empty() ? 1 : seqs.back() + 1;
+
+  cursor_fd_ = ::open((opts_.dir + "/cursor").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (cursor_fd_ < 0) return -errno;
+  Cursor cur{0, 0};
+  if (pread_full(cursor_fd_, &cur, sizeof cur, 0) < 0) cur = {0, 0};
+
+  for (uint64_t seq : seqs) {
+    Segment seg{seq, 0, 0};
+    // Segments the cursor has moved past were replayed completely.
+    if (seq >= cur.seq) scan(seg);
+    if (seg.records == 0) {
+      ::unlink(path(seq).c_str());
+      continue;
+    }
+    stats_.recovered += seg.records;
+    pending_ += seg.records;
+    bytes_ += seg.size;
+    segments_.push_back(seg);
+  }
+  if (!segments_.empty() && segments_.front().seq == cur.seq) {
+    // Skip what was popped: walk the headers up to the saved offset.
+    int fd = ::open(path(cur.seq).c_str(), O_RDONLY | O_CLOEXEC);
+    SpoolRecordHeader h;
+    while (fd >= 0 && roff_ < std::min<std::size_t>(cur.off, segments_.front().size) &&
+           pread_full(fd, &h, sizeof h, roff_) == 0) {
+      roff_ += record_bytes(h.len);
+      ++rskip_;
+    }
+    if (fd >= 0) ::close(fd);
+    pending_ -= rskip_;
+    stats_.recovered -= rskip_;
+  }
+
+  void* mem = std::aligned_alloc(kSpoolBlock, opts_.buffer_bytes);
+  if (!mem) return -ENOMEM;
+  buf_ = {static_cast<uint8_t*>(mem), std::free};
+  open_ = true;
+  if (int rc = start_segment(); rc < 0) {
+    close();
+    return rc;
+  }
+  evict();
+  return 0;
+}
+
+void Spool::scan(Segment& seg) {
+  int fd = ::open(path(seg.seq).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  std::vector<uint8_t> payload;
+  SpoolRecordHeader h;
+  // The first zero block, torn write or foreign record ends the segment.
+  while (pread_full(fd, &h, sizeof h, seg.size) == 0 && h.magic == kSpoolMagic && h.len <= opts_.buffer_bytes) {
+    payload.resize(h.len);
+    if (pread_full(fd, payload.data(), h.len, seg.size + sizeof h) < 0 || fnv1a(payload.data(), h.len) != h.checksum)
+      break;
+    seg.size += record_bytes(h.len);
+    ++seg.records;
+  }
+  ::close(fd);
+}
+
+int Spool::start_segment() {
+  const uint64_t seq = next_seq_++;
+  const std::string p = path(seq);
+  const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  fd_ = -1;
+  if (opts_.direct) fd_ = ::open(p.c_str(), flags | O_DIRECT, 0644);
+  stats_.direct = fd_ >= 0;
+  if (fd_ < 0) fd_ = ::open(p.c_str(), flags, 0644);  // e.g. tmpfs refuses O_DIRECT
+  if (fd_ < 0) return -errno;
+  segments_.push_back({seq, 0, 0});
+  buf_base_ = 0;
+  buf_len_ = 0;
+  return 0;
+}
+
+int Spool::flush() {
+  if (buf_len_ == 0) return 0;
+  const std::size_t len = round_up(buf_len_, kSpoolBlock);
+  std::memset(buf_.get() + buf_len_, 0, len - buf_len_);
+  for (std::size_t off = 0; off < len;) {
+    ssize_t n = ::pwrite(fd_, buf_.get() + off, len - off, static_cast<off_t>(buf_base_ + off));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      ++stats_.write_errors;
+      return n < 0 ? -errno : -EIO;
+    }
+    off += static_cast<std::size_t>(n);
+  }
+  // Keep the partial block: the next flush rewrites it with more records.
+  const std::size_t full = buf_len_ / kSpoolBlock * kSpoolBlock;
+  std::memmove(buf_.get(), buf_.get() + full, buf_len_ - full);
+  buf_base_ += full;
+  buf_len_ -= full;
+  return 0;
+}
+
+int Spool::finish_active() {
+  int rc = flush();
+  if (rc == 0 && ::fdatasync(fd_) < 0) rc = -errno;
+  ++stats_.syncs;
+  ::close(fd_);
+  fd_ = -1;
+  return rc;
+}
+
+int Spool::append(const void* data, std::size_t len, uint32_t points) {
+  if (!open_) return -EBADF;
+  const std::size_t rec = record_bytes(len);
+  if (rec + kSpoolBlock > opts_.buffer_bytes) return -EFBIG;
+  if (segments_.back().records && segments_.back().size + rec > opts_.segment_bytes) {
+    if (int rc = finish_active(); rc < 0) return rc;
+    if (int rc = start_segment(); rc < 0) return rc;
+  }
+  if (buf_len_ + rec > opts_.buffer_bytes)
+    if (int rc = flush(); rc < 0) return rc;
+  uint8_t* p = buf_.get() + buf_len_;
+  const SpoolRecordHeader h{kSpoolMagic, static_cast<uint32_t>(len), points, fnv1a(data, len)};
+  std::memcpy(p, &h, sizeof h);
+  std::memcpy(p + sizeof h, data, len);
+  std::memset(p + sizeof h + len, 0, rec - sizeof h - len);
+  buf_len_ += rec;
+  Segment& a = segments_.back();
+  a.size += rec;
+  ++a.records;
+  ++pending_;
+  bytes_ += rec;
+  ++stats_.appended;
+  dirty_ = true;
+  evict();
+  return 0;
+}
+
+void Spool::advance_segment() {
+  const Segment& s = segments_.front();
+  ::unlink(path(s.seq).c_str());
+  bytes_ -= s.size;
+  if (rfd_ >= 0) ::close(rfd_);
+  rfd_ = -1;
+  segments_.erase(segments_.begin());
+  roff_ = 0;
+  rskip_ = 0;
+  dirty_ = true;  // the cursor moved
+}
+
+void Spool::evict() {
+  while (bytes_ > opts_.max_bytes && segments_.size() > 1) {
+    const std::size_t lost = segments_.front().records - rskip_;
+    pending_ -= lost;
+    stats_.dropped += lost;
+    advance_segment();
+  }
+}
+
+int Spool::pop(std::vector<uint8_t>* out, uint32_t* points) {
+  while (pending_ > 0) {
+    Segment& s = segments_.front();
+    if (roff_ >= s.size) {
+      if (segments_.size() == 1) return 0;
+      advance_segment();
+      continue;
+    }
+    const bool active = segments_.size() == 1;
+    SpoolRecordHeader h;
+    int rc = 0;
+    if (active && roff_ >= buf_base_) {
+      // Not necessarily on disk yet; the buffer has it.
+      std::memcpy(&h, buf_.get() + (roff_ - buf_base_), sizeof h);
+      out->assign(buf_.get() + (roff_ - buf_base_) + sizeof h, buf_.get() + (roff_ - buf_base_) + sizeof h + h.len);
+    } else {
+      if (rfd_ < 0 || rseq_ != s.seq) {
+        if (rfd_ >= 0) ::close(rfd_);
+        rfd_ = ::open(path(s.seq).c_str(), O_RDONLY | O_CLOEXEC);
+        if (rfd_ < 0) return -errno;
+        rseq_ = s.seq;
+      }
+      rc = pread_full(rfd_, &h, sizeof h, roff_);
+      if (rc == 0 && h.magic == kSpoolMagic && h.len <= opts_.buffer_bytes) {
+        out->resize(h.len);
+        rc = pread_full(rfd_, out->data(), h.len, roff_ + sizeof h);
+      }
+    }
+    if (rc < 0 && rc != -ENODATA) return rc;
+    if (rc < 0 || h.magic != kSpoolMagic || fnv1a(out->data(), out->size()) != h.checksum) {
+      // Damaged on disk: give up on the rest of this segment.
+      const std::size_t lost = s.records - rskip_;
+      pending_ -= lost;
+      stats_.dropped += lost;
+      rskip_ = s.records;
+      roff_ = s.size;
+      continue;
+    }
+    *points = h.points;
+    roff_ += record_bytes(h.len);
+    ++rskip_;
+    --pending_;
+    ++stats_.popped;
+    dirty_ = true;
+    return 1;
+  }
+  return 0;
+}
+
+void Spool::save_cursor() {
+  const Cursor c{segments_.front().seq, roff_};
+  if (::pwrite(cursor_fd_, &c, sizeof c, 0) != static_cast<ssize_t>(sizeof c)) ++stats_.write_errors;
+}
+
+int Spool::sync(int64_t now_ns, bool force) {
+  if (!open_ || !dirty_) return 0;
+  if (!force && now_ns - last_sync_ns_ < opts_.sync_interval_ns) return 0;
+  int rc = flush();
+  if (rc == 0 && ::fdatasync(fd_) < 0) rc = -errno;
+  save_cursor();
+  ++stats_.syncs;
+  last_sync_ns_ = now_ns;
+  dirty_ = false;
+  return rc;
+}
+
+void Spool::close() {
+  if (open_) {
+    sync(0, true);
+    ::close(fd_);
+    fd_ = -1;
+  }
+  if (rfd_ >= 0) ::close(rfd_);
+  rfd_ = -1;
+  if (cursor_fd_ >= 0) ::close(cursor_fd_);
+  cursor_fd_ = -1;
+  open_ = false;
+}
+
+SpoolStats Spool::stats() const {
+  SpoolStats st = stats_;
+  st.pending = pending_;
+  st.bytes = bytes_;
+  st.segments = segments_.size();
+  return st;
+}
+
+}  // namespace sysapm
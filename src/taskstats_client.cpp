@@ -0,0 +1,235 @@
+#include "sysapm/taskstats_client.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <linux/taskstats.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace sysapm {
+namespace {
+
+constexpr std::size_t kRxSlot = 2048;  // one reply datagram (~600 bytes)
+constexpr std::size_t kRxSlots = 64;   // datagrams per recvmmsg()
+constexpr std::size_t kRequestLen = NLMSG_ALIGN(NLMSG_LENGTH(GENL_HDRLEN + NLA_HDRLEN + sizeof(uint32_t)));
+
+nlattr* attr_at(void* base, std::size_t off) {
+  return reinterpret_cast<nlattr*>(static_cast<unsigned char*>(base) + off);
+}
+
+void* attr_data(nlattr* a) { return reinterpret_cast<unsigned char*>(a) + NLA_HDRLEN; }
+
+// Walks the attributes in [p, p+len), calling fn(attr) for each.
+template <typename Fn>
+void for_each_attr(void* p, std::size_t len, Fn&& fn) {
+  std::size_t off = 0;
+  while (off + NLA_HDRLEN <= len) {
+    nlattr* a = attr_at(p, off);
+    if (a->nla_len < NLA_HDRLEN || off + a->nla_len > len) return;
+    fn(a);
+    off += NLA_ALIGN(a->nla_len);
+  }
+}
+
+void fill_record(const taskstats& ts, TaskstatsRecord& r) {
+  r.cpu_ns = ts.cpu_run_real_total;
+  r.cpu_count = ts.cpu_count;
+  r.cpu_delay_ns = ts.cpu_delay_total;
+  r.blkio_delay_ns = ts.blkio_delay_total;
+  r.swapin_delay_ns = ts.swapin_delay_total;
+  r.freepages_delay_ns = ts.freepages_delay_total;
+  r.thrashing_delay_ns = ts.thrashing_delay_total;
+  r.voluntary_ctxt = ts.nvcsw;
+  r.nonvoluntary_ctxt = ts.nivcsw;
+}
+
+}  // namespace
+
+TaskstatsClient::~TaskstatsClient() { close(); }
+
+void TaskstatsClient::close() {
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+}
+
+int TaskstatsClient::open(std::size_t batch) {
+  close();
+  batch_ = batch ? batch : kDefaultBatch;
+  int fd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+  if (fd < 0) return -errno;
+  // Every request in a batch is answered before we read; size the queue
+  // for a whole batch of replies including skb overhead.
+  int rcvbuf = static_cast<int>(batch_ * 4096);
+  if (::setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof rcvbuf) < 0)
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+  timeval tv{0, 200000};  // a lost reply must not stall the tick
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  sockaddr_nl addr{};
+  addr.nl_family = AF_NETLINK;
+  if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0) {
+    int err = -errno;
+    ::close(fd);
+    return err;
+  }
+  fd_ = fd;
+  tx_.assign(batch_ * kRequestLen, 0);
+  rx_.assign(kRxSlots * kRxSlot, 0);
+  syscalls_ = 0;
+
+  if (int rc = resolve_family(); rc < 0) {
+    close();
+    return rc;
+  }
+  // Queries are privileged; find out now rather than on the first tick.
+  int32_t self = static_cast<int32_t>(getpid());
+  TaskstatsRecord rec;
+  int rc = query(&self, 1, &rec);
+  if (rc < 0) {
+    close();
+    return rc;
+  }
+  if (rc == 0) {
+    close();
+    return -EPERM;
+  }
+  return 0;
+}
+
+int TaskstatsClient::resolve_family() {
+  alignas(nlmsghdr) unsigned char req[NLMSG_SPACE(GENL_HDRLEN + NLA_HDRLEN + 16)] = {};
+  auto* nl = reinterpret_cast<nlmsghdr*>(req);
+  auto* genl = static_cast<genlmsghdr*>(NLMSG_DATA(nl));
+  genl->cmd = CTRL_CMD_GETFAMILY;
+  genl->version = 1;
+  nlattr* a = attr_at(genl, GENL_HDRLEN);
+  const char name[] = TASKSTATS_GENL_NAME;
+  a->nla_type = CTRL_ATTR_FAMILY_NAME;
+  a->nla_len = static_cast<uint16_t>(NLA_HDRLEN + sizeof name);
+  std::memcpy(attr_data(a), name, sizeof name);
+  nl->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_ALIGN(a->nla_len));
+  nl->nlmsg_type = GENL_ID_CTRL;
+  nl->nlmsg_flags = NLM_F_REQUEST;
+  nl->nlmsg_seq = 1;
+  ++syscalls_;
+  if (::send(fd_, req, nl->nlmsg_len, 0) < 0) return -errno;
+
+  ++syscalls_;
+  ssize_t n = ::recv(fd_, rx_.data(), rx_.size(), 0);
+  if (n < 0) return -errno;
+  auto* rep = reinterpret_cast<nlmsghdr*>(rx_.data());
+  if (!NLMSG_OK(rep, static_cast<std::size_t>(n))) return -EPROTO;
+  if (rep->nlmsg_type == NLMSG_ERROR) {
+    int err = static_cast<nlmsgerr*>(NLMSG_DATA(rep))->error;
+    return err ? err : -EPROTO;  // -ENOENT: no taskstats family
+  }
+  auto* rgenl = static_cast<genlmsghdr*>(NLMSG_DATA(rep));
+  for_each_attr(attr_at(rgenl, GENL_HDRLEN), rep->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+                [this](nlattr* attr) {
+                  if (attr->nla_type == CTRL_ATTR_FAMILY_ID)
+                    std::memcpy(&family_, attr_data(attr), sizeof family_);
+                });
+  return family_ ? 0 : -EPROTO;
+}
+
+int TaskstatsClient::send_batch(const int32_t* tgids, std::size_t n) {
+  // Requests go back to back in one datagram; the kernel walks every
+  // nlmsghdr in it and answers each with its own reply.
+  for (std::size_t i = 0; i < n; ++i) {
+    auto* nl = reinterpret_cast<nlmsghdr*>(tx_.data() + i * kRequestLen);
+    nl->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_HDRLEN + sizeof(uint32_t));
+    nl->nlmsg_type = family_;
+    nl->nlmsg_flags = NLM_F_REQUEST;
+    nl->nlmsg_seq = seq_base_ + static_cast<uint32_t>(i);
+    nl->nlmsg_pid = 0;
+    auto* genl = static_cast<genlmsghdr*>(NLMSG_DATA(nl));
+    genl->cmd = TASKSTATS_CMD_GET;
+    genl->version = TASKSTATS_GENL_VERSION;
+    genl->reserved = 0;
+    nlattr* a = attr_at(genl, GENL_HDRLEN);
+    a->nla_type = TASKSTATS_CMD_ATTR_TGID;
+    a->nla_len = NLA_HDRLEN + sizeof(uint32_t);
+    uint32_t tgid = static_cast<uint32_t>(tgids[i]);
+    std::memcpy(attr_data(a), &tgid, sizeof tgid);
+  }
+  ++syscalls_;
+  for (;;) {
+    if (::send(fd_, tx_.data(), n * kRequestLen, 0) >= 0) return 0;
+    if (errno != EINTR) return -errno;
+  }
+}
+
+int TaskstatsClient::receive(std::size_t expected, const int32_t* tgids, TaskstatsRecord* out,
+                             std::size_t* got) {
+  mmsghdr msgs[kRxSlots];
+  iovec iov[kRxSlots];
+  std::size_t answered = 0;
+  while (answered < expected) {
+    for (std::size_t i = 0; i < kRxSlots; ++i) {
+      iov[i] = {rx_.data() + i * kRxSlot, kRxSlot};
+      msgs[i] = {};
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    std::size_t want = expected - answered < kRxSlots ? expected - answered : kRxSlots;
+    ++syscalls_;
+    int r = ::recvmmsg(fd_, msgs, static_cast<unsigned>(want), MSG_WAITFORONE, nullptr);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -errno;  // -EAGAIN: timed out waiting for replies
+    }
+    for (int m = 0; m < r; ++m) {
+      auto* nl = reinterpret_cast<nlmsghdr*>(iov[m].iov_base);
+      std::size_t len = msgs[m].msg_len;
+      for (; NLMSG_OK(nl, len); nl = NLMSG_NEXT(nl, len)) {
+        uint32_t idx = nl->nlmsg_seq - seq_base_;
+        if (idx >= expected) continue;  // stale reply from an earlier batch
+        ++answered;
+        if (nl->nlmsg_type == NLMSG_ERROR) {
+          int err = static_cast<nlmsgerr*>(NLMSG_DATA(nl))->error;
+          if (err == -EPERM || err == -EACCES) return err;
+          continue;  // -ESRCH: exited since we listed it
+        }
+        if (nl->nlmsg_type != family_) continue;
+        auto* genl = static_cast<genlmsghdr*>(NLMSG_DATA(nl));
+        TaskstatsRecord& rec = out[*got];
+        bool filled = false;
+        for_each_attr(attr_at(genl, GENL_HDRLEN), nl->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+                      [&](nlattr* agg) {
+                        if (agg->nla_type != TASKSTATS_TYPE_AGGR_TGID) return;
+                        for_each_attr(attr_data(agg), agg->nla_len - NLA_HDRLEN, [&](nlattr* a) {
+                          if (a->nla_type != TASKSTATS_TYPE_STATS) return;
+                          // Older kernels send a shorter struct; zero the tail.
+                          taskstats ts{};
+                          std::size_t n = a->nla_len - NLA_HDRLEN;
+                          std::memcpy(&ts, attr_data(a), n < sizeof ts ? n : sizeof ts);
+                          rec = {};
+                          rec.tgid = tgids[idx];
+                          fill_record(ts, rec);
+                          filled = true;
+                        });
+                      });
+        if (filled) ++*got;
+      }
+    }
+  }
+  return 0;
+}
+
+int TaskstatsClient::query(const int32_t* tgids, std::size_t n, TaskstatsRecord* out) {
+  if (fd_ < 0) return -EBADF;
+  std::size_t got = 0;
+  for (std::size_t off = 0; off < n; off += batch_) {
+    std::size_t k = n - off < batch_ ? n - off : batch_;
+    // Fresh sequence numbers per batch so late replies cannot be mistaken
+    // for answers to this one.
+    seq_base_ += static_cast<uint32_t>(batch_);
+    if (int rc = send_batch(tgids + off, k); rc < 0) return rc;
+    if (int rc = receive(k, tgids + off, out, &got); rc < 0) return rc;
+  }
+  return static_cast<int>(got);
+}
+
+}  // namespace sysapm
@@ -0,0 +1,365 @@
+#include "sysapm/thread_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <iterator>
+#include <system_error>
+
+#include "sysapm/clock.hpp"
+
+namespace sysapm {
+namespace {
+
+constexpr unsigned kMaxDefaultWorkers = 8;
+constexpr int64_t kMaxThrottleSleepNs = 100000000;
+
+// Which pool and worker the current thread is, if any.
+thread_local const void* tl_pool = nullptr;
+thread_local unsigned tl_worker = 0;
+
+}  // namespace
+
+ThreadPool::~ThreadPool() { stop(); }
+
+int ThreadPool::start(const PoolOptions& opts) {
+  if (!workers_.empty()) return -EBUSY;
+  opts_ = opts;
+  unsigned n = opts_.workers;
+  if (n == 0) n = std::clamp(std::thread::hardware_concurrency(), 1u, kMaxDefaultWorkers);
+  nodes_.clear();
+  for (const NumaNode& nn : opts_.nodes) {
+    auto node = std::make_unique<Node>();
+    node->id = nn.id;
+    node->policy = opts_.policy;
+    // Only the node's housekeeping CPUs; a node with none gets no workers.
+    if (!opts_.policy.cpus.empty()) {
+      node->policy.cpus.clear();
+      std::set_intersection(nn.cpus.begin(), nn.cpus.end(), opts_.policy.cpus.begin(), opts_.policy.cpus.end(),
+                            std::back_inserter(node->policy.cpus));
+    } else {
+      node->policy.cpus = nn.cpus;
+    }
+    if (!node->policy.cpus.empty()) nodes_.push_back(std::move(node));
+  }
+  if (!nodes_.empty()) n = std::max(n, static_cast<unsigned>(nodes_.size()));
+  stopping_.store(false);
+  tokens_ = opts_.cpu_budget * static_cast<double>(opts_.budget_window_ns);
+  refill_ns_ = clock_ns(CLOCK_MONOTONIC);
+  for (unsigned i = 0; i < n; ++i) {
+    workers_.push_back(std::make_unique<Worker>(opts_.deque_capacity));
+    workers_.back()->seed = 0x9e3779b97f4a7c15ull * (i + 1);
+    if (!nodes_.empty()) {
+      workers_.back()->node = static_cast<int>(i % nodes_.size());
+      nodes_[i % nodes_.size()]->workers.push_back(i);
+    }
+  }
+  // Every deque exists before any worker looks for a victim.
+  try {
+    for (unsigned i = 0; i < n; ++i) workers_[i]->thread = std::thread([this, i] { run(i); });
+  } catch (const std::system_error& e) {
+    stop();
+    return -e.code().value();
+  }
+  return 0;
+}
+
+void ThreadPool::stop() {
+  if (workers_.empty()) return;
+  stopping_.store(true);
+  {
+    std::lock_guard<std::mutex> lk(park_mu_);
+    park_cv_.notify_all();
+    for (auto& node : nodes_) node->park.notify_all();
+  }
+  for (auto& w : workers_)
+    if (w->thread.joinable()) w->thread.join();
+  workers_.clear();
+  nodes_.clear();
+}
+
+void ThreadPool::submit(std::function<void()> fn) {
+  if (workers_.empty() || stopping_.load(std::memory_order_relaxed)) {
+    inlined_.fetch_add(1, std::memory_order_relaxed);
+    fn();
+    return;
+  }
+  enqueue(new Task{std::move(fn)});
+}
+
+void ThreadPool::submit(std::function<void()> fn, int node) {
+  const int idx = node_index(node);
+  if (idx < 0 || workers_.empty() || stopping_.load(std::memory_order_relaxed)) {
+    submit(std::move(fn));
+    return;
+  }
+  enqueue(new Task{std::move(fn), idx});
+}
+
+int ThreadPool::node_index(int id) const {
+  if (id < 0) return -1;
+  for (std::size_t i = 0; i < nodes_.size(); ++i)
+    if (nodes_[i]->id == id) return static_cast<int>(i);
+  return -1;
+}
+
+int ThreadPool::current_node() const {
+  if (tl_pool != this || tl_worker >= workers_.size()) return -1;
+  const int idx = workers_[tl_worker]->node;
+  return idx < 0 ? -1 : nodes_[static_cast<std::size_t>(idx)]->id;
+}
+
+void ThreadPool::enqueue(Task* t) {
+  // Count first: a worker that sees queued_ == 0 after announcing itself
+  // as a sleeper is guaranteed to be notified below.
+  queued_.fetch_add(1);
+  const bool mine = tl_pool == this;
+  Worker* w = mine ? workers_[tl_worker].get() : nullptr;
+  if (t->node >= 0 && (!w || w->node != t->node)) {
+    // Off every deque, so other nodes' thieves come to it last.
+    Node& node = *nodes_[static_cast<std::size_t>(t->node)];
+    std::lock_guard<std::mutex> lk(node.mu);
+    node.inject.push_back(t);
+  } else if (!w || !w->deque.push(t)) {
+    std::lock_guard<std::mutex> lk(inject_mu_);
+    inject_.push_back(t);
+  }
+  if (!mine) injected_.fetch_add(1, std::memory_order_relaxed);
+  if (sleepers_.load() > 0) wake(t->node);
+}
+
+void ThreadPool::wake(int node) {
+  std::lock_guard<std::mutex> lk(park_mu_);
+  if (nodes_.empty()) {
+    park_cv_.notify_one();
+    return;
+  }
+  // The task's own node first; only a node-bound task with no sleeper
+  // there wakes a worker elsewhere.
+  if (node >= 0 && nodes_[static_cast<std::size_t>(node)]->sleepers) {
+    nodes_[static_cast<std::size_t>(node)]->park.notify_one();
+    return;
+  }
+  for (auto& n : nodes_)
+    if (n->sleepers) {
+      n->park.notify_one();
+      return;
+    }
+}
+
+ThreadPool::Task* ThreadPool::take(unsigned self) {
+  Worker& w = *workers_[self];
+  if (Task* t = w.deque.pop()) return took(t, w);
+  if (w.node >= 0) {
+    Node& node = *nodes_[static_cast<std::size_t>(w.node)];
+    std::lock_guard<std::mutex> lk(node.mu);
+    if (!node.inject.empty()) {
+      Task* t = node.inject.front();
+      node.inject.pop_front();
+      return took(t, w);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lk(inject_mu_);
+    if (!inject_.empty()) {
+      Task* t = inject_.front();
+      inject_.pop_front();
+      return took(t, w);
+    }
+  }
+  if (Task* t = steal(self, true)) return t;
+  if (nodes_.empty()) return nullptr;
+  // The whole node is idle: help the others.
+  if (Task* t = steal(self, false)) return t;
+  for (std::size_t i = 0; i < nodes_.size(); ++i) {
+    if (static_cast<int>(i) == w.node) continue;
+    Node& node = *nodes_[i];
+    std::lock_guard<std::mutex> lk(node.mu);
+    if (!node.inject.empty()) {
+      Task* t = node.inject.front();
+      node.inject.pop_front();
+      return took(t, w);
+    }
+  }
+  return nullptr;
+}
+
+ThreadPool::Task* ThreadPool::steal(unsigned self, bool same_node) {
+  Worker& w = *workers_[self];
+  const unsigned n = static_cast<unsigned>(workers_.size());
+  w.seed ^= w.seed << 13;
+  w.seed ^= w.seed >> 7;
+  w.seed ^= w.seed << 17;
+  const unsigned first = static_cast<unsigned>(w.seed % n);
+  for (unsigned i = 0; i < n; ++i) {
+    const unsigned victim = (first + i) % n;
+    if (victim == self || (workers_[victim]->node == w.node) != same_node) continue;
+    if (Task* t = workers_[victim]->deque.steal()) {
+      steals_.fetch_add(1, std::memory_order_relaxed);
+      return took(t, w);
+    }
+  }
+  return nullptr;
+}
+
+ThreadPool::Task* ThreadPool::took(Task* t, const Worker& w) {
+  queued_.fetch_sub(1);
+  if (t->node >= 0 && t->node != w.node) remote_.fetch_add(1, std::memory_order_relaxed);
+  return t;
+}
+
+void ThreadPool::run(unsigned self) {
+  tl_pool = this;
+  tl_worker = self;
+  const int node = workers_[self]->node;
+  apply_thread_policy(node < 0 ? opts_.policy : nodes_[static_cast<std::size_t>(node)]->policy);
+  for (;;) {
+    Task* t = take(self);
+    if (!t) {
+      if (stopping_.load() && queued_.load() <= 0) return;
+      std::unique_lock<std::mutex> lk(park_mu_);
+      Node* home = node < 0 ? nullptr : nodes_[static_cast<std::size_t>(node)].get();
+      sleepers_.fetch_add(1);
+      if (home) ++home->sleepers;
+      // A steal that lost a race leaves queued_ > 0: look again at once.
+      (home ? home->park : park_cv_).wait(lk, [&] { return queued_.load() > 0 || stopping_.load(); });
+      if (home) --home->sleepers;
+      sleepers_.fetch_sub(1);
+      continue;
+    }
+    throttle();
+    const int64_t c0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    t->fn();
+    delete t;
+    charge(clock_ns(CLOCK_THREAD_CPUTIME_ID) - c0);
+    tasks_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void ThreadPool::charge(int64_t cpu_ns) {
+  cpu_ns_.fetch_add(static_cast<uint64_t>(cpu_ns), std::memory_order_relaxed);
+  if (opts_.cpu_budget <= 0) return;
+  std::lock_guard<std::mutex> lk(budget_mu_);
+  tokens_ -= static_cast<double>(cpu_ns);
+}
+
+void ThreadPool::throttle() {
+  if (opts_.cpu_budget <= 0) return;
+  const double burst = opts_.cpu_budget * static_cast<double>(opts_.budget_window_ns);
+  for (;;) {
+    int64_t wait_ns;
+    {
+      std::lock_guard<std::mutex> lk(budget_mu_);
+      const int64_t now = clock_ns(CLOCK_MONOTONIC);
+      tokens_ = std::min(burst, tokens_ + static_cast<double>(now - refill_ns_) * opts_.cpu_budget);
+      refill_ns_ = now;
+      if (tokens_ > 0 || stopping_.load(std::memory_order_relaxed)) return;
+      wait_ns = static_cast<int64_t>(-tokens_ / opts_.cpu_budget) + 1;
+    }
+    wait_ns = std::min(wait_ns, kMaxThrottleSleepNs);
+    timespec ts{static_cast<time_t>(wait_ns / 1000000000), static_cast<long>(wait_ns % 1000000000)};
+    const int64_t t0 = clock_ns(CLOCK_MONOTONIC);
+    nanosleep(&ts, nullptr);
+    throttled_ns_.fetch_add(static_cast<uint64_t>(clock_ns(CLOCK_MONOTONIC) - t0), std::memory_order_relaxed);
+  }
+}
+
+void ThreadPool::parallel_for(std::size_t n, std::size_t grain,
+                              const std::function<void(std::size_t, std::size_t)>& fn) {
+  if (n == 0) return;
+  grain = std::max<std::size_t>(grain, 1);
+  const std::size_t chunks = (n + grain - 1) / grain;
+  struct Shared {
+    std::atomic<std::size_t> next{0};
+    std::atomic<std::size_t> done{0};
+    std::mutex mu;
+    std::condition_variable cv;
+  };
+  auto sh = std::make_shared<Shared>();
+  // Each helper claims chunks until none are left; the caller also helps,
+  // so chunks still queued when it finishes just find nothing to do.
+  auto drain = [sh, n, grain, chunks, &fn] {
+    std::size_t c;
+    while ((c = sh->next.fetch_add(1, std::memory_order_relaxed)) < chunks) {
+      fn(c * grain, std::min(n, (c + 1) * grain));
+      if (sh->done.fetch_add(1, std::memory_order_acq_rel) + 1 == chunks) {
+        std::lock_guard<std::mutex> lk(sh->mu);
+        sh->cv.notify_all();
+      }
+    }
+  };
+  const std::size_t helpers = std::min<std::size_t>(workers_.size(), chunks - 1);
+  for (std::size_t i = 0; i < helpers; ++i) submit(drain);
+  drain();
+  std::unique_lock<std::mutex> lk(sh->mu);
+  sh->cv.wait(lk, [&] { return sh->done.load(std::memory_order_acquire) == chunks; });
+}
+
+void ThreadPool::parallel_for(const std::vector<NodeRange>& ranges, std::size_t grain,
+                              const std::function<void(std::size_t, std::size_t)>& fn) {
+  grain = std::max<std::size_t>(grain, 1);
+  struct Shared {
+    std::vector<NodeRange> ranges;
+    std::vector<std::size_t> chunks;                 // per range
+    std::unique_ptr<std::atomic<std::size_t>[]> next;  // chunks claimed, per range
+    std::size_t total = 0;
+    std::atomic<std::size_t> done{0};
+    std::mutex mu;
+    std::condition_variable cv;
+  };
+  auto sh = std::make_shared<Shared>();
+  sh->ranges = ranges;
+  sh->next = std::make_unique<std::atomic<std::size_t>[]>(ranges.size());
+  for (const NodeRange& r : ranges) {
+    sh->chunks.push_back(r.end > r.begin ? (r.end - r.begin + grain - 1) / grain : 0);
+    sh->total += sh->chunks.back();
+  }
+  if (sh->total == 0) return;
+  // Like parallel_for(), but a helper starts on its own range and sweeps
+  // the others once that is claimed.
+  auto drain = [sh, grain, &fn](std::size_t first) {
+    const std::size_t nr = sh->ranges.size();
+    for (std::size_t k = 0; k < nr; ++k) {
+      const std::size_t r = (first + k) % nr;
+      std::size_t c;
+      while ((c = sh->next[r].fetch_add(1, std::memory_order_relaxed)) < sh->chunks[r]) {
+        const std::size_t b = sh->ranges[r].begin + c * grain;
+        fn(b, std::min(sh->ranges[r].end, b + grain));
+        if (sh->done.fetch_add(1, std::memory_order_acq_rel) + 1 == sh->total) {
+          std::lock_guard<std::mutex> lk(sh->mu);
+          sh->cv.notify_all();
+        }
+      }
+    }
+  };
+  const int here = current_node();
+  std::size_t mine = 0;
+  for (std::size_t r = 0; r < ranges.size(); ++r)
+    if (ranges[r].node == here) mine = r;
+  std::size_t spare = workers_.size();
+  for (std::size_t r = 0; r < ranges.size() && spare; ++r) {
+    const int idx = node_index(ranges[r].node);
+    std::size_t helpers = idx < 0 ? workers_.size() : nodes_[static_cast<std::size_t>(idx)]->workers.size();
+    helpers = std::min({helpers, sh->chunks[r] - (r == mine && sh->chunks[r] ? 1 : 0), spare});
+    spare -= helpers;
+    for (std::size_t i = 0; i < helpers; ++i) submit([drain, r] { drain(r); }, ranges[r].node);
+  }
+  drain(mine);
+  std::unique_lock<std::mutex> lk(sh->mu);
+  sh->cv.wait(lk, [&] { return sh->done.load(std::memory_order_acquire) == sh->total; });
+}
+
+ThreadPoolStats ThreadPool::stats() const {
+  ThreadPoolStats st;
+  st.tasks = tasks_.load(std::memory_order_relaxed);
+  st.inlined = inlined_.load(std::memory_order_relaxed);
+  st.injected = injected_.load(std::memory_order_relaxed);
+  st.steals = steals_.load(std::memory_order_relaxed);
+  st.remote = remote_.load(std::memory_order_relaxed);
+  st.queued = static_cast<uint64_t>(std::max<int64_t>(queued_.load(std::memory_order_relaxed), 0));
+  st.cpu_ns = cpu_ns_.load(std::memory_order_relaxed);
+  st.throttled_ns = throttled_ns_.load(std::memory_order_relaxed);
+  return st;
+}
+
+}  // namespace sysapm
@@ -0,0 +1,129 @@
+#include "sysapm/tick_scheduler.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "sysapm/clock.hpp"
+#include "sysapm/text.hpp"
+
+namespace sysapm {
+namespace {
+
+timespec to_timespec(int64_t ns) {
+  return {static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000)};
+}
+
+}  // namespace
+
+TickScheduler::~TickScheduler() { close(); }
+
+int TickScheduler::open(int64_t interval_ns) {
+  close();
+  if (interval_ns <= 0) return -EINVAL;
+  int fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (fd < 0) return -errno;
+  fd_ = fd;
+  interval_ns_ = interval_ns;
+  next_real_ = (clock_ns(CLOCK_REALTIME) / interval_ns + 1) * interval_ns;
+  skipped_total_ = pending_skipped_ = 0;
+  woken_.store(false);
+  return 0;
+}
+
+void TickScheduler::close() {
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+}
+
+int TickScheduler::arm() {
+  const int64_t real = clock_ns(CLOCK_REALTIME);
+  const int64_t mono = clock_ns(CLOCK_MONOTONIC);
+  if (next_real_ <= real) {
+    // Overran: skip to the next boundary instead of firing the missed ones.
+    const uint64_t missed = static_cast<uint64_t>((real - next_real_) / interval_ns_) + 1;
+    next_real_ += static_cast<int64_t>(missed) * interval_ns_;
+    pending_skipped_ += missed;
+    skipped_total_ += missed;
+  } else if (next_real_ > real + interval_ns_) {
+    next_real_ = (real / interval_ns_ + 1) * interval_ns_;  // the clock stepped back
+  }
+  armed_mono_ = mono + (next_real_ - real);
+  itimerspec its{};
+  its.it_value = to_timespec(armed_mono_);
+  if (::timerfd_settime(fd_, TFD_TIMER_ABSTIME, &its, nullptr) < 0) return -errno;
+  return 0;
+}
+
+int TickScheduler::wait(Tick* tick) {
+  if (fd_ < 0) return -EBADF;
+  if (int rc = arm(); rc < 0) return rc;
+  if (woken_.exchange(false)) return 0;
+  uint64_t expirations;
+  while (::read(fd_, &expirations, sizeof expirations) < 0) {
+    if (errno != EINTR) return -errno;
+  }
+  if (woken_.exchange(false)) return 0;
+  tick->deadline_ns = next_real_;
+  tick->skew_ns = clock_ns(CLOCK_MONOTONIC) - armed_mono_;
+  tick->skipped = pending_skipped_;
+  pending_skipped_ = 0;
+  next_real_ += interval_ns_;
+  return 1;
+}
+
+void TickScheduler::wake() {
+  woken_.store(true);
+  // Any expired deadline makes a blocked read() return; 1ns relative is
+  // the earliest one that still counts as armed.
+  itimerspec its{};
+  its.it_value.tv_nsec = 1;
+  ::timerfd_settime(fd_, 0, &its, nullptr);
+}
+
+int apply_thread_policy(const ThreadPolicy& p) {
+  int first = 0;
+  if (!p.cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : p.cpus)
+      if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    // pid 0 is the calling thread, not the whole process.
+    if (::sched_setaffinity(0, sizeof set, &set) < 0) first = -errno;
+  }
+  if (p.idle) {
+    sched_param sp{};
+    if (::sched_setscheduler(0, SCHED_IDLE, &sp) < 0 &&
+        ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), 19) < 0 && first == 0)
+      first = -errno;
+  }
+  return first;
+}
+
+int parse_cpu_list(std::string_view s, std::vector<int>* out) {
+  out->clear();
+  if (!s.empty() && s.back() == '\n') s.remove_suffix(1);
+  while (!s.empty()) {
+    const std::size_t comma = s.find(',');
+    std::string_view item = s.substr(0, comma);
+    s = comma == std::string_view::npos ? std::string_view{} : s.substr(comma + 1);
+    const std::size_t dash = item.find('-');
+    uint64_t lo, hi;
+    if (!parse_u64(item.substr(0, dash), lo)) return -EINVAL;
+    hi = lo;
+    if (dash != std::string_view::npos && !parse_u64(item.substr(dash + 1), hi)) return -EINVAL;
+    if (hi < lo || hi >= CPU_SETSIZE) return -EINVAL;
+    for (uint64_t c = lo; c <= hi; ++c) out->push_back(static_cast<int>(c));
+  }
+  if (out->empty()) return -EINVAL;
+  std::sort(out->begin(), out->end());
+  out->erase(std::unique(out->begin(), out->end()), out->end());
+  return 0;
+}
+
+}  // namespace sysapm
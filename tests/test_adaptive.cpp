@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "sysapm/adaptive.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+constexpr int64_t kSec = 1000000000;
+
+// Feeds one sample per tick and returns the ticks that were forwarded.
+std::vector<int> run(AdaptiveFilter& f, const std::vector<double>& values) {
+  std::vector<int> fwd;
+  for (std::size_t t = 0; t < values.size(); ++t) {
+    Sample s = Sample::make_gauge(static_cast<int64_t>(t) * kSec, 1, values[t]);
+    if (f.filter(&s, 1, &s) == 1) fwd.push_back(static_cast<int>(t));
+  }
+  return fwd;
+}
+
+}  // namespace
+
+TEST_CASE(flat_series_backs_off_exponentially) {
+  AdaptiveOptions o;
+  o.stable_ticks = 2;
+  o.max_stride = 8;
+  AdaptiveFilter f(o);
+  const auto fwd = run(f, std::vector<double>(60, 42.0));
+  // Two heartbeats at each stride: 1, 2, 4, then 8 from there on.
+  CHECK((std::vector<int>(fwd.begin(), fwd.begin() + 8) == std::vector<int>{0, 1, 2, 4, 6, 10, 14, 22}));
+  for (std::size_t i = 8; i < fwd.size(); ++i) CHECK_EQ(fwd[i] - fwd[i - 1], 8);
+  CHECK_EQ(f.stride(1), 8u);
+  CHECK_EQ(f.stats().backed_off, 1u);
+  CHECK(f.stats().heartbeats > 0);
+}
+
+TEST_CASE(change_snaps_back_immediately) {
+  AdaptiveOptions o;
+  o.stable_ticks = 2;
+  o.max_stride = 16;
+  AdaptiveFilter f(o);
+  std::vector<double> v(40, 1.0);
+  v[37] = 2.0;
+  v[38] = 2.0;
+  const auto fwd = run(f, v);
+  CHECK(fwd.back() >= 37);
+  CHECK(std::find(fwd.begin(), fwd.end(), 37) != fwd.end());
+  CHECK(std::find(fwd.begin(), fwd.end(), 38) != fwd.end());  // stride is 1 again
+  CHECK_EQ(f.stats().snapbacks, 1u);
+  CHECK_EQ(f.stride(1), 1u);
+  CHECK_EQ(f.stats().backed_off, 0u);
+}
+
+TEST_CASE(epsilon_and_drift_against_the_anchor) {
+  AdaptiveOptions o;
+  o.stable_ticks = 1;
+  o.max_stride = 4;
+  o.abs_epsilon = 0.5;
+  o.rel_epsilon = 0;
+  AdaptiveFilter f(o);
+  // Creeps by 0.2 per tick: each step is within epsilon of the previous
+  // one, but the anchor is the last change, so it still triggers.
+  std::vector<double> v;
+  for (int t = 0; t < 12; ++t) v.push_back(10.0 + 0.2 * t);
+  const auto fwd = run(f, v);
+  CHECK(f.stats().snapbacks + fwd.size() >= 4);
+  CHECK(std::find(fwd.begin(), fwd.end(), 3) != fwd.end());  // 10.6: moved 0.6 from the anchor
+}
+
+TEST_CASE(counters_need_exact_equality) {
+  AdaptiveOptions o;
+  o.stable_ticks = 1;
+  o.abs_epsilon = 1e9;  // gauges only
+  AdaptiveFilter f(o);
+  int fwd = 0;
+  for (int t = 0; t < 20; ++t) {
+    Sample s = Sample::make_counter(t * kSec, 3, static_cast<uint64_t>(t));
+    fwd += static_cast<int>(f.filter(&s, 1, &s));
+  }
+  CHECK_EQ(fwd, 20);
+}
+
+TEST_CASE(silent_series_get_one_stale_marker) {
+  AdaptiveOptions o;
+  o.stale_after_ns = 3 * kSec;
+  AdaptiveFilter f(o);
+  Sample in[2] = {Sample::make_gauge(0, 1, 5), Sample::make_counter(0, 2, 9)};
+  CHECK_EQ(f.filter(in, 2, in), 2u);
+  std::vector<Sample> marks;
+  for (int64_t t = 1; t <= 10; ++t) {
+    Sample keep = Sample::make_gauge(t * kSec, 1, 5);  // series 1 keeps reporting
+    f.filter(&keep, 1, &keep);
+    f.sweep(t * kSec, &marks);
+  }
+  REQUIRE(marks.size() == 1);
+  CHECK_EQ(marks[0].series, 2u);
+  CHECK(marks[0].stale());
+  CHECK(marks[0].kind == SampleKind::kCounter);
+  CHECK(std::isnan(marks[0].gauge));
+  uint64_t bits;
+  std::memcpy(&bits, &marks[0].gauge, sizeof bits);
+  CHECK_EQ(bits, kStaleNaN);
+  CHECK_EQ(f.stride(2), 0u);
+  // Coming back starts a fresh series at full rate.
+  Sample back = Sample::make_counter(11 * kSec, 2, 9);
+  CHECK_EQ(f.filter(&back, 1, &back), 1u);
+  CHECK_EQ(f.stride(2), 1u);
+}
@@ -0,0 +1,217 @@
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "sysapm/aggregator.hpp"
+#include "sysapm/exporter.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+constexpr int64_t kSec = 1000000000;
+constexpr int64_t kStart = 1700000000 * kSec;  // a 10 s window boundary
+
+// One agent: its own registry, and a batch of three window-0 points.
+struct Agent {
+  SeriesRegistry reg;
+  HistogramSnapshot hist{HistogramLayout{}};
+  std::vector<RollupPoint> points;
+
+  Agent(uint64_t bytes, double load, std::initializer_list<uint64_t> latencies) {
+    const uint32_t c = reg.intern("net_bytes_total", {{"dev", "eth0"}});
+    const uint32_t g = reg.intern("load1");
+    const uint32_t h = reg.intern("rpc_latency_ns", {{"method", "get"}});
+    RollupPoint p{};
+    p.window = 0;
+    p.start_ns = kStart;
+    p.last = Sample::make_counter(kStart + 9 * kSec, c, bytes);
+    p.count = 10;
+    p.min = 0;
+    p.max = static_cast<double>(bytes);
+    p.sum = static_cast<double>(bytes) / 2;
+    points.push_back(p);
+    p.last = Sample::make_gauge(kStart + 9 * kSec, g, load);
+    p.min = p.max = p.sum = load;
+    p.count = 1;
+    points.push_back(p);
+    for (uint64_t v : latencies) hist.add(v);
+    p.last = Sample::make_counter(kStart + 9 * kSec, h, hist.count());
+    p.count = 1;
+    p.sum = 0;
+    p.histogram = &hist;
+    points.push_back(p);
+  }
+
+  std::vector<uint8_t> batch(const char* host) const {
+    ExportEncoder enc(ExportFormat::kAgent, &reg);
+    enc.set_resource({{"host.name", host}});
+    enc.set_windows(RollupOptions{}.windows_ns);
+    std::vector<uint8_t> out;
+    enc.begin(&out);
+    for (const RollupPoint& p : points) enc.add(p);
+    enc.add(Sample::make_gauge(kStart, points[1].last.series, 1));  // raw: not merged
+    out.erase(out.begin(), out.begin() + static_cast<std::ptrdiff_t>(enc.finish()));
+    return out;
+  }
+};
+
+struct Merged {
+  RollupPoint point;
+  uint64_t hist_count = 0;
+  uint64_t hist_p100 = 0;
+};
+
+// Runs the aggregator's sink into a name -> point map.
+struct Collect {
+  Aggregator* agg = nullptr;
+  std::map<std::string, Merged> got;
+  void operator()(unsigned shard, const RollupPoint* p, std::size_t n) {
+    char name[256];
+    for (std::size_t i = 0; i < n; ++i) {
+      REQUIRE(agg->registry(shard).format(p[i].last.series, name, sizeof name));
+      Merged m{p[i]};
+      if (p[i].histogram) {
+        m.hist_count = p[i].histogram->count();
+        m.hist_p100 = p[i].histogram->quantile(1);
+      }
+      m.point.histogram = nullptr;
+      got[name] = m;
+    }
+  }
+};
+
+std::vector<std::string_view> views(const std::vector<std::vector<uint8_t>>& bodies) {
+  std::vector<std::string_view> v;
+  for (const auto& b : bodies) v.emplace_back(reinterpret_cast<const char*>(b.data()), b.size());
+  return v;
+}
+
+}  // namespace
+
+TEST_CASE(windows_of_many_agents_merge_exactly_across_shards) {
+  ThreadPool pool;
+  PoolOptions po;
+  po.workers = 2;
+  REQUIRE(pool.start(po) == 0);
+  Collect sink;
+  AggregatorOptions o;
+  o.shards = 4;
+  Aggregator agg(o, &pool, [&](unsigned s, const RollupPoint* p, std::size_t n) { sink(s, p, n); });
+  sink.agg = &agg;
+  const Agent a(1000, 0.5, {100, 200}), b(500, 1.5, {300, 5000, 7});
+  const std::vector<std::vector<uint8_t>> bodies = {a.batch("a"), b.batch("b")};
+  CHECK_EQ(agg.ingest(views(bodies)), 0u);
+  AggregatorStats st = agg.stats();
+  CHECK_EQ(st.points, 6u);
+  CHECK_EQ(st.unmerged, 2u);
+  CHECK_EQ(st.cells, 3u);
+  CHECK_EQ(st.series, 3u);
+
+  agg.advance(kStart + 10 * kSec);  // still within the grace period
+  CHECK(sink.got.empty());
+  agg.advance(kStart + 10 * kSec + o.grace_ns);
+  REQUIRE(sink.got.size() == 3u);
+  const RollupPoint& c = sink.got["net_bytes_total{dev=\"eth0\"}"].point;
+  CHECK(c.last.kind == SampleKind::kCounter);
+  CHECK_EQ(c.last.counter, 1500u);
+  CHECK_EQ(c.count, 20u);
+  CHECK(c.sum == 750);
+  CHECK(c.max == 1000);
+  CHECK_EQ(c.start_ns, kStart);
+  const RollupPoint& g = sink.got["load1"].point;
+  CHECK(g.last.gauge == 2.0);
+  CHECK(g.min == 0.5);
+  CHECK(g.max == 1.5);
+  CHECK_EQ(g.count, 2u);
+  const Merged& h = sink.got["rpc_latency_ns{method=\"get\"}"];
+  CHECK_EQ(h.hist_count, 5u);
+  CHECK_EQ(h.point.last.counter, 5u);
+  CHECK(h.hist_p100 >= 5000);
+
+  // The same windows again are late; nothing is left open.
+  CHECK_EQ(agg.ingest(views(bodies)), 0u);
+  st = agg.stats();
+  CHECK_EQ(st.late, 6u);
+  CHECK_EQ(st.cells, 0u);
+  CHECK_EQ(st.emitted, 3u);
+
+  // A truncated batch is reported; garbage is malformed, not fatal.
+  std::vector<std::vector<uint8_t>> bad = {std::vector<uint8_t>(bodies[0].begin(), bodies[0].end() - 3),
+                                           {0xff, 0xff, 0xff}};
+  CHECK_EQ(agg.ingest(views(bad)), 2u);
+  CHECK_EQ(agg.stats().batches, 6u);
+}
+
+TEST_CASE(resource_attributes_can_keep_agents_apart) {
+  Collect sink;
+  AggregatorOptions o;
+  o.shards = 3;
+  o.by_resource = {"host.name"};
+  Aggregator agg(o, nullptr, [&](unsigned s, const RollupPoint* p, std::size_t n) { sink(s, p, n); });
+  sink.agg = &agg;
+  const Agent a(1000, 0.5, {1}), b(500, 1.5, {2});
+  const std::vector<std::vector<uint8_t>> bodies = {a.batch("a"), b.batch("b"), b.batch("b")};
+  agg.ingest(views(bodies));
+  agg.flush();
+  CHECK_EQ(sink.got.size(), 6u);
+  CHECK_EQ(sink.got["load1{host_name=\"a\"}"].point.last.gauge, 0.5);
+  // The same host twice in one window adds up, like any two sources.
+  CHECK_EQ(sink.got["load1{host_name=\"b\"}"].point.last.gauge, 3.0);
+  CHECK_EQ(sink.got["net_bytes_total{dev=\"eth0\",host_name=\"b\"}"].point.last.counter, 1000u);
+}
+
+TEST_CASE(intake_server_takes_pipelined_exporter_batches) {
+  IntakeServer server;
+  IntakeOptions io;
+  io.host = "127.0.0.1";
+  io.port = 0;
+  REQUIRE(server.open(io) == 0);
+  REQUIRE(server.port() != 0);
+  const Agent a(42, 1, {10});
+  Exporter ex;
+  ExporterOptions xo;
+  xo.host = "127.0.0.1";
+  xo.port = server.port();
+  xo.path = io.path;
+  xo.format = ExportFormat::kAgent;
+  xo.batch_points = 1;  // three batches, pipelined on one connection
+  xo.resource = {{"host.name", "a"}};
+  REQUIRE(ex.open(xo, &a.reg) == 0);
+  ex.add(a.points.data(), a.points.size());
+  ex.flush();
+  std::vector<std::vector<uint8_t>> bodies;
+  for (int i = 0; i < 200 && !ex.idle(); ++i) {
+    ex.pump(5);
+    REQUIRE(server.poll(5, &bodies) == 0);
+  }
+  CHECK(ex.idle());
+  CHECK_EQ(ex.stats().accepted, 3u);
+  CHECK_EQ(server.stats().connections, 1u);
+  REQUIRE(bodies.size() == 3u);
+
+  Collect sink;
+  Aggregator agg({}, nullptr, [&](unsigned s, const RollupPoint* p, std::size_t n) { sink(s, p, n); });
+  sink.agg = &agg;
+  CHECK_EQ(agg.ingest(views(bodies)), 0u);
+  agg.flush();
+  CHECK_EQ(sink.got.size(), 3u);
+  CHECK_EQ(sink.got["net_bytes_total{dev=\"eth0\"}"].point.last.counter, 42u);
+
+  // Another path is refused.
+  Exporter wrong;
+  xo.path = "/api/v1/write";
+  REQUIRE(wrong.open(xo, &a.reg) == 0);
+  wrong.add(a.points.data(), 1);
+  wrong.flush();
+  for (int i = 0; i < 200 && !wrong.idle(); ++i) {
+    wrong.pump(5);
+    REQUIRE(server.poll(5, &bodies) == 0);
+  }
+  CHECK_EQ(wrong.stats().rejected, 1u);
+  CHECK_EQ(server.stats().rejected, 1u);
+}
@@ -0,0 +1,165 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory_resource>
+#include <vector>
+
+#include "sysapm/arena.hpp"
+#include "sysapm/host_collectors.hpp"
+#include "sysapm/spsc_ring.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+// Every heap allocation in this binary goes through malloc and friends, so
+// counting them here catches operator new, libc internals (opendir, stdio)
+// and the containers alike.
+extern "C" {
+void* __libc_malloc(std::size_t);
+void* __libc_calloc(std::size_t, std::size_t);
+void* __libc_realloc(void*, std::size_t);
+void* __libc_memalign(std::size_t, std::size_t);
+void __libc_free(void*);
+}
+
+namespace {
+
+std::atomic<bool> g_counting{false};
+std::atomic<uint64_t> g_mallocs{0};
+
+void note() {
+  if (g_counting.load(std::memory_order_relaxed)) g_mallocs.fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+extern "C" {
+void* malloc(std::size_t n) {
+  note();
+  return __libc_malloc(n);
+}
+void* calloc(std::size_t n, std::size_t size) {
+  note();
+  return __libc_calloc(n, size);
+}
+void* realloc(void* p, std::size_t n) {
+  note();
+  return __libc_realloc(p, n);
+}
+void* aligned_alloc(std::size_t align, std::size_t n) {
+  note();
+  return __libc_memalign(align, n);
+}
+int posix_memalign(void** out, std::size_t align, std::size_t n) {
+  note();
+  *out = __libc_memalign(align, n);
+  return *out ? 0 : ENOMEM;
+}
+void free(void* p) { __libc_free(p); }
+}
+
+TEST_CASE(bump_allocation_respects_alignment) {
+  TickArena a(256);
+  auto* c = static_cast<char*>(a.allocate(1, 1));
+  auto* d = static_cast<double*>(a.allocate(sizeof(double), alignof(double)));
+  void* line = a.allocate(64, 64);
+  CHECK(c != nullptr);
+  CHECK_EQ(reinterpret_cast<uintptr_t>(d) % alignof(double), 0u);
+  CHECK_EQ(reinterpret_cast<uintptr_t>(line) % 64, 0u);
+  void* big = a.allocate(1000);  // larger than a block: chains one
+  CHECK(big != nullptr);
+  CHECK(a.used() >= 1065u);
+  CHECK_EQ(a.upstream_allocs(), 2u);
+}
+
+TEST_CASE(reset_folds_blocks_and_then_stops_allocating) {
+  TickArena a(1024);
+  for (int tick = 0; tick < 10; ++tick) {
+    a.reset();
+    for (int i = 0; i < 100; ++i) a.allocate(100);  // ~10 KB per tick
+  }
+  CHECK(a.high_water() >= 10000u);
+  CHECK(a.capacity() >= a.high_water());
+  // Growth on the first tick, one fold on the first reset, then nothing.
+  const uint64_t after_warmup = a.upstream_allocs();
+  for (int tick = 0; tick < 100; ++tick) {
+    a.reset();
+    for (int i = 0; i < 100; ++i) a.allocate(100);
+  }
+  CHECK_EQ(a.upstream_allocs(), after_warmup);
+}
+
+TEST_CASE(pmr_containers_live_in_the_arena) {
+  TickArena a;
+  ArenaResource res(a);
+  a.allocate(1);  // the first block comes from the heap
+  a.reset();
+  g_mallocs = 0;
+  g_counting = true;
+  {
+    std::pmr::vector<uint64_t> v(&res);
+    for (uint64_t i = 0; i < 1000; ++i) v.push_back(i);
+    std::pmr::vector<std::pmr::vector<int>> rows(&res);
+    rows.resize(10);  // allocator propagates to the inner vectors
+    for (auto& r : rows) r.assign(50, 7);
+    CHECK_EQ(v[999], 999u);
+    CHECK_EQ(rows[9][49], 7);
+  }
+  g_counting = false;
+  CHECK_EQ(g_mallocs.load(), 0u);
+  CHECK(a.used() > 1000 * sizeof(uint64_t));
+}
+
+TEST_CASE(steady_state_ticks_do_not_malloc) {
+  // Every host collector over the fixture tree, the process collector
+  // rescanning /proc on every tick, and the batch handed through a ring:
+  // after warm-up ticks a tick must not touch the heap.
+  SamplerOptions so;
+  so.proc_root = SYSAPM_TEST_FIXTURES "/proc";
+  ProcessCollectorOptions po;
+  po.proc_root = so.proc_root;
+  po.use_connector = false;
+  po.backend = ProcessBackend::kProcfs;
+  po.fallback_rescan_ticks = 1;
+  CpuCollector cpu;
+  MemoryCollector mem;
+  NetCollector net;
+  DiskCollector disk;
+  ProcessSummaryCollector procs;
+  REQUIRE(cpu.open(so) == 0);
+  REQUIRE(mem.open(so) == 0);
+  REQUIRE(net.open(so) == 0);
+  REQUIRE(disk.open(so) == 0);
+  REQUIRE(procs.open(po) == 0);
+  Collector* all[] = {&cpu, &mem, &net, &disk, &procs};
+
+  SpscRing<Sample> ring(4096);
+  std::vector<Sample> batch, drained(4096);
+  std::size_t samples = 0;
+  auto tick = [&] {
+    for (Collector* c : all) {
+      batch.clear();
+      CHECK(c->collect(batch) == 0);
+      ring.push(batch.data(), batch.size());
+      samples += ring.pop(drained.data(), drained.size());
+    }
+  };
+  for (int i = 0; i < 3; ++i) tick();
+
+  constexpr int kTicks = 200;
+  samples = 0;
+  g_mallocs = 0;
+  g_counting = true;
+  for (int i = 0; i < kTicks; ++i) tick();
+  g_counting = false;
+  const uint64_t mallocs = g_mallocs.load();
+  CHECK_EQ(mallocs, 0u);
+  CHECK(samples > 0);
+  CHECK_EQ(procs.processes().stats().rescans, static_cast<uint64_t>(kTicks) + 3 + 1);
+
+  if (std::FILE* f = std::fopen(SYSAPM_TEST_OUTPUT, "a")) {
+    std::fprintf(f, "arena steady_state ticks=%d samples=%zu mallocs=%llu\n", kTicks, samples,
+                 static_cast<unsigned long long>(mallocs));
+    std::fclose(f);
+  }
+}
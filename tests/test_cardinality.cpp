@@ -0,0 +1,230 @@
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "sysapm/cardinality.hpp"
+#include "sysapm/sketch.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+constexpr int64_t kSec = 1000000000;
+
+uint64_t splitmix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+const Sample* find(const std::vector<Sample>& out, uint32_t id) {
+  for (const Sample& s : out)
+    if (s.series == id && !s.stale()) return &s;
+  return nullptr;
+}
+
+}  // namespace
+
+TEST_CASE(hyperloglog_estimates_distinct_keys) {
+  for (uint64_t n : {10ull, 1000ull, 100000ull}) {
+    HyperLogLog h;
+    for (uint64_t i = 0; i < n; ++i) {
+      h.add(splitmix(i));
+      h.add(splitmix(i));  // repeats change nothing
+    }
+    const double err = std::fabs(h.estimate() - static_cast<double>(n)) / static_cast<double>(n);
+    CHECK(err < 0.1);
+  }
+  HyperLogLog h;
+  CHECK_EQ(h.bytes(), 1024u);
+  CHECK(h.estimate() == 0);
+}
+
+TEST_CASE(space_saving_holds_the_heavy_hitters) {
+  SpaceSaving ss(16);
+  // Four heavy keys among 10000 light ones, interleaved.
+  for (uint32_t i = 0; i < 10000; ++i) {
+    ss.offer(100 + i, 1);
+    ss.offer(i % 4 + 1, 10);
+  }
+  CHECK_EQ(ss.size(), 16u);
+  std::vector<uint32_t> top;
+  ss.top(4, &top);
+  CHECK((top.size() == 4 && top[0] <= 4 && top[1] <= 4 && top[2] <= 4 && top[3] <= 4));
+  for (uint32_t k = 1; k <= 4; ++k) {
+    CHECK(ss.count(k) >= 25000);
+    CHECK(ss.count(k) - ss.error(k) <= 25000);
+  }
+  ss.decay(0.5);
+  CHECK(ss.count(1) >= 12500);
+  CHECK(!ss.contains(100));
+}
+
+TEST_CASE(limiter_keeps_the_heaviest_series_and_folds_the_rest) {
+  SeriesRegistry r;
+  CardinalityLimits lim;
+  lim.per_metric = 4;
+  r.set_limits(lim);
+  const uint32_t host = r.intern("host_up");
+  std::vector<uint32_t> ids;
+  char v[16];
+  for (int i = 0; i < 8; ++i) {
+    std::snprintf(v, sizeof v, "%d", i);
+    ids.push_back(r.intern("bytes_total", {{"conn", v}}));
+  }
+  CardinalityOptions o;
+  o.top_k = 2;
+  o.epoch_ticks = 3;
+  CardinalityLimiter lim_stage(r, o);
+  // Series 0 and 1 grow fast, the rest by one a tick.
+  uint64_t value[8] = {};
+  std::vector<Sample> out;
+  uint64_t folded_sum = 0;
+  for (int t = 1; t <= 12; ++t) {
+    std::vector<Sample> in{Sample::make_gauge(t * kSec, host, 1)};
+    for (std::size_t i = 0; i < ids.size(); ++i) {
+      value[i] += i < 2 ? 1000 : 1;
+      in.push_back(Sample::make_counter(t * kSec, ids[i], value[i]));
+    }
+    out.clear();
+    lim_stage.filter(in.data(), in.size(), &out);
+    lim_stage.finish_tick(&out);
+    REQUIRE(find(out, host));
+    if (t < 3) CHECK(find(out, ids[7]));  // nothing chosen yet
+    if (t >= 3) {
+      CHECK(find(out, ids[0]));
+      CHECK(find(out, ids[1]));
+      CHECK(!find(out, ids[5]));
+      CHECK(lim_stage.kept(ids[0]));
+      CHECK(!lim_stage.kept(ids[5]));
+    }
+    if (t == 3) {
+      int stale = 0;
+      for (const Sample& s : out) stale += s.stale();
+      CHECK_EQ(stale, 6);  // the six demoted series, once
+    }
+    if (t > 3) {
+      MetricCardinality c;
+      REQUIRE(r.cardinality(ids[0], &c));
+      const Sample* other = find(out, c.overflow);
+      REQUIRE(other);
+      CHECK(other->counter > folded_sum);  // rising with the folded increases
+      folded_sum = other->counter;
+    }
+  }
+  // Six series rising by 1 for ticks 4..12, plus their tick-3 increase.
+  CHECK_EQ(folded_sum, 6u * 10);
+  CHECK_EQ(lim_stage.stats().demoted, 6u);
+  CHECK_EQ(lim_stage.stats().limited, 1u);
+
+  std::vector<Sample> self;
+  lim_stage.self_metrics(12 * kSec, &self);
+  CHECK_EQ(self.size(), 3u);
+  CHECK_EQ(r.metric(self[0].series), "system_apm_self_series_estimate");
+  self.clear();
+  lim_stage.self_metrics(12 * kSec, &self);
+  CHECK(self.empty());  // once per tick
+}
+
+TEST_CASE(limiter_takes_increases_of_refused_label_sets) {
+  SeriesRegistry r;
+  CardinalityLimits lim;
+  lim.per_metric = 1;
+  lim.headroom = 1;
+  r.set_limits(lim);
+  const uint32_t a = r.intern("req_total", {{"path", "/a"}});
+  const uint32_t other = r.intern("req_total", {{"path", "/b"}});
+  CHECK(other != a);
+  CHECK_EQ(r.intern("req_total", {{"path", "/c"}}), other);
+  CardinalityLimiter stage(r);
+  std::vector<Sample> out;
+  // Two refused sources share the overflow id: sums 15, 25, then one goes away.
+  const uint64_t b[] = {10, 15, 20};
+  const uint64_t c[] = {5, 10, 0};
+  uint64_t seen[3] = {};
+  for (int t = 0; t < 3; ++t) {
+    Sample in[] = {Sample::make_counter((t + 1) * kSec, a, 1),
+                   Sample::make_counter((t + 1) * kSec, other, b[t]),
+                   Sample::make_counter((t + 1) * kSec, other, c[t])};
+    out.clear();
+    stage.filter(in, c[t] ? 3 : 2, &out);
+    stage.finish_tick(&out);
+    REQUIRE(find(out, a));
+    const Sample* o = find(out, other);
+    REQUIRE(o);
+    seen[t] = o->counter;
+  }
+  // The first sum counts as an increase, then 10, then a drop adds nothing.
+  CHECK_EQ(seen[0], 15u);
+  CHECK_EQ(seen[1], 25u);
+  CHECK_EQ(seen[2], 25u);
+}
+
+TEST_CASE(limiter_emits_one_overflow_point_per_tick_across_runs) {
+  SeriesRegistry r;
+  CardinalityLimits lim;
+  lim.per_metric = 4;
+  r.set_limits(lim);
+  std::vector<uint32_t> gauges, counters;
+  char v[16];
+  for (int i = 0; i < 6; ++i) {
+    std::snprintf(v, sizeof v, "%d", i);
+    gauges.push_back(r.intern("queue_depth", {{"q", v}}));
+    counters.push_back(r.intern("drops_total", {{"q", v}}));
+  }
+  CardinalityOptions o;
+  o.top_k = 2;
+  o.epoch_ticks = 3;
+  CardinalityLimiter stage(r, o);
+  MetricCardinality gc, cc;
+  REQUIRE(r.cardinality(gauges[0], &gc));
+  REQUIRE(r.cardinality(counters[0], &cc));
+  auto tick = [&](int t) {
+    std::vector<Sample> in;
+    for (std::size_t i = 0; i < gauges.size(); ++i) {
+      in.push_back(Sample::make_gauge(t * kSec, gauges[i], i < 2 ? 100.0 : 1.0 + static_cast<double>(i)));
+      in.push_back(Sample::make_counter(t * kSec, counters[i], (i < 2 ? 1000ull : 10ull * i) * t));
+    }
+    return in;
+  };
+  std::vector<Sample> out;
+  for (int t = 1; t <= 2; ++t) {
+    const std::vector<Sample> in = tick(t);
+    stage.filter(in.data(), in.size(), &out);
+    stage.finish_tick(&out);
+  }
+  // Tick 3 chooses, folds four series of each metric and reaches the
+  // limiter in two runs, as a drain split into chunks would hand it over.
+  const std::vector<Sample> in = tick(3);
+  const std::size_t half = in.size() / 2;
+  out.clear();
+  stage.filter(in.data(), half, &out);
+  stage.filter(in.data() + half, in.size() - half, &out);
+  CHECK(!find(out, gc.overflow));  // held until the tick is done
+  stage.finish_tick(&out);
+  int gauge_points = 0, counter_points = 0;
+  double gauge_sum = 0;
+  uint64_t counter_sum = 0;
+  for (const Sample& s : out) {
+    if (s.stale()) continue;
+    if (s.series == gc.overflow) {
+      ++gauge_points;
+      gauge_sum = s.gauge;
+    }
+    if (s.series == cc.overflow) {
+      ++counter_points;
+      counter_sum = s.counter;
+    }
+  }
+  CHECK_EQ(gauge_points, 1);
+  CHECK_EQ(gauge_sum, 3.0 + 4.0 + 5.0 + 6.0);
+  CHECK_EQ(counter_points, 1);
+  CHECK_EQ(counter_sum, 10u * (2 + 3 + 4 + 5));  // their tick-3 increases
+  out.clear();
+  stage.finish_tick(&out);
+  CHECK(out.empty());
+}
@@ -0,0 +1,163 @@
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "sysapm/cgroup_collector.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+namespace fs = std::filesystem;
+
+namespace {
+
+void write(const fs::path& p, const char* text) { std::ofstream(p) << text; }
+
+// A cgroup directory as the kernel lays it out, minus the files of
+// controllers that are not enabled.
+void make_cgroup(const fs::path& dir, bool io) {
+  fs::create_directories(dir);
+  write(dir / "cpu.stat",
+        "usage_usec 5000\nuser_usec 3000\nsystem_usec 2000\nnr_periods 10\nnr_throttled 2\n"
+        "throttled_usec 700\n");
+  write(dir / "memory.stat",
+        "anon 4096\nfile 8192\nkernel 1024\nkernel_stack 512\npagetables 256\nsock 0\nshmem 128\n"
+        "file_mapped 64\nfile_dirty 32\nfile_writeback 0\nslab 2048\npgfault 99\npgmajfault 3\n");
+  write(dir / "cpu.pressure",
+        "some avg10=1.50 avg60=0.80 avg300=0.20 total=123456\nfull avg10=0.25 avg60=0.00 avg300=0.00 total=789\n");
+  write(dir / "memory.pressure",
+        "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\nfull avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+  if (io)
+    write(dir / "io.stat",
+          "8:0 rbytes=1000 wbytes=2000 rios=10 wios=20 dbytes=0 dios=0\n"
+          "259:0 rbytes=500 wbytes=10 rios=5 wios=1 dbytes=4096 dios=1\n");
+}
+
+const Sample* find_sample(const CgroupCollector& c, const std::vector<Sample>& out, const char* metric,
+                          const char* cgroup) {
+  const uint32_t id = c.registry().find(metric, {{"cgroup", cgroup}});
+  if (id == 0) return nullptr;
+  for (const Sample& s : out)
+    if (s.series == id) return &s;
+  return nullptr;
+}
+
+}  // namespace
+
+TEST_CASE(parses_cgroup_files) {
+  test::TempDir root("cgroup");
+  make_cgroup(root.path, true);
+  make_cgroup(root.path + "/kubepods.slice/pod-a", true);
+  make_cgroup(root.path + "/system.slice", false);
+  CgroupCollector c;
+  REQUIRE(c.open({root.path}) == 0);
+  CHECK_EQ(c.stats().tracked, 4u);  // kubepods.slice itself has no files but is tracked
+  std::vector<Sample> out;
+  REQUIRE(c.collect(out) == 0);
+
+  const Sample* s = find_sample(c, out, "cgroup_cpu_usage_usec_total", "/kubepods.slice/pod-a");
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 5000u);
+  s = find_sample(c, out, "cgroup_cpu_throttled_usec_total", "/");
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 700u);
+  s = find_sample(c, out, "cgroup_memory_slab_bytes", "/system.slice");
+  REQUIRE(s);
+  CHECK_EQ(s->gauge, 2048.0);
+  s = find_sample(c, out, "cgroup_memory_major_page_faults_total", "/system.slice");
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 3u);
+  // io.stat sums the devices; system.slice has no io controller.
+  s = find_sample(c, out, "cgroup_io_read_bytes_total", "/kubepods.slice/pod-a");
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 1500u);
+  s = find_sample(c, out, "cgroup_io_discards_total", "/kubepods.slice/pod-a");
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 1u);
+  CHECK(find_sample(c, out, "cgroup_io_read_bytes_total", "/system.slice") == nullptr);
+  s = find_sample(c, out, "cgroup_cpu_pressure_some_avg10", "/");
+  REQUIRE(s);
+  CHECK_EQ(s->gauge, 1.5);
+  s = find_sample(c, out, "cgroup_cpu_pressure_full_usec_total", "/");
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 789u);
+  // Three populated cgroups with everything, one without io.
+  CHECK_EQ(out.size(), 2 * kCgroupSeriesCount + (kCgroupSeriesCount - 6));
+}
+
+TEST_CASE(follows_mkdir_and_rmdir_without_rescans) {
+  test::TempDir root("cgroup");
+  make_cgroup(root.path, false);
+  CgroupCollector c;
+  REQUIRE(c.open({root.path}) == 0);
+  std::vector<Sample> out;
+  REQUIRE(c.collect(out) == 0);
+  CHECK_EQ(c.stats().tracked, 1u);
+
+  // A nested pod created in one go: the inner directory exists before the
+  // collector has a watch on the outer one.
+  make_cgroup(root.path + "/pod-b/ctr-1", true);
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  CHECK_EQ(c.stats().tracked, 3u);
+  CHECK(c.find("/pod-b/ctr-1") != nullptr);
+  const Sample* s = find_sample(c, out, "cgroup_io_written_bytes_total", "/pod-b/ctr-1");
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 2010u);
+
+  fs::remove_all(root.path + "/pod-b");
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  CHECK_EQ(c.stats().tracked, 1u);
+  CHECK_EQ(c.stats().removed, 2u);
+  CHECK(c.find("/pod-b") == nullptr);
+  CHECK_EQ(out.size(), kCgroupSeriesCount - 6);
+  CHECK_EQ(c.stats().rescans, 0u);
+}
+
+TEST_CASE(rename_rewalks_and_relabels) {
+  test::TempDir root("cgroup");
+  make_cgroup(root.path + "/old/inner", false);
+  CgroupCollector c;
+  REQUIRE(c.open({root.path}) == 0);
+  std::vector<Sample> out;
+  REQUIRE(c.collect(out) == 0);
+  fs::rename(root.path + "/old", root.path + "/new");
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  CHECK_EQ(c.stats().rescans, 1u);
+  CHECK(c.find("/old/inner") == nullptr);
+  CHECK(c.find("/new/inner") != nullptr);
+  CHECK(find_sample(c, out, "cgroup_cpu_usage_usec_total", "/new/inner") != nullptr);
+  CHECK_EQ(c.stats().tracked, 3u);
+}
+
+TEST_CASE(reprobes_files_of_late_controllers) {
+  test::TempDir root("cgroup");
+  make_cgroup(root.path, false);
+  CgroupOptions o;
+  o.root = root.path;
+  o.reprobe_ticks = 2;
+  CgroupCollector c;
+  REQUIRE(c.open(o) == 0);
+  std::vector<Sample> out;
+  REQUIRE(c.collect(out) == 0);
+  write(fs::path(root.path) / "io.stat", "8:0 rbytes=1 wbytes=2 rios=3 wios=4 dbytes=0 dios=0\n");
+  out.clear();
+  REQUIRE(c.collect(out) == 0);  // tick 2: reprobed
+  CHECK(find_sample(c, out, "cgroup_io_writes_total", "/") != nullptr);
+}
+
+TEST_CASE(live_cgroup2_if_mounted) {
+  const std::string root = find_cgroup2();
+  if (root.empty()) SKIP("no cgroup v2 mount");
+  CgroupCollector c;
+  int rc = c.open({root});
+  if (rc == -EACCES) SKIP("cgroup v2 mount not readable");
+  REQUIRE(rc == 0);
+  std::vector<Sample> out;
+  REQUIRE(c.collect(out) == 0);
+  CHECK(c.stats().tracked >= 1);
+  CHECK(find_sample(c, out, "cgroup_cpu_usage_usec_total", "/") != nullptr);
+}
@@ -0,0 +1,184 @@
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "sysapm/bitstream.hpp"
+#include "sysapm/chunk_store.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+constexpr int64_t kSec = 1000000000;
+constexpr int64_t kT0 = 1699999200 * kSec;  // aligned to 1 min and 2 h blocks
+
+uint64_t bits_of(double d) {
+  uint64_t u;
+  std::memcpy(&u, &d, sizeof u);
+  return u;
+}
+
+std::vector<Sample> collect(const ChunkStore& st, uint32_t series, int64_t from = 0,
+                            int64_t to = std::numeric_limits<int64_t>::max()) {
+  std::vector<Sample> out;
+  st.scan(series, from, to, [&](const Sample& s) { out.push_back(s); });
+  return out;
+}
+
+}  // namespace
+
+TEST_CASE(bitstream_round_trip) {
+  std::vector<std::atomic<uint64_t>> words(4096);
+  BitWriter w(words.data(), words.size());
+  std::mt19937_64 rng(1);
+  std::vector<std::pair<uint64_t, unsigned>> ref;
+  while (w.remaining_bits() >= 64) {
+    unsigned n = static_cast<unsigned>(rng() % 65);
+    uint64_t v = n == 64 ? rng() : rng() & ((uint64_t{1} << n) - 1);
+    w.write(v, n);
+    ref.push_back({v, n});
+  }
+  BitReader<AtomicWords> r(AtomicWords{words.data()});
+  bool ok = true;
+  for (auto& [v, n] : ref) ok &= r.read(n) == v;
+  CHECK(ok);
+  CHECK_EQ(r.bit_pos(), w.bit_pos());
+}
+
+TEST_CASE(gauges_and_counters_round_trip_exactly) {
+  ChunkStore st;
+  const double gauges[] = {0.0, -0.0, 1.5, 1.5, std::numeric_limits<double>::infinity(), 3.25e300,
+                           std::numeric_limits<double>::quiet_NaN(), 1e-310, -42.0, -42.0};
+  // Irregular steps, a counter reset and a full-width jump.
+  const int64_t steps[] = {1000, 1000, 1003, 997, 5000, 1, 0, 3600000, 1000, 1000};
+  const uint64_t counters[] = {5, 105, 205, 305, 300, 0, ~uint64_t{0}, 7, 7, 1ull << 63};
+  int64_t t = kT0;
+  for (int i = 0; i < 10; ++i) {
+    CHECK(st.append(Sample::make_gauge(t, 101, gauges[i])));
+    CHECK(st.append(Sample::make_counter(t, 201, counters[i])));
+    t += steps[i] * 1000000;
+  }
+  auto check = [&] {
+    auto g = collect(st, 101);
+    auto c = collect(st, 201);
+    REQUIRE(g.size() == 10 && c.size() == 10);
+    int64_t tt = kT0;
+    for (int i = 0; i < 10; ++i) {
+      CHECK_EQ(g[i].ts_ns, tt);
+      CHECK_EQ(g[i].kind, SampleKind::kGauge);
+      CHECK_EQ(bits_of(g[i].gauge), bits_of(gauges[i]));
+      CHECK_EQ(c[i].kind, SampleKind::kCounter);
+      CHECK_EQ(c[i].counter, counters[i]);
+      tt += steps[i] * 1000000;
+    }
+  };
+  check();  // from the head chunks
+  st.seal_all();
+  check();  // from sealed chunks
+  CHECK(collect(st, 401).empty());
+}
+
+TEST_CASE(blocks_seal_and_expire) {
+  StoreOptions opts;
+  opts.block_ns = 60 * kSec;
+  opts.retention_ns = 120 * kSec;
+  ChunkStore st(opts);
+  const uint32_t id = 307;
+  for (int i = 0; i < 300; ++i) CHECK(st.append(Sample::make_counter(kT0 + i * kSec, id, 10ull * i)));
+  CHECK(!st.append(Sample::make_counter(kT0, id, 0)));             // out of order
+  CHECK(!st.append(Sample::make_gauge(kT0 + 300 * kSec, id, 1)));  // kind changed
+  StoreStats s = st.stats();
+  CHECK_EQ(s.samples, 300u);
+  CHECK_EQ(s.sealed_chunks, 4u);  // the fifth block is still the head
+  CHECK_EQ(s.rejected, 2u);
+
+  auto mid = collect(st, id, kT0 + 50 * kSec, kT0 + 70 * kSec);
+  REQUIRE(mid.size() == 21);  // spans a block boundary
+  CHECK_EQ(mid.front().counter, 500u);
+  CHECK_EQ(mid.back().counter, 700u);
+
+  CHECK_EQ(st.expire(kT0 + 300 * kSec), 3u);  // blocks ending before t0+180s
+  auto all = collect(st, id);
+  REQUIRE(all.size() == 120);
+  CHECK_EQ(all.front().ts_ns, kT0 + 180 * kSec);
+  s = st.stats();
+  CHECK_EQ(s.samples, 120u);
+  CHECK_EQ(s.expired_chunks, 3u);
+}
+
+TEST_CASE(readers_see_consistent_prefix_while_appending) {
+  // Small heads force many grow/seal swaps under the reader.
+  StoreOptions opts;
+  opts.block_ns = 500 * kSec;
+  opts.initial_chunk_words = 4;
+  opts.max_chunk_words = 64;
+  ChunkStore st(opts);
+  const uint32_t id = 203;
+  constexpr int kTotal = 200000;
+  std::atomic<bool> done{false};
+  bool ok = true;
+  std::size_t last_seen = 0;
+  std::thread reader([&] {
+    while (!done.load(std::memory_order_acquire)) {
+      std::size_t n = 0;
+      bool good = true;
+      st.scan(id, 0, std::numeric_limits<int64_t>::max(), [&](const Sample& s) {
+        good &= s.ts_ns == kT0 + static_cast<int64_t>(n) * kSec && s.counter == 3ull * n * n;
+        ++n;
+      });
+      ok &= good && n >= last_seen;
+      last_seen = n;
+    }
+  });
+  for (uint64_t i = 0; i < kTotal; ++i)
+    st.append(Sample::make_counter(kT0 + static_cast<int64_t>(i) * kSec, id, 3 * i * i));
+  done.store(true, std::memory_order_release);
+  reader.join();
+  CHECK(ok);
+  CHECK_EQ(collect(st, id).size(), static_cast<std::size_t>(kTotal));
+}
+
+TEST_CASE(realistic_mix_under_two_bytes_per_sample) {
+  // Three hours of 1 s samples with millisecond scheduling jitter: idle and
+  // slowly moving gauges, tick counters and byte counters, in the
+  // proportions the host collectors emit them.
+  ChunkStore st;
+  std::mt19937 rng(7);
+  constexpr int kSeries = 200, kTicks = 3 * 3600;
+  std::vector<uint64_t> counter(kSeries, 1000000);
+  std::vector<double> gauge(kSeries, 1024.0 * 1024 * 1024);
+  for (int t = 0; t < kTicks; ++t) {
+    const int64_t ts = kT0 + int64_t{t} * kSec + static_cast<int64_t>(rng() % 3) * 1000000;
+    for (int s = 0; s < kSeries; ++s) {
+      const uint32_t id = 1 + static_cast<uint32_t>(s);
+      switch (s % 4) {
+        case 0:  // cpu ticks: ~100/s when busy, often exactly idle
+          if (rng() % 4) counter[s] += 100 + rng() % 3;
+          st.append(Sample::make_counter(ts, id, counter[s]));
+          break;
+        case 1:  // byte counters
+          counter[s] += 20000 + rng() % 4000;
+          st.append(Sample::make_counter(ts, id, counter[s]));
+          break;
+        case 2:  // memory gauge changing by whole pages now and then
+          if (rng() % 8 == 0) gauge[s] += static_cast<double>(4096 * (rng() % 64));
+          st.append(Sample::make_gauge(ts, id, gauge[s]));
+          break;
+        default:  // mostly idle gauges (hugepages, blocked tasks, ...)
+          st.append(Sample::make_gauge(ts, id, rng() % 50 == 0 ? 1.0 : 0.0));
+          break;
+      }
+    }
+  }
+  StoreStats s = st.stats();
+  CHECK_EQ(s.samples, static_cast<uint64_t>(kSeries) * kTicks);
+  std::printf("  %.3f bytes/sample over %llu samples\n", s.bytes_per_sample(),
+              static_cast<unsigned long long>(s.samples));
+  CHECK(s.bytes_per_sample() < 2.0);
+}
@@ -0,0 +1,401 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sysapm/exporter.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+constexpr int64_t kT0 = 1700000000000000000;
+
+std::vector<uint8_t> roundtrip(const std::vector<uint8_t>& in, std::size_t* compressed = nullptr) {
+  SnappyCompressor c;
+  std::vector<uint8_t> z, out;
+  c.compress(in.data(), in.size(), &z);
+  if (compressed) *compressed = z.size();
+  if (snappy_uncompress(z.data(), z.size(), &out) != 0) out.assign(1, 0xee);
+  return out;
+}
+
+// Decoded remote-write series: "name{labels}" and its single sample.
+struct RwSeries {
+  std::string name;
+  double value = 0;
+  int64_t ts_ms = 0;
+};
+
+std::vector<RwSeries> decode_rw(std::string_view msg, bool* ok) {
+  std::vector<RwSeries> out;
+  ProtoReader req(msg);
+  while (req.next()) {
+    if (req.field() != 1) continue;
+    RwSeries s;
+    std::string labels;
+    ProtoReader ts(req.bytes());
+    while (ts.next()) {
+      ProtoReader sub(ts.bytes());
+      std::string k, v;
+      double value = 0;
+      int64_t t = 0;
+      while (sub.next()) {
+        if (ts.field() == 1 && sub.field() == 1) k = sub.bytes();
+        if (ts.field() == 1 && sub.field() == 2) v = sub.bytes();
+        if (ts.field() == 2 && sub.field() == 1) value = sub.as_double();
+        if (ts.field() == 2 && sub.field() == 2) t = static_cast<int64_t>(sub.value());
+      }
+      if (ts.field() == 2) {
+        s.value = value;
+        s.ts_ms = t;
+      } else if (k == "__name__") {
+        s.name = v + s.name;
+      } else {
+        s.name += (s.name.find('{') == std::string::npos ? "{" : ",") + k + "=" + v;
+      }
+    }
+    if (s.name.find('{') != std::string::npos) s.name += "}";
+    out.push_back(s);
+  }
+  *ok = !req.error();
+  return out;
+}
+
+// A loopback HTTP server that answers each request with the next status
+// from `script` (then 204), recording the decompressed bodies.
+struct FakeGateway {
+  int listen_fd = -1;
+  uint16_t port = 0;
+  std::vector<int> script;
+  std::vector<std::vector<uint8_t>> bodies;
+  std::atomic<int> accepts{0};
+  std::atomic<bool> stop{false};
+  std::thread thread;
+
+  bool start() {
+    listen_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in a{};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof a;
+    if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&a), sizeof a) < 0 || ::listen(listen_fd, 4) < 0 ||
+        ::getsockname(listen_fd, reinterpret_cast<sockaddr*>(&a), &len) < 0)
+      return false;
+    port = ntohs(a.sin_port);
+    thread = std::thread([this] { serve(); });
+    return true;
+  }
+
+  void serve() {
+    timeval tv{0, 100000};
+    ::setsockopt(listen_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    std::size_t answered = 0;
+    while (!stop) {
+      int fd = ::accept(listen_fd, nullptr, nullptr);
+      if (fd < 0) continue;
+      ++accepts;
+      ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+      std::string buf;
+      char tmp[65536];
+      while (!stop) {
+        ssize_t n = ::recv(fd, tmp, sizeof tmp, 0);
+        if (n == 0) break;
+        if (n > 0) buf.append(tmp, static_cast<std::size_t>(n));
+        // Answer every complete request in the buffer.
+        for (;;) {
+          std::size_t he = buf.find("\r\n\r\n");
+          if (he == std::string::npos) break;
+          std::size_t cl = buf.find("Content-Length: ");
+          if (cl == std::string::npos || cl > he) break;
+          std::size_t len = std::strtoul(buf.c_str() + cl + 16, nullptr, 10);
+          if (buf.size() < he + 4 + len) break;
+          std::vector<uint8_t> body;
+          snappy_uncompress(reinterpret_cast<const uint8_t*>(buf.data()) + he + 4, len, &body);
+          const int status = answered < script.size() ? script[answered] : 204;
+          ++answered;
+          if (status / 100 == 2) bodies.push_back(std::move(body));
+          std::string resp = "HTTP/1.1 " + std::to_string(status) + " X\r\n";
+          resp += status == 204 ? "\r\n" : "Content-Length: 2\r\n\r\nno";
+          ::send(fd, resp.data(), resp.size(), MSG_NOSIGNAL);
+          buf.erase(0, he + 4 + len);
+        }
+      }
+      ::close(fd);
+    }
+  }
+
+  ~FakeGateway() {
+    stop = true;
+    if (thread.joinable()) thread.join();
+    if (listen_fd >= 0) ::close(listen_fd);
+  }
+};
+
+}  // namespace
+
+TEST_CASE(snappy_roundtrips) {
+  std::mt19937 rng(3);
+  std::vector<uint8_t> random(200000), text, empty;
+  for (auto& b : random) b = static_cast<uint8_t>(rng());
+  for (int i = 0; i < 20000; ++i) {
+    const std::string line = "node_cpu_seconds_total{cpu=\"" + std::to_string(i % 64) + "\",mode=\"idle\"} ";
+    text.insert(text.end(), line.begin(), line.end());
+  }
+  std::size_t z = 0;
+  CHECK(roundtrip(random, &z) == random);
+  CHECK(z <= SnappyCompressor::max_compressed_length(random.size()));
+  CHECK(roundtrip(text, &z) == text);
+  CHECK(z * 10 < text.size());
+  CHECK(roundtrip(empty).empty());
+  const std::vector<uint8_t> tiny = {'a', 'b', 'c'};
+  CHECK(roundtrip(tiny) == tiny);
+
+  std::vector<uint8_t> out;
+  const uint8_t bad[] = {10, 0x09, 1, 2};  // copy before any output
+  CHECK_EQ(snappy_uncompress(bad, sizeof bad, &out), -EINVAL);
+}
+
+TEST_CASE(remote_write_encodes_labels_and_values) {
+  SeriesRegistry reg;
+  const uint32_t cpu = reg.intern("cpu_seconds_total", {{"mode", "user"}, {"cpu", "0"}});
+  const uint32_t load = reg.intern("load1");
+  ExportEncoder enc(ExportFormat::kRemoteWrite, &reg);
+  std::vector<uint8_t> buf;
+  enc.begin(&buf);
+  enc.add(Sample::make_counter(kT0, cpu, 123456));
+  enc.add(Sample::make_gauge(kT0 + 1000000, load, 0.75));
+  enc.add(Sample::make_gauge(kT0, 999, 1));  // unknown: skipped
+  const std::size_t at = enc.finish();
+  CHECK_EQ(enc.points(), 2u);
+  bool ok = false;
+  auto got = decode_rw(std::string_view(reinterpret_cast<const char*>(buf.data()) + at, buf.size() - at), &ok);
+  CHECK(ok);
+  REQUIRE(got.size() == 2u);
+  CHECK_EQ(got[0].name, std::string("cpu_seconds_total{cpu=0,mode=user}"));
+  CHECK_EQ(got[0].value, 123456.0);
+  CHECK_EQ(got[0].ts_ms, kT0 / 1000000);
+  CHECK_EQ(got[1].name, std::string("load1"));
+  CHECK_EQ(got[1].value, 0.75);
+
+  // Reuse: the next message replaces the first.
+  enc.begin(&buf);
+  enc.add(Sample::make_gauge(kT0, load, 2));
+  enc.finish();
+  CHECK_EQ(decode_rw(std::string_view(reinterpret_cast<const char*>(buf.data()), buf.size()), &ok).size(), 1u);
+}
+
+TEST_CASE(otlp_groups_metrics_and_carries_histograms) {
+  SeriesRegistry reg;
+  const uint32_t a = reg.intern("disk_reads_total", {{"device", "sda"}});
+  const uint32_t b = reg.intern("disk_reads_total", {{"device", "sdb"}});
+  const uint32_t g = reg.intern("load1");
+  const uint32_t h = reg.intern("collect_duration_ns");
+  HistogramSnapshot snap(HistogramLayout{});
+  for (uint64_t v = 100; v < 200; ++v) snap.add(v);
+
+  ExportEncoder enc(ExportFormat::kOtlp, &reg);
+  enc.set_resource({{"host.name", "web-1"}});
+  std::vector<uint8_t> buf;
+  enc.begin(&buf);
+  enc.add(Sample::make_counter(kT0, a, 10));
+  enc.add(Sample::make_counter(kT0, b, 20));
+  enc.add(Sample::make_gauge(kT0, g, 1.5));
+  RollupPoint hp{Sample::make_counter(kT0, h, 100), 0, kT0 - 10000000000, 1, 100, 207, 15000, &snap};
+  enc.add(hp);
+  const std::size_t at = enc.finish();
+
+  // ExportMetricsServiceRequest -> ResourceMetrics -> {Resource, ScopeMetrics -> Metric*}
+  ProtoReader req(buf.data() + at, buf.size() - at);
+  REQUIRE(req.next() && req.field() == 1);
+  ProtoReader rm(req.bytes());
+  CHECK(!req.next() && !req.error());
+  std::string host;
+  std::vector<std::string> metrics;
+  std::vector<int> points, kinds;
+  uint64_t hist_count = 0, bucket_total = 0;
+  std::size_t bounds = 0;
+  while (rm.next()) {
+    if (rm.field() == 1) {
+      ProtoReader res(rm.bytes());
+      while (res.next()) {
+        ProtoReader kv(res.bytes());
+        while (kv.next())
+          if (kv.field() == 2) {
+            ProtoReader any(kv.bytes());
+            while (any.next()) host = any.bytes();
+          }
+      }
+      continue;
+    }
+    ProtoReader sm(rm.bytes());
+    while (sm.next()) {
+      if (sm.field() != 2) continue;
+      ProtoReader m(sm.bytes());
+      while (m.next()) {
+        if (m.field() == 1) {
+          metrics.emplace_back(m.bytes());
+          continue;
+        }
+        kinds.push_back(static_cast<int>(m.field()));
+        int n = 0;
+        ProtoReader data(m.bytes());
+        while (data.next()) {
+          if (data.field() != 1) continue;
+          ++n;
+          if (m.field() != 9) continue;
+          ProtoReader dp(data.bytes());
+          while (dp.next()) {
+            if (dp.field() == 4) hist_count = dp.value();
+            if (dp.field() == 6)
+              for (std::size_t i = 0; i + 8 <= dp.bytes().size(); i += 8) {
+                uint64_t c;
+                std::memcpy(&c, dp.bytes().data() + i, 8);
+                bucket_total += c;
+              }
+            if (dp.field() == 7) bounds = dp.bytes().size() / 8;
+          }
+        }
+        points.push_back(n);
+      }
+    }
+  }
+  CHECK_EQ(host, std::string("web-1"));
+  REQUIRE(metrics.size() == 3u);
+  CHECK_EQ(metrics[0], std::string("disk_reads_total"));
+  CHECK(kinds == (std::vector<int>{7, 5, 9}));
+  CHECK(points == (std::vector<int>{2, 1, 1}));
+  CHECK_EQ(hist_count, 100u);
+  CHECK_EQ(bucket_total, 100u);
+  CHECK(bounds > 0);
+}
+
+TEST_CASE(parses_export_targets) {
+  ExporterOptions o;
+  CHECK_EQ(parse_export_target("gw.example:9201/receive", &o), 0);
+  CHECK_EQ(o.host, std::string("gw.example"));
+  CHECK_EQ(o.port, 9201);
+  CHECK_EQ(o.path, std::string("/receive"));
+  CHECK_EQ(parse_export_target("[::1]:4318", &o), 0);
+  CHECK_EQ(o.host, std::string("::1"));
+  CHECK_EQ(o.path, std::string("/receive"));  // kept when not given
+  CHECK_EQ(parse_export_target("host", &o), -EINVAL);
+  CHECK_EQ(parse_export_target("host:0", &o), -EINVAL);
+  CHECK_EQ(parse_export_target("host:x/", &o), -EINVAL);
+}
+
+TEST_CASE(exporter_pipelines_on_one_connection_and_retries) {
+  FakeGateway gw;
+  gw.script = {503};  // the first batch is refused once
+  if (!gw.start()) SKIP("no loopback sockets");
+  SeriesRegistry reg;
+  std::vector<uint32_t> ids;
+  for (int i = 0; i < 50; ++i) ids.push_back(reg.intern("m", {{"i", std::to_string(i)}}));
+
+  Exporter ex;
+  ExporterOptions o;
+  o.port = gw.port;
+  o.batch_points = 100;
+  o.max_in_flight = 4;
+  o.min_backoff_ns = 1000000;
+  REQUIRE(ex.open(o, &reg) == 0);
+  std::vector<Sample> raw;
+  for (int t = 0; t < 20; ++t)
+    for (uint32_t id : ids) raw.push_back(Sample::make_gauge(kT0 + t * 1000000000ll, id, t));
+  ex.add(raw.data(), raw.size());
+  ex.flush();
+  CHECK_EQ(ex.stats().batches, 10u);
+  for (int i = 0; i < 400 && !ex.idle(); ++i) ex.pump(10);
+  CHECK(ex.idle());
+  CHECK_EQ(ex.stats().accepted, 10u);
+  CHECK(ex.stats().retries >= 1u);
+  CHECK_EQ(ex.stats().connects, 1u);
+  CHECK_EQ(gw.accepts.load(), 1);
+  CHECK(ex.stats().sent_bytes < ex.stats().raw_bytes);
+  gw.stop = true;
+  gw.thread.join();
+  std::size_t total = 0;
+  for (const auto& b : gw.bodies) {
+    bool ok = false;
+    total += decode_rw(std::string_view(reinterpret_cast<const char*>(b.data()), b.size()), &ok).size();
+    CHECK(ok);
+  }
+  CHECK_EQ(total, raw.size());
+}
+
+TEST_CASE(exporter_spools_during_an_outage_and_replays_in_order) {
+  test::TempDir dir("xspool");
+  SeriesRegistry reg;
+  const uint32_t id = reg.intern("m", {});
+  // Reserve a port, then leave it closed until the "backend" comes back.
+  FakeGateway gw;
+  if (!gw.start()) SKIP("no loopback sockets");
+  const uint16_t port = gw.port;
+  gw.stop = true;
+  gw.thread.join();
+  ::close(gw.listen_fd);
+  gw.listen_fd = -1;
+
+  Exporter ex;
+  ExporterOptions o;
+  o.port = port;
+  o.batch_points = 10;
+  o.max_in_flight = 2;
+  o.max_queued = 4;
+  o.min_backoff_ns = 1000000;
+  o.max_backoff_ns = 5000000;
+  o.spool_dir = dir.path;
+  REQUIRE(ex.open(o, &reg) == 0);
+  std::vector<Sample> raw;
+  for (int t = 0; t < 200; ++t) raw.push_back(Sample::make_gauge(kT0 + t * 1000000000ll, id, t));
+  for (int t = 0; t < 200; t += 10) {
+    ex.add(&raw[static_cast<std::size_t>(t)], 10);
+    ex.pump(0);
+  }
+  ex.flush();
+  CHECK_EQ(ex.stats().batches, 20u);
+  CHECK_EQ(ex.stats().dropped, 0u);
+  CHECK(ex.stats().spooled >= 16u);
+  CHECK(!ex.idle());
+
+  FakeGateway up;
+  up.stop = false;
+  up.listen_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int one = 1;
+  ::setsockopt(up.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  sockaddr_in a{};
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  a.sin_port = htons(port);
+  if (::bind(up.listen_fd, reinterpret_cast<sockaddr*>(&a), sizeof a) < 0 || ::listen(up.listen_fd, 4) < 0)
+    SKIP("port taken");
+  up.thread = std::thread([&up] { up.serve(); });
+  for (int i = 0; i < 1000 && !ex.idle(); ++i) ex.pump(10);
+  CHECK(ex.idle());
+  CHECK_EQ(ex.stats().accepted, 20u);
+  CHECK_EQ(ex.stats().replayed, ex.stats().spooled);
+  up.stop = true;
+  up.thread.join();
+  // Timestamps arrive in the order they were sampled.
+  std::vector<int64_t> ts;
+  for (const auto& b : up.bodies) {
+    bool ok = false;
+    for (const RwSeries& s : decode_rw(std::string_view(reinterpret_cast<const char*>(b.data()), b.size()), &ok))
+      ts.push_back(s.ts_ms);
+    CHECK(ok);
+  }
+  CHECK_EQ(ts.size(), raw.size());
+  CHECK(std::is_sorted(ts.begin(), ts.end()));
+  ex.close();
+}
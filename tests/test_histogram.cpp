@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "sysapm/histogram.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+TEST_CASE(buckets_tile_the_range_within_relative_error) {
+  const HistogramLayout l;  // 4 sub-bucket bits: 1/16 relative width
+  CHECK_EQ(l.buckets(), 37u * 16);
+  for (std::size_t i = 0; i + 1 < l.buckets(); ++i) {
+    CHECK_EQ(l.index(l.lower(i)), i);
+    CHECK_EQ(l.index(l.upper(i)), i);
+    CHECK_EQ(l.upper(i) + 1, l.lower(i + 1));
+    if (l.lower(i) >= 16) CHECK(static_cast<double>(l.upper(i) - l.lower(i) + 1) / l.lower(i) <= 1.0 / 16);
+  }
+  CHECK_EQ(l.index(0), 0u);
+  CHECK_EQ(l.index(15), 15u);
+  CHECK_EQ(l.index(uint64_t{1} << 40), l.buckets() - 1);  // clamped
+  CHECK_EQ(l.index(~uint64_t{0}), l.buckets() - 1);
+  const HistogramLayout wide{3, 64};
+  CHECK_EQ(wide.index(~uint64_t{0}), wide.buckets() - 1);
+  CHECK_EQ(wide.upper(wide.buckets() - 1), ~uint64_t{0});
+}
+
+TEST_CASE(quantiles_bound_the_true_values) {
+  std::mt19937_64 rng(3);
+  std::lognormal_distribution<double> dist(11.0, 1.5);  // ~60 µs median, long tail
+  std::vector<uint64_t> values(100000);
+  HistogramSnapshot h(HistogramLayout{});
+  for (auto& v : values) {
+    v = static_cast<uint64_t>(dist(rng));
+    h.add(v);
+  }
+  std::sort(values.begin(), values.end());
+  for (double q : {0.5, 0.9, 0.99, 0.999}) {
+    const uint64_t exact = values[static_cast<std::size_t>(q * values.size()) - 1];
+    const uint64_t est = h.quantile(q);
+    CHECK(est >= exact);
+    CHECK(static_cast<double>(est - exact) <= static_cast<double>(exact) / 16 + 1);
+  }
+  CHECK_EQ(h.count(), values.size());
+  CHECK_EQ(HistogramSnapshot(HistogramLayout{}).quantile(0.5), 0u);
+}
+
+TEST_CASE(sharded_recording_survives_concurrent_snapshots) {
+  Histogram h(HistogramLayout{}, 8);
+  CHECK_EQ(h.shards(), 8u);
+  constexpr int kThreads = 4, kPerThread = 200000;
+  std::atomic<bool> go{false};
+  std::vector<std::thread> writers;
+  for (int t = 0; t < kThreads; ++t) {
+    writers.emplace_back([&, t] {
+      while (!go.load()) {
+      }
+      for (int i = 0; i < kPerThread; ++i) h.record(static_cast<uint64_t>(1000 * (t + 1) + i % 500));
+    });
+  }
+  go = true;
+  HistogramSnapshot prev, s;
+  bool monotonic = true;
+  for (int i = 0; i < 50; ++i) {
+    h.snapshot(&s);
+    if (!prev.counts().empty())
+      for (std::size_t b = 0; b < s.counts().size(); ++b) monotonic &= s.counts()[b] >= prev.counts()[b];
+    prev = s;
+  }
+  for (auto& w : writers) w.join();
+  CHECK(monotonic);
+  h.snapshot(&s);
+  CHECK_EQ(s.count(), static_cast<uint64_t>(kThreads) * kPerThread);
+  CHECK(s.quantile(0) >= 1000 && s.quantile(0) < 1100);
+  CHECK(s.quantile(1) >= 4499);
+}
+
+TEST_CASE(merged_host_snapshots_equal_the_union) {
+  // Three "hosts" record disjoint slices; their encoded snapshots merged on
+  // the collector tier match one histogram fed everything.
+  std::mt19937_64 rng(11);
+  HistogramSnapshot all(HistogramLayout{}), merged;
+  std::vector<uint8_t> wire[3];
+  for (int host = 0; host < 3; ++host) {
+    HistogramSnapshot local(HistogramLayout{});
+    for (int i = 0; i < 10000; ++i) {
+      const uint64_t v = rng() % (uint64_t{1} << (10 + 8 * host));
+      local.add(v);
+      all.add(v);
+    }
+    local.encode(&wire[host]);
+  }
+  for (auto& w : wire) {
+    HistogramSnapshot decoded;
+    REQUIRE(decoded.decode(w.data(), w.size()) == static_cast<int>(w.size()));
+    REQUIRE(merged.merge(decoded) == 0);
+  }
+  CHECK(merged.counts() == all.counts());
+  CHECK_EQ(merged.count(), all.count());
+  for (double q : {0.1, 0.5, 0.99}) CHECK_EQ(merged.quantile(q), all.quantile(q));
+  CHECK(wire[0].size() < 700);  // sparse: only populated buckets travel
+
+  HistogramSnapshot other(HistogramLayout{5, 40});
+  CHECK_EQ(merged.merge(other), -EINVAL);
+  HistogramSnapshot bad;
+  std::vector<uint8_t> truncated(wire[1].begin(), wire[1].begin() + 10);
+  CHECK_EQ(bad.decode(truncated.data(), truncated.size()), -EINVAL);
+}
+
+TEST_CASE(subtract_leaves_the_interval) {
+  Histogram h(HistogramLayout{}, 1);
+  for (int i = 0; i < 100; ++i) h.record(10);
+  HistogramSnapshot before = h.snapshot();
+  for (int i = 0; i < 50; ++i) h.record(5000);
+  HistogramSnapshot window = h.snapshot();
+  REQUIRE(window.subtract(before) == 0);
+  CHECK_EQ(window.count(), 50u);
+  CHECK(window.quantile(0) >= 5000);
+}
@@ -0,0 +1,148 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sysapm/io_ring.hpp"
+#include "sysapm/proc_sampler.hpp"
+#include "sysapm/process_collector.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+bool uring_unavailable(int rc) { return rc == -ENOSYS || rc == -EPERM; }
+
+}  // namespace
+
+TEST_CASE(ring_reads_registered_buffers) {
+  IoRing ring;
+  int rc = ring.open(4);
+  if (uring_unavailable(rc)) SKIP("io_uring not available");
+  REQUIRE(rc == 0);
+  CHECK(ring.capacity() >= 4);
+  int fd = ::open(SYSAPM_TEST_FIXTURES "/proc/loadavg", O_RDONLY | O_CLOEXEC);
+  REQUIRE(fd >= 0);
+  char buf[2][64] = {};
+  const iovec iov[2] = {{buf[0], sizeof buf[0]}, {buf[1], sizeof buf[1]}};
+  REQUIRE(ring.register_buffers(iov, 2) == 0);
+  REQUIRE(ring.register_files(&fd, 1) == 0);
+  // The same file twice: once by fd, once by registered index, at an offset.
+  CHECK(ring.read_fixed(fd, false, buf[0], sizeof buf[0], 0, 0, 10));
+  CHECK(ring.read_fixed(0, true, buf[1], sizeof buf[1], 5, 1, 11));
+  REQUIRE(ring.submit(2) == 2);
+  int32_t res[2] = {-1, -1};
+  unsigned got = 0;
+  while (got < 2) got += ring.reap([&](uint64_t tag, int32_t r) { res[tag - 10] = r; });
+  CHECK_EQ(res[0], 30);
+  CHECK_EQ(res[1], 25);
+  CHECK(std::memcmp(buf[0], "0.52 1.58", 9) == 0);
+  CHECK(std::memcmp(buf[1], "1.58", 4) == 0);
+  ::close(fd);
+}
+
+TEST_CASE(sampler_uring_matches_pread) {
+  SamplerOptions o;
+  o.proc_root = SYSAPM_TEST_FIXTURES "/proc";
+  ProcSampler plain, ring;
+  REQUIRE(plain.open(o) == 0);
+  o.io = IoBackend::kUring;
+  int rc = ring.open(o);
+  if (uring_unavailable(rc)) SKIP("io_uring not available");
+  REQUIRE(rc == 0);
+  CHECK(ring.uring_active());
+  for (int i = 0; i < 2; ++i) {
+    REQUIRE(plain.sample() == 0);
+    REQUIRE(ring.sample() == 0);
+  }
+  const ProcSnapshot& a = plain.snapshot();
+  const ProcSnapshot& b = ring.snapshot();
+  CHECK(std::memcmp(&a.cpu.total, &b.cpu.total, sizeof a.cpu.total) == 0);
+  REQUIRE(a.cpu.cpus.size() == b.cpu.cpus.size());
+  CHECK(std::memcmp(a.cpu.cpus.data(), b.cpu.cpus.data(), a.cpu.cpus.size() * sizeof(CpuTimes)) == 0);
+  CHECK(std::memcmp(&a.mem, &b.mem, sizeof a.mem) == 0);
+  CHECK_EQ(a.load.last_pid, b.load.last_pid);
+  REQUIRE(a.net.size() == b.net.size());
+  CHECK(std::memcmp(a.net.data(), b.net.data(), a.net.size() * sizeof(NetDevStats)) == 0);
+  REQUIRE(a.disks.size() == b.disks.size());
+  CHECK(std::memcmp(a.disks.data(), b.disks.data(), a.disks.size() * sizeof(DiskStats)) == 0);
+}
+
+TEST_CASE(sampler_uring_grows_small_buffers) {
+  // A file that fills its buffer is grown and reread, and the next pass
+  // reads through the re-registered buffer.
+  ProcFile small;
+  REQUIRE(small.open(SYSAPM_TEST_FIXTURES "/proc/meminfo", 64) == 0);
+  IoRing ring;
+  int rc = ring.open(2);
+  if (uring_unavailable(rc)) SKIP("io_uring not available");
+  REQUIRE(rc == 0);
+  ProcFileBatch batch;
+  ProcFile* files[] = {&small};
+  REQUIRE(batch.attach(&ring, files, 1) == 0);
+  long n = 0;
+  REQUIRE(batch.read_all(&n) == 0);
+  CHECK(n > 64);
+  CHECK(small.grow_count() > 0);
+  CHECK_EQ(static_cast<std::size_t>(n), small.data().size());
+  CHECK(small.data().starts_with("MemTotal:"));
+  const unsigned grows = small.grow_count();
+  long again = 0;
+  REQUIRE(batch.read_all(&again) == 0);
+  CHECK_EQ(again, n);
+  CHECK_EQ(small.grow_count(), grows);
+}
+
+TEST_CASE(process_uring_matches_procfs_with_fewer_syscalls) {
+  ProcessCollectorOptions o;
+  o.proc_root = SYSAPM_TEST_FIXTURES "/proc";
+  o.use_connector = false;
+  o.backend = ProcessBackend::kProcfs;
+  ProcessCollector plain, ring;
+  REQUIRE(plain.open(o) == 0);
+  o.io = IoBackend::kUring;
+  int rc = ring.open(o);
+  if (uring_unavailable(rc)) SKIP("io_uring not available");
+  REQUIRE(rc == 0);
+  CHECK(ring.uring_active());
+  for (int i = 0; i < 2; ++i) {
+    REQUIRE(plain.collect() == 0);
+    REQUIRE(ring.collect() == 0);
+  }
+  CHECK_EQ(ring.table().size(), plain.table().size());
+  for (int32_t pid : {1, 4242}) {
+    const ProcessEntry* a = plain.table().find(pid);
+    const ProcessEntry* b = ring.table().find(pid);
+    REQUIRE(a && b);
+    CHECK(std::strcmp(a->stats.comm, b->stats.comm) == 0);
+    CHECK_EQ(a->stats.utime, b->stats.utime);
+    CHECK_EQ(a->stats.rss, b->stats.rss);
+    CHECK_EQ(a->stats.uid, b->stats.uid);
+    CHECK_EQ(a->stats.voluntary_ctxt, b->stats.voluntary_ctxt);
+    CHECK_EQ(a->stats.vm_swap_kb, b->stats.vm_swap_kb);
+  }
+  // Four preads collapse into one io_uring_enter.
+  CHECK_EQ(plain.stats().syscalls_last_tick, 4u);
+  CHECK_EQ(ring.stats().syscalls_last_tick, 1u);
+}
+
+TEST_CASE(process_uring_tracks_live_proc) {
+  ProcessCollectorOptions o;
+  o.io = IoBackend::kUring;
+  o.uring_depth = 16;  // several batches per tick on any real host
+  ProcessCollector c;
+  int rc = c.open(o);
+  if (rc == -ENOENT) SKIP("/proc not readable");
+  if (uring_unavailable(rc)) SKIP("io_uring not available");
+  REQUIRE(rc == 0);
+  for (int i = 0; i < 3; ++i) REQUIRE(c.collect() == 0);
+  const ProcessEntry* self = c.table().find(getpid());
+  REQUIRE(self);
+  CHECK(self->starttime != 0);  // state reads 'S': we sleep in io_uring_enter while it is read
+  CHECK(self->stats.uid == getuid());
+  std::fprintf(stderr, "  %zu processes: %llu syscalls/tick with io_uring\n", c.table().size(),
+               static_cast<unsigned long long>(c.stats().syscalls_last_tick));
+  CHECK(c.stats().syscalls_last_tick < c.table().size());
+}
@@ -0,0 +1,56 @@
+#include "test_main.hpp"
+
+namespace sysapm::test {
+namespace {
+
+struct Case {
+  const char* name;
+  TestFn fn;
+};
+
+constexpr int kMaxCases = 256;
+Case g_cases[kMaxCases];
+int g_case_count = 0;
+int g_failures = 0;
+bool g_skipped = false;
+
+}  // namespace
+
+int register_case(const char* name, TestFn fn) {
+  if (g_case_count < kMaxCases) g_cases[g_case_count++] = {name, fn};
+  return g_case_count;
+}
+
+void fail(const char* file, int line, const char* expr) {
+  std::fprintf(stderr, "  %s:%d: CHECK failed: %s\n", file, line, expr);
+  ++g_failures;
+}
+
+void skip(const char* reason) {
+  std::fprintf(stderr, "  skipped: %s\n", reason);
+  g_skipped = true;
+}
+
+}  // namespace sysapm::test
+
+int main(int argc, char** argv) {
+  using namespace sysapm::test;
+  const char* only = argc > 1 ? argv[1] : nullptr;
+  int failed_cases = 0;
+  for (int i = 0; i < g_case_count; ++i) {
+    if (only && std::strcmp(only, g_cases[i].name) != 0) continue;
+    int before = g_failures;
+    g_skipped = false;
+    std::fprintf(stderr, "[ RUN  ] %s\n", g_cases[i].name);
+    g_cases[i].fn();
+    bool ok = g_failures == before;
+    if (!ok) ++failed_cases;
+    std::fprintf(stderr, "[ %s ] %s\n", !ok ? "FAIL" : (g_skipped ? "SKIP" : " OK "),
+                 g_cases[i].name);
+  }
+  if (failed_cases) {
+    std::fprintf(stderr, "%d case(s) failed\n", failed_cases);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
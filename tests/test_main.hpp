@@ -0,0 +1,68 @@
+// test_main.hpp — minimal self-registering test harness.
+//
+// Each test binary defines cases with TEST_CASE(name) and links against
+// test_main.cpp, which runs every registered case and reports failures.
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+
+namespace sysapm::test {
+
+using TestFn = void (*)();
+
+/// Registers a test case; returns a dummy value so it can run at static init.
+int register_case(const char* name, TestFn fn);
+
+/// Records a failed check; the current case keeps running.
+void fail(const char* file, int line, const char* expr);
+
+/// Marks the current case as skipped (e.g. missing kernel capability).
+void skip(const char* reason);
+
+/// A fresh /tmp/sysapm-<prefix>-XXXXXX directory, removed with everything
+/// in it when the case leaves its scope.
+struct TempDir {
+  std::string path;
+  explicit TempDir(const char* prefix) {
+    std::string tmpl = std::string("/tmp/sysapm-") + prefix + "-XXXXXX";
+    if (::mkdtemp(tmpl.data())) path = tmpl;
+  }
+  ~TempDir() {
+    if (!path.empty()) std::filesystem::remove_all(path);
+  }
+  TempDir(const TempDir&) = delete;
+  TempDir& operator=(const TempDir&) = delete;
+};
+
+}  // namespace sysapm::test
+
+#define TEST_CASE(name)                                                    \
+  static void test_case_##name();                                          \
+  [[maybe_unused]] static const int test_reg_##name =                      \
+      ::sysapm::test::register_case(#name, &test_case_##name);             \
+  static void test_case_##name()
+
+#define CHECK(cond)                                                        \
+  do {                                                                     \
+    if (!(cond)) ::sysapm::test::fail(__FILE__, __LINE__, #cond);          \
+  } while (0)
+
+#define CHECK_EQ(a, b) CHECK((a) == (b))
+
+#define REQUIRE(cond)                                                      \
+  do {                                                                     \
+    if (!(cond)) {                                                         \
+      ::sysapm::test::fail(__FILE__, __LINE__, #cond);                     \
+      return;                                                              \
+    }                                                                      \
+  } while (0)
+
+#define SKIP(reason)                                                       \
+  do {                                                                     \
+    ::sysapm::test::skip(reason);                                          \
+    return;                                                                \
+  } while (0)
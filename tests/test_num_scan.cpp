@@ -0,0 +1,116 @@
+#include <random>
+#include <string>
+
+#include "sysapm/num_scan.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+constexpr ScanImpl kImpls[] = {ScanImpl::kScalar, ScanImpl::kSse42, ScanImpl::kAvx2};
+
+struct Result {
+  std::size_t n;
+  uint64_t v[64];
+  std::ptrdiff_t stop;
+};
+
+Result run(ScanImpl impl, const std::string& s, std::size_t offset, std::size_t max) {
+  Result r{};
+  const char* stop = nullptr;
+  r.n = scan_fn(impl)(s.data() + offset, s.data() + s.size(), r.v, max, &stop);
+  r.stop = stop - s.data();
+  return r;
+}
+
+void check_all_agree(const std::string& s, std::size_t offset, std::size_t max) {
+  Result ref = run(ScanImpl::kScalar, s, offset, max);
+  for (ScanImpl impl : kImpls) {
+    Result r = run(impl, s, offset, max);
+    CHECK_EQ(r.n, ref.n);
+    CHECK_EQ(r.stop, ref.stop);
+    for (std::size_t i = 0; i < ref.n && i < r.n; ++i) CHECK_EQ(r.v[i], ref.v[i]);
+  }
+}
+
+}  // namespace
+
+TEST_CASE(scalar_semantics) {
+  std::string s = " 1 22\t333 4444 sda 5\n";
+  Result r = run(ScanImpl::kScalar, s, 0, 16);
+  CHECK_EQ(r.n, 4u);
+  CHECK_EQ(r.v[3], 4444u);
+  CHECK_EQ(s.substr(static_cast<std::size_t>(r.stop), 3), "sda");
+
+  r = run(ScanImpl::kScalar, "7 8 12ab 9", 0, 16);
+  CHECK_EQ(r.n, 2u);
+  CHECK_EQ(r.stop, 4);
+
+  r = run(ScanImpl::kScalar, "1 2 3\n4", 0, 2);
+  CHECK_EQ(r.n, 2u);
+  CHECK_EQ(r.stop, 3);
+}
+
+TEST_CASE(vector_paths_parse_long_rows) {
+  // A row long enough to go through several 32-byte blocks, with runs that
+  // straddle block edges and every digit length from 1 to 20.
+  std::string s;
+  uint64_t expect[20];
+  uint64_t v = 0;
+  for (int len = 1; len <= 20; ++len) {
+    v = v * 10 + static_cast<uint64_t>(len % 10);
+    expect[len - 1] = v;
+    s += std::to_string(v) + (len % 3 ? " " : "\t ");
+  }
+  s += "\nnext line 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15";
+  for (ScanImpl impl : kImpls) {
+    Result r = run(impl, s, 0, 64);
+    REQUIRE(r.n == 20);
+    for (int i = 0; i < 20; ++i) CHECK_EQ(r.v[i], expect[i]);
+    CHECK_EQ(s[static_cast<std::size_t>(r.stop)], '\n');
+  }
+}
+
+TEST_CASE(randomized_agreement) {
+  std::mt19937_64 rng(7);
+  const char* labels[] = {"sda", "eth0:", "12x", "cpu3", "-1"};
+  for (int round = 0; round < 3000; ++round) {
+    std::string s;
+    int tokens = static_cast<int>(rng() % 40);
+    for (int t = 0; t < tokens; ++t) {
+      int spaces = 1 + static_cast<int>(rng() % 3);
+      for (int i = 0; i < spaces; ++i) s += (rng() % 5 == 0) ? '\t' : ' ';
+      uint64_t kind = rng() % 40;
+      if (kind == 0) {
+        s += labels[rng() % 5];
+      } else if (kind == 1) {
+        s += '\n';
+      } else {
+        uint64_t digits = 1 + rng() % 20;
+        uint64_t val = rng() % (digits >= 19 ? ~0ull : [&] {
+          uint64_t p = 1;
+          for (uint64_t i = 0; i < digits; ++i) p *= 10;
+          return p;
+        }());
+        s += std::to_string(val);
+      }
+    }
+    s += std::string(rng() % 70, ' ');
+    std::size_t offset = s.empty() ? 0 : rng() % (s.size() / 4 + 1);
+    check_all_agree(s, offset, 1 + rng() % 40);
+  }
+}
+
+TEST_CASE(dispatch_override) {
+  ScanImpl original = active_scan_impl();
+  set_scan_impl(ScanImpl::kScalar);
+  CHECK(active_scan_impl() == ScanImpl::kScalar);
+  std::string s = "10 20 30";
+  uint64_t v[3];
+  const char* stop;
+  CHECK_EQ(scan_u64_row(s.data(), s.data() + s.size(), v, 3, &stop), 3u);
+  CHECK_EQ(v[2], 30u);
+  set_scan_impl(original);
+  CHECK(active_scan_impl() == original);
+}
@@ -0,0 +1,70 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "sysapm/arena.hpp"
+#include "sysapm/numa.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+namespace fs = std::filesystem;
+
+namespace {
+
+void write(const fs::path& p, const char* text) {
+  fs::create_directories(p.parent_path());
+  std::ofstream(p) << text;
+}
+
+}  // namespace
+
+TEST_CASE(topology_lists_nodes_with_cpus) {
+  test::TempDir sys("numa");
+  const fs::path dir = fs::path(sys.path) / "devices/system/node";
+  write(dir / "node1/cpulist", "4-7,12\n");
+  write(dir / "node0/cpulist", "0-3,8-11\n");
+  write(dir / "node2/cpulist", "\n");  // memory only
+  write(dir / "possible", "0-2\n");
+  write(dir / "nodefoo/cpulist", "1\n");
+  std::vector<NumaNode> nodes;
+  REQUIRE(read_numa_topology(&nodes, sys.path) == 0);
+  REQUIRE(nodes.size() == 2u);
+  CHECK_EQ(nodes[0].id, 0);
+  CHECK_EQ(nodes[0].cpus.size(), 8u);
+  CHECK_EQ(nodes[1].id, 1);
+  CHECK_EQ(nodes[1].cpus, (std::vector<int>{4, 5, 6, 7, 12}));
+  CHECK_EQ(numa_node_of(nodes, 9), 0);
+  CHECK_EQ(numa_node_of(nodes, 12), 1);
+  CHECK_EQ(numa_node_of(nodes, 13), -1);
+  CHECK_EQ(read_numa_topology(&nodes, sys.path + "/none"), -ENOENT);
+  CHECK(nodes.empty());
+}
+
+TEST_CASE(node_memory_is_usable_without_numa) {
+  // Binding may be refused (no NUMA kernel, a container); memory comes anyway.
+  void* p = numa_alloc(1 << 20, 0);
+  REQUIRE(p != nullptr);
+  auto* bytes = static_cast<uint8_t*>(p);
+  CHECK_EQ(bytes[12345], 0u);
+  std::memset(bytes, 0xab, 1 << 20);
+  numa_free(p, 1 << 20);
+
+  TickArena arena(4096, 0);
+  CHECK_EQ(arena.node(), 0);
+  uint64_t allocs = 0;
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 100; ++i) {
+      auto* q = static_cast<char*>(arena.allocate(1000, 64));
+      CHECK_EQ(reinterpret_cast<uintptr_t>(q) % 64, 0u);
+      std::memset(q, i, 1000);
+    }
+    arena.reset();
+    if (round == 0) allocs = arena.upstream_allocs();
+  }
+  CHECK(arena.capacity() >= 100000u);
+  CHECK_EQ(arena.upstream_allocs(), allocs);  // folded into one block after the first round
+}
@@ -0,0 +1,162 @@
+#include <linux/perf_event.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "sysapm/perf_collector.hpp"
+#include "sysapm/thread_pool.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+// Software events count on every kernel, PMU or not, with the same group
+// and multiplexing machinery as hardware ones.
+const std::vector<PerfEventSpec> kSoftware = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task_clock"},
+    {PERF_TYPE_SOFTWARE, 9999, "bogus"},  // refused; the group opens without it
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page_faults"},
+};
+
+volatile uint64_t g_sink;
+
+void burn() {
+  uint64_t x = 1;
+  for (int i = 0; i < 20000000; ++i) x = x * 6364136223846793005ull + 1442695040888963407ull;
+  std::vector<char> pages(1 << 22);
+  for (std::size_t i = 0; i < pages.size(); i += 4096) pages[i] = 1;
+  g_sink = x + static_cast<uint64_t>(pages[4096]);
+}
+
+const Sample* find_sample(const PerfCollector& c, const std::vector<Sample>& out, const char* metric,
+                          const char* key, const std::string& value) {
+  const uint32_t id = c.registry().find(metric, {{key, value}});
+  if (id == 0) return nullptr;
+  for (const Sample& s : out)
+    if (s.series == id) return &s;
+  return nullptr;
+}
+
+std::string own_cgroup() {
+  std::ifstream in("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(in, line))
+    if (line.rfind("0::", 0) == 0) return line.substr(3);
+  return {};
+}
+
+}  // namespace
+
+TEST_CASE(perf_scale_extrapolates_multiplexed_deltas) {
+  CHECK_EQ(perf_scale(1000, 100, 100), 1000u);
+  CHECK_EQ(perf_scale(1000, 100, 25), 4000u);
+  CHECK_EQ(perf_scale(1000, 100, 0), 0u);  // never on the PMU this tick
+  // The product is wider than 64 bits; the result is not.
+  CHECK_EQ(perf_scale(uint64_t{1} << 40, 4000000000, 1000000000), uint64_t{1} << 42);
+}
+
+TEST_CASE(perf_group_reads_the_whole_group_at_once) {
+  PerfGroup g;
+  int rc = g.open(kSoftware, 0, -1, 0, true);
+  if (rc == -ENOSYS || rc == -EACCES || rc == -EPERM) SKIP("perf_event_open not permitted");
+  REQUIRE(rc == 0);
+  CHECK_EQ(g.present(), 0b101u);
+  REQUIRE(g.read() == 0);
+  const uint64_t clock0 = g.totals()[0];
+  burn();
+  REQUIRE(g.read() == 0);
+  // Software events are never rdpmc-readable: this was the read() path.
+  CHECK(!g.last_read_rdpmc());
+  CHECK(g.totals()[0] > clock0);
+  CHECK_EQ(g.deltas()[0], g.totals()[0] - clock0);
+  CHECK(g.deltas()[2] >= 1000u);  // 4 MiB of fresh pages
+  CHECK_EQ(g.totals()[1], 0u);
+  CHECK(g.last_enabled_ns() > 0);
+  CHECK_EQ(g.last_running_ns(), g.last_enabled_ns());
+}
+
+TEST_CASE(perf_collector_publishes_per_cpu_counters_from_sharded_reads) {
+  ThreadPool pool;
+  PoolOptions po;
+  po.workers = 2;
+  REQUIRE(pool.start(po) == 0);
+  PerfOptions o;
+  o.events = kSoftware;
+  o.pool = &pool;
+  o.shard_groups = 1;
+  PerfCollector c;
+  int rc = c.open(o);
+  if (rc == -ENOSYS || rc == -EACCES || rc == -EPERM) SKIP("no permission for per-CPU events");
+  REQUIRE(rc == 0);
+  SeriesRegistry reg;
+  c.bind_registry(&reg);
+  REQUIRE(c.events().size() == 2u);  // the refused event is left out of every group
+
+  std::vector<Sample> out;
+  REQUIRE(c.collect(out) == 0);
+  burn();
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  uint64_t clock = 0;
+  bool ratio = false;
+  for (const Sample& s : out) {
+    if (reg.metric(s.series) == "perf_task_clock_total") clock += s.counter;
+    if (reg.metric(s.series) == "perf_running_ratio") ratio = s.gauge > 0.99 && s.gauge <= 1.0;
+  }
+  CHECK(clock > 0);
+  CHECK(ratio);
+  CHECK(find_sample(c, out, "perf_page_faults_total", "cpu", "0"));
+  CHECK(!find_sample(c, out, "perf_bogus_total", "cpu", "0"));
+  // No cycles among the events: no IPC and no self group.
+  CHECK_EQ(reg.find("perf_ipc", {{"cpu", "0"}}), 0u);
+  const PerfStats& st = c.stats();
+  CHECK_EQ(st.reads, 2 * st.groups);
+  CHECK_EQ(st.read_errors, 0u);
+  if (st.groups > 1) CHECK_EQ(st.shards, 2 * st.groups);
+  pool.stop();
+}
+
+TEST_CASE(perf_collector_counts_a_cgroup_across_cpus) {
+  const std::string cg = own_cgroup();
+  // The root cgroup is every CPU's whole count, which per-CPU scopes cover.
+  if (cg.empty() || cg == "/") SKIP("not in a child cgroup v2 group");
+  PerfOptions o;
+  o.events = kSoftware;
+  o.per_cpu = false;
+  o.cgroups = {cg};
+  PerfCollector c;
+  int rc = c.open(o);
+  if (rc == -ENOSYS || rc == -EACCES || rc == -EPERM || rc == -ENOENT || rc == -EOPNOTSUPP || rc == -EBADF)
+    SKIP("cgroup perf events not available");
+  REQUIRE(rc == 0);
+  SeriesRegistry reg;
+  c.bind_registry(&reg);
+  std::vector<Sample> out;
+  REQUIRE(c.collect(out) == 0);
+  const Sample* before = find_sample(c, out, "perf_task_clock_total", "cgroup", cg);
+  REQUIRE(before);
+  const uint64_t clock0 = before->counter;
+  burn();
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  const Sample* after = find_sample(c, out, "perf_task_clock_total", "cgroup", cg);
+  REQUIRE(after);
+  CHECK(after->counter > clock0);
+}
+
+TEST_CASE(parses_perf_options) {
+  PerfOptions o;
+  CHECK_EQ(parse_perf_options("cgroups=/a.slice:/b.slice/c,per_cpu=0,shard=64,self=0", &o), 0);
+  CHECK_EQ(o.cgroups.size(), 2u);
+  CHECK(o.cgroups[1] == "/b.slice/c");
+  CHECK(!o.per_cpu);
+  CHECK_EQ(o.shard_groups, 64u);
+  CHECK(!o.self);
+  CHECK_EQ(parse_perf_options("shard=0", &o), -EINVAL);
+  CHECK_EQ(parse_perf_options("self=yes", &o), -EINVAL);
+  CHECK_EQ(parse_perf_options("bogus=1", &o), -EINVAL);
+}
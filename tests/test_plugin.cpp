@@ -0,0 +1,214 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "sysapm/plugin.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+const std::string kBuilt = SYSAPM_TEST_PLUGIN_DIR "/sysapm-interrupts.so";
+
+// A scratch directory holding a copy of the plugin and a proc root of its own.
+struct Scratch {
+  test::TempDir tmp{"plugin"};
+  std::string dir = tmp.path;
+  std::string lib = dir + "/interrupts.so";
+  Scratch() { std::filesystem::create_directories(dir + "/proc"); }
+
+  // Installs a fresh copy the way package managers do: write aside, rename.
+  void install() const {
+    std::filesystem::copy_file(kBuilt, lib + ".new", std::filesystem::copy_options::overwrite_existing);
+    std::filesystem::rename(lib + ".new", lib);
+  }
+  // A column per CPU in `cpus` (by default CPU1 is offline), `irqs`
+  // numbered rows, and optionally ERR.
+  void interrupts(int irqs, bool err, const std::vector<int>& cpus = {0, 2}) const {
+    std::ofstream f(dir + "/proc/interrupts");
+    f << "     ";
+    for (int cpu : cpus) f << "      CPU" << cpu;
+    f << "\n";
+    for (int i = 0; i < irqs; ++i) {
+      f << "  " << i << ":";
+      for (std::size_t j = 0; j < cpus.size(); ++j) f << "   " << i * 10 + static_cast<int>(j);
+      f << "   IO-APIC  edge  dev\n";
+    }
+    f << "NMI:";
+    for (std::size_t j = 0; j < cpus.size(); ++j) f << "   " << 4 + j;
+    f << "   Non-maskable interrupts\n";
+    if (err) f << "ERR:          3\n";
+  }
+  PluginOptions options() const {
+    PluginOptions o;
+    o.path = lib;
+    o.args = "proc_root=" + dir + "/proc";
+    o.check_ticks = 1;
+    return o;
+  }
+};
+
+const Sample* find(const SeriesRegistry& reg, const std::vector<Sample>& out, const char* irq, const char* cpu) {
+  const uint32_t id = reg.find("interrupts_per_cpu_total", {{"irq", irq}, {"cpu", cpu}});
+  for (const Sample& s : out)
+    if (id && s.series == id) return &s;
+  return nullptr;
+}
+
+}  // namespace
+
+TEST_CASE(plugin_fills_a_batch_bigger_than_its_first_capacity) {
+  if (::access(kBuilt.c_str(), R_OK) != 0) SKIP("plugins not built");
+  Scratch scratch;
+  scratch.install();
+  scratch.interrupts(700, true);  // 1400 rows outgrow the initial 1024
+  SeriesRegistry reg;
+  PluginCollector c;
+  c.bind_registry(&reg);
+  std::string why;
+  REQUIRE(c.open(scratch.options(), &why) == 0);
+  CHECK(std::string(c.name()) == "interrupts");
+  std::vector<Sample> out;
+  REQUIRE(c.collect(out) == 0);
+  CHECK_EQ(out.size(), 700u * 2 + 2 + 1);
+  CHECK_EQ(c.stats().series, out.size());
+  CHECK_EQ(c.stats().dropped_rows, 0u);
+  const Sample* s = find(reg, out, "699", "2");
+  REQUIRE(s);
+  CHECK(s->kind == SampleKind::kCounter);
+  CHECK_EQ(s->counter, 6991u);
+  s = find(reg, out, "ERR", "0");
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 3u);
+  CHECK(!find(reg, out, "ERR", "2"));
+  CHECK(!find(reg, out, "0", "1"));  // offline CPUs have no column
+
+  // Steady state: the same series, no new handles.
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  CHECK_EQ(out.size(), 700u * 2 + 2 + 1);
+  CHECK_EQ(c.stats().loads, 1u);
+}
+
+TEST_CASE(plugin_loader_reports_what_is_wrong) {
+  if (::access(kBuilt.c_str(), R_OK) != 0) SKIP("plugins not built");
+  Scratch scratch;
+  scratch.install();
+  scratch.interrupts(1, false);
+  PluginCollector c;
+  std::string why;
+  PluginOptions o = scratch.options();
+  o.args = "bogus=1";
+  CHECK_EQ(c.open(o, &why), -EINVAL);
+  CHECK(!why.empty());
+  CHECK(!c.loaded());
+  CHECK_EQ(c.stats().load_errors, 1u);
+  o.path = scratch.dir + "/missing.so";
+  CHECK_EQ(c.open(o, &why), -ENOENT);
+  // An in-tree plugin has no C entry point; load_plugin() takes it.
+  o.path = SYSAPM_TEST_PLUGIN_DIR "/sysapm-sched.so";
+  if (::access(o.path.c_str(), R_OK) == 0) CHECK_EQ(c.open(o, &why), -ENOEXEC);
+}
+
+TEST_CASE(plugin_reloads_a_new_build_and_unloads_a_removed_one) {
+  if (::access(kBuilt.c_str(), R_OK) != 0) SKIP("plugins not built");
+  Scratch scratch;
+  scratch.install();
+  scratch.interrupts(2, true);
+  SeriesRegistry reg;
+  PluginCollector c;
+  c.bind_registry(&reg);
+  REQUIRE(c.open(scratch.options()) == 0);
+  std::vector<Sample> out;
+  REQUIRE(c.collect(out) == 0);
+  REQUIRE(out.size() == 7u);
+  const uint32_t err_id = find(reg, out, "ERR", "0")->series;
+  const uint32_t irq1 = find(reg, out, "1", "2")->series;
+
+  // A new build goes in while the host stops reporting ERR: the new build
+  // keeps the other series, and ERR is marked stale.
+  scratch.install();
+  scratch.interrupts(2, false);
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  CHECK_EQ(c.stats().loads, 2u);
+  CHECK_EQ(c.stats().unloads, 1u);
+  REQUIRE(out.size() == 7u);
+  CHECK(out[6].stale());
+  CHECK_EQ(out[6].series, err_id);
+  CHECK(find(reg, out, "1", "2")->series == irq1);
+
+  // Unchanged file, nothing happens; a forced reload changes nothing visible.
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  CHECK_EQ(c.stats().loads, 2u);
+  c.request_reload();
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  CHECK_EQ(c.stats().loads, 3u);
+  CHECK_EQ(out.size(), 6u);
+
+  // Removed: every series goes stale and the lane idles.
+  std::filesystem::remove(scratch.lib);
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  CHECK(!c.loaded());
+  REQUIRE(out.size() == 6u);
+  for (const Sample& s : out) CHECK(s.stale());
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  CHECK(out.empty());
+
+  // A file that will not load is reported once, not retried every tick.
+  { std::ofstream(scratch.lib) << "not an ELF file\n"; }
+  REQUIRE(c.collect(out) == 0);
+  CHECK_EQ(c.stats().load_errors, 1u);
+  REQUIRE(c.collect(out) == 0);
+  CHECK_EQ(c.stats().load_errors, 1u);
+
+  // Back again.
+  scratch.install();
+  out.clear();
+  REQUIRE(c.collect(out) == 0);
+  CHECK(c.loaded());
+  CHECK_EQ(out.size(), 6u);
+  CHECK(find(reg, out, "1", "2")->series == irq1);
+}
+
+TEST_CASE(plugin_series_keep_their_handles_across_cpu_hotplug) {
+  if (::access(kBuilt.c_str(), R_OK) != 0) SKIP("plugins not built");
+  Scratch scratch;
+  scratch.install();
+  scratch.interrupts(50, false);
+  SeriesRegistry reg;
+  PluginCollector c;
+  c.bind_registry(&reg);
+  REQUIRE(c.open(scratch.options()) == 0);
+  std::vector<Sample> out;
+  REQUIRE(c.collect(out) == 0);
+  REQUIRE(out.size() == 51u * 2);
+  const uint32_t irq7 = find(reg, out, "7", "2")->series;
+  // CPU1 comes and goes: only its own series are new, and never again.
+  for (int round = 0; round < 10; ++round) {
+    scratch.interrupts(50, false, {0, 1, 2});
+    out.clear();
+    REQUIRE(c.collect(out) == 0);
+    CHECK_EQ(out.size(), 51u * 3);
+    CHECK_EQ(find(reg, out, "7", "2")->series, irq7);
+    CHECK_EQ(find(reg, out, "7", "2")->counter, 72u);
+    scratch.interrupts(50, false);
+    out.clear();
+    REQUIRE(c.collect(out) == 0);
+    CHECK_EQ(out.size(), 51u * 2);
+    CHECK_EQ(find(reg, out, "7", "2")->series, irq7);
+  }
+  CHECK_EQ(c.stats().series, 51u * 3);
+  CHECK_EQ(c.stats().dropped_rows, 0u);
+}
@@ -0,0 +1,139 @@
+#include <cstring>
+#include <vector>
+
+#include "sysapm/proc_sampler.hpp"
+#include "sysapm/text.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+SamplerOptions fixture_options() {
+  SamplerOptions o;
+  o.proc_root = SYSAPM_TEST_FIXTURES "/proc";
+  return o;
+}
+
+}  // namespace
+
+TEST_CASE(parses_fixture_tables) {
+  ProcSampler s;
+  REQUIRE(s.open(fixture_options()) == 0);
+  CHECK_EQ(s.sources(), kSourceStat | kSourceMeminfo | kSourceLoadavg | kSourceNetDev |
+                            kSourceDiskstats);
+  REQUIRE(s.sample() == 0);
+  const ProcSnapshot& snap = s.snapshot();
+
+  CHECK_EQ(snap.cpu.cpus.size(), 4u);
+  CHECK_EQ(snap.cpu.total.v[kStatCpuSchema.index("user")], 40100u);
+  CHECK_EQ(snap.cpu.total.v[kStatCpuSchema.index("steal")], 35u);
+  CHECK_EQ(snap.cpu.cpus[1].v[kStatCpuSchema.index("idle")], 219000u);
+  CHECK_EQ(snap.cpu.v[kStatSchema.index("ctxt")], 5721904u);
+  CHECK_EQ(snap.cpu.v[kStatSchema.index("procs_blocked")], 1u);
+
+  CHECK_EQ(snap.mem.v[kMeminfoSchema.index("MemTotal")], 6158152u);
+  CHECK_EQ(snap.mem.v[kMeminfoSchema.index("MemAvailable")], 5713476u);
+  CHECK_EQ(snap.mem.v[kMeminfoSchema.index("Dirty")], 180u);
+
+  CHECK(snap.load.load1 > 0.519 && snap.load.load1 < 0.521);
+  CHECK(snap.load.load15 > 10.08 && snap.load.load15 < 10.1);
+  CHECK_EQ(snap.load.running, 3u);
+  CHECK_EQ(snap.load.total, 1093u);
+  CHECK_EQ(snap.load.last_pid, 123456u);
+
+  REQUIRE(snap.net.size() == 2);
+  CHECK(std::strcmp(snap.net[1].name, "eth0") == 0);
+  CHECK_EQ(snap.net[1].v[kNetDevSchema.index("rx_bytes")], 4242000000u);
+  CHECK_EQ(snap.net[1].v[kNetDevSchema.index("rx_multicast")], 12u);
+  CHECK_EQ(snap.net[1].v[kNetDevSchema.index("tx_drop")], 3u);
+
+  REQUIRE(snap.disks.size() == 4);
+  CHECK(std::strcmp(snap.disks[1].name, "nvme0n1") == 0);
+  CHECK_EQ(snap.disks[1].major, 259u);
+  CHECK_EQ(snap.disks[1].v[kDiskstatsSchema.index("sectors_written")], 990000000u);
+  CHECK_EQ(snap.disks[1].v[kDiskstatsSchema.index("flush_ms")], 7000u);
+  // Old-format rows leave the newer columns zero.
+  CHECK_EQ(snap.disks[2].v[kDiskstatsSchema.index("discards")], 0u);
+  CHECK_EQ(snap.disks[3].v[kDiskstatsSchema.index("weighted_io_ms")], 1000u);
+}
+
+TEST_CASE(resample_keeps_buffers) {
+  ProcSampler s;
+  REQUIRE(s.open(fixture_options()) == 0);
+  REQUIRE(s.sample() == 0);
+  const auto* cpus = s.snapshot().cpu.cpus.data();
+  const auto* disks = s.snapshot().disks.data();
+  for (int i = 0; i < 10; ++i) REQUIRE(s.sample() == 0);
+  CHECK(s.snapshot().cpu.cpus.data() == cpus);
+  CHECK(s.snapshot().disks.data() == disks);
+  CHECK_EQ(s.snapshot().disks.size(), 4u);
+}
+
+TEST_CASE(small_buffer_grows_once) {
+  ProcFile f;
+  REQUIRE(f.open(SYSAPM_TEST_FIXTURES "/proc/meminfo", 64) == 0);
+  long n = f.read();
+  REQUIRE(n > 64);
+  unsigned grows = f.grow_count();
+  CHECK(grows > 0);
+  CHECK_EQ(f.read(), n);
+  CHECK_EQ(f.grow_count(), grows);
+  CHECK(f.data().starts_with("MemTotal:"));
+}
+
+TEST_CASE(live_proc_if_present) {
+  ProcSampler s;
+  if (s.open() != 0) SKIP("/proc/stat not readable");
+  CHECK_EQ(s.sample(), 0);
+  CHECK(s.snapshot().cpu.total.v[kStatCpuSchema.index("idle")] > 0);
+}
+
+TEST_CASE(schema_key_index_and_encoder) {
+  static_assert(KeyIndex<kMeminfoSchema>::find("MemAvailable") == kMeminfoSchema.index("MemAvailable"));
+  for (std::size_t i = 0; i < kMeminfoSchema.size(); ++i)
+    CHECK_EQ(KeyIndex<kMeminfoSchema>::find(kMeminfoSchema.fields[i].key), static_cast<int>(i));
+  for (std::size_t i = 0; i < kStatSchema.size(); ++i)
+    CHECK_EQ(KeyIndex<kStatSchema>::find(kStatSchema.fields[i].key), static_cast<int>(i));
+  CHECK_EQ(KeyIndex<kMeminfoSchema>::find("MemAvailabl"), -1);
+  CHECK_EQ(KeyIndex<kMeminfoSchema>::find("Hugepagesize"), -1);
+  CHECK_EQ(KeyIndex<kStatSchema>::find(""), -1);
+
+  // Unpublished fields get no id and no sample; kinds and scales come
+  // from the schema.
+  SeriesRegistry r;
+  uint32_t ids[kStatSchema.size()];
+  intern_schema<kStatSchema>(r, {{"host", "a"}}, ids);
+  CHECK_EQ(ids[kStatSchema.index("btime")], 0u);
+  CHECK_EQ(r.find("procs_running", {{"host", "a"}}), ids[kStatSchema.index("procs_running")]);
+  uint64_t v[kStatSchema.size()] = {10, 20, 30, 4, 5, 6, 7};
+  std::vector<Sample> out;
+  emit_schema<kStatSchema>(1, ids, v, out);
+  REQUIRE(out.size() == 5u);
+  CHECK(out[0].kind == SampleKind::kCounter);
+  CHECK_EQ(out[0].counter, 10u);
+  CHECK(out[3].kind == SampleKind::kGauge);
+  CHECK_EQ(out[3].gauge, 4.0);
+
+  uint32_t cpu[kCpuFieldCount];
+  intern_schema<kStatCpuSchema>(r, {{"cpu", "3"}}, cpu);
+  CHECK_EQ(r.find("cpu_ticks_total", {{"cpu", "3"}, {"mode", "steal"}}), cpu[kStatCpuSchema.index("steal")]);
+  uint64_t mem[kMeminfoSchema.size()] = {2};
+  uint32_t mem_ids[kMeminfoSchema.size()];
+  intern_schema<kMeminfoSchema>(r, {}, mem_ids);
+  out.clear();
+  emit_schema<kMeminfoSchema>(1, mem_ids, mem, out);
+  REQUIRE(out.size() == kMeminfoSchema.size());
+  CHECK_EQ(out[0].gauge, 2048.0);
+}
+
+TEST_CASE(text_helpers) {
+  uint64_t v = 0;
+  CHECK(parse_u64("18446744073709551615", v) && v == 18446744073709551615ull);
+  CHECK(!parse_u64("12a", v));
+  double d = 0;
+  CHECK(parse_fixed("3.25", d) && d == 3.25);
+  FieldReader f("  12\t34 x 5");
+  uint64_t out[4];
+  CHECK_EQ(f.read_u64s(out, 4), 2u);
+}
@@ -0,0 +1,184 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "sysapm/pid_table.hpp"
+#include "sysapm/process_collector.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+namespace fs = std::filesystem;
+
+TEST_CASE(pid_table_matches_reference) {
+  PidTable<uint64_t> t(16);
+  std::unordered_map<int32_t, uint64_t> ref;
+  std::mt19937 rng(3);
+  for (int i = 0; i < 200000; ++i) {
+    int32_t pid = 1 + static_cast<int32_t>(rng() % 5000);
+    if (rng() % 3 == 0) {
+      CHECK_EQ(t.erase(pid), ref.erase(pid) == 1);
+    } else {
+      t.insert(pid) = static_cast<uint64_t>(i);
+      ref[pid] = static_cast<uint64_t>(i);
+    }
+  }
+  CHECK_EQ(t.size(), ref.size());
+  for (auto& [pid, v] : ref) {
+    uint64_t* got = t.find(pid);
+    REQUIRE(got);
+    CHECK_EQ(*got, v);
+  }
+  // retain() must visit every entry exactly once even while shifting.
+  std::size_t visited = 0;
+  t.retain([&](int32_t pid, uint64_t&) {
+    ++visited;
+    return pid % 2 == 0;
+  });
+  CHECK_EQ(visited, ref.size());
+  std::size_t even = 0;
+  for (auto& [pid, v] : ref) {
+    if (pid % 2 == 0) {
+      ++even;
+      CHECK(t.find(pid) != nullptr);
+    } else {
+      CHECK(t.find(pid) == nullptr);
+    }
+  }
+  CHECK_EQ(t.size(), even);
+}
+
+TEST_CASE(parses_stat_with_tricky_comm) {
+  const char line[] =
+      "4242 (my (odd) proc) R 1 4242 4242 0 -1 4194304 1000 0 3 0 7700 1300 0 0 20 -5 12 0 "
+      "185000 2147483648 51200 18446744073709551615\n";
+  ProcessStats s;
+  REQUIRE(parse_pid_stat(line, line + sizeof line - 1, s));
+  CHECK(std::string(s.comm) == "my (odd) proc");
+  CHECK_EQ(s.state, 'R');
+  CHECK_EQ(s.ppid, 1);
+  CHECK_EQ(s.majflt, 3u);
+  CHECK_EQ(s.utime, 7700u);
+  CHECK_EQ(s.nice, -5);
+  CHECK_EQ(s.num_threads, 12u);
+  CHECK_EQ(s.starttime, 185000u);
+  CHECK_EQ(s.rss, 51200u);
+  CHECK(!parse_pid_stat(line, line + 20, s));
+}
+
+TEST_CASE(collects_fixture_processes) {
+  ProcessCollectorOptions o;
+  o.proc_root = SYSAPM_TEST_FIXTURES "/proc";
+  o.use_connector = false;
+  o.backend = ProcessBackend::kProcfs;
+  ProcessCollector c;
+  REQUIRE(c.open(o) == 0);
+  REQUIRE(c.collect() == 0);
+  CHECK_EQ(c.table().size(), 2u);
+  const auto* init = c.table().find(1);
+  REQUIRE(init);
+  CHECK(std::string(init->stats.comm) == "systemd");
+  CHECK_EQ(init->stats.voluntary_ctxt, 51234u);
+  const auto* odd = c.table().find(4242);
+  REQUIRE(odd);
+  CHECK_EQ(odd->stats.uid, 1000u);
+  CHECK_EQ(odd->stats.vm_swap_kb, 2048u);
+  CHECK_EQ(odd->stats.nonvoluntary_ctxt, 4500u);
+  // Cached fds: a steady tick is one pread per file, nothing else.
+  REQUIRE(c.collect() == 0);
+  CHECK_EQ(c.stats().syscalls_last_tick, 4u);
+}
+
+TEST_CASE(rescan_drops_vanished_pids) {
+  fs::path root = fs::temp_directory_path() / ("sysapm-proc-" + std::to_string(getpid()));
+  fs::remove_all(root);
+  fs::create_directories(root);
+  fs::copy(SYSAPM_TEST_FIXTURES "/proc/1", root / "1");
+  fs::copy(SYSAPM_TEST_FIXTURES "/proc/4242", root / "4242");
+
+  ProcessCollectorOptions o;
+  o.proc_root = root.string();
+  o.use_connector = false;
+  o.fallback_rescan_ticks = 1;
+  o.backend = ProcessBackend::kProcfs;
+  ProcessCollector c;
+  REQUIRE(c.open(o) == 0);
+  REQUIRE(c.collect() == 0);
+  CHECK_EQ(c.table().size(), 2u);
+  fs::remove_all(root / "4242");
+  REQUIRE(c.collect() == 0);
+  CHECK_EQ(c.table().size(), 1u);
+  CHECK_EQ(c.stats().removed, 1u);
+  fs::remove_all(root);
+}
+
+TEST_CASE(tracks_live_fork_and_exit) {
+  ProcessCollectorOptions o;
+  o.fallback_rescan_ticks = 1;
+  ProcessCollector c;
+  if (c.open(o) != 0) SKIP("/proc not readable");
+  pid_t child = fork();
+  REQUIRE(child >= 0);
+  if (child == 0) {
+    pause();
+    _exit(0);
+  }
+  usleep(20000);
+  REQUIRE(c.collect() == 0);
+  CHECK(c.table().find(child) != nullptr);
+  kill(child, SIGKILL);
+  waitpid(child, nullptr, 0);
+  REQUIRE(c.collect() == 0);
+  CHECK(c.table().find(child) == nullptr);
+  std::fprintf(stderr, "  connector %s, %llu events\n", c.connector_active() ? "active" : "off",
+               static_cast<unsigned long long>(c.stats().events));
+}
+
+TEST_CASE(taskstats_queries_live_groups) {
+  TaskstatsClient ts;
+  int rc = ts.open(4);
+  if (rc == -EPERM || rc == -ENOENT) SKIP("taskstats not permitted or not built in");
+  REQUIRE(rc == 0);
+  // Burn a little CPU so our own group has a nonzero runtime.
+  volatile uint64_t x = 0;
+  for (int i = 0; i < 2000000; ++i) x = x + static_cast<uint64_t>(i);
+  // More groups than one batch, plus one that cannot exist.
+  std::vector<int32_t> tgids(9, static_cast<int32_t>(getpid()));
+  tgids[4] = 0x3ffffff0;
+  std::vector<TaskstatsRecord> out(tgids.size());
+  int n = ts.query(tgids.data(), tgids.size(), out.data());
+  CHECK_EQ(n, 8);
+  CHECK(out[0].tgid == getpid());
+  CHECK(out[0].cpu_ns > 0);
+}
+
+TEST_CASE(taskstats_backend_cuts_syscalls) {
+  ProcessCollectorOptions procfs;
+  procfs.backend = ProcessBackend::kProcfs;
+  ProcessCollectorOptions tstats;
+  tstats.backend = ProcessBackend::kTaskstats;
+  ProcessCollector a, b;
+  if (a.open(procfs) != 0) SKIP("/proc not readable");
+  int rc = b.open(tstats);
+  if (rc == -EPERM || rc == -ENOENT) SKIP("taskstats not permitted or not built in");
+  REQUIRE(rc == 0);
+  for (int i = 0; i < 3; ++i) {
+    REQUIRE(a.collect() == 0);
+    REQUIRE(b.collect() == 0);
+  }
+  CHECK(b.taskstats_active());
+  const ProcessEntry* self = b.table().find(getpid());
+  REQUIRE(self);
+  CHECK(self->stats.cpu_ns > 0);
+  CHECK(self->stats.uid == getuid());
+  std::fprintf(stderr, "  %zu processes: procfs %llu syscalls/tick, taskstats %llu\n",
+               b.table().size(), static_cast<unsigned long long>(a.stats().syscalls_last_tick),
+               static_cast<unsigned long long>(b.stats().syscalls_last_tick));
+  CHECK(b.stats().syscalls_last_tick < a.stats().syscalls_last_tick);
+}
@@ -0,0 +1,227 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "sysapm/query.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+constexpr int64_t kSec = 1000000000;
+constexpr int64_t kT0 = 1699999200 * kSec;
+
+// Three cgroups of a gauge and a counter, one sample a second for an hour.
+struct Fixture {
+  SeriesRegistry reg;
+  ChunkStore store;
+  uint32_t gauge[3], counter[3];
+
+  Fixture() : store(small_blocks()) {
+    const char* groups[] = {"/a", "/b", "/sys"};
+    for (int g = 0; g < 3; ++g) {
+      gauge[g] = reg.intern("pressure", {{"cgroup", groups[g]}, {"host", "h1"}});
+      counter[g] = reg.intern("usage_usec_total", {{"cgroup", groups[g]}});
+    }
+    for (int t = 0; t < 3600; ++t)
+      for (int g = 0; g < 3; ++g) {
+        // Gauge g counts 0..99 over and over, offset by 100 * g.
+        store.append(Sample::make_gauge(kT0 + t * kSec, gauge[g], 100.0 * g + t % 100));
+        // Counter g grows by (g + 1) per second, with a reset half way.
+        const uint64_t v = t < 1800 ? uint64_t(t) * (g + 1) : uint64_t(t - 1800) * (g + 1);
+        store.append(Sample::make_counter(kT0 + t * kSec, counter[g], v));
+      }
+  }
+  static StoreOptions small_blocks() {
+    StoreOptions o;
+    o.block_ns = 600 * kSec;  // six sealed chunks per series
+    return o;
+  }
+};
+
+Query query(std::string_view text) {
+  Query q;
+  CHECK(parse_query(text, kT0 + 3599 * kSec, &q) == 0);
+  return q;
+}
+
+}  // namespace
+
+TEST_CASE(parses_queries) {
+  Query q = query("p99(cgroup_cpu_pressure{cgroup=~\"/kubepods.*\", host!=\"x\"}[30m]) by (cgroup)");
+  CHECK(q.agg == QueryAgg::kQuantile);
+  CHECK_EQ(q.quantile, 0.99);
+  CHECK_EQ(q.metric, "cgroup_cpu_pressure");
+  REQUIRE(q.matchers.size() == 2);
+  CHECK(q.matchers[0].op == MatchOp::kPrefix);
+  CHECK_EQ(q.matchers[0].value, "/kubepods");
+  CHECK(q.matchers[1].op == MatchOp::kNotEqual);
+  CHECK_EQ(q.to_ns - q.from_ns, 1800 * kSec);
+  CHECK(q.grouped);
+  CHECK((q.by == std::vector<std::string>{"cgroup"}));
+
+  q = query("max(up[5s]) by ()");
+  CHECK(q.agg == QueryAgg::kMax);
+  CHECK(q.grouped && q.by.empty());
+  CHECK_EQ(query("p999(x{}[1h])").quantile, 0.999);
+  CHECK(!query("rate(x[1d])").grouped);
+
+  Query bad;
+  CHECK_EQ(parse_query("p99(x)", 0, &bad), -EINVAL);             // no range
+  CHECK_EQ(parse_query("median(x[1m])", 0, &bad), -EINVAL);
+  CHECK_EQ(parse_query("avg(x{a=~\"b|c\"}[1m])", 0, &bad), -EINVAL);  // not a prefix
+  CHECK_EQ(parse_query("avg(x[1m]) by (a", 0, &bad), -EINVAL);
+  CHECK_EQ(parse_query("avg(x[1m]) junk", 0, &bad), -EINVAL);
+}
+
+TEST_CASE(gauge_aggregations_per_series_and_group) {
+  Fixture f;
+  QueryEngine e(f.store, f.reg);
+  std::vector<QueryRow> rows;
+  QueryStats st;
+  REQUIRE(e.run(query("max(pressure[1h])"), &rows, &st) == 0);
+  REQUIRE(rows.size() == 3);
+  CHECK_EQ(rows[0].group, "pressure{cgroup=\"/sys\",host=\"h1\"}");
+  CHECK_EQ(rows[0].value, 299.0);
+  CHECK_EQ(rows[2].value, 99.0);
+  CHECK_EQ(st.series, 3u);
+  CHECK_EQ(st.samples, 3u * 3600);
+
+  REQUIRE(e.run(query("avg(pressure{cgroup!=\"/sys\"}[1h]) by ()"), &rows) == 0);
+  REQUIRE(rows.size() == 1);
+  CHECK_EQ(rows[0].group, "{}");
+  CHECK_EQ(rows[0].series, 2u);
+  CHECK(std::fabs(rows[0].value - 99.5) < 1e-9);  // mean of 49.5 and 149.5
+
+  REQUIRE(e.run(query("p50(pressure{cgroup=~\"/s.*\"}[1h]) by (host)"), &rows) == 0);
+  REQUIRE(rows.size() == 1);
+  CHECK_EQ(rows[0].group, "{host=\"h1\"}");
+  CHECK_EQ(rows[0].value, 249.0);  // nearest rank of 3600 points: the 1800th
+  REQUIRE(e.run(query("count(pressure{cgroup=\"/a\"}[10s])"), &rows) == 0);
+  REQUIRE(rows.size() == 1);
+  CHECK_EQ(rows[0].value, 11.0);  // [now - 10s, now] holds both ends
+}
+
+TEST_CASE(counters_become_rates_with_resets) {
+  Fixture f;
+  QueryEngine e(f.store, f.reg);
+  std::vector<QueryRow> rows;
+  REQUIRE(e.run(query("max(usage_usec_total[1h]) by (cgroup)"), &rows) == 0);
+  REQUIRE(rows.size() == 3);
+  CHECK_EQ(rows[0].group, "{cgroup=\"/sys\"}");
+  CHECK_EQ(rows[0].value, 3.0);  // the reset sample's delta is its own value, 0
+  CHECK_EQ(rows[2].value, 1.0);
+
+  REQUIRE(e.run(query("rate(usage_usec_total[1h]) by ()"), &rows) == 0);
+  REQUIRE(rows.size() == 1);
+  // Increase over 3599 s: 1799 * (1 + 2 + 3) before the reset, 1799 * 6 after.
+  CHECK(std::fabs(rows[0].value - 2.0 * 1799 * 6 / 3599) < 1e-9);
+}
+
+TEST_CASE(time_range_skips_chunks) {
+  Fixture f;
+  f.store.seal_all();
+  QueryEngine e(f.store, f.reg);
+  std::vector<QueryRow> rows;
+  QueryStats st;
+  REQUIRE(e.run(query("last(pressure{cgroup=\"/b\"}[5m])"), &rows, &st) == 0);
+  REQUIRE(rows.size() == 1);
+  CHECK_EQ(rows[0].value, 100.0 + 3599 % 100);
+  CHECK_EQ(rows[0].samples, 301u);
+  CHECK_EQ(st.chunks.chunks, 1u);
+  CHECK_EQ(st.chunks.skipped, 5u);
+}
+
+TEST_CASE(parallel_scan_matches_inline) {
+  SeriesRegistry reg;
+  ChunkStore store;
+  std::vector<uint32_t> ids;
+  for (int i = 0; i < 200; ++i) ids.push_back(reg.intern("m", {{"i", std::to_string(i)}}));
+  for (int t = 0; t < 600; ++t)
+    for (std::size_t i = 0; i < ids.size(); ++i)
+      store.append(Sample::make_gauge(kT0 + t * kSec, ids[i], static_cast<double>(i * 1000 + t)));
+  ThreadPool pool;
+  REQUIRE(pool.start({3}) == 0);
+  QueryEngine par(store, reg, &pool), seq(store, reg);
+  Query q;
+  REQUIRE(parse_query("avg(m[10m]) by ()", kT0 + 599 * kSec, &q) == 0);
+  std::vector<QueryRow> a, b;
+  REQUIRE(par.run(q, &a) == 0);
+  REQUIRE(seq.run(q, &b) == 0);
+  REQUIRE(a.size() == 1 && b.size() == 1);
+  CHECK_EQ(a[0].samples, 200u * 600);
+  CHECK(std::fabs(a[0].value - b[0].value) < 1e-6);
+  CHECK(std::fabs(a[0].value - (99500.0 + 299.5)) < 1e-6);
+  // A series interned after the first query is picked up by the next.
+  const uint32_t late = reg.intern("m", {{"i", "late"}});
+  store.append(Sample::make_gauge(kT0 + 599 * kSec, late, 0));
+  REQUIRE(par.run(q, &a) == 0);
+  CHECK_EQ(a[0].series, 201u);
+}
+
+TEST_CASE(query_socket_round_trip) {
+  Fixture f;
+  QueryEngine e(f.store, f.reg);
+  QueryServer srv;
+  const std::string path = "/tmp/sysapm-query-" + std::to_string(::getpid()) + ".sock";
+  REQUIRE(srv.open(path) == 0);
+  std::string reply;
+  std::atomic<bool> done{false};
+  std::thread client([&] {
+    CHECK_EQ(query_socket(path, "max(pressure{cgroup=\"/a\"}[1h])", &reply), 0);
+    done = true;
+  });
+  while (!done) srv.serve(e, kT0 + 3599 * kSec);
+  client.join();
+  CHECK_EQ(reply, "pressure{cgroup=\"/a\",host=\"h1\"} 99\n");
+  std::thread bad([&] { CHECK_EQ(query_socket(path, "nonsense", &reply), 0); });
+  while (srv.serve(e, 0) == 0) {
+  }
+  bad.join();
+  CHECK(reply.starts_with("error:"));
+}
+
+TEST_CASE(query_socket_cuts_off_a_trickling_client) {
+  Fixture f;
+  QueryEngine e(f.store, f.reg);
+  QueryServer srv;
+  const std::string path = "/tmp/sysapm-query-slow-" + std::to_string(::getpid()) + ".sock";
+  REQUIRE(srv.open(path) == 0);
+  std::atomic<bool> stop{false};
+  std::string reply;
+  // One byte every 100 ms: each recv() is quick, the line takes seconds.
+  std::thread client([&] {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    REQUIRE(::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof addr) == 0);
+    const std::string line = "max(pressure{cgroup=\"/a\"}[1h])\n";
+    for (std::size_t i = 0; i < line.size() && !stop; ++i) {
+      if (::send(fd, &line[i], 1, MSG_NOSIGNAL) != 1) break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    char buf[256];
+    ssize_t n;
+    while ((n = ::recv(fd, buf, sizeof buf, 0)) > 0) reply.append(buf, static_cast<std::size_t>(n));
+    ::close(fd);
+  });
+  const auto t0 = std::chrono::steady_clock::now();
+  while (srv.serve(e, kT0 + 3599 * kSec) == 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  const auto took = std::chrono::steady_clock::now() - t0;
+  stop = true;
+  client.join();
+  CHECK(took < std::chrono::milliseconds(2500));
+  CHECK(reply.starts_with("error:"));
+}
@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "sysapm/rollup.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+constexpr int64_t kSec = 1000000000;
+constexpr int64_t kT0 = 1699999200 * kSec;  // a multiple of 5 min
+
+struct Collected {
+  std::vector<RollupPoint> points;
+  std::vector<HistogramSnapshot> hists;
+  RollupStage::Sink sink() {
+    return [this](const RollupPoint* p, std::size_t n) {
+      for (std::size_t i = 0; i < n; ++i) {
+        points.push_back(p[i]);
+        if (p[i].histogram) hists.push_back(*p[i].histogram);
+      }
+    };
+  }
+  std::vector<RollupPoint> of(uint32_t series, uint8_t window) const {
+    std::vector<RollupPoint> r;
+    for (const auto& p : points)
+      if (p.last.series == series && p.window == window) r.push_back(p);
+    return r;
+  }
+};
+
+}  // namespace
+
+TEST_CASE(gauge_windows_match_a_rescan) {
+  Collected got;
+  RollupStage st({}, got.sink());
+  std::mt19937 rng(5);
+  std::vector<Sample> raw;
+  for (int t = 0; t < 600; ++t) raw.push_back(Sample::make_gauge(kT0 + t * kSec, 1, rng() % 1000 / 10.0));
+  st.append(raw.data(), raw.size());
+  st.flush();
+  const auto ten = got.of(1, 0);
+  REQUIRE(ten.size() == 60u);
+  REQUIRE(got.of(1, 1).size() == 10u);
+  REQUIRE(got.of(1, 2).size() == 2u);
+  for (std::size_t w = 0; w < ten.size(); ++w) {
+    double mn = 1e9, mx = -1e9, sum = 0;
+    for (std::size_t i = w * 10; i < w * 10 + 10; ++i) {
+      mn = std::min(mn, raw[i].gauge);
+      mx = std::max(mx, raw[i].gauge);
+      sum += raw[i].gauge;
+    }
+    CHECK_EQ(ten[w].start_ns, kT0 + static_cast<int64_t>(w) * 10 * kSec);
+    CHECK_EQ(ten[w].count, 10u);
+    CHECK_EQ(ten[w].min, mn);
+    CHECK_EQ(ten[w].max, mx);
+    CHECK(std::abs(ten[w].sum - sum) < 1e-9);
+    CHECK_EQ(ten[w].last.gauge, raw[w * 10 + 9].gauge);
+  }
+  // Egress: one point per 10 samples at the upstream resolution.
+  CHECK_EQ(st.stats().samples, 600u);
+}
+
+TEST_CASE(counter_increase_spans_windows_and_resets) {
+  Collected got;
+  RollupStage st({}, got.sink());
+  uint64_t v = 1000, total = 0;
+  for (int t = 0; t < 60; ++t) {
+    if (t == 33) {
+      v = 5;  // restart
+      total += 5;
+    } else if (t > 0) {
+      v += 7;
+      total += 7;
+    }
+    st.append(Sample::make_counter(kT0 + t * kSec, 9, v));
+  }
+  st.flush();
+  double sum = 0;
+  for (const auto& p : got.of(9, 0)) sum += p.sum;
+  CHECK_EQ(sum, static_cast<double>(total));
+  const auto minute = got.of(9, 1);
+  REQUIRE(minute.size() == 1u);
+  CHECK_EQ(minute[0].sum, static_cast<double>(total));
+  CHECK_EQ(minute[0].last.counter, v);
+  CHECK(minute[0].last.kind == SampleKind::kCounter);
+}
+
+TEST_CASE(advance_closes_quiet_series_and_late_samples_drop) {
+  Collected got;
+  RollupOptions o;
+  o.windows_ns = {10 * kSec};
+  RollupStage st(o, got.sink());
+  st.append(Sample::make_gauge(kT0 + 1 * kSec, 3, 1.0));
+  st.append(Sample::make_gauge(kT0 + 2 * kSec, 4, 2.0));
+  st.advance(kT0 + 11 * kSec);  // inside the grace period
+  CHECK(got.points.empty());
+  st.advance(kT0 + 12 * kSec);
+  CHECK_EQ(got.points.size(), 2u);
+  st.append(Sample::make_gauge(kT0 + 5 * kSec, 3, 9.0));  // that window is gone
+  CHECK_EQ(st.stats().late, 1u);
+  st.append(Sample::make_gauge(kT0 + 13 * kSec, 3, 9.0));
+  st.flush();
+  CHECK_EQ(got.points.size(), 3u);
+  CHECK_EQ(st.stats().points, 3u);
+}
+
+TEST_CASE(stale_marker_closes_windows_and_passes_through) {
+  Collected got;
+  RollupStage st({}, got.sink());
+  st.append(Sample::make_counter(kT0 + 1 * kSec, 1, 100));
+  st.append(Sample::make_counter(kT0 + 2 * kSec, 1, 130));
+  st.append(Sample::make_stale(kT0 + 3 * kSec, 1, SampleKind::kCounter));
+  for (uint8_t w = 0; w < 3; ++w) {
+    auto pts = got.of(1, w);
+    REQUIRE(pts.size() == 2);
+    CHECK_EQ(pts[0].count, 2u);
+    CHECK_EQ(pts[0].sum, 30.0);
+    CHECK(pts[1].last.stale());
+    CHECK_EQ(pts[1].count, 0u);
+  }
+  // A new incarnation starts over instead of counting from 130.
+  st.append(Sample::make_counter(kT0 + 4 * kSec, 1, 5));
+  st.append(Sample::make_counter(kT0 + 5 * kSec, 1, 7));
+  st.flush();
+  auto pts = got.of(1, 0);
+  REQUIRE(pts.size() == 3);
+  CHECK_EQ(pts[2].sum, 2.0);
+}
+
+TEST_CASE(histogram_windows_merge_their_snapshots) {
+  Collected got;
+  RollupOptions o;
+  o.windows_ns = {10 * kSec, 60 * kSec};
+  RollupStage st(o, got.sink());
+  HistogramSnapshot expect_minute(HistogramLayout{});
+  for (int t = 0; t < 60; ++t) {
+    HistogramSnapshot interval(HistogramLayout{});
+    for (int i = 0; i < 100; ++i) interval.add(static_cast<uint64_t>(1000 + t * 100 + i));
+    expect_minute.merge(interval);
+    st.append_histogram(42, kT0 + t * kSec, interval);
+  }
+  st.flush();
+  REQUIRE(got.of(42, 0).size() == 6u);
+  const auto minute = got.of(42, 1);
+  REQUIRE(minute.size() == 1u);
+  REQUIRE(got.hists.size() == 7u);
+  CHECK(got.hists.back().counts() == expect_minute.counts());
+  CHECK_EQ(minute[0].count, 60u);
+  CHECK_EQ(minute[0].last.counter, 6000u);
+  CHECK(minute[0].min <= 1000 && minute[0].max >= 6999);
+}
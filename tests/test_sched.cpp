@@ -0,0 +1,194 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <memory>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "sysapm/bpf.hpp"
+#include "sysapm/plugin.hpp"
+#include "sysapm/sched_collector.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+TEST_CASE(tracepoint_fields_come_from_the_format_file) {
+  const std::string tracefs = SYSAPM_TEST_FIXTURES "/tracing";
+  TracepointField f;
+  REQUIRE(tracepoint_field(tracefs, "sched", "sched_switch", "next_pid", &f) == 0);
+  CHECK_EQ(f.offset, 56u);
+  CHECK_EQ(f.size, 4u);
+  REQUIRE(tracepoint_field(tracefs, "sched", "sched_switch", "prev_state", &f) == 0);
+  CHECK_EQ(f.offset, 32u);
+  CHECK_EQ(f.size, 8u);
+  REQUIRE(tracepoint_field(tracefs, "sched", "sched_switch", "prev_comm", &f) == 0);
+  CHECK_EQ(f.size, 16u);
+  REQUIRE(tracepoint_field(tracefs, "sched", "sched_wakeup", "pid", &f) == 0);
+  CHECK_EQ(f.offset, 24u);
+  CHECK_EQ(tracepoint_field(tracefs, "sched", "sched_switch", "pid", &f), -ENOENT);  // only prev_/next_pid
+  CHECK_EQ(tracepoint_field(tracefs, "sched", "no_such_event", "pid", &f), -ENOENT);
+}
+
+TEST_CASE(preempt_flag_comes_from_the_print_fmt) {
+  std::string fmt;
+  REQUIRE(tracepoint_print_fmt(SYSAPM_TEST_FIXTURES "/tracing", "sched", "sched_switch", &fmt) == 0);
+  uint64_t flag = 0;
+  REQUIRE(sched_preempt_flag(fmt, &flag) == 0);
+  CHECK_EQ(flag, 0x100u);  // TASK_REPORT_MAX
+  CHECK_EQ(sched_preempt_flag(R"(prev_state=%s%s", ..., REC->prev_state & (2048) ? "+" : "")", &flag), 0);
+  CHECK_EQ(flag, 2048u);  // TASK_STATE_MAX before 4.14
+  CHECK_EQ(sched_preempt_flag(R"(REC->prev_state & (0x3 << 1) ? "+" : "")", &flag), -EINVAL);
+  CHECK_EQ(sched_preempt_flag(R"(REC->prev_state & (0x80 ? "+" : "")", &flag), -EINVAL);
+  CHECK_EQ(sched_preempt_flag(R"(REC->prev_state ? "R" : "")", &flag), -EINVAL);
+}
+
+TEST_CASE(assembler_resolves_forward_and_backward_jumps) {
+  BpfAsm a;
+  auto top = a.label(), end = a.label();
+  a.bind(top);
+  a.jmp_imm(BPF_JEQ, BPF_REG_1, 0, end);
+  a.ld_map(BPF_REG_1, 3);
+  a.ja(top);
+  a.bind(end);
+  a.exit();
+  REQUIRE(a.finish() == 0);
+  const auto& in = a.insns();
+  REQUIRE(in.size() == 5u);
+  CHECK_EQ(in[0].off, 3);   // over the two-slot ld_imm64 and the ja
+  CHECK_EQ(in[1].src_reg, BPF_PSEUDO_MAP_FD);
+  CHECK_EQ(in[3].off, -4);  // back to the top
+  BpfAsm unbound;
+  unbound.ja(unbound.label());
+  CHECK_EQ(unbound.finish(), -EINVAL);
+}
+
+TEST_CASE(options_parse_and_reject_unknown_keys) {
+  SchedOptions o;
+  REQUIRE(parse_sched_options("drain_s=5,max_stacks=128,stack_frames=3,tracefs=/t", &o) == 0);
+  CHECK_EQ(o.drain_interval_ns, 5000000000);
+  CHECK_EQ(o.max_stacks, 128u);
+  CHECK_EQ(o.stack_frames, 3u);
+  CHECK(o.tracefs == "/t");
+  CHECK_EQ(parse_sched_options("drain_s=0", &o), -EINVAL);
+  CHECK_EQ(parse_sched_options("bogus=1", &o), -EINVAL);
+  CHECK_EQ(parse_sched_options("max_tasks", &o), -EINVAL);
+}
+
+TEST_CASE(plugin_loader_checks_the_library) {
+  std::unique_ptr<Collector> c;
+  std::string why;
+  CHECK_EQ(load_plugin("/nonexistent/sysapm-x.so", "", &c, &why), -ENOENT);
+  CHECK(!why.empty());
+  // The real plugin loads; a bad argument string fails in its factory
+  // before anything touches the kernel.
+  CHECK_EQ(load_plugin(SYSAPM_TEST_PLUGIN_DIR "/sysapm-sched.so", "bogus=1", &c, &why), -EINVAL);
+  CHECK(!c);
+}
+
+TEST_CASE(scheduler_latency_and_offcpu_stacks_are_drained) {
+  SchedCollector sched;
+  SchedOptions o;
+  std::string log;
+  int rc = sched.open(o, &log);
+  if (!log.empty()) std::fprintf(stderr, "%s\n", log.c_str());
+  if (rc == -EPERM || rc == -ENOENT || rc == -EACCES) SKIP("eBPF or tracefs not available");
+  REQUIRE(rc == 0);
+  SeriesRegistry reg;
+  sched.bind_registry(&reg);
+
+  // Two threads handing a token back and forth through pipes block and
+  // wake each other thousands of times.
+  int ab[2], ba[2];
+  REQUIRE(::pipe(ab) == 0 && ::pipe(ba) == 0);
+  constexpr int kRounds = 2000;
+  std::thread peer([&] {
+    char c;
+    for (int i = 0; i < kRounds; ++i)
+      if (::read(ab[0], &c, 1) != 1 || ::write(ba[1], &c, 1) != 1) break;
+  });
+  char c = 'x';
+  for (int i = 0; i < kRounds; ++i)
+    if (::write(ab[1], &c, 1) != 1 || ::read(ba[0], &c, 1) != 1) break;
+  peer.join();
+  for (int fd : {ab[0], ab[1], ba[0], ba[1]}) ::close(fd);
+
+  std::vector<Sample> out;
+  REQUIRE(sched.drain(out) == 0);
+  uint64_t runq = 0, offcpu_ns = 0;
+  bool pipe_stack = false;
+  for (const Sample& s : out) {
+    const std::string_view m = reg.metric(s.series);
+    if (m == "sched_runqueue_latency_us_count") runq += s.counter;
+    if (m != "sched_offcpu_ns_total") continue;
+    offcpu_ns += s.counter;
+    for (std::size_t i = 0; i < reg.label_count(s.series); ++i)
+      if (reg.label(s.series, i).name == "stack" && reg.label(s.series, i).value.find("pipe_read") != std::string_view::npos)
+        pipe_stack = true;
+  }
+  CHECK(runq >= static_cast<uint64_t>(kRounds));
+  CHECK(offcpu_ns > 0);
+  CHECK(pipe_stack);
+  // Counters are cumulative and series ids are stable across drains.
+  std::vector<Sample> again;
+  REQUIRE(sched.drain(again) == 0);
+  CHECK(again.size() >= out.size());
+  CHECK_EQ(sched.drains(), 2u);
+}
+
+TEST_CASE(preempted_tasks_wait_on_the_run_queue_not_off_cpu) {
+  SchedCollector sched;
+  SchedOptions o;
+  o.stack_frames = 16;
+  int rc = sched.open(o);
+  if (rc == -EPERM || rc == -ENOENT || rc == -EACCES) SKIP("eBPF or tracefs not available");
+  REQUIRE(rc == 0);
+  SeriesRegistry reg;
+  sched.bind_registry(&reg);
+  auto runq_count = [&](const std::vector<Sample>& out) {
+    uint64_t n = 0;
+    for (const Sample& s : out)
+      if (reg.metric(s.series) == "sched_runqueue_latency_us_count") n += s.counter;
+    return n;
+  };
+  std::vector<Sample> before;
+  REQUIRE(sched.drain(before) == 0);
+
+  // Two threads pinned to one CPU stay runnable and preempt each other.
+  // Reading /dev/zero keeps them in the kernel, where a preempted task
+  // reports TASK_REPORT_MAX rather than TASK_RUNNING.
+  const int cpu = ::sched_getcpu();
+  REQUIRE(cpu >= 0);
+  auto spin = [cpu] {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    ::pthread_setaffinity_np(::pthread_self(), sizeof set, &set);
+    std::vector<char> buf(1 << 24);
+    const int fd = ::open("/dev/zero", O_RDONLY | O_CLOEXEC);
+    const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(300);
+    while (fd >= 0 && std::chrono::steady_clock::now() < until)
+      if (::read(fd, buf.data(), buf.size()) < 0) break;
+    if (fd >= 0) ::close(fd);
+  };
+  std::thread a(spin), b(spin);
+  a.join();
+  b.join();
+
+  std::vector<Sample> out;
+  REQUIRE(sched.drain(out) == 0);
+  CHECK(runq_count(out) > runq_count(before));
+  uint64_t spinner_offcpu_ns = 0;
+  for (const Sample& s : out) {
+    if (reg.metric(s.series) != "sched_offcpu_ns_total") continue;
+    for (std::size_t i = 0; i < reg.label_count(s.series); ++i)
+      if (reg.label(s.series, i).name == "stack" && reg.label(s.series, i).value.find("read_zero") != std::string_view::npos)
+        spinner_offcpu_ns += s.counter;
+  }
+  CHECK_EQ(spinner_offcpu_ns, 0u);
+}
@@ -0,0 +1,181 @@
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "sysapm/chunk_store.hpp"
+#include "sysapm/segment.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr int64_t kSec = 1000000000;
+constexpr int64_t kT0 = 1699999200 * kSec;
+
+StoreOptions minute_blocks() {
+  StoreOptions o;
+  o.block_ns = 60 * kSec;
+  o.retention_ns = 24 * 3600 * kSec;
+  return o;
+}
+
+// Two series, `ticks` seconds each, one block per minute.
+void fill(ChunkStore& st, int from, int ticks) {
+  for (int i = from; i < from + ticks; ++i) {
+    const int64_t ts = kT0 + int64_t{i} * kSec;
+    st.append(Sample::make_counter(ts, 301, 1000ull * i));
+    st.append(Sample::make_gauge(ts, 102, 0.5 * (i % 7)));
+  }
+}
+
+bool matches(const ChunkStore& st, int ticks) {
+  std::size_t n = 0;
+  bool ok = true;
+  st.scan(301, 0, std::numeric_limits<int64_t>::max(), [&](const Sample& s) {
+    ok &= s.ts_ns == kT0 + static_cast<int64_t>(n) * kSec && s.counter == 1000ull * n;
+    ++n;
+  });
+  ok &= n == static_cast<std::size_t>(ticks);
+  n = 0;
+  st.scan(102, 0, std::numeric_limits<int64_t>::max(), [&](const Sample& s) {
+    ok &= s.gauge == 0.5 * static_cast<double>(n % 7);
+    ++n;
+  });
+  return ok && n == static_cast<std::size_t>(ticks);
+}
+
+}  // namespace
+
+TEST_CASE(sealed_chunks_are_served_from_the_mapping) {
+  test::TempDir dir("segment");
+  SegmentStore seg;
+  REQUIRE(seg.open({dir.path}) == 0);
+  ChunkStore st(minute_blocks());
+  CHECK_EQ(st.attach(&seg), 0u);
+  fill(st, 0, 600);
+  st.seal_all();
+  CHECK(matches(st, 600));
+  StoreStats ss = st.stats();
+  CHECK_EQ(ss.sealed_chunks, 20u);
+  CHECK_EQ(ss.mapped_bytes, ss.bytes);
+  SegmentStats gs = seg.stats();
+  CHECK_EQ(gs.segments, 1u);
+  CHECK_EQ(gs.chunks, 20u);
+  CHECK_EQ(gs.write_errors, 0u);
+}
+
+TEST_CASE(reopen_adopts_segments_without_replay) {
+  test::TempDir dir("segment");
+  {
+    SegmentStore seg;
+    REQUIRE(seg.open({dir.path}) == 0);
+    ChunkStore st(minute_blocks());
+    st.attach(&seg);
+    fill(st, 0, 300);
+    st.seal_all();
+  }  // finishing the segment writes its footer
+  SegmentStore seg;
+  REQUIRE(seg.open({dir.path}) == 0);
+  CHECK_EQ(seg.stats().recovered_chunks, 0u);
+  ChunkStore st(minute_blocks());
+  CHECK_EQ(st.attach(&seg), 10u);
+  CHECK(matches(st, 300));
+  // Appends continue after the adopted history; older samples are refused.
+  CHECK(!st.append(Sample::make_counter(kT0, 301, 0)));
+  fill(st, 300, 60);
+  CHECK(matches(st, 360));
+  CHECK_EQ(st.stats().samples, 720u);
+}
+
+TEST_CASE(unfinished_segment_is_recovered_up_to_torn_record) {
+  test::TempDir dir("segment");
+  test::TempDir crashed("segment");
+  std::string file;
+  {
+    SegmentStore seg;
+    REQUIRE(seg.open({dir.path}) == 0);
+    ChunkStore st(minute_blocks());
+    st.attach(&seg);
+    fill(st, 0, 300);
+    st.seal_all();
+    // Capture the active segment as a crash would leave it, then tear the
+    // tail with a partial record.
+    for (auto& e : fs::directory_iterator(dir.path)) file = e.path().filename();
+    fs::copy_file(dir.path + "/" + file, crashed.path + "/" + file);
+    std::ofstream(crashed.path + "/" + file, std::ios::app | std::ios::binary) << "SCHK torn";
+  }
+  SegmentStore seg;
+  REQUIRE(seg.open({crashed.path}) == 0);
+  CHECK_EQ(seg.stats().recovered_chunks, 10u);
+  ChunkStore st(minute_blocks());
+  CHECK_EQ(st.attach(&seg), 10u);
+  CHECK(matches(st, 300));
+  CHECK_EQ(fs::file_size(crashed.path + "/" + file) % kSegmentPage, 0u);  // finished on recovery
+}
+
+TEST_CASE(garbage_trailer_falls_back_to_recovery) {
+  test::TempDir dir("segment");
+  std::string file;
+  {
+    SegmentStore seg;
+    REQUIRE(seg.open({dir.path}) == 0);
+    ChunkStore st(minute_blocks());
+    st.attach(&seg);
+    fill(st, 0, 300);
+    st.seal_all();
+    REQUIRE(seg.finish() == 0);
+    for (auto& e : fs::directory_iterator(dir.path)) file = e.path().filename();
+  }
+  // A footer offset that wraps the bounds check back into the file.
+  const std::string path = dir.path + "/" + file;
+  const auto size = fs::file_size(path);
+  SegmentTrailer tr;
+  {
+    std::ifstream f(path, std::ios::binary);
+    f.seekg(static_cast<std::streamoff>(size - sizeof tr));
+    f.read(reinterpret_cast<char*>(&tr), sizeof tr);
+  }
+  tr.footer_offset = std::numeric_limits<uint64_t>::max() - sizeof(FooterEntry) + 1;
+  tr.entries = 1;
+  {
+    std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(static_cast<std::streamoff>(size - sizeof tr));
+    f.write(reinterpret_cast<const char*>(&tr), sizeof tr);
+  }
+  SegmentStore seg;
+  REQUIRE(seg.open({dir.path}) == 0);
+  CHECK_EQ(seg.stats().recovered_chunks, 10u);
+  ChunkStore st(minute_blocks());
+  CHECK_EQ(st.attach(&seg), 10u);
+  CHECK(matches(st, 300));
+}
+
+TEST_CASE(segments_rotate_and_expire) {
+  test::TempDir dir("segment");
+  SegmentStore seg;
+  SegmentOptions so{dir.path};
+  so.segment_bytes = 2 * kSegmentPage;
+  so.sync = false;
+  REQUIRE(seg.open(so) == 0);
+  StoreOptions o = minute_blocks();
+  o.retention_ns = 600 * kSec;
+  ChunkStore st(o);
+  st.attach(&seg);
+  fill(st, 0, 3600);
+  st.seal_all();
+  CHECK(seg.stats().segments > 2);
+  CHECK(matches(st, 3600));
+  const uint64_t before = seg.stats().segments;
+  st.expire(kT0 + 3600 * kSec);
+  SegmentStats gs = seg.stats();
+  CHECK(gs.removed > 0);
+  CHECK_EQ(gs.segments + gs.removed, before);
+  std::size_t files = 0;
+  for ([[maybe_unused]] auto& e : fs::directory_iterator(dir.path)) ++files;
+  CHECK_EQ(files, gs.segments);
+  CHECK_EQ(st.stats().samples, 2u * 600);
+}
@@ -0,0 +1,114 @@
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sysapm/pipeline.hpp"
+#include "sysapm/self_profile.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+class SleepyCollector final : public Collector {
+ public:
+  const char* name() const override { return "sleepy"; }
+  int collect(std::vector<Sample>& out) override {
+    if (!series_) series_ = registry().intern("sleepy");
+    StageTimer timer(Stage::kParse);
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+    out.push_back(Sample::make_gauge(0, series_, 1));
+    return 0;
+  }
+
+ private:
+  uint32_t series_ = 0;
+};
+
+void time_sleeps(Stage s, int n, std::chrono::microseconds each) {
+  for (int i = 0; i < n; ++i) {
+    StageTimer timer(s);
+    std::this_thread::sleep_for(each);
+  }
+}
+
+}  // namespace
+
+TEST_CASE(stage_timers_record_into_their_stage) {
+  StageProfiler& p = stage_profiler();
+  p.configure({});
+  const StageStats before = p.stats(Stage::kSend);
+  const StageStats other = p.stats(Stage::kCompress);
+  time_sleeps(Stage::kSend, 5, std::chrono::microseconds(2000));
+  const StageStats after = p.stats(Stage::kSend);
+  CHECK_EQ(after.calls - before.calls, 5u);
+  CHECK(after.total_ns - before.total_ns >= 10000000u);
+  CHECK(after.total_ns - before.total_ns < 1000000000u);
+  CHECK_EQ(p.stats(Stage::kCompress).calls, other.calls);
+  CHECK(std::string(stage_name(Stage::kCompress)) == "compress");
+}
+
+TEST_CASE(disabled_profiler_records_nothing) {
+  StageProfiler& p = stage_profiler();
+  SelfProfileOptions off;
+  off.enabled = false;
+  p.configure(off);
+  const StageStats before = p.stats(Stage::kEncode);
+  time_sleeps(Stage::kEncode, 3, std::chrono::microseconds(100));
+  if (!p.active()) CHECK_EQ(p.stats(Stage::kEncode).calls, before.calls);
+  p.configure({});
+}
+
+TEST_CASE(tsc_clock_agrees_with_the_raw_clock) {
+  StageProfiler& p = stage_profiler();
+  SelfProfileOptions o;
+  o.clock = ProfileClock::kTsc;
+  if (p.configure(o) != ProfileClock::kTsc) {
+    p.configure({});
+    SKIP("no invariant TSC");
+  }
+  const HistogramSnapshot before = p.histogram(Stage::kSend).snapshot();
+  time_sleeps(Stage::kSend, 4, std::chrono::microseconds(5000));
+  HistogramSnapshot window = p.histogram(Stage::kSend).snapshot();
+  window.subtract(before);
+  p.configure({});
+  CHECK_EQ(window.count(), 4u);
+  // Bucket bounds are within 6.25%; sleeps only ever run long.
+  CHECK(window.quantile(0.0) >= 4500000u);
+  CHECK(window.quantile(1.0) < 100000000u);
+}
+
+TEST_CASE(pipeline_publishes_stage_series) {
+  stage_profiler().configure({});
+  Pipeline p;
+  p.add(std::make_unique<SleepyCollector>());
+  std::atomic<uint64_t> parse_calls{0};
+  std::atomic<uint32_t> calls_id{0};
+  PipelineOptions o;
+  o.interval_ns = 10000000;
+  REQUIRE(p.start(o, [&](const Sample* s, std::size_t n) {
+            for (std::size_t i = 0; i < n; ++i)
+              if (calls_id.load() && s[i].series == calls_id.load()) parse_calls.store(s[i].counter);
+          }) == 0);
+  calls_id.store(p.registry().find("system_apm_self_stage_calls_total", {{"stage", "parse"}}));
+  std::this_thread::sleep_for(std::chrono::milliseconds(120));
+  p.stop();
+  CHECK(calls_id.load() != 0);
+  CHECK(parse_calls.load() >= 3u);
+  CHECK(p.registry().find("system_apm_self_stage_duration_p99_ns", {{"stage", "collect"}}) != 0);
+  CHECK(p.registry().find("system_apm_self_stage_ns_total", {{"stage", "send"}}) != 0);
+}
+
+#if SYSAPM_HAVE_USDT
+TEST_CASE(usdt_probe_is_described_in_the_binary) {
+  std::ifstream exe("/proc/self/exe", std::ios::binary);
+  const std::string image((std::istreambuf_iterator<char>(exe)), std::istreambuf_iterator<char>());
+  CHECK(image.find(std::string("stapsdt\0", 8)) != std::string::npos);
+  CHECK(image.find(std::string("sysapm\0stage\0", 13)) != std::string::npos);
+}
+#endif
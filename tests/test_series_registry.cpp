@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sysapm/series_registry.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+TEST_CASE(label_order_does_not_change_identity) {
+  SeriesRegistry r;
+  const uint32_t a = r.intern("cpu_ticks_total", {{"cpu", "0"}, {"mode", "user"}});
+  const uint32_t b = r.intern("cpu_ticks_total", {{"mode", "user"}, {"cpu", "0"}});
+  const uint32_t c = r.intern("cpu_ticks_total", {{"cpu", "1"}, {"mode", "user"}});
+  CHECK_EQ(a, 1u);
+  CHECK_EQ(a, b);
+  CHECK_EQ(c, 2u);
+  CHECK_EQ(r.size(), 2u);
+  CHECK_EQ(r.find("cpu_ticks_total", {{"mode", "user"}, {"cpu", "1"}}), c);
+  CHECK_EQ(r.find("cpu_ticks_total", {{"cpu", "2"}, {"mode", "user"}}), 0u);
+  CHECK_EQ(r.find("missing_metric"), 0u);
+  CHECK_EQ(r.size(), 2u);  // find() never adds
+  // Shared strings are stored once: metric, cpu, 0, 1, mode, user.
+  CHECK_EQ(r.stats().symbols, 6u);
+}
+
+TEST_CASE(invalid_series_are_refused) {
+  SeriesRegistry r;
+  CHECK_EQ(r.intern(""), 0u);
+  CHECK_EQ(r.intern("m", {{"a", "1"}, {"a", "2"}}), 0u);
+  std::vector<Label> many(SeriesRegistry::kMaxLabels + 1);
+  std::vector<std::string> names;
+  for (std::size_t i = 0; i < many.size(); ++i) names.push_back("l" + std::to_string(i));
+  for (std::size_t i = 0; i < many.size(); ++i) many[i] = {names[i], "v"};
+  CHECK_EQ(r.intern("m", many.data(), many.size()), 0u);
+  CHECK(r.intern("m", many.data(), SeriesRegistry::kMaxLabels) != 0);
+  CHECK(!r.contains(0));
+  CHECK(r.metric(99).empty());
+}
+
+TEST_CASE(format_escapes_label_values) {
+  SeriesRegistry r;
+  const uint32_t plain = r.intern("load1");
+  const uint32_t id = r.intern("disk_reads_total", {{"device", "a\"b\\c\nd"}, {"class", "x"}});
+  char buf[128];
+  CHECK(r.format(plain, buf, sizeof buf));
+  CHECK(std::string(buf) == "load1");
+  CHECK(r.format(id, buf, sizeof buf));
+  CHECK(std::string(buf) == "disk_reads_total{class=\"x\",device=\"a\\\"b\\\\c\\nd\"}");
+  CHECK_EQ(r.label_count(id), 2u);
+  CHECK(r.label(id, 1).name == "device");
+  CHECK(!r.format(id, buf, 20));  // too small: refused, not truncated
+  CHECK_EQ(buf[0], '\0');
+}
+
+TEST_CASE(high_cardinality_labels) {
+  SeriesRegistry r;
+  constexpr int kPids = 50000;
+  char pid[16];
+  for (int i = 0; i < kPids; ++i) {
+    std::snprintf(pid, sizeof pid, "%d", i);
+    CHECK_EQ(r.intern("process_rss_bytes", {{"pid", pid}, {"comm", "worker"}}), static_cast<uint32_t>(i + 1));
+  }
+  for (int i = 0; i < kPids; i += 997) {
+    std::snprintf(pid, sizeof pid, "%d", i);
+    CHECK_EQ(r.find("process_rss_bytes", {{"comm", "worker"}, {"pid", pid}}), static_cast<uint32_t>(i + 1));
+    CHECK(r.label(static_cast<uint32_t>(i + 1), 1).value == pid);
+  }
+  RegistryStats st = r.stats();
+  CHECK_EQ(st.series, static_cast<uint64_t>(kPids));
+  CHECK_EQ(st.symbols, static_cast<uint64_t>(kPids) + 4);
+  CHECK(st.bytes / kPids < 128);
+}
+
+TEST_CASE(readers_resolve_ids_while_writers_intern) {
+  SeriesRegistry r;
+  constexpr int kWriters = 4, kPerWriter = 20000;
+  std::atomic<bool> done{false};
+  std::atomic<uint64_t> bad{0};
+  std::thread reader([&] {
+    char buf[64];
+    while (!done.load()) {
+      const std::size_t n = r.size();
+      for (std::size_t id = n > 64 ? n - 64 : 1; id <= n; ++id)
+        if (!r.format(static_cast<uint32_t>(id), buf, sizeof buf) || r.metric(static_cast<uint32_t>(id)) != "m")
+          bad.fetch_add(1);
+    }
+  });
+  std::vector<std::thread> writers;
+  std::vector<std::vector<uint32_t>> ids(kWriters);
+  for (int w = 0; w < kWriters; ++w) {
+    writers.emplace_back([&, w] {
+      char v[16];
+      // Every writer interns the same keys, racing on each one.
+      for (int i = 0; i < kPerWriter; ++i) {
+        std::snprintf(v, sizeof v, "%d", i);
+        ids[w].push_back(r.intern("m", {{"k", v}}));
+      }
+    });
+  }
+  for (auto& t : writers) t.join();
+  done = true;
+  reader.join();
+  CHECK_EQ(bad.load(), 0u);
+  CHECK_EQ(r.size(), static_cast<std::size_t>(kPerWriter));
+  for (int w = 1; w < kWriters; ++w) CHECK(ids[w] == ids[0]);
+}
+
+TEST_CASE(capped_metric_refuses_new_label_sets_without_storing_them) {
+  SeriesRegistry r;
+  CardinalityLimits lim;
+  lim.per_metric = 4;
+  lim.headroom = 2;
+  lim.overrides = {{"free", 0}};
+  r.set_limits(lim);
+  char v[16];
+  std::vector<uint32_t> ids;
+  for (int i = 0; i < 8; ++i) {
+    std::snprintf(v, sizeof v, "c%d", i);
+    ids.push_back(r.intern("conns", {{"port", v}}));
+    CHECK(ids.back() != 0);
+    CHECK_EQ(r.limited(ids.back()), i >= 3);  // limited from the fourth on
+  }
+  const RegistryStats before = r.stats();
+  const uint32_t other = r.intern("conns", {{"port", "c8"}});
+  CHECK(std::find(ids.begin(), ids.end(), other) == ids.end());
+  CHECK_EQ(r.find("conns", {{"series", "other"}}), other);
+  const std::size_t symbols = r.stats().symbols;
+  for (int i = 9; i < 2000; ++i) {
+    std::snprintf(v, sizeof v, "c%d", i);
+    CHECK_EQ(r.intern("conns", {{"port", v}}), other);
+  }
+  CHECK_EQ(r.stats().symbols, symbols);  // refused values leave nothing behind
+  CHECK_EQ(r.size(), before.series + 1);
+  CHECK_EQ(r.intern("conns", {{"port", "c5"}}), ids[5]);  // known sets still resolve
+
+  MetricCardinality c;
+  REQUIRE(r.cardinality(ids[0], &c));
+  CHECK(c.metric == "conns");
+  CHECK_EQ(c.cap, 4u);
+  CHECK_EQ(c.interned, 8u);
+  CHECK_EQ(c.overflow, other);
+  CHECK_EQ(c.refused, 1992u);
+  CHECK(c.estimate > 1800 && c.estimate < 2200);
+  CHECK_EQ(r.limited_metrics().size(), 1u);
+
+  // Unlimited by override, and other metrics keep their own count.
+  for (int i = 0; i < 100; ++i) {
+    std::snprintf(v, sizeof v, "%d", i);
+    CHECK(r.intern("free", {{"k", v}}) != 0);
+  }
+  CHECK(!r.limited(r.find("free", {{"k", "99"}})));
+  CHECK_EQ(r.limit_epoch(), 1u);
+}
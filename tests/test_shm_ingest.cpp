@@ -0,0 +1,213 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sysapm/shm_client.hpp"
+#include "sysapm/shm_ingest.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+struct Agent {
+  std::string path = "/tmp/sysapm-ingest-" + std::to_string(::getpid()) + ".sock";
+  SeriesRegistry reg;
+  ShmIngestCollector c;
+  int open() {
+    c.bind_registry(&reg);
+    ShmIngestOptions o;
+    o.socket_path = path;
+    return c.open(o);
+  }
+  std::vector<Sample> tick() {
+    std::vector<Sample> out;
+    c.collect(out);
+    return out;
+  }
+  const Sample* find(const std::vector<Sample>& out, const char* metric, std::initializer_list<Label> labels) const {
+    const uint32_t id = reg.find(metric, labels);
+    if (id == 0) return nullptr;
+    for (const Sample& s : out)
+      if (s.series == id) return &s;
+    return nullptr;
+  }
+};
+
+}  // namespace
+
+TEST_CASE(histogram_buckets_are_upper_inclusive_powers_of_two) {
+  CHECK_EQ(shm::hist_bucket(0), 0u);
+  CHECK_EQ(shm::hist_bucket(1), 0u);
+  CHECK_EQ(shm::hist_bucket(2), 1u);
+  CHECK_EQ(shm::hist_bucket(3), 2u);
+  CHECK_EQ(shm::hist_bucket(4), 2u);
+  CHECK_EQ(shm::hist_bucket(5), 3u);
+  CHECK_EQ(shm::hist_bucket(uint64_t{1} << 37), shm::kHistBuckets - 2);
+  CHECK_EQ(shm::hist_bucket(~uint64_t{0}), shm::kHistBuckets - 1);
+}
+
+TEST_CASE(client_handles_work_before_an_agent_takes_the_region) {
+  shm::Client client;
+  CHECK_EQ(client.connect("app", "/nonexistent/ingest.sock", 4), -ENOENT);
+  CHECK(!client.attached());
+  shm::Counter a = client.counter("hits_total");
+  REQUIRE(a);
+  a.add(3);
+  // The same key is the same slot; the same key as another kind is refused.
+  shm::Counter again = client.counter("hits_total");
+  again.add();
+  CHECK(!client.gauge("hits_total"));
+  CHECK(client.gauge("queue_depth", {{"queue", "in"}}));
+  CHECK(client.histogram("latency_us"));
+  CHECK(client.counter("more_total"));
+  CHECK(!client.counter("full_total"));  // four slots
+  CHECK(!client.counter(std::string(shm::kKeyBytes, 'x')));
+  shm::Counter none;
+  none.add();  // handles from nowhere do nothing
+}
+
+TEST_CASE(agent_harvests_counters_gauges_and_histograms) {
+  Agent agent;
+  REQUIRE(agent.open() == 0);
+  shm::Client client;
+  REQUIRE(client.connect("checkout", agent.path.c_str()) == 0);
+  CHECK(client.attached());
+  shm::Counter orders = client.counter("orders_total", {{"region", "eu"}});
+  shm::Gauge depth = client.gauge("queue_depth");
+  shm::Histogram lat = client.histogram("latency_us");
+
+  // Several threads update the same handles with no coordination.
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)
+    threads.emplace_back([&] {
+      for (int i = 0; i < 10000; ++i) {
+        orders.add();
+        lat.record(static_cast<uint64_t>(i % 100));
+      }
+    });
+  for (std::thread& t : threads) t.join();
+  depth.set(12.5);
+
+  std::vector<Sample> out = agent.tick();
+  CHECK_EQ(agent.c.stats().clients, 1u);
+  CHECK_EQ(agent.c.stats().slots, 3u);
+  const std::string pid = std::to_string(::getpid());
+  const Sample* s = agent.find(out, "orders_total", {{"app", "checkout"}, {"pid", pid}, {"region", "eu"}});
+  REQUIRE(s);
+  CHECK(s->kind == SampleKind::kCounter);
+  CHECK_EQ(s->counter, 40000u);
+  s = agent.find(out, "queue_depth", {{"app", "checkout"}, {"pid", pid}});
+  REQUIRE(s);
+  CHECK_EQ(s->gauge, 12.5);
+  s = agent.find(out, "latency_us_count", {{"app", "checkout"}, {"pid", pid}});
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 40000u);
+  s = agent.find(out, "latency_us_sum", {{"app", "checkout"}, {"pid", pid}});
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 4u * 100 * 4950);
+  // 0..99: le=1 holds 0 and 1, le=64 everything up to 64, +Inf all.
+  s = agent.find(out, "latency_us_bucket", {{"app", "checkout"}, {"pid", pid}, {"le", "1"}});
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 4u * 100 * 2);
+  s = agent.find(out, "latency_us_bucket", {{"app", "checkout"}, {"pid", pid}, {"le", "64"}});
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 4u * 100 * 65);
+  s = agent.find(out, "latency_us_bucket", {{"app", "checkout"}, {"pid", pid}, {"le", "+Inf"}});
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 40000u);
+
+  // A slot taken after the first harvest shows up on the next one.
+  client.counter("late_total").add(7);
+  orders.add();
+  out = agent.tick();
+  s = agent.find(out, "late_total", {{"app", "checkout"}, {"pid", pid}});
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 7u);
+  s = agent.find(out, "orders_total", {{"app", "checkout"}, {"pid", pid}, {"region", "eu"}});
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 40001u);
+}
+
+TEST_CASE(a_closed_client_is_read_once_more_and_marked_stale) {
+  Agent agent;
+  REQUIRE(agent.open() == 0);
+  shm::Client client;
+  REQUIRE(client.connect("batch", agent.path.c_str()) == 0);
+  shm::Counter done = client.counter("jobs_total");
+  done.add(5);
+  agent.tick();
+  // Reattaching the same region keeps the client and its series.
+  REQUIRE(client.reattach() == 0);
+  done.add(1);
+  std::vector<Sample> out = agent.tick();
+  CHECK_EQ(agent.c.stats().accepted, 1u);
+  CHECK_EQ(agent.c.stats().clients, 1u);
+  const std::string pid = std::to_string(::getpid());
+  const Sample* s = agent.find(out, "jobs_total", {{"app", "batch"}, {"pid", pid}});
+  REQUIRE(s);
+  CHECK_EQ(s->counter, 6u);
+
+  client.close();
+  out = agent.tick();
+  CHECK_EQ(agent.c.stats().clients, 0u);
+  CHECK_EQ(agent.c.stats().detached, 1u);
+  REQUIRE(out.size() == 2u);
+  CHECK(!out[0].stale());
+  CHECK(out[1].stale());
+  CHECK(out[1].kind == SampleKind::kCounter);
+  CHECK(agent.tick().empty());
+}
+
+TEST_CASE(agent_refuses_unsealed_regions_and_reserved_labels) {
+  Agent agent;
+  REQUIRE(agent.open() == 0);
+  // A well-formed hello with a memfd whose size could still shrink.
+  int fd = ::memfd_create("unsealed", MFD_CLOEXEC);
+  REQUIRE(fd >= 0);
+  REQUIRE(::ftruncate(fd, 4 * shm::kSlotBytes) == 0);
+  int s = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, agent.path.c_str(), agent.path.size() + 1);
+  REQUIRE(::connect(s, reinterpret_cast<const sockaddr*>(&addr), sizeof addr) == 0);
+  shm::Hello hello{shm::kRegionMagic, shm::kRegionVersion, "rogue"};
+  iovec iov{&hello, sizeof hello};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  cmsghdr* c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(c), &fd, sizeof fd);
+  REQUIRE(::sendmsg(s, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof hello));
+  CHECK(agent.tick().empty());
+  CHECK_EQ(agent.c.stats().refused, 1u);
+  CHECK_EQ(agent.c.stats().clients, 0u);
+  ::close(s);
+  ::close(fd);
+
+  // The agent sets app and pid itself; a slot claiming either is dropped.
+  shm::Client client;
+  REQUIRE(client.connect("honest", agent.path.c_str()) == 0);
+  client.counter("spoofed_total", {{"app", "other"}}).add();
+  client.counter("bad-name_total").add();
+  client.counter("fine_total").add();
+  std::vector<Sample> out = agent.tick();
+  CHECK_EQ(agent.c.stats().refused_slots, 2u);
+  REQUIRE(out.size() == 1u);
+  CHECK(agent.reg.metric(out[0].series) == "fine_total");
+}
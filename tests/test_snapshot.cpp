@@ -0,0 +1,361 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "sysapm/chunk_store.hpp"
+#include "sysapm/segment.hpp"
+#include "sysapm/snapshot.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr int64_t kSec = 1000000000;
+constexpr int64_t kT0 = 1699999200 * kSec;  // a multiple of 5 min
+
+struct Collected {
+  std::vector<RollupPoint> points;
+  std::vector<HistogramSnapshot> hists;  // by point; empty for plain series
+  RollupStage::Sink sink() {
+    return [this](const RollupPoint* p, std::size_t n) {
+      for (std::size_t i = 0; i < n; ++i) {
+        points.push_back(p[i]);
+        hists.push_back(p[i].histogram ? *p[i].histogram : HistogramSnapshot());
+        points.back().histogram = nullptr;
+      }
+    };
+  }
+  std::vector<RollupPoint> of(uint32_t series, uint8_t window) const {
+    std::vector<RollupPoint> r;
+    for (const auto& p : points)
+      if (p.last.series == series && p.window == window) r.push_back(p);
+    return r;
+  }
+  std::vector<HistogramSnapshot> hists_of(uint32_t series, uint8_t window) const {
+    std::vector<HistogramSnapshot> r;
+    for (std::size_t i = 0; i < points.size(); ++i)
+      if (points[i].last.series == series && points[i].window == window) r.push_back(hists[i]);
+    return r;
+  }
+};
+
+// A different number of observations each second, so the encoded
+// snapshots come in lengths that need padding.
+HistogramSnapshot observations(int t, uint32_t series) {
+  HistogramSnapshot h(HistogramLayout{});
+  for (int i = 0; i <= t; ++i) h.add(static_cast<uint64_t>(series) * 1000 + static_cast<uint64_t>(t * 37 + i * 101));
+  return h;
+}
+
+// One agent run that stores ten seconds of samples for `series` from
+// minute `minute` on into segments under `dir`, with `reg`'s ids.
+void store_run(const std::string& dir, const SeriesRegistry& reg, int minute, const std::vector<uint32_t>& series) {
+  SegmentOptions so;
+  so.dir = dir;
+  so.sync = false;
+  so.origin = reg.origin();
+  SegmentStore seg;
+  REQUIRE(seg.open(so) == 0);
+  ChunkStore st;
+  st.attach(&seg, &reg);
+  for (int t = 0; t < 10; ++t)
+    for (uint32_t id : series) st.append(Sample::make_gauge(kT0 + (minute * 60 + t) * kSec, id, id));
+  st.seal_all();
+  REQUIRE(seg.finish() == 0);
+}
+
+std::size_t stored(const ChunkStore& st, uint32_t series) {
+  return st.scan(series, 0, std::numeric_limits<int64_t>::max(), [](const Sample&) {});
+}
+
+}  // namespace
+
+TEST_CASE(registry_round_trip_keeps_ids) {
+  test::TempDir dir("snapshot");
+  const std::string path = dir.path + "/state.snap";
+  std::vector<uint32_t> ids;
+  {
+    SeriesRegistry reg;
+    ids.push_back(reg.intern("cpu_seconds_total", {{"cpu", "0"}, {"mode", "user"}}));
+    ids.push_back(reg.intern("cpu_seconds_total", {{"mode", "idle"}, {"cpu", "1"}}));
+    ids.push_back(reg.intern("up"));
+    for (int i = 0; i < 1000; ++i) ids.push_back(reg.intern("net_bytes", {{"dev", "eth" + std::to_string(i)}}));
+    REQUIRE(write_snapshot(path, reg, nullptr) == 0);
+  }
+  SnapshotReader rd;
+  REQUIRE(rd.open(path) == 0);
+  SeriesRegistry reg;
+  REQUIRE(rd.restore(&reg) == 0);
+  CHECK_EQ(reg.size(), ids.size());
+  CHECK_EQ(reg.find("cpu_seconds_total", {{"mode", "user"}, {"cpu", "0"}}), ids[0]);
+  CHECK_EQ(reg.find("cpu_seconds_total", {{"cpu", "1"}, {"mode", "idle"}}), ids[1]);
+  CHECK_EQ(reg.find("up"), ids[2]);
+  CHECK_EQ(reg.find("net_bytes", {{"dev", "eth999"}}), ids.back());
+  char name[128];
+  REQUIRE(reg.format(ids[1], name, sizeof name));
+  CHECK_EQ(std::string(name), "cpu_seconds_total{cpu=\"1\",mode=\"idle\"}");
+  // New series continue after the restored ones.
+  CHECK_EQ(reg.intern("new_metric"), static_cast<uint32_t>(ids.size() + 1));
+  CHECK_EQ(reg.intern("up"), ids[2]);
+  // Only an empty registry takes a snapshot, and there is no rollup section.
+  CHECK_EQ(rd.restore(&reg), -EBUSY);
+  Collected got;
+  RollupStage st({}, got.sink());
+  CHECK_EQ(rd.restore(&st), -ENODATA);
+}
+
+TEST_CASE(missing_or_corrupt_files_are_refused) {
+  test::TempDir dir("snapshot");
+  SnapshotReader rd;
+  CHECK_EQ(rd.open(dir.path + "/none.snap"), -ENOENT);
+  const std::string path = dir.path + "/state.snap";
+  {
+    SeriesRegistry reg;
+    reg.intern("up", {{"job", "node"}});
+    REQUIRE(write_snapshot(path, reg, nullptr) == 0);
+  }
+  CHECK(!fs::exists(path + ".tmp"));
+  const auto size = fs::file_size(path);
+  {
+    std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(static_cast<std::streamoff>(size - 3));
+    f.put('\x7f');
+  }
+  CHECK_EQ(rd.open(path), -EINVAL);
+  fs::resize_file(path, 8);
+  CHECK_EQ(rd.open(path), -EINVAL);
+}
+
+TEST_CASE(rollup_round_trip_continues_windows) {
+  test::TempDir dir("snapshot");
+  const std::string path = dir.path + "/state.snap";
+  uint32_t ctr, gauge;
+  {
+    Collected got;
+    SeriesRegistry reg;
+    ctr = reg.intern("requests_total");
+    gauge = reg.intern("load");
+    RollupStage st({}, got.sink());
+    for (int t = 0; t < 15; ++t) {
+      st.append(Sample::make_counter(kT0 + t * kSec, ctr, 1000 + 10 * t));
+      st.append(Sample::make_gauge(kT0 + t * kSec, gauge, t));
+    }
+    st.advance(kT0 + 15 * kSec);
+    REQUIRE(got.of(ctr, 0).size() == 1u);
+    // Two series, each with its 10 s, 1 min and 5 min window.
+    CHECK_EQ(st.open_windows(), 6u);
+    REQUIRE(write_snapshot(path, reg, &st) == 0);
+  }
+  SnapshotReader rd;
+  REQUIRE(rd.open(path) == 0);
+  SeriesRegistry reg;
+  REQUIRE(rd.restore(&reg) == 0);
+  Collected got;
+  RollupStage st({}, got.sink());
+  REQUIRE(rd.restore(&st) == 0);
+  CHECK_EQ(st.open_windows(), 6u);
+  for (int t = 15; t < 20; ++t) {
+    st.append(Sample::make_counter(kT0 + t * kSec, ctr, 1000 + 10 * t));
+    st.append(Sample::make_gauge(kT0 + t * kSec, gauge, t));
+  }
+  st.flush();
+  CHECK_EQ(st.open_windows(), 0u);
+  // The window open at the restart holds samples from both runs.
+  const auto ten = got.of(ctr, 0);
+  REQUIRE(ten.size() == 1u);
+  CHECK_EQ(ten[0].start_ns, kT0 + 10 * kSec);
+  CHECK_EQ(ten[0].count, 10u);
+  CHECK_EQ(ten[0].sum, 100.0);
+  const auto minute = got.of(ctr, 1);
+  REQUIRE(minute.size() == 1u);
+  CHECK_EQ(minute[0].count, 20u);
+  CHECK_EQ(minute[0].sum, 190.0);
+  const auto g = got.of(gauge, 0);
+  REQUIRE(g.size() == 1u);
+  CHECK_EQ(g[0].min, 10.0);
+  CHECK_EQ(g[0].max, 19.0);
+}
+
+TEST_CASE(histogram_windows_continue_after_restore) {
+  test::TempDir dir("snapshot");
+  const std::string path = dir.path + "/state.snap";
+  RollupOptions o;
+  o.windows_ns = {10 * kSec, 60 * kSec};
+  const uint32_t series[] = {42, 43};
+  {
+    Collected got;
+    SeriesRegistry reg;
+    RollupStage st(o, got.sink());
+    for (int t = 0; t < 15; ++t)
+      for (uint32_t id : series) st.append_histogram(id, kT0 + t * kSec, observations(t, id));
+    st.advance(kT0 + 15 * kSec);
+    REQUIRE(got.of(42, 0).size() == 1u);
+    CHECK_EQ(st.open_windows(), 4u);
+    REQUIRE(write_snapshot(path, reg, &st) == 0);
+  }
+  SnapshotReader rd;
+  REQUIRE(rd.open(path) == 0);
+  Collected got;
+  RollupStage st(o, got.sink());
+  REQUIRE(rd.restore(&st) == 0);
+  CHECK_EQ(st.open_windows(), 4u);
+  for (int t = 15; t < 20; ++t)
+    for (uint32_t id : series) st.append_histogram(id, kT0 + t * kSec, observations(t, id));
+  // The restored 10 s windows end at 20 s and close after the grace.
+  st.advance(kT0 + 21 * kSec);
+  CHECK(got.points.empty());
+  st.advance(kT0 + 22 * kSec);
+  CHECK(got.of(42, 1).empty());
+  st.flush();
+  for (uint32_t id : series) {
+    HistogramSnapshot ten(HistogramLayout{}), minute(HistogramLayout{});
+    for (int t = 0; t < 20; ++t) {
+      if (t >= 10) ten.merge(observations(t, id));
+      minute.merge(observations(t, id));
+    }
+    const auto pts = got.of(id, 0);
+    REQUIRE(pts.size() == 1u);
+    CHECK_EQ(pts[0].start_ns, kT0 + 10 * kSec);
+    CHECK_EQ(pts[0].count, 10u);
+    CHECK_EQ(pts[0].last.counter, ten.count());
+    CHECK(got.hists_of(id, 0)[0].counts() == ten.counts());
+    const auto mins = got.of(id, 1);
+    REQUIRE(mins.size() == 1u);
+    CHECK_EQ(mins[0].count, 20u);
+    CHECK(got.hists_of(id, 1)[0].counts() == minute.counts());
+  }
+}
+
+TEST_CASE(counter_baseline_survives_a_closed_window) {
+  test::TempDir dir("snapshot");
+  const std::string path = dir.path + "/state.snap";
+  {
+    Collected got;
+    SeriesRegistry reg;
+    reg.intern("requests_total");
+    RollupStage st({{10 * kSec}, 2 * kSec}, got.sink());
+    st.append(Sample::make_counter(kT0 + 1 * kSec, 1, 500));
+    st.advance(kT0 + 20 * kSec);
+    REQUIRE(got.points.size() == 1u);
+    REQUIRE(write_snapshot(path, reg, &st) == 0);
+  }
+  SnapshotReader rd;
+  REQUIRE(rd.open(path) == 0);
+  Collected got;
+  RollupStage st({{10 * kSec}, 2 * kSec}, got.sink());
+  REQUIRE(rd.restore(&st) == 0);
+  st.append(Sample::make_counter(kT0 + 31 * kSec, 1, 540));
+  st.flush();
+  REQUIRE(got.points.size() == 1u);
+  CHECK_EQ(got.points[0].sum, 40.0);
+}
+
+TEST_CASE(limits_are_recounted_on_load) {
+  test::TempDir dir("snapshot");
+  const std::string path = dir.path + "/state.snap";
+  CardinalityLimits limits;
+  limits.per_metric = 4;
+  uint32_t first;
+  {
+    SeriesRegistry reg;
+    reg.set_limits(limits);
+    first = reg.intern("conns", {{"port", "1"}});
+    for (int i = 2; i <= 4; ++i) reg.intern("conns", {{"port", std::to_string(i)}});
+    reg.intern("up");
+    REQUIRE(reg.limited(first));
+    REQUIRE(write_snapshot(path, reg, nullptr) == 0);
+  }
+  SnapshotReader rd;
+  REQUIRE(rd.open(path) == 0);
+  SeriesRegistry reg;
+  reg.set_limits(limits);
+  REQUIRE(rd.restore(&reg) == 0);
+  CHECK(reg.limited(first));
+  CHECK(!reg.limited(reg.find("up")));
+  const auto lm = reg.limited_metrics();
+  REQUIRE(lm.size() == 1u);
+  CHECK_EQ(lm[0].metric, "conns");
+  CHECK_EQ(lm[0].interned, 4u);
+  // Headroom is counted from the restored series: four more, then overflow.
+  for (int i = 5; i <= 8; ++i) CHECK(reg.intern("conns", {{"port", std::to_string(i)}}) != 0);
+  const uint32_t over = reg.intern("conns", {{"port", "9"}});
+  CHECK_EQ(reg.intern("conns", {{"port", "10"}}), over);
+  CHECK_EQ(reg.limited_metrics()[0].interned, 8u);
+}
+
+TEST_CASE(segments_without_a_matching_snapshot_are_not_adopted) {
+  test::TempDir dir("snapshot");
+  const std::string path = dir.path + "/state.snap";
+  const std::string data = dir.path + "/data";
+  {
+    // A clean run: its segments and the snapshot it leaves agree.
+    SeriesRegistry reg;
+    reg.intern("a");
+    reg.intern("b");
+    store_run(data, reg, 0, {1, 2});
+    REQUIRE(write_snapshot(path, reg, nullptr) == 0);
+  }
+  {
+    // A run that starts from it, interns one more series and crashes.
+    SnapshotReader rd;
+    REQUIRE(rd.open(path) == 0);
+    SeriesRegistry reg;
+    REQUIRE(rd.restore(&reg) == 0);
+    CHECK_EQ(reg.intern("c"), 3u);
+    store_run(data, reg, 1, {1, 2, 3});
+  }
+  {
+    // Restarting from the same snapshot: "c" could be reassigned, so only
+    // the ids both runs inherited are taken from the crashed run.
+    SnapshotReader rd;
+    REQUIRE(rd.open(path) == 0);
+    SeriesRegistry reg;
+    REQUIRE(rd.restore(&reg) == 0);
+    SegmentStore seg;
+    REQUIRE(seg.open({data}) == 0);
+    ChunkStore st;
+    CHECK_EQ(st.attach(&seg, &reg), 4u);
+    CHECK_EQ(st.stats().untrusted_chunks, 1u);
+    CHECK_EQ(stored(st, 1), 20u);
+    CHECK_EQ(stored(st, 2), 20u);
+    CHECK_EQ(stored(st, 3), 0u);
+  }
+  {
+    // Without the snapshot no id is known to mean the same series.
+    SeriesRegistry reg;
+    reg.intern("b");
+    SegmentStore seg;
+    REQUIRE(seg.open({data}) == 0);
+    ChunkStore st;
+    CHECK_EQ(st.attach(&seg, &reg), 0u);
+    CHECK_EQ(st.stats().untrusted_chunks, 5u);
+    CHECK_EQ(stored(st, 1), 0u);
+  }
+  {
+    // A snapshot saved after the crashed run's series vouches for them all.
+    SnapshotReader rd;
+    REQUIRE(rd.open(path) == 0);
+    SeriesRegistry reg;
+    REQUIRE(rd.restore(&reg) == 0);
+    reg.intern("c");
+    store_run(data, reg, 2, {3});
+    REQUIRE(write_snapshot(path, reg, nullptr) == 0);
+    SnapshotReader again;
+    REQUIRE(again.open(path) == 0);
+    SeriesRegistry next;
+    REQUIRE(again.restore(&next) == 0);
+    SegmentStore seg;
+    REQUIRE(seg.open({data}) == 0);
+    ChunkStore st;
+    CHECK_EQ(st.attach(&seg, &next), 5u);
+    CHECK_EQ(st.stats().untrusted_chunks, 1u);
+    CHECK_EQ(stored(st, 3), 10u);
+  }
+}
@@ -0,0 +1,132 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "sysapm/spool.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+namespace fs = std::filesystem;
+
+namespace {
+
+// Record i: `len` bytes, byte k holding the low byte of i + k.
+std::vector<uint8_t> record(uint32_t i, std::size_t len) {
+  std::vector<uint8_t> r(len);
+  for (std::size_t k = 0; k < len; ++k) r[k] = static_cast<uint8_t>(i + k);
+  return r;
+}
+
+SpoolOptions small(const std::string& dir) {
+  SpoolOptions o;
+  o.dir = dir;
+  o.segment_bytes = 64 << 10;
+  o.buffer_bytes = 16 << 10;
+  o.max_bytes = 1 << 20;
+  return o;
+}
+
+}  // namespace
+
+TEST_CASE(spool_pops_in_append_order_across_buffers_and_segments) {
+  test::TempDir dir("spool");
+  Spool sp;
+  REQUIRE(sp.open(small(dir.path)) == 0);
+  CHECK(sp.empty());
+  // Odd lengths so records straddle blocks, flushes and segment ends.
+  for (uint32_t i = 0; i < 300; ++i) {
+    const std::vector<uint8_t> r = record(i, 100 + i * 7 % 1500);
+    REQUIRE(sp.append(r.data(), r.size(), i) == 0);
+  }
+  CHECK(sp.stats().segments > 2u);
+  CHECK_EQ(sp.stats().pending, 300u);
+  std::vector<uint8_t> out;
+  uint32_t points = 0;
+  for (uint32_t i = 0; i < 300; ++i) {
+    REQUIRE(sp.pop(&out, &points) == 1);
+    CHECK_EQ(points, i);
+    CHECK(out == record(i, 100 + i * 7 % 1500));
+  }
+  CHECK_EQ(sp.pop(&out, &points), 0);
+  CHECK(sp.empty());
+  CHECK_EQ(sp.stats().segments, 1u);
+  const std::vector<uint8_t> big(32 << 10);
+  CHECK_EQ(sp.append(big.data(), big.size(), 0), -EFBIG);
+}
+
+TEST_CASE(spool_resumes_from_the_saved_cursor) {
+  test::TempDir dir("spool");
+  std::vector<uint8_t> out;
+  uint32_t points = 0;
+  {
+    Spool sp;
+    REQUIRE(sp.open(small(dir.path)) == 0);
+    for (uint32_t i = 0; i < 100; ++i) REQUIRE(sp.append(record(i, 900).data(), 900, i) == 0);
+    for (uint32_t i = 0; i < 40; ++i) REQUIRE(sp.pop(&out, &points) == 1);
+    sp.sync(0, true);
+    CHECK(sp.stats().syncs >= 1u);
+  }
+  Spool sp;
+  REQUIRE(sp.open(small(dir.path)) == 0);
+  CHECK_EQ(sp.stats().recovered, 60u);
+  REQUIRE(sp.append(record(100, 900).data(), 900, 100) == 0);
+  for (uint32_t i = 40; i <= 100; ++i) {
+    REQUIRE(sp.pop(&out, &points) == 1);
+    CHECK_EQ(points, i);
+    CHECK(out == record(i, 900));
+  }
+  CHECK(sp.empty());
+}
+
+TEST_CASE(spool_evicts_the_oldest_segment_past_its_cap) {
+  test::TempDir dir("spool");
+  SpoolOptions o = small(dir.path);
+  o.max_bytes = 256 << 10;
+  Spool sp;
+  REQUIRE(sp.open(o) == 0);
+  for (uint32_t i = 0; i < 1000; ++i) REQUIRE(sp.append(record(i, 1000).data(), 1000, i) == 0);
+  const SpoolStats st = sp.stats();
+  CHECK(st.bytes <= o.max_bytes);
+  CHECK(st.dropped > 0u);
+  CHECK_EQ(st.pending + st.dropped, 1000u);
+  // What is left is the newest records, still in order.
+  std::vector<uint8_t> out;
+  uint32_t points = 0, expect = static_cast<uint32_t>(st.dropped);
+  while (sp.pop(&out, &points) == 1) CHECK_EQ(points, expect++);
+  CHECK_EQ(expect, 1000u);
+}
+
+TEST_CASE(spool_recovers_up_to_a_torn_record) {
+  test::TempDir dir("spool");
+  {
+    Spool sp;
+    REQUIRE(sp.open(small(dir.path)) == 0);
+    for (uint32_t i = 0; i < 10; ++i) REQUIRE(sp.append(record(i, 500).data(), 500, i) == 0);
+  }
+  // Corrupt the payload of record 6 in the only segment.
+  std::string seg;
+  for (const auto& e : fs::directory_iterator(dir.path))
+    if (e.path().extension() == ".spool") seg = e.path();
+  REQUIRE(!seg.empty());
+  int fd = ::open(seg.c_str(), O_WRONLY);
+  REQUIRE(fd >= 0);
+  const uint8_t junk[4] = {0xde, 0xad, 0xbe, 0xef};
+  const std::size_t rec = sizeof(SpoolRecordHeader) + 504;
+  CHECK_EQ(::pwrite(fd, junk, sizeof junk, static_cast<off_t>(6 * rec + sizeof(SpoolRecordHeader) + 8)), 4);
+  ::close(fd);
+
+  Spool sp;
+  REQUIRE(sp.open(small(dir.path)) == 0);
+  CHECK_EQ(sp.stats().recovered, 6u);
+  REQUIRE(sp.append(record(10, 500).data(), 500, 10) == 0);
+  std::vector<uint8_t> out;
+  uint32_t points = 0;
+  std::vector<uint32_t> seen;
+  while (sp.pop(&out, &points) == 1) seen.push_back(points);
+  CHECK((seen == std::vector<uint32_t>{0, 1, 2, 3, 4, 5, 10}));
+}
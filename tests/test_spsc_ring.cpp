@@ -0,0 +1,176 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "sysapm/pipeline.hpp"
+#include "sysapm/spsc_ring.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+TEST_CASE(batch_push_pop_in_order) {
+  SpscRing<uint64_t> r(8);
+  CHECK_EQ(r.capacity(), 8u);
+  uint64_t in[5] = {1, 2, 3, 4, 5}, out[8];
+  CHECK_EQ(r.push(in, 5), 0u);
+  CHECK_EQ(r.pop(out, 3), 3u);
+  CHECK_EQ(out[2], 3u);
+  CHECK_EQ(r.push(in, 5), 0u);  // wraps around the end of the slot array
+  CHECK_EQ(r.pop(out, 8), 7u);
+  CHECK_EQ(out[0], 4u);
+  CHECK_EQ(out[6], 5u);
+  CHECK_EQ(r.pop(out, 8), 0u);
+}
+
+TEST_CASE(full_ring_drops_oldest) {
+  SpscRing<uint64_t> r(4);
+  uint64_t in[6] = {1, 2, 3, 4, 5, 6}, out[4];
+  CHECK_EQ(r.push(in, 3), 0u);
+  CHECK_EQ(r.push(in + 3, 3), 2u);  // 1 and 2 make room for 4..6
+  CHECK_EQ(r.pop(out, 4), 4u);
+  CHECK_EQ(out[0], 3u);
+  CHECK_EQ(out[3], 6u);
+  // A batch larger than the ring keeps only its newest records.
+  CHECK_EQ(r.push(in, 6), 2u);
+  CHECK_EQ(r.pop(out, 4), 4u);
+  CHECK_EQ(out[0], 3u);
+  RingStats st = r.stats();
+  CHECK_EQ(st.dropped, 4u);
+  CHECK_EQ(st.pushed, 10u);
+  CHECK_EQ(st.popped, 8u);
+  CHECK_EQ(st.high_water, 4u);
+}
+
+TEST_CASE(concurrent_producer_never_blocks) {
+  // The consumer is deliberately slower than the producer, forcing drops
+  // while it copies. Whatever it receives must be strictly increasing, and
+  // every record must be accounted for as popped, dropped or still queued.
+  SpscRing<uint64_t> r(256);
+  constexpr uint64_t kTotal = 2000000;
+  std::atomic<bool> done{false};
+  uint64_t received = 0, last = 0;
+  bool ordered = true;
+  std::thread consumer([&] {
+    uint64_t buf[64];
+    for (;;) {
+      bool finished = done.load(std::memory_order_acquire);
+      std::size_t n = r.pop(buf, 64);
+      for (std::size_t i = 0; i < n; ++i) {
+        if (buf[i] <= last) ordered = false;
+        last = buf[i];
+      }
+      received += n;
+      if (n == 0 && finished) break;
+      for (int spin = 0; spin < 200; ++spin) asm volatile("");
+    }
+  });
+  uint64_t batch[32];
+  for (uint64_t v = 1; v <= kTotal;) {
+    std::size_t n = 0;
+    while (n < 32 && v <= kTotal) batch[n++] = v++;
+    r.push(batch, n);
+  }
+  done.store(true, std::memory_order_release);
+  consumer.join();
+  RingStats st = r.stats();
+  CHECK(ordered);
+  CHECK_EQ(st.pushed, kTotal);
+  CHECK_EQ(st.popped, received);
+  CHECK_EQ(st.popped + st.dropped, kTotal);
+  CHECK(st.high_water <= r.capacity());
+}
+
+namespace {
+
+class CountingCollector final : public Collector {
+ public:
+  const char* name() const override { return "counting"; }
+  int collect(std::vector<Sample>& out) override {
+    if (!ids_[0]) {
+      char v[8];
+      for (uint32_t i = 0; i < 100; ++i) {
+        std::snprintf(v, sizeof v, "%u", i);
+        ids_[i] = registry().intern("counting_total", {{"i", v}});
+      }
+    }
+    ++ticks_;
+    for (uint32_t i = 0; i < 100; ++i) out.push_back(Sample::make_counter(ticks_, ids_[i], ticks_));
+    return 0;
+  }
+
+ private:
+  int64_t ticks_ = 0;
+  uint32_t ids_[100] = {};
+};
+
+}  // namespace
+
+TEST_CASE(pipeline_delivers_collector_and_self_samples) {
+  Pipeline p;
+  p.add(std::make_unique<CountingCollector>());
+  std::atomic<uint64_t> data{0}, self{0}, drains{0}, drained_data{0};
+  PipelineOptions o;
+  o.interval_ns = 10000000;
+  REQUIRE(p.start(
+              o,
+              [&](const Sample* s, std::size_t n) {
+                for (std::size_t i = 0; i < n; ++i)
+                  (p.registry().metric(s[i].series).starts_with("system_apm_self_") ? self : data).fetch_add(1);
+              },
+              [&] {
+                drains.fetch_add(1);
+                drained_data.store(data.load());
+              }) == 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(120));
+  p.stop();
+  CHECK(data.load() >= 500);
+  CHECK(drains.load() >= 5);
+  CHECK_EQ(drained_data.load(), data.load());  // the final drain ends with the hook too
+  CHECK_EQ(data.load() % 100, 0u);
+  CHECK(self.load() >= kSelfLaneMetricCount);
+  CHECK_EQ(p.ring_stats(0).dropped, 0u);
+  char name[128];
+  const uint32_t hw = p.registry().find("system_apm_self_ring_high_water", {{"collector", "counting"}});
+  CHECK(hw != 0);
+  CHECK(p.describe(hw, name, sizeof name));
+  CHECK(std::string(name) == "system_apm_self_ring_high_water{collector=\"counting\"}");
+}
+
+TEST_CASE(pipeline_stop_does_not_wait_out_the_interval) {
+  Pipeline p;
+  p.add(std::make_unique<CountingCollector>());
+  PipelineOptions o;
+  o.interval_ns = 3600ll * 1000000000;
+  REQUIRE(p.start(o, [](const Sample*, std::size_t) {}) == 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  const auto t0 = std::chrono::steady_clock::now();
+  p.stop();
+  CHECK(std::chrono::steady_clock::now() - t0 < std::chrono::seconds(5));
+  CHECK(p.registry().find("system_apm_self_wake_skew_ns", {{"collector", "counting"}}) != 0);
+}
+
+TEST_CASE(pipeline_runs_collectors_on_a_pool) {
+  ThreadPool pool;
+  REQUIRE(pool.start({2}) == 0);
+  Pipeline p;
+  p.add(std::make_unique<CountingCollector>());
+  p.add(std::make_unique<CountingCollector>());
+  std::atomic<uint64_t> data{0};
+  PipelineOptions o;
+  o.interval_ns = 10000000;
+  o.pool = &pool;
+  REQUIRE(p.start(o, [&](const Sample* s, std::size_t n) {
+            for (std::size_t i = 0; i < n; ++i)
+              if (p.registry().metric(s[i].series) == "counting_total") data.fetch_add(1);
+          }) == 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(120));
+  p.stop();
+  CHECK(data.load() >= 1000);
+  CHECK_EQ(data.load() % 100, 0u);
+  CHECK(pool.stats().tasks >= 10);
+  CHECK(p.registry().find("system_apm_self_pool_steals_total") != 0);
+}
@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "sysapm/clock.hpp"
+#include "sysapm/thread_pool.hpp"
+#include "sysapm/work_deque.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+void burn(int64_t ns) {
+  const int64_t until = clock_ns(CLOCK_THREAD_CPUTIME_ID) + ns;
+  while (clock_ns(CLOCK_THREAD_CPUTIME_ID) < until) {
+  }
+}
+
+}  // namespace
+
+TEST_CASE(deque_owner_is_lifo_thieves_fifo) {
+  WorkDeque<int> d(4);
+  int v[5] = {0, 1, 2, 3, 4};
+  for (int i = 0; i < 4; ++i) REQUIRE(d.push(&v[i]));
+  CHECK(!d.push(&v[4]));  // full
+  CHECK_EQ(d.size(), 4u);
+  CHECK_EQ(d.steal(), &v[0]);
+  CHECK_EQ(d.pop(), &v[3]);
+  CHECK_EQ(d.pop(), &v[2]);
+  CHECK_EQ(d.steal(), &v[1]);
+  CHECK(d.pop() == nullptr);
+  CHECK(d.steal() == nullptr);
+  CHECK(d.push(&v[4]));  // wrapped around
+  CHECK_EQ(d.pop(), &v[4]);
+}
+
+TEST_CASE(deque_hands_out_every_item_once_under_contention) {
+  constexpr int kItems = 200000;
+  std::vector<int> items(kItems);
+  std::vector<std::atomic<int>> seen(kItems);
+  WorkDeque<int> d(256);
+  std::atomic<bool> done{false};
+  std::atomic<int> stolen{0};
+  auto thief = [&] {
+    while (!done.load()) {
+      if (int* p = d.steal()) {
+        seen[p - items.data()].fetch_add(1);
+        stolen.fetch_add(1);
+      }
+    }
+  };
+  std::thread t1(thief), t2(thief);
+  for (int i = 0; i < kItems; ++i) {
+    while (!d.push(&items[i]))
+      if (int* p = d.pop()) seen[p - items.data()].fetch_add(1);
+    if (i % 3 == 0)
+      if (int* p = d.pop()) seen[p - items.data()].fetch_add(1);
+  }
+  while (int* p = d.pop()) seen[p - items.data()].fetch_add(1);
+  done = true;
+  t1.join();
+  t2.join();
+  CHECK(std::all_of(seen.begin(), seen.end(), [](const std::atomic<int>& s) { return s.load() == 1; }));
+}
+
+TEST_CASE(parallel_for_covers_range) {
+  ThreadPool pool;
+  REQUIRE(pool.start({2}) == 0);
+  std::vector<std::atomic<int>> hits(1000);
+  pool.parallel_for(hits.size(), 7, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) hits[i].fetch_add(1);
+  });
+  CHECK(std::all_of(hits.begin(), hits.end(), [](const std::atomic<int>& h) { return h.load() == 1; }));
+  ThreadPool none;  // never started: inline
+  int ran = 0;
+  none.parallel_for(10, 3, [&](std::size_t b, std::size_t e) { ran += static_cast<int>(e - b); });
+  CHECK_EQ(ran, 10);
+  CHECK_EQ(none.stats().inlined, 0u);  // the caller ran every chunk itself
+}
+
+TEST_CASE(tasks_spawned_by_workers_are_stolen) {
+  ThreadPool pool;
+  REQUIRE(pool.start({3}) == 0);
+  std::atomic<int> ran{0};
+  // One root task fans out onto its own deque; the idle workers have to
+  // steal to help.
+  pool.submit([&] {
+    for (int i = 0; i < 300; ++i)
+      pool.submit([&] {
+        burn(100000);
+        ran.fetch_add(1);
+      });
+  });
+  const auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+  while (ran.load() < 300 && std::chrono::steady_clock::now() < give_up)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  CHECK_EQ(ran.load(), 300);
+  const ThreadPoolStats st = pool.stats();
+  CHECK_EQ(st.injected, 1u);
+  CHECK_EQ(st.tasks, 301u);
+  CHECK(st.steals > 0);
+  CHECK_EQ(st.queued, 0u);
+}
+
+TEST_CASE(stop_runs_queued_tasks) {
+  std::atomic<int> ran{0};
+  ThreadPool pool;
+  REQUIRE(pool.start({1}) == 0);
+  for (int i = 0; i < 50; ++i) pool.submit([&] { ran.fetch_add(1); });
+  pool.stop();
+  CHECK_EQ(ran.load(), 50);
+  pool.submit([&] { ran.fetch_add(1); });  // stopped: inline
+  CHECK_EQ(ran.load(), 51);
+}
+
+TEST_CASE(cpu_budget_throttles_workers) {
+  PoolOptions o;
+  o.workers = 1;
+  o.cpu_budget = 0.5;
+  o.budget_window_ns = 20000000;  // 10 ms of CPU saved up at most
+  ThreadPool pool;
+  const auto t0 = std::chrono::steady_clock::now();
+  REQUIRE(pool.start(o) == 0);
+  std::atomic<int> ran{0};
+  for (int i = 0; i < 20; ++i)
+    pool.submit([&] {
+      burn(5000000);
+      ran.fetch_add(1);
+    });
+  while (ran.load() < 20) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  const auto took = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+  // The budget refills by wall time, so on a busy host the worker may
+  // never wait; what holds regardless is the CPU it got: half a core over
+  // the run, plus the 10 ms burst and the one 5 ms task that may start on
+  // an empty budget (and a millisecond of slack for the clocks).
+  const ThreadPoolStats st = pool.stats();
+  CHECK(st.cpu_ns >= 100000000);
+  CHECK(static_cast<double>(st.cpu_ns) <= 0.5 * took + 16e6);
+}
+
+namespace {
+
+// Two nodes on CPU 0, so the test runs on any machine.
+PoolOptions two_nodes() {
+  PoolOptions o;
+  o.workers = 2;
+  o.nodes = {{0, {0}}, {1, {0}}};
+  return o;
+}
+
+void wait_for(const std::atomic<bool>& flag) {
+  const auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+  while (!flag.load() && std::chrono::steady_clock::now() < give_up)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+// Keeps a worker of `node` busy until `release`. A worker still looking
+// for work at start-up may take the task for its own node: try again.
+void occupy(ThreadPool& pool, int node, const std::atomic<bool>& release) {
+  for (;;) {
+    std::atomic<int> where{-2};
+    pool.submit([&pool, &where, &release, node] {
+      const int at = pool.current_node();
+      where.store(at);
+      if (at == node)
+        while (!release.load()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }, node);
+    while (where.load() == -2) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    if (where.load() == node) return;
+  }
+}
+
+}  // namespace
+
+TEST_CASE(node_bound_tasks_run_on_their_node) {
+  ThreadPool pool;
+  REQUIRE(pool.start(two_nodes()) == 0);
+  CHECK_EQ(pool.current_node(), -1);
+  // Node 1's only worker is busy, so node 0's work cannot go astray.
+  std::atomic<bool> release{false};
+  occupy(pool, 1, release);
+  const uint64_t remote = pool.stats().remote;
+  std::atomic<int> on_zero{0}, ran{0};
+  for (int i = 0; i < 20; ++i)
+    pool.submit([&] {
+      if (pool.current_node() == 0) on_zero.fetch_add(1);
+      ran.fetch_add(1);
+    }, 0);
+  while (ran.load() < 20) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  CHECK_EQ(on_zero.load(), 20);
+  release.store(true);
+  pool.stop();
+  CHECK_EQ(pool.stats().remote, remote);
+}
+
+TEST_CASE(idle_node_takes_another_nodes_work) {
+  ThreadPool pool;
+  REQUIRE(pool.start(two_nodes()) == 0);
+  std::atomic<bool> release{false}, done{false};
+  occupy(pool, 0, release);
+  const uint64_t remote = pool.stats().remote;
+  int node = -1;
+  pool.submit([&] {
+    node = pool.current_node();
+    done.store(true);
+  }, 0);
+  wait_for(done);
+  CHECK_EQ(node, 1);
+  CHECK_EQ(pool.stats().remote, remote + 1);
+  release.store(true);
+  pool.stop();
+  // Unknown nodes and stopped pools fall back to submit().
+  pool.submit([&] { node = 7; }, 3);
+  CHECK_EQ(node, 7);
+}
+TEST_CASE(parallel_for_covers_node_ranges) {
+  ThreadPool pool;
+  REQUIRE(pool.start(two_nodes()) == 0);
+  std::vector<std::atomic<int>> hits(1000);
+  const std::vector<ThreadPool::NodeRange> ranges = {{0, 400, 0}, {400, 400, 1}, {400, 900, 1}, {900, 1000, 5}};
+  pool.parallel_for(ranges, 7, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) hits[i].fetch_add(1);
+  });
+  CHECK(std::all_of(hits.begin(), hits.end(), [](const std::atomic<int>& h) { return h.load() == 1; }));
+  ThreadPool none;
+  int ran = 0;
+  none.parallel_for(ranges, 3, [&](std::size_t b, std::size_t e) { ran += static_cast<int>(e - b); });
+  CHECK_EQ(ran, 1000);
+}
@@ -0,0 +1,108 @@
+#include <cerrno>
+#include <ctime>
+#include <sched.h>
+#include <thread>
+#include <vector>
+
+#include "sysapm/clock.hpp"
+#include "sysapm/tick_scheduler.hpp"
+#include "test_main.hpp"
+
+using namespace sysapm;
+
+namespace {
+
+void sleep_ms(int ms) {
+  timespec ts{0, ms * 1000000L};
+  nanosleep(&ts, nullptr);
+}
+
+}  // namespace
+
+TEST_CASE(ticks_land_on_wall_clock_boundaries) {
+  constexpr int64_t kInterval = 20000000;
+  TickScheduler s;
+  REQUIRE(s.open(kInterval) == 0);
+  int64_t prev = 0;
+  for (int i = 0; i < 5; ++i) {
+    Tick t;
+    REQUIRE(s.wait(&t) == 1);
+    CHECK_EQ(t.deadline_ns % kInterval, 0);
+    CHECK(t.skew_ns >= 0);
+    CHECK(realtime_ns() >= t.deadline_ns);
+    if (prev) CHECK_EQ(t.deadline_ns - prev, kInterval);
+    prev = t.deadline_ns;
+  }
+  CHECK_EQ(s.skipped_total(), 0u);
+}
+
+TEST_CASE(overrun_skips_instead_of_bunching) {
+  constexpr int64_t kInterval = 10000000;
+  TickScheduler s;
+  REQUIRE(s.open(kInterval) == 0);
+  Tick first, next;
+  REQUIRE(s.wait(&first) == 1);
+  sleep_ms(35);  // misses three deadlines
+  REQUIRE(s.wait(&next) == 1);
+  CHECK(next.skipped >= 3 && next.skipped <= 4);
+  CHECK_EQ(next.deadline_ns, first.deadline_ns + static_cast<int64_t>(next.skipped + 1) * kInterval);
+  CHECK_EQ(s.skipped_total(), next.skipped);
+  // The schedule resumed: the next tick is one interval later, not immediate.
+  Tick after;
+  REQUIRE(s.wait(&after) == 1);
+  CHECK_EQ(after.skipped, 0u);
+  CHECK_EQ(after.deadline_ns - next.deadline_ns, kInterval);
+}
+
+TEST_CASE(wake_interrupts_a_long_wait) {
+  TickScheduler s;
+  REQUIRE(s.open(60ll * 1000000000) == 0);
+  std::thread waker([&] {
+    sleep_ms(20);
+    s.wake();
+  });
+  Tick t;
+  const int64_t t0 = realtime_ns();
+  CHECK_EQ(s.wait(&t), 0);
+  CHECK(realtime_ns() - t0 < 5ll * 1000000000);
+  waker.join();
+  // A wake before the wait is not lost either.
+  s.wake();
+  CHECK_EQ(s.wait(&t), 0);
+}
+
+TEST_CASE(parses_cpu_lists) {
+  std::vector<int> cpus;
+  REQUIRE(parse_cpu_list("0-3,8,10-11\n", &cpus) == 0);
+  CHECK((cpus == std::vector<int>{0, 1, 2, 3, 8, 10, 11}));
+  REQUIRE(parse_cpu_list("5,1-2,2", &cpus) == 0);
+  CHECK((cpus == std::vector<int>{1, 2, 5}));
+  CHECK_EQ(parse_cpu_list("", &cpus), -EINVAL);
+  CHECK_EQ(parse_cpu_list("3-1", &cpus), -EINVAL);
+  CHECK_EQ(parse_cpu_list("x", &cpus), -EINVAL);
+}
+
+TEST_CASE(thread_policy_pins_and_idles) {
+  cpu_set_t allowed;
+  REQUIRE(sched_getaffinity(0, sizeof allowed, &allowed) == 0);
+  int cpu = 0;
+  while (cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &allowed)) ++cpu;
+  REQUIRE(cpu < CPU_SETSIZE);
+  int rc = 1, policy = -1, count = 0;
+  std::thread t([&] {
+    ThreadPolicy p;
+    p.cpus = {cpu};
+    p.idle = true;
+    rc = apply_thread_policy(p);
+    cpu_set_t now;
+    sched_getaffinity(0, sizeof now, &now);
+    count = CPU_COUNT(&now);
+    policy = sched_getscheduler(0);
+  });
+  t.join();
+  CHECK_EQ(rc, 0);
+  CHECK_EQ(count, 1);
+  CHECK_EQ(policy, SCHED_IDLE);
+  // Only that thread changed.
+  CHECK(sched_getscheduler(0) != SCHED_IDLE);
+}